@@ -1,9 +1,11 @@
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/IR/Module.h"
-#include "llvm/IRReader/IRReader.h"
 #include "llvm/Linker/Linker.h"
+#include "llvm/Object/Archive.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/CommandLine.h"
-#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include <map>
@@ -16,80 +18,126 @@ using namespace llvm;
 #include "blas_headers.h"
 #undef DATA
 
-bool provideDefinitions(Module &M) {
-  std::vector<StringRef> todo;
-  bool seen32 = false;
-  bool seen64 = false;
-  bool seenGemm = false;
-  for (auto &F : M) {
-    if (!F.empty())
-      continue;
-    int index = 0;
-    for (auto postfix : {"", "_", "_64_"}) {
-      std::string str;
-      if (strlen(postfix) == 0)
-        str = F.getName().str();
-      else if (F.getName().endswith(postfix)) {
-        str = "cblas_" +
-              F.getName().substr(0, F.getName().size() - strlen(postfix)).str();
+static cl::opt<std::string>
+    BCLoaderArchive("bcloader-archive", cl::init(""), cl::Hidden,
+                    cl::desc("Bitcode archive to provide BLAS definitions "
+                             "from instead of the embedded one"));
+
+namespace {
+/// The BLAS bitcode archive and its symbol index. This is parsed once per
+/// process; member modules are only read, lazily, in the context of the
+/// module requesting one of their functions.
+class BlasArchive {
+  std::unique_ptr<MemoryBuffer> File;
+  std::unique_ptr<object::Archive> Archive;
+  StringMap<MemoryBufferRef> Members;
+
+public:
+  BlasArchive() {
+    MemoryBufferRef Buf(StringRef(EnzymeBlasBC, sizeof(EnzymeBlasBC)),
+                        "bcloader");
+    if (BCLoaderArchive.size()) {
+      // Memory-mapped by MemoryBuffer for anything but tiny files.
+      auto FileOrErr = MemoryBuffer::getFile(BCLoaderArchive);
+      if (!FileOrErr) {
+        llvm::errs() << "bcloader: could not open " << BCLoaderArchive << ": "
+                     << FileOrErr.getError().message() << "\n";
+        return;
       }
+      File = std::move(*FileOrErr);
+      Buf = File->getMemBufferRef();
+    }
 
-      auto found = EnzymeBlasBC.find(str);
-      if (found != EnzymeBlasBC.end()) {
-        todo.push_back(found->second);
-        if (index == 1)
-          seen32 = true;
-        if (index == 2)
-          seen64 = true;
-        if (StringRef(str).endswith("gemm"))
-          seenGemm = true;
-        break;
+    auto ArchiveOrErr = object::Archive::create(Buf);
+    if (!ArchiveOrErr) {
+      logAllUnhandledErrors(ArchiveOrErr.takeError(), llvm::errs(),
+                            "bcloader: ");
+      return;
+    }
+    Archive = std::move(*ArchiveOrErr);
+
+    for (auto &Sym : Archive->symbols()) {
+      auto Member = Sym.getMember();
+      if (!Member) {
+        consumeError(Member.takeError());
+        continue;
       }
-      index++;
+      auto MemberBuf = Member->getMemoryBufferRef();
+      if (!MemberBuf) {
+        consumeError(MemberBuf.takeError());
+        continue;
+      }
+      Members.try_emplace(Sym.getName(), *MemberBuf);
     }
   }
 
-  // Push fortran wrapper libs before all the other blas
-  // to ensure the fortran injections have their code
-  // replaced
-  if (seen32)
-    todo.insert(todo.begin(), __data_fblas32);
-  if (seen64)
-    todo.insert(todo.begin(), __data_fblas64);
-  if (seenGemm) {
-    todo.push_back(__data_xerbla);
+  /// Return the archive member defining the symbol Name, if any.
+  Optional<MemoryBufferRef> lookup(StringRef Name) const {
+    auto found = Members.find(Name);
+    if (found == Members.end())
+      return {};
+    return found->second;
   }
+};
+} // namespace
+
+static const BlasArchive &getBlasArchive() {
+  static BlasArchive Archive;
+  return Archive;
+}
+
+bool provideDefinitions(Module &M) {
+  const BlasArchive &Archive = getBlasArchive();
+
+  std::set<Function *> definedBefore;
+  for (auto &F : M)
+    if (!F.isDeclaration())
+      definedBefore.insert(&F);
+
+  // Each round links, for every unresolved declaration the archive defines,
+  // just that function and what it transitively references from the same
+  // member. References into other members (e.g. fortran wrappers calling
+  // cblas routines, or gemm calling xerbla) appear as new declarations and
+  // are resolved by the next round.
+  std::set<std::string> attempted;
   bool changed = false;
-  for (auto mod : todo) {
-    SMDiagnostic Err;
-    MemoryBufferRef buf(mod, StringRef("bcloader"));
-
-#if LLVM_VERSION_MAJOR <= 10
-    auto BC = llvm::parseIR(buf, Err, M.getContext(), true,
-                            M.getDataLayout().getStringRepresentation());
-#else
-    auto BC = llvm::parseIR(buf, Err, M.getContext(), [&](StringRef) {
-      return Optional<std::string>(M.getDataLayout().getStringRepresentation());
-    });
-#endif
-    if (!BC)
-      Err.print("bcloader", llvm::errs());
-    assert(BC);
-    SmallVector<std::string, 1> toReplace;
-    for (auto &F : *BC) {
-      if (F.empty())
+  while (true) {
+    std::map<const char *, MemoryBufferRef> todo;
+    for (auto &F : M) {
+      if (!F.isDeclaration() || F.isIntrinsic())
         continue;
-      toReplace.push_back(F.getName().str());
+      if (!attempted.insert(F.getName().str()).second)
+        continue;
+      if (auto found = Archive.lookup(F.getName()))
+        todo.emplace(found->getBufferStart(), *found);
     }
-    Linker L(M);
-    L.linkInModule(std::move(BC));
-    for (auto name : toReplace) {
-      if (auto F = M.getFunction(name)) {
-        F->setLinkage(Function::LinkageTypes::InternalLinkage);
-        F->addFnAttr(Attribute::AlwaysInline);
+    if (todo.empty())
+      break;
+
+    for (auto &pair : todo) {
+      auto BC = getLazyBitcodeModule(pair.second, M.getContext());
+      if (!BC) {
+        logAllUnhandledErrors(BC.takeError(), llvm::errs(), "bcloader: ");
+        continue;
+      }
+      (*BC)->setDataLayout(M.getDataLayout());
+      Linker L(M);
+      if (L.linkInModule(std::move(*BC), Linker::Flags::LinkOnlyNeeded)) {
+        llvm::errs() << "bcloader: could not link "
+                     << pair.second.getBufferIdentifier() << "\n";
+        continue;
       }
+      changed = true;
     }
-    changed = true;
+  }
+
+  // Only internalize once all rounds are done, so that later rounds can still
+  // resolve references against definitions linked by earlier ones.
+  for (auto &F : M) {
+    if (F.isDeclaration() || definedBefore.count(&F))
+      continue;
+    F.setLinkage(Function::LinkageTypes::InternalLinkage);
+    F.addFnAttr(Attribute::AlwaysInline);
   }
   return changed;
 }
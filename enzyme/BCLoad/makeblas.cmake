@@ -1,46 +1,39 @@
 cmake_minimum_required(VERSION 3.9)
 project(BLASHeader)
 
+# Assemble every BLAS routine and the fortran wrappers into its own bitcode
+# member of a single archive. llvm-ar writes a symbol index for bitcode
+# members, which lets BCLoader find the member defining a routine without
+# parsing any IR.
 file(GLOB BLAS_LL "${CMAKE_CURRENT_SOURCE_DIR}/src/gsl/*.ll")
-set (NEED_COMMA FALSE)
 list(FILTER BLAS_LL EXCLUDE REGEX ".*test.*")
+list(APPEND BLAS_LL "${CMAKE_CURRENT_SOURCE_DIR}/../fblas/src/fblas/bclib32.ll")
+list(APPEND BLAS_LL "${CMAKE_CURRENT_SOURCE_DIR}/../fblas/src/fblas/bclib64.ll")
 
-file(WRITE ${CMAKE_CURRENT_SOURCE_DIR}/blas_headers.h "")
-foreach(file ${BLAS_LL})
-    get_filename_component(variableName ${file} NAME_WE)
-
-    file(READ ${file} hexString HEX)
-
-    set(hexString "${hexString}00")
-
-    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," arrayValues ${hexString})
-    string(REGEX REPLACE ",$" "" arrayValues ${arrayValues})
+set(BLAS_BC_DIR "${CMAKE_CURRENT_SOURCE_DIR}/bc")
+set(BLAS_ARCHIVE "${CMAKE_CURRENT_SOURCE_DIR}/libenzymeblas.a")
+file(MAKE_DIRECTORY ${BLAS_BC_DIR})
+file(REMOVE ${BLAS_ARCHIVE})
 
-    file(APPEND ${CMAKE_CURRENT_SOURCE_DIR}/blas_headers.h "const char __data_${variableName}[] = {${arrayValues}};\n")
-endforeach()
-
-file(APPEND ${CMAKE_CURRENT_SOURCE_DIR}/blas_headers.h "std::map<std::string, const char*> DATA = {\n")
+set(BLAS_BC "")
 foreach(file ${BLAS_LL})
     get_filename_component(variableName ${file} NAME_WE)
-    # declares byte array and the length variables
-    if (${NEED_COMMA})
-        file(APPEND ${CMAKE_CURRENT_SOURCE_DIR}/blas_headers.h ",\n")
+    set(bcfile "${BLAS_BC_DIR}/${variableName}.bc")
+    execute_process(COMMAND ${LLVM_AS} ${file} -o ${bcfile}
+                    RESULT_VARIABLE result)
+    if (NOT ${result} EQUAL 0)
+        message(FATAL_ERROR "could not assemble ${file}")
     endif()
-    set(arrayDefinition "{ \"cblas_${variableName}\",  __data_${variableName} }")
-    file(APPEND ${CMAKE_CURRENT_SOURCE_DIR}/blas_headers.h "${arrayDefinition}")
-    set (NEED_COMMA TRUE)
+    list(APPEND BLAS_BC ${bcfile})
 endforeach()
-file(APPEND ${CMAKE_CURRENT_BINARY_DIR}/blas_headers.h "\n};\n")
 
-file(READ "${CMAKE_CURRENT_SOURCE_DIR}/../fblas/src/fblas/bclib32.ll" hexString HEX)
-set(hexString "${hexString}00")
-string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," arrayValues ${hexString})
-string(REGEX REPLACE ",$" "" arrayValues ${arrayValues})
-file(APPEND ${CMAKE_CURRENT_SOURCE_DIR}/blas_headers.h "const char __data_fblas32[] = {${arrayValues}};\n")
+execute_process(COMMAND ${LLVM_AR} rcs ${BLAS_ARCHIVE} ${BLAS_BC}
+                RESULT_VARIABLE result)
+if (NOT ${result} EQUAL 0)
+    message(FATAL_ERROR "could not create ${BLAS_ARCHIVE}")
+endif()
 
-file(READ "${CMAKE_CURRENT_SOURCE_DIR}/../fblas/src/fblas/bclib64.ll" hexString HEX)
-set(hexString "${hexString}00")
+file(READ ${BLAS_ARCHIVE} hexString HEX)
 string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," arrayValues ${hexString})
 string(REGEX REPLACE ",$" "" arrayValues ${arrayValues})
-file(APPEND ${CMAKE_CURRENT_SOURCE_DIR}/blas_headers.h "const char __data_fblas64[] = {${arrayValues}};\n")
-
+file(WRITE ${CMAKE_CURRENT_SOURCE_DIR}/blas_headers.h "const char DATA[] = {${arrayValues}};\n")
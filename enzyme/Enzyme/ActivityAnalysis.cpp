@@ -51,8 +51,10 @@
 #include "llvm/Demangle/Demangle.h"
 #endif
 
+#include "FunctionSummary.h"
 #include "FunctionUtils.h"
 #include "LibraryFuncs.h"
+#include "PhaseTimer.h"
 #include "TypeAnalysis/TBAA.h"
 
 #include "llvm/Analysis/ValueTracking.h"
@@ -335,6 +337,29 @@ bool ActivityAnalyzer::isFunctionArgumentConstant(CallInst *CI, Value *val) {
     return true;
   }
 
+  // The summary of the callee may show that every argument val is passed
+  // as carries no differentiable data
+  if (auto Summary = getFunctionSummary(F)) {
+    bool inactive = false;
+#if LLVM_VERSION_MAJOR >= 14
+    size_t numArgs = CI->arg_size();
+#else
+    size_t numArgs = CI->getNumArgOperands();
+#endif
+    for (size_t i = 0, e = Summary->InactiveArgs.size(); i < e && i < numArgs;
+         i++) {
+      if (CI->getArgOperand(i) != val)
+        continue;
+      if (!Summary->InactiveArgs[i]) {
+        inactive = false;
+        break;
+      }
+      inactive = true;
+    }
+    if (inactive)
+      return true;
+  }
+
   auto Name = F->getName();
 
   // Allocations, deallocations, and c++ guards don't impact the activity
@@ -456,7 +481,8 @@ bool ActivityAnalyzer::isFunctionArgumentConstant(CallInst *CI, Value *val) {
     return val != CI->getOperand(0);
   }
   // only the recv buffer and request is active for mpi isend/irecv
-  if (Name == "MPI_Irecv" || Name == "MPI_Isend") {
+  if (Name == "MPI_Irecv" || Name == "MPI_Isend" || Name == "MPI_Recv_init" ||
+      Name == "MPI_Send_init") {
     return val != CI->getOperand(0) && val != CI->getOperand(6);
   }
 
@@ -467,6 +493,19 @@ bool ActivityAnalyzer::isFunctionArgumentConstant(CallInst *CI, Value *val) {
   if (Name == "MPI_Waitall" || Name == "PMPI_Waitall")
     return val != CI->getOperand(1);
 
+  if (Name == "MPI_Start" || Name == "MPI_Request_free")
+    return val != CI->getOperand(0);
+
+  if (Name == "MPI_Startall")
+    return val != CI->getOperand(1);
+
+  // only the argument handed to the routine of a thread is active
+  if (Name == "pthread_create")
+    return val != CI->getOperand(3);
+
+  if (Name == "pthread_join")
+    return true;
+
   // TODO interprocedural detection
   // Before potential introprocedural detection, any function without definition
   // may to be assumed to have an active use
@@ -587,11 +626,26 @@ static inline void propagateArgumentInformation(
   }
 }
 
+namespace {
+/// Time only the outermost activity query. Queries recurse heavily, so
+/// timing every nested call would distort the time being measured.
+class ActivityQueryTimer {
+  static unsigned Depth;
+  PhaseTimer Timer;
+
+public:
+  ActivityQueryTimer() : Timer(EnzymePhase::ActivityAnalysis, Depth++ == 0) {}
+  ~ActivityQueryTimer() { --Depth; }
+};
+unsigned ActivityQueryTimer::Depth = 0;
+} // namespace
+
 /// Return whether this instruction is known not to propagate adjoints
 /// Note that instructions could return an active pointer, but
 /// do not propagate adjoints themselves
 bool ActivityAnalyzer::isConstantInstruction(TypeResults const &TR,
                                              Instruction *I) {
+  ActivityQueryTimer timer;
   // This analysis may only be called by instructions corresponding to
   // the function analyzed by TypeInfo
   assert(I);
@@ -918,6 +972,7 @@ bool isValuePotentiallyUsedAsPointer(llvm::Value *val) {
 }
 
 bool ActivityAnalyzer::isConstantValue(TypeResults const &TR, Value *Val) {
+  ActivityQueryTimer timer;
   // This analysis may only be called by instructions corresponding to
   // the function analyzed by TypeInfo -- however if the Value
   // was created outside a function (e.g. global, constant), that is allowed
@@ -38,6 +38,8 @@
 #include "FunctionUtils.h"
 #include "GradientUtils.h"
 #include "LibraryFuncs.h"
+#include "OpenMPFusion.h"
+#include "OpenMPShadow.h"
 #include "TypeAnalysis/TBAA.h"
 
 #define DEBUG_TYPE "enzyme"
@@ -68,6 +70,22 @@ private:
   const SmallPtrSetImpl<BasicBlock *> &oldUnreachable;
   AllocaInst *dretAlloca;
 
+  // The last reverse OpenMP region forked, and the last instruction emitted
+  // to finish it, which the next reverse region may be fused with
+  WeakVH lastReverseFork;
+  WeakVH lastReverseForkEnd;
+
+  // Adjoint collectives issued non-blocking whose wait, and the remainder of
+  // whose adjoint, is deferred until the reverse pass may touch the primal
+  // buffers they communicate, by the original block in whose reverse they
+  // are in flight
+  struct PendingMPICollective {
+    SmallVector<Value *, 2> buffers;
+    std::function<void(IRBuilder<> &)> finish;
+  };
+  std::map<BasicBlock *, SmallVector<PendingMPICollective, 1>>
+      pendingMPICollectives;
+
 public:
   AdjointGenerator(
       DerivativeMode Mode, GradientUtils *gutils,
@@ -314,6 +332,171 @@ public:
 #endif
   }
 
+  /// Only reductions by MPI_SUM are differentiable
+  void checkMPISumOp(CallInst &call, Value *orig_op) {
+    bool isSum = false;
+    if (Constant *C = dyn_cast<Constant>(orig_op)) {
+      while (ConstantExpr *CE = dyn_cast<ConstantExpr>(C)) {
+        C = CE->getOperand(0);
+      }
+      if (auto GV = dyn_cast<GlobalVariable>(C)) {
+        if (GV->getName() == "ompi_mpi_op_sum") {
+          isSum = true;
+        }
+      }
+      // MPICH
+      if (ConstantInt *CI = dyn_cast<ConstantInt>(C)) {
+        if (CI->getValue() == 1476395011) {
+          isSum = true;
+        }
+      }
+    }
+    if (!isSum) {
+      std::string s;
+      llvm::raw_string_ostream ss(s);
+      ss << *gutils->oldFunc << "\n";
+      ss << *gutils->newFunc << "\n";
+      ss << " call: " << call << "\n";
+      ss << " unhandled mpi_allreduce op: " << *orig_op << "\n";
+      if (CustomErrorHandler) {
+        CustomErrorHandler(ss.str().c_str(), wrap(&call),
+                           ErrorType::NoDerivative, nullptr);
+      }
+      llvm::errs() << ss.str() << "\n";
+      report_fatal_error("unhandled mpi_allreduce op");
+    }
+  }
+
+  /// The type of MPI_Status, taken from the declaration of MPI_Wait
+  Type *MPI_STATUS_TYPE(Module &M) {
+    Type *statusType = nullptr;
+    for (auto name : {"PMPI_Wait", "MPI_Wait"})
+      if (Function *waitfn = M.getFunction(name)) {
+        auto statusArg = waitfn->arg_end();
+        statusArg--;
+        if (auto PT = dyn_cast<PointerType>(statusArg->getType()))
+          statusType = PT->getPointerElementType();
+      }
+    if (statusType == nullptr) {
+      statusType = ArrayType::get(Type::getInt8Ty(M.getContext()), 24);
+      llvm::errs() << " warning could not automatically determine mpi "
+                      "status type, assuming [24 x i8]\n";
+    }
+    return statusType;
+  }
+
+  /// The type of MPI_Request, taken from the declaration of MPI_Wait if
+  /// present. Otherwise requests are integers if communicators are (MPICH),
+  /// and opaque pointers if not (Open MPI).
+  Type *MPI_REQUEST_TYPE(Module &M, Value *comm) {
+    for (auto name : {"PMPI_Wait", "MPI_Wait"})
+      if (Function *waitfn = M.getFunction(name))
+        if (auto PT =
+                dyn_cast<PointerType>(waitfn->arg_begin()->getType()))
+          return PT->getPointerElementType();
+    if (comm->getType()->isIntegerTy())
+      return comm->getType();
+    return Type::getInt8PtrTy(M.getContext());
+  }
+
+  /// Wait for the request stored at `req` to complete
+  void MPI_WAIT(Value *req, IRBuilder<> &B, Type *intType) {
+    Module &M = *B.GetInsertBlock()->getParent()->getParent();
+    Value *args[] = {req, IRBuilder<>(gutils->inversionAllocs)
+                              .CreateAlloca(MPI_STATUS_TYPE(M))};
+    Type *types[] = {args[0]->getType(), args[1]->getType()};
+    auto FT = FunctionType::get(intType, types, false);
+    B.CreateCall(M.getOrInsertFunction("MPI_Wait", FT), args);
+  }
+
+  /// Call the adjoint collective `name`, then `finish` its adjoint. With
+  /// -enzyme-nonblocking-mpi the non-blocking variant is issued instead, and
+  /// the wait and `finish` are deferred until the reverse pass may next
+  /// touch one of the primal `buffers` of the original call.
+  void createMPIAdjointCollective(CallInst &call, IRBuilder<> &Builder2,
+                                  StringRef name, ArrayRef<Value *> args,
+                                  ArrayRef<OperandBundleDef> Defs,
+                                  ArrayRef<Value *> buffers,
+                                  std::function<void(IRBuilder<> &)> finish) {
+    Module &M = *gutils->newFunc->getParent();
+    SmallVector<Value *, 9> nargs(args.begin(), args.end());
+    std::string fname = name.str();
+    Value *req = nullptr;
+    if (EnzymeNonBlockingMPI) {
+      // The communicator is the last argument of every collective
+      fname = "MPI_I" + name.substr(4).lower();
+      req = IRBuilder<>(gutils->inversionAllocs)
+                .CreateAlloca(MPI_REQUEST_TYPE(M, args.back()));
+      nargs.push_back(req);
+    }
+    SmallVector<Type *, 9> types;
+    for (auto arg : nargs)
+      types.push_back(arg->getType());
+    FunctionType *FT = FunctionType::get(call.getType(), types, false);
+    Builder2.CreateCall(M.getOrInsertFunction(fname, FT), nargs, Defs);
+
+    if (!req) {
+      finish(Builder2);
+      return;
+    }
+    Type *intType = call.getType();
+    pendingMPICollectives[call.getParent()].push_back(
+        {SmallVector<Value *, 2>(buffers.begin(), buffers.end()),
+         [=](IRBuilder<> &Builder2) {
+           MPI_WAIT(req, Builder2, intType);
+           finish(Builder2);
+         }});
+  }
+
+  /// Finish, in the reverse of `BB`, the adjoint collectives in flight whose
+  /// buffers the reverse of `next` may touch, or all of them once the
+  /// reverse of `BB` is complete (`next` is null).
+  void finishMPIAdjointCollectives(BasicBlock *BB, Instruction *next) {
+    auto found = pendingMPICollectives.find(BB);
+    if (found == pendingMPICollectives.end())
+      return;
+    auto &pending = found->second;
+    for (auto it = pending.begin(); it != pending.end();) {
+      if (next && llvm::none_of(it->buffers, [&](Value *buf) {
+            return isModOrRefSet(gutils->OrigAA.getModRefInfo(
+                next,
+#if LLVM_VERSION_MAJOR >= 12
+                MemoryLocation(buf, LocationSize::beforeOrAfterPointer())
+#elif LLVM_VERSION_MAJOR >= 9
+                MemoryLocation(buf, LocationSize::unknown())
+#else
+                MemoryLocation(buf, MemoryLocation::UnknownSize)
+#endif
+                    ));
+          })) {
+        ++it;
+        continue;
+      }
+      IRBuilder<> Builder2(BB);
+      getReverseBuilder(Builder2);
+      it->finish(Builder2);
+      it = pending.erase(it);
+    }
+    if (pending.empty())
+      pendingMPICollectives.erase(found);
+  }
+
+  /// Carry the adjoint collectives still in flight at the end of the reverse
+  /// of `BB` into the reverse of each of `preds`, which is entered from the
+  /// reverse of `BB` alone.
+  void carryMPIAdjointCollectives(BasicBlock *BB,
+                                  ArrayRef<BasicBlock *> preds) {
+    auto found = pendingMPICollectives.find(BB);
+    if (found == pendingMPICollectives.end())
+      return;
+    auto pending = std::move(found->second);
+    pendingMPICollectives.erase(found);
+    for (auto pred : preds) {
+      auto &carried = pendingMPICollectives[pred];
+      carried.append(pending.begin(), pending.end());
+    }
+  }
+
 #if LLVM_VERSION_MAJOR >= 10
   void visitFreezeInst(llvm::FreezeInst &inst) {
     eraseIfUnused(inst);
@@ -4858,6 +5041,8 @@ public:
 
     SmallVector<Value *, 4> OutTypes;
     SmallVector<Type *, 4> OutFPTypes;
+    // Argument numbers of the shadows in the reverse outlined body
+    SmallVector<unsigned, 4> ShadowArgNos;
 
 #if LLVM_VERSION_MAJOR >= 14
     for (unsigned i = 3; i < call.arg_size(); ++i)
@@ -4892,6 +5077,9 @@ public:
           args.push_back(
               lookup(gutils->invertPointerM(call.getArgOperand(i), Builder2),
                      Builder2));
+          // The outlined body takes two thread ids in place of the three
+          // leading arguments of the fork call.
+          ShadowArgNos.push_back(args.size() - 2);
         }
         pre_args.push_back(
             gutils->invertPointerM(call.getArgOperand(i), BuilderZ));
@@ -5149,6 +5337,17 @@ public:
       IRBuilder<> Builder2(call.getParent());
       getReverseBuilder(Builder2);
 
+      // The reverse of the region forked directly after this one, if nothing
+      // has been emitted since it, can share a team of threads with this one
+      CallInst *fusable = nullptr;
+      Instruction *fusableEnd = nullptr;
+      if (EnzymeOMPFuseReverse && lastReverseFork &&
+          Builder2.GetInsertPoint() != Builder2.GetInsertBlock()->begin() &&
+          &*std::prev(Builder2.GetInsertPoint()) == lastReverseForkEnd) {
+        fusable = cast<CallInst>(lastReverseFork);
+        fusableEnd = cast<Instruction>(lastReverseForkEnd);
+      }
+
       if (Mode == DerivativeMode::ReverseModeGradient) {
         BuilderZ.SetInsertPoint(
             gutils->getNewFromOriginal(&call)->getNextNode());
@@ -5190,8 +5389,11 @@ public:
             TR.analyzer.interprocedural, subdata,
             /*omp*/ true);
 
+        // The tape is left unread if all its values are kept in thread-local
+        // stacks
         if (subdata->returns.find(AugmentedStruct::Tape) !=
-            subdata->returns.end()) {
+                subdata->returns.end() &&
+            !std::prev(newcalled->arg_end())->use_empty()) {
           auto tapeArg = newcalled->arg_end();
           tapeArg--;
           LoadInst *tape = nullptr;
@@ -5263,6 +5465,23 @@ public:
           }
         }
 
+        SmallVector<PrivateShadow, 2> Privatized;
+        SmallVector<Value *, 2> PrivateBufs;
+        if (EnzymeOMPPrivateShadow) {
+          Value *Ident = lookup(
+              gutils->getNewFromOriginal(call.getArgOperand(0)), Builder2);
+          if (auto NF = privatizeOMPShadows(newcalled, ShadowArgNos, Ident,
+                                            gutils->TLI, Privatized)) {
+            newcalled = NF;
+            SmallVector<Value *, 4> RegionArgs(args.begin() + 3, args.end());
+            for (auto &P : Privatized) {
+              Value *&Shadow = args[P.ArgNo + 1];
+              Shadow = allocatePrivateShadow(Builder2, Shadow, P, RegionArgs);
+              PrivateBufs.push_back(Shadow);
+            }
+          }
+        }
+
         Value *OutAlloc = nullptr;
         auto ST = StructType::get(newcalled->getContext(), OutFPTypes);
         if (OutTypes.size()) {
@@ -5394,6 +5613,11 @@ public:
             Builder2.CreateCall(kmpc->getFunctionType(), kmpc, args);
         diffes->setCallingConv(call.getCallingConv());
         diffes->setDebugLoc(gutils->getNewFromOriginal(call.getDebugLoc()));
+        if (fusable)
+          if (auto fused = fuseOMPForks(fusable, fusableEnd, diffes))
+            diffes = fused;
+        for (auto Buf : PrivateBufs)
+          CreateDealloc(Builder2, Buf);
 
         for (size_t i = 0; i < OutTypes.size(); i++) {
 
@@ -5427,12 +5651,345 @@ public:
                                     : Builder2.CreateExtractValue(tape, idx));
           }
         }
+        lastReverseFork = diffes;
+        lastReverseForkEnd = &*std::prev(Builder2.GetInsertPoint());
       } else {
         assert(0 && "openmp indirect unhandled");
       }
     }
   }
 
+  /// The sum reductions of a parallel region are outlined into
+  /// __enzyme_omp_reduce_add during preprocessing, which reduces the private
+  /// copies of all threads into the shared values through the runtime. Its
+  /// adjoint adds the adjoint of each shared value to the private copy of
+  /// every thread, which each thread reads once all are past a barrier and
+  /// needs neither a critical section nor atomics. The adjoint of the shared
+  /// value itself is left in place, as it is also the adjoint of the value
+  /// held before the reduction.
+  void handleOMPReduceAdd(llvm::CallInst &call) {
+    CallInst *const orig = &call;
+    if (gutils->isConstantInstruction(orig)) {
+      if (Mode == DerivativeMode::ReverseModeGradient ||
+          Mode == DerivativeMode::ForwardModeSplit)
+        eraseIfUnused(*orig, /*erase*/ true, /*check*/ false);
+      return;
+    }
+    unsigned numVars = (call.arg_size() - 2) / 2;
+
+    if (Mode == DerivativeMode::ForwardMode ||
+        Mode == DerivativeMode::ForwardModeSplit) {
+      llvm::errs() << *gutils->oldFunc << "\n";
+      llvm::errs() << call << "\n";
+      assert(0 && "forward mode openmp reduction unhandled");
+      llvm_unreachable("forward mode openmp reduction unhandled");
+    }
+
+    if (Mode == DerivativeMode::ReverseModeGradient)
+      eraseIfUnused(*orig, /*erase*/ true, /*check*/ false);
+    if (Mode == DerivativeMode::ReverseModePrimal)
+      return;
+
+    IRBuilder<> Builder2(call.getParent());
+    getReverseBuilder(Builder2);
+    Value *loc =
+        lookup(gutils->getNewFromOriginal(call.getArgOperand(0)), Builder2);
+    Value *gtid =
+        lookup(gutils->getNewFromOriginal(call.getArgOperand(1)), Builder2);
+    Type *VoidTy = Type::getVoidTy(call.getContext());
+    Type *tys[] = {loc->getType(), gtid->getType()};
+    Value *args[] = {loc, gtid};
+    Builder2.CreateCall(gutils->newFunc->getParent()->getOrInsertFunction(
+                            "__kmpc_barrier",
+                            FunctionType::get(VoidTy, tys, false)),
+                        args);
+    for (unsigned i = 0; i < numVars; i++) {
+      Value *priv = call.getArgOperand(2 + 2 * i);
+      Value *shared = call.getArgOperand(3 + 2 * i);
+      if (gutils->isConstantValue(priv) || gutils->isConstantValue(shared))
+        continue;
+      Type *T = shared->getType()->getPointerElementType();
+      auto rule = [&](Value *dpriv, Value *dshared) {
+        dpriv = Builder2.CreatePointerCast(dpriv, shared->getType());
+        Value *dif = Builder2.CreateLoad(T, dshared);
+        Builder2.CreateStore(
+            Builder2.CreateFAdd(Builder2.CreateLoad(T, dpriv), dif), dpriv);
+      };
+      gutils->applyChainRule(
+          Builder2, rule,
+          lookup(gutils->invertPointerM(priv, Builder2), Builder2),
+          lookup(gutils->invertPointerM(shared, Builder2), Builder2));
+    }
+  }
+
+  /// A thread spawned by pthread_create runs the augmented forward routine,
+  /// which leaves its tape in the closure it returns to pthread_join (see
+  /// getPThreadClosure). The adjoint of the join spawns the adjoint routine
+  /// as a thread of its own and the adjoint of the create joins it, so the
+  /// reverse threads run over the same interval as the primal ones. Shadows
+  /// shared between threads are accumulated into atomically.
+  bool handlePThreadCall(llvm::CallInst &call, StringRef funcName) {
+    // Vector mode and split forward mode are not handled yet
+    if (gutils->getWidth() != 1 || Mode == DerivativeMode::ForwardModeSplit)
+      return false;
+
+    LLVMContext &ctx = call.getContext();
+    Module &M = *gutils->newFunc->getParent();
+    Type *i8p = Type::getInt8PtrTy(ctx);
+    Type *i32 = Type::getInt32Ty(ctx);
+    bool create = funcName == "pthread_create";
+
+    Type *threadType =
+        create ? call.getArgOperand(0)->getType()->getPointerElementType()
+               : call.getArgOperand(0)->getType();
+    StructType *CT = getPThreadClosure(ctx, threadType);
+    PointerType *CTp = PointerType::getUnqual(CT);
+    Type *routineArgs[] = {i8p};
+    FunctionType *routineTy = FunctionType::get(i8p, routineArgs, false);
+
+    auto load = [](IRBuilder<> &B, Type *T, Value *ptr) -> Value * {
+#if LLVM_VERSION_MAJOR > 7
+      return B.CreateLoad(T, ptr);
+#else
+      return B.CreateLoad(ptr);
+#endif
+    };
+
+    CallInst *newCall = cast<CallInst>(gutils->getNewFromOriginal(&call));
+    IRBuilder<> BuilderZ(newCall);
+    BuilderZ.setFastMathFlags(getFast());
+
+    Value *closure = nullptr;
+    if (create && Mode != DerivativeMode::ReverseModeGradient) {
+      assert(uncacheable_args_map.find(&call) != uncacheable_args_map.end() ||
+             Mode == DerivativeMode::ForwardMode);
+      const std::map<Argument *, bool> &uncacheable_args =
+          Mode == DerivativeMode::ForwardMode
+              ? std::map<Argument *, bool>()
+              : uncacheable_args_map.find(&call)->second;
+
+      Function *task = dyn_cast<Function>(call.getArgOperand(2));
+      if (task == nullptr && isa<ConstantExpr>(call.getArgOperand(2))) {
+        task = dyn_cast<Function>(
+            cast<ConstantExpr>(call.getArgOperand(2))->getOperand(0));
+      }
+      if (task == nullptr || task->empty() || task->arg_size() > 1) {
+        llvm::errs() << "could not derive underlying routine from thread: "
+                     << call << "\n";
+        llvm_unreachable("could not derive underlying routine from thread");
+      }
+
+      std::vector<DIFFE_TYPE> argsInverted;
+      FnTypeInfo nextTypeInfo(task);
+      if (task->arg_size()) {
+        argsInverted.push_back(
+            gutils->getDiffeType(call.getArgOperand(3), false));
+        nextTypeInfo.Arguments.insert(std::pair<Argument *, TypeTree>(
+            task->arg_begin(), TR.query(call.getArgOperand(3))));
+        nextTypeInfo.KnownValues.insert(
+            std::pair<Argument *, std::set<int64_t>>(
+                task->arg_begin(),
+                TR.knownIntegralValues(call.getArgOperand(3))));
+      }
+      bool shadowArg =
+          argsInverted.size() && argsInverted[0] != DIFFE_TYPE::CONSTANT;
+      // The value the routine returns is handed to the join through the
+      // closure
+      bool returnUsed = task->getReturnType()->isPointerTy();
+
+      // Emit a routine for the thread which unpacks the closure and calls
+      // fn, storing anything fn returns back into the closure by the
+      // returns map of an augmented call.
+      auto createRoutine = [&](Function *fn, const Twine &name,
+                               const std::map<AugmentedStruct, int> &returns,
+                               bool tapeArg) -> Function * {
+        if (auto F = M.getFunction(name.str()))
+          return F;
+        Function *F = Function::Create(
+            routineTy, GlobalVariable::InternalLinkage, name, M);
+        BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+        IRBuilder<> B(entry);
+        Value *cl = B.CreatePointerCast(F->arg_begin(), CTp);
+        SmallVector<Value *, 3> args;
+        if (task->arg_size()) {
+          args.push_back(load(B, i8p,
+                              getPThreadMemberPtr<PThread_Elem::Arg>(B, cl)));
+          if (shadowArg)
+            args.push_back(load(
+                B, i8p, getPThreadMemberPtr<PThread_Elem::Shadow>(B, cl)));
+        }
+        if (tapeArg)
+          args.push_back(
+              load(B, i8p, getPThreadMemberPtr<PThread_Elem::Tape>(B, cl)));
+        for (size_t i = 0; i < args.size(); ++i)
+          args[i] = B.CreatePointerCast(
+              args[i], fn->getFunctionType()->getParamType(i));
+        Value *res = B.CreateCall(fn, args);
+        auto store = [&](AugmentedStruct S, Value *ptr) {
+          auto found = returns.find(S);
+          if (found == returns.end())
+            return;
+          Value *V = found->second == -1
+                         ? res
+                         : B.CreateExtractValue(res, found->second);
+          B.CreateStore(B.CreatePointerCast(V, i8p), ptr);
+        };
+        store(AugmentedStruct::Tape,
+              getPThreadMemberPtr<PThread_Elem::Tape>(B, cl));
+        store(AugmentedStruct::Return,
+              getPThreadMemberPtr<PThread_Elem::Return>(B, cl));
+        B.CreateRet(F->arg_begin());
+        return F;
+      };
+
+      Function *forward = nullptr;
+      Function *reverse = nullptr;
+      if (Mode == DerivativeMode::ForwardMode) {
+        auto fwd = gutils->Logic.CreateForwardDiff(
+            task, DIFFE_TYPE::CONSTANT, argsInverted,
+            TR.analyzer.interprocedural, returnUsed, Mode,
+            ((DiffeGradientUtils *)gutils)->FreeMemory, gutils->getWidth(),
+            /*additionalArg*/ nullptr, nextTypeInfo, uncacheable_args,
+            /*augmented*/ nullptr);
+        std::map<AugmentedStruct, int> returns;
+        if (returnUsed)
+          returns[AugmentedStruct::Return] = -1;
+        forward = createRoutine(fwd, fwd->getName() + "_thread", returns,
+                                /*tapeArg*/ false);
+      } else {
+        auto subdata = &gutils->Logic.CreateAugmentedPrimal(
+            task, DIFFE_TYPE::CONSTANT, argsInverted,
+            TR.analyzer.interprocedural, returnUsed,
+            /*shadowReturnUsed*/ false, nextTypeInfo, uncacheable_args,
+            /*forceAnonymousTape*/ true, gutils->getWidth(),
+            /*AtomicAdd*/ true);
+        bool hasTape = subdata->returns.find(AugmentedStruct::Tape) !=
+                       subdata->returns.end();
+        forward = createRoutine(subdata->fn, subdata->fn->getName() + "_thread",
+                                subdata->returns, /*tapeArg*/ false);
+
+        auto rev = gutils->Logic.CreatePrimalAndGradient(
+            (ReverseCacheKey){.todiff = task,
+                              .retType = DIFFE_TYPE::CONSTANT,
+                              .constant_args = argsInverted,
+                              .uncacheable_args = uncacheable_args,
+                              .returnUsed = false,
+                              .shadowReturnUsed = false,
+                              .mode = DerivativeMode::ReverseModeGradient,
+                              .width = gutils->getWidth(),
+                              .freeMemory = true,
+                              .AtomicAdd = true,
+                              .additionalType = hasTape ? i8p : nullptr,
+                              .typeInfo = nextTypeInfo},
+            TR.analyzer.interprocedural, subdata);
+        reverse = createRoutine(rev, rev->getName() + "_thread", {}, hasTape);
+      }
+
+      Value *arg = gutils->getNewFromOriginal(call.getArgOperand(3));
+      Value *shadow = shadowArg
+                          ? BuilderZ.CreatePointerCast(
+                                gutils->invertPointerM(call.getArgOperand(3),
+                                                       BuilderZ),
+                                i8p)
+                          : ConstantPointerNull::get(cast<PointerType>(i8p));
+      closure = BuilderZ.CreatePointerCast(
+          CreateAllocation(BuilderZ, CT,
+                           ConstantInt::get(Type::getInt64Ty(ctx), 1),
+                           "thread_closure"),
+          CTp);
+      BuilderZ.CreateStore(BuilderZ.CreatePointerCast(arg, i8p),
+                           getPThreadMemberPtr<PThread_Elem::Arg>(BuilderZ,
+                                                                  closure));
+      BuilderZ.CreateStore(shadow, getPThreadMemberPtr<PThread_Elem::Shadow>(
+                                       BuilderZ, closure));
+      BuilderZ.CreateStore(
+          reverse ? BuilderZ.CreatePointerCast(reverse, i8p)
+                  : ConstantPointerNull::get(cast<PointerType>(i8p)),
+          getPThreadMemberPtr<PThread_Elem::Reverse>(BuilderZ, closure));
+
+      newCall->setArgOperand(
+          2, BuilderZ.CreatePointerCast(
+                 forward, newCall->getFunctionType()->getParamType(2)));
+      newCall->setArgOperand(
+          3, BuilderZ.CreatePointerCast(
+                 closure, newCall->getFunctionType()->getParamType(3)));
+    }
+
+    if (!create && Mode != DerivativeMode::ReverseModeGradient) {
+      // The thread exits with its closure, from which the value returned by
+      // the routine is forwarded to the caller of the join.
+      auto slot = IRBuilder<>(gutils->inversionAllocs).CreateAlloca(i8p);
+      newCall->setArgOperand(
+          1, BuilderZ.CreatePointerCast(
+                 slot, newCall->getFunctionType()->getParamType(1)));
+      BuilderZ.SetInsertPoint(newCall->getNextNode());
+      closure = BuilderZ.CreatePointerCast(load(BuilderZ, i8p, slot), CTp);
+
+      Value *retval = gutils->getNewFromOriginal(call.getArgOperand(1));
+      if (!isa<ConstantPointerNull>(retval)) {
+        auto sink = IRBuilder<>(gutils->inversionAllocs).CreateAlloca(i8p);
+        Value *dst = BuilderZ.CreatePointerCast(retval, sink->getType());
+        dst = BuilderZ.CreateSelect(BuilderZ.CreateIsNull(dst), sink, dst);
+        BuilderZ.CreateStore(
+            load(BuilderZ, i8p,
+                 getPThreadMemberPtr<PThread_Elem::Return>(BuilderZ, closure)),
+            dst);
+      }
+
+      // Without a reverse pass the closure is no longer needed
+      if (Mode == DerivativeMode::ForwardMode) {
+        CreateDealloc(BuilderZ, closure);
+        return true;
+      }
+    }
+
+    if (Mode == DerivativeMode::ForwardMode)
+      return true;
+
+    if (Mode == DerivativeMode::ReverseModeGradient) {
+      BuilderZ.SetInsertPoint(newCall->getNextNode());
+      eraseIfUnused(call, /*erase*/ true, /*check*/ false);
+      closure = BuilderZ.CreatePHI(CTp, 0, "thread_closure");
+    }
+    closure = gutils->cacheForReverse(BuilderZ, closure,
+                                      getIndex(&call, CacheType::Tape));
+
+    if (Mode == DerivativeMode::ReverseModePrimal)
+      return true;
+
+    IRBuilder<> Builder2(call.getParent());
+    getReverseBuilder(Builder2);
+    closure = lookup(closure, Builder2);
+    Value *thread =
+        getPThreadMemberPtr<PThread_Elem::Thread>(Builder2, closure);
+
+    if (create) {
+      // Wait for the reverse of the thread spawned by the adjoint of the join
+      Type *joinArgs[] = {threadType, PointerType::getUnqual(i8p)};
+      auto joinFn = M.getOrInsertFunction(
+          "pthread_join", FunctionType::get(i32, joinArgs, false));
+      Value *args[] = {
+          load(Builder2, threadType, thread),
+          ConstantPointerNull::get(PointerType::getUnqual(i8p))};
+      Builder2.CreateCall(joinFn, args);
+      CreateDealloc(Builder2, closure);
+    } else {
+      Type *createArgs[] = {thread->getType(), i8p,
+                            PointerType::getUnqual(routineTy), i8p};
+      auto createFn = M.getOrInsertFunction(
+          "pthread_create", FunctionType::get(i32, createArgs, false));
+      Value *reverse = Builder2.CreatePointerCast(
+          load(Builder2, i8p,
+               getPThreadMemberPtr<PThread_Elem::Reverse>(Builder2, closure)),
+          PointerType::getUnqual(routineTy));
+      Value *args[] = {thread,
+                       ConstantPointerNull::get(cast<PointerType>(i8p)),
+                       reverse, Builder2.CreatePointerCast(closure, i8p)};
+      Builder2.CreateCall(createFn, args);
+    }
+    return true;
+  }
+
   void DifferentiableMemCopyFloats(CallInst &call, Value *origArg, Value *dsto,
                                    Value *srco, Value *len_arg,
                                    IRBuilder<> &Builder2,
@@ -5555,7 +6112,10 @@ public:
 
   std::string extractBLAS(StringRef in, std::string &prefix,
                           std::string &suffix) {
-    std::string extractable[] = {"ddot", "sdot", "dnrm2", "snrm2"};
+    std::string extractable[] = {"ddot",  "sdot",  "dnrm2", "snrm2", "daxpy",
+                                 "saxpy", "dscal", "sscal", "dgemv", "sgemv",
+                                 "dgemm", "sgemm", "dtrsv", "strsv", "dtrsm",
+                                 "strsm", "dsyrk", "ssyrk"};
     std::string prefixes[] = {"", "cblas_", "cublas_"};
     std::string suffixes[] = {"", "_", "_64_"};
     for (auto ex : extractable) {
@@ -5581,6 +6141,15 @@ public:
     IRBuilder<> allocationBuilder(gutils->inversionAllocs);
     allocationBuilder.setFastMathFlags(getFast());
 
+    if (funcName != "dnrm2" && funcName != "snrm2" && funcName != "ddot" &&
+        funcName != "sdot") {
+      // cuBLAS routines beyond dot products take a handle and are not handled
+      if (prefix == "cublas_")
+        return false;
+      return handleBLASRoutine(call, funcName, prefix, suffix,
+                               uncacheable_args);
+    }
+
     if (funcName == "dnrm2" || funcName == "snrm2") {
       if (!gutils->isConstantInstruction(&call)) {
 
@@ -6284,6 +6853,863 @@ public:
     return false;
   }
 
+  /// Create the derivative of a call to one of the BLAS routines axpy, scal,
+  /// gemv, gemm, trsv, trsm or syrk. The derivative is itself computed by
+  /// calls to BLAS using the calling convention of the original call, and only
+  /// the operands read by the reverse pass which may be overwritten before it
+  /// runs are cached.
+  bool handleBLASRoutine(llvm::CallInst &call, StringRef funcName,
+                         StringRef prefix, StringRef suffix,
+                         const std::map<Argument *, bool> &uncacheable_args) {
+    // Vector mode and split forward mode are not handled yet
+    if (gutils->getWidth() != 1 || Mode == DerivativeMode::ForwardModeSplit)
+      return false;
+
+    LLVMContext &ctx = call.getContext();
+    StringRef routine = funcName.drop_front();
+    Type *fpType = funcName[0] == 'd' ? Type::getDoubleTy(ctx)
+                                      : Type::getFloatTy(ctx);
+    bool level1 = routine == "axpy" || routine == "scal";
+    unsigned off = (prefix == "cblas_" && !level1) ? 1 : 0;
+    bool byRef = call.getArgOperand(off)->getType()->isPointerTy();
+    // Level 2 and 3 routines take their flags either as cblas enumerations or
+    // as Fortran characters passed by reference
+    if (!level1 && !off && !byRef)
+      return false;
+
+    // A row-major cblas call is differentiated as the equivalent column-major
+    // call on the transposed matrices, which requires the layout to be known
+    bool rowMajor = false;
+    if (off) {
+      auto layout = dyn_cast<ConstantInt>(call.getArgOperand(0));
+      if (!layout)
+        return false;
+      rowMajor = layout->getSExtValue() == /*CblasRowMajor*/ 101;
+    }
+
+    // Operand positions of the routine, None if not taken by the routine
+    const unsigned None = ~0U;
+    unsigned ArgTrans = None, ArgTransB = None, ArgUplo = None, ArgDiag = None,
+             ArgSide = None, ArgM = None, ArgN = None, ArgK = None,
+             ArgAlpha = None, ArgBeta = None, ArgA = None, ArgLda = None,
+             ArgB = None, ArgLdb = None, ArgC = None, ArgLdc = None,
+             ArgX = None, ArgIncx = None, ArgY = None, ArgIncy = None;
+    bool flipTrans = false, flipUplo = false, flipSide = false;
+    if (routine == "axpy") {
+      ArgN = 0, ArgAlpha = 1, ArgX = 2, ArgIncx = 3, ArgY = 4, ArgIncy = 5;
+    } else if (routine == "scal") {
+      ArgN = 0, ArgAlpha = 1, ArgX = 2, ArgIncx = 3;
+    } else if (routine == "gemv") {
+      ArgTrans = 0, ArgM = 1, ArgN = 2, ArgAlpha = 3, ArgA = 4, ArgLda = 5,
+      ArgX = 6, ArgIncx = 7, ArgBeta = 8, ArgY = 9, ArgIncy = 10;
+      if (rowMajor) {
+        std::swap(ArgM, ArgN);
+        flipTrans = true;
+      }
+    } else if (routine == "gemm") {
+      ArgTrans = 0, ArgTransB = 1, ArgM = 2, ArgN = 3, ArgK = 4, ArgAlpha = 5,
+      ArgA = 6, ArgLda = 7, ArgB = 8, ArgLdb = 9, ArgBeta = 10, ArgC = 11,
+      ArgLdc = 12;
+      // C^T = op(B)^T op(A)^T
+      if (rowMajor) {
+        std::swap(ArgTrans, ArgTransB);
+        std::swap(ArgM, ArgN);
+        std::swap(ArgA, ArgB);
+        std::swap(ArgLda, ArgLdb);
+      }
+    } else if (routine == "trsv") {
+      ArgUplo = 0, ArgTrans = 1, ArgDiag = 2, ArgN = 3, ArgA = 4, ArgLda = 5,
+      ArgX = 6, ArgIncx = 7;
+      flipUplo = flipTrans = rowMajor;
+    } else if (routine == "trsm") {
+      ArgSide = 0, ArgUplo = 1, ArgTrans = 2, ArgDiag = 3, ArgM = 4, ArgN = 5,
+      ArgAlpha = 6, ArgA = 7, ArgLda = 8, ArgB = 9, ArgLdb = 10;
+      flipSide = flipUplo = rowMajor;
+      if (rowMajor)
+        std::swap(ArgM, ArgN);
+    } else if (routine == "syrk") {
+      ArgUplo = 0, ArgTrans = 1, ArgN = 2, ArgK = 3, ArgAlpha = 4, ArgA = 5,
+      ArgLda = 6, ArgBeta = 7, ArgC = 8, ArgLdc = 9;
+      flipUplo = flipTrans = rowMajor;
+    } else {
+      return false;
+    }
+    for (unsigned *pos :
+         {&ArgTrans, &ArgTransB, &ArgUplo, &ArgDiag, &ArgSide, &ArgM, &ArgN,
+          &ArgK, &ArgAlpha, &ArgBeta, &ArgA, &ArgLda, &ArgB, &ArgLdb, &ArgC,
+          &ArgLdc, &ArgX, &ArgIncx, &ArgY, &ArgIncy})
+      if (*pos != None)
+        *pos += off;
+
+    // The array overwritten by the routine
+    unsigned ArgOut = ArgC != None   ? ArgC
+                      : ArgY != None ? ArgY
+                      : ArgB != None ? ArgB
+                                     : ArgX;
+
+    IntegerType *intType;
+    if (byRef)
+      intType = IntegerType::get(ctx, suffix.contains("64") ? 64 : 32);
+    else
+      intType = cast<IntegerType>(call.getArgOperand(ArgN)->getType());
+
+    CallInst *const newCall = cast<CallInst>(gutils->getNewFromOriginal(&call));
+    IRBuilder<> BuilderZ(newCall);
+    BuilderZ.setFastMathFlags(getFast());
+    IRBuilder<> allocationBuilder(gutils->inversionAllocs);
+    allocationBuilder.setFastMathFlags(getFast());
+
+    auto active = [&](unsigned i) {
+      return i != None && !gutils->isConstantValue(call.getArgOperand(i));
+    };
+
+    if (gutils->isConstantInstruction(&call) || !active(ArgOut)) {
+      if (Mode == DerivativeMode::ReverseModeGradient) {
+        eraseIfUnused(call, /*erase*/ true, /*check*/ false);
+      } else {
+        eraseIfUnused(call);
+      }
+      return true;
+    }
+
+    BLASEmitter E(*gutils->newFunc->getParent(), allocationBuilder, prefix,
+                  suffix, fpType, intType, byRef);
+
+    Function *F = getFunctionFromCall(&call);
+    auto uncacheable = [&](unsigned i) {
+      if (!F || i >= F->arg_size())
+        return true;
+      auto found = uncacheable_args.find(F->arg_begin() + i);
+      return found == uncacheable_args.end() || found->second;
+    };
+
+    // Scalar operands and the type of the value they hold
+    SmallVector<std::pair<unsigned, Type *>, 12> scalars;
+    Type *charType =
+        byRef ? Type::getInt8Ty(ctx)
+              : (off ? call.getArgOperand(0)->getType() : nullptr);
+    for (unsigned i : {ArgTrans, ArgTransB, ArgUplo, ArgDiag, ArgSide})
+      if (i != None)
+        scalars.emplace_back(i, charType);
+    for (unsigned i :
+         {ArgM, ArgN, ArgK, ArgLda, ArgLdb, ArgLdc, ArgIncx, ArgIncy})
+      if (i != None)
+        scalars.emplace_back(i, intType);
+    for (unsigned i : {ArgAlpha, ArgBeta})
+      if (i != None)
+        scalars.emplace_back(i, fpType);
+    auto scalarType = [&](unsigned i) -> Type * {
+      for (auto &pair : scalars)
+        if (pair.first == i)
+          return pair.second;
+      llvm_unreachable("unknown BLAS scalar operand");
+    };
+
+    bool activeAlpha = active(ArgAlpha), activeBeta = active(ArgBeta),
+         activeA = active(ArgA), activeB = active(ArgB),
+         activeX = active(ArgX);
+
+    // Arrays cached for the reverse pass, either before the call or after the
+    // call for the solution of a triangular solve
+    SmallVector<std::pair<unsigned, bool>, 3> cached;
+    auto cacheIf = [&](bool cond, unsigned i, bool post = false) {
+      if (cond)
+        cached.emplace_back(i, post);
+    };
+    if (Mode != DerivativeMode::ForwardMode) {
+      if (routine == "axpy") {
+        cacheIf(activeAlpha && uncacheable(ArgX), ArgX);
+      } else if (routine == "scal") {
+        cacheIf(activeAlpha, ArgX);
+      } else if (routine == "gemv") {
+        cacheIf((activeX || activeAlpha) && uncacheable(ArgA), ArgA);
+        cacheIf((activeA || activeAlpha) && uncacheable(ArgX), ArgX);
+        cacheIf(activeBeta, ArgY);
+      } else if (routine == "gemm") {
+        cacheIf((activeB || activeAlpha) && uncacheable(ArgA), ArgA);
+        cacheIf((activeA || activeAlpha) && uncacheable(ArgB), ArgB);
+        cacheIf(activeBeta, ArgC);
+      } else if (routine == "trsv") {
+        cacheIf(uncacheable(ArgA), ArgA);
+        cacheIf(activeA && uncacheable(ArgX), ArgX, /*post*/ true);
+      } else if (routine == "trsm") {
+        cacheIf(uncacheable(ArgA), ArgA);
+        cacheIf(activeA && uncacheable(ArgB), ArgB, /*post*/ true);
+        cacheIf(activeAlpha, ArgB);
+      } else if (routine == "syrk") {
+        cacheIf((activeA || activeAlpha) && uncacheable(ArgA), ArgA);
+        cacheIf(activeBeta, ArgC);
+      }
+    }
+
+    // Scalars passed by reference which may be overwritten are cached too
+    SmallVector<unsigned, 4> taped;
+    SmallVector<Type *, 8> cacheTypes;
+    if (byRef && Mode != DerivativeMode::ForwardMode)
+      for (auto &pair : scalars)
+        if (uncacheable(pair.first)) {
+          taped.push_back(pair.first);
+          cacheTypes.push_back(pair.second);
+        }
+    for (size_t i = 0; i < cached.size(); i++)
+      cacheTypes.push_back(PointerType::getUnqual(fpType));
+
+    Type *cachetype = nullptr;
+    switch (cacheTypes.size()) {
+    case 0:
+      break;
+    case 1:
+      cachetype = cacheTypes[0];
+      break;
+    default:
+      cachetype = StructType::get(ctx, cacheTypes);
+      break;
+    }
+
+    struct BLASOperands {
+      Value *trans = nullptr, *transb = nullptr, *upper = nullptr,
+            *unit = nullptr, *left = nullptr;
+      Value *m = nullptr, *n = nullptr, *k = nullptr;
+      Value *alpha = nullptr, *beta = nullptr;
+      Value *lda = nullptr, *ldb = nullptr, *ldc = nullptr;
+      Value *incx = nullptr, *incy = nullptr;
+    };
+
+    // Interpret the scalar operands given by getScalar as a column-major call
+    auto decode = [&](IRBuilder<> &B,
+                      std::function<Value *(unsigned)> getScalar) {
+      auto isFlag = [&](unsigned i, char c, unsigned e) -> Value * {
+        Value *v = getScalar(i);
+        if (byRef)
+          return B.CreateICmpEQ(
+              B.CreateOr(v, ConstantInt::get(v->getType(), 0x20)),
+              ConstantInt::get(v->getType(), c));
+        return B.CreateICmpEQ(v, ConstantInt::get(v->getType(), e));
+      };
+      auto get = [&](unsigned i) {
+        return i == None ? nullptr : getScalar(i);
+      };
+      BLASOperands o;
+      if (ArgTrans != None) {
+        o.trans = isFlag(ArgTrans, 'n', /*CblasNoTrans*/ 111);
+        if (!flipTrans)
+          o.trans = B.CreateNot(o.trans);
+      }
+      if (ArgTransB != None)
+        o.transb = B.CreateNot(isFlag(ArgTransB, 'n', /*CblasNoTrans*/ 111));
+      if (ArgUplo != None) {
+        o.upper = isFlag(ArgUplo, 'u', /*CblasUpper*/ 121);
+        if (flipUplo)
+          o.upper = B.CreateNot(o.upper);
+      }
+      if (ArgDiag != None)
+        o.unit = isFlag(ArgDiag, 'u', /*CblasUnit*/ 132);
+      if (ArgSide != None) {
+        o.left = isFlag(ArgSide, 'l', /*CblasLeft*/ 141);
+        if (flipSide)
+          o.left = B.CreateNot(o.left);
+      }
+      o.m = get(ArgM);
+      o.n = get(ArgN);
+      o.k = get(ArgK);
+      o.alpha = get(ArgAlpha);
+      o.beta = get(ArgBeta);
+      o.lda = get(ArgLda);
+      o.ldb = get(ArgLdb);
+      o.ldc = get(ArgLdc);
+      o.incx = get(ArgIncx);
+      o.incy = get(ArgIncy);
+      return o;
+    };
+
+    // The dimensions of array operand i. Vectors have no columns and their
+    // increment in place of a leading dimension.
+    struct Shape {
+      Value *rows, *cols, *ld, *tri;
+    };
+    auto shape = [&](IRBuilder<> &B, BLASOperands &o, unsigned i) {
+      Shape s = {nullptr, nullptr, nullptr, B.getInt8(BLASEmitter::Full)};
+      auto triangle = [&]() {
+        return B.CreateSelect(o.upper, B.getInt8(BLASEmitter::Upper),
+                              B.getInt8(BLASEmitter::Lower));
+      };
+      if (i == ArgX) {
+        s.ld = o.incx;
+        s.rows = routine == "gemv" ? B.CreateSelect(o.trans, o.m, o.n) : o.n;
+      } else if (i == ArgY) {
+        s.ld = o.incy;
+        s.rows = routine == "gemv" ? B.CreateSelect(o.trans, o.n, o.m) : o.n;
+      } else if (i == ArgA) {
+        s.ld = o.lda;
+        if (routine == "gemv") {
+          s.rows = o.m;
+          s.cols = o.n;
+        } else if (routine == "gemm") {
+          s.rows = B.CreateSelect(o.trans, o.k, o.m);
+          s.cols = B.CreateSelect(o.trans, o.m, o.k);
+        } else if (routine == "syrk") {
+          s.rows = B.CreateSelect(o.trans, o.k, o.n);
+          s.cols = B.CreateSelect(o.trans, o.n, o.k);
+        } else {
+          s.rows = s.cols =
+              routine == "trsm" ? B.CreateSelect(o.left, o.m, o.n) : o.n;
+          s.tri = triangle();
+        }
+      } else if (i == ArgB) {
+        s.ld = o.ldb;
+        if (routine == "gemm") {
+          s.rows = B.CreateSelect(o.transb, o.n, o.k);
+          s.cols = B.CreateSelect(o.transb, o.k, o.n);
+        } else {
+          s.rows = o.m;
+          s.cols = o.n;
+        }
+      } else {
+        assert(i == ArgC);
+        s.ld = o.ldc;
+        if (routine == "gemm") {
+          s.rows = o.m;
+          s.cols = o.n;
+        } else {
+          s.rows = s.cols = o.n;
+          s.tri = triangle();
+        }
+      }
+      return s;
+    };
+
+    auto allocate = [&](IRBuilder<> &B, Value *rows, Value *cols) -> Value * {
+      Value *count = B.CreateSExt(rows, B.getInt64Ty());
+      if (cols)
+        count = B.CreateMul(count, B.CreateSExt(cols, B.getInt64Ty()));
+      return B.CreatePointerCast(CreateAllocation(B, fpType, count),
+                                 PointerType::getUnqual(fpType));
+    };
+
+    auto forwardScalar = [&](unsigned i) -> Value * {
+      Value *v = gutils->getNewFromOriginal(call.getArgOperand(i));
+      if (!byRef)
+        return v;
+      Type *T = scalarType(i);
+      v = BuilderZ.CreatePointerCast(v, PointerType::getUnqual(T));
+#if LLVM_VERSION_MAJOR > 7
+      return BuilderZ.CreateLoad(T, v);
+#else
+      return BuilderZ.CreateLoad(v);
+#endif
+    };
+
+    Value *cacheval = nullptr;
+    if ((Mode == DerivativeMode::ReverseModeCombined ||
+         Mode == DerivativeMode::ReverseModePrimal) &&
+        cachetype) {
+      BLASOperands o = decode(BuilderZ, forwardScalar);
+      IRBuilder<> BuilderA(newCall->getNextNode());
+      BuilderA.setFastMathFlags(getFast());
+
+      SmallVector<Value *, 8> cacheValues;
+      for (unsigned i : taped)
+        cacheValues.push_back(forwardScalar(i));
+      for (auto &pair : cached) {
+        Shape s = shape(BuilderZ, o, pair.first);
+        Value *buffer = allocate(BuilderZ, s.rows, s.cols);
+        IRBuilder<> &B = pair.second ? BuilderA : BuilderZ;
+        Value *src = E.ptr(
+            B, gutils->getNewFromOriginal(call.getArgOperand(pair.first)));
+        if (s.cols)
+          E.matrix(B, BLASMatrixOp::Copy, s.tri, B.getFalse(),
+                   {s.rows, s.cols, src, s.ld, buffer, s.rows});
+        else
+          E.call(B, "copy",
+                 {E.integer(B, s.rows), src, E.integer(B, s.ld), buffer,
+                  E.integer(B, 1)});
+        cacheValues.push_back(buffer);
+      }
+
+      if (cacheValues.size() == 1)
+        cacheval = cacheValues[0];
+      else {
+        cacheval = UndefValue::get(cachetype);
+        for (auto tup : llvm::enumerate(cacheValues))
+          cacheval = BuilderZ.CreateInsertValue(cacheval, tup.value(),
+                                                tup.index());
+      }
+      gutils->cacheForReverse(BuilderZ, cacheval,
+                              getIndex(&call, CacheType::Tape));
+    }
+
+    if (Mode == DerivativeMode::ForwardMode) {
+      BLASOperands o = decode(BuilderZ, forwardScalar);
+      IRBuilder<> BuilderA(newCall->getNextNode());
+      BuilderA.setFastMathFlags(getFast());
+      auto &B = BuilderZ;
+
+      auto primal = [&](IRBuilder<> &B, unsigned i) {
+        return E.ptr(B, gutils->getNewFromOriginal(call.getArgOperand(i)));
+      };
+      auto shadow = [&](IRBuilder<> &B, unsigned i) {
+        return E.ptr(B, gutils->invertPointerM(call.getArgOperand(i), B));
+      };
+      auto tangent = [&](unsigned i) -> Value * {
+        if (!byRef)
+          return diffe(call.getArgOperand(i), BuilderZ);
+        Value *d = gutils->invertPointerM(call.getArgOperand(i), BuilderZ);
+        d = BuilderZ.CreatePointerCast(d, PointerType::getUnqual(fpType));
+#if LLVM_VERSION_MAJOR > 7
+        return BuilderZ.CreateLoad(fpType, d);
+#else
+        return BuilderZ.CreateLoad(d);
+#endif
+      };
+      auto I = [&](IRBuilder<> &B, Value *v) { return E.integer(B, v); };
+      Value *full = B.getInt8(BLASEmitter::Full);
+
+      if (routine == "axpy") {
+        Value *dy = shadow(B, ArgY);
+        if (activeX)
+          E.call(B, "axpy",
+                 {I(B, o.n), E.fp(B, o.alpha), shadow(B, ArgX), I(B, o.incx),
+                  dy, I(B, o.incy)});
+        if (activeAlpha)
+          E.call(B, "axpy",
+                 {I(B, o.n), E.fp(B, tangent(ArgAlpha)), primal(B, ArgX),
+                  I(B, o.incx), dy, I(B, o.incy)});
+      } else if (routine == "scal") {
+        // dx = alpha dx + dalpha x, using x before it is overwritten
+        Value *dx = shadow(B, ArgX);
+        E.call(B, "scal", {I(B, o.n), E.fp(B, o.alpha), dx, I(B, o.incx)});
+        if (activeAlpha)
+          E.call(B, "axpy",
+                 {I(B, o.n), E.fp(B, tangent(ArgAlpha)), primal(B, ArgX),
+                  I(B, o.incx), dx, I(B, o.incx)});
+      } else if (routine == "gemv") {
+        Value *dy = shadow(B, ArgY);
+        Value *leny = B.CreateSelect(o.trans, o.n, o.m);
+        E.call(B, "scal", {I(B, leny), E.fp(B, o.beta), dy, I(B, o.incy)});
+        if (activeBeta)
+          E.call(B, "axpy",
+                 {I(B, leny), E.fp(B, tangent(ArgBeta)), primal(B, ArgY),
+                  I(B, o.incy), dy, I(B, o.incy)});
+        auto gemv = [&](Value *alpha, Value *A, Value *x) {
+          E.call(B, "gemv",
+                 {E.trans(B, o.trans), I(B, o.m), I(B, o.n), E.fp(B, alpha), A,
+                  I(B, o.lda), x, I(B, o.incx), E.fp(B, 1.0), dy,
+                  I(B, o.incy)});
+        };
+        if (activeX)
+          gemv(o.alpha, primal(B, ArgA), shadow(B, ArgX));
+        if (activeA)
+          gemv(o.alpha, shadow(B, ArgA), primal(B, ArgX));
+        if (activeAlpha)
+          gemv(tangent(ArgAlpha), primal(B, ArgA), primal(B, ArgX));
+      } else if (routine == "gemm") {
+        Value *dC = shadow(B, ArgC);
+        E.matrix(B, BLASMatrixOp::Scal, full, B.getFalse(),
+                 {o.m, o.n, o.beta, dC, o.ldc});
+        if (activeBeta)
+          E.matrix(B, BLASMatrixOp::Axpy, full, B.getFalse(),
+                   {o.m, o.n, tangent(ArgBeta), primal(B, ArgC), o.ldc, dC,
+                    o.ldc});
+        auto gemm = [&](Value *alpha, Value *A, Value *Bm) {
+          E.call(B, "gemm",
+                 {E.trans(B, o.trans), E.trans(B, o.transb), I(B, o.m),
+                  I(B, o.n), I(B, o.k), E.fp(B, alpha), A, I(B, o.lda), Bm,
+                  I(B, o.ldb), E.fp(B, 1.0), dC, I(B, o.ldc)});
+        };
+        if (activeA)
+          gemm(o.alpha, shadow(B, ArgA), primal(B, ArgB));
+        if (activeB)
+          gemm(o.alpha, primal(B, ArgA), shadow(B, ArgB));
+        if (activeAlpha)
+          gemm(tangent(ArgAlpha), primal(B, ArgA), primal(B, ArgB));
+      } else if (routine == "trsv") {
+        // dx = op(A)^-1 (db - op(dA) x), where x is the solution
+        auto &BA = BuilderA;
+        Value *dx = shadow(BA, ArgX);
+        if (activeA) {
+          Value *x = primal(BA, ArgX);
+          Value *tmp = allocate(BA, o.n, nullptr);
+          E.call(BA, "copy",
+                 {I(BA, o.n), x, I(BA, o.incx), tmp, E.integer(BA, 1)});
+          E.call(BA, "trmv",
+                 {E.uplo(BA, o.upper), E.trans(BA, o.trans),
+                  E.diag(BA, o.unit), I(BA, o.n), shadow(BA, ArgA),
+                  I(BA, o.lda), tmp, E.integer(BA, 1)});
+          // A unit diagonal is implicit and has no derivative
+          Value *unitScale =
+              BA.CreateSelect(o.unit, ConstantFP::get(fpType, -1.0),
+                              ConstantFP::get(fpType, 0.0));
+          E.call(BA, "axpy",
+                 {I(BA, o.n), E.fp(BA, unitScale), x, I(BA, o.incx), tmp,
+                  E.integer(BA, 1)});
+          E.call(BA, "axpy",
+                 {I(BA, o.n), E.fp(BA, -1.0), tmp, E.integer(BA, 1), dx,
+                  I(BA, o.incx)});
+          CreateDealloc(BA, tmp);
+        }
+        E.call(BA, "trsv",
+               {E.uplo(BA, o.upper), E.trans(BA, o.trans), E.diag(BA, o.unit),
+                I(BA, o.n), primal(BA, ArgA), I(BA, o.lda), dx,
+                I(BA, o.incx)});
+      } else if (routine == "trsm") {
+        // dX = op(A)^-1 (alpha dB + dalpha B - op(dA) X) on the left, and
+        // correspondingly on the right
+        Value *dB = shadow(B, ArgB);
+        E.matrix(B, BLASMatrixOp::Scal, full, B.getFalse(),
+                 {o.m, o.n, o.alpha, dB, o.ldb});
+        if (activeAlpha)
+          E.matrix(B, BLASMatrixOp::Axpy, full, B.getFalse(),
+                   {o.m, o.n, tangent(ArgAlpha), primal(B, ArgB), o.ldb, dB,
+                    o.ldb});
+        auto &BA = BuilderA;
+        if (activeA) {
+          Value *X = primal(BA, ArgB);
+          Value *tmp = allocate(BA, o.m, o.n);
+          E.matrix(BA, BLASMatrixOp::Copy, full, BA.getFalse(),
+                   {o.m, o.n, X, o.ldb, tmp, o.m});
+          E.call(BA, "trmm",
+                 {E.side(BA, o.left), E.uplo(BA, o.upper),
+                  E.trans(BA, o.trans), E.diag(BA, o.unit), I(BA, o.m),
+                  I(BA, o.n), E.fp(BA, 1.0), shadow(BA, ArgA), I(BA, o.lda),
+                  tmp, I(BA, o.m)});
+          // A unit diagonal is implicit and has no derivative
+          Value *unitScale =
+              BA.CreateSelect(o.unit, ConstantFP::get(fpType, -1.0),
+                              ConstantFP::get(fpType, 0.0));
+          E.matrix(BA, BLASMatrixOp::Axpy, full, BA.getFalse(),
+                   {o.m, o.n, unitScale, X, o.ldb, tmp, o.m});
+          E.matrix(BA, BLASMatrixOp::Axpy, full, BA.getFalse(),
+                   {o.m, o.n, ConstantFP::get(fpType, -1.0), tmp, o.m, dB,
+                    o.ldb});
+          CreateDealloc(BA, tmp);
+        }
+        E.call(BA, "trsm",
+               {E.side(BA, o.left), E.uplo(BA, o.upper), E.trans(BA, o.trans),
+                E.diag(BA, o.unit), I(BA, o.m), I(BA, o.n), E.fp(BA, 1.0),
+                primal(BA, ArgA), I(BA, o.lda), dB, I(BA, o.ldb)});
+      } else if (routine == "syrk") {
+        Value *dC = shadow(B, ArgC);
+        Value *tri = B.CreateSelect(o.upper, B.getInt8(BLASEmitter::Upper),
+                                    B.getInt8(BLASEmitter::Lower));
+        E.matrix(B, BLASMatrixOp::Scal, tri, B.getFalse(),
+                 {o.n, o.n, o.beta, dC, o.ldc});
+        if (activeBeta)
+          E.matrix(B, BLASMatrixOp::Axpy, tri, B.getFalse(),
+                   {o.n, o.n, tangent(ArgBeta), primal(B, ArgC), o.ldc, dC,
+                    o.ldc});
+        if (activeA)
+          E.call(B, "syr2k",
+                 {E.uplo(B, o.upper), E.trans(B, o.trans), I(B, o.n),
+                  I(B, o.k), E.fp(B, o.alpha), shadow(B, ArgA), I(B, o.lda),
+                  primal(B, ArgA), I(B, o.lda), E.fp(B, 1.0), dC,
+                  I(B, o.ldc)});
+        if (activeAlpha)
+          E.call(B, "syrk",
+                 {E.uplo(B, o.upper), E.trans(B, o.trans), I(B, o.n),
+                  I(B, o.k), E.fp(B, tangent(ArgAlpha)), primal(B, ArgA),
+                  I(B, o.lda), E.fp(B, 1.0), dC, I(B, o.ldc)});
+      }
+    }
+
+    if (Mode == DerivativeMode::ReverseModeCombined ||
+        Mode == DerivativeMode::ReverseModeGradient) {
+      IRBuilder<> Builder2(call.getParent());
+      getReverseBuilder(Builder2);
+      auto &B = Builder2;
+
+      if (cachetype) {
+        if (Mode != DerivativeMode::ReverseModeCombined)
+          cacheval = BuilderZ.CreatePHI(cachetype, 0);
+        cacheval = gutils->cacheForReverse(BuilderZ, cacheval,
+                                           getIndex(&call, CacheType::Tape));
+        cacheval = lookup(cacheval, Builder2);
+      }
+      auto fromTape = [&](unsigned idx) {
+        return cacheTypes.size() == 1
+                   ? cacheval
+                   : Builder2.CreateExtractValue(cacheval, {idx});
+      };
+
+      auto reverseScalar = [&](unsigned i) -> Value * {
+        auto found = llvm::find(taped, i);
+        if (found != taped.end())
+          return fromTape(found - taped.begin());
+        Value *v =
+            lookup(gutils->getNewFromOriginal(call.getArgOperand(i)), Builder2);
+        if (!byRef)
+          return v;
+        Type *T = scalarType(i);
+        v = Builder2.CreatePointerCast(v, PointerType::getUnqual(T));
+#if LLVM_VERSION_MAJOR > 7
+        return Builder2.CreateLoad(T, v);
+#else
+        return Builder2.CreateLoad(v);
+#endif
+      };
+      BLASOperands o = decode(Builder2, reverseScalar);
+
+      struct Array {
+        Value *ptr, *ld;
+      };
+      // The primal value of array i, from the cache if it was cached
+      auto primal = [&](unsigned i, bool post = false) -> Array {
+        Shape s = shape(B, o, i);
+        for (auto tup : llvm::enumerate(cached))
+          if (tup.value().first == i && tup.value().second == post)
+            return {fromTape(taped.size() + tup.index()),
+                    s.cols ? s.rows : ConstantInt::get(intType, 1)};
+        Value *ptr = lookup(
+            gutils->getNewFromOriginal(call.getArgOperand(i)), Builder2);
+        return {E.ptr(B, ptr), s.ld};
+      };
+      auto shadow = [&](unsigned i) -> Array {
+        Value *ptr = lookup(
+            gutils->invertPointerM(call.getArgOperand(i), Builder2), Builder2);
+        return {E.ptr(B, ptr), shape(B, o, i).ld};
+      };
+      auto addToScalar = [&](unsigned i, Value *dif) {
+        if (!byRef) {
+          addToDiffe(call.getArgOperand(i), dif, Builder2, fpType);
+          return;
+        }
+        Value *ptr = lookup(
+            gutils->invertPointerM(call.getArgOperand(i), Builder2), Builder2);
+        ptr = Builder2.CreatePointerCast(ptr, PointerType::getUnqual(fpType));
+#if LLVM_VERSION_MAJOR > 7
+        Value *prev = Builder2.CreateLoad(fpType, ptr);
+#else
+        Value *prev = Builder2.CreateLoad(ptr);
+#endif
+        Builder2.CreateStore(Builder2.CreateFAdd(prev, dif), ptr);
+      };
+      auto I = [&](Value *v) { return E.integer(B, v); };
+      auto select = [&](Value *cond, Array a, Array b) -> Array {
+        return {B.CreateSelect(cond, a.ptr, b.ptr),
+                B.CreateSelect(cond, a.ld, b.ld)};
+      };
+      Value *one = ConstantInt::get(intType, 1);
+      Value *full = B.getInt8(BLASEmitter::Full);
+
+      if (routine == "axpy") {
+        Array dy = shadow(ArgY);
+        if (activeX) {
+          Array dx = shadow(ArgX);
+          E.call(B, "axpy",
+                 {I(o.n), E.fp(B, o.alpha), dy.ptr, I(dy.ld), dx.ptr,
+                  I(dx.ld)});
+        }
+        if (activeAlpha) {
+          Array x = primal(ArgX);
+          addToScalar(ArgAlpha, E.call(B, "dot",
+                                       {I(o.n), x.ptr, I(x.ld), dy.ptr,
+                                        I(dy.ld)}));
+        }
+      } else if (routine == "scal") {
+        Array dx = shadow(ArgX);
+        if (activeAlpha) {
+          Array x = primal(ArgX);
+          addToScalar(ArgAlpha, E.call(B, "dot",
+                                       {I(o.n), x.ptr, I(x.ld), dx.ptr,
+                                        I(dx.ld)}));
+        }
+        E.call(B, "scal", {I(o.n), E.fp(B, o.alpha), dx.ptr, I(dx.ld)});
+      } else if (routine == "gemv") {
+        Array dy = shadow(ArgY);
+        Value *leny = B.CreateSelect(o.trans, o.n, o.m);
+        if (activeAlpha) {
+          Array A = primal(ArgA), x = primal(ArgX);
+          Value *tmp = allocate(B, leny, nullptr);
+          E.call(B, "gemv",
+                 {E.trans(B, o.trans), I(o.m), I(o.n), E.fp(B, 1.0), A.ptr,
+                  I(A.ld), x.ptr, I(x.ld), E.fp(B, 0.0), tmp, I(one)});
+          addToScalar(ArgAlpha, E.call(B, "dot",
+                                       {I(leny), tmp, I(one), dy.ptr,
+                                        I(dy.ld)}));
+          CreateDealloc(B, tmp);
+        }
+        if (activeA) {
+          // dA += alpha dy x^T, or alpha x dy^T if transposed
+          Array dA = shadow(ArgA), x = primal(ArgX);
+          Array u = select(o.trans, x, dy), v = select(o.trans, dy, x);
+          E.call(B, "ger",
+                 {I(o.m), I(o.n), E.fp(B, o.alpha), u.ptr, I(u.ld), v.ptr,
+                  I(v.ld), dA.ptr, I(dA.ld)});
+        }
+        if (activeX) {
+          Array A = primal(ArgA), dx = shadow(ArgX);
+          E.call(B, "gemv",
+                 {E.trans(B, B.CreateNot(o.trans)), I(o.m), I(o.n),
+                  E.fp(B, o.alpha), A.ptr, I(A.ld), dy.ptr, I(dy.ld),
+                  E.fp(B, 1.0), dx.ptr, I(dx.ld)});
+        }
+        if (activeBeta) {
+          Array y = primal(ArgY);
+          addToScalar(ArgBeta, E.call(B, "dot",
+                                      {I(leny), y.ptr, I(y.ld), dy.ptr,
+                                       I(dy.ld)}));
+        }
+        E.call(B, "scal", {I(leny), E.fp(B, o.beta), dy.ptr, I(dy.ld)});
+      } else if (routine == "gemm") {
+        Array dC = shadow(ArgC);
+        if (activeAlpha) {
+          Array A = primal(ArgA), Bm = primal(ArgB);
+          Value *tmp = allocate(B, o.m, o.n);
+          E.call(B, "gemm",
+                 {E.trans(B, o.trans), E.trans(B, o.transb), I(o.m), I(o.n),
+                  I(o.k), E.fp(B, 1.0), A.ptr, I(A.ld), Bm.ptr, I(Bm.ld),
+                  E.fp(B, 0.0), tmp, I(o.m)});
+          addToScalar(ArgAlpha,
+                      E.matrix(B, BLASMatrixOp::Dot, full, B.getFalse(),
+                               {o.m, o.n, tmp, o.m, dC.ptr, dC.ld}));
+          CreateDealloc(B, tmp);
+        }
+        if (activeA) {
+          // dA += alpha dC op(B)^T, or alpha op(B) dC^T if transposed
+          Array dA = shadow(ArgA), Bm = primal(ArgB);
+          Array u = select(o.trans, Bm, dC), v = select(o.trans, dC, Bm);
+          E.call(B, "gemm",
+                 {E.trans(B, B.CreateAnd(o.trans, o.transb)),
+                  E.trans(B, B.CreateOr(o.trans, B.CreateNot(o.transb))),
+                  I(B.CreateSelect(o.trans, o.k, o.m)),
+                  I(B.CreateSelect(o.trans, o.m, o.k)), I(o.n),
+                  E.fp(B, o.alpha), u.ptr, I(u.ld), v.ptr, I(v.ld),
+                  E.fp(B, 1.0), dA.ptr, I(dA.ld)});
+        }
+        if (activeB) {
+          // dB += alpha op(A)^T dC, or alpha dC^T op(A) if transposed
+          Array dB = shadow(ArgB), A = primal(ArgA);
+          Array u = select(o.transb, dC, A), v = select(o.transb, A, dC);
+          E.call(B, "gemm",
+                 {E.trans(B, B.CreateOr(o.transb, B.CreateNot(o.trans))),
+                  E.trans(B, B.CreateAnd(o.transb, o.trans)),
+                  I(B.CreateSelect(o.transb, o.n, o.k)),
+                  I(B.CreateSelect(o.transb, o.k, o.n)), I(o.m),
+                  E.fp(B, o.alpha), u.ptr, I(u.ld), v.ptr, I(v.ld),
+                  E.fp(B, 1.0), dB.ptr, I(dB.ld)});
+        }
+        if (activeBeta) {
+          Array C = primal(ArgC);
+          addToScalar(ArgBeta,
+                      E.matrix(B, BLASMatrixOp::Dot, full, B.getFalse(),
+                               {o.m, o.n, C.ptr, C.ld, dC.ptr, dC.ld}));
+        }
+        E.matrix(B, BLASMatrixOp::Scal, full, B.getFalse(),
+                 {o.m, o.n, o.beta, dC.ptr, dC.ld});
+      } else if (routine == "trsv") {
+        // The adjoint of the right hand side solves op(A)^T lambda = dx
+        Array A = primal(ArgA), dx = shadow(ArgX);
+        E.call(B, "trsv",
+               {E.uplo(B, o.upper), E.trans(B, B.CreateNot(o.trans)),
+                E.diag(B, o.unit), I(o.n), A.ptr, I(A.ld), dx.ptr,
+                I(dx.ld)});
+        if (activeA) {
+          // dA -= lambda x^T, or x lambda^T if transposed, on the triangle
+          Array x = primal(ArgX, /*post*/ true), dA = shadow(ArgA);
+          Value *lambda = allocate(B, o.n, nullptr);
+          E.call(B, "copy", {I(o.n), dx.ptr, I(dx.ld), lambda, I(one)});
+          Value *xs = allocate(B, o.n, nullptr);
+          E.call(B, "copy", {I(o.n), x.ptr, I(x.ld), xs, I(one)});
+          Value *tmp = allocate(B, o.n, o.n);
+          E.call(B, "gemm",
+                 {E.trans(B, B.getFalse()), E.trans(B, B.getTrue()), I(o.n),
+                  I(o.n), I(one), E.fp(B, 1.0),
+                  B.CreateSelect(o.trans, xs, lambda), I(o.n),
+                  B.CreateSelect(o.trans, lambda, xs), I(o.n), E.fp(B, 0.0),
+                  tmp, I(o.n)});
+          E.matrix(B, BLASMatrixOp::Axpy, shape(B, o, ArgA).tri, o.unit,
+                   {o.n, o.n, ConstantFP::get(fpType, -1.0), tmp, o.n,
+                    dA.ptr, dA.ld});
+          CreateDealloc(B, tmp);
+          CreateDealloc(B, xs);
+          CreateDealloc(B, lambda);
+        }
+      } else if (routine == "trsm") {
+        // The adjoint of the right hand side solves op(A)^T lambda = dX on
+        // the left, or lambda op(A)^T = dX on the right
+        Array A = primal(ArgA), dB = shadow(ArgB);
+        E.call(B, "trsm",
+               {E.side(B, o.left), E.uplo(B, o.upper),
+                E.trans(B, B.CreateNot(o.trans)), E.diag(B, o.unit), I(o.m),
+                I(o.n), E.fp(B, 1.0), A.ptr, I(A.ld), dB.ptr, I(dB.ld)});
+        if (activeA) {
+          // dA -= lambda X^T (left) or X^T lambda (right), or their
+          // transposes if A is transposed, on the triangle
+          Array X = primal(ArgB, /*post*/ true), dA = shadow(ArgA);
+          Value *dim = B.CreateSelect(o.left, o.m, o.n);
+          Value *firstX = B.CreateICmpEQ(o.trans, o.left);
+          Array u = select(firstX, X, dB), v = select(firstX, dB, X);
+          Value *tmp = allocate(B, dim, dim);
+          E.call(B, "gemm",
+                 {E.trans(B, B.CreateNot(o.left)), E.trans(B, o.left),
+                  I(dim), I(dim), I(B.CreateSelect(o.left, o.n, o.m)),
+                  E.fp(B, 1.0), u.ptr, I(u.ld), v.ptr, I(v.ld), E.fp(B, 0.0),
+                  tmp, I(dim)});
+          E.matrix(B, BLASMatrixOp::Axpy, shape(B, o, ArgA).tri, o.unit,
+                   {dim, dim, ConstantFP::get(fpType, -1.0), tmp, dim,
+                    dA.ptr, dA.ld});
+          CreateDealloc(B, tmp);
+        }
+        if (activeAlpha) {
+          Array Bm = primal(ArgB);
+          addToScalar(ArgAlpha,
+                      E.matrix(B, BLASMatrixOp::Dot, full, B.getFalse(),
+                               {o.m, o.n, Bm.ptr, Bm.ld, dB.ptr, dB.ld}));
+        }
+        E.matrix(B, BLASMatrixOp::Scal, full, B.getFalse(),
+                 {o.m, o.n, o.alpha, dB.ptr, dB.ld});
+      } else if (routine == "syrk") {
+        Array dC = shadow(ArgC);
+        Value *tri = shape(B, o, ArgC).tri;
+        if (activeA) {
+          // dA += alpha (dC + dC^T) op(A), applied as a symmetric product
+          // whose diagonal is temporarily doubled
+          Array A = primal(ArgA), dA = shadow(ArgA);
+          Value *diagInc = B.CreateAdd(dC.ld, one);
+          E.call(B, "scal",
+                 {I(o.n), E.fp(B, 2.0), dC.ptr, I(diagInc)});
+          E.call(B, "symm",
+                 {E.side(B, B.CreateNot(o.trans)), E.uplo(B, o.upper),
+                  I(B.CreateSelect(o.trans, o.k, o.n)),
+                  I(B.CreateSelect(o.trans, o.n, o.k)), E.fp(B, o.alpha),
+                  dC.ptr, I(dC.ld), A.ptr, I(A.ld), E.fp(B, 1.0), dA.ptr,
+                  I(dA.ld)});
+          E.call(B, "scal",
+                 {I(o.n), E.fp(B, 0.5), dC.ptr, I(diagInc)});
+        }
+        if (activeAlpha) {
+          Array A = primal(ArgA);
+          Value *tmp = allocate(B, o.n, o.n);
+          E.call(B, "syrk",
+                 {E.uplo(B, o.upper), E.trans(B, o.trans), I(o.n), I(o.k),
+                  E.fp(B, 1.0), A.ptr, I(A.ld), E.fp(B, 0.0), tmp, I(o.n)});
+          addToScalar(ArgAlpha,
+                      E.matrix(B, BLASMatrixOp::Dot, tri, B.getFalse(),
+                               {o.n, o.n, tmp, o.n, dC.ptr, dC.ld}));
+          CreateDealloc(B, tmp);
+        }
+        if (activeBeta) {
+          Array C = primal(ArgC);
+          addToScalar(ArgBeta,
+                      E.matrix(B, BLASMatrixOp::Dot, tri, B.getFalse(),
+                               {o.n, o.n, C.ptr, C.ld, dC.ptr, dC.ld}));
+        }
+        E.matrix(B, BLASMatrixOp::Scal, tri, B.getFalse(),
+                 {o.n, o.n, o.beta, dC.ptr, dC.ld});
+      }
+
+      if (shouldFree())
+        for (size_t i = 0; i < cached.size(); i++)
+          CreateDealloc(Builder2, fromTape(taped.size() + i));
+    }
+
+    if (Mode == DerivativeMode::ReverseModeGradient) {
+      eraseIfUnused(call, /*erase*/ true, /*check*/ false);
+    } else {
+      eraseIfUnused(call);
+    }
+    return true;
+  }
+
   void handleMPI(llvm::CallInst &call, Function *called, StringRef funcName) {
     assert(called);
     assert(gutils->getWidth() == 1);
@@ -6292,8 +7718,16 @@ public:
     BuilderZ.setFastMathFlags(getFast());
 
     // MPI send / recv can only send float/integers
+    // Persistent requests are recorded like their non-blocking counterparts,
+    // along with an adjoint persistent request which the reverse pass
+    // restarts for every start of the primal one.
     if (funcName == "PMPI_Isend" || funcName == "MPI_Isend" ||
-        funcName == "PMPI_Irecv" || funcName == "MPI_Irecv") {
+        funcName == "PMPI_Irecv" || funcName == "MPI_Irecv" ||
+        funcName == "MPI_Send_init" || funcName == "MPI_Recv_init") {
+      bool persistent =
+          funcName == "MPI_Send_init" || funcName == "MPI_Recv_init";
+      bool send = funcName == "MPI_Isend" || funcName == "PMPI_Isend" ||
+                  funcName == "MPI_Send_init";
       if (!gutils->isConstantInstruction(&call)) {
         if (Mode == DerivativeMode::ReverseModePrimal ||
             Mode == DerivativeMode::ReverseModeCombined) {
@@ -6308,10 +7742,32 @@ public:
 
           auto i64 = Type::getInt64Ty(call.getContext());
           auto impi = getMPIHelper(call.getContext());
-
-          Value *impialloc =
-              CreateAllocation(BuilderZ, impi, ConstantInt::get(i64, 1));
+          auto PT = getMPIPersistentHelper(
+              call.getContext(),
+              call.getOperand(6)->getType()->getPointerElementType());
+
+          Value *persistentalloc = nullptr;
+          Value *impialloc = nullptr;
+          if (persistent)
+            persistentalloc =
+                CreateAllocation(BuilderZ, PT, ConstantInt::get(i64, 1));
+          else
+            impialloc =
+                CreateAllocation(BuilderZ, impi, ConstantInt::get(i64, 1));
           BuilderZ.SetInsertPoint(gutils->getNewFromOriginal(&call));
+          auto persistentMember = [&](MPI_PersistentElem E) -> Value * {
+            Value *idxs[] = {
+                ConstantInt::get(i64, 0),
+                ConstantInt::get(Type::getInt32Ty(call.getContext()),
+                                 (uint64_t)E)};
+#if LLVM_VERSION_MAJOR > 7
+            return BuilderZ.CreateInBoundsGEP(PT, persistentalloc, idxs);
+#else
+            return BuilderZ.CreateInBoundsGEP(persistentalloc, idxs);
+#endif
+          };
+          if (persistent)
+            impialloc = persistentMember(MPI_PersistentElem::Helper);
 
           d_req = BuilderZ.CreateBitCast(
               d_req, PointerType::getUnqual(impialloc->getType()));
@@ -6326,7 +7782,7 @@ public:
               getMPIMemberPtr<MPI_Elem::Old>(BuilderZ, impialloc));
           BuilderZ.CreateStore(impialloc, d_req);
 
-          if (funcName == "MPI_Isend" || funcName == "PMPI_Isend") {
+          if (send) {
             Value *tysize =
                 MPI_TYPE_SIZE(gutils->getNewFromOriginal(call.getOperand(2)),
                               BuilderZ, call.getType());
@@ -6389,50 +7845,89 @@ public:
                                          Type::getInt8PtrTy(call.getContext())),
               getMPIMemberPtr<MPI_Elem::Comm>(BuilderZ, impialloc));
 
+          MPI_CallType CT = persistent ? (send ? MPI_CallType::PSEND
+                                               : MPI_CallType::PRECV)
+                                       : (send ? MPI_CallType::ISEND
+                                               : MPI_CallType::IRECV);
           BuilderZ.CreateStore(
-              ConstantInt::get(
-                  Type::getInt8Ty(impialloc->getContext()),
-                  (funcName == "MPI_Isend" || funcName == "PMPI_Isend")
-                      ? (int)MPI_CallType::ISEND
-                      : (int)MPI_CallType::IRECV),
+              ConstantInt::get(Type::getInt8Ty(impialloc->getContext()),
+                               (int)CT),
               getMPIMemberPtr<MPI_Elem::Call>(BuilderZ, impialloc));
           // TODO old
-        }
-        if (Mode == DerivativeMode::ReverseModeGradient ||
-            Mode == DerivativeMode::ReverseModeCombined) {
+
+          if (persistent) {
+            auto i8p = Type::getInt8PtrTy(call.getContext());
+            Value *shadow =
+                gutils->invertPointerM(call.getOperand(0), BuilderZ);
+            if (shadow->getType()->isIntegerTy())
+              shadow = BuilderZ.CreateIntToPtr(shadow, i8p);
+            BuilderZ.CreateStore(
+                BuilderZ.CreatePointerCast(shadow, i8p),
+                persistentMember(MPI_PersistentElem::Shadow));
+            Value *op = ConstantPointerNull::get(i8p);
+            if (send) {
+              ConcreteType CT = TR.firstPointer(1, call.getOperand(0));
+              op = BuilderZ.CreatePointerCast(
+                  getOrInsertOpFloatSum(*gutils->newFunc->getParent(),
+                                        PointerType::getUnqual(i8p), CT,
+                                        call.getType(), BuilderZ),
+                  i8p);
+            }
+            BuilderZ.CreateStore(op,
+                                 persistentMember(MPI_PersistentElem::Op));
+
+            // The adjoint of a persistent send is a persistent receive into
+            // the intermediate buffer, and vice versa from the shadow buffer
+            Value *buf;
+#if LLVM_VERSION_MAJOR > 7
+            buf = BuilderZ.CreateLoad(
+                i8p, getMPIMemberPtr<MPI_Elem::Buf>(BuilderZ, impialloc));
+#else
+            buf = BuilderZ.CreateLoad(
+                getMPIMemberPtr<MPI_Elem::Buf>(BuilderZ, impialloc));
+#endif
+            auto FT = call.getFunctionType();
+            if (FT->getParamType(0)->isIntegerTy())
+              buf = BuilderZ.CreatePtrToInt(buf, FT->getParamType(0));
+            else
+              buf = BuilderZ.CreatePointerCast(buf, FT->getParamType(0));
+            Value *args[] = {
+                /*buf*/ buf,
+                /*count*/ gutils->getNewFromOriginal(call.getOperand(1)),
+                /*datatype*/ gutils->getNewFromOriginal(call.getOperand(2)),
+                /*peer*/ gutils->getNewFromOriginal(call.getOperand(3)),
+                /*tag*/ gutils->getNewFromOriginal(call.getOperand(4)),
+                /*comm*/ gutils->getNewFromOriginal(call.getOperand(5)),
+                /*request*/
+                BuilderZ.CreatePointerCast(
+                    persistentMember(MPI_PersistentElem::Request),
+                    FT->getParamType(6)),
+            };
+            auto fcall = BuilderZ.CreateCall(
+                called->getParent()->getOrInsertFunction(
+                    send ? "MPI_Recv_init" : "MPI_Send_init", FT),
+                args);
+            fcall->setCallingConv(call.getCallingConv());
+          }
+        }
+        if ((Mode == DerivativeMode::ReverseModeGradient ||
+             Mode == DerivativeMode::ReverseModeCombined) &&
+            persistent) {
+          // Every start of the adjoint request has been completed by the
+          // reverse of the corresponding start, so it only remains to release
+          // it along with the bookkeeping.
           IRBuilder<> Builder2(call.getParent());
           getReverseBuilder(Builder2);
 
-          Type *statusType = nullptr;
-
-          if (Function *recvfn =
-                  called->getParent()->getFunction("PMPI_Wait")) {
-            auto statusArg = recvfn->arg_end();
-            statusArg--;
-            if (auto PT = dyn_cast<PointerType>(statusArg->getType()))
-              statusType = PT->getPointerElementType();
-          }
-          if (Function *recvfn = called->getParent()->getFunction("MPI_Wait")) {
-            auto statusArg = recvfn->arg_end();
-            statusArg--;
-            if (auto PT = dyn_cast<PointerType>(statusArg->getType()))
-              statusType = PT->getPointerElementType();
-          }
-          if (statusType == nullptr) {
-            statusType = ArrayType::get(Type::getInt8Ty(call.getContext()), 24);
-            llvm::errs() << " warning could not automatically determine mpi "
-                            "status type, assuming [24 x i8]\n";
-          }
-          Value *req =
-              lookup(gutils->getNewFromOriginal(call.getOperand(6)), Builder2);
+          auto i8p = Type::getInt8PtrTy(call.getContext());
           Value *d_req = lookup(
               gutils->invertPointerM(call.getOperand(6), Builder2), Builder2);
-          if (d_req->getType()->isIntegerTy()) {
-            d_req = Builder2.CreateIntToPtr(
-                d_req, Type::getInt8PtrTy(call.getContext()));
-          }
-          Type *helperTy =
-              llvm::PointerType::getUnqual(getMPIHelper(call.getContext()));
+          if (d_req->getType()->isIntegerTy())
+            d_req = Builder2.CreateIntToPtr(d_req, i8p);
+          auto PT = getMPIPersistentHelper(
+              call.getContext(),
+              call.getOperand(6)->getType()->getPointerElementType());
+          Type *helperTy = PointerType::getUnqual(PT);
           Value *helper = Builder2.CreatePointerCast(
               d_req, PointerType::getUnqual(helperTy));
 #if LLVM_VERSION_MAJOR > 7
@@ -6440,29 +7935,100 @@ public:
 #else
           helper = Builder2.CreateLoad(helper);
 #endif
-
-          auto i64 = Type::getInt64Ty(call.getContext());
-
-          Value *firstallocation;
+          Value *idxs[] = {
+              ConstantInt::get(Type::getInt64Ty(call.getContext()), 0),
+              ConstantInt::get(Type::getInt32Ty(call.getContext()),
+                               (int)MPI_PersistentElem::Helper)};
 #if LLVM_VERSION_MAJOR > 7
-          firstallocation = Builder2.CreateLoad(
-              Type::getInt8PtrTy(call.getContext()),
-              getMPIMemberPtr<MPI_Elem::Buf>(Builder2, helper));
+          Value *base = Builder2.CreateInBoundsGEP(PT, helper, idxs);
 #else
-          firstallocation = Builder2.CreateLoad(
-              getMPIMemberPtr<MPI_Elem::Buf>(Builder2, helper));
+          Value *base = Builder2.CreateInBoundsGEP(helper, idxs);
 #endif
-          Value *len_arg = nullptr;
-          if (auto C = dyn_cast<Constant>(
-                  gutils->getNewFromOriginal(call.getOperand(1)))) {
-            len_arg = Builder2.CreateZExtOrTrunc(C, i64);
-          } else {
+
+          Value *prev;
 #if LLVM_VERSION_MAJOR > 7
-            len_arg = Builder2.CreateLoad(
-                i64, getMPIMemberPtr<MPI_Elem::Count>(Builder2, helper));
+          prev = Builder2.CreateLoad(
+              i8p, getMPIMemberPtr<MPI_Elem::Old>(Builder2, base));
 #else
-            len_arg = Builder2.CreateLoad(
-                getMPIMemberPtr<MPI_Elem::Count>(Builder2, helper));
+          prev = Builder2.CreateLoad(
+              getMPIMemberPtr<MPI_Elem::Old>(Builder2, base));
+#endif
+          Builder2.CreateStore(
+              prev, Builder2.CreatePointerCast(
+                        d_req, PointerType::getUnqual(prev->getType())));
+
+          // int MPI_Request_free(MPI_Request *request)
+          idxs[1] = ConstantInt::get(Type::getInt32Ty(call.getContext()),
+                                     (int)MPI_PersistentElem::Request);
+#if LLVM_VERSION_MAJOR > 7
+          Value *adj_req = Builder2.CreateInBoundsGEP(PT, helper, idxs);
+#else
+          Value *adj_req = Builder2.CreateInBoundsGEP(helper, idxs);
+#endif
+          Type *types[] = {adj_req->getType()};
+          Builder2.CreateCall(
+              called->getParent()->getOrInsertFunction(
+                  "MPI_Request_free",
+                  FunctionType::get(call.getType(), types, false)),
+              adj_req);
+
+          if (send) {
+#if LLVM_VERSION_MAJOR > 7
+            Value *buf = Builder2.CreateLoad(
+                i8p, getMPIMemberPtr<MPI_Elem::Buf>(Builder2, base));
+#else
+            Value *buf = Builder2.CreateLoad(
+                getMPIMemberPtr<MPI_Elem::Buf>(Builder2, base));
+#endif
+            CreateDealloc(Builder2, buf);
+          }
+          CreateDealloc(Builder2, helper);
+        } else if (Mode == DerivativeMode::ReverseModeGradient ||
+                   Mode == DerivativeMode::ReverseModeCombined) {
+          IRBuilder<> Builder2(call.getParent());
+          getReverseBuilder(Builder2);
+
+          Type *statusType = MPI_STATUS_TYPE(*called->getParent());
+          Value *req =
+              lookup(gutils->getNewFromOriginal(call.getOperand(6)), Builder2);
+          Value *d_req = lookup(
+              gutils->invertPointerM(call.getOperand(6), Builder2), Builder2);
+          if (d_req->getType()->isIntegerTy()) {
+            d_req = Builder2.CreateIntToPtr(
+                d_req, Type::getInt8PtrTy(call.getContext()));
+          }
+          Type *helperTy =
+              llvm::PointerType::getUnqual(getMPIHelper(call.getContext()));
+          Value *helper = Builder2.CreatePointerCast(
+              d_req, PointerType::getUnqual(helperTy));
+#if LLVM_VERSION_MAJOR > 7
+          helper = Builder2.CreateLoad(helperTy, helper);
+#else
+          helper = Builder2.CreateLoad(helper);
+#endif
+
+          auto i64 = Type::getInt64Ty(call.getContext());
+
+          Value *firstallocation;
+#if LLVM_VERSION_MAJOR > 7
+          firstallocation = Builder2.CreateLoad(
+              Type::getInt8PtrTy(call.getContext()),
+              getMPIMemberPtr<MPI_Elem::Buf>(Builder2, helper));
+#else
+          firstallocation = Builder2.CreateLoad(
+              getMPIMemberPtr<MPI_Elem::Buf>(Builder2, helper));
+#endif
+          Value *len_arg = nullptr;
+          if (auto C = dyn_cast<Constant>(
+                  gutils->getNewFromOriginal(call.getOperand(1)))) {
+            len_arg = Builder2.CreateZExtOrTrunc(C, i64);
+          } else {
+#if LLVM_VERSION_MAJOR > 7
+            len_arg = Builder2.CreateLoad(
+                i64, getMPIMemberPtr<MPI_Elem::Count>(Builder2, helper));
+#else
+            len_arg = Builder2.CreateLoad(
+                getMPIMemberPtr<MPI_Elem::Count>(Builder2, helper));
 #endif
           }
           Value *tysize = nullptr;
@@ -6557,7 +8123,7 @@ public:
               Builder2.CreateZExtOrTrunc(
                   tysize, Type::getInt64Ty(Builder2.getContext())),
               "", true, true);
-          if (funcName == "MPI_Irecv" || funcName == "PMPI_Irecv") {
+          if (!send) {
             auto val_arg =
                 ConstantInt::get(Type::getInt8Ty(Builder2.getContext()), 0);
             auto volatile_arg = ConstantInt::getFalse(Builder2.getContext());
@@ -6578,7 +8144,7 @@ public:
                                           Intrinsic::memset, tys),
                 nargs, BufferDefs));
             memset->addParamAttr(0, Attribute::NonNull);
-          } else if (funcName == "MPI_Isend" || funcName == "PMPI_Isend") {
+          } else if (send) {
             assert(!gutils->isConstantValue(call.getOperand(0)));
             Value *shadow = lookup(
                 gutils->invertPointerM(call.getOperand(0), Builder2), Builder2);
@@ -6647,6 +8213,259 @@ public:
       return;
     }
 
+    // The adjoint of a non-blocking collective is begun at the reverse of
+    // its wait, and completed at the reverse of the collective itself.
+    // int MPI_Iallreduce(const void *sendbuf, void *recvbuf, int count,
+    //                    MPI_Datatype datatype, MPI_Op op, MPI_Comm comm,
+    //                    MPI_Request *request)
+    // int MPI_Ibcast(void *buffer, int count, MPI_Datatype datatype, int root,
+    //                MPI_Comm comm, MPI_Request *request)
+    if (funcName == "MPI_Iallreduce" || funcName == "MPI_Ibcast") {
+      bool bcast = funcName == "MPI_Ibcast";
+      unsigned bufIdx = bcast ? 0 : 1;
+      unsigned reqIdx = bcast ? 5 : 6;
+      if (!bcast)
+        checkMPISumOp(call, call.getOperand(4));
+
+      if (Mode == DerivativeMode::ForwardMode) {
+        IRBuilder<> Builder2(&call);
+        getForwardBuilder(Builder2);
+
+        SmallVector<Value *, 7> args;
+        SmallVector<ValueType, 7> types;
+        for (unsigned i = 0; i < call.arg_size(); i++) {
+          Value *arg = call.getArgOperand(i);
+          bool shadow = i == reqIdx || i == bufIdx || (!bcast && i == 0);
+          args.push_back(shadow ? gutils->invertPointerM(arg, Builder2)
+                                : gutils->getNewFromOriginal(arg));
+          types.push_back(shadow ? ValueType::Shadow : ValueType::Primal);
+        }
+        auto Defs = gutils->getInvertedBundles(&call, types, Builder2,
+                                               /*lookup*/ false);
+
+#if LLVM_VERSION_MAJOR >= 11
+        auto callval = call.getCalledOperand();
+#else
+        auto callval = call.getCalledValue();
+#endif
+
+#if LLVM_VERSION_MAJOR > 7
+        Builder2.CreateCall(call.getFunctionType(), callval, args, Defs);
+#else
+        Builder2.CreateCall(callval, args, Defs);
+#endif
+        return;
+      }
+
+      if (Mode == DerivativeMode::ReverseModePrimal ||
+          Mode == DerivativeMode::ReverseModeCombined) {
+        Value *d_req =
+            gutils->invertPointerM(call.getOperand(reqIdx), BuilderZ);
+        if (d_req->getType()->isIntegerTy()) {
+          d_req = BuilderZ.CreateIntToPtr(
+              d_req,
+              PointerType::getUnqual(Type::getInt8PtrTy(call.getContext())));
+        }
+
+        auto i64 = Type::getInt64Ty(call.getContext());
+        auto i8p = Type::getInt8PtrTy(call.getContext());
+        auto impi = getMPIHelper(call.getContext());
+
+        Value *impialloc =
+            CreateAllocation(BuilderZ, impi, ConstantInt::get(i64, 1));
+        BuilderZ.SetInsertPoint(gutils->getNewFromOriginal(&call));
+
+        d_req = BuilderZ.CreateBitCast(
+            d_req, PointerType::getUnqual(impialloc->getType()));
+#if LLVM_VERSION_MAJOR > 7
+        Value *d_req_prev = BuilderZ.CreateLoad(impialloc->getType(), d_req);
+#else
+        Value *d_req_prev = BuilderZ.CreateLoad(d_req);
+#endif
+        BuilderZ.CreateStore(
+            BuilderZ.CreatePointerCast(d_req_prev, i8p),
+            getMPIMemberPtr<MPI_Elem::Old>(BuilderZ, impialloc));
+        BuilderZ.CreateStore(impialloc, d_req);
+
+        auto toI8P = [&](Value *V) {
+          if (V->getType()->isIntegerTy())
+            return BuilderZ.CreateIntToPtr(V, i8p);
+          return BuilderZ.CreatePointerCast(V, i8p);
+        };
+        auto toI64 = [&](Value *V) {
+          if (V->getType()->isIntegerTy())
+            return BuilderZ.CreateZExtOrTrunc(V, i64);
+          return BuilderZ.CreatePtrToInt(V, i64);
+        };
+
+        // The shadow buffer is reduced in place by the adjoint
+        BuilderZ.CreateStore(
+            toI8P(gutils->invertPointerM(call.getOperand(bufIdx), BuilderZ)),
+            getMPIMemberPtr<MPI_Elem::Buf>(BuilderZ, impialloc));
+        BuilderZ.CreateStore(
+            toI64(gutils->getNewFromOriginal(call.getOperand(bufIdx + 1))),
+            getMPIMemberPtr<MPI_Elem::Count>(BuilderZ, impialloc));
+        BuilderZ.CreateStore(
+            toI8P(gutils->getNewFromOriginal(call.getOperand(bufIdx + 2))),
+            getMPIMemberPtr<MPI_Elem::DataType>(BuilderZ, impialloc));
+
+        // The root of a broadcast is held in place of the source, and the
+        // (sum) reduction operator in place of the tag
+        Value *root = bcast ? gutils->getNewFromOriginal(call.getOperand(3))
+                            : ConstantInt::get(i64, 0);
+        BuilderZ.CreateStore(
+            toI64(root), getMPIMemberPtr<MPI_Elem::Src>(BuilderZ, impialloc));
+
+        Value *op;
+        if (bcast) {
+          ConcreteType CT = TR.firstPointer(1, call.getOperand(0));
+          op = getOrInsertOpFloatSum(
+              *gutils->newFunc->getParent(), PointerType::getUnqual(i8p), CT,
+              root->getType(), BuilderZ);
+        } else
+          op = gutils->getNewFromOriginal(call.getOperand(4));
+        BuilderZ.CreateStore(
+            toI64(op), getMPIMemberPtr<MPI_Elem::Tag>(BuilderZ, impialloc));
+
+        BuilderZ.CreateStore(
+            toI8P(gutils->getNewFromOriginal(call.getOperand(reqIdx - 1))),
+            getMPIMemberPtr<MPI_Elem::Comm>(BuilderZ, impialloc));
+
+        BuilderZ.CreateStore(
+            ConstantInt::get(Type::getInt8Ty(call.getContext()),
+                             bcast ? (int)MPI_CallType::IBCAST
+                                   : (int)MPI_CallType::IALLREDUCE),
+            getMPIMemberPtr<MPI_Elem::Call>(BuilderZ, impialloc));
+      }
+
+      if (Mode == DerivativeMode::ReverseModeGradient ||
+          Mode == DerivativeMode::ReverseModeCombined) {
+        IRBuilder<> Builder2(call.getParent());
+        getReverseBuilder(Builder2);
+
+        Value *req = lookup(
+            gutils->getNewFromOriginal(call.getOperand(reqIdx)), Builder2);
+        Value *d_req = lookup(
+            gutils->invertPointerM(call.getOperand(reqIdx), Builder2),
+            Builder2);
+        if (d_req->getType()->isIntegerTy()) {
+          d_req = Builder2.CreateIntToPtr(
+              d_req, Type::getInt8PtrTy(call.getContext()));
+        }
+        Type *helperTy =
+            llvm::PointerType::getUnqual(getMPIHelper(call.getContext()));
+        Value *helper = Builder2.CreatePointerCast(
+            d_req, PointerType::getUnqual(helperTy));
+#if LLVM_VERSION_MAJOR > 7
+        helper = Builder2.CreateLoad(helperTy, helper);
+#else
+        helper = Builder2.CreateLoad(helper);
+#endif
+
+        auto i64 = Type::getInt64Ty(call.getContext());
+        auto i8p = Type::getInt8PtrTy(call.getContext());
+
+#if LLVM_VERSION_MAJOR > 7
+        Value *shadow = Builder2.CreateLoad(
+            i8p, getMPIMemberPtr<MPI_Elem::Buf>(Builder2, helper));
+        Value *len_arg = Builder2.CreateLoad(
+            i64, getMPIMemberPtr<MPI_Elem::Count>(Builder2, helper));
+        Value *datatype = Builder2.CreateLoad(
+            i8p, getMPIMemberPtr<MPI_Elem::DataType>(Builder2, helper));
+        Value *prev = Builder2.CreateLoad(
+            i8p, getMPIMemberPtr<MPI_Elem::Old>(Builder2, helper));
+#else
+        Value *shadow = Builder2.CreateLoad(
+            getMPIMemberPtr<MPI_Elem::Buf>(Builder2, helper));
+        Value *len_arg = Builder2.CreateLoad(
+            getMPIMemberPtr<MPI_Elem::Count>(Builder2, helper));
+        Value *datatype = Builder2.CreateLoad(
+            getMPIMemberPtr<MPI_Elem::DataType>(Builder2, helper));
+        Value *prev = Builder2.CreateLoad(
+            getMPIMemberPtr<MPI_Elem::Old>(Builder2, helper));
+#endif
+        Builder2.CreateStore(
+            prev, Builder2.CreatePointerCast(
+                      d_req, PointerType::getUnqual(prev->getType())));
+
+        len_arg = Builder2.CreateMul(
+            len_arg,
+            Builder2.CreateZExtOrTrunc(
+                MPI_TYPE_SIZE(datatype, Builder2, call.getType()), i64),
+            "", true, true);
+
+        MPI_WAIT(req, Builder2, call.getType());
+
+        // Need to preserve the shadow buffers.
+        SmallVector<ValueType, 7> types(call.arg_size(), ValueType::None);
+        types[0] = types[bufIdx] = ValueType::Shadow;
+        auto BufferDefs =
+            gutils->getInvertedBundles(&call, types, Builder2, /*lookup*/ true);
+
+        if (bcast) {
+          // Only the root holds the reduced adjoint, zero the others
+          Value *orig_root = call.getOperand(3);
+          Value *orig_comm = call.getOperand(4);
+#if LLVM_VERSION_MAJOR > 7
+          Value *root = Builder2.CreateLoad(
+              i64, getMPIMemberPtr<MPI_Elem::Src>(Builder2, helper));
+          Value *comm = Builder2.CreateLoad(
+              i8p, getMPIMemberPtr<MPI_Elem::Comm>(Builder2, helper));
+#else
+          Value *root = Builder2.CreateLoad(
+              getMPIMemberPtr<MPI_Elem::Src>(Builder2, helper));
+          Value *comm = Builder2.CreateLoad(
+              getMPIMemberPtr<MPI_Elem::Comm>(Builder2, helper));
+#endif
+          root = Builder2.CreateTrunc(root, orig_root->getType());
+          if (orig_comm->getType()->isIntegerTy())
+            comm = Builder2.CreatePtrToInt(comm, orig_comm->getType());
+          else
+            comm = Builder2.CreatePointerCast(comm, orig_comm->getType());
+          Value *rank = MPI_COMM_RANK(comm, Builder2, root->getType());
+
+          BasicBlock *currentBlock = Builder2.GetInsertBlock();
+          BasicBlock *nonrootBlock = gutils->addReverseBlock(
+              currentBlock, currentBlock->getName() + "_nonroot",
+              gutils->newFunc);
+          BasicBlock *mergeBlock = gutils->addReverseBlock(
+              nonrootBlock, currentBlock->getName() + "_post", gutils->newFunc);
+
+          Builder2.CreateCondBr(Builder2.CreateICmpEQ(rank, root), mergeBlock,
+                                nonrootBlock);
+
+          Builder2.SetInsertPoint(nonrootBlock);
+          auto val_arg =
+              ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
+          auto volatile_arg = ConstantInt::getFalse(call.getContext());
+          Value *args[] = {shadow, val_arg, len_arg, volatile_arg};
+          Type *tys[] = {args[0]->getType(), args[2]->getType()};
+          auto memset = cast<CallInst>(Builder2.CreateCall(
+              Intrinsic::getDeclaration(gutils->newFunc->getParent(),
+                                        Intrinsic::memset, tys),
+              args, BufferDefs));
+          memset->addParamAttr(0, Attribute::NonNull);
+          Builder2.CreateBr(mergeBlock);
+
+          Builder2.SetInsertPoint(mergeBlock);
+        } else {
+          // diff(sendbuffer) += diff(recvbuffer), zeroing the latter
+          Value *shadow_sendbuf = lookup(
+              gutils->invertPointerM(call.getOperand(0), Builder2), Builder2);
+          if (shadow_sendbuf->getType()->isIntegerTy())
+            shadow_sendbuf = Builder2.CreateIntToPtr(shadow_sendbuf, i8p);
+          DifferentiableMemCopyFloats(call, call.getOperand(0), shadow,
+                                      shadow_sendbuf, len_arg, Builder2,
+                                      BufferDefs);
+        }
+
+        CreateDealloc(Builder2, helper);
+      }
+      if (Mode == DerivativeMode::ReverseModeGradient)
+        eraseIfUnused(call, /*erase*/ true, /*check*/ false);
+      return;
+    }
+
     if (funcName == "MPI_Wait" || funcName == "PMPI_Wait") {
       Value *d_reqp = nullptr;
       auto impi = getMPIHelper(call.getContext());
@@ -6742,9 +8561,10 @@ public:
             getMPIMemberPtr<MPI_Elem::Tag, false>(Builder2, cache),
             getMPIMemberPtr<MPI_Elem::Comm, false>(Builder2, cache),
             getMPIMemberPtr<MPI_Elem::Call, false>(Builder2, cache),
-            req};
-        Type *types[sizeof(args) / sizeof(*args) - 1];
-        for (size_t i = 0; i < sizeof(args) / sizeof(*args) - 1; i++)
+            req,
+            d_reqp};
+        Type *types[sizeof(args) / sizeof(*args) - 2];
+        for (size_t i = 0; i < sizeof(args) / sizeof(*args) - 2; i++)
           types[i] = args[i]->getType();
         Function *dwait = getOrInsertDifferentialMPI_Wait(
             *called->getParent(), types, call.getOperand(0)->getType());
@@ -6935,9 +8755,10 @@ public:
             getMPIMemberPtr<MPI_Elem::Tag, false>(Builder2, cache),
             getMPIMemberPtr<MPI_Elem::Comm, false>(Builder2, cache),
             getMPIMemberPtr<MPI_Elem::Call, false>(Builder2, cache),
-            req};
-        Type *types[sizeof(args) / sizeof(*args) - 1];
-        for (size_t i = 0; i < sizeof(args) / sizeof(*args) - 1; i++)
+            req,
+            d_req};
+        Type *types[sizeof(args) / sizeof(*args) - 2];
+        for (size_t i = 0; i < sizeof(args) / sizeof(*args) - 2; i++)
           types[i] = args[i]->getType();
         Function *dwait = getOrInsertDifferentialMPI_Wait(
             *called->getParent(), types, req->getType());
@@ -6980,12 +8801,13 @@ public:
         }
       } else if (Mode == DerivativeMode::ForwardMode) {
         IRBuilder<> Builder2(&call);
+        getForwardBuilder(Builder2);
 
         assert(!gutils->isConstantValue(call.getOperand(1)));
 
         Value *count = gutils->getNewFromOriginal(call.getOperand(0));
-        Value *array_of_requests = gutils->invertPointerM(
-            gutils->getNewFromOriginal(call.getOperand(1)), Builder2);
+        Value *array_of_requests =
+            gutils->invertPointerM(call.getOperand(1), Builder2);
         if (array_of_requests->getType()->isIntegerTy()) {
           array_of_requests = Builder2.CreateIntToPtr(
               array_of_requests,
@@ -6995,13 +8817,184 @@ public:
         Value *args[] = {
             /*count*/ count,
             /*array_of_requests*/ array_of_requests,
+            /*array_of_statuses*/
+            gutils->getNewFromOriginal(call.getOperand(2)),
         };
 
         auto Defs = gutils->getInvertedBundles(
-            &call,
-            {ValueType::None, ValueType::None, ValueType::None, ValueType::None,
-             ValueType::None, ValueType::None, ValueType::Shadow},
-            Builder2, /*lookup*/ true);
+            &call, {ValueType::Primal, ValueType::Shadow, ValueType::Primal},
+            Builder2, /*lookup*/ false);
+
+#if LLVM_VERSION_MAJOR >= 11
+        auto callval = call.getCalledOperand();
+#else
+        auto callval = call.getCalledValue();
+#endif
+
+#if LLVM_VERSION_MAJOR > 7
+        Builder2.CreateCall(call.getFunctionType(), callval, args, Defs);
+#else
+        Builder2.CreateCall(callval, args, Defs);
+#endif
+        return;
+      }
+      if (Mode == DerivativeMode::ReverseModeGradient)
+        eraseIfUnused(call, /*erase*/ true, /*check*/ false);
+      return;
+    }
+
+    // The reverse of a start completes the adjoint persistent request that
+    // the reverse of the matching wait restarted, and accumulates its result.
+    if (funcName == "MPI_Start" || funcName == "MPI_Startall") {
+      bool all = funcName == "MPI_Startall";
+      // int MPI_Start(MPI_Request *request)
+      // int MPI_Startall(int count, MPI_Request array_of_requests[])
+      Value *orig_req = call.getOperand(all ? 1 : 0);
+      Value *d_reqp = nullptr;
+      auto impi = getMPIHelper(call.getContext());
+      Type *helpersTy = PointerType::getUnqual(impi);
+      if (all)
+        helpersTy = PointerType::getUnqual(helpersTy);
+      if (Mode == DerivativeMode::ReverseModePrimal ||
+          Mode == DerivativeMode::ReverseModeCombined) {
+        Value *req = gutils->getNewFromOriginal(orig_req);
+        Value *d_req = gutils->invertPointerM(orig_req, BuilderZ);
+
+        if (req->getType()->isIntegerTy()) {
+          req = BuilderZ.CreateIntToPtr(
+              req,
+              PointerType::getUnqual(Type::getInt8PtrTy(call.getContext())));
+        }
+
+        if (d_req->getType()->isIntegerTy()) {
+          d_req = BuilderZ.CreateIntToPtr(
+              d_req,
+              PointerType::getUnqual(Type::getInt8PtrTy(call.getContext())));
+        }
+
+        if (all) {
+          Value *count = gutils->getNewFromOriginal(call.getOperand(0));
+          Function *dsave = getOrInsertDifferentialWaitallSave(
+              *gutils->oldFunc->getParent(),
+              {count->getType(), req->getType(), d_req->getType()},
+              PointerType::getUnqual(impi));
+
+          d_reqp = BuilderZ.CreateCall(dsave, {count, req, d_req});
+          cast<CallInst>(d_reqp)->setCallingConv(dsave->getCallingConv());
+          cast<CallInst>(d_reqp)->setDebugLoc(
+              gutils->getNewFromOriginal(call.getDebugLoc()));
+        } else {
+#if LLVM_VERSION_MAJOR > 7
+          d_reqp = BuilderZ.CreateLoad(
+              helpersTy,
+              BuilderZ.CreatePointerCast(d_req,
+                                         PointerType::getUnqual(helpersTy)));
+#else
+          d_reqp = BuilderZ.CreateLoad(BuilderZ.CreatePointerCast(
+              d_req, PointerType::getUnqual(helpersTy)));
+#endif
+          if (auto I = dyn_cast<Instruction>(d_reqp))
+            gutils->TapesToPreventRecomputation.insert(I);
+        }
+        d_reqp = gutils->cacheForReverse(BuilderZ, d_reqp,
+                                         getIndex(&call, CacheType::Tape));
+      }
+      if (Mode == DerivativeMode::ReverseModeGradient ||
+          Mode == DerivativeMode::ReverseModeCombined) {
+        IRBuilder<> Builder2(call.getParent());
+        getReverseBuilder(Builder2);
+
+        assert(!gutils->isConstantValue(orig_req));
+        if (Mode != DerivativeMode::ReverseModeCombined) {
+          d_reqp = BuilderZ.CreatePHI(helpersTy, 0);
+          d_reqp = gutils->cacheForReverse(BuilderZ, d_reqp,
+                                           getIndex(&call, CacheType::Tape));
+        } else
+          assert(d_reqp);
+        d_reqp = lookup(d_reqp, Builder2);
+
+        Module &M = *called->getParent();
+        Type *reqType = orig_req->getType()->getPointerElementType();
+        Function *dstart;
+        SmallVector<Value *, 2> args;
+        if (all) {
+          Value *count =
+              lookup(gutils->getNewFromOriginal(call.getOperand(0)), Builder2);
+          dstart = getOrInsertDifferentialMPI_Startall(
+              M, count->getType(), reqType, MPI_STATUS_TYPE(M));
+          args.push_back(count);
+        } else
+          dstart =
+              getOrInsertDifferentialMPI_Start(M, reqType, MPI_STATUS_TYPE(M));
+        args.push_back(d_reqp);
+
+        // Need to preserve the shadow requests. As with the waits, the
+        // function is force inlined to preserve the underlying buffers.
+        SmallVector<ValueType, 2> types(call.arg_size(), ValueType::None);
+        types.back() = ValueType::Shadow;
+        auto cal = Builder2.CreateCall(
+            dstart, args,
+            gutils->getInvertedBundles(&call, types, Builder2,
+                                       /*lookup*/ true));
+        cal->setCallingConv(dstart->getCallingConv());
+        cal->setDebugLoc(gutils->getNewFromOriginal(call.getDebugLoc()));
+#if LLVM_VERSION_MAJOR >= 14
+        cal->addFnAttr(Attribute::AlwaysInline);
+#else
+        cal->addAttribute(AttributeList::FunctionIndex,
+                          Attribute::AlwaysInline);
+#endif
+        if (all && shouldFree()) {
+          CreateDealloc(Builder2, d_reqp);
+        }
+      } else if (Mode == DerivativeMode::ForwardMode) {
+        IRBuilder<> Builder2(&call);
+        getForwardBuilder(Builder2);
+
+        assert(!gutils->isConstantValue(orig_req));
+
+        SmallVector<Value *, 2> args;
+        SmallVector<ValueType, 2> types;
+        if (all) {
+          args.push_back(gutils->getNewFromOriginal(call.getOperand(0)));
+          types.push_back(ValueType::Primal);
+        }
+        args.push_back(gutils->invertPointerM(orig_req, Builder2));
+        types.push_back(ValueType::Shadow);
+
+        auto Defs = gutils->getInvertedBundles(&call, types, Builder2,
+                                               /*lookup*/ false);
+
+#if LLVM_VERSION_MAJOR >= 11
+        auto callval = call.getCalledOperand();
+#else
+        auto callval = call.getCalledValue();
+#endif
+
+#if LLVM_VERSION_MAJOR > 7
+        Builder2.CreateCall(call.getFunctionType(), callval, args, Defs);
+#else
+        Builder2.CreateCall(callval, args, Defs);
+#endif
+        return;
+      }
+      if (Mode == DerivativeMode::ReverseModeGradient)
+        eraseIfUnused(call, /*erase*/ true, /*check*/ false);
+      return;
+    }
+
+    // Freeing a persistent request leaves its bookkeeping in place for the
+    // reverse pass, which releases it at the reverse of its creation.
+    if (funcName == "MPI_Request_free") {
+      if (Mode == DerivativeMode::ForwardMode) {
+        IRBuilder<> Builder2(&call);
+        getForwardBuilder(Builder2);
+
+        Value *args[] = {
+            gutils->invertPointerM(call.getArgOperand(0), Builder2)};
+
+        auto Defs = gutils->getInvertedBundles(&call, {ValueType::Shadow},
+                                               Builder2, /*lookup*/ false);
 
 #if LLVM_VERSION_MAJOR >= 11
         auto callval = call.getCalledOperand();
@@ -7403,83 +9396,78 @@ public:
             Builder2, /*lookup*/ true);
 
         // 2. reduce sum diff(buffer) into intermediate
-        {
-          // int MPI_Reduce(const void *sendbuf, void *recvbuf, int count,
-          // MPI_Datatype datatype,
-          //     MPI_Op op, int root, MPI_Comm comm)
-          Value *args[] = {
-              /*sendbuf*/ shadow,
-              /*recvbuf*/ buf,
-              /*count*/ count,
-              /*datatype*/ datatype,
-              /*op (MPI_SUM)*/
-              getOrInsertOpFloatSum(*gutils->newFunc->getParent(),
-                                    MPI_OP_Ptr_type, CT, root->getType(),
-                                    Builder2),
-              /*int root*/ root,
-              /*comm*/ comm,
-          };
-          Type *types[sizeof(args) / sizeof(*args)];
-          for (size_t i = 0; i < sizeof(args) / sizeof(*args); i++)
-            types[i] = args[i]->getType();
-
-          FunctionType *FT = FunctionType::get(call.getType(), types, false);
-
-          Builder2.CreateCall(
-              called->getParent()->getOrInsertFunction("MPI_Reduce", FT), args,
-              BufferDefs);
-        }
+        // int MPI_Reduce(const void *sendbuf, void *recvbuf, int count,
+        // MPI_Datatype datatype,
+        //     MPI_Op op, int root, MPI_Comm comm)
+        Value *args[] = {
+            /*sendbuf*/ shadow,
+            /*recvbuf*/ buf,
+            /*count*/ count,
+            /*datatype*/ datatype,
+            /*op (MPI_SUM)*/
+            getOrInsertOpFloatSum(*gutils->newFunc->getParent(),
+                                  MPI_OP_Ptr_type, CT, root->getType(),
+                                  Builder2),
+            /*int root*/ root,
+            /*comm*/ comm,
+        };
 
-        // 3. if root, set shadow(buffer) = intermediate [memcpy]
-        BasicBlock *currentBlock = Builder2.GetInsertBlock();
-        BasicBlock *rootBlock = gutils->addReverseBlock(
-            currentBlock, currentBlock->getName() + "_root", gutils->newFunc);
-        BasicBlock *nonrootBlock = gutils->addReverseBlock(
-            rootBlock, currentBlock->getName() + "_nonroot", gutils->newFunc);
-        BasicBlock *mergeBlock = gutils->addReverseBlock(
-            nonrootBlock, currentBlock->getName() + "_post", gutils->newFunc);
+        auto finish = [=, &call](IRBuilder<> &Builder2) {
+          // 3. if root, set shadow(buffer) = intermediate [memcpy]
+          BasicBlock *currentBlock = Builder2.GetInsertBlock();
+          BasicBlock *rootBlock = gutils->addReverseBlock(
+              currentBlock, currentBlock->getName() + "_root", gutils->newFunc);
+          BasicBlock *nonrootBlock = gutils->addReverseBlock(
+              rootBlock, currentBlock->getName() + "_nonroot", gutils->newFunc);
+          BasicBlock *mergeBlock = gutils->addReverseBlock(
+              nonrootBlock, currentBlock->getName() + "_post", gutils->newFunc);
 
-        Builder2.CreateCondBr(Builder2.CreateICmpEQ(rank, root), rootBlock,
-                              nonrootBlock);
+          Builder2.CreateCondBr(Builder2.CreateICmpEQ(rank, root), rootBlock,
+                                nonrootBlock);
 
-        Builder2.SetInsertPoint(rootBlock);
+          Builder2.SetInsertPoint(rootBlock);
 
-        {
-          auto volatile_arg = ConstantInt::getFalse(call.getContext());
-          Value *nargs[] = {shadow, buf, len_arg, volatile_arg};
+          {
+            auto volatile_arg = ConstantInt::getFalse(call.getContext());
+            Value *nargs[] = {shadow, buf, len_arg, volatile_arg};
 
-          Type *tys[] = {shadow->getType(), buf->getType(), len_arg->getType()};
+            Type *tys[] = {shadow->getType(), buf->getType(),
+                           len_arg->getType()};
 
-          auto memcpyF = Intrinsic::getDeclaration(gutils->newFunc->getParent(),
-                                                   Intrinsic::memcpy, tys);
+            auto memcpyF = Intrinsic::getDeclaration(
+                gutils->newFunc->getParent(), Intrinsic::memcpy, tys);
 
-          auto mem =
-              cast<CallInst>(Builder2.CreateCall(memcpyF, nargs, BufferDefs));
-          mem->setCallingConv(memcpyF->getCallingConv());
+            auto mem =
+                cast<CallInst>(Builder2.CreateCall(memcpyF, nargs, BufferDefs));
+            mem->setCallingConv(memcpyF->getCallingConv());
 
-          // Free up the memory of the buffer
-          if (shouldFree()) {
-            CreateDealloc(Builder2, buf);
+            // Free up the memory of the buffer
+            if (shouldFree()) {
+              CreateDealloc(Builder2, buf);
+            }
           }
-        }
 
-        Builder2.CreateBr(mergeBlock);
+          Builder2.CreateBr(mergeBlock);
 
-        Builder2.SetInsertPoint(nonrootBlock);
+          Builder2.SetInsertPoint(nonrootBlock);
 
-        // 3-e. else, set shadow(buffer) = 0 [memset]
-        auto val_arg = ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
-        auto volatile_arg = ConstantInt::getFalse(call.getContext());
-        Value *args[] = {shadow, val_arg, len_arg, volatile_arg};
-        Type *tys[] = {args[0]->getType(), args[2]->getType()};
-        auto memset = cast<CallInst>(Builder2.CreateCall(
-            Intrinsic::getDeclaration(gutils->newFunc->getParent(),
-                                      Intrinsic::memset, tys),
-            args, BufferDefs));
-        memset->addParamAttr(0, Attribute::NonNull);
-        Builder2.CreateBr(mergeBlock);
+          // 3-e. else, set shadow(buffer) = 0 [memset]
+          auto val_arg =
+              ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
+          auto volatile_arg = ConstantInt::getFalse(call.getContext());
+          Value *args[] = {shadow, val_arg, len_arg, volatile_arg};
+          Type *tys[] = {args[0]->getType(), args[2]->getType()};
+          auto memset = cast<CallInst>(Builder2.CreateCall(
+              Intrinsic::getDeclaration(gutils->newFunc->getParent(),
+                                        Intrinsic::memset, tys),
+              args, BufferDefs));
+          memset->addParamAttr(0, Attribute::NonNull);
+          Builder2.CreateBr(mergeBlock);
 
-        Builder2.SetInsertPoint(mergeBlock);
+          Builder2.SetInsertPoint(mergeBlock);
+        };
+        createMPIAdjointCollective(call, Builder2, "MPI_Reduce", args,
+                                   BufferDefs, {call.getOperand(0)}, finish);
       }
       if (Mode == DerivativeMode::ReverseModeGradient)
         eraseIfUnused(call, /*erase*/ true, /*check*/ false);
@@ -7523,37 +9511,7 @@ public:
         Value *orig_root = call.getOperand(5);
         Value *orig_comm = call.getOperand(6);
 
-        bool isSum = false;
-        if (Constant *C = dyn_cast<Constant>(orig_op)) {
-          while (ConstantExpr *CE = dyn_cast<ConstantExpr>(C)) {
-            C = CE->getOperand(0);
-          }
-          if (auto GV = dyn_cast<GlobalVariable>(C)) {
-            if (GV->getName() == "ompi_mpi_op_sum") {
-              isSum = true;
-            }
-          }
-          // MPICH
-          if (ConstantInt *CI = dyn_cast<ConstantInt>(C)) {
-            if (CI->getValue() == 1476395011) {
-              isSum = true;
-            }
-          }
-        }
-        if (!isSum) {
-          std::string s;
-          llvm::raw_string_ostream ss(s);
-          ss << *gutils->oldFunc << "\n";
-          ss << *gutils->newFunc << "\n";
-          ss << " call: " << call << "\n";
-          ss << " unhandled mpi_allreduce op: " << *orig_op << "\n";
-          if (CustomErrorHandler) {
-            CustomErrorHandler(ss.str().c_str(), wrap(&call),
-                               ErrorType::NoDerivative, nullptr);
-          }
-          llvm::errs() << ss.str() << "\n";
-          report_fatal_error("unhandled mpi_allreduce op");
-        }
+        checkMPISumOp(call, orig_op);
 
         Value *shadow_recvbuf = gutils->invertPointerM(orig_recvbuf, Builder2);
         if (!forwardMode)
@@ -7681,63 +9639,59 @@ public:
         }
 
         // 2. MPI_Bcast intermediate to all
-        {
-          // int MPI_Bcast( void *buffer, int count, MPI_Datatype datatype, int
-          // root,
-          //     MPI_Comm comm )
-          Value *args[] = {
-              /*buf*/ buf,
-              /*count*/ count,
-              /*datatype*/ datatype,
-              /*int root*/ root,
-              /*comm*/ comm,
-          };
-          Type *types[sizeof(args) / sizeof(*args)];
-          for (size_t i = 0; i < sizeof(args) / sizeof(*args); i++)
-            types[i] = args[i]->getType();
-
-          FunctionType *FT = FunctionType::get(call.getType(), types, false);
-          Builder2.CreateCall(
-              called->getParent()->getOrInsertFunction("MPI_Bcast", FT), args,
-              BufferDefs);
-        }
+        // int MPI_Bcast( void *buffer, int count, MPI_Datatype datatype, int
+        // root,
+        //     MPI_Comm comm )
+        Value *args[] = {
+            /*buf*/ buf,
+            /*count*/ count,
+            /*datatype*/ datatype,
+            /*int root*/ root,
+            /*comm*/ comm,
+        };
 
-        // 3. if root, Zero diff(recvbuffer) [memset to 0]
-        {
-          BasicBlock *currentBlock = Builder2.GetInsertBlock();
-          BasicBlock *rootBlock = gutils->addReverseBlock(
-              currentBlock, currentBlock->getName() + "_root", gutils->newFunc);
-          BasicBlock *mergeBlock = gutils->addReverseBlock(
-              rootBlock, currentBlock->getName() + "_post", gutils->newFunc);
+        auto finish = [=, &call](IRBuilder<> &Builder2) {
+          // 3. if root, Zero diff(recvbuffer) [memset to 0]
+          {
+            BasicBlock *currentBlock = Builder2.GetInsertBlock();
+            BasicBlock *rootBlock = gutils->addReverseBlock(
+                currentBlock, currentBlock->getName() + "_root",
+                gutils->newFunc);
+            BasicBlock *mergeBlock = gutils->addReverseBlock(
+                rootBlock, currentBlock->getName() + "_post", gutils->newFunc);
 
-          Builder2.CreateCondBr(Builder2.CreateICmpEQ(rank, root), rootBlock,
-                                mergeBlock);
+            Builder2.CreateCondBr(Builder2.CreateICmpEQ(rank, root), rootBlock,
+                                  mergeBlock);
 
-          Builder2.SetInsertPoint(rootBlock);
+            Builder2.SetInsertPoint(rootBlock);
 
-          auto val_arg =
-              ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
-          auto volatile_arg = ConstantInt::getFalse(call.getContext());
-          Value *args[] = {shadow_recvbuf, val_arg, len_arg, volatile_arg};
-          Type *tys[] = {args[0]->getType(), args[2]->getType()};
-          auto memset = cast<CallInst>(Builder2.CreateCall(
-              Intrinsic::getDeclaration(gutils->newFunc->getParent(),
-                                        Intrinsic::memset, tys),
-              args, BufferDefs));
-          memset->addParamAttr(0, Attribute::NonNull);
+            auto val_arg =
+                ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
+            auto volatile_arg = ConstantInt::getFalse(call.getContext());
+            Value *args[] = {shadow_recvbuf, val_arg, len_arg, volatile_arg};
+            Type *tys[] = {args[0]->getType(), args[2]->getType()};
+            auto memset = cast<CallInst>(Builder2.CreateCall(
+                Intrinsic::getDeclaration(gutils->newFunc->getParent(),
+                                          Intrinsic::memset, tys),
+                args, BufferDefs));
+            memset->addParamAttr(0, Attribute::NonNull);
 
-          Builder2.CreateBr(mergeBlock);
-          Builder2.SetInsertPoint(mergeBlock);
-        }
+            Builder2.CreateBr(mergeBlock);
+            Builder2.SetInsertPoint(mergeBlock);
+          }
 
-        // 4. diff(sendbuffer) += intermediate buffer (diffmemcopy)
-        DifferentiableMemCopyFloats(call, orig_sendbuf, buf, shadow_sendbuf,
-                                    len_arg, Builder2, BufferDefs);
+          // 4. diff(sendbuffer) += intermediate buffer (diffmemcopy)
+          DifferentiableMemCopyFloats(call, orig_sendbuf, buf, shadow_sendbuf,
+                                      len_arg, Builder2, BufferDefs);
 
-        // Free up intermediate buffer
-        if (shouldFree()) {
-          CreateDealloc(Builder2, buf);
-        }
+          // Free up intermediate buffer
+          if (shouldFree()) {
+            CreateDealloc(Builder2, buf);
+          }
+        };
+        createMPIAdjointCollective(call, Builder2, "MPI_Bcast", args,
+                                   BufferDefs, {orig_sendbuf, orig_recvbuf},
+                                   finish);
       }
       if (Mode == DerivativeMode::ReverseModeGradient)
         eraseIfUnused(call, /*erase*/ true, /*check*/ false);
@@ -7778,37 +9732,7 @@ public:
         Value *orig_op = call.getOperand(4);
         Value *orig_comm = call.getOperand(5);
 
-        bool isSum = false;
-        if (Constant *C = dyn_cast<Constant>(orig_op)) {
-          while (ConstantExpr *CE = dyn_cast<ConstantExpr>(C)) {
-            C = CE->getOperand(0);
-          }
-          if (auto GV = dyn_cast<GlobalVariable>(C)) {
-            if (GV->getName() == "ompi_mpi_op_sum") {
-              isSum = true;
-            }
-          }
-          // MPICH
-          if (ConstantInt *CI = dyn_cast<ConstantInt>(C)) {
-            if (CI->getValue() == 1476395011) {
-              isSum = true;
-            }
-          }
-        }
-        if (!isSum) {
-          std::string s;
-          llvm::raw_string_ostream ss(s);
-          ss << *gutils->oldFunc << "\n";
-          ss << *gutils->newFunc << "\n";
-          ss << " call: " << call << "\n";
-          ss << " unhandled mpi_allreduce op: " << *orig_op << "\n";
-          if (CustomErrorHandler) {
-            CustomErrorHandler(ss.str().c_str(), wrap(&call),
-                               ErrorType::NoDerivative, nullptr);
-          }
-          llvm::errs() << ss.str() << "\n";
-          report_fatal_error("unhandled mpi_allreduce op");
-        }
+        checkMPISumOp(call, orig_op);
 
         Value *shadow_recvbuf = gutils->invertPointerM(orig_recvbuf, Builder2);
         if (!forwardMode)
@@ -7890,46 +9814,42 @@ public:
                              len_arg, "mpireduce_malloccache");
 
         // 2. MPI_Allreduce (sum) of diff(recvbuffer) to intermediate
-        {
-          // int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count,
-          //              MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
-          Value *args[] = {
-              /*sendbuf*/ shadow_recvbuf,
-              /*recvbuf*/ buf,
-              /*count*/ count,
-              /*datatype*/ datatype,
-              /*op*/ op,
-              /*comm*/ comm,
-          };
-          Type *types[sizeof(args) / sizeof(*args)];
-          for (size_t i = 0; i < sizeof(args) / sizeof(*args); i++)
-            types[i] = args[i]->getType();
-
-          FunctionType *FT = FunctionType::get(call.getType(), types, false);
-          Builder2.CreateCall(
-              called->getParent()->getOrInsertFunction("MPI_Allreduce", FT),
-              args, BufferDefs);
-        }
+        // int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count,
+        //              MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
+        Value *args[] = {
+            /*sendbuf*/ shadow_recvbuf,
+            /*recvbuf*/ buf,
+            /*count*/ count,
+            /*datatype*/ datatype,
+            /*op*/ op,
+            /*comm*/ comm,
+        };
 
-        // 3. Zero diff(recvbuffer) [memset to 0]
-        auto val_arg = ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
-        auto volatile_arg = ConstantInt::getFalse(call.getContext());
-        Value *args[] = {shadow_recvbuf, val_arg, len_arg, volatile_arg};
-        Type *tys[] = {args[0]->getType(), args[2]->getType()};
-        auto memset = cast<CallInst>(Builder2.CreateCall(
-            Intrinsic::getDeclaration(gutils->newFunc->getParent(),
-                                      Intrinsic::memset, tys),
-            args, BufferDefs));
-        memset->addParamAttr(0, Attribute::NonNull);
+        auto finish = [=, &call](IRBuilder<> &Builder2) {
+          // 3. Zero diff(recvbuffer) [memset to 0]
+          auto val_arg =
+              ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
+          auto volatile_arg = ConstantInt::getFalse(call.getContext());
+          Value *args[] = {shadow_recvbuf, val_arg, len_arg, volatile_arg};
+          Type *tys[] = {args[0]->getType(), args[2]->getType()};
+          auto memset = cast<CallInst>(Builder2.CreateCall(
+              Intrinsic::getDeclaration(gutils->newFunc->getParent(),
+                                        Intrinsic::memset, tys),
+              args, BufferDefs));
+          memset->addParamAttr(0, Attribute::NonNull);
 
-        // 4. diff(sendbuffer) += intermediate buffer (diffmemcopy)
-        DifferentiableMemCopyFloats(call, orig_sendbuf, buf, shadow_sendbuf,
-                                    len_arg, Builder2, BufferDefs);
+          // 4. diff(sendbuffer) += intermediate buffer (diffmemcopy)
+          DifferentiableMemCopyFloats(call, orig_sendbuf, buf, shadow_sendbuf,
+                                      len_arg, Builder2, BufferDefs);
 
-        // Free up intermediate buffer
-        if (shouldFree()) {
-          CreateDealloc(Builder2, buf);
-        }
+          // Free up intermediate buffer
+          if (shouldFree()) {
+            CreateDealloc(Builder2, buf);
+          }
+        };
+        createMPIAdjointCollective(call, Builder2, "MPI_Allreduce", args,
+                                   BufferDefs, {orig_sendbuf, orig_recvbuf},
+                                   finish);
       }
       if (Mode == DerivativeMode::ReverseModeGradient)
         eraseIfUnused(call, /*erase*/ true, /*check*/ false);
@@ -8068,81 +9988,78 @@ public:
                              sendlen_arg, "mpireduce_malloccache");
 
         // 2. Scatter diff(recvbuffer) to intermediate buffer
-        {
-          // int MPI_Scatter(const void *sendbuf, int sendcount, MPI_Datatype
-          // sendtype,
-          //     void *recvbuf, int recvcount, MPI_Datatype recvtype, int root,
-          //     MPI_Comm comm)
-          Value *args[] = {
-              /*sendbuf*/ shadow_recvbuf,
-              /*sendcount*/ recvcount,
-              /*sendtype*/ recvtype,
-              /*recvbuf*/ buf,
-              /*recvcount*/ sendcount,
-              /*recvtype*/ sendtype,
-              /*op*/ root,
-              /*comm*/ comm,
-          };
-          Type *types[sizeof(args) / sizeof(*args)];
-          for (size_t i = 0; i < sizeof(args) / sizeof(*args); i++)
-            types[i] = args[i]->getType();
-
-          FunctionType *FT = FunctionType::get(call.getType(), types, false);
-          Builder2.CreateCall(
-              called->getParent()->getOrInsertFunction("MPI_Scatter", FT), args,
-              BufferDefs);
-        }
-
-        // 3. if root, Zero diff(recvbuffer) [memset to 0]
-        {
-
-          BasicBlock *currentBlock = Builder2.GetInsertBlock();
-          BasicBlock *rootBlock = gutils->addReverseBlock(
-              currentBlock, currentBlock->getName() + "_root", gutils->newFunc);
-          BasicBlock *mergeBlock = gutils->addReverseBlock(
-              rootBlock, currentBlock->getName() + "_post", gutils->newFunc);
+        // int MPI_Scatter(const void *sendbuf, int sendcount, MPI_Datatype
+        // sendtype,
+        //     void *recvbuf, int recvcount, MPI_Datatype recvtype, int root,
+        //     MPI_Comm comm)
+        Value *args[] = {
+            /*sendbuf*/ shadow_recvbuf,
+            /*sendcount*/ recvcount,
+            /*sendtype*/ recvtype,
+            /*recvbuf*/ buf,
+            /*recvcount*/ sendcount,
+            /*recvtype*/ sendtype,
+            /*op*/ root,
+            /*comm*/ comm,
+        };
 
-          Builder2.CreateCondBr(Builder2.CreateICmpEQ(rank, root), rootBlock,
-                                mergeBlock);
+        auto finish = [=, &call](IRBuilder<> &Builder2) {
+          // 3. if root, Zero diff(recvbuffer) [memset to 0]
+          {
 
-          Builder2.SetInsertPoint(rootBlock);
-          auto recvlen_arg = Builder2.CreateZExtOrTrunc(
-              recvcount, Type::getInt64Ty(call.getContext()));
-          recvlen_arg = Builder2.CreateMul(
-              recvlen_arg,
-              Builder2.CreateZExtOrTrunc(tysize,
-                                         Type::getInt64Ty(call.getContext())),
-              "", true, true);
-          recvlen_arg = Builder2.CreateMul(
-              recvlen_arg,
-              Builder2.CreateZExtOrTrunc(
-                  MPI_COMM_SIZE(comm, Builder2, root->getType()),
-                  Type::getInt64Ty(call.getContext())),
-              "", true, true);
+            BasicBlock *currentBlock = Builder2.GetInsertBlock();
+            BasicBlock *rootBlock = gutils->addReverseBlock(
+                currentBlock, currentBlock->getName() + "_root",
+                gutils->newFunc);
+            BasicBlock *mergeBlock = gutils->addReverseBlock(
+                rootBlock, currentBlock->getName() + "_post", gutils->newFunc);
+
+            Builder2.CreateCondBr(Builder2.CreateICmpEQ(rank, root), rootBlock,
+                                  mergeBlock);
+
+            Builder2.SetInsertPoint(rootBlock);
+            auto recvlen_arg = Builder2.CreateZExtOrTrunc(
+                recvcount, Type::getInt64Ty(call.getContext()));
+            recvlen_arg = Builder2.CreateMul(
+                recvlen_arg,
+                Builder2.CreateZExtOrTrunc(tysize,
+                                           Type::getInt64Ty(call.getContext())),
+                "", true, true);
+            recvlen_arg = Builder2.CreateMul(
+                recvlen_arg,
+                Builder2.CreateZExtOrTrunc(
+                    MPI_COMM_SIZE(comm, Builder2, root->getType()),
+                    Type::getInt64Ty(call.getContext())),
+                "", true, true);
 
-          auto val_arg =
-              ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
-          auto volatile_arg = ConstantInt::getFalse(call.getContext());
-          Value *args[] = {shadow_recvbuf, val_arg, recvlen_arg, volatile_arg};
-          Type *tys[] = {args[0]->getType(), args[2]->getType()};
-          auto memset = cast<CallInst>(Builder2.CreateCall(
-              Intrinsic::getDeclaration(gutils->newFunc->getParent(),
-                                        Intrinsic::memset, tys),
-              args, BufferDefs));
-          memset->addParamAttr(0, Attribute::NonNull);
+            auto val_arg =
+                ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
+            auto volatile_arg = ConstantInt::getFalse(call.getContext());
+            Value *args[] = {shadow_recvbuf, val_arg, recvlen_arg,
+                             volatile_arg};
+            Type *tys[] = {args[0]->getType(), args[2]->getType()};
+            auto memset = cast<CallInst>(Builder2.CreateCall(
+                Intrinsic::getDeclaration(gutils->newFunc->getParent(),
+                                          Intrinsic::memset, tys),
+                args, BufferDefs));
+            memset->addParamAttr(0, Attribute::NonNull);
 
-          Builder2.CreateBr(mergeBlock);
-          Builder2.SetInsertPoint(mergeBlock);
-        }
+            Builder2.CreateBr(mergeBlock);
+            Builder2.SetInsertPoint(mergeBlock);
+          }
 
-        // 4. diff(sendbuffer) += intermediate buffer (diffmemcopy)
-        DifferentiableMemCopyFloats(call, orig_sendbuf, buf, shadow_sendbuf,
-                                    sendlen_arg, Builder2, BufferDefs);
+          // 4. diff(sendbuffer) += intermediate buffer (diffmemcopy)
+          DifferentiableMemCopyFloats(call, orig_sendbuf, buf, shadow_sendbuf,
+                                      sendlen_arg, Builder2, BufferDefs);
 
-        // Free up intermediate buffer
-        if (shouldFree()) {
-          CreateDealloc(Builder2, buf);
-        }
+          // Free up intermediate buffer
+          if (shouldFree()) {
+            CreateDealloc(Builder2, buf);
+          }
+        };
+        createMPIAdjointCollective(call, Builder2, "MPI_Scatter", args,
+                                   BufferDefs, {orig_sendbuf, orig_recvbuf},
+                                   finish);
       }
       if (Mode == DerivativeMode::ReverseModeGradient)
         eraseIfUnused(call, /*erase*/ true, /*check*/ false);
@@ -8323,72 +10240,69 @@ public:
         }
 
         // 2. Gather diff(recvbuffer) to intermediate buffer
-        {
-          // int MPI_Gather(const void *sendbuf, int sendcount, MPI_Datatype
-          // sendtype,
-          //     void *recvbuf, int recvcount, MPI_Datatype recvtype,
-          //     int root, MPI_Comm comm)
-          Value *args[] = {
-              /*sendbuf*/ shadow_recvbuf,
-              /*sendcount*/ recvcount,
-              /*sendtype*/ recvtype,
-              /*recvbuf*/ buf,
-              /*recvcount*/ sendcount,
-              /*recvtype*/ sendtype,
-              /*root*/ root,
-              /*comm*/ comm,
-          };
-          Type *types[sizeof(args) / sizeof(*args)];
-          for (size_t i = 0; i < sizeof(args) / sizeof(*args); i++)
-            types[i] = args[i]->getType();
-
-          FunctionType *FT = FunctionType::get(call.getType(), types, false);
-          Builder2.CreateCall(
-              called->getParent()->getOrInsertFunction("MPI_Gather", FT), args,
-              BufferDefs);
-        }
+        // int MPI_Gather(const void *sendbuf, int sendcount, MPI_Datatype
+        // sendtype,
+        //     void *recvbuf, int recvcount, MPI_Datatype recvtype,
+        //     int root, MPI_Comm comm)
+        Value *args[] = {
+            /*sendbuf*/ shadow_recvbuf,
+            /*sendcount*/ recvcount,
+            /*sendtype*/ recvtype,
+            /*recvbuf*/ buf,
+            /*recvcount*/ sendcount,
+            /*recvtype*/ sendtype,
+            /*root*/ root,
+            /*comm*/ comm,
+        };
 
-        // 3. Zero diff(recvbuffer) [memset to 0]
-        {
-          auto val_arg =
-              ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
-          auto volatile_arg = ConstantInt::getFalse(call.getContext());
-          Value *args[] = {shadow_recvbuf, val_arg, recvlen_arg, volatile_arg};
-          Type *tys[] = {args[0]->getType(), args[2]->getType()};
-          auto memset = cast<CallInst>(Builder2.CreateCall(
-              Intrinsic::getDeclaration(gutils->newFunc->getParent(),
-                                        Intrinsic::memset, tys),
-              args, BufferDefs));
-          memset->addParamAttr(0, Attribute::NonNull);
-        }
+        auto finish = [=, &call](IRBuilder<> &Builder2) {
+          // 3. Zero diff(recvbuffer) [memset to 0]
+          {
+            auto val_arg =
+                ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
+            auto volatile_arg = ConstantInt::getFalse(call.getContext());
+            Value *args[] = {shadow_recvbuf, val_arg, recvlen_arg,
+                             volatile_arg};
+            Type *tys[] = {args[0]->getType(), args[2]->getType()};
+            auto memset = cast<CallInst>(Builder2.CreateCall(
+                Intrinsic::getDeclaration(gutils->newFunc->getParent(),
+                                          Intrinsic::memset, tys),
+                args, BufferDefs));
+            memset->addParamAttr(0, Attribute::NonNull);
+          }
 
-        // 4. if root, diff(sendbuffer) += intermediate buffer (diffmemcopy)
-        // 5. if root, free intermediate buffer
+          // 4. if root, diff(sendbuffer) += intermediate buffer (diffmemcopy)
+          // 5. if root, free intermediate buffer
 
-        {
-          BasicBlock *currentBlock = Builder2.GetInsertBlock();
-          BasicBlock *rootBlock = gutils->addReverseBlock(
-              currentBlock, currentBlock->getName() + "_root", gutils->newFunc);
-          BasicBlock *mergeBlock = gutils->addReverseBlock(
-              rootBlock, currentBlock->getName() + "_post", gutils->newFunc);
+          {
+            BasicBlock *currentBlock = Builder2.GetInsertBlock();
+            BasicBlock *rootBlock = gutils->addReverseBlock(
+                currentBlock, currentBlock->getName() + "_root",
+                gutils->newFunc);
+            BasicBlock *mergeBlock = gutils->addReverseBlock(
+                rootBlock, currentBlock->getName() + "_post", gutils->newFunc);
 
-          Builder2.CreateCondBr(Builder2.CreateICmpEQ(rank, root), rootBlock,
-                                mergeBlock);
+            Builder2.CreateCondBr(Builder2.CreateICmpEQ(rank, root), rootBlock,
+                                  mergeBlock);
 
-          Builder2.SetInsertPoint(rootBlock);
+            Builder2.SetInsertPoint(rootBlock);
 
-          // 4. diff(sendbuffer) += intermediate buffer (diffmemcopy)
-          DifferentiableMemCopyFloats(call, orig_sendbuf, buf, shadow_sendbuf,
-                                      sendlen_phi, Builder2, BufferDefs);
+            // 4. diff(sendbuffer) += intermediate buffer (diffmemcopy)
+            DifferentiableMemCopyFloats(call, orig_sendbuf, buf, shadow_sendbuf,
+                                        sendlen_phi, Builder2, BufferDefs);
 
-          // Free up intermediate buffer
-          if (shouldFree()) {
-            CreateDealloc(Builder2, buf);
-          }
+            // Free up intermediate buffer
+            if (shouldFree()) {
+              CreateDealloc(Builder2, buf);
+            }
 
-          Builder2.CreateBr(mergeBlock);
-          Builder2.SetInsertPoint(mergeBlock);
-        }
+            Builder2.CreateBr(mergeBlock);
+            Builder2.SetInsertPoint(mergeBlock);
+          }
+        };
+        createMPIAdjointCollective(call, Builder2, "MPI_Gather", args,
+                                   BufferDefs, {orig_sendbuf, orig_recvbuf},
+                                   finish);
       }
       if (Mode == DerivativeMode::ReverseModeGradient)
         eraseIfUnused(call, /*erase*/ true, /*check*/ false);
@@ -8528,49 +10442,576 @@ public:
 
         // 2. reduce diff(recvbuffer) then scatter to corresponding input node's
         // intermediate buffer
-        {
-          // int MPI_Reduce_scatter_block(const void* send_buffer,
-          //                    void* receive_buffer,
-          //                    int count,
-          //                    MPI_Datatype datatype,
-          //                    MPI_Op operation,
-          //                    MPI_Comm communicator);
+        // int MPI_Reduce_scatter_block(const void* send_buffer,
+        //                    void* receive_buffer,
+        //                    int count,
+        //                    MPI_Datatype datatype,
+        //                    MPI_Op operation,
+        //                    MPI_Comm communicator);
+        Value *args[] = {
+            /*sendbuf*/ shadow_recvbuf,
+            /*recvbuf*/ buf,
+            /*recvcount*/ sendcount,
+            /*recvtype*/ sendtype,
+            /*op (MPI_SUM)*/
+            getOrInsertOpFloatSum(*gutils->newFunc->getParent(),
+                                  MPI_OP_Ptr_type, CT, call.getType(),
+                                  Builder2),
+            /*comm*/ comm,
+        };
+
+        auto finish = [=, &call](IRBuilder<> &Builder2) {
+          // 3. zero diff(recvbuffer) [memset to 0]
+          {
+            auto recvlen_arg = Builder2.CreateZExtOrTrunc(
+                recvcount, Type::getInt64Ty(call.getContext()));
+            recvlen_arg = Builder2.CreateMul(
+                recvlen_arg,
+                Builder2.CreateZExtOrTrunc(tysize,
+                                           Type::getInt64Ty(call.getContext())),
+                "", true, true);
+            recvlen_arg = Builder2.CreateMul(
+                recvlen_arg,
+                Builder2.CreateZExtOrTrunc(
+                    MPI_COMM_SIZE(comm, Builder2, call.getType()),
+                    Type::getInt64Ty(call.getContext())),
+                "", true, true);
+            auto val_arg =
+                ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
+            auto volatile_arg = ConstantInt::getFalse(call.getContext());
+            Value *args[] = {shadow_recvbuf, val_arg, recvlen_arg,
+                             volatile_arg};
+            Type *tys[] = {args[0]->getType(), args[2]->getType()};
+            auto memset = cast<CallInst>(Builder2.CreateCall(
+                Intrinsic::getDeclaration(gutils->newFunc->getParent(),
+                                          Intrinsic::memset, tys),
+                args, BufferDefs));
+            memset->addParamAttr(0, Attribute::NonNull);
+          }
+
+          // 4. diff(sendbuffer) += intermediate buffer (diffmemcopy)
+          DifferentiableMemCopyFloats(call, orig_sendbuf, buf, shadow_sendbuf,
+                                      sendlen_arg, Builder2, BufferDefs);
+
+          // Free up intermediate buffer
+          if (shouldFree()) {
+            CreateDealloc(Builder2, buf);
+          }
+        };
+        createMPIAdjointCollective(call, Builder2, "MPI_Reduce_scatter_block",
+                                   args, BufferDefs,
+                                   {orig_sendbuf, orig_recvbuf}, finish);
+      }
+      if (Mode == DerivativeMode::ReverseModeGradient)
+        eraseIfUnused(call, /*erase*/ true, /*check*/ false);
+      return;
+    }
+
+    if (funcName == "MPI_Alltoall" || funcName == "MPI_Neighbor_alltoall") {
+      if (Mode == DerivativeMode::ReverseModeGradient ||
+          Mode == DerivativeMode::ReverseModeCombined ||
+          Mode == DerivativeMode::ForwardMode) {
+        bool forwardMode = Mode == DerivativeMode::ForwardMode;
+        bool neighbor = funcName == "MPI_Neighbor_alltoall";
+
+        IRBuilder<> Builder2 =
+            forwardMode ? IRBuilder<>(&call) : IRBuilder<>(call.getParent());
+        if (forwardMode) {
+          getForwardBuilder(Builder2);
+        } else {
+          getReverseBuilder(Builder2);
+        }
+
+        Value *orig_sendbuf = call.getOperand(0);
+        Value *orig_sendcount = call.getOperand(1);
+        Value *orig_sendtype = call.getOperand(2);
+        Value *orig_recvbuf = call.getOperand(3);
+        Value *orig_recvcount = call.getOperand(4);
+        Value *orig_recvtype = call.getOperand(5);
+        Value *orig_comm = call.getOperand(6);
+
+        Value *shadow_recvbuf = gutils->invertPointerM(orig_recvbuf, Builder2);
+        if (!forwardMode)
+          shadow_recvbuf = lookup(shadow_recvbuf, Builder2);
+
+        if (shadow_recvbuf->getType()->isIntegerTy())
+          shadow_recvbuf = Builder2.CreateIntToPtr(
+              shadow_recvbuf, Type::getInt8PtrTy(call.getContext()));
+
+        Value *shadow_sendbuf = gutils->invertPointerM(orig_sendbuf, Builder2);
+        if (!forwardMode)
+          shadow_sendbuf = lookup(shadow_sendbuf, Builder2);
+
+        if (shadow_sendbuf->getType()->isIntegerTy())
+          shadow_sendbuf = Builder2.CreateIntToPtr(
+              shadow_sendbuf, Type::getInt8PtrTy(call.getContext()));
+
+        Value *recvcount = gutils->getNewFromOriginal(orig_recvcount);
+        if (!forwardMode)
+          recvcount = lookup(recvcount, Builder2);
+
+        Value *recvtype = gutils->getNewFromOriginal(orig_recvtype);
+        if (!forwardMode)
+          recvtype = lookup(recvtype, Builder2);
+
+        Value *sendcount = gutils->getNewFromOriginal(orig_sendcount);
+        if (!forwardMode)
+          sendcount = lookup(sendcount, Builder2);
+
+        Value *sendtype = gutils->getNewFromOriginal(orig_sendtype);
+        if (!forwardMode)
+          sendtype = lookup(sendtype, Builder2);
+
+        Value *comm = gutils->getNewFromOriginal(orig_comm);
+        if (!forwardMode)
+          comm = lookup(comm, Builder2);
+
+        if (forwardMode) {
           Value *args[] = {
-              /*sendbuf*/ shadow_recvbuf,
-              /*recvbuf*/ buf,
-              /*recvcount*/ sendcount,
-              /*recvtype*/ sendtype,
-              /*op (MPI_SUM)*/
-              getOrInsertOpFloatSum(*gutils->newFunc->getParent(),
-                                    MPI_OP_Ptr_type, CT, call.getType(),
-                                    Builder2),
+              /*sendbuf*/ shadow_sendbuf,
+              /*sendcount*/ sendcount,
+              /*sendtype*/ sendtype,
+              /*recvbuf*/ shadow_recvbuf,
+              /*recvcount*/ recvcount,
+              /*recvtype*/ recvtype,
               /*comm*/ comm,
           };
-          Type *types[sizeof(args) / sizeof(*args)];
-          for (size_t i = 0; i < sizeof(args) / sizeof(*args); i++)
-            types[i] = args[i]->getType();
 
-          FunctionType *FT = FunctionType::get(call.getType(), types, false);
-          Builder2.CreateCall(called->getParent()->getOrInsertFunction(
-                                  "MPI_Reduce_scatter_block", FT),
-                              args, BufferDefs);
+          auto Defs = gutils->getInvertedBundles(
+              &call,
+              {ValueType::Shadow, ValueType::Primal, ValueType::Primal,
+               ValueType::Shadow, ValueType::Primal, ValueType::Primal,
+               ValueType::Primal},
+              Builder2, /*lookup*/ false);
+
+#if LLVM_VERSION_MAJOR >= 11
+          auto callval = call.getCalledOperand();
+#else
+          auto callval = call.getCalledValue();
+#endif
+
+#if LLVM_VERSION_MAJOR > 7
+          Builder2.CreateCall(call.getFunctionType(), callval, args, Defs);
+#else
+          Builder2.CreateCall(callval, args, Defs);
+#endif
+
+          return;
         }
 
-        // 3. zero diff(recvbuffer) [memset to 0]
-        {
-          auto recvlen_arg = Builder2.CreateZExtOrTrunc(
-              recvcount, Type::getInt64Ty(call.getContext()));
-          recvlen_arg = Builder2.CreateMul(
-              recvlen_arg,
-              Builder2.CreateZExtOrTrunc(tysize,
-                                         Type::getInt64Ty(call.getContext())),
+        // The number of blocks sent and received, which for a neighborhood
+        // collective are the degrees of the process topology
+        Type *intType = call.getType();
+        Value *sendblocks, *recvblocks;
+        if (neighbor) {
+          IRBuilder<> AB(gutils->inversionAllocs);
+          Value *indegree = AB.CreateAlloca(intType);
+          Value *outdegree = AB.CreateAlloca(intType);
+          Builder2.CreateCall(getOrInsertMPINeighborCount(
+                                  *gutils->newFunc->getParent(),
+                                  comm->getType(), intType),
+                              {comm, indegree, outdegree});
+#if LLVM_VERSION_MAJOR > 7
+          sendblocks = Builder2.CreateLoad(intType, outdegree);
+          recvblocks = Builder2.CreateLoad(intType, indegree);
+#else
+          sendblocks = Builder2.CreateLoad(outdegree);
+          recvblocks = Builder2.CreateLoad(indegree);
+#endif
+        } else {
+          sendblocks = recvblocks = MPI_COMM_SIZE(comm, Builder2, intType);
+        }
+
+        // Get the length for the allocation of the intermediate buffer
+        auto length = [&](Value *count, Value *type, Value *blocks) {
+          Type *i64 = Type::getInt64Ty(call.getContext());
+          Value *len = Builder2.CreateZExtOrTrunc(count, i64);
+          len = Builder2.CreateMul(
+              len,
+              Builder2.CreateZExtOrTrunc(
+                  MPI_TYPE_SIZE(type, Builder2, intType), i64),
               "", true, true);
-          recvlen_arg = Builder2.CreateMul(
-              recvlen_arg,
+          return Builder2.CreateMul(len,
+                                    Builder2.CreateZExtOrTrunc(blocks, i64),
+                                    "", true, true);
+        };
+        Value *sendlen_arg = length(sendcount, sendtype, sendblocks);
+        Value *recvlen_arg = length(recvcount, recvtype, recvblocks);
+
+        // Need to preserve the shadow send/recv buffers.
+        auto BufferDefs = gutils->getInvertedBundles(
+            &call,
+            {ValueType::Shadow, ValueType::Primal, ValueType::Primal,
+             ValueType::Shadow, ValueType::Primal, ValueType::Primal,
+             ValueType::Primal},
+            Builder2, /*lookup*/ true);
+
+        // 1. Alloc intermediate buffer
+        Value *buf =
+            CreateAllocation(Builder2, Type::getInt8Ty(call.getContext()),
+                             sendlen_arg, "mpialltoall_malloccache");
+
+        // 2. The transpose of an all to all is the all to all of the
+        // differentials in the opposite direction
+        Value *args[] = {
+            /*sendbuf*/ shadow_recvbuf,
+            /*sendcount*/ recvcount,
+            /*sendtype*/ recvtype,
+            /*recvbuf*/ buf,
+            /*recvcount*/ sendcount,
+            /*recvtype*/ sendtype,
+            /*comm*/ comm,
+        };
+
+        auto finish = [=, &call](IRBuilder<> &Builder2) {
+          // 3. zero diff(recvbuffer) [memset to 0]
+          {
+            auto val_arg =
+                ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
+            auto volatile_arg = ConstantInt::getFalse(call.getContext());
+            Value *args[] = {shadow_recvbuf, val_arg, recvlen_arg,
+                             volatile_arg};
+            Type *tys[] = {args[0]->getType(), args[2]->getType()};
+            auto memset = cast<CallInst>(Builder2.CreateCall(
+                Intrinsic::getDeclaration(gutils->newFunc->getParent(),
+                                          Intrinsic::memset, tys),
+                args, BufferDefs));
+            memset->addParamAttr(0, Attribute::NonNull);
+          }
+
+          // 4. diff(sendbuffer) += intermediate buffer (diffmemcopy)
+          DifferentiableMemCopyFloats(call, orig_sendbuf, buf, shadow_sendbuf,
+                                      sendlen_arg, Builder2, BufferDefs);
+
+          // Free up intermediate buffer
+          if (shouldFree()) {
+            CreateDealloc(Builder2, buf);
+          }
+        };
+        createMPIAdjointCollective(call, Builder2, funcName, args, BufferDefs,
+                                   {orig_sendbuf, orig_recvbuf}, finish);
+      }
+      if (Mode == DerivativeMode::ReverseModeGradient)
+        eraseIfUnused(call, /*erase*/ true, /*check*/ false);
+      return;
+    }
+
+    if (funcName == "MPI_Alltoallv") {
+      if (Mode == DerivativeMode::ReverseModeGradient ||
+          Mode == DerivativeMode::ReverseModeCombined ||
+          Mode == DerivativeMode::ForwardMode) {
+        bool forwardMode = Mode == DerivativeMode::ForwardMode;
+
+        IRBuilder<> Builder2 =
+            forwardMode ? IRBuilder<>(&call) : IRBuilder<>(call.getParent());
+        if (forwardMode) {
+          getForwardBuilder(Builder2);
+        } else {
+          getReverseBuilder(Builder2);
+        }
+
+        // int MPI_Alltoallv(const void *sendbuf, const int sendcounts[],
+        //                   const int sdispls[], MPI_Datatype sendtype,
+        //                   void *recvbuf, const int recvcounts[],
+        //                   const int rdispls[], MPI_Datatype recvtype,
+        //                   MPI_Comm comm)
+        Value *orig_sendbuf = call.getOperand(0);
+        Value *orig_recvbuf = call.getOperand(4);
+
+        Value *shadow_recvbuf = gutils->invertPointerM(orig_recvbuf, Builder2);
+        if (!forwardMode)
+          shadow_recvbuf = lookup(shadow_recvbuf, Builder2);
+
+        if (shadow_recvbuf->getType()->isIntegerTy())
+          shadow_recvbuf = Builder2.CreateIntToPtr(
+              shadow_recvbuf, Type::getInt8PtrTy(call.getContext()));
+
+        Value *shadow_sendbuf = gutils->invertPointerM(orig_sendbuf, Builder2);
+        if (!forwardMode)
+          shadow_sendbuf = lookup(shadow_sendbuf, Builder2);
+
+        if (shadow_sendbuf->getType()->isIntegerTy())
+          shadow_sendbuf = Builder2.CreateIntToPtr(
+              shadow_sendbuf, Type::getInt8PtrTy(call.getContext()));
+
+        auto primal = [&](unsigned i) {
+          Value *V = gutils->getNewFromOriginal(call.getOperand(i));
+          if (!forwardMode)
+            V = lookup(V, Builder2);
+          return V;
+        };
+        Value *sendcounts = primal(1);
+        Value *sdispls = primal(2);
+        Value *sendtype = primal(3);
+        Value *recvcounts = primal(5);
+        Value *rdispls = primal(6);
+        Value *recvtype = primal(7);
+        Value *comm = primal(8);
+
+        SmallVector<ValueType, 9> types = {
+            ValueType::Shadow, ValueType::Primal, ValueType::Primal,
+            ValueType::Primal, ValueType::Shadow, ValueType::Primal,
+            ValueType::Primal, ValueType::Primal, ValueType::Primal};
+
+        if (forwardMode) {
+          Value *args[] = {
+              /*sendbuf*/ shadow_sendbuf,
+              /*sendcounts*/ sendcounts,
+              /*sdispls*/ sdispls,
+              /*sendtype*/ sendtype,
+              /*recvbuf*/ shadow_recvbuf,
+              /*recvcounts*/ recvcounts,
+              /*rdispls*/ rdispls,
+              /*recvtype*/ recvtype,
+              /*comm*/ comm,
+          };
+
+          auto Defs = gutils->getInvertedBundles(&call, types, Builder2,
+                                                 /*lookup*/ false);
+
+#if LLVM_VERSION_MAJOR >= 11
+          auto callval = call.getCalledOperand();
+#else
+          auto callval = call.getCalledValue();
+#endif
+
+#if LLVM_VERSION_MAJOR > 7
+          Builder2.CreateCall(call.getFunctionType(), callval, args, Defs);
+#else
+          Builder2.CreateCall(callval, args, Defs);
+#endif
+
+          return;
+        }
+
+        // The buffers span the furthest block of the displacements, which
+        // need not be packed
+        Type *intType = call.getType();
+        Value *nblocks = MPI_COMM_SIZE(comm, Builder2, intType);
+        Function *extent = getOrInsertMPIExtent(
+            *gutils->newFunc->getParent(), sendcounts->getType(), intType);
+        auto length = [&](Value *counts, Value *displs, Value *type) {
+          Type *i64 = Type::getInt64Ty(call.getContext());
+          Value *len = Builder2.CreateCall(extent, {counts, displs, nblocks});
+          return Builder2.CreateMul(
+              len,
               Builder2.CreateZExtOrTrunc(
-                  MPI_COMM_SIZE(comm, Builder2, call.getType()),
-                  Type::getInt64Ty(call.getContext())),
+                  MPI_TYPE_SIZE(type, Builder2, intType), i64),
               "", true, true);
+        };
+        Value *sendlen_arg = length(sendcounts, sdispls, sendtype);
+        Value *recvlen_arg = length(recvcounts, rdispls, recvtype);
+
+        // Need to preserve the shadow send/recv buffers.
+        auto BufferDefs =
+            gutils->getInvertedBundles(&call, types, Builder2, /*lookup*/ true);
+
+        // 1. Alloc intermediate buffer, zeroed since the gaps between blocks
+        // are not received into
+        Value *buf =
+            CreateAllocation(Builder2, Type::getInt8Ty(call.getContext()),
+                             sendlen_arg, "mpialltoallv_malloccache");
+        auto memsetBuffer = [&call, this](IRBuilder<> &Builder2, Value *ptr,
+                                          Value *len,
+                                          ArrayRef<OperandBundleDef> Defs) {
+          auto val_arg =
+              ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
+          auto volatile_arg = ConstantInt::getFalse(call.getContext());
+          Value *args[] = {ptr, val_arg, len, volatile_arg};
+          Type *tys[] = {args[0]->getType(), args[2]->getType()};
+          auto memset = cast<CallInst>(Builder2.CreateCall(
+              Intrinsic::getDeclaration(gutils->newFunc->getParent(),
+                                        Intrinsic::memset, tys),
+              args, Defs));
+          memset->addParamAttr(0, Attribute::NonNull);
+        };
+        memsetBuffer(Builder2, buf, sendlen_arg, {});
+
+        // 2. The transpose of an all to all is the all to all of the
+        // differentials in the opposite direction
+        Value *args[] = {
+            /*sendbuf*/ shadow_recvbuf,
+            /*sendcounts*/ recvcounts,
+            /*sdispls*/ rdispls,
+            /*sendtype*/ recvtype,
+            /*recvbuf*/ buf,
+            /*recvcounts*/ sendcounts,
+            /*rdispls*/ sdispls,
+            /*recvtype*/ sendtype,
+            /*comm*/ comm,
+        };
+
+        auto finish = [=, &call](IRBuilder<> &Builder2) {
+          // 3. zero diff(recvbuffer) [memset to 0]
+          memsetBuffer(Builder2, shadow_recvbuf, recvlen_arg, BufferDefs);
+
+          // 4. diff(sendbuffer) += intermediate buffer (diffmemcopy)
+          DifferentiableMemCopyFloats(call, orig_sendbuf, buf, shadow_sendbuf,
+                                      sendlen_arg, Builder2, BufferDefs);
+
+          // Free up intermediate buffer
+          if (shouldFree()) {
+            CreateDealloc(Builder2, buf);
+          }
+        };
+        createMPIAdjointCollective(call, Builder2, "MPI_Alltoallv", args,
+                                   BufferDefs, {orig_sendbuf, orig_recvbuf},
+                                   finish);
+      }
+      if (Mode == DerivativeMode::ReverseModeGradient)
+        eraseIfUnused(call, /*erase*/ true, /*check*/ false);
+      return;
+    }
+
+    if (funcName == "MPI_Sendrecv") {
+      if (Mode == DerivativeMode::ReverseModeGradient ||
+          Mode == DerivativeMode::ReverseModeCombined ||
+          Mode == DerivativeMode::ForwardMode) {
+        bool forwardMode = Mode == DerivativeMode::ForwardMode;
+
+        IRBuilder<> Builder2 =
+            forwardMode ? IRBuilder<>(&call) : IRBuilder<>(call.getParent());
+        if (forwardMode) {
+          getForwardBuilder(Builder2);
+        } else {
+          getReverseBuilder(Builder2);
+        }
+
+        // int MPI_Sendrecv(const void *sendbuf, int sendcount,
+        //                  MPI_Datatype sendtype, int dest, int sendtag,
+        //                  void *recvbuf, int recvcount,
+        //                  MPI_Datatype recvtype, int source, int recvtag,
+        //                  MPI_Comm comm, MPI_Status *status)
+        Value *orig_sendbuf = call.getOperand(0);
+        Value *orig_recvbuf = call.getOperand(5);
+        Value *orig_status = call.getOperand(11);
+
+        Value *shadow_recvbuf = gutils->invertPointerM(orig_recvbuf, Builder2);
+        if (!forwardMode)
+          shadow_recvbuf = lookup(shadow_recvbuf, Builder2);
+
+        if (shadow_recvbuf->getType()->isIntegerTy())
+          shadow_recvbuf = Builder2.CreateIntToPtr(
+              shadow_recvbuf, Type::getInt8PtrTy(call.getContext()));
+
+        Value *shadow_sendbuf = gutils->invertPointerM(orig_sendbuf, Builder2);
+        if (!forwardMode)
+          shadow_sendbuf = lookup(shadow_sendbuf, Builder2);
+
+        if (shadow_sendbuf->getType()->isIntegerTy())
+          shadow_sendbuf = Builder2.CreateIntToPtr(
+              shadow_sendbuf, Type::getInt8PtrTy(call.getContext()));
+
+        auto primal = [&](unsigned i) {
+          Value *V = gutils->getNewFromOriginal(call.getOperand(i));
+          if (!forwardMode)
+            V = lookup(V, Builder2);
+          return V;
+        };
+        Value *sendcount = primal(1);
+        Value *sendtype = primal(2);
+        Value *dest = primal(3);
+        Value *sendtag = primal(4);
+        Value *recvcount = primal(6);
+        Value *recvtype = primal(7);
+        Value *source = primal(8);
+        Value *recvtag = primal(9);
+        Value *comm = primal(10);
+
+        SmallVector<ValueType, 12> types(12, ValueType::Primal);
+        types[0] = ValueType::Shadow;
+        types[5] = ValueType::Shadow;
+        types[11] = ValueType::None;
+
+        if (forwardMode) {
+          Value *args[] = {
+              /*sendbuf*/ shadow_sendbuf,
+              /*sendcount*/ sendcount,
+              /*sendtype*/ sendtype,
+              /*dest*/ dest,
+              /*sendtag*/ sendtag,
+              /*recvbuf*/ shadow_recvbuf,
+              /*recvcount*/ recvcount,
+              /*recvtype*/ recvtype,
+              /*source*/ source,
+              /*recvtag*/ recvtag,
+              /*comm*/ comm,
+              /*status*/ gutils->getNewFromOriginal(orig_status),
+          };
+          types[11] = ValueType::Primal;
+
+          auto Defs = gutils->getInvertedBundles(&call, types, Builder2,
+                                                 /*lookup*/ false);
+
+#if LLVM_VERSION_MAJOR >= 11
+          auto callval = call.getCalledOperand();
+#else
+          auto callval = call.getCalledValue();
+#endif
+
+#if LLVM_VERSION_MAJOR > 7
+          Builder2.CreateCall(call.getFunctionType(), callval, args, Defs);
+#else
+          Builder2.CreateCall(callval, args, Defs);
+#endif
+
+          return;
+        }
+
+        Type *intType = call.getType();
+        Type *i64 = Type::getInt64Ty(call.getContext());
+        Value *sendlen_arg = Builder2.CreateMul(
+            Builder2.CreateZExtOrTrunc(sendcount, i64),
+            Builder2.CreateZExtOrTrunc(
+                MPI_TYPE_SIZE(sendtype, Builder2, intType), i64),
+            "", true, true);
+        Value *recvlen_arg = Builder2.CreateMul(
+            Builder2.CreateZExtOrTrunc(recvcount, i64),
+            Builder2.CreateZExtOrTrunc(
+                MPI_TYPE_SIZE(recvtype, Builder2, intType), i64),
+            "", true, true);
+
+        // Need to preserve the shadow send/recv buffers.
+        auto BufferDefs =
+            gutils->getInvertedBundles(&call, types, Builder2, /*lookup*/ true);
+
+        // 1. Alloc intermediate buffer
+        Value *buf =
+            CreateAllocation(Builder2, Type::getInt8Ty(call.getContext()),
+                             sendlen_arg, "mpisendrecv_malloccache");
+
+        // 2. Send diff(recvbuffer) back to the source, and receive the
+        // differential of what was sent from the destination
+        Value *status = IRBuilder<>(gutils->inversionAllocs)
+                            .CreateAlloca(orig_status->getType()
+                                              ->getPointerElementType());
+        Value *args[] = {
+            /*sendbuf*/ shadow_recvbuf,
+            /*sendcount*/ recvcount,
+            /*sendtype*/ recvtype,
+            /*dest*/ source,
+            /*sendtag*/ recvtag,
+            /*recvbuf*/ buf,
+            /*recvcount*/ sendcount,
+            /*recvtype*/ sendtype,
+            /*source*/ dest,
+            /*recvtag*/ sendtag,
+            /*comm*/ comm,
+            /*status*/ status,
+        };
+#if LLVM_VERSION_MAJOR >= 11
+        auto callval = call.getCalledOperand();
+#else
+        auto callval = call.getCalledValue();
+#endif
+#if LLVM_VERSION_MAJOR > 7
+        Builder2.CreateCall(call.getFunctionType(), callval, args, BufferDefs);
+#else
+        Builder2.CreateCall(callval, args, BufferDefs);
+#endif
+
+        // 3. zero diff(recvbuffer) [memset to 0]
+        {
           auto val_arg =
               ConstantInt::get(Type::getInt8Ty(call.getContext()), 0);
           auto volatile_arg = ConstantInt::getFalse(call.getContext());
@@ -8914,6 +11355,16 @@ public:
         return;
       }
 
+      if (funcName == "pthread_create" || funcName == "pthread_join") {
+        if (handlePThreadCall(call, funcName))
+          return;
+      }
+
+      if (funcName.startswith("__enzyme_omp_reduce_add")) {
+        handleOMPReduceAdd(call);
+        return;
+      }
+
       if (funcName == "__kmpc_for_static_init_4" ||
           funcName == "__kmpc_for_static_init_4u" ||
           funcName == "__kmpc_for_static_init_8" ||
@@ -8999,8 +11450,21 @@ public:
         return;
       }
 
-      if (funcName.startswith("__kmpc") &&
-          funcName != "__kmpc_global_thread_num") {
+      // The chunks handed out by a dynamic or guided schedule are bounds
+      // loaded after __kmpc_dispatch_next, which are cached like any other
+      // value read from overwritten memory. The reverse replays those cached
+      // chunks, so the dispatch calls themselves are only run in the
+      // augmented pass.
+      if (funcName.startswith("__kmpc_dispatch_")) {
+        if (Mode == DerivativeMode::ReverseModeCombined) {
+          llvm::errs() << *gutils->oldFunc << "\n";
+          llvm::errs() << call << "\n";
+          assert(0 && "dynamic openmp schedule outside of a parallel region");
+          llvm_unreachable(
+              "dynamic openmp schedule outside of a parallel region");
+        }
+      } else if (funcName.startswith("__kmpc") &&
+                 funcName != "__kmpc_global_thread_num") {
         llvm::errs() << *gutils->oldFunc << "\n";
         llvm::errs() << call << "\n";
         assert(0 && "unhandled openmp function");
@@ -252,6 +252,14 @@ void EnzymeRegisterAllocationHandler(char *Name, CustomShadowAlloc AHandle,
   };
 }
 
+void EnzymeRegisterTapeArenaHandler(CustomTapeAlloc AHandle,
+                                    CustomTapeRealloc RHandle,
+                                    CustomShadowFree FHandle) {
+  CustomTapeAllocator = AHandle;
+  CustomTapeReallocator = RHandle;
+  CustomTapeDeallocator = FHandle;
+}
+
 void EnzymeRegisterCallHandler(char *Name,
                                CustomAugmentedFunctionForward FwdHandle,
                                CustomFunctionReverse RevHandle) {
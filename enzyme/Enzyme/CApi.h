@@ -178,6 +178,17 @@ typedef LLVMValueRef (*CustomShadowFree)(LLVMBuilderRef, LLVMValueRef);
 void EnzymeRegisterAllocationHandler(char *Name, CustomShadowAlloc AHandle,
                                      CustomShadowFree FHandle);
 
+typedef LLVMValueRef (*CustomTapeAlloc)(LLVMBuilderRef, LLVMValueRef /*Size*/);
+typedef LLVMValueRef (*CustomTapeRealloc)(LLVMBuilderRef, LLVMValueRef /*Ptr*/,
+                                          LLVMValueRef /*OldSize*/,
+                                          LLVMValueRef /*NewSize*/);
+
+/// Allocate cache buffers through the given handlers rather than malloc,
+/// realloc and free, e.g. to carve them out of an arena.
+void EnzymeRegisterTapeArenaHandler(CustomTapeAlloc AHandle,
+                                    CustomTapeRealloc RHandle,
+                                    CustomShadowFree FHandle);
+
 class GradientUtils;
 class DiffeGradientUtils;
 
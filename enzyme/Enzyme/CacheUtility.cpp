@@ -26,9 +26,25 @@
 
 #include "CacheUtility.h"
 #include "FunctionUtils.h"
+#include "TypeAnalysis/TypeAnalysis.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Support/MathExtras.h"
 
 using namespace llvm;
 
+#ifdef DEBUG_TYPE
+#undef DEBUG_TYPE
+#endif
+#define DEBUG_TYPE "enzyme"
+
+STATISTIC(NumCaches, "Number of caches created for the reverse pass");
+STATISTIC(NumCachedValues, "Number of values stored into a cache");
+STATISTIC(NumCompressedCachedValues,
+          "Number of values stored into a cache in a compressed form");
+STATISTIC(NumStackCaches, "Number of caches held on the stack");
+
 /// Pack 8 bools together in a single byte
 extern "C" {
 llvm::cl::opt<bool>
@@ -47,10 +63,57 @@ llvm::cl::opt<bool> EfficientMaxCache(
     "enzyme-max-cache", cl::init(false), cl::Hidden,
     cl::desc(
         "Avoid reallocs when possible by potentially overallocating cache"));
+
+llvm::cl::opt<TapeCompressFP> EnzymeTapeCompressFP(
+    "enzyme-tape-compress-fp", cl::init(TapeCompressFP::None), cl::Hidden,
+    cl::desc("Precision to store loop caches of floating point values in"),
+    cl::values(clEnumValN(TapeCompressFP::None, "none", "Full precision"),
+               clEnumValN(TapeCompressFP::Float, "float",
+                          "Single precision for double values"),
+               clEnumValN(TapeCompressFP::BFloat16, "bfloat16",
+                          "bfloat16 for float and double values")));
+
+llvm::cl::opt<bool> EnzymeTapePackInts(
+    "enzyme-tape-pack-ints", cl::init(false), cl::Hidden,
+    cl::desc("Store loop caches of integers in the narrowest width that holds "
+             "their range"));
+
+llvm::cl::opt<unsigned> EnzymeStackCacheBytes(
+    "enzyme-stack-cache-bytes", cl::init(0), cl::Hidden,
+    cl::desc("Hold caches of loops with constant trip counts of up to this "
+             "many bytes on the stack, or inline in the tape, rather than on "
+             "the heap"));
 }
 
 CacheUtility::~CacheUtility() {}
 
+OptimizationRemarkEmitter &CacheUtility::getRemarkEmitter(Function *F) {
+  auto &ORE = remarkEmitters[F];
+  if (!ORE)
+    ORE.reset(new OptimizationRemarkEmitter(F));
+  return *ORE;
+}
+
+bool CacheUtility::isStackChunk(const SubLimitType &sublimits, int i, Type *T,
+                                bool isi1, Value *extraSize) const {
+  if (!EnzymeStackCacheBytes || sublimits.size() != 1 || extraSize ||
+      NumReturns != 1)
+    return false;
+  for (auto &lim : sublimits[i].second)
+    if (lim.first.offset || !lim.first.maxLimit)
+      return false;
+  auto count = dyn_cast<ConstantInt>(sublimits[i].first);
+  if (!count)
+    return false;
+  uint64_t elements = count->getZExtValue();
+  if (EfficientBoolCache && isi1)
+    elements = (elements + 7) / 8;
+  uint64_t bytes = SaturatingMultiply(
+      elements,
+      (uint64_t)newFunc->getParent()->getDataLayout().getTypeAllocSize(T));
+  return bytes <= EnzymeStackCacheBytes;
+}
+
 /// Erase this instruction both from LLVM modules and any local data-structures
 void CacheUtility::erase(Instruction *I) {
   assert(I);
@@ -59,11 +122,16 @@ void CacheUtility::erase(Instruction *I) {
     scopeFrees.erase(found->first);
     scopeAllocs.erase(found->first);
     scopeInstructions.erase(found->first);
+    scopeEstimates.erase(found->first);
+    StackCaches.erase(found->first);
   }
   if (auto AI = dyn_cast<AllocaInst>(I)) {
     scopeFrees.erase(AI);
     scopeAllocs.erase(AI);
     scopeInstructions.erase(AI);
+    scopeEstimates.erase(AI);
+    CompressedCaches.erase(AI);
+    StackCaches.erase(AI);
   }
   scopeMap.erase(I);
   SE.eraseValueFromMap(I);
@@ -785,10 +853,15 @@ AllocaInst *CacheUtility::createCacheForScope(LimitContext ctx, Type *T,
       auto P = B.CreatePHI(i64, 1);
 
       CallInst *malloccall;
-      allocType = cast<PointerType>(CreateAllocation(B, types.back(), P,
-                                                     "tmpfortypecalc",
-                                                     &malloccall, nullptr)
-                                        ->getType());
+      allocType = cast<PointerType>(
+          (useCacheArena()
+               ? CreateTapeAllocation(B, types.back(), P, "tmpfortypecalc",
+                                      &malloccall, nullptr)
+               : CreateAllocation(B, types.back(), P, "tmpfortypecalc",
+                                  &malloccall, nullptr))
+              ->getType());
+      if (isSegmentedChunk(sublimits, i))
+        allocType = PointerType::getUnqual(allocType);
       malloctypes.push_back(cast<PointerType>(malloccall->getType()));
       SmallVector<Instruction *, 2> toErase;
       for (auto &I : *BB)
@@ -822,6 +895,36 @@ AllocaInst *CacheUtility::createCacheForScope(LimitContext ctx, Type *T,
     scopeInstructions[alloc].push_back(
         entryBuilder.CreateStore(Constant::getNullValue(types.back()), alloc));
 
+  ++NumCaches;
+
+  // Estimate the number of elements held by the cache, using the trip count
+  // of loops with a statically known bound and assuming the default trip
+  // count for the rest
+  {
+    unsigned depth = 0;
+    uint64_t iterations = 1;
+    for (auto &sublimit : sublimits) {
+      for (auto &lim : sublimit.second) {
+        ++depth;
+        uint64_t trips = EnzymeMinCutUnknownTripCount;
+        if (auto CI = dyn_cast<ConstantInt>(lim.second))
+          trips = CI->getZExtValue();
+        else if (auto CI = dyn_cast_or_null<ConstantInt>(
+                     (Value *)lim.first.maxLimit))
+          if (!lim.first.dynamic)
+            trips = CI->getZExtValue() + 1;
+        iterations = SaturatingMultiply(iterations, trips);
+      }
+    }
+    scopeEstimates[alloc] = std::make_pair(depth, iterations);
+    uint64_t elementBytes =
+        newFunc->getParent()->getDataLayout().getTypeStoreSize(types[0]);
+    EmitCacheRemark(getRemarkEmitter(newFunc), "CacheForScope",
+                    getBlockLocation(ctx.Block), ctx.Block,
+                    "Created cache for", nullptr, name, elementBytes, depth,
+                    SaturatingMultiply(elementBytes, iterations));
+  }
+
   Value *storeInto = alloc;
 
   // Iterating from outermost chunk to innermost chunk
@@ -840,6 +943,8 @@ AllocaInst *CacheUtility::createCacheForScope(LimitContext ctx, Type *T,
     unsigned bsize = (unsigned)byteSizeOfType->getZExtValue();
     unsigned alignSize = getCacheAlignment(bsize);
 
+    bool onStack = isStackChunk(sublimits, i, myType, isi1, extraSize);
+
     // Allocate and store the required memory
     if (allocateInternal) {
 
@@ -870,13 +975,55 @@ AllocaInst *CacheUtility::createCacheForScope(LimitContext ctx, Type *T,
       }
 
       StoreInst *storealloc = nullptr;
+      if (onStack) {
+        // Hold all iterations in the entry block of the function
+        uint64_t count = cast<ConstantInt>(size)->getZExtValue();
+        AllocaInst *buffer = entryBuilder.CreateAlloca(
+            ArrayType::get(myType, count), nullptr, name + "_stackcache");
+#if LLVM_VERSION_MAJOR >= 10
+        buffer->setAlignment(Align(alignSize));
+#else
+        buffer->setAlignment(alignSize);
+#endif
+        auto firstallocation = cast<Instruction>(entryBuilder.CreatePointerCast(
+            buffer, PointerType::getUnqual(myType)));
+        scopeInstructions[alloc].push_back(buffer);
+        scopeInstructions[alloc].push_back(firstallocation);
+        StackCaches[alloc] = buffer;
+        ++NumStackCaches;
+
+        if (EnzymeZeroCache)
+          scopeInstructions[alloc].push_back(allocationBuilder.CreateStore(
+              Constant::getNullValue(buffer->getAllocatedType()), buffer));
+        storealloc = allocationBuilder.CreateStore(firstallocation, storeInto);
+
+        if (CachePointerInvariantGroups.find(std::make_pair(
+                (Value *)alloc, i)) == CachePointerInvariantGroups.end()) {
+          MDNode *invgroup = MDNode::getDistinct(alloc->getContext(), {});
+          CachePointerInvariantGroups[std::make_pair((Value *)alloc, i)] =
+              invgroup;
+        }
+        storealloc->setMetadata(
+            LLVMContext::MD_invariant_group,
+            CachePointerInvariantGroups[std::make_pair((Value *)alloc, i)]);
+        scopeInstructions[alloc].push_back(storealloc);
+        for (auto post : PostCacheStore(storealloc, allocationBuilder)) {
+          scopeInstructions[alloc].push_back(post);
+        }
+      }
       // Statically allocate memory for all iterations if possible
-      if (sublimits[i].second.back().first.maxLimit) {
+      else if (sublimits[i].second.back().first.maxLimit) {
         CallInst *malloccall = nullptr;
         Instruction *ZeroInst = nullptr;
-        Value *firstallocation = CreateAllocation(
-            allocationBuilder, myType, size, name + "_malloccache", &malloccall,
-            /*ZeroMem*/ (EnzymeZeroCache && i == 0) ? &ZeroInst : nullptr);
+        Instruction **ZeroMem =
+            (EnzymeZeroCache && i == 0) ? &ZeroInst : nullptr;
+        Value *firstallocation =
+            useCacheArena()
+                ? CreateTapeAllocation(allocationBuilder, myType, size,
+                                       name + "_malloccache", &malloccall,
+                                       ZeroMem)
+                : CreateAllocation(allocationBuilder, myType, size,
+                                   name + "_malloccache", &malloccall, ZeroMem);
 
         scopeInstructions[alloc].push_back(malloccall);
         if (firstallocation != malloccall)
@@ -912,6 +1059,43 @@ AllocaInst *CacheUtility::createCacheForScope(LimitContext ctx, Type *T,
         for (auto post : PostCacheStore(storealloc, allocationBuilder)) {
           scopeInstructions[alloc].push_back(post);
         }
+      } else if (isSegmentedChunk(sublimits, i)) {
+        // Keep the iterations of the dynamic loop in fixed size segments
+        // reached through a directory, so that cached values are never
+        // copied as the loop runs
+        auto zerostore = allocationBuilder.CreateStore(
+            ConstantPointerNull::get(cast<PointerType>(types[i + 1])),
+            storeInto);
+        scopeInstructions[alloc].push_back(zerostore);
+
+        IRBuilder<> build(containedloops.back().first.incvar->getNextNode());
+#if LLVM_VERSION_MAJOR > 7
+        Value *allocation = build.CreateLoad(
+            storeInto->getType()->getPointerElementType(), storeInto);
+#else
+        Value *allocation = build.CreateLoad(storeInto);
+#endif
+
+        CallInst *segmentcall = nullptr;
+        Value *segmented = CreateSegmentedAllocation(
+            build, allocation, myType, containedloops.back().first.var, size,
+            name + "_segmentedcache", &segmentcall, EnzymeZeroCache && i == 0);
+        scopeInstructions[alloc].push_back(segmentcall);
+
+        if (segmented->getType() != types[i + 1]) {
+          auto I =
+              cast<Instruction>(build.CreateBitCast(segmented, types[i + 1]));
+          scopeInstructions[alloc].push_back(I);
+          segmented = I;
+        }
+
+        scopeAllocs[alloc].push_back(segmentcall);
+
+        storealloc = build.CreateStore(segmented, storeInto);
+        scopeInstructions[alloc].push_back(storealloc);
+        for (auto post : PostCacheStore(storealloc, build)) {
+          scopeInstructions[alloc].push_back(post);
+        }
       } else {
         llvm::PointerType *allocType = cast<PointerType>(types[i + 1]);
         llvm::PointerType *mallocType = malloctypes[i];
@@ -940,7 +1124,8 @@ AllocaInst *CacheUtility::createCacheForScope(LimitContext ctx, Type *T,
         CallInst *realloccall = nullptr;
         auto reallocation = CreateReAllocation(
             build, allocation, myType, containedloops.back().first.incvar, size,
-            name + "_realloccache", &realloccall, EnzymeZeroCache && i == 0);
+            name + "_realloccache", &realloccall, EnzymeZeroCache && i == 0,
+            useCacheArena());
 
         scopeInstructions[alloc].push_back(cast<Instruction>(reallocation));
 
@@ -973,7 +1158,7 @@ AllocaInst *CacheUtility::createCacheForScope(LimitContext ctx, Type *T,
     }
 
     // Free the memory, if requested
-    if (shouldFree) {
+    if (shouldFree && !onStack) {
       if (CachePointerInvariantGroups.find(std::make_pair((Value *)alloc, i)) ==
           CachePointerInvariantGroups.end()) {
         MDNode *invgroup = MDNode::getDistinct(alloc->getContext(), {});
@@ -990,9 +1175,11 @@ AllocaInst *CacheUtility::createCacheForScope(LimitContext ctx, Type *T,
     if (i != 0) {
       IRBuilder<> v(&sublimits[i - 1].second.back().first.preheader->back());
 
+      Value *segment = nullptr;
       Value *idx = computeIndexOfChunk(
           /*inForwardPass*/ true, v, containedloops,
-          /*available*/ ValueToValueMapTy());
+          /*available*/ ValueToValueMapTy(),
+          isSegmentedChunk(sublimits, i) ? &segment : nullptr);
 
 #if LLVM_VERSION_MAJOR > 7
       storeInto = v.CreateLoad(storeInto->getType()->getPointerElementType(),
@@ -1002,11 +1189,18 @@ AllocaInst *CacheUtility::createCacheForScope(LimitContext ctx, Type *T,
 #else
       cast<LoadInst>(storeInto)->setAlignment(alignSize);
 #endif
+      if (segment)
+        storeInto = v.CreateLoad(
+            storeInto->getType()->getPointerElementType(),
+            v.CreateInBoundsGEP(storeInto->getType()->getPointerElementType(),
+                                storeInto, segment));
       storeInto = v.CreateGEP(storeInto->getType()->getPointerElementType(),
                               storeInto, idx);
 #else
       storeInto = v.CreateLoad(storeInto);
       cast<LoadInst>(storeInto)->setAlignment(alignSize);
+      if (segment)
+        storeInto = v.CreateLoad(v.CreateInBoundsGEP(storeInto, segment));
       storeInto = v.CreateGEP(storeInto, idx);
 #endif
       cast<GetElementPtrInst>(storeInto)->setIsInBounds(true);
@@ -1015,10 +1209,220 @@ AllocaInst *CacheUtility::createCacheForScope(LimitContext ctx, Type *T,
   return alloc;
 }
 
+/// The tape compression policy named Key for V, given by metadata on V, else
+/// by an attribute of F, else by Default
+static StringRef getTapeCompressPolicy(const Value *V, const Function *F,
+                                       StringRef Key, StringRef Default) {
+  if (auto I = dyn_cast<Instruction>(V))
+    if (auto MD = I->getMetadata(Key))
+      if (MD->getNumOperands())
+        if (auto S = dyn_cast<MDString>(MD->getOperand(0)))
+          return S->getString();
+  if (F->hasFnAttribute(Key))
+    return F->getFnAttribute(Key).getValueAsString();
+  return Default;
+}
+
+/// Whether V only flows into floating point arithmetic, such that rounding it
+/// perturbs derivatives by a bounded relative error rather than changing
+/// control flow, indices or addresses recomputed from it in the reverse
+static bool onlyFeedsFPArithmetic(Value *V) {
+  SmallVector<Value *, 4> todo = {V};
+  SmallPtrSet<Value *, 8> seen = {V};
+  while (!todo.empty()) {
+    Value *cur = todo.pop_back_val();
+    for (User *U : cur->users()) {
+      auto I = cast<Instruction>(U);
+      if (isa<ReturnInst>(I))
+        continue;
+      if (auto SI = dyn_cast<StoreInst>(I)) {
+        if (SI->getValueOperand() != cur)
+          return false;
+        continue;
+      }
+      if (auto SI = dyn_cast<SelectInst>(I)) {
+        if (SI->getCondition() == cur)
+          return false;
+      } else if (auto CI = dyn_cast<CallInst>(I)) {
+        Intrinsic::ID ID = Intrinsic::not_intrinsic;
+        if (auto II = dyn_cast<IntrinsicInst>(CI))
+          ID = II->getIntrinsicID();
+        else
+          isMemFreeLibMFunction(getFuncNameFromCall(CI), &ID);
+        switch (ID) {
+        case Intrinsic::sqrt:
+        case Intrinsic::sin:
+        case Intrinsic::cos:
+        case Intrinsic::exp:
+        case Intrinsic::exp2:
+        case Intrinsic::log:
+        case Intrinsic::log2:
+        case Intrinsic::log10:
+        case Intrinsic::pow:
+        case Intrinsic::fabs:
+        case Intrinsic::fma:
+        case Intrinsic::fmuladd:
+          break;
+        default:
+          return false;
+        }
+      } else if (!isa<PHINode>(I) && !isa<FPExtInst>(I) &&
+                 !isa<FPTruncInst>(I)) {
+        switch (I->getOpcode()) {
+        case Instruction::FAdd:
+        case Instruction::FSub:
+        case Instruction::FMul:
+        case Instruction::FDiv:
+        case Instruction::FNeg:
+          break;
+        default:
+          return false;
+        }
+      }
+      if (seen.insert(I).second)
+        todo.push_back(I);
+    }
+  }
+  return true;
+}
+
+Type *CacheUtility::getCacheStorageType(Value *V, LimitContext ctx) {
+  Type *T = V->getType();
+
+  // Only loop caches are compressed. Other caches live in an alloca or
+  // directly in the tape, where the saving is negligible.
+  if (!ctx.ForceSingleIteration) {
+    LoopContext lc;
+    if (!getContext(ctx.Block, lc, ctx.ReverseLimit))
+      return T;
+  }
+
+  if (T->isFloatTy() || T->isDoubleTy()) {
+    TapeCompressFP policy = EnzymeTapeCompressFP;
+    StringRef name =
+        getTapeCompressPolicy(V, newFunc, "enzyme_tape_compress_fp", "");
+    if (!name.empty()) {
+      if (name == "none")
+        policy = TapeCompressFP::None;
+      else if (name == "float")
+        policy = TapeCompressFP::Float;
+      else if (name == "bfloat16")
+        policy = TapeCompressFP::BFloat16;
+      else {
+        EmitWarning("UnknownTapeCompression", newFunc,
+                    "unknown tape compression policy ", name);
+        return T;
+      }
+    }
+    if (policy == TapeCompressFP::None || !onlyFeedsFPArithmetic(V))
+      return T;
+    if (policy == TapeCompressFP::Float && T->isDoubleTy())
+      return Type::getFloatTy(T->getContext());
+    // bfloat16 values are stored as the upper half of the bits of a float
+    if (policy == TapeCompressFP::BFloat16)
+      return Type::getInt16Ty(T->getContext());
+    return T;
+  }
+
+  if (auto IT = dyn_cast<IntegerType>(T)) {
+    if (IT->getBitWidth() <= 8)
+      return T;
+    if (getTapeCompressPolicy(V, newFunc, "enzyme_tape_pack_ints",
+                              EnzymeTapePackInts ? "true" : "false") != "true")
+      return T;
+    // Values are sign extended on lookup, so we need the sign bit as well
+    unsigned bits = IT->getBitWidth() -
+                    ComputeNumSignBits(V, newFunc->getParent()->getDataLayout(),
+                                       0, &AC, dyn_cast<Instruction>(V), &DT) +
+                    1;
+    unsigned width = std::max(8u, (unsigned)PowerOf2Ceil(bits));
+    if (width >= IT->getBitWidth())
+      return T;
+    return IntegerType::get(T->getContext(), width);
+  }
+  return T;
+}
+
+bool isCompressedCacheType(Type *Stored, Type *Orig) {
+  if (Stored == Orig)
+    return false;
+  if (Orig->isDoubleTy())
+    return Stored->isFloatTy() || Stored->isIntegerTy(16);
+  if (Orig->isFloatTy())
+    return Stored->isIntegerTy(16);
+  if (Orig->isIntegerTy() && Stored->isIntegerTy())
+    return Stored->getIntegerBitWidth() >= 8 &&
+           Stored->getIntegerBitWidth() < Orig->getIntegerBitWidth();
+  return false;
+}
+
+/// Convert V to the compressed cache type Stored
+static Value *compressCacheValue(IRBuilder<> &B, Value *V, Type *Stored) {
+  Type *T = V->getType();
+  if (T->isFloatingPointTy() && Stored->isIntegerTy()) {
+    // Round to the nearest bfloat16, ties to even, keeping NaNs quiet. The
+    // NaN check must not be folded away by fast math flags.
+    IRBuilder<>::FastMathFlagGuard guard(B);
+    B.clearFastMathFlags();
+    auto i32 = B.getInt32Ty();
+    Value *F = T->isFloatTy() ? V : B.CreateFPTrunc(V, B.getFloatTy());
+    Value *bits = B.CreateBitCast(F, i32);
+    Value *odd = B.CreateAnd(B.CreateLShr(bits, 16), ConstantInt::get(i32, 1));
+    Value *rounded =
+        B.CreateAdd(bits, B.CreateAdd(odd, ConstantInt::get(i32, 0x7FFF)));
+    bits = B.CreateSelect(B.CreateFCmpUNO(F, F),
+                          B.CreateOr(bits, ConstantInt::get(i32, 0x400000)),
+                          rounded);
+    return B.CreateTrunc(B.CreateLShr(bits, 16), Stored);
+  }
+  if (T->isFloatingPointTy())
+    return B.CreateFPTrunc(V, Stored);
+  return B.CreateTrunc(V, Stored);
+}
+
+/// Convert V, loaded from a compressed cache, back to the type Orig
+static Value *decompressCacheValue(IRBuilder<> &B, Value *V, Type *Orig) {
+  if (Orig->isFloatingPointTy() && V->getType()->isIntegerTy()) {
+    Value *F = B.CreateBitCast(
+        B.CreateShl(B.CreateZExt(V, B.getInt32Ty()), 16), B.getFloatTy());
+    return Orig->isFloatTy() ? F : B.CreateFPExt(F, Orig);
+  }
+  if (Orig->isFloatingPointTy())
+    return B.CreateFPExt(V, Orig);
+  return B.CreateSExt(V, Orig);
+}
+
+/// Report a value being cached as the compressed type Stored, with the
+/// relative error this introduces for floating point values. The bound only
+/// holds within the exponent range of float, as larger values overflow to
+/// infinity and smaller ones lose precision as subnormals.
+static void EmitCompressedCacheRemark(OptimizationRemarkEmitter &ORE,
+                                      const DiagnosticLocation &Loc,
+                                      const BasicBlock *BB, const Value *V,
+                                      Type *Stored) {
+  if (!V->getType()->isFloatingPointTy()) {
+    ORE.emit([&]() {
+      return OptimizationRemarkAnalysis("enzyme", "PackedCache", Loc, BB)
+             << "Caching " << ore::NV("Value", V) << " losslessly in "
+             << ore::NV("Bits", Stored->getIntegerBitWidth()) << " bits";
+    });
+    return;
+  }
+  bool bf16 = Stored->isIntegerTy();
+  ORE.emit([&]() {
+    return OptimizationRemarkAnalysis("enzyme", "LossyCache", Loc, BB)
+           << "Caching " << ore::NV("Value", V) << " as "
+           << (bf16 ? "bfloat16" : "float") << ", relative error up to 2^-"
+           << ore::NV("PrecisionBits", bf16 ? 8 : 24)
+           << " for magnitudes from 2^-126 to 2^127, larger magnitudes "
+              "overflow to infinity";
+  });
+}
+
 Value *CacheUtility::computeIndexOfChunk(
     bool inForwardPass, IRBuilder<> &v,
     ArrayRef<std::pair<LoopContext, llvm::Value *>> containedloops,
-    const ValueToValueMapTy &available) {
+    const ValueToValueMapTy &available, Value **segment) {
   // List of loop indices in chunk from innermost to outermost
   SmallVector<Value *, 3> indices;
   // List of cumulative indices in chunk from innermost to outermost
@@ -1052,6 +1456,13 @@ Value *CacheUtility::computeIndexOfChunk(
                         /*NSW*/ true);
     }
 
+    // Iterations of a segmented dynamic loop are split into the segment and
+    // the iteration within it
+    if (segment && i + 1 == containedloops.size() && !idx.maxLimit) {
+      *segment = v.CreateLShr(var, getCacheSegmentShift());
+      var = v.CreateAnd(var, (1ULL << getCacheSegmentShift()) - 1);
+    }
+
     indices.push_back(var);
     Value *lim = pair.second;
     assert(lim);
@@ -1394,6 +1805,14 @@ void CacheUtility::storeInstructionInCache(LimitContext ctx,
     }
   }
 
+  bool compressed = false;
+  if (isCompressedCacheType(loc->getType()->getPointerElementType(),
+                            val->getType())) {
+    tostore = compressCacheValue(v, val,
+                                 loc->getType()->getPointerElementType());
+    compressed = true;
+  }
+
   if (tostore->getType() != loc->getType()->getPointerElementType()) {
     llvm::errs() << "val: " << *val << "\n";
     llvm::errs() << "tostore: " << *tostore << "\n";
@@ -1404,7 +1823,7 @@ void CacheUtility::storeInstructionInCache(LimitContext ctx,
 
   // If the value stored doesnt change (per efficient bool cache),
   // mark it as invariant
-  if (tostore == val) {
+  if (tostore == val || compressed) {
     if (ValueInvariantGroups.find(cache) == ValueInvariantGroups.end()) {
       MDNode *invgroup = MDNode::getDistinct(cache->getContext(), {});
       ValueInvariantGroups[cache] = invgroup;
@@ -1419,10 +1838,12 @@ void CacheUtility::storeInstructionInCache(LimitContext ctx,
                        ctx.Block->getParent()
                                ->getParent()
                                ->getDataLayout()
-                               .getTypeAllocSizeInBits(val->getType()) /
+                               .getTypeAllocSizeInBits(tostore->getType()) /
                            8);
   unsigned align = getCacheAlignment((unsigned)byteSizeOfType->getZExtValue());
-  storeinst->setMetadata(LLVMContext::MD_tbaa, TBAA);
+  // The type based aliasing tag of the value does not describe its compressed
+  // form
+  storeinst->setMetadata(LLVMContext::MD_tbaa, compressed ? nullptr : TBAA);
 #if LLVM_VERSION_MAJOR >= 10
   storeinst->setAlignment(Align(align));
 #else
@@ -1432,6 +1853,27 @@ void CacheUtility::storeInstructionInCache(LimitContext ctx,
   for (auto post : PostCacheStore(storeinst, v)) {
     scopeInstructions[cache].push_back(post);
   }
+
+  ++NumCachedValues;
+  {
+    auto found = scopeEstimates.find(cache);
+    unsigned depth = found == scopeEstimates.end() ? 0 : found->second.first;
+    uint64_t iterations =
+        found == scopeEstimates.end() ? 1 : found->second.second;
+    DiagnosticLocation Loc = BuilderM.getCurrentDebugLocation();
+    if (auto inst = dyn_cast<Instruction>(val))
+      if (inst->getDebugLoc())
+        Loc = DiagnosticLocation(inst->getDebugLoc());
+    uint64_t elementBytes = byteSizeOfType->getZExtValue();
+    if (compressed) {
+      ++NumCompressedCachedValues;
+      EmitCompressedCacheRemark(getRemarkEmitter(newFunc), Loc,
+                                v.GetInsertBlock(), val, tostore->getType());
+    }
+    EmitCacheRemark(getRemarkEmitter(newFunc), "StoreInCache", Loc,
+                    v.GetInsertBlock(), "Caching", val, "", elementBytes,
+                    depth, SaturatingMultiply(elementBytes, iterations));
+  }
 }
 
 /// Given an allocation defined at a particular ctx, store the instruction
@@ -1528,8 +1970,28 @@ Value *CacheUtility::getCachePointer(bool inForwardPass, IRBuilder<> &BuilderM,
     const auto &containedloops = sublimits[i].second;
 
     if (containedloops.size() > 0) {
-      Value *idx = computeIndexOfChunk(inForwardPass, BuilderM, containedloops,
-                                       available);
+      Value *segment = nullptr;
+      Value *idx = computeIndexOfChunk(
+          inForwardPass, BuilderM, containedloops, available,
+          isSegmentedChunk(sublimits, i) ? &segment : nullptr);
+      if (segment) {
+        // Lookup the segment holding this iteration
+#if LLVM_VERSION_MAJOR > 7
+        Value *entry = BuilderM.CreateInBoundsGEP(
+            next->getType()->getPointerElementType(), next, segment);
+        next =
+            BuilderM.CreateLoad(entry->getType()->getPointerElementType(), entry);
+#else
+        Value *entry = BuilderM.CreateInBoundsGEP(next, segment);
+        next = BuilderM.CreateLoad(entry);
+#endif
+        if (storeInInstructionsMap && isa<AllocaInst>(cache)) {
+          scopeInstructions[cast<AllocaInst>(cache)].push_back(
+              cast<Instruction>(entry));
+          scopeInstructions[cast<AllocaInst>(cache)].push_back(
+              cast<Instruction>(next));
+        }
+      }
       if (EfficientBoolCache && isi1 && i == 0)
         idx = BuilderM.CreateLShr(
             idx, ConstantInt::get(Type::getInt64Ty(newFunc->getContext()), 3));
@@ -1538,6 +2000,18 @@ Value *CacheUtility::getCachePointer(bool inForwardPass, IRBuilder<> &BuilderM,
         assert(es);
         idx = BuilderM.CreateMul(idx, es, "", /*NUW*/ true, /*NSW*/ true);
       }
+      // The reverse pass reads memory mapped caches backwards, so ask for
+      // them to be read ahead
+      if (i == 0 && !inForwardPass && useCacheArena() && useTapeMmap()) {
+        uint64_t stride =
+            newFunc->getParent()->getDataLayout().getTypeAllocSize(
+                next->getType()->getPointerElementType());
+        CreateTapePrefetch(
+            BuilderM, next,
+            BuilderM.CreateMul(idx, ConstantInt::get(idx->getType(), stride),
+                               "", /*NUW*/ true, /*NSW*/ true),
+            stride);
+      }
 #if LLVM_VERSION_MAJOR > 7
       next = BuilderM.CreateGEP(next->getType()->getPointerElementType(), next,
                                 idx);
@@ -1630,5 +2104,9 @@ CacheUtility::lookupValueFromCache(bool inForwardPass, IRBuilder<> &BuilderM,
       return BuilderM.CreateTrunc(res, Type::getInt1Ty(result->getContext()));
     }
   }
+
+  auto found = CompressedCaches.find(cache);
+  if (found != CompressedCaches.end())
+    result = decompressCacheValue(BuilderM, result, found->second);
   return result;
 }
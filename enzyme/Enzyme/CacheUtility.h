@@ -40,11 +40,26 @@
 #include "FunctionUtils.h"
 #include "MustExitScalarEvolution.h"
 
+/// Precision in which loop caches of floating point values are stored
+enum class TapeCompressFP { None, Float, BFloat16 };
+
 extern "C" {
 /// Pack 8 bools together in a single byte
 extern llvm::cl::opt<bool> EfficientBoolCache;
 
 extern llvm::cl::opt<bool> EnzymeZeroCache;
+
+/// Trip count assumed for loops whose maximum trip count is not known
+extern llvm::cl::opt<unsigned> EnzymeMinCutUnknownTripCount;
+
+/// Precision in which loop caches of floating point values are stored
+extern llvm::cl::opt<TapeCompressFP> EnzymeTapeCompressFP;
+
+/// Store loop caches of integers in the narrowest width holding their range
+extern llvm::cl::opt<bool> EnzymeTapePackInts;
+
+/// Largest cache of loops with constant trip counts held on the stack
+extern llvm::cl::opt<unsigned> EnzymeStackCacheBytes;
 }
 
 /// Container for all loop information to synthesize gradients
@@ -152,10 +167,16 @@ protected:
   CacheUtility(llvm::TargetLibraryInfo &TLI, llvm::Function *newFunc)
       : newFunc(newFunc), TLI(TLI), DT(*newFunc), LI(DT), AC(*newFunc),
         SE(*newFunc, TLI, AC, DT, LI) {
+    for (auto &BB : *newFunc)
+      if (llvm::isa_and_nonnull<llvm::ReturnInst>(BB.getTerminator()))
+        ++NumReturns;
     inversionAllocs = llvm::BasicBlock::Create(newFunc->getContext(),
                                                "allocsForInversion", newFunc);
   }
 
+  /// Number of returns of the function being differentiated
+  unsigned NumReturns = 0;
+
 public:
   virtual ~CacheUtility();
 
@@ -247,6 +268,27 @@ public:
   SubLimitType getSubLimits(bool inForwardPass, llvm::IRBuilder<> *RB,
                             LimitContext ctx, llvm::Value *extraSize = nullptr);
 
+  /// Whether chunk i of sublimits, holding elements of T, is small enough to
+  /// be held on the stack rather than the heap. This requires the trip counts
+  /// of every enclosing loop to be constant. In split mode such a chunk is
+  /// passed inline in the tape, which requires a single return to load it at.
+  bool isStackChunk(const SubLimitType &sublimits, int i, llvm::Type *T,
+                    bool isi1, llvm::Value *extraSize) const;
+
+  /// Whether chunk i of sublimits is cached in a directory of fixed size
+  /// segments, rather than in a buffer reallocated as its dynamic loop runs.
+  /// This adds a level of pointers to the cache.
+  bool isSegmentedChunk(const SubLimitType &sublimits, int i) const {
+    return useSegmentedCache() && !sublimits[i].second.back().first.maxLimit;
+  }
+
+  /// Whether the outermost chunk of sublimits belongs to a dynamic loop, so
+  /// that its allocation is grown as the loop runs. Inside a parallel region
+  /// such a cache is private to the thread that ran the loop.
+  bool isDynamicOutermostChunk(const SubLimitType &sublimits) const {
+    return sublimits.size() && !sublimits.back().second.back().first.maxLimit;
+  }
+
 private:
   /// Internal data structure used by getSubLimit to avoid computing the same
   /// loop limit multiple times if possible. Map's a desired limitMinus1 (see
@@ -265,11 +307,14 @@ private:
       SizeCache;
 
   /// Given a loop context, compute the corresponding index into said loop at
-  /// the IRBuilder<>
+  /// the IRBuilder<>. If segment is set and the outermost loop of the chunk is
+  /// dynamic, set it to the index of the segment holding the iteration and
+  /// return the index within that segment.
   llvm::Value *computeIndexOfChunk(
       bool inForwardPass, llvm::IRBuilder<> &v,
       llvm::ArrayRef<std::pair<LoopContext, llvm::Value *>> containedloops,
-      const llvm::ValueToValueMapTy &available);
+      const llvm::ValueToValueMapTy &available,
+      llvm::Value **segment = nullptr);
 
 private:
   /// Given a cache allocation and an index denoting how many Chunks deep the
@@ -308,6 +353,28 @@ protected:
            llvm::SmallVector<llvm::AssertingVH<llvm::CallInst>, 4>>
       scopeAllocs;
 
+  /// A map of caches whose elements are held on the stack to the alloca
+  /// holding them
+  std::map<llvm::AllocaInst *, llvm::AllocaInst *> StackCaches;
+
+  /// A map of allocations to the depth of the loop nest they are indexed by
+  /// and the estimated number of elements they hold, for remarks
+  std::map<llvm::AllocaInst *, std::pair<unsigned, uint64_t>> scopeEstimates;
+
+  /// A map of functions to the emitter of the remarks reported on them,
+  /// created on first use
+  std::map<llvm::Function *, std::unique_ptr<llvm::OptimizationRemarkEmitter>>
+      remarkEmitters;
+
+public:
+  /// Return the emitter shared by the remarks reported on F
+  llvm::OptimizationRemarkEmitter &getRemarkEmitter(llvm::Function *F);
+
+protected:
+  /// A map of caches storing compressed values to the type of the values
+  /// before compression
+  std::map<llvm::Value *, llvm::Type *> CompressedCaches;
+
   /// Perform the final load from the cache, applying requisite invariant
   /// group and alignment
   llvm::Value *loadFromCachePointer(llvm::IRBuilder<> &BuilderM,
@@ -322,6 +389,15 @@ public:
                                         bool allocateInternal = true,
                                         llvm::Value *extraSize = nullptr);
 
+  /// The type in which to cache V at ctx. Per the tape compression policy
+  /// of V (an !enzyme_tape_compress_fp or !enzyme_tape_pack_ints metadata
+  /// string), else of its function (a function attribute of the same name),
+  /// else of the command line, loop caches may hold floating point values in
+  /// reduced precision and integers in a narrower width. Floating point values
+  /// are only held in reduced precision if they solely feed floating point
+  /// arithmetic, and not comparisons, conversions or addresses.
+  llvm::Type *getCacheStorageType(llvm::Value *V, LimitContext ctx);
+
   /// High-level utility to "unwrap" an instruction at a new location specified
   /// by BuilderM. Depending on the mode, it will either just unwrap this
   /// instruction, all of its instructions operands, and optionally lookup
@@ -350,6 +426,9 @@ public:
 
   virtual bool assumeDynamicLoopOfSizeOne(llvm::Loop *L) const = 0;
 
+  /// Whether the buffers of caches should be allocated out of the tape arena
+  virtual bool useCacheArena() const { return useTapeArena(); }
+
   /// If an allocation is requested to be freed, this subclass will be called to
   /// chose how and where to free it. It is by default not implemented, falling
   /// back to an error. Subclasses who want to free memory should implement this
@@ -397,6 +476,9 @@ protected:
   llvm::SmallPtrSet<llvm::LoadInst *, 10> CacheLookups;
 };
 
+/// Whether a cache of values of type Orig may store them as type Stored
+bool isCompressedCacheType(llvm::Type *Stored, llvm::Type *Orig);
+
 // Create a new canonical induction variable of Type Ty for Loop L
 // Return the variable and the increment instruction
 std::pair<llvm::PHINode *, llvm::Instruction *>
@@ -27,6 +27,7 @@
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
 #include "../Enzyme.h"
+#include "../FunctionSummary.h"
 #include "../PreserveNVVM.h"
 
 #include "llvm/LinkAllPasses.h"
@@ -62,6 +63,21 @@ static RegisterStandardPasses
     clangtoolLoader_OEarly(PassManagerBuilder::EP_EarlyAsPossible,
                            loadNVVMPass);
 
+// Embed the analysis summaries once the module is otherwise final, such that
+// a link-time Enzyme pass can reuse them
+static void loadSummaryPass(const PassManagerBuilder &Builder,
+                            legacy::PassManagerBase &PM) {
+  if (EnzymeEmitSummaries)
+    PM.add(createFunctionSummaryPass());
+}
+
+static RegisterStandardPasses
+    clangtoolLoader_SummaryOx(PassManagerBuilder::EP_OptimizerLast,
+                              loadSummaryPass);
+static RegisterStandardPasses
+    clangtoolLoader_SummaryO0(PassManagerBuilder::EP_EnabledOnOptLevel0,
+                              loadSummaryPass);
+
 #if LLVM_VERSION_MAJOR >= 9
 
 static void loadLTOPass(const PassManagerBuilder &Builder,
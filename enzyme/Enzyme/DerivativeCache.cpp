@@ -0,0 +1,513 @@
+//===- DerivativeCache.cpp - Persistent on-disk cache of derivatives  -----===//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+// If using this code in an academic setting, please cite the following:
+// @incollection{enzymeNeurips,
+// title = {Instead of Rewriting Foreign Code for Machine Learning,
+//          Automatically Synthesize Fast Gradients},
+// author = {Moses, William S. and Churavy, Valentin},
+// booktitle = {Advances in Neural Information Processing Systems 33},
+// year = {2020},
+// note = {To appear in},
+// }
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements an opt-in persistent cache which stores generated
+// derivatives as bitcode on disk, keyed by a structural hash of the primal
+// function (and everything it references) together with the derivative
+// configuration. A later compilation of the same primal splices the cached
+// derivative back into the module rather than regenerating it.
+//
+//===----------------------------------------------------------------------===//
+// GradientUtils.h must come first, so that Enzyme's copy of ScalarEvolution
+// replaces the one the other headers include.
+#include "GradientUtils.h"
+
+#include "DerivativeCache.h"
+
+#include "ActivityAnalysis.h"
+#include "FunctionSummary.h"
+#include "LoopCheckpointing.h"
+#include "OpenMPFusion.h"
+#include "OpenMPShadow.h"
+#include "TypeAnalysis/TypeTree.h"
+#include "Utils.h"
+
+#include <llvm/Config/llvm-config.h>
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+
+#include "llvm/Linker/Linker.h"
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+
+#include "llvm/Transforms/Utils/Cloning.h"
+
+using namespace llvm;
+
+#ifdef DEBUG_TYPE
+#undef DEBUG_TYPE
+#endif
+#define DEBUG_TYPE "enzyme"
+
+STATISTIC(NumDerivativeCacheHits,
+          "Number of derivatives loaded from the derivative cache");
+STATISTIC(NumDerivativeCacheMisses,
+          "Number of derivatives not found in the derivative cache");
+STATISTIC(NumDerivativeCacheStores,
+          "Number of derivatives written to the derivative cache");
+
+extern "C" {
+llvm::cl::opt<std::string> EnzymeDerivativeCache(
+    "enzyme-derivative-cache", cl::init(""), cl::Hidden,
+    cl::desc("Directory in which to persistently cache generated derivatives"));
+}
+
+extern "C" {
+// Options changing the generated derivatives which no header declares
+extern llvm::cl::opt<bool> EnzymeEmptyFnInactive;
+extern llvm::cl::opt<bool> EnzymeGlobalActivity;
+extern llvm::cl::opt<bool> EfficientMaxCache;
+extern llvm::cl::opt<bool> EnzymeJuliaAddrLoad;
+extern llvm::cl::opt<bool> EnzymePreopt;
+extern llvm::cl::opt<bool> EnzymeInline;
+extern llvm::cl::opt<bool> EnzymeNoAlias;
+extern llvm::cl::opt<bool> EnzymeAggressiveAA;
+extern llvm::cl::opt<bool> EnzymeLowerGlobals;
+extern llvm::cl::opt<int> EnzymeInlineCount;
+extern llvm::cl::opt<bool> EnzymeCoalese;
+#if LLVM_VERSION_MAJOR >= 8
+extern llvm::cl::opt<bool> EnzymePHIRestructure;
+#endif
+extern llvm::cl::opt<bool> EnzymeNameInstructions;
+extern llvm::cl::opt<bool> EnzymeSelectOpt;
+extern llvm::cl::opt<bool> EnzymeNewCache;
+extern llvm::cl::opt<bool> EnzymeMinCutCache;
+extern llvm::cl::opt<bool> EnzymeWeightedMinCut;
+extern llvm::cl::opt<bool> EnzymeLoopInvariantCache;
+extern llvm::cl::opt<bool> EnzymeSharedForward;
+extern llvm::cl::opt<bool> EnzymeRegisterReduce;
+extern llvm::cl::opt<bool> EnzymeSpeculatePHIs;
+extern llvm::cl::opt<bool> EnzymeVectorSplitPhi;
+extern llvm::cl::opt<int> MaxIntOffset;
+extern llvm::cl::opt<bool> RustTypeRules;
+extern llvm::cl::opt<bool> EnzymeStrictAliasing;
+extern llvm::cl::opt<bool> EnzymeTypeSummaries;
+extern llvm::cl::opt<std::string> EnzymeTapeMmapDir;
+extern llvm::cl::opt<unsigned> EnzymeTapeMmapPrefetch;
+}
+
+/// Version of the on-disk format, bumped whenever the generated derivatives
+/// or the cache layout change incompatibly.
+static constexpr const char *CacheFormatVersion = "enzyme-derivative-cache-1";
+
+/// Prefix given to the root derivative while it is stored in the cache.
+static constexpr const char *CacheRootPrefix = "__enzyme_cached_";
+
+/// Attribute holding the name of the root derivative while it is stored in
+/// the cache.
+static constexpr const char *CacheNameAttr = "enzyme_cache_name";
+
+/// Add the global values referenced by \p V to \p todo.
+static void findReferencedGlobals(Value *V, SmallVectorImpl<GlobalValue *> &todo,
+                                  SmallPtrSetImpl<Constant *> &seenConstants) {
+  if (auto GV = dyn_cast<GlobalValue>(V)) {
+    todo.push_back(GV);
+    return;
+  }
+  auto C = dyn_cast<Constant>(V);
+  if (!C || !seenConstants.insert(C).second)
+    return;
+  for (auto &op : C->operands())
+    findReferencedGlobals(op, todo, seenConstants);
+}
+
+/// Collect all global values transitively referenced from \p root, either
+/// through instructions, initializers, or metadata such as enzyme_gradient.
+static void collectReferencedGlobals(GlobalValue *root,
+                                     SmallPtrSetImpl<GlobalValue *> &seen) {
+  SmallVector<GlobalValue *, 4> todo = {root};
+  SmallPtrSet<Constant *, 4> seenConstants;
+  while (todo.size()) {
+    auto GV = todo.pop_back_val();
+    if (!seen.insert(GV).second)
+      continue;
+    if (auto GA = dyn_cast<GlobalAlias>(GV)) {
+      findReferencedGlobals(GA->getAliasee(), todo, seenConstants);
+      continue;
+    }
+    if (auto G = dyn_cast<GlobalVariable>(GV)) {
+      if (G->hasInitializer())
+        findReferencedGlobals(G->getInitializer(), todo, seenConstants);
+    }
+    SmallVector<std::pair<unsigned, MDNode *>, 2> MDs;
+    cast<GlobalObject>(GV)->getAllMetadata(MDs);
+    for (auto &pair : MDs)
+      for (auto &op : pair.second->operands())
+        if (auto CAM = dyn_cast_or_null<ConstantAsMetadata>(op))
+          findReferencedGlobals(CAM->getValue(), todo, seenConstants);
+    if (auto F = dyn_cast<Function>(GV)) {
+      if (F->hasPersonalityFn())
+        findReferencedGlobals(F->getPersonalityFn(), todo, seenConstants);
+      for (auto &I : instructions(F))
+        for (auto &op : I.operands())
+          findReferencedGlobals(op, todo, seenConstants);
+    }
+  }
+}
+
+/// Erase all global values of \p M which are not referenced and for which
+/// \p keep returns false.
+static void
+eraseUnusedGlobals(Module &M,
+                   llvm::function_ref<bool(const GlobalValue *)> keep) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    SmallVector<GlobalValue *, 4> toErase;
+    for (auto &GV : M.global_values()) {
+      GV.removeDeadConstantUsers();
+      if (GV.use_empty() && !keep(&GV))
+        toErase.push_back(&GV);
+    }
+    for (auto GV : toErase) {
+      GV->eraseFromParent();
+      changed = true;
+    }
+  }
+}
+
+/// Return a canonical textual form of \p todiff and every global it
+/// references, independent of unrelated contents of the module.
+static std::string printPrimalClosure(Function *todiff) {
+  SmallPtrSet<GlobalValue *, 4> primal;
+  collectReferencedGlobals(todiff, primal);
+
+  ValueToValueMapTy VMap;
+  auto Clone = CloneModule(
+      *todiff->getParent(), VMap,
+      [&](const GlobalValue *GV) { return primal.count(GV) != 0; });
+  SmallPtrSet<const GlobalValue *, 4> clonedPrimal;
+  for (auto GV : primal)
+    clonedPrimal.insert(cast<GlobalValue>(VMap[GV]));
+  eraseUnusedGlobals(*Clone, [&](const GlobalValue *GV) {
+    return clonedPrimal.count(GV) != 0;
+  });
+
+  // Module-level bookkeeping does not affect the derivative, except for the
+  // module flags, and differs between otherwise identical compilations.
+  SmallVector<NamedMDNode *, 2> namedToErase;
+  for (auto &NMD : Clone->named_metadata())
+    if (NMD.getName() != "llvm.module.flags")
+      namedToErase.push_back(&NMD);
+  for (auto NMD : namedToErase)
+    Clone->eraseNamedMetadata(NMD);
+  Clone->setModuleIdentifier("");
+  Clone->setSourceFileName("");
+
+  std::string s;
+  raw_string_ostream ss(s);
+  Clone->print(ss, nullptr);
+  return ss.str();
+}
+
+static void printTypeInfo(raw_ostream &ss, const FnTypeInfo &typeInfo) {
+  for (auto &arg : typeInfo.Function->args()) {
+    auto found = typeInfo.Arguments.find(&arg);
+    if (found != typeInfo.Arguments.end())
+      ss << " arg" << arg.getArgNo() << ":" << found->second.str();
+    auto foundv = typeInfo.KnownValues.find(&arg);
+    if (foundv != typeInfo.KnownValues.end())
+      ss << " known" << arg.getArgNo() << ":" << to_string(foundv->second);
+  }
+  ss << " ret:" << typeInfo.Return.str() << "\n";
+}
+
+static void printUncacheable(raw_ostream &ss, Function *todiff,
+                             const std::map<Argument *, bool> &uncacheable) {
+  ss << "uncacheable:";
+  for (auto &arg : todiff->args()) {
+    auto found = uncacheable.find(&arg);
+    ss << " "
+       << (found == uncacheable.end() ? "?"
+                                       : (found->second ? "true" : "false"));
+  }
+  ss << "\n";
+}
+
+template <typename T>
+static void printOption(raw_ostream &ss, const cl::opt<T> &opt) {
+  ss << " " << opt.ArgStr << "=" << opt.getValue();
+}
+
+static void printOption(raw_ostream &ss, const cl::opt<TapeCompressFP> &opt) {
+  ss << " " << opt.ArgStr << "=" << (int)opt.getValue();
+}
+
+/// Print the value of every option which changes the generated derivatives,
+/// so that a derivative generated under different options is never reused.
+/// Options which only print diagnostics, or which only act on the module
+/// after the derivative is stored, are left out.
+static void printCodegenOptions(raw_ostream &ss) {
+  ss << "options:";
+  // Preprocessing
+  printOption(ss, EnzymePreopt);
+  printOption(ss, EnzymeInline);
+  printOption(ss, EnzymeInlineCount);
+  printOption(ss, EnzymeNoAlias);
+  printOption(ss, EnzymeAggressiveAA);
+  printOption(ss, EnzymeLowerGlobals);
+  printOption(ss, EnzymeCoalese);
+#if LLVM_VERSION_MAJOR >= 8
+  printOption(ss, EnzymePHIRestructure);
+#endif
+  printOption(ss, EnzymeNameInstructions);
+  printOption(ss, EnzymeSelectOpt);
+  printOption(ss, EnzymeUseSummaries);
+  // Type and activity analysis
+  printOption(ss, looseTypeAnalysis);
+  printOption(ss, nonmarkedglobals_inactiveloads);
+  printOption(ss, MaxIntOffset);
+  printOption(ss, MaxTypeOffset);
+  printOption(ss, RustTypeRules);
+  printOption(ss, EnzymeStrictAliasing);
+  printOption(ss, EnzymeTypeSummaries);
+  printOption(ss, EnzymeNonmarkedGlobalsInactive);
+  printOption(ss, EnzymeEmptyFnInactive);
+  printOption(ss, EnzymeGlobalActivity);
+  printOption(ss, EnzymeInactiveDynamic);
+  printOption(ss, EnzymeRuntimeActivityCheck);
+  printOption(ss, EnzymeJuliaAddrLoad);
+  // Caching and the tape
+  printOption(ss, EnzymeNewCache);
+  printOption(ss, EnzymeMinCutCache);
+  printOption(ss, EnzymeWeightedMinCut);
+  printOption(ss, EnzymeMinCutUnknownTripCount);
+  printOption(ss, EnzymeLoopInvariantCache);
+  printOption(ss, EnzymeRematerialize);
+  printOption(ss, EnzymeSpeculatePHIs);
+  printOption(ss, EnzymeSharedForward);
+  printOption(ss, EnzymeRegisterReduce);
+  printOption(ss, EnzymeFreeInternalAllocations);
+  printOption(ss, EfficientBoolCache);
+  printOption(ss, EfficientMaxCache);
+  printOption(ss, EnzymeZeroCache);
+  printOption(ss, EnzymeTapeCompressFP);
+  printOption(ss, EnzymeTapePackInts);
+  printOption(ss, EnzymeStackCacheBytes);
+  printOption(ss, EnzymeSegmentedCache);
+  printOption(ss, EnzymeCacheSegmentIterations);
+  printOption(ss, EnzymeTapeArena);
+  printOption(ss, EnzymeTapeArenaLimit);
+  printOption(ss, EnzymeTapeMmapThreshold);
+  printOption(ss, EnzymeTapeMmapDir);
+  printOption(ss, EnzymeTapeMmapPrefetch);
+  printOption(ss, EnzymeLoopCheckpoint);
+  printOption(ss, EnzymeLoopCheckpointSnapshots);
+  // Adjoint emission
+  printOption(ss, EnzymeVectorShadow);
+  printOption(ss, EnzymeVectorSplitPhi);
+  printOption(ss, EnzymeOMPPrivateShadow);
+  printOption(ss, EnzymeOMPPrivateShadowMaxBytes);
+  printOption(ss, EnzymeOMPFuseReverse);
+  printOption(ss, EnzymeNonBlockingMPI);
+  ss << "\n";
+}
+
+static std::string hashDerivative(Function *todiff, StringRef config) {
+  std::string options;
+  raw_string_ostream os(options);
+  printCodegenOptions(os);
+  SHA1 Hasher;
+  Hasher.update(CacheFormatVersion);
+  Hasher.update(LLVM_VERSION_STRING);
+  Hasher.update(os.str());
+  Hasher.update(config);
+  Hasher.update(printPrimalClosure(todiff));
+  return toHex(Hasher.final());
+}
+
+std::string getDerivativeCacheHash(const ReverseCacheKey &key, bool PostOpt) {
+  std::string s;
+  raw_string_ostream ss(s);
+  ss << "reverse " << key.todiff->getName() << " mode:" << to_string(key.mode)
+     << " ret:" << to_string(key.retType) << " args:";
+  for (auto arg : key.constant_args)
+    ss << " " << to_string(arg);
+  ss << "\n";
+  printUncacheable(ss, key.todiff, key.uncacheable_args);
+  ss << "returnUsed:" << key.returnUsed
+     << " shadowReturnUsed:" << key.shadowReturnUsed
+     << " width:" << key.width << " freeMemory:" << key.freeMemory
+     << " AtomicAdd:" << key.AtomicAdd << " PostOpt:" << PostOpt << "\n";
+  printTypeInfo(ss, key.typeInfo);
+  return hashDerivative(key.todiff, ss.str());
+}
+
+std::string getDerivativeCacheHash(const EnzymeLogic::ForwardCacheKey &key,
+                                   bool freeMemory, bool PostOpt) {
+  std::string s;
+  raw_string_ostream ss(s);
+  ss << "forward " << key.todiff->getName() << " mode:" << to_string(key.mode)
+     << " ret:" << to_string(key.retType) << " args:";
+  for (auto arg : key.constant_args)
+    ss << " " << to_string(arg);
+  ss << "\n";
+  printUncacheable(ss, key.todiff, key.uncacheable_args);
+  ss << "returnUsed:" << key.returnUsed << " width:" << key.width
+     << " freeMemory:" << freeMemory << " PostOpt:" << PostOpt << "\n";
+  printTypeInfo(ss, key.typeInfo);
+  return hashDerivative(key.todiff, ss.str());
+}
+
+static SmallString<128> getCachePath(StringRef hash) {
+  SmallString<128> path(EnzymeDerivativeCache);
+  sys::path::append(path, hash + ".bc");
+  return path;
+}
+
+Function *loadCachedDerivative(StringRef hash, Function *todiff) {
+  Module &M = *todiff->getParent();
+  auto buf = MemoryBuffer::getFile(getCachePath(hash));
+  if (!buf) {
+    ++NumDerivativeCacheMisses;
+    EmitWarning("DerivativeCacheMiss", todiff,
+                "Derivative cache miss for ", todiff->getName(), " (", hash,
+                ")");
+    return nullptr;
+  }
+
+  auto cached = parseBitcodeFile(buf.get()->getMemBufferRef(), M.getContext());
+  if (!cached) {
+    consumeError(cached.takeError());
+    ++NumDerivativeCacheMisses;
+    EmitWarning("DerivativeCacheMiss", todiff, "Ignoring corrupt cache entry ",
+                hash, " for ", todiff->getName());
+    return nullptr;
+  }
+
+  // The cached derivative refers to the primal functions and globals by name.
+  // Those with local linkage cannot be linked against, so expose them for the
+  // duration of linking.
+  SmallVector<std::pair<GlobalValue *, GlobalValue::LinkageTypes>, 4> exposed;
+  for (auto &GV : (*cached)->global_values()) {
+    if (!GV.isDeclaration())
+      continue;
+    auto local = M.getNamedValue(GV.getName());
+    if (local && local->hasLocalLinkage()) {
+      exposed.emplace_back(local, local->getLinkage());
+      local->setLinkage(GlobalValue::ExternalLinkage);
+    }
+  }
+
+  std::string rootName = (CacheRootPrefix + hash).str();
+  bool failed = Linker::linkModules(M, std::move(*cached));
+
+  for (auto &pair : exposed)
+    pair.first->setLinkage(pair.second);
+
+  Function *NewF = failed ? nullptr : M.getFunction(rootName);
+  if (!NewF) {
+    ++NumDerivativeCacheMisses;
+    EmitWarning("DerivativeCacheMiss", todiff, "Failed to link cache entry ",
+                hash, " for ", todiff->getName());
+    return nullptr;
+  }
+  NewF->setLinkage(GlobalValue::InternalLinkage);
+  NewF->setName(NewF->getFnAttribute(CacheNameAttr).getValueAsString());
+  NewF->removeFnAttr(CacheNameAttr);
+
+  ++NumDerivativeCacheHits;
+  EmitWarning("DerivativeCacheHit", todiff, "Derivative cache hit for ",
+              todiff->getName(), " (", hash, ")");
+  return NewF;
+}
+
+void storeCachedDerivative(StringRef hash, Function *todiff, Function *NewF) {
+  SmallPtrSet<GlobalValue *, 4> primal;
+  collectReferencedGlobals(todiff, primal);
+
+  // Everything reachable from the derivative that is not part of the primal
+  // was created while differentiating, and must be stored alongside it.
+  SmallPtrSet<GlobalValue *, 4> reachable;
+  collectReferencedGlobals(NewF, reachable);
+  SmallPtrSet<const GlobalValue *, 4> derived;
+  for (auto GV : reachable) {
+    if (primal.count(GV) || GV->isDeclaration())
+      continue;
+    // Shadow globals and the like are keyed on the primal global, and cannot
+    // be soundly recreated by linking in a copy.
+    if (!isa<Function>(GV)) {
+      EmitWarning("DerivativeCacheSkip", todiff,
+                  "Not caching derivative of ", todiff->getName(),
+                  " as it requires global ", GV->getName());
+      return;
+    }
+    derived.insert(GV);
+  }
+
+  ValueToValueMapTy VMap;
+  auto Clone = CloneModule(
+      *NewF->getParent(), VMap,
+      [&](const GlobalValue *GV) { return derived.count(GV) != 0; });
+  SmallPtrSet<const GlobalValue *, 4> clonedDerived;
+  for (auto GV : derived)
+    clonedDerived.insert(cast<GlobalValue>(VMap[GV]));
+  eraseUnusedGlobals(*Clone, [&](const GlobalValue *GV) {
+    return clonedDerived.count(GV) != 0;
+  });
+
+  auto root = cast<Function>(VMap[NewF]);
+  root->addFnAttr(CacheNameAttr, NewF->getName());
+  root->setName(CacheRootPrefix + hash);
+  root->setLinkage(GlobalValue::ExternalLinkage);
+
+  // Debug info would have to be merged with the compile unit of the module
+  // the entry is later spliced into, and is therefore not cached.
+  StripDebugInfo(*Clone);
+
+  SmallString<128> path = getCachePath(hash);
+  if (sys::fs::create_directories(EnzymeDerivativeCache))
+    return;
+
+  // Write to a temporary first so concurrent compilations never observe a
+  // partially written entry.
+  int FD;
+  SmallString<128> tmpPath;
+  if (sys::fs::createUniqueFile(path + ".tmp%%%%%%", FD, tmpPath))
+    return;
+  {
+    raw_fd_ostream os(FD, /*shouldClose*/ true);
+    WriteBitcodeToFile(*Clone, os);
+    if (os.has_error()) {
+      os.clear_error();
+      sys::fs::remove(tmpPath);
+      return;
+    }
+  }
+  if (sys::fs::rename(tmpPath, path)) {
+    sys::fs::remove(tmpPath);
+    return;
+  }
+  ++NumDerivativeCacheStores;
+}
@@ -0,0 +1,61 @@
+//===- DerivativeCache.h - Persistent on-disk cache of derivatives  -------===//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+// If using this code in an academic setting, please cite the following:
+// @incollection{enzymeNeurips,
+// title = {Instead of Rewriting Foreign Code for Machine Learning,
+//          Automatically Synthesize Fast Gradients},
+// author = {Moses, William S. and Churavy, Valentin},
+// booktitle = {Advances in Neural Information Processing Systems 33},
+// year = {2020},
+// note = {To appear in},
+// }
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares an opt-in persistent cache which stores generated
+// derivatives as bitcode on disk, keyed by a structural hash of the primal
+// function (and everything it references) together with the derivative
+// configuration. A later compilation of the same primal splices the cached
+// derivative back into the module rather than regenerating it.
+//
+//===----------------------------------------------------------------------===//
+#ifndef ENZYME_DERIVATIVE_CACHE_H
+#define ENZYME_DERIVATIVE_CACHE_H
+
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "EnzymeLogic.h"
+
+extern "C" {
+/// Directory of the persistent derivative cache, disabled if empty
+extern llvm::cl::opt<std::string> EnzymeDerivativeCache;
+}
+
+/// Compute the cache key of the reverse-mode derivative described by \p key
+std::string getDerivativeCacheHash(const ReverseCacheKey &key, bool PostOpt);
+
+/// Compute the cache key of the forward-mode derivative described by \p key
+std::string getDerivativeCacheHash(const EnzymeLogic::ForwardCacheKey &key,
+                                   bool freeMemory, bool PostOpt);
+
+/// Splice the derivative stored under \p hash into the module of \p todiff,
+/// returning nullptr if no such entry exists
+llvm::Function *loadCachedDerivative(llvm::StringRef hash,
+                                     llvm::Function *todiff);
+
+/// Store the derivative \p NewF of \p todiff under \p hash. Derivatives which
+/// refer to globals created during differentiation are not stored.
+void storeCachedDerivative(llvm::StringRef hash, llvm::Function *todiff,
+                           llvm::Function *NewF);
+
+#endif
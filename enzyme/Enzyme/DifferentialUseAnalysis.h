@@ -26,6 +26,7 @@
 #include <deque>
 #include <map>
 #include <set>
+#include <vector>
 
 #include "GradientUtils.h"
 
@@ -273,7 +274,8 @@ static inline bool is_use_directly_needed_in_reverse(
 
     // Only need primal (and shadow) request for reverse
     if (funcName == "MPI_Isend" || funcName == "MPI_Irecv" ||
-        funcName == "PMPI_Isend" || funcName == "PMPI_Irecv") {
+        funcName == "PMPI_Isend" || funcName == "PMPI_Irecv" ||
+        funcName == "MPI_Send_init" || funcName == "MPI_Recv_init") {
       if (val != CI->getArgOperand(6)) {
         return false;
       }
@@ -284,6 +286,19 @@ static inline bool is_use_directly_needed_in_reverse(
       if (val != CI->getArgOperand(0))
         return false;
 
+    // Everything needed for the reverse of a start is cached.
+    if (funcName == "MPI_Start" || funcName == "MPI_Request_free")
+      return false;
+
+    // Everything needed for the reverse of a thread is kept in its closure.
+    if (funcName == "pthread_create" || funcName == "pthread_join")
+      return false;
+
+    // Only need element count for reverse of startall
+    if (funcName == "MPI_Startall")
+      if (val != CI->getArgOperand(0))
+        return false;
+
     // Only need element count for reverse of waitall
     if (funcName == "MPI_Waitall" || funcName == "PMPI_Waitall")
       if (val != CI->getArgOperand(0) || val != CI->getOperand(1))
@@ -433,6 +448,20 @@ static inline bool is_value_needed_in_reverse(
               return seen[idx] = true;
           goto endShadow;
         }
+        // The persistent bookkeeping lives behind the shadow request, and is
+        // released in the reverse pass.
+        if (funcName == "MPI_Send_init" || funcName == "MPI_Recv_init") {
+          if (gutils->isConstantInstruction(const_cast<Instruction *>(user)))
+            goto endShadow;
+          // Need shadow request
+          if (inst == CI->getArgOperand(6))
+            return seen[idx] = true;
+          // Need shadow buffer in forward pass
+          if (mode != DerivativeMode::ReverseModeGradient)
+            if (inst == CI->getArgOperand(0))
+              return seen[idx] = true;
+          goto endShadow;
+        }
         if (funcName == "MPI_Isend" || funcName == "PMPI_Isend") {
           if (gutils->isConstantInstruction(const_cast<Instruction *>(user)))
             goto endShadow;
@@ -447,7 +476,8 @@ static inline bool is_value_needed_in_reverse(
 
         // Don't need shadow of anything (all via cache for reverse),
         // but need shadow of request for primal.
-        if (funcName == "MPI_Wait" || funcName == "PMPI_Wait") {
+        if (funcName == "MPI_Wait" || funcName == "PMPI_Wait" ||
+            funcName == "MPI_Start" || funcName == "MPI_Request_free") {
           if (gutils->isConstantInstruction(const_cast<Instruction *>(user)))
             goto endShadow;
           // Need shadow request in forward pass only
@@ -457,9 +487,19 @@ static inline bool is_value_needed_in_reverse(
           goto endShadow;
         }
 
+        // The shadow argument is handed to the thread in the forward pass,
+        // and read back from its closure in the reverse.
+        if (funcName == "pthread_create") {
+          if (mode != DerivativeMode::ReverseModeGradient)
+            if (inst == CI->getArgOperand(3))
+              return seen[idx] = true;
+          goto endShadow;
+        }
+
         // Don't need shadow of anything (all via cache for reverse),
         // but need shadow of request for primal.
-        if (funcName == "MPI_Waitall" || funcName == "PMPI_Waitall") {
+        if (funcName == "MPI_Waitall" || funcName == "PMPI_Waitall" ||
+            funcName == "MPI_Startall") {
           if (gutils->isConstantInstruction(const_cast<Instruction *>(user)))
             goto endShadow;
           // Need shadow request in forward pass
@@ -726,14 +766,14 @@ static inline int cmpLoopNest(Loop *prev, Loop *next) {
   return -1;
 }
 
-static inline void minCut(const DataLayout &DL, LoopInfo &OrigLI,
-                          const SmallPtrSetImpl<Value *> &Recomputes,
-                          const SmallPtrSetImpl<Value *> &Intermediates,
-                          SmallPtrSetImpl<Value *> &Required,
-                          SmallPtrSetImpl<Value *> &MinReq,
-                          const ValueMap<Value *, GradientUtils::Rematerializer>
-                              &rematerializableAllocations) {
-  Graph G;
+/// Build the flow graph over \p Intermediates used by the min-cut cache
+/// planners. Each value is split into an incoming and outgoing node, with the
+/// edge between them representing the choice of caching that value.
+static inline void
+buildMinCutGraph(const SmallPtrSetImpl<Value *> &Intermediates,
+                 const ValueMap<Value *, GradientUtils::Rematerializer>
+                     &rematerializableAllocations,
+                 Graph &G) {
   for (auto V : Intermediates) {
     G[Node(V, false)].insert(Node(V, true));
     for (auto U : V->users()) {
@@ -762,6 +802,59 @@ static inline void minCut(const DataLayout &DL, LoopInfo &OrigLI,
       }
     }
   }
+}
+
+/// When ambiguous, move the values chosen for caching in \p MinReq to the
+/// last value in a computation chain, if that is no more expensive to cache.
+static inline void
+preferLaterCachedValues(const DataLayout &DL, LoopInfo &OrigLI,
+                        const Graph &Orig,
+                        const SmallPtrSetImpl<Value *> &Required,
+                        SmallPtrSetImpl<Value *> &MinReq) {
+  std::deque<Value *> todo(MinReq.begin(), MinReq.end());
+  while (todo.size()) {
+    auto V = todo.front();
+    todo.pop_front();
+    auto found = Orig.find(Node(V, true));
+    if (found->second.size() == 1 && !Required.count(V)) {
+      bool potentiallyRecursive =
+          isa<PHINode>((*found->second.begin()).V) &&
+          OrigLI.isLoopHeader(
+              cast<PHINode>((*found->second.begin()).V)->getParent());
+      int moreOuterLoop = cmpLoopNest(
+          OrigLI.getLoopFor(cast<Instruction>(V)->getParent()),
+          OrigLI.getLoopFor(
+              cast<Instruction>(((*found->second.begin()).V))->getParent()));
+      if (potentiallyRecursive)
+        continue;
+      if (moreOuterLoop == -1)
+        continue;
+      if (auto ASC = dyn_cast<AddrSpaceCastInst>((*found->second.begin()).V)) {
+        if (ASC->getDestAddressSpace() == 11 ||
+            ASC->getDestAddressSpace() == 13)
+          continue;
+      }
+      if (moreOuterLoop == 1 ||
+          (moreOuterLoop == 0 &&
+           DL.getTypeSizeInBits(V->getType()) >=
+               DL.getTypeSizeInBits((*found->second.begin()).V->getType()))) {
+        MinReq.erase(V);
+        MinReq.insert((*found->second.begin()).V);
+        todo.push_back((*found->second.begin()).V);
+      }
+    }
+  }
+}
+
+static inline void minCut(const DataLayout &DL, LoopInfo &OrigLI,
+                          const SmallPtrSetImpl<Value *> &Recomputes,
+                          const SmallPtrSetImpl<Value *> &Intermediates,
+                          SmallPtrSetImpl<Value *> &Required,
+                          SmallPtrSetImpl<Value *> &MinReq,
+                          const ValueMap<Value *, GradientUtils::Rematerializer>
+                              &rematerializableAllocations) {
+  Graph G;
+  buildMinCutGraph(Intermediates, rematerializableAllocations, G);
   for (auto R : Required) {
     assert(Intermediates.count(R));
   }
@@ -821,38 +914,172 @@ static inline void minCut(const DataLayout &DL, LoopInfo &OrigLI,
 
   // When ambiguous, push to cache the last value in a computation chain
   // This should be considered in a cost for the max flow
-  std::deque<Value *> todo(MinReq.begin(), MinReq.end());
-  while (todo.size()) {
-    auto V = todo.front();
-    todo.pop_front();
-    auto found = Orig.find(Node(V, true));
-    if (found->second.size() == 1 && !Required.count(V)) {
-      bool potentiallyRecursive =
-          isa<PHINode>((*found->second.begin()).V) &&
-          OrigLI.isLoopHeader(
-              cast<PHINode>((*found->second.begin()).V)->getParent());
-      int moreOuterLoop = cmpLoopNest(
-          OrigLI.getLoopFor(cast<Instruction>(V)->getParent()),
-          OrigLI.getLoopFor(
-              cast<Instruction>(((*found->second.begin()).V))->getParent()));
-      if (potentiallyRecursive)
-        continue;
-      if (moreOuterLoop == -1)
+  preferLaterCachedValues(DL, OrigLI, Orig, Required, MinReq);
+  return;
+}
+
+/// Max-flow over a dense, indexed graph with integer capacities, computed
+/// with Dinic's algorithm.
+class DinicMaxFlow {
+public:
+  static constexpr uint64_t Infinite = UINT64_MAX / 4;
+
+  DinicMaxFlow(unsigned numNodes) : adjacent(numNodes), level(numNodes) {}
+
+  void addEdge(unsigned from, unsigned to, uint64_t capacity) {
+    adjacent[from].push_back(edges.size());
+    edges.push_back({to, capacity});
+    adjacent[to].push_back(edges.size());
+    edges.push_back({from, 0});
+  }
+
+  void run(unsigned source, unsigned sink) {
+    while (levelize(source, sink))
+      blockingFlow(source, sink);
+  }
+
+  /// After run, whether \p node is reachable from the source in the residual
+  /// graph, i.e. is on the source side of the minimum cut.
+  bool onSourceSide(unsigned node) const { return level[node] >= 0; }
+
+private:
+  struct Edge {
+    unsigned to;
+    uint64_t capacity;
+  };
+  std::vector<Edge> edges;
+  std::vector<SmallVector<unsigned, 4>> adjacent;
+  std::vector<int> level;
+  std::vector<unsigned> current;
+
+  bool levelize(unsigned source, unsigned sink) {
+    std::fill(level.begin(), level.end(), -1);
+    std::deque<unsigned> q = {source};
+    level[source] = 0;
+    while (!q.empty()) {
+      auto u = q.front();
+      q.pop_front();
+      for (auto e : adjacent[u]) {
+        if (edges[e].capacity && level[edges[e].to] < 0) {
+          level[edges[e].to] = level[u] + 1;
+          q.push_back(edges[e].to);
+        }
+      }
+    }
+    return level[sink] >= 0;
+  }
+
+  void blockingFlow(unsigned source, unsigned sink) {
+    current.assign(adjacent.size(), 0);
+    SmallVector<unsigned, 16> path;
+    unsigned u = source;
+    while (true) {
+      if (u == sink) {
+        uint64_t flow = Infinite;
+        for (auto e : path)
+          flow = std::min(flow, edges[e].capacity);
+        size_t firstSaturated = path.size();
+        for (size_t i = 0; i < path.size(); i++) {
+          edges[path[i]].capacity -= flow;
+          edges[path[i] ^ 1].capacity += flow;
+          if (edges[path[i]].capacity == 0 && firstSaturated == path.size())
+            firstSaturated = i;
+        }
+        // Retreat to the tail of the first saturated edge.
+        u = edges[path[firstSaturated] ^ 1].to;
+        path.resize(firstSaturated);
         continue;
-      if (auto ASC = dyn_cast<AddrSpaceCastInst>((*found->second.begin()).V)) {
-        if (ASC->getDestAddressSpace() == 11 ||
-            ASC->getDestAddressSpace() == 13)
-          continue;
       }
-      if (moreOuterLoop == 1 ||
-          (moreOuterLoop == 0 &&
-           DL.getTypeSizeInBits(V->getType()) >=
-               DL.getTypeSizeInBits((*found->second.begin()).V->getType()))) {
-        MinReq.erase(V);
-        MinReq.insert((*found->second.begin()).V);
-        todo.push_back((*found->second.begin()).V);
+      bool advanced = false;
+      for (; current[u] < adjacent[u].size(); ++current[u]) {
+        auto e = adjacent[u][current[u]];
+        if (edges[e].capacity && level[edges[e].to] == level[u] + 1) {
+          path.push_back(e);
+          u = edges[e].to;
+          advanced = true;
+          break;
+        }
       }
+      if (advanced)
+        continue;
+      if (u == source)
+        break;
+      // Dead end, never visit this node again in this phase.
+      level[u] = -1;
+      u = edges[path.pop_back_val() ^ 1].to;
+      ++current[u];
     }
   }
-  return;
+};
+
+/// Estimated tape cost in bytes of caching \p V, being the store size of its
+/// type scaled by the trip count of every enclosing loop.
+static inline uint64_t
+estimateCacheBytes(const DataLayout &DL, LoopInfo &OrigLI, Value *V,
+                   llvm::function_ref<uint64_t(Loop *)> tripCount) {
+  // Bound individual costs such that the sum over all values cannot reach
+  // the capacity used for uncuttable edges.
+  constexpr uint64_t MaxCost = 1ULL << 40;
+  uint64_t cost = (DL.getTypeSizeInBits(V->getType()) + 7) / 8;
+  if (cost == 0)
+    cost = 1;
+  for (Loop *L = OrigLI.getLoopFor(cast<Instruction>(V)->getParent());
+       L != nullptr; L = L->getParentLoop()) {
+    uint64_t TC = std::max<uint64_t>(tripCount(L), 1);
+    cost = (cost > MaxCost / TC) ? MaxCost : cost * TC;
+  }
+  return cost;
+}
+
+/// Variant of minCut where the capacity of caching a value is its estimated
+/// size on the tape, rather than one per value.
+static inline void
+weightedMinCut(const DataLayout &DL, LoopInfo &OrigLI,
+               llvm::function_ref<uint64_t(Loop *)> tripCount,
+               const SmallPtrSetImpl<Value *> &Recomputes,
+               const SmallPtrSetImpl<Value *> &Intermediates,
+               SmallPtrSetImpl<Value *> &Required,
+               SmallPtrSetImpl<Value *> &MinReq,
+               const ValueMap<Value *, GradientUtils::Rematerializer>
+                   &rematerializableAllocations) {
+  Graph Orig;
+  buildMinCutGraph(Intermediates, rematerializableAllocations, Orig);
+
+  // Node 2i is the incoming and 2i+1 the outgoing node of value i.
+  std::map<Value *, unsigned> index;
+  SmallVector<Value *, 4> values;
+  for (auto &pair : Orig) {
+    if (!pair.first.outgoing && index.emplace(pair.first.V, values.size()).second)
+      values.push_back(pair.first.V);
+  }
+  unsigned source = 2 * values.size();
+  unsigned sink = source + 1;
+
+  DinicMaxFlow flow(sink + 1);
+  for (size_t i = 0; i < values.size(); i++)
+    flow.addEdge(2 * i, 2 * i + 1,
+                 estimateCacheBytes(DL, OrigLI, values[i], tripCount));
+  for (auto &pair : Orig) {
+    if (!pair.first.outgoing)
+      continue;
+    for (auto N : pair.second)
+      flow.addEdge(2 * index[pair.first.V] + 1, 2 * index[N.V],
+                   DinicMaxFlow::Infinite);
+  }
+  for (auto R : Recomputes) {
+    assert(Intermediates.count(R));
+    flow.addEdge(source, 2 * index[R], DinicMaxFlow::Infinite);
+  }
+  for (auto R : Required) {
+    assert(Intermediates.count(R));
+    flow.addEdge(2 * index[R] + 1, sink, DinicMaxFlow::Infinite);
+  }
+
+  flow.run(source, sink);
+
+  for (size_t i = 0; i < values.size(); i++)
+    if (flow.onSourceSide(2 * i) && !flow.onSourceSide(2 * i + 1))
+      MinReq.insert(values[i]);
+
+  preferLaterCachedValues(DL, OrigLI, Orig, Required, MinReq);
 }
@@ -60,7 +60,9 @@
 
 #include "ActivityAnalysis.h"
 #include "EnzymeLogic.h"
+#include "FunctionSummary.h"
 #include "GradientUtils.h"
+#include "PhaseTimer.h"
 #include "Utils.h"
 
 #include "InstructionBatcher.h"
@@ -91,6 +93,15 @@ llvm::cl::opt<bool> EnzymeAttributor("enzyme-attributor", cl::init(false),
 llvm::cl::opt<bool> EnzymeOMPOpt("enzyme-omp-opt", cl::init(false), cl::Hidden,
                                  cl::desc("Whether to enable openmp opt"));
 
+llvm::cl::opt<double> EnzymeFixedPointTolerance(
+    "enzyme-fixed-point-tolerance", cl::init(1e-10), cl::Hidden,
+    cl::desc("Relative tolerance of the adjoint iteration of "
+             "__enzyme_fixed_point"));
+
+llvm::cl::opt<unsigned> EnzymeFixedPointMaxIterations(
+    "enzyme-fixed-point-max-iterations", cl::init(1000), cl::Hidden,
+    cl::desc("Maximum number of adjoint iterations of __enzyme_fixed_point"));
+
 #if LLVM_VERSION_MAJOR >= 14
 #define addAttribute addAttributeAtIndex
 #endif
@@ -755,9 +766,12 @@ static bool replaceOriginalCall(CallInst *CI, Function *fn, Value *diffret,
 class Enzyme final : public ModulePass {
 public:
   EnzymeLogic Logic;
+  /// TypeAnalysis shared by all __enzyme_* call sites in the module, such
+  /// that helpers reached from independent call sites are analyzed only once
+  TypeAnalysis TA;
   static char ID;
   Enzyme(bool PostOpt = false)
-      : ModulePass(ID), Logic(PostOpt | EnzymePostOpt) {
+      : ModulePass(ID), Logic(PostOpt | EnzymePostOpt), TA(Logic.PPC.FAM) {
     // initializeLowerAutodiffIntrinsicPass(*PassRegistry::getPassRegistry());
   }
 
@@ -1039,6 +1053,202 @@ public:
     return true;
   }
 
+  /// Lower __enzyme_fixed_point(step, x, dx, n, args...), which propagates
+  /// the adjoint dx of a converged fixed point x = step(x, args...) of n
+  /// elements into the shadows of args. Rather than differentiating every
+  /// iteration of the solver that found x, this solves the adjoint equation
+  /// lambda = dx + (d step / d x)^T lambda by iterating the gradient of a
+  /// single step, and then differentiates that step once more with respect
+  /// to args. The step function has the form void step(T *out, T *in,
+  /// args...), where args are annotated as for __enzyme_autodiff. As x does
+  /// not depend on the initial guess of the solver, dx is zeroed.
+  bool HandleFixedPoint(CallInst *CI, TargetLibraryInfo &TLI) {
+    Function *fn;
+    auto parsedFunction = parseFunctionParameter(CI);
+    if (parsedFunction.hasValue()) {
+      fn = parsedFunction.getValue();
+    } else {
+      return false;
+    }
+
+    auto FT = fn->getFunctionType();
+    PointerType *PT = FT->getNumParams() >= 2
+                          ? dyn_cast<PointerType>(FT->getParamType(1))
+                          : nullptr;
+#if LLVM_VERSION_MAJOR >= 14
+    size_t num_args = CI->arg_size();
+#else
+    size_t num_args = CI->getNumArgOperands();
+#endif
+    if (!PT || FT->getParamType(0) != PT ||
+        !PT->getPointerElementType()->isFloatingPointTy() ||
+        !FT->getReturnType()->isVoidTy()) {
+      EmitFailure("IllegalFixedPoint", CI->getDebugLoc(), CI,
+                  "__enzyme_fixed_point requires a step function of the form "
+                  "void(T* out, T* in, ...) with T floating point, found ",
+                  *FT);
+      return false;
+    }
+    if (num_args < 4 || !CI->getArgOperand(3)->getType()->isIntegerTy()) {
+      EmitFailure("IllegalFixedPoint", CI->getDebugLoc(), CI,
+                  "__enzyme_fixed_point requires the fixed point, its "
+                  "adjoint, and its number of elements ",
+                  *CI);
+      return false;
+    }
+
+    LLVMContext &Ctx = CI->getContext();
+    Type *T = PT->getPointerElementType();
+    auto dup = MetadataAsValue::get(Ctx, MDString::get(Ctx, "enzyme_dup"));
+    auto cnst = MetadataAsValue::get(Ctx, MDString::get(Ctx, "enzyme_const"));
+
+    // Iterations only need the product with the Jacobian of the state, hence
+    // treat every other argument as constant.
+    SmallVector<Value *, 4> constArgs;
+    unsigned truei = 2;
+    for (unsigned i = 4; i < num_args; ++i) {
+      Value *res = CI->getArgOperand(i);
+      Optional<DIFFE_TYPE> opt_ty;
+      if (auto metaString = getMetadataName(res)) {
+        if (metaString->startswith("enzyme_")) {
+          if (*metaString == "enzyme_dup" ||
+              *metaString == "enzyme_dupnoneed") {
+            opt_ty = DIFFE_TYPE::DUP_ARG;
+          } else if (*metaString == "enzyme_out") {
+            opt_ty = DIFFE_TYPE::OUT_DIFF;
+          } else if (*metaString == "enzyme_const") {
+            opt_ty = DIFFE_TYPE::CONSTANT;
+          } else {
+            EmitFailure("IllegalDiffeType", CI->getDebugLoc(), CI,
+                        "illegal enzyme metadata classification for "
+                        "__enzyme_fixed_point ",
+                        *CI, *metaString);
+            return false;
+          }
+          if (++i >= num_args)
+            break;
+          res = CI->getArgOperand(i);
+        }
+      }
+      if (truei >= FT->getNumParams()) {
+        EmitFailure("TooManyArgs", CI->getDebugLoc(), CI,
+                    "Had too many arguments to __enzyme_fixed_point", *CI,
+                    " - extra arg - ", *res);
+        return false;
+      }
+      DIFFE_TYPE ty = opt_ty ? *opt_ty
+                             : whatType(FT->getParamType(truei),
+                                        DerivativeMode::ReverseModeCombined);
+      constArgs.push_back(cnst);
+      constArgs.push_back(res);
+      if (ty == DIFFE_TYPE::DUP_ARG || ty == DIFFE_TYPE::DUP_NONEED)
+        ++i;
+      ++truei;
+    }
+
+    BasicBlock *pre = CI->getParent();
+    BasicBlock *exit = pre->splitBasicBlock(CI, "fixedpoint.end");
+    BasicBlock *iter = BasicBlock::Create(Ctx, "fixedpoint.iter",
+                                          pre->getParent(), exit);
+    pre->getTerminator()->eraseFromParent();
+
+    IRBuilder<> B(pre);
+    Value *x = B.CreatePointerCast(CI->getArgOperand(1), PT);
+    Value *dx = B.CreatePointerCast(CI->getArgOperand(2), PT);
+    Value *n = B.CreateZExtOrTrunc(CI->getArgOperand(3), B.getInt64Ty());
+
+    // Hold lambda, the accumulated product, the seed of the product, and the
+    // discarded output of the step in a single buffer
+    CallInst *malloccall = nullptr;
+    Instruction *zero = nullptr;
+    Value *buf = CreateAllocation(B, T, B.CreateNUWMul(n, B.getInt64(4)),
+                                  "fixedpoint", &malloccall, &zero);
+#if LLVM_VERSION_MAJOR > 7
+    Value *lambda = buf;
+    Value *prod = B.CreateInBoundsGEP(T, buf, n, "fixedpoint.prod");
+    Value *dout = B.CreateInBoundsGEP(T, prod, n, "fixedpoint.dout");
+    Value *out = B.CreateInBoundsGEP(T, dout, n, "fixedpoint.out");
+#else
+    Value *lambda = buf;
+    Value *prod = B.CreateInBoundsGEP(buf, n, "fixedpoint.prod");
+    Value *dout = B.CreateInBoundsGEP(prod, n, "fixedpoint.dout");
+    Value *out = B.CreateInBoundsGEP(dout, n, "fixedpoint.out");
+#endif
+
+    Function *update = getOrInsertFixedPointUpdate(*fn->getParent(), T);
+    Value *tol = ConstantFP::get(T, EnzymeFixedPointTolerance);
+    Value *converged = B.CreateCall(update, {lambda, dx, prod, dout, n, tol});
+    B.CreateCondBr(converged, exit, iter);
+
+    auto autodiff = [&](IRBuilder<> &B, Type *RT, ArrayRef<Value *> extra) {
+      SmallVector<Value *, 8> args = {CI->getArgOperand(0), dup, out, dout,
+                                      dup, x, prod};
+      args.append(extra.begin(), extra.end());
+      auto AFT = FunctionType::get(RT, {}, /*isVarArg*/ true);
+      auto AF = fn->getParent()->getOrInsertFunction("__enzyme_autodiff", AFT);
+      CallInst *call = B.CreateCall(AFT, AF.getCallee(), args);
+      call->setDebugLoc(CI->getDebugLoc());
+      return call;
+    };
+
+    BasicBlock *latch = BasicBlock::Create(Ctx, "fixedpoint.latch",
+                                           pre->getParent(), exit);
+    BasicBlock *capped = BasicBlock::Create(Ctx, "fixedpoint.capped",
+                                            pre->getParent(), exit);
+
+    IRBuilder<> IB(iter);
+    PHINode *idx = IB.CreatePHI(n->getType(), 2, "fixedpoint.it");
+    idx->addIncoming(IB.getInt64(0), pre);
+    CallInst *step = autodiff(IB, IB.getVoidTy(), constArgs);
+    Value *next = IB.CreateNUWAdd(idx, IB.getInt64(1), "fixedpoint.it.next");
+    idx->addIncoming(next, latch);
+    converged = IB.CreateCall(update, {lambda, dx, prod, dout, n, tol});
+    IB.CreateCondBr(converged, exit, latch);
+
+    IB.SetInsertPoint(latch);
+    IB.CreateCondBr(
+        IB.CreateICmpUGE(next, IB.getInt64(EnzymeFixedPointMaxIterations)),
+        capped, iter);
+
+    // Warn at run time that the adjoint is used without having converged
+    IB.SetInsertPoint(capped);
+    FunctionType *PutsFT =
+        FunctionType::get(IB.getInt32Ty(), {IB.getInt8PtrTy()}, false);
+    IB.CreateCall(
+        fn->getParent()->getOrInsertFunction("puts", PutsFT),
+        IB.CreateGlobalStringPtr(
+            "Enzyme: __enzyme_fixed_point adjoint did not converge within " +
+            std::to_string(EnzymeFixedPointMaxIterations) + " iterations"));
+    IB.CreateBr(exit);
+
+    // With dout holding the converged lambda, differentiate the step with
+    // respect to the arguments as requested
+    IRBuilder<> EB(CI);
+    SmallVector<Value *, 4> userArgs;
+    for (unsigned i = 4; i < num_args; ++i)
+      userArgs.push_back(CI->getArgOperand(i));
+    CallInst *final = autodiff(EB, CI->getType(), userArgs);
+    if (!CI->getType()->isVoidTy())
+      CI->replaceAllUsesWith(final);
+    Value *zeroArgs[] = {
+        EB.CreatePointerCast(dx, EB.getInt8PtrTy()), EB.getInt8(0),
+        EB.CreateNUWMul(n, EB.getInt64(fn->getParent()
+                                           ->getDataLayout()
+                                           .getTypeAllocSize(T))),
+        EB.getFalse()};
+    Type *zeroTys[] = {zeroArgs[0]->getType(), zeroArgs[2]->getType()};
+    EB.CreateCall(Intrinsic::getDeclaration(fn->getParent(), Intrinsic::memset,
+                                            zeroTys),
+                  zeroArgs);
+    CreateDealloc(EB, malloccall);
+    CI->eraseFromParent();
+
+    return HandleAutoDiff(step, TLI, DerivativeMode::ReverseModeCombined,
+                          /*sizeOnly*/ false) &&
+           HandleAutoDiff(final, TLI, DerivativeMode::ReverseModeCombined,
+                          /*sizeOnly*/ false);
+  }
+
   /// Return whether successful
   bool HandleAutoDiff(CallInst *CI, TargetLibraryInfo &TLI, DerivativeMode mode,
                       bool sizeOnly) {
@@ -1515,7 +1725,6 @@ public:
           std::pair<Argument *, std::set<int64_t>>(&a, {}));
     }
 
-    TypeAnalysis TA(Logic.PPC.FAM);
     type_args = TA.analyzeFunction(type_args).getAnalyzedTypeInfo();
 
     // differentiate fn
@@ -1831,6 +2040,9 @@ public:
                   InlineFunction(cur, IFI);
 #endif
               if (IR.isSuccess()) {
+                // Inlining may modify any transitive caller, so drop all
+                // type information rather than tracking each one.
+                TA.clear();
                 for (auto U : outerFunc->users()) {
                   if (auto CI = dyn_cast<CallInst>(U)) {
                     if (CI->getCalledFunction() == outerFunc) {
@@ -1898,6 +2110,7 @@ public:
               Fn->getName().contains("__enzyme_augmentfwd") ||
               Fn->getName().contains("__enzyme_augmentsize") ||
               Fn->getName().contains("__enzyme_reverse") ||
+              Fn->getName().contains("__enzyme_fixed_point") ||
               Fn->getName().contains("__enzyme_batch")))
           continue;
 
@@ -1935,6 +2148,7 @@ public:
     MapVector<CallInst *, DerivativeMode> toVirtual;
     MapVector<CallInst *, DerivativeMode> toSize;
     SmallVector<CallInst *, 4> toBatch;
+    SmallVector<CallInst *, 4> toFixedPoint;
     SetVector<CallInst *> InactiveCalls;
     SetVector<CallInst *> IterCalls;
   retry:;
@@ -2154,6 +2368,7 @@ public:
         bool virtualCall = false;
         bool sizeOnly = false;
         bool batch = false;
+        bool fixedPoint = false;
         DerivativeMode mode;
         if (Fn->getName().contains("__enzyme_autodiff")) {
           enableEnzyme = true;
@@ -2181,6 +2396,9 @@ public:
         } else if (Fn->getName().contains("__enzyme_batch")) {
           enableEnzyme = true;
           batch = true;
+        } else if (Fn->getName().contains("__enzyme_fixed_point")) {
+          enableEnzyme = true;
+          fixedPoint = true;
         }
 
         if (enableEnzyme) {
@@ -2226,6 +2444,8 @@ public:
             toSize[CI] = mode;
           else if (batch)
             toBatch.push_back(CI);
+          else if (fixedPoint)
+            toFixedPoint.push_back(CI);
           else
             toLower[CI] = mode;
 
@@ -2271,6 +2491,14 @@ public:
     for (auto pair : toSize) {
       successful &= HandleAutoDiff(pair.first, TLI, pair.second,
                                    /*sizeOnly*/ true);
+      TA.invalidate(&F);
+      Changed = true;
+      if (!successful)
+        break;
+    }
+    for (auto CI : toFixedPoint) {
+      successful &= HandleFixedPoint(CI, TLI);
+      TA.invalidate(&F);
       Changed = true;
       if (!successful)
         break;
@@ -2278,6 +2506,7 @@ public:
     for (auto pair : toLower) {
       successful &= HandleAutoDiff(pair.first, TLI, pair.second,
                                    /*sizeOnly*/ false);
+      TA.invalidate(&F);
       Changed = true;
       if (!successful)
         break;
@@ -2292,8 +2521,6 @@ public:
                     *CI->getArgOperand(0));
         return false;
       }
-      TypeAnalysis TA(Logic.PPC.FAM);
-
       auto Arch =
           llvm::Triple(
               CI->getParent()->getParent()->getParent()->getTargetTriple())
@@ -2306,12 +2533,15 @@ public:
           Logic, TLI, TA, fn, pair.second, /*width*/ 1, AtomicAdd);
       CI->replaceAllUsesWith(ConstantExpr::getPointerCast(val, CI->getType()));
       CI->eraseFromParent();
+      TA.invalidate(&F);
       Changed = true;
     }
 
     for (auto call : toBatch) {
       HandleBatch(call);
     }
+    if (toBatch.size())
+      TA.invalidate(&F);
 
     if (Changed && EnzymeAttributor) {
       // TODO consider enabling when attributor does not delete
@@ -2379,6 +2609,7 @@ public:
         "__enzyme_register_splitderivative";
 
     Logic.clear();
+    TA.clear();
 
     bool changed = false;
     SmallVector<GlobalVariable *, 4> globalsToErase;
@@ -2467,6 +2698,10 @@ public:
     }
 #endif
 
+    // Summaries embedded at compile time are only valid for the body they
+    // were derived from
+    changed |= dropStaleFunctionSummaries(M);
+
     std::set<Function *> done;
     for (Function &F : M) {
       if (F.empty())
@@ -2525,6 +2760,7 @@ public:
       changed = true;
     }
 
+    TA.clear();
     for (const auto &pair : Logic.PPC.cache)
       pair.second->eraseFromParent();
     Logic.clear();
@@ -2562,6 +2798,7 @@ public:
       }
 #endif
     }
+    writeEnzymeStatsJSON();
     return changed;
   }
 };
@@ -56,12 +56,18 @@
 
 #include "llvm/Support/AMDGPUMetadata.h"
 
+#include "DerivativeCache.h"
 #include "FunctionUtils.h"
 #include "GradientUtils.h"
 #include "InstructionBatcher.h"
 #include "LibraryFuncs.h"
+#include "LoopCheckpointing.h"
+#include "OpenMPFusion.h"
+#include "PhaseTimer.h"
 #include "Utils.h"
 
+#include "llvm/ADT/Statistic.h"
+
 #if LLVM_VERSION_MAJOR >= 14
 #define addAttribute addAttributeAtIndex
 #define removeAttribute removeAttributeAtIndex
@@ -69,6 +75,15 @@
 
 using namespace llvm;
 
+STATISTIC(NumAugmentedPrimals, "Number of augmented primals created");
+STATISTIC(NumAugmentedCacheHits, "Number of augmented primals reused");
+STATISTIC(NumGradients, "Number of gradients created");
+STATISTIC(NumGradientCacheHits, "Number of gradients reused");
+STATISTIC(NumForwardDerivatives, "Number of forward derivatives created");
+STATISTIC(NumForwardCacheHits, "Number of forward derivatives reused");
+STATISTIC(NumBatchedFunctions, "Number of batched functions created");
+STATISTIC(NumBatchCacheHits, "Number of batched functions reused");
+
 extern "C" {
 llvm::cl::opt<bool>
     EnzymePrint("enzyme-print", cl::init(false), cl::Hidden,
@@ -90,6 +105,11 @@ cl::opt<bool> nonmarkedglobals_inactiveloads(
 cl::opt<bool> EnzymeJuliaAddrLoad(
     "enzyme-julia-addr-load", cl::init(false), cl::Hidden,
     cl::desc("Mark all loads resulting in an addr(13)* to be legal to redo"));
+
+llvm::cl::opt<bool> EnzymeNonBlockingMPI(
+    "enzyme-nonblocking-mpi", cl::init(false), cl::Hidden,
+    cl::desc("Issue the adjoints of MPI collectives non-blocking, waiting "
+             "only once the reverse pass next touches their buffers"));
 }
 
 struct CacheAnalysis {
@@ -569,6 +589,16 @@ struct CacheAnalysis {
           break;
         }
       }
+    } else if (funcName == "pthread_create") {
+      Value *op = callsite_op->getArgOperand(2);
+      if (auto castinst = dyn_cast<ConstantExpr>(op))
+        if (castinst->isCast())
+          op = castinst->getOperand(0);
+      // The routine runs concurrently with the caller, which may overwrite
+      // its argument at any point until the join
+      if (auto task = dyn_cast<Function>(op))
+        for (auto &arg : task->args())
+          uncacheable_args[&arg] = true;
     } else {
       auto arg = Fn->arg_begin();
       for (unsigned i = 0; i < args.size(); ++i) {
@@ -1169,6 +1199,24 @@ bool legalCombinedForwardReverse(
   Value *calledValue = origop->getCalledValue();
 #endif
 
+  // Report why the call could not be merged, as the augmented forward pass
+  // must then cache its tape for the reverse
+  auto missed = [&](StringRef Reason, const Instruction *I) {
+    gutils->getRemarkEmitter(origop->getFunction()).emit([&]() {
+      unsigned depth = gutils->OrigLI.getLoopDepth(origop->getParent());
+      OptimizationRemarkMissed R("enzyme", "CombinedForwardReverse", origop);
+      R << "could not combine forward and reverse of call to ";
+      if (called)
+        R << ore::NV("Callee", called);
+      else
+        R << ore::NV("Callee", calledValue);
+      R << " (" << ore::NV("Reason", Reason) << ")";
+      if (I)
+        R << " due to " << ore::NV("Inst", I);
+      return R << ", loop depth " << ore::NV("LoopDepth", depth);
+    });
+  };
+
   if (isa<PointerType>(origop->getType())) {
     bool sret = subretused;
     if (!sret && !gutils->isConstantValue(origop)) {
@@ -1177,6 +1225,7 @@ bool legalCombinedForwardReverse(
     }
 
     if (sret) {
+      missed("pointer return", nullptr);
       if (EnzymePrintPerf) {
         if (called)
           llvm::errs() << " [not implemented] pointer return for combined "
@@ -1218,6 +1267,7 @@ bool legalCombinedForwardReverse(
 
     if (isa<BranchInst>(I) || isa<SwitchInst>(I)) {
       legal = false;
+      missed("branch", I);
       if (EnzymePrintPerf) {
         if (called)
           llvm::errs() << " [bi] failed to replace function "
@@ -1251,6 +1301,7 @@ bool legalCombinedForwardReverse(
     }
     if (isa<PHINode>(I)) {
       legal = false;
+      missed("phi", I);
       if (EnzymePrintPerf) {
         if (called)
           llvm::errs() << " [phi] failed to replace function "
@@ -1264,6 +1315,7 @@ bool legalCombinedForwardReverse(
     if (is_value_needed_in_reverse<ValueType::Primal>(
             gutils, I, DerivativeMode::ReverseModeCombined, oldUnreachable)) {
       legal = false;
+      missed("value needed in reverse", I);
       if (EnzymePrintPerf) {
         if (called)
           llvm::errs() << " [nv] failed to replace function "
@@ -1276,6 +1328,7 @@ bool legalCombinedForwardReverse(
     }
     if (I != origop && !isa<IntrinsicInst>(I) && isa<CallInst>(I)) {
       legal = false;
+      missed("call", I);
       if (EnzymePrintPerf) {
         if (called)
           llvm::errs() << " [ci] failed to replace function "
@@ -1293,6 +1346,7 @@ bool legalCombinedForwardReverse(
           gutils->getNewFromOriginal(I)->getParent() !=
               gutils->getNewFromOriginal(I->getParent())) {
         legal = false;
+        missed("memory access moved", I);
         if (EnzymePrintPerf) {
           if (called)
             llvm::errs() << " [am] failed to replace function "
@@ -1352,6 +1406,7 @@ bool legalCombinedForwardReverse(
       if (writesToMemoryReadBy(gutils->OrigAA, gutils->TLI,
                                /*maybeReader*/ inst,
                                /*maybeWriter*/ post)) {
+        missed("later write to read memory", post);
         if (EnzymePrintPerf) {
           if (called)
             llvm::errs() << " failed to replace function "
@@ -1388,6 +1443,7 @@ bool legalCombinedForwardReverse(
     if (inst->getParent() != origop->getParent()) {
       // Don't move a writing instruction (may change speculatable/etc things)
       if (inst->mayWriteToMemory()) {
+        missed("non-speculatable write", inst);
         if (EnzymePrintPerf) {
           if (called)
             llvm::errs() << " [nonspec] failed to replace function "
@@ -1404,6 +1460,7 @@ bool legalCombinedForwardReverse(
     if (isa<CallInst>(inst) &&
         gutils->originalToNewFn.find(inst) == gutils->originalToNewFn.end()) {
       legal = false;
+      missed("call moved", inst);
       if (EnzymePrintPerf) {
         if (called)
           llvm::errs() << " [premove] failed to replace function "
@@ -1505,6 +1562,20 @@ void cleanupInversionAllocs(DiffeGradientUtils *gutils, BasicBlock *entry) {
   }
 }
 
+/// Return the block from whose reverse alone the reverse of `BB` is entered,
+/// if any: the only successor of `BB`, if it is neither a loop header nor
+/// within another loop.
+static BasicBlock *
+getSoleReverseEntry(BasicBlock *BB, LoopInfo &LI,
+                    const SmallPtrSetImpl<BasicBlock *> &unreachable) {
+  BasicBlock *succ = BB->getSingleSuccessor();
+  if (!succ || LI.isLoopHeader(succ) ||
+      LI.getLoopFor(succ) != LI.getLoopFor(BB) || unreachable.count(BB) ||
+      unreachable.count(succ))
+    return nullptr;
+  return succ;
+}
+
 static FnTypeInfo preventTypeAnalysisLoops(const FnTypeInfo &oldTypeInfo_,
                                            llvm::Function *todiff) {
   FnTypeInfo oldTypeInfo = oldTypeInfo_;
@@ -1690,6 +1761,17 @@ void restoreCache(
   }
 }
 
+/// Whether \p F spawns threads with pthread_create. The reverse of such a call
+/// runs the adjoint of the routine concurrently with the remaining reverse of
+/// \p F, so locations both of them read must be accumulated atomically.
+static bool spawnsThreads(const Function *F) {
+  for (auto &I : instructions(F))
+    if (auto CI = dyn_cast<CallInst>(&I))
+      if (getFuncNameFromCall(const_cast<CallInst *>(CI)) == "pthread_create")
+        return true;
+  return false;
+}
+
 //! return structtype if recursive function
 const AugmentedReturn &EnzymeLogic::CreateAugmentedPrimal(
     Function *todiff, DIFFE_TYPE retType, ArrayRef<DIFFE_TYPE> constant_args,
@@ -1722,8 +1804,11 @@ const AugmentedReturn &EnzymeLogic::CreateAugmentedPrimal(
 
   auto found = AugmentedCachedFunctions.find(tup);
   if (found != AugmentedCachedFunctions.end()) {
+    ++NumAugmentedCacheHits;
     return found->second;
   }
+  PhaseTimer timer(EnzymePhase::AugmentedPrimal);
+  ++NumAugmentedPrimals;
   TargetLibraryInfo &TLI = PPC.FAM.getResult<TargetLibraryAnalysis>(*todiff);
 
   // TODO make default typing (not just constant)
@@ -2059,7 +2144,7 @@ const AugmentedReturn &EnzymeLogic::CreateAugmentedPrimal(
       *this, width, todiff, TLI, TA, oldTypeInfo, retType, constant_args,
       /*returnUsed*/ returnUsed, /*shadowReturnUsed*/ shadowReturnUsed,
       returnMapping, omp);
-  gutils->AtomicAdd = AtomicAdd;
+  gutils->AtomicAdd = AtomicAdd || spawnsThreads(todiff);
   const SmallPtrSet<BasicBlock *, 4> guaranteedUnreachable =
       getGuaranteedUnreachable(gutils->oldFunc);
 
@@ -2341,6 +2426,11 @@ const AugmentedReturn &EnzymeLogic::CreateAugmentedPrimal(
     }
   }
 
+  for (auto &pair : gutils->ThreadLocalTapes)
+    AugmentedCachedFunctions.find(tup)
+        ->second.threadLocalTapes[removeTapeStruct ? -1 : pair.first] =
+        pair.second;
+
   bool recursive =
       AugmentedCachedFunctions.find(tup)->second.fn->getNumUses() > 0 ||
       forceAnonymousTape;
@@ -3235,15 +3325,26 @@ Function *EnzymeLogic::CreatePrimalAndGradient(
   Function *prevFunction = nullptr;
   if (ReverseCachedFunctions.find(key) != ReverseCachedFunctions.end()) {
     prevFunction = ReverseCachedFunctions.find(key)->second;
-    if (!hasMetadata(prevFunction, "enzyme_placeholder"))
+    if (!hasMetadata(prevFunction, "enzyme_placeholder")) {
+      ++NumGradientCacheHits;
       return prevFunction;
+    }
     if (augmenteddata && !augmenteddata->isComplete)
       return prevFunction;
   }
+  PhaseTimer timer(EnzymePhase::Reverse);
+  ++NumGradients;
 
   if (key.returnUsed)
     assert(key.mode == DerivativeMode::ReverseModeCombined);
 
+  if (key.todiff->hasFnAttribute("enzyme_checkpoint")) {
+    if (auto NewF = createCheckpointedGradient(*this, key, TA))
+      return insert_or_assign2<ReverseCacheKey, Function *>(
+                 ReverseCachedFunctions, key, NewF)
+          ->second;
+  }
+
   TargetLibraryInfo &TLI =
       PPC.FAM.getResult<TargetLibraryAnalysis>(*key.todiff);
 
@@ -3635,6 +3736,16 @@ Function *EnzymeLogic::CreatePrimalAndGradient(
   }
   assert(!key.todiff->empty());
 
+  std::string cacheHash;
+  if (!EnzymeDerivativeCache.empty() && !prevFunction && !augmenteddata &&
+      !omp && key.mode == DerivativeMode::ReverseModeCombined) {
+    cacheHash = getDerivativeCacheHash(key, PostOpt);
+    if (auto cached = loadCachedDerivative(cacheHash, key.todiff))
+      return insert_or_assign2<ReverseCacheKey, Function *>(
+                 ReverseCachedFunctions, key, cached)
+          ->second;
+  }
+
   ReturnType retVal =
       key.returnUsed ? (key.shadowReturnUsed ? ReturnType::ArgsWithTwoReturns
                                              : ReturnType::ArgsWithReturn)
@@ -3647,7 +3758,7 @@ Function *EnzymeLogic::CreatePrimalAndGradient(
       *this, key.mode, key.width, key.todiff, TLI, TA, oldTypeInfo, key.retType,
       diffeReturnArg, key.constant_args, retVal, key.additionalType, omp);
 
-  gutils->AtomicAdd = key.AtomicAdd;
+  gutils->AtomicAdd = key.AtomicAdd || spawnsThreads(key.todiff);
   gutils->FreeMemory = key.freeMemory;
   insert_or_assign2<ReverseCacheKey, Function *>(ReverseCachedFunctions, key,
                                                  gutils->newFunc);
@@ -3760,7 +3871,7 @@ Function *EnzymeLogic::CreatePrimalAndGradient(
         }
         additionalValue = truetape;
       } else {
-        if (gutils->FreeMemory) {
+        if (!omp && gutils->FreeMemory) {
           CreateDealloc(BuilderZ, additionalValue);
         }
         additionalValue = UndefValue::get(augmenteddata->tapeType);
@@ -3769,6 +3880,7 @@ Function *EnzymeLogic::CreatePrimalAndGradient(
 
     // TODO here finish up making recursive structs simply pass in i8*
     gutils->setTape(additionalValue);
+    gutils->ThreadLocalTapes = augmenteddata->threadLocalTapes;
   }
 
   Argument *differetval = nullptr;
@@ -3854,7 +3966,44 @@ Function *EnzymeLogic::CreatePrimalAndGradient(
       unnecessaryValues, unnecessaryInstructions, unnecessaryStores,
       guaranteedUnreachable, dretAlloca);
 
-  for (BasicBlock &oBB : *gutils->oldFunc) {
+  // With non-blocking adjoint collectives, differentiate a block before the
+  // predecessors whose reverse is entered from its reverse alone, so the
+  // wait of a collective may be carried into the reverse of those
+  std::map<BasicBlock *, SmallVector<BasicBlock *, 2>> soleReverseExits;
+  if (EnzymeNonBlockingMPI)
+    for (BasicBlock &oBB : *gutils->oldFunc)
+      if (auto succ = getSoleReverseEntry(&oBB, gutils->OrigLI,
+                                          guaranteedUnreachable))
+        soleReverseExits[succ].push_back(&oBB);
+  SmallVector<BasicBlock *, 16> blockOrder;
+  SmallPtrSet<BasicBlock *, 16> ordered;
+  auto orderFrom = [&](BasicBlock *root) {
+    SmallVector<BasicBlock *, 4> todo = {root};
+    while (!todo.empty()) {
+      BasicBlock *BB = todo.pop_back_val();
+      if (!ordered.insert(BB).second)
+        continue;
+      blockOrder.push_back(BB);
+      auto found = soleReverseExits.find(BB);
+      if (found != soleReverseExits.end())
+        todo.append(found->second.rbegin(), found->second.rend());
+    }
+  };
+  for (BasicBlock &oBB : *gutils->oldFunc)
+    if (!EnzymeNonBlockingMPI ||
+        !getSoleReverseEntry(&oBB, gutils->OrigLI, guaranteedUnreachable))
+      orderFrom(&oBB);
+  // Blocks in an unreachable cycle have no block to be ordered after
+  for (BasicBlock &oBB : *gutils->oldFunc)
+    if (!ordered.count(&oBB)) {
+      auto &exits = soleReverseExits[getSoleReverseEntry(
+          &oBB, gutils->OrigLI, guaranteedUnreachable)];
+      exits.erase(std::remove(exits.begin(), exits.end(), &oBB), exits.end());
+      orderFrom(&oBB);
+    }
+
+  for (BasicBlock *oBBp : blockOrder) {
+    BasicBlock &oBB = *oBBp;
     // Don't create derivatives for code that results in termination
     if (guaranteedUnreachable.find(&oBB) != guaranteedUnreachable.end()) {
       auto newBB = cast<BasicBlock>(gutils->getNewFromOriginal(&oBB));
@@ -3913,9 +4062,15 @@ Function *EnzymeLogic::CreatePrimalAndGradient(
     BasicBlock::reverse_iterator I = oBB.rbegin(), E = oBB.rend();
     ++I;
     for (; I != E; ++I) {
+      maker.finishMPIAdjointCollectives(&oBB, &*I);
       maker.visit(&*I);
       assert(oBB.rend() == E);
     }
+    auto found = soleReverseExits.find(&oBB);
+    if (found != soleReverseExits.end() && !found->second.empty())
+      maker.carryMPIAdjointCollectives(&oBB, found->second);
+    else
+      maker.finishMPIAdjointCollectives(&oBB, nullptr);
 
     createInvertedTerminator(gutils, key.constant_args, &oBB, retAlloca,
                              dretAlloca,
@@ -4021,6 +4176,8 @@ Function *EnzymeLogic::CreatePrimalAndGradient(
 
   cleanupInversionAllocs(gutils, entry);
   clearFunctionAttributes(gutils->newFunc);
+  if (EnzymeOMPFuseReverse && !omp)
+    fuseOMPLoops(*gutils->newFunc);
 
   if (llvm::verifyFunction(*gutils->newFunc, &llvm::errs())) {
     llvm::errs() << *gutils->oldFunc << "\n";
@@ -4055,6 +4212,8 @@ Function *EnzymeLogic::CreatePrimalAndGradient(
   if (EnzymePrint) {
     llvm::errs() << *nf << "\n";
   }
+  if (!cacheHash.empty())
+    storeCachedDerivative(cacheHash, key.todiff, nf);
   return nf;
 }
 
@@ -4086,8 +4245,11 @@ Function *EnzymeLogic::CreateForwardDiff(
                          oldTypeInfo};
 
   if (ForwardCachedFunctions.find(tup) != ForwardCachedFunctions.end()) {
+    ++NumForwardCacheHits;
     return ForwardCachedFunctions.find(tup)->second;
   }
+  PhaseTimer timer(EnzymePhase::Forward);
+  ++NumForwardDerivatives;
 
   TargetLibraryInfo &TLI = PPC.FAM.getResult<TargetLibraryAnalysis>(*todiff);
 
@@ -4261,6 +4423,14 @@ Function *EnzymeLogic::CreateForwardDiff(
     llvm::errs() << *todiff << "\n";
   assert(!todiff->empty());
 
+  std::string cacheHash;
+  if (!EnzymeDerivativeCache.empty() && !augmenteddata && !omp &&
+      mode == DerivativeMode::ForwardMode) {
+    cacheHash = getDerivativeCacheHash(tup, freeMemory, PostOpt);
+    if (auto cached = loadCachedDerivative(cacheHash, todiff))
+      return ForwardCachedFunctions[tup] = cached;
+  }
+
   bool retActive = retType != DIFFE_TYPE::CONSTANT;
 
   ReturnType retVal =
@@ -4488,6 +4658,8 @@ Function *EnzymeLogic::CreateForwardDiff(
   if (EnzymePrint) {
     llvm::errs() << *nf << "\n";
   }
+  if (!cacheHash.empty())
+    storeCachedDerivative(cacheHash, todiff, nf);
   return nf;
 }
 
@@ -4497,8 +4669,11 @@ llvm::Function *EnzymeLogic::CreateBatch(Function *tobatch, unsigned width,
 
   BatchCacheKey tup = std::make_tuple(tobatch, width, arg_types, ret_type);
   if (BatchCachedFunctions.find(tup) != BatchCachedFunctions.end()) {
+    ++NumBatchCacheHits;
     return BatchCachedFunctions.find(tup)->second;
   }
+  PhaseTimer timer(EnzymePhase::Batch);
+  ++NumBatchedFunctions;
 
   FunctionType *orig_FTy = tobatch->getFunctionType();
   SmallVector<Type *, 4> params;
@@ -4728,6 +4903,89 @@ llvm::Function *EnzymeLogic::CreateBatch(Function *tobatch, unsigned width,
       batcher->visit(inst);
   }
 
+  // Compute lanes of elementwise floating point instructions by one vector
+  // instruction, in program order so that the operands of an instruction are
+  // already vectors extracted from. Floating point phis become vector phis,
+  // so that values carried around a loop stay vectors. Lanes are only
+  // extracted where a scalar use, such as a call or store, needs them.
+  if (EnzymeVectorShadow) {
+    SmallVector<std::pair<PHINode *, SmallVector<PHINode *, 4>>, 2> phis;
+    SmallVector<Instruction *, 16> extracts;
+    std::map<SmallVector<Value *, 4>, Value *> packs;
+    for (auto &I : instructions(tobatch)) {
+      if (I.getType()->isVoidTy() || toVectorize.count(&I) == 0)
+        continue;
+      auto &lanes = vectorizedValues[&I];
+      Value *vec;
+      SmallVector<Instruction *, 4> combined;
+      IRBuilder<> Builder2(I.getContext());
+      if (isa<PHINode>(&I) && I.getType()->isFloatingPointTy()) {
+        auto lane0 = cast<PHINode>(lanes[0]);
+        Builder2.SetInsertPoint(lane0);
+#if LLVM_VERSION_MAJOR >= 11
+        auto VT = FixedVectorType::get(I.getType(), width);
+#else
+        auto VT = VectorType::get(I.getType(), width);
+#endif
+        vec = Builder2.CreatePHI(VT, lane0->getNumIncomingValues());
+        SmallVector<PHINode *, 4> lanePhis;
+        for (auto lane : lanes)
+          lanePhis.push_back(cast<PHINode>(lane));
+        phis.emplace_back(cast<PHINode>(vec), lanePhis);
+        Builder2.SetInsertPoint(lane0->getParent(),
+                                lane0->getParent()->getFirstInsertionPt());
+      } else if (isCombinableLanes(lanes)) {
+        Builder2.SetInsertPoint(cast<Instruction>(lanes.back())->getNextNode());
+        vec = combineLanes(Builder2, lanes, combined, &packs);
+      } else {
+        continue;
+      }
+      Builder2.SetCurrentDebugLocation(DebugLoc());
+      if (I.hasName())
+        vec->setName(I.getName());
+      packs.erase(SmallVector<Value *, 4>(lanes.begin(), lanes.end()));
+      for (unsigned i = 0; i < width; ++i) {
+        auto elem = cast<Instruction>(Builder2.CreateExtractElement(vec, i));
+        lanes[i]->replaceAllUsesWith(elem);
+        lanes[i] = elem;
+        extracts.push_back(elem);
+      }
+      for (auto inst : llvm::reverse(combined))
+        if (inst->use_empty())
+          inst->eraseFromParent();
+    }
+
+    // With every lane now extracted from a vector where possible, combine
+    // the incoming lanes of each phi at the end of its predecessors
+    SmallVector<Instruction *, 4> combined;
+    for (auto &pair : phis) {
+      PHINode *lane0 = pair.second[0];
+      for (unsigned j = 0; j < lane0->getNumIncomingValues(); ++j) {
+        BasicBlock *pred = lane0->getIncomingBlock(j);
+        SmallVector<Value *, 4> incoming;
+        for (auto lane : pair.second)
+          incoming.push_back(lane->getIncomingValueForBlock(pred));
+        IRBuilder<> Builder2(pred->getTerminator());
+        Builder2.SetCurrentDebugLocation(DebugLoc());
+        pair.first->addIncoming(
+            combineLanes(Builder2, incoming, combined, &packs), pred);
+      }
+    }
+    for (auto &pair : phis)
+      for (auto lane : pair.second)
+        lane->eraseFromParent();
+
+    SmallPtrSet<Instruction *, 4> erased;
+    for (auto inst : llvm::reverse(combined))
+      if (!erased.count(inst) && inst->use_empty()) {
+        erased.insert(inst);
+        inst->eraseFromParent();
+      }
+    for (auto inst : extracts)
+      if (inst->use_empty())
+        inst->eraseFromParent();
+  }
+
   if (llvm::verifyFunction(*NewF, &llvm::errs())) {
     llvm::errs() << *tobatch << "\n";
     llvm::errs() << *NewF << "\n";
@@ -53,6 +53,8 @@
 
 extern "C" {
 extern llvm::cl::opt<bool> EnzymePrint;
+/// Whether adjoints of MPI collectives are issued non-blocking
+extern llvm::cl::opt<bool> EnzymeNonBlockingMPI;
 }
 
 enum class AugmentedStruct { Tape, Return, DifferentialReturn };
@@ -117,6 +119,10 @@ public:
 
   std::set<ssize_t> tapeIndiciesToFree;
 
+  //! Thread-local stacks holding tape values of a parallel region body in
+  //! place of its tape, keyed by their index in the tape
+  std::map<int, llvm::GlobalVariable *> threadLocalTapes;
+
   bool isComplete;
 
   AugmentedReturn(
@@ -0,0 +1,598 @@
+//===- FunctionSummary.cpp - Analysis summaries embedded in function metadata//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+// If using this code in an academic setting, please cite the following:
+// @incollection{enzymeNeurips,
+// title = {Instead of Rewriting Foreign Code for Machine Learning,
+//          Automatically Synthesize Fast Gradients},
+// author = {Moses, William S. and Churavy, Valentin},
+// booktitle = {Advances in Neural Information Processing Systems 33},
+// year = {2020},
+// note = {To appear in},
+// }
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the summaries of the facts Enzyme's analyses derive
+// about a function independent of its callers, their serialization into
+// function metadata, and the pass embedding them. A summary is serialized as
+//
+//   !enzyme_summary !{i64 hash, !return, !{!arg0, ...},
+//                     !{i1 inactive0, ...}, !{i1 written0, ...},
+//                     i1 writesOther}
+//
+// where each TypeTree is a tuple of entries !{!"type", i64 offset, ...}.
+//
+//===----------------------------------------------------------------------===//
+#include <llvm/Config/llvm-config.h>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ValueMap.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Mutex.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+
+#include "FunctionSummary.h"
+#include "FunctionUtils.h"
+#include "TypeAnalysis/TypeAnalysis.h"
+
+using namespace llvm;
+
+extern "C" {
+llvm::cl::opt<bool> EnzymeUseSummaries(
+    "enzyme-use-summaries", cl::init(true), cl::Hidden,
+    cl::desc("Use the analysis summaries embedded in function metadata"));
+
+llvm::cl::opt<bool> EnzymeEmitSummaries(
+    "enzyme-emit-summaries", cl::init(false), cl::Hidden,
+    cl::desc("Embed analysis summaries into function metadata at the end of "
+             "the pipeline"));
+}
+
+namespace {
+/// Hashes functions together with the functions they reference, such that
+/// the hash of a function changes with the body of any function local to the
+/// module it calls. Functions visible outside the module are only hashed by
+/// their name and type, as they may be declared when the summary is derived
+/// and defined once the module is linked with their library.
+class SummaryHasher {
+  /// Hashes which do not depend on the function the traversal started from
+  DenseMap<const Function *, uint64_t> Done;
+  /// Functions whose hash is being computed
+  SmallPtrSet<const Function *, 4> Active;
+
+public:
+  /// Return the hash of \p F, setting \p Cyclic if it refers to a function
+  /// whose hash is still being computed
+  uint64_t hash(const Function &F, bool &Cyclic);
+};
+} // namespace
+
+uint64_t SummaryHasher::hash(const Function &F, bool &Cyclic) {
+  auto Found = Done.find(&F);
+  if (Found != Done.end())
+    return Found->second;
+  Active.insert(&F);
+  bool SelfCyclic = false;
+
+  // Values local to the function are named by their position, such that the
+  // hash does not depend on value names or metadata numbering
+  DenseMap<const Value *, unsigned> Numbering;
+  unsigned Idx = 0;
+  for (auto &Arg : F.args())
+    Numbering[&Arg] = Idx++;
+  for (auto &BB : F) {
+    Numbering[&BB] = Idx++;
+    for (auto &I : BB)
+      Numbering[&I] = Idx++;
+  }
+
+  std::string Str;
+  raw_string_ostream OS(Str);
+  auto printOperand = [&](const Value *V) {
+    auto Found = Numbering.find(V);
+    if (Found != Numbering.end())
+      OS << "%" << Found->second;
+    else if (auto Callee = dyn_cast<Function>(V)) {
+      OS << "@" << Callee->getName() << " ";
+      Callee->getFunctionType()->print(OS);
+      if (hasMetadata(Callee, "enzyme_gradient") ||
+          hasMetadata(Callee, "enzyme_derivative"))
+        OS << " custom";
+      // Whether an external function is defined depends on what the module
+      // is linked with, so only local callees contribute their bodies. Those
+      // in the same cycle of calls are only named, as their hash is not known
+      // yet.
+      if (Callee->hasLocalLinkage()) {
+        if (Active.count(Callee))
+          SelfCyclic = true;
+        else
+          OS << "#" << hash(*Callee, SelfCyclic);
+      }
+    } else if (auto GV = dyn_cast<GlobalValue>(V))
+      OS << "@" << GV->getName();
+    else if (isa<MetadataAsValue>(V))
+      OS << "!md";
+    else if (auto IA = dyn_cast<InlineAsm>(V))
+      OS << "asm \"" << IA->getAsmString() << "\" \""
+         << IA->getConstraintString() << "\"";
+    else if (auto C = dyn_cast<Constant>(V))
+      C->printAsOperand(OS, /*PrintType*/ true);
+    else
+      OS << "?";
+  };
+  // Print metadata by its contents rather than its numbering in the module
+  SmallPtrSet<const MDNode *, 4> Printing;
+  std::function<void(const Metadata *)> printMetadata =
+      [&](const Metadata *MD) {
+        if (auto S = dyn_cast_or_null<MDString>(MD))
+          OS << "\"" << S->getString() << "\"";
+        else if (auto CAM = dyn_cast_or_null<ConstantAsMetadata>(MD))
+          printOperand(CAM->getValue());
+        else if (auto N = dyn_cast_or_null<MDNode>(MD)) {
+          if (!Printing.insert(N).second) {
+            OS << "!cycle";
+            return;
+          }
+          OS << "!{";
+          for (auto &Op : N->operands()) {
+            printMetadata(Op);
+            OS << ",";
+          }
+          OS << "}";
+          Printing.erase(N);
+        } else
+          OS << "null";
+      };
+
+  F.getFunctionType()->print(OS);
+  OS << "\n";
+  for (auto &BB : F) {
+    OS << Numbering[&BB] << ":\n";
+    for (auto &I : BB) {
+      OS << I.getOpcodeName() << " ";
+      I.getType()->print(OS);
+      if (auto Cmp = dyn_cast<CmpInst>(&I))
+        OS << " " << CmpInst::getPredicateName(Cmp->getPredicate());
+      if (auto GEP = dyn_cast<GetElementPtrInst>(&I)) {
+        OS << " ";
+        GEP->getSourceElementType()->print(OS);
+        OS << (GEP->isInBounds() ? " inbounds" : "");
+      }
+      if (auto AI = dyn_cast<AllocaInst>(&I)) {
+        OS << " ";
+        AI->getAllocatedType()->print(OS);
+      }
+      if (auto EVI = dyn_cast<ExtractValueInst>(&I))
+        for (auto Ind : EVI->indices())
+          OS << " " << Ind;
+      if (auto IVI = dyn_cast<InsertValueInst>(&I))
+        for (auto Ind : IVI->indices())
+          OS << " " << Ind;
+#if LLVM_VERSION_MAJOR >= 11
+      if (auto SVI = dyn_cast<ShuffleVectorInst>(&I))
+        for (auto M : SVI->getShuffleMask())
+          OS << " " << M;
+#endif
+      for (auto &Op : I.operands()) {
+        OS << " ";
+        printOperand(Op);
+      }
+      // TypeAnalysis derives types from the TBAA of memory accesses
+      for (unsigned Kind : {LLVMContext::MD_tbaa, LLVMContext::MD_tbaa_struct})
+        if (auto MD = I.getMetadata(Kind)) {
+          OS << " !" << Kind << " ";
+          printMetadata(MD);
+        }
+      OS << "\n";
+    }
+  }
+
+  MD5 Hash;
+  Hash.update(OS.str());
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  Active.erase(&F);
+  if (SelfCyclic)
+    Cyclic = true;
+  else
+    Done[&F] = Result.low();
+  return Result.low();
+}
+
+uint64_t hashFunctionForSummary(const Function &F) {
+  bool Cyclic = false;
+  return SummaryHasher().hash(F, Cyclic);
+}
+
+static MDNode *typeTreeToMD(const TypeTree &TT, LLVMContext &C) {
+  SmallVector<Metadata *, 4> Entries;
+  for (const auto &pair : TT.getMapping()) {
+    SmallVector<Metadata *, 4> Entry;
+    Entry.push_back(MDString::get(C, pair.second.str()));
+    for (int Off : pair.first)
+      Entry.push_back(ConstantAsMetadata::get(
+          ConstantInt::get(Type::getInt64Ty(C), Off, /*isSigned*/ true)));
+    Entries.push_back(MDTuple::get(C, Entry));
+  }
+  return MDTuple::get(C, Entries);
+}
+
+static MDNode *boolsToMD(const std::vector<bool> &Bools, LLVMContext &C) {
+  SmallVector<Metadata *, 4> Ops;
+  for (bool B : Bools)
+    Ops.push_back(ConstantAsMetadata::get(ConstantInt::getBool(C, B)));
+  return MDTuple::get(C, Ops);
+}
+
+static bool typeTreeFromMD(const Metadata *MD, LLVMContext &C,
+                           TypeTree &Result) {
+  auto Tuple = dyn_cast_or_null<MDTuple>(MD);
+  if (!Tuple)
+    return false;
+  for (auto &Op : Tuple->operands()) {
+    auto Entry = dyn_cast<MDTuple>(Op);
+    if (!Entry || Entry->getNumOperands() == 0 ||
+        Entry->getNumOperands() > EnzymeMaxTypeDepth + 1)
+      return false;
+    auto Name = dyn_cast<MDString>(Entry->getOperand(0));
+    if (!Name)
+      return false;
+    std::vector<int> Seq;
+    for (unsigned i = 1; i < Entry->getNumOperands(); i++) {
+      auto Off = mdconst::dyn_extract<ConstantInt>(Entry->getOperand(i));
+      if (!Off)
+        return false;
+      Seq.push_back((int)Off->getSExtValue());
+    }
+    Result.insert(Seq, ConcreteType(Name->getString().str(), C));
+  }
+  Result.intern();
+  return true;
+}
+
+static bool boolsFromMD(const Metadata *MD, std::vector<bool> &Result) {
+  auto Tuple = dyn_cast_or_null<MDTuple>(MD);
+  if (!Tuple)
+    return false;
+  for (auto &Op : Tuple->operands()) {
+    auto B = mdconst::dyn_extract<ConstantInt>(Op);
+    if (!B)
+      return false;
+    Result.push_back(!B->isZero());
+  }
+  return true;
+}
+
+/// Return the hash recorded in the summary \p MD, or None if malformed
+static Optional<uint64_t> getSummaryHash(const MDNode *MD) {
+  if (MD->getNumOperands() != 6)
+    return None;
+  auto Hash = mdconst::dyn_extract<ConstantInt>(MD->getOperand(0));
+  if (!Hash)
+    return None;
+  return Hash->getZExtValue();
+}
+
+static FunctionSummary computeFunctionSummary(Function &F, TypeAnalysis &TA,
+                                              SummaryHasher &Hasher) {
+  assert(!F.empty());
+  FunctionSummary Summary;
+  bool Cyclic = false;
+  Summary.Hash = Hasher.hash(F, Cyclic);
+
+  TypeResults TR = TA.analyzeSummary(&F);
+  Summary.Return = TR.getReturnAnalysis();
+  for (auto &Arg : F.args()) {
+    TypeTree TT = TR.query(&Arg);
+    // An argument whose type is fully known and contains no floating point
+    // data cannot carry derivatives. Data of any type may be floating point
+    // in some calling context.
+    bool Inactive = TT.IsFullyDetermined();
+    for (const auto &pair : TT.getMapping())
+      if (pair.second.isFloat() || pair.second == BaseType::Anything)
+        Inactive = false;
+    Summary.Arguments.push_back(TT);
+    Summary.InactiveArgs.push_back(Inactive);
+  }
+
+  Summary.WrittenArgs.resize(F.arg_size(), false);
+  Summary.WritesOther = false;
+  auto markWrite = [&](Value *Ptr) {
+    Value *Obj =
+#if LLVM_VERSION_MAJOR >= 12
+        getUnderlyingObject(Ptr, 100);
+#else
+        GetUnderlyingObject(Ptr, F.getParent()->getDataLayout(), 100);
+#endif
+    if (isa<AllocaInst>(Obj))
+      return;
+    if (auto Arg = dyn_cast<Argument>(Obj)) {
+      Summary.WrittenArgs[Arg->getArgNo()] = true;
+      return;
+    }
+    Summary.WritesOther = true;
+  };
+
+  for (auto &I : instructions(F)) {
+    if (!I.mayWriteToMemory())
+      continue;
+    if (auto SI = dyn_cast<StoreInst>(&I)) {
+      markWrite(SI->getPointerOperand());
+      continue;
+    }
+    if (auto RMW = dyn_cast<AtomicRMWInst>(&I)) {
+      markWrite(RMW->getPointerOperand());
+      continue;
+    }
+    if (auto CAS = dyn_cast<AtomicCmpXchgInst>(&I)) {
+      markWrite(CAS->getPointerOperand());
+      continue;
+    }
+    if (auto MI = dyn_cast<MemIntrinsic>(&I)) {
+      markWrite(MI->getDest());
+      continue;
+    }
+    if (auto II = dyn_cast<IntrinsicInst>(&I)) {
+      switch (II->getIntrinsicID()) {
+      case Intrinsic::lifetime_start:
+      case Intrinsic::lifetime_end:
+      case Intrinsic::assume:
+      case Intrinsic::stacksave:
+      case Intrinsic::stackrestore:
+        continue;
+      default:
+        break;
+      }
+    }
+    if (auto CB = dyn_cast<CallBase>(&I)) {
+      if (auto Callee = CB->getCalledFunction()) {
+        if (auto CalleeSummary = getFunctionSummary(Callee)) {
+          Summary.WritesOther |= CalleeSummary->WritesOther;
+          for (unsigned i = 0, e = CalleeSummary->WrittenArgs.size(); i < e;
+               i++)
+            if (CalleeSummary->WrittenArgs[i])
+              markWrite(CB->getArgOperand(i));
+          continue;
+        }
+      }
+      if (CB->onlyAccessesArgMemory()) {
+        for (auto &Arg : CB->args())
+          if (Arg->getType()->isPointerTy())
+            markWrite(Arg);
+        continue;
+      }
+    }
+    Summary.WritesOther = true;
+  }
+  return Summary;
+}
+
+FunctionSummary computeFunctionSummary(Function &F, TypeAnalysis &TA) {
+  SummaryHasher Hasher;
+  return computeFunctionSummary(F, TA, Hasher);
+}
+
+void writeFunctionSummary(Function &F, const FunctionSummary &Summary) {
+  auto &C = F.getContext();
+  SmallVector<Metadata *, 4> Args;
+  for (const auto &TT : Summary.Arguments)
+    Args.push_back(typeTreeToMD(TT, C));
+  Metadata *Ops[] = {
+      ConstantAsMetadata::get(
+          ConstantInt::get(Type::getInt64Ty(C), Summary.Hash)),
+      typeTreeToMD(Summary.Return, C),
+      MDTuple::get(C, Args),
+      boolsToMD(Summary.InactiveArgs, C),
+      boolsToMD(Summary.WrittenArgs, C),
+      ConstantAsMetadata::get(ConstantInt::getBool(C, Summary.WritesOther))};
+  F.setMetadata(EnzymeSummaryMDName, MDTuple::get(C, Ops));
+}
+
+bool dropStaleFunctionSummaries(Module &M) {
+  SummaryHasher Hasher;
+  SmallVector<Function *, 4> Stale;
+  for (auto &F : M) {
+    auto MD = F.getMetadata(EnzymeSummaryMDName);
+    if (!MD)
+      continue;
+    auto Hash = getSummaryHash(MD);
+    bool Cyclic = false;
+    if (F.empty() || F.isInterposable() || !Hash ||
+        *Hash != Hasher.hash(F, Cyclic))
+      Stale.push_back(&F);
+  }
+  // The hash of a caller does not cover the body of an external callee, so
+  // the summaries of the callers of a stale summary are dropped with it
+  bool Changed = !Stale.empty();
+  while (!Stale.empty()) {
+    auto F = Stale.pop_back_val();
+    if (!F->getMetadata(EnzymeSummaryMDName))
+      continue;
+    F->setMetadata(EnzymeSummaryMDName, nullptr);
+    for (auto U : F->users())
+      if (auto CB = dyn_cast<CallBase>(U))
+        if (CB->getCalledFunction() == F)
+          Stale.push_back(CB->getFunction());
+  }
+  return Changed;
+}
+
+static Optional<FunctionSummary> parseFunctionSummary(const Function *F,
+                                                     const MDNode *MD) {
+  auto Hash = getSummaryHash(MD);
+  if (!Hash)
+    return None;
+
+  auto &C = F->getContext();
+  FunctionSummary Summary;
+  Summary.Hash = *Hash;
+  if (!typeTreeFromMD(MD->getOperand(1), C, Summary.Return))
+    return None;
+  auto Args = dyn_cast<MDTuple>(MD->getOperand(2));
+  if (!Args || Args->getNumOperands() != F->arg_size())
+    return None;
+  for (auto &Op : Args->operands()) {
+    TypeTree TT;
+    if (!typeTreeFromMD(Op, C, TT))
+      return None;
+    Summary.Arguments.push_back(TT);
+  }
+  if (!boolsFromMD(MD->getOperand(3), Summary.InactiveArgs) ||
+      Summary.InactiveArgs.size() != F->arg_size())
+    return None;
+  if (!boolsFromMD(MD->getOperand(4), Summary.WrittenArgs) ||
+      Summary.WrittenArgs.size() != F->arg_size())
+    return None;
+  auto WritesOther = mdconst::dyn_extract<ConstantInt>(MD->getOperand(5));
+  if (!WritesOther)
+    return None;
+  Summary.WritesOther = !WritesOther->isZero();
+  return Summary;
+}
+
+namespace {
+/// Parsed summaries, dropped when their function is deleted
+struct SummaryCacheEntry {
+  /// The metadata the summary was parsed from
+  const MDNode *MD;
+  /// The parsed summary, or null if the metadata was malformed
+  std::unique_ptr<FunctionSummary> Summary;
+};
+
+static sys::Mutex SummaryCacheMutex;
+
+struct SummaryCacheConfig : ValueMapConfig<const Function *, sys::Mutex> {
+  static mutex_type *getMutex(const ExtraData &) { return &SummaryCacheMutex; }
+};
+} // namespace
+
+const FunctionSummary *getFunctionSummary(const Function *F) {
+  if (!EnzymeUseSummaries)
+    return nullptr;
+  auto MD = F->getMetadata(EnzymeSummaryMDName);
+  if (!MD)
+    return nullptr;
+
+  // Parsing rebuilds every tree of the summary, whereas the summary is
+  // queried for each pair of instructions by the cache analysis.
+  static ValueMap<const Function *, SummaryCacheEntry, SummaryCacheConfig>
+      Cache;
+  std::lock_guard<sys::Mutex> Lock(SummaryCacheMutex);
+  auto &Entry = Cache[F];
+  if (Entry.MD != MD) {
+    Entry.MD = MD;
+    Entry.Summary.reset();
+    if (auto Summary = parseFunctionSummary(F, MD))
+      Entry.Summary.reset(new FunctionSummary(std::move(*Summary)));
+  }
+  return Entry.Summary.get();
+}
+
+/// Whether a summary of \p F may be derived and stay valid until link time
+static bool isSummarizable(const Function &F) {
+  // The definition of an interposable function may be replaced by another
+  if (F.empty() || F.isInterposable() || F.getName().startswith("__enzyme"))
+    return false;
+  // Calls to Enzyme are replaced by the Enzyme pass, modifying the caller
+  for (auto &I : instructions(F))
+    if (auto CB = dyn_cast<CallBase>(&I))
+      if (auto Callee = CB->getCalledFunction())
+        if (Callee->getName().startswith("__enzyme"))
+          return false;
+  return true;
+}
+
+namespace {
+
+class FunctionSummaryPass final : public ModulePass {
+public:
+  static char ID;
+  FunctionSummaryPass() : ModulePass(ID) {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {}
+
+  bool runOnModule(Module &M) override {
+    PreProcessCache PPC;
+    TypeAnalysis TA(PPC.FAM);
+    // Most functions summarized are never differentiated, and may pun types
+    // in ways the analysis rejects. Skip those rather than aborting.
+    TA.RecoverIllegal = true;
+
+    // Summarize callees before their callers, such that callers can use the
+    // summaries of their callees
+    bool Changed = false;
+    SummaryHasher Hasher;
+    std::set<Function *> done;
+    // Functions which are, or call, a function whose definition may be
+    // replaced by another, and whose summary could thus be wrong
+    std::set<Function *> interposed;
+    std::function<void(Function &)> visit = [&](Function &F) {
+      if (!done.insert(&F).second || F.empty())
+        return;
+      bool callsInterposed = false;
+      for (auto &I : instructions(F))
+        if (auto CB = dyn_cast<CallBase>(&I))
+          if (auto Callee = CB->getCalledFunction()) {
+            visit(*Callee);
+            if (Callee->isInterposable() || interposed.count(Callee))
+              callsInterposed = true;
+          }
+      if (F.isInterposable() || callsInterposed) {
+        interposed.insert(&F);
+        return;
+      }
+      if (!isSummarizable(F))
+        return;
+      TA.SawIllegal = false;
+      auto Summary = computeFunctionSummary(F, TA, Hasher);
+      if (TA.SawIllegal)
+        return;
+      writeFunctionSummary(F, Summary);
+      Changed = true;
+    };
+    for (auto &F : M)
+      visit(F);
+    return Changed;
+  }
+};
+
+} // namespace
+
+char FunctionSummaryPass::ID = 0;
+
+static RegisterPass<FunctionSummaryPass>
+    X("enzyme-summary", "Embed Enzyme analysis summaries into functions");
+
+ModulePass *createFunctionSummaryPass() { return new FunctionSummaryPass(); }
+
+#include <llvm-c/Core.h>
+#include <llvm-c/Types.h>
+
+#include "llvm/IR/LegacyPassManager.h"
+
+extern "C" void AddFunctionSummaryPass(LLVMPassManagerRef PM) {
+  unwrap(PM)->add(createFunctionSummaryPass());
+}
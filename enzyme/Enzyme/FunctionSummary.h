@@ -0,0 +1,101 @@
+//===- FunctionSummary.h - Analysis summaries embedded in function metadata===//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+// If using this code in an academic setting, please cite the following:
+// @incollection{enzymeNeurips,
+// title = {Instead of Rewriting Foreign Code for Machine Learning,
+//          Automatically Synthesize Fast Gradients},
+// author = {Moses, William S. and Churavy, Valentin},
+// booktitle = {Advances in Neural Information Processing Systems 33},
+// year = {2020},
+// note = {To appear in},
+// }
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares summaries of the facts Enzyme's analyses derive about a
+// function independent of its callers, and createFunctionSummaryPass, a pass
+// which embeds them into the metadata of each function at compile time. When
+// the module is later linked (e.g. for LTO), TypeAnalysis, ActivityAnalysis
+// and the cache analysis use the embedded summaries of library functions
+// rather than deriving them again. Each summary records a hash of the body it
+// was derived from, and summaries of functions modified since are ignored.
+//
+//===----------------------------------------------------------------------===//
+#ifndef ENZYME_FUNCTION_SUMMARY_H
+#define ENZYME_FUNCTION_SUMMARY_H
+
+#include <vector>
+
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "TypeAnalysis/TypeTree.h"
+
+namespace llvm {
+class ModulePass;
+}
+
+class TypeAnalysis;
+
+extern "C" {
+/// Whether to use the summaries embedded in function metadata
+extern llvm::cl::opt<bool> EnzymeUseSummaries;
+/// Whether the clang plugin embeds summaries at the end of the pipeline
+extern llvm::cl::opt<bool> EnzymeEmitSummaries;
+}
+
+/// Kind of the function metadata holding the summary
+static constexpr const char EnzymeSummaryMDName[] = "enzyme_summary";
+
+/// Facts about a function which hold for every call of it
+struct FunctionSummary {
+  /// Hash of the function body the summary was derived from
+  uint64_t Hash = 0;
+  /// Type of the return, as derived without any calling context
+  TypeTree Return;
+  /// Type of each argument, as derived without any calling context
+  std::vector<TypeTree> Arguments;
+  /// Whether each argument is known to carry no differentiable data
+  std::vector<bool> InactiveArgs;
+  /// Whether memory based on each argument may be written
+  std::vector<bool> WrittenArgs;
+  /// Whether memory not based on an argument or a local allocation may be
+  /// written
+  bool WritesOther = true;
+};
+
+/// Hash the body of \p F and of the local functions it calls, such that a
+/// summary can be matched to the bodies it was derived from. Functions
+/// visible outside the module are hashed by name and type only, such that
+/// linking in their definition keeps the summary. The hash is stable across
+/// processes.
+uint64_t hashFunctionForSummary(const llvm::Function &F);
+
+/// Derive the summary of the function \p F, which must have a body
+FunctionSummary computeFunctionSummary(llvm::Function &F, TypeAnalysis &TA);
+
+/// Embed \p Summary into the metadata of \p F
+void writeFunctionSummary(llvm::Function &F, const FunctionSummary &Summary);
+
+/// Remove the embedded summaries of all functions in \p M whose body changed
+/// since their summary was derived, and of the functions calling them,
+/// returning whether any were removed
+bool dropStaleFunctionSummaries(llvm::Module &M);
+
+/// Return the summary embedded in the metadata of \p F, if any. Stale
+/// summaries must have been removed by dropStaleFunctionSummaries. The
+/// summary is parsed once and remains valid until \p F is deleted or its
+/// summary is replaced.
+const FunctionSummary *getFunctionSummary(const llvm::Function *F);
+
+/// Create a pass which embeds the summary of each function in the module
+llvm::ModulePass *createFunctionSummaryPass();
+
+#endif
@@ -25,8 +25,11 @@
 #include "FunctionUtils.h"
 
 #include "EnzymeLogic.h"
+#include "FunctionSummary.h"
 #include "GradientUtils.h"
 #include "LibraryFuncs.h"
+#include "LoopCheckpointing.h"
+#include "PhaseTimer.h"
 
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/DebugInfoMetadata.h"
@@ -133,7 +136,7 @@ cl::opt<bool> EnzymeCoalese("enzyme-coalese", cl::init(false), cl::Hidden,
                             cl::desc("Whether to coalese memory allocations"));
 
 #if LLVM_VERSION_MAJOR >= 8
-static cl::opt<bool> EnzymePHIRestructure(
+cl::opt<bool> EnzymePHIRestructure(
     "enzyme-phi-restructure", cl::init(false), cl::Hidden,
     cl::desc("Whether to restructure phi's to have better unwrap behavior"));
 #endif
@@ -973,6 +976,314 @@ static void SimplifyMPIQueries(Function &NewF, FunctionAnalysisManager &FAM) {
   FAM.invalidate(NewF, PA);
 }
 
+#if LLVM_VERSION_MAJOR >= 9
+/// If every variable reduced by \p CI (a __kmpc_reduce{,_nowait} call) is a
+/// floating point sum, collect the private copy and shared value of each, in
+/// the order of the runtime's reduction list, and the stores filling that
+/// list.
+static bool
+matchAdditiveOMPReduction(CallInst *CI, DominatorTree &DT,
+                          SmallVectorImpl<std::pair<Value *, Value *>> &Vars,
+                          SmallVectorImpl<StoreInst *> &ListStores) {
+  auto Num = dyn_cast<ConstantInt>(CI->getArgOperand(2));
+  auto List = dyn_cast<AllocaInst>(CI->getArgOperand(4)->stripPointerCasts());
+  if (!Num || !List || !isa<Constant>(CI->getArgOperand(5)) ||
+      !isa<Constant>(CI->getArgOperand(6)))
+    return false;
+  Vars.resize(Num->getZExtValue(), {nullptr, nullptr});
+  for (auto U : List->users()) {
+    if (U == CI->getArgOperand(4))
+      continue;
+    auto GEP = dyn_cast<GetElementPtrInst>(U);
+    if (!GEP || GEP->getNumIndices() != 2 || !GEP->hasAllConstantIndices())
+      return false;
+    auto Idx = cast<ConstantInt>(GEP->getOperand(2))->getZExtValue();
+    for (auto GU : GEP->users()) {
+      auto SI = dyn_cast<StoreInst>(GU);
+      if (!SI || SI->getPointerOperand() != GEP || Idx >= Vars.size() ||
+          Vars[Idx].first)
+        return false;
+      Vars[Idx].first = SI->getValueOperand()->stripPointerCasts();
+      ListStores.push_back(SI);
+    }
+  }
+
+  // The first case combines each private copy into the shared value.
+  BasicBlock *Combine = nullptr;
+  for (auto U : CI->users())
+    if (auto SWI = dyn_cast<SwitchInst>(U))
+      for (auto Case : SWI->cases())
+        if (Case.getCaseValue()->isOne())
+          Combine = Case.getCaseSuccessor();
+  if (!Combine)
+    return false;
+  for (auto &I : *Combine) {
+    if (isa<LoadInst>(&I) || isa<BranchInst>(&I))
+      continue;
+    if (auto Call = dyn_cast<CallInst>(&I)) {
+      auto Fn = Call->getCalledFunction();
+      if (Fn && (Fn->getName() == "__kmpc_end_reduce" ||
+                 Fn->getName() == "__kmpc_end_reduce_nowait"))
+        continue;
+      return false;
+    }
+    if (isa<BinaryOperator>(&I) &&
+        cast<BinaryOperator>(&I)->getOpcode() == Instruction::FAdd &&
+        I.hasOneUse() && isa<StoreInst>(*I.user_begin()))
+      continue;
+    auto SI = dyn_cast<StoreInst>(&I);
+    if (!SI)
+      return false;
+    auto Add = dyn_cast<BinaryOperator>(SI->getValueOperand());
+    if (!Add || Add->getOpcode() != Instruction::FAdd)
+      return false;
+    Value *Shared = SI->getPointerOperand();
+    auto LHS = dyn_cast<LoadInst>(Add->getOperand(0));
+    auto RHS = dyn_cast<LoadInst>(Add->getOperand(1));
+    if (!LHS || !RHS)
+      return false;
+    if (RHS->getPointerOperand() == Shared)
+      std::swap(LHS, RHS);
+    if (LHS->getPointerOperand() != Shared)
+      return false;
+    if (auto SharedI = dyn_cast<Instruction>(Shared))
+      if (!DT.dominates(SharedI, CI))
+        return false;
+    Value *Private = RHS->getPointerOperand()->stripPointerCasts();
+    bool Found = false;
+    for (auto &V : Vars)
+      if (V.first == Private && !V.second) {
+        V.second = Shared;
+        Found = true;
+        break;
+      }
+    if (!Found)
+      return false;
+  }
+  for (auto &V : Vars)
+    if (!V.first || !V.second)
+      return false;
+  return true;
+}
+
+/// Outline the sum reduction \p CI, whose variables are \p Vars, into a
+/// function taking the location and thread id of the reduction followed by
+/// each private copy and shared value. The function still reduces through
+/// the runtime, tree and atomic paths included, and being linear in the
+/// private copies it is differentiated as a whole (see AdjointGenerator).
+static Function *
+createOMPReduceAdd(CallInst *CI, ArrayRef<std::pair<Value *, Value *>> Vars) {
+  Module &M = *CI->getModule();
+  LLVMContext &Ctx = CI->getContext();
+  Function *Reduce = CI->getCalledFunction();
+  bool Blocking = Reduce->getName() == "__kmpc_reduce";
+  Value *Loc = CI->getArgOperand(0);
+  Value *Gtid = CI->getArgOperand(1);
+  Value *Lck = CI->getArgOperand(6);
+
+  SmallVector<Type *, 8> ArgTys = {Loc->getType(), Gtid->getType()};
+  for (auto &V : Vars) {
+    ArgTys.push_back(V.first->getType());
+    ArgTys.push_back(V.second->getType());
+  }
+  Type *VoidTy = Type::getVoidTy(Ctx);
+  Function *F = Function::Create(FunctionType::get(VoidTy, ArgTys, false),
+                                 Function::InternalLinkage,
+                                 "__enzyme_omp_reduce_add", &M);
+  F->addFnAttr(Attribute::NoUnwind);
+  F->addFnAttr(Attribute::NoInline);
+  // The runtime only reads the private copies during the call
+  for (unsigned i = 2; i < ArgTys.size(); i++)
+    F->addParamAttr(i, Attribute::NoCapture);
+  BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", F);
+  BasicBlock *Combine = BasicBlock::Create(Ctx, "combine", F);
+  BasicBlock *Atomic = BasicBlock::Create(Ctx, "atomic", F);
+  BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", F);
+  SmallVector<Value *, 8> FArgs;
+  for (auto &Arg : F->args())
+    FArgs.push_back(&Arg);
+  Value *FLoc = FArgs[0];
+  Value *FGtid = FArgs[1];
+
+  IRBuilder<> B(Entry);
+  Type *I8P = Type::getInt8PtrTy(Ctx);
+  Type *ListTy = ArrayType::get(I8P, Vars.size());
+  Value *List = B.CreateAlloca(ListTy, nullptr, "red_list");
+  for (size_t i = 0; i < Vars.size(); i++) {
+    Value *Idx[] = {B.getInt64(0), B.getInt64(i)};
+#if LLVM_VERSION_MAJOR > 7
+    Value *Slot = B.CreateInBoundsGEP(ListTy, List, Idx);
+#else
+    Value *Slot = B.CreateInBoundsGEP(List, Idx);
+#endif
+    B.CreateStore(B.CreatePointerCast(FArgs[2 + 2 * i], I8P), Slot);
+  }
+  Value *Args[] = {FLoc,
+                   FGtid,
+                   CI->getArgOperand(2),
+                   CI->getArgOperand(3),
+                   B.CreatePointerCast(List, I8P),
+                   CI->getArgOperand(5),
+                   Lck};
+  Value *Method = B.CreateCall(Reduce, Args);
+  auto SWI = B.CreateSwitch(Method, Exit, 2);
+  SWI->addCase(B.getInt32(1), Combine);
+  SWI->addCase(B.getInt32(2), Atomic);
+
+  Type *EndTys[] = {Loc->getType(), Gtid->getType(), Lck->getType()};
+  Value *EndArgs[] = {FLoc, FGtid, Lck};
+  auto End = M.getOrInsertFunction(
+      Blocking ? "__kmpc_end_reduce" : "__kmpc_end_reduce_nowait",
+      FunctionType::get(VoidTy, EndTys, false));
+
+  B.SetInsertPoint(Combine);
+  for (size_t i = 0; i < Vars.size(); i++) {
+    Value *Private = FArgs[2 + 2 * i];
+    Value *Shared = FArgs[3 + 2 * i];
+    Type *T = Shared->getType()->getPointerElementType();
+    Value *Sum = B.CreateFAdd(B.CreateLoad(T, Shared),
+                              B.CreateLoad(T, B.CreatePointerCast(
+                                                  Private, Shared->getType())));
+    B.CreateStore(Sum, Shared);
+  }
+  B.CreateCall(End, EndArgs);
+  B.CreateBr(Exit);
+
+  B.SetInsertPoint(Atomic);
+  for (size_t i = 0; i < Vars.size(); i++) {
+    Value *Private = FArgs[2 + 2 * i];
+    Value *Shared = FArgs[3 + 2 * i];
+    Type *T = Shared->getType()->getPointerElementType();
+    Value *Val =
+        B.CreateLoad(T, B.CreatePointerCast(Private, Shared->getType()));
+#if LLVM_VERSION_MAJOR >= 13
+    B.CreateAtomicRMW(AtomicRMWInst::FAdd, Shared, Val, MaybeAlign(),
+                      AtomicOrdering::Monotonic, SyncScope::System);
+#else
+    B.CreateAtomicRMW(AtomicRMWInst::FAdd, Shared, Val,
+                      AtomicOrdering::Monotonic, SyncScope::System);
+#endif
+  }
+  // Only the blocking reduction is ended on the atomic path
+  if (Blocking)
+    B.CreateCall(End, EndArgs);
+  B.CreateBr(Exit);
+
+  B.SetInsertPoint(Exit);
+  B.CreateRetVoid();
+  return F;
+}
+#endif
+
+/// Rewrite the reductions of OpenMP regions into a form with an adjoint. The
+/// runtime may combine the private copies in a tree through an opaque
+/// reduction function, or with atomics, neither of which can be reversed
+/// instruction by instruction.
+///
+/// Sums of floating point values are outlined into __enzyme_omp_reduce_add,
+/// which keeps using the runtime's reduction in the primal and whose adjoint
+/// broadcasts the adjoint of the shared value to each private copy. Any
+/// other reduction is rewritten so that every thread combines its private
+/// copy into the shared value inside a critical section, which is reversed
+/// like any other.
+static void SimplifyOMPReductions(Function &NewF, FunctionAnalysisManager &FAM) {
+  SmallVector<CallInst *, 4> Todo;
+  for (auto &BB : NewF) {
+    for (auto &I : BB) {
+      if (auto CI = dyn_cast<CallInst>(&I)) {
+        Function *Fn = CI->getCalledFunction();
+        if (Fn == nullptr)
+          continue;
+        if (Fn->getName() == "__kmpc_reduce" ||
+            Fn->getName() == "__kmpc_reduce_nowait") {
+          Todo.push_back(CI);
+        }
+      }
+    }
+  }
+  if (Todo.size() == 0)
+    return;
+  Module &M = *NewF.getParent();
+  DominatorTree &DT = FAM.getResult<DominatorTreeAnalysis>(NewF);
+  SmallVector<BasicBlock *, 4> BranchesToFold;
+  for (auto CI : Todo) {
+    IRBuilder<> B(CI);
+    Value *loc = CI->getArgOperand(0);
+    Value *gtid = CI->getArgOperand(1);
+    Type *VoidTy = Type::getVoidTy(CI->getContext());
+    for (auto U : CI->users())
+      if (auto I = dyn_cast<Instruction>(U))
+        BranchesToFold.push_back(I->getParent());
+#if LLVM_VERSION_MAJOR >= 9
+    SmallVector<std::pair<Value *, Value *>, 2> Vars;
+    SmallVector<StoreInst *, 2> ListStores;
+    if (matchAdditiveOMPReduction(CI, DT, Vars, ListStores)) {
+      Function *Reduce = createOMPReduceAdd(CI, Vars);
+      SmallVector<Value *, 8> Args = {loc, gtid};
+      for (auto &V : Vars) {
+        Args.push_back(V.first);
+        Args.push_back(V.second);
+      }
+      B.CreateCall(Reduce, Args);
+      // 0 selects neither case, both of which are now performed by Reduce
+      CI->replaceAllUsesWith(ConstantInt::get(CI->getType(), 0));
+      for (auto SI : ListStores)
+        SI->eraseFromParent();
+      CI->eraseFromParent();
+      continue;
+    }
+#endif
+    Value *lck = CI->getArgOperand(6);
+    Type *tys[] = {loc->getType(), gtid->getType(), lck->getType()};
+    Value *args[] = {loc, gtid, lck};
+    B.CreateCall(M.getOrInsertFunction(
+                     "__kmpc_critical", FunctionType::get(VoidTy, tys, false)),
+                 args);
+    // 1 selects the reduction with the private copy in the outlined region
+    CI->replaceAllUsesWith(ConstantInt::get(CI->getType(), 1));
+    CI->eraseFromParent();
+  }
+  for (auto BB : BranchesToFold)
+    ConstantFoldTerminator(BB);
+  removeUnreachableBlocks(NewF);
+
+  // The reductions left end their critical section where they end
+  SmallVector<CallInst *, 4> Ends;
+  for (auto &BB : NewF)
+    for (auto &I : BB)
+      if (auto CI = dyn_cast<CallInst>(&I))
+        if (Function *Fn = CI->getCalledFunction())
+          if (Fn->getName() == "__kmpc_end_reduce" ||
+              Fn->getName() == "__kmpc_end_reduce_nowait")
+            Ends.push_back(CI);
+  for (auto CI : Ends) {
+    IRBuilder<> B(CI);
+    Value *loc = CI->getArgOperand(0);
+    Value *gtid = CI->getArgOperand(1);
+    Value *lck = CI->getArgOperand(2);
+    Type *VoidTy = Type::getVoidTy(CI->getContext());
+    Type *tys[] = {loc->getType(), gtid->getType(), lck->getType()};
+    Value *args[] = {loc, gtid, lck};
+    B.CreateCall(M.getOrInsertFunction("__kmpc_end_critical",
+                                       FunctionType::get(VoidTy, tys, false)),
+                 args);
+    // The blocking reduction ends with a barrier
+    if (CI->getCalledFunction()->getName() == "__kmpc_end_reduce") {
+      Type *btys[] = {loc->getType(), gtid->getType()};
+      Value *bargs[] = {loc, gtid};
+      B.CreateCall(
+          M.getOrInsertFunction("__kmpc_barrier",
+                                FunctionType::get(VoidTy, btys, false)),
+          bargs);
+    }
+    CI->eraseFromParent();
+  }
+  PreservedAnalyses PA;
+  PA.preserve<AssumptionAnalysis>();
+  PA.preserve<TargetLibraryAnalysis>();
+  FAM.invalidate(NewF, PA);
+}
+
 /// Perform recursive inlinining on NewF up to the given limit
 static void ForceRecursiveInlining(Function *NewF, size_t Limit) {
   std::map<const Function *, RecurType> RecurResults;
@@ -1203,6 +1514,8 @@ Function *PreProcessCache::preprocessForClone(Function *F,
     return NewF;
   }
 
+  PhaseTimer timer(EnzymePhase::Preprocess);
+
   Function *NewF =
       Function::Create(F->getFunctionType(), F->getLinkage(),
                        "preprocess_" + F->getName(), F->getParent());
@@ -1231,6 +1544,8 @@ Function *PreProcessCache::preprocessForClone(Function *F,
                     Returns, "", nullptr);
 #endif
   CloneOrigin[NewF] = F;
+  // The clone is modified, invalidating the summary of the original
+  NewF->setMetadata(EnzymeSummaryMDName, nullptr);
   NewF->setAttributes(F->getAttributes());
   if (EnzymeNoAlias)
     for (auto j = NewF->arg_begin(); j != NewF->arg_end(); j++) {
@@ -1327,6 +1642,7 @@ Function *PreProcessCache::preprocessForClone(Function *F,
 
   SimplifyMPIQueries<CallInst>(*NewF, FAM);
   SimplifyMPIQueries<InvokeInst>(*NewF, FAM);
+  SimplifyOMPReductions(*NewF, FAM);
 
   if (EnzymeLowerGlobals) {
     SmallVector<CallInst *, 4> Calls;
@@ -1703,6 +2019,10 @@ Function *PreProcessCache::preprocessForClone(Function *F,
     FAM.invalidate(*NewF, PA);
   }
 
+  if (mode == DerivativeMode::ReverseModePrimal ||
+      mode == DerivativeMode::ReverseModeCombined)
+    outlineCheckpointedLoops(NewF, F, FAM);
+
   {
     SmallVector<Instruction *, 4> ToErase;
     for (auto &BB : *NewF) {
@@ -2039,6 +2359,7 @@ Function *PreProcessCache::CloneFunctionWithReturns(
                     nullptr);
 #endif
   CloneOrigin[NewF] = F;
+  NewF->setMetadata(EnzymeSummaryMDName, nullptr);
   if (VMapO) {
     VMapO->insert(VMap.begin(), VMap.end());
     VMapO->getMDMap() = VMap.getMDMap();
@@ -2240,6 +2561,7 @@ void ReplaceFunctionImplementation(Module &M) {
 }
 
 void PreProcessCache::optimizeIntermediate(Function *F) {
+  PhaseTimer timer(EnzymePhase::Optimize);
   PromotePass().run(*F, FAM);
 #if LLVM_VERSION_MAJOR >= 14 && !defined(FLANG)
   GVNPass().run(*F, FAM);
@@ -34,6 +34,8 @@
 #include "FunctionUtils.h"
 #include "GradientUtils.h"
 #include "LibraryFuncs.h"
+#include "OpenMPFusion.h"
+#include "PhaseTimer.h"
 #include "TypeAnalysis/TBAA.h"
 
 #include "llvm/IR/GlobalValue.h"
@@ -72,6 +74,15 @@ llvm::cl::opt<bool> EnzymeMinCutCache("enzyme-mincut-cache", cl::init(true),
                                       cl::Hidden,
                                       cl::desc("Use Enzyme Mincut algorithm"));
 
+llvm::cl::opt<bool> EnzymeWeightedMinCut(
+    "enzyme-weighted-mincut", cl::init(false), cl::Hidden,
+    cl::desc("Weigh values by their estimated tape size in the mincut"));
+
+llvm::cl::opt<unsigned> EnzymeMinCutUnknownTripCount(
+    "enzyme-mincut-unknown-trip-count", cl::init(16), cl::Hidden,
+    cl::desc("Trip count assumed by the weighted mincut for loops whose "
+             "maximum trip count is not known"));
+
 llvm::cl::opt<bool> EnzymeLoopInvariantCache(
     "enzyme-loop-invariant-cache", cl::init(true), cl::Hidden,
     cl::desc("Attempt to hoist cache outside of loop"));
@@ -1795,6 +1806,20 @@ endCheck:
   return nullptr;
 }
 
+Value *GradientUtils::getThreadLocalTapeSlot(int idx) {
+  auto found = ThreadLocalSlots.find(idx);
+  if (found != ThreadLocalSlots.end())
+    return found->second;
+  auto stack = ThreadLocalTapes.find(idx);
+  if (stack == ThreadLocalTapes.end())
+    return nullptr;
+  IRBuilder<> B(inversionAllocs);
+  Value *slot = tape ? CreateOMPTapePop(B, stack->second)
+                     : CreateOMPTapePush(B, stack->second);
+  ThreadLocalSlots[idx] = slot;
+  return slot;
+}
+
 Value *GradientUtils::cacheForReverse(IRBuilder<> &BuilderQ, Value *malloc,
                                       int idx, bool ignoreType, bool replace) {
   assert(malloc);
@@ -1835,8 +1860,13 @@ Value *GradientUtils::cacheForReverse(IRBuilder<> &BuilderQ, Value *malloc,
     }
     assert(idx < 0 ||
            (unsigned)idx < cast<StructType>(tape->getType())->getNumElements());
-    Value *ret =
-        (idx < 0) ? tape : BuilderQ.CreateExtractValue(tape, {(unsigned)idx});
+    // A value kept in a thread-local stack is loaded from the slot of this
+    // call, rather than from the slot of this thread in a shared allocation
+    Value *threadSlot = omp ? getThreadLocalTapeSlot(idx) : nullptr;
+    Value *ret = threadSlot ? threadSlot
+                 : (idx < 0)
+                     ? tape
+                     : BuilderQ.CreateExtractValue(tape, {(unsigned)idx});
 
     if (ret->getType()->isEmptyTy()) {
       if (auto inst = dyn_cast_or_null<Instruction>(malloc)) {
@@ -1880,38 +1910,76 @@ Value *GradientUtils::cacheForReverse(IRBuilder<> &BuilderQ, Value *malloc,
       inLoop = getContext(ctx.Block, lc);
     }
 
+    Value *loadedTape = nullptr;
     if (!inLoop) {
       if (malloc)
         ret->setName(malloc->getName() + "_fromtape");
       if (omp) {
-        Value *tid = ompThreadId();
+        Value *tPtr = threadSlot;
+        if (!tPtr) {
+          Value *tid = ompThreadId();
 #if LLVM_VERSION_MAJOR > 7
-        Value *tPtr =
-            BuilderQ.CreateInBoundsGEP(ret->getType()->getPointerElementType(),
-                                       ret, ArrayRef<Value *>(tid));
+          tPtr = BuilderQ.CreateInBoundsGEP(
+              ret->getType()->getPointerElementType(), ret,
+              ArrayRef<Value *>(tid));
 #else
-        Value *tPtr = BuilderQ.CreateInBoundsGEP(ret, ArrayRef<Value *>(tid));
+          tPtr = BuilderQ.CreateInBoundsGEP(ret, ArrayRef<Value *>(tid));
 #endif
+        }
         ret =
             BuilderQ.CreateLoad(ret->getType()->getPointerElementType(), tPtr);
       }
     } else {
-      if (idx >= 0)
+      if (idx >= 0 && !threadSlot)
         erase(cast<Instruction>(ret));
       IRBuilder<> entryBuilder(inversionAllocs);
       entryBuilder.setFastMathFlags(getFast());
-      ret = (idx < 0) ? tape
-                      : entryBuilder.CreateExtractValue(tape, {(unsigned)idx});
+      ret = threadSlot ? threadSlot
+            : (idx < 0)
+                ? tape
+                : entryBuilder.CreateExtractValue(tape, {(unsigned)idx});
+
+      auto sublimits =
+          getSubLimits(/*inForwardPass*/ true, nullptr,
+                       LimitContext(/*ReverseLimit*/ reverseBlocks.size() > 0,
+                                    BuilderQ.GetInsertBlock()));
+
+      // A per thread cache is loaded from the slot of this thread
+      if (omp && isDynamicOutermostChunk(sublimits)) {
+        Value *tPtr = threadSlot;
+        if (!tPtr) {
+#if LLVM_VERSION_MAJOR > 7
+          tPtr = entryBuilder.CreateInBoundsGEP(
+              ret->getType()->getPointerElementType(), ret,
+              ArrayRef<Value *>(ompThreadId()));
+#else
+          tPtr = entryBuilder.CreateInBoundsGEP(
+              ret, ArrayRef<Value *>(ompThreadId()));
+#endif
+        }
+        ret = cast<Instruction>(entryBuilder.CreateLoad(
+            ret->getType()->getPointerElementType(), tPtr,
+            malloc->getName() + "_thread"));
+        loadedTape = ret;
+      }
+
+      // A cache held inline in the tape is copied back onto the stack
+      if (auto AT = dyn_cast<ArrayType>(ret->getType())) {
+        auto buffer = entryBuilder.CreateAlloca(AT, nullptr,
+                                                ret->getName() + "_stackcache");
+        entryBuilder.CreateStore(ret, buffer);
+        ret = cast<Instruction>(entryBuilder.CreatePointerCast(
+            buffer, PointerType::getUnqual(AT->getElementType())));
+        loadedTape = ret;
+      }
 
       Type *innerType = ret->getType();
-      for (size_t i = 0,
-                  limit = getSubLimits(
-                              /*inForwardPass*/ true, nullptr,
-                              LimitContext(
-                                  /*ReverseLimit*/ reverseBlocks.size() > 0,
-                                  BuilderQ.GetInsertBlock()))
-                              .size();
-           i < limit; ++i) {
+      size_t limit = sublimits.size();
+      // Segmented chunks are reached through an additional directory
+      for (size_t i = 0; i < sublimits.size(); ++i)
+        if (isSegmentedChunk(sublimits, i))
+          limit++;
+      for (size_t i = 0; i < limit; ++i) {
         if (!isa<PointerType>(innerType)) {
           llvm::errs() << "mod: "
                        << *BuilderQ.GetInsertBlock()->getParent()->getParent()
@@ -1937,7 +2005,7 @@ Value *GradientUtils::cacheForReverse(IRBuilder<> &BuilderQ, Value *malloc,
             cast<IntegerType>(malloc->getType())->getBitWidth() == 1 &&
             innerType != ret->getType()) {
           assert(innerType == Type::getInt8Ty(malloc->getContext()));
-        } else {
+        } else if (!isCompressedCacheType(innerType, malloc->getType())) {
           if (innerType != malloc->getType()) {
             llvm::errs() << *oldFunc << "\n";
             llvm::errs() << *newFunc << "\n";
@@ -1957,6 +2025,8 @@ Value *GradientUtils::cacheForReverse(IRBuilder<> &BuilderQ, Value *malloc,
           createCacheForScope(lctx, innerType, "mdyncache_fromtape",
                               ((DiffeGradientUtils *)this)->FreeMemory, false);
       assert(malloc);
+      if (!ignoreType && isCompressedCacheType(innerType, malloc->getType()))
+        CompressedCaches[cache] = malloc->getType();
       bool isi1 = !ignoreType && malloc->getType()->isIntegerTy() &&
                   cast<IntegerType>(malloc->getType())->getBitWidth() == 1;
       assert(isa<PointerType>(cache->getType()));
@@ -2018,18 +2088,23 @@ Value *GradientUtils::cacheForReverse(IRBuilder<> &BuilderQ, Value *malloc,
               if (replace) {
 
                 Value *replacewith =
-                    (idx < 0) ? tape
-                              : lb.CreateExtractValue(tape, {(unsigned)idx});
+                    threadSlot ? threadSlot
+                    : (idx < 0)
+                        ? tape
+                        : lb.CreateExtractValue(tape, {(unsigned)idx});
                 if (!inLoop && omp) {
-                  Value *tid = ompThreadId();
+                  Value *tPtr = threadSlot;
+                  if (!tPtr) {
+                    Value *tid = ompThreadId();
 #if LLVM_VERSION_MAJOR > 7
-                  Value *tPtr = lb.CreateInBoundsGEP(
-                      replacewith->getType()->getPointerElementType(),
-                      replacewith, ArrayRef<Value *>(tid));
+                    tPtr = lb.CreateInBoundsGEP(
+                        replacewith->getType()->getPointerElementType(),
+                        replacewith, ArrayRef<Value *>(tid));
 #else
-                  Value *tPtr =
-                      lb.CreateInBoundsGEP(replacewith, ArrayRef<Value *>(tid));
+                    tPtr = lb.CreateInBoundsGEP(replacewith,
+                                                ArrayRef<Value *>(tid));
 #endif
+                  }
                   replacewith = lb.CreateLoad(
                       replacewith->getType()->getPointerElementType(), tPtr);
                 }
@@ -2116,9 +2191,11 @@ Value *GradientUtils::cacheForReverse(IRBuilder<> &BuilderQ, Value *malloc,
               // not of the final value (thereby overwriting the new
               // inst
               IRBuilder<> lb(li);
-              auto replacewith =
-                  (idx < 0) ? tape
-                            : lb.CreateExtractValue(tape, {(unsigned)idx});
+              Value *replacewith =
+                  loadedTape ? loadedTape
+                  : (idx < 0)
+                      ? tape
+                      : lb.CreateExtractValue(tape, {(unsigned)idx});
               li->replaceAllUsesWith(replacewith);
               erase(li);
             } else {
@@ -2180,7 +2257,18 @@ Value *GradientUtils::cacheForReverse(IRBuilder<> &BuilderQ, Value *malloc,
 
     if (!inLoop) {
       Value *toStoreInTape = malloc;
-      if (omp) {
+      if (omp && EnzymeOMPFuseReverse) {
+        // Each call of the body keeps the value in a slot of its thread,
+        // leaving an empty entry in the tape shared by the team
+        ThreadLocalTapes[idx] = createOMPTapeStack(
+            *newFunc, malloc->getType(), oldFunc->getName() + "_tape");
+        Value *slot = getThreadLocalTapeSlot(idx);
+        IRBuilder<> B(inversionAllocs);
+        if (auto inst = dyn_cast<Instruction>(malloc))
+          B.SetInsertPoint(inst->getNextNode());
+        B.CreateStore(malloc, slot);
+        toStoreInTape = UndefValue::get(StructType::get(malloc->getContext()));
+      } else if (omp) {
         Value *numThreads = ompNumThreads();
         Value *tid = ompThreadId();
         IRBuilder<> entryBuilder(inversionAllocs);
@@ -2216,24 +2304,42 @@ Value *GradientUtils::cacheForReverse(IRBuilder<> &BuilderQ, Value *malloc,
     assert(found2->second.first);
 
     Value *toadd;
-    toadd = scopeAllocs[found2->second.first][0];
-    for (auto u : toadd->users()) {
-      if (auto ci = dyn_cast<CastInst>(u)) {
-        toadd = ci;
+    auto foundStack = StackCaches.find(found2->second.first);
+    if (foundStack != StackCaches.end()) {
+      // Caches held on the stack are passed inline in the tape, loaded once
+      // the function has written them
+      ReturnInst *RI = nullptr;
+      for (auto &BB : *newFunc)
+        if (auto R = dyn_cast_or_null<ReturnInst>(BB.getTerminator()))
+          RI = R;
+      assert(RI);
+      AllocaInst *buffer = foundStack->second;
+      toadd = IRBuilder<>(RI).CreateLoad(buffer->getAllocatedType(), buffer,
+                                         buffer->getName() + "_tape");
+    } else {
+      toadd = scopeAllocs[found2->second.first][0];
+      for (auto u : toadd->users()) {
+        if (auto ci = dyn_cast<CastInst>(u)) {
+          toadd = ci;
+        }
       }
     }
 
     // llvm::errs() << " malloc: " << *malloc << "\n";
     // llvm::errs() << " toadd: " << *toadd << "\n";
     Type *innerType = toadd->getType();
-    for (size_t
-             i = 0,
-             limit = getSubLimits(
-                         /*inForwardPass*/ true, nullptr,
-                         LimitContext(/*ReverseLimit*/ reverseBlocks.size() > 0,
-                                      BuilderQ.GetInsertBlock()))
-                         .size();
-         i < limit; ++i) {
+    if (auto AT = dyn_cast<ArrayType>(innerType))
+      innerType = PointerType::getUnqual(AT->getElementType());
+    auto sublimits =
+        getSubLimits(/*inForwardPass*/ true, nullptr,
+                     LimitContext(/*ReverseLimit*/ reverseBlocks.size() > 0,
+                                  BuilderQ.GetInsertBlock()));
+    size_t limit = sublimits.size();
+    // Segmented chunks are reached through an additional directory
+    for (size_t i = 0; i < sublimits.size(); ++i)
+      if (isSegmentedChunk(sublimits, i))
+        limit++;
+    for (size_t i = 0; i < limit; ++i) {
       innerType = innerType->getPointerElementType();
     }
     assert(!ignoreType);
@@ -2241,7 +2347,7 @@ Value *GradientUtils::cacheForReverse(IRBuilder<> &BuilderQ, Value *malloc,
         toadd->getType() != innerType &&
         cast<IntegerType>(malloc->getType())->getBitWidth() == 1) {
       assert(innerType == Type::getInt8Ty(toadd->getContext()));
-    } else {
+    } else if (!isCompressedCacheType(innerType, malloc->getType())) {
       if (innerType != malloc->getType()) {
         llvm::errs() << "oldFunc:" << *oldFunc << "\n";
         llvm::errs() << "newFunc: " << *newFunc << "\n";
@@ -2251,6 +2357,41 @@ Value *GradientUtils::cacheForReverse(IRBuilder<> &BuilderQ, Value *malloc,
       }
       assert(innerType == malloc->getType());
     }
+    if (omp && isDynamicOutermostChunk(sublimits)) {
+      // A dynamic loop inside a parallel region, such as one over the chunks
+      // of a dynamic schedule, grows a cache private to each thread. It is
+      // kept in a slot of the thread-local tape stack, or else in the slot of
+      // the thread in an allocation of the caller, once the thread returns.
+      AllocaInst *storeInto = found2->second.first;
+      Type *cacheTy = storeInto->getAllocatedType();
+      Value *threadallocation = nullptr;
+      if (EnzymeOMPFuseReverse) {
+        ThreadLocalTapes[idx] = createOMPTapeStack(
+            *newFunc, cacheTy, storeInto->getName() + "_threadtape");
+        toadd = UndefValue::get(StructType::get(newFunc->getContext()));
+      } else {
+        IRBuilder<> entryBuilder(inversionAllocs);
+        threadallocation =
+            CreateAllocation(entryBuilder, cacheTy, ompNumThreads(),
+                             storeInto->getName() + "_threadcache");
+        toadd = threadallocation;
+      }
+      for (auto &BB : *newFunc)
+        if (auto RI = dyn_cast_or_null<ReturnInst>(BB.getTerminator())) {
+          IRBuilder<> B(RI);
+          Value *tPtr = getThreadLocalTapeSlot(idx);
+          if (!tPtr) {
+#if LLVM_VERSION_MAJOR > 7
+            tPtr = B.CreateInBoundsGEP(cacheTy, threadallocation,
+                                       ArrayRef<Value *>(ompThreadId()));
+#else
+            tPtr = B.CreateInBoundsGEP(threadallocation,
+                                       ArrayRef<Value *>(ompThreadId()));
+#endif
+          }
+          B.CreateStore(B.CreateLoad(cacheTy, storeInto), tPtr);
+        }
+    }
     addedTapeVals.push_back(toadd);
     return malloc;
   }
@@ -2922,6 +3063,43 @@ BasicBlock *GradientUtils::getReverseOrLatchMerge(BasicBlock *BB,
   return newBlocksForLoop_cache[tup] = reverseBlocks[BB].front();
 }
 
+Value *GradientUtils::combineChainRule(IRBuilder<> &Builder,
+                                       ArrayRef<Value *> Lanes,
+                                       BasicBlock *StartBB,
+                                       Instruction *Start) {
+  SmallPtrSet<Instruction *, 8> emitted;
+  if (Builder.GetInsertBlock() == StartBB) {
+    auto end = Builder.GetInsertPoint();
+    for (auto it = Start ? std::next(Start->getIterator()) : StartBB->begin();
+         it != end; ++it)
+      emitted.insert(&*it);
+  }
+
+  Type *wrappedType = ArrayType::get(Lanes[0]->getType(), width);
+  Value *res = UndefValue::get(wrappedType);
+  if (!isCombinableLanes(Lanes)) {
+    for (unsigned int i = 0; i < width; ++i)
+      res = Builder.CreateInsertValue(res, Lanes[i], {i});
+    return res;
+  }
+
+  SmallVector<Instruction *, 8> Combined;
+  Value *vec = combineLanes(Builder, Lanes, Combined);
+  for (unsigned int i = 0; i < width; ++i)
+    res = Builder.CreateInsertValue(res, Builder.CreateExtractElement(vec, i),
+                                    {i});
+
+  // Only the scalar code emitted by the rule itself is erased, as values
+  // looked up by the rule may be cached.
+  for (auto I : llvm::reverse(Combined))
+    if (emitted.erase(I) && I->use_empty())
+      I->eraseFromParent();
+  for (auto I : emitted)
+    if (isa<ExtractValueInst>(I) && I->use_empty())
+      I->eraseFromParent();
+  return res;
+}
+
 void GradientUtils::forceContexts() {
   for (auto BB : originalBlocks) {
     LoopContext lc;
@@ -6573,6 +6751,7 @@ nofast:;
 }
 
 void GradientUtils::computeMinCache() {
+  PhaseTimer timer(EnzymePhase::MinCut);
   if (EnzymeMinCutCache) {
     SmallPtrSet<Value *, 4> Recomputes;
 
@@ -6768,8 +6947,18 @@ void GradientUtils::computeMinCache() {
     }
 
     SmallPtrSet<Value *, 5> MinReq;
-    minCut(oldFunc->getParent()->getDataLayout(), OrigLI, Recomputes,
-           Intermediates, Required, MinReq, rematerializableAllocations);
+    auto tripCount = [&](Loop *L) -> uint64_t {
+      if (auto TC = OrigSE.getSmallConstantMaxTripCount(L))
+        return TC;
+      return EnzymeMinCutUnknownTripCount;
+    };
+    if (EnzymeWeightedMinCut) {
+      weightedMinCut(oldFunc->getParent()->getDataLayout(), OrigLI, tripCount,
+                     Recomputes, Intermediates, Required, MinReq,
+                     rematerializableAllocations);
+    } else
+      minCut(oldFunc->getParent()->getDataLayout(), OrigLI, Recomputes,
+             Intermediates, Required, MinReq, rematerializableAllocations);
     SmallPtrSet<Value *, 5> NeedGraph;
     for (Value *V : MinReq)
       NeedGraph.insert(V);
@@ -6792,7 +6981,29 @@ void GradientUtils::computeMinCache() {
       knownRecomputeHeuristic[V] = !MinReq.count(V);
       if (!NeedGraph.count(V)) {
         unnecessaryIntermediates.insert(cast<Instruction>(V));
+        continue;
       }
+      auto I = cast<Instruction>(V);
+      unsigned depth = 0;
+      uint64_t iterations = 1;
+      for (Loop *L = OrigLI.getLoopFor(I->getParent()); L;
+           L = L->getParentLoop()) {
+        ++depth;
+        iterations = SaturatingMultiply(iterations, tripCount(L));
+      }
+      uint64_t elementBytes =
+          I->getType()->isSized()
+              ? (uint64_t)oldFunc->getParent()->getDataLayout().getTypeStoreSize(
+                    I->getType())
+              : 0;
+      bool cached = MinReq.count(V);
+      EmitCacheRemark(getRemarkEmitter(oldFunc),
+                      cached ? "MinCutCache" : "MinCutRecompute",
+                      DiagnosticLocation(I->getDebugLoc()), I->getParent(),
+                      cached ? "Min-cut caches" : "Min-cut recomputes", I, "",
+                      elementBytes, depth,
+                      cached ? SaturatingMultiply(elementBytes, iterations)
+                             : 0);
     }
   }
 }
@@ -48,6 +48,7 @@
 #include "llvm/ADT/Triple.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/CaptureTracking.h"
 #include "llvm/Analysis/LoopInfo.h"
 
 #include "llvm/IR/BasicBlock.h"
@@ -425,6 +426,14 @@ public:
     return red;
   }
 
+  bool useCacheArena() const override {
+    // The arena is thread-local, whereas caches of a parallel region or a
+    // thread routine, and of anything they call, may be freed by a different
+    // thread than the one which allocated them. Such code is exactly the code
+    // differentiated with atomic accumulation.
+    return !omp && !AtomicAdd && CacheUtility::useCacheArena();
+  }
+
   bool assumeDynamicLoopOfSizeOne(llvm::Loop *L) const override {
     if (!EnzymeInactiveDynamic)
       return false;
@@ -1164,6 +1173,19 @@ public:
 
   ArrayRef<WeakTrackingVH> getTapeValues() const { return addedTapeVals; }
 
+  /// Thread-local stacks holding the tape values of a parallel region body
+  /// in place of its tape, keyed by their index in the tape
+  std::map<int, GlobalVariable *> ThreadLocalTapes;
+
+private:
+  /// Slot of each thread-local tape stack of this call of the body
+  std::map<int, Value *> ThreadLocalSlots;
+
+  /// Return the slot of this call on the thread-local tape stack of the tape
+  /// value \p idx, if it is kept in one. The forward body reserves the slot
+  /// and the reverse body releases it.
+  Value *getThreadLocalTapeSlot(int idx);
+
 public:
   AAResults &OrigAA;
   TypeAnalysis &TA;
@@ -1664,9 +1686,12 @@ public:
 
     LimitContext lctx(/*ReverseLimit*/ reverseBlocks.size() > 0, scope);
 
+    Type *T = getCacheStorageType(inst, lctx);
     AllocaInst *cache =
-        createCacheForScope(lctx, inst->getType(), inst->getName(), shouldFree);
+        createCacheForScope(lctx, T, inst->getName(), shouldFree);
     assert(cache);
+    if (T != inst->getType())
+      CompressedCaches[cache] = inst->getType();
     Value *Val = inst;
     insert_or_assign(
         scopeMap, Val,
@@ -1915,6 +1940,18 @@ public:
           assert(cast<ArrayType>(vals[i]->getType())->getNumElements() ==
                  width);
 
+      if (EnzymeVectorShadow && diffType->isFloatingPointTy()) {
+        BasicBlock *StartBB = Builder.GetInsertBlock();
+        Instruction *Start = getLastInserted(Builder);
+        SmallVector<Value *, 4> Lanes;
+        for (unsigned int i = 0; i < getWidth(); ++i) {
+          auto tup = std::tuple<Args...>{
+              (args ? extractMeta(Builder, args, i) : nullptr)...};
+          Lanes.push_back(std::apply(rule, std::move(tup)));
+        }
+        return combineChainRule(Builder, Lanes, StartBB, Start);
+      }
+
       Type *wrappedType = ArrayType::get(diffType, width);
       Value *res = UndefValue::get(wrappedType);
       for (unsigned int i = 0; i < getWidth(); ++i) {
@@ -1929,6 +1966,21 @@ public:
     }
   }
 
+  /// The instruction before the insertion point of \p Builder, if any
+  static Instruction *getLastInserted(IRBuilder<> &Builder) {
+    auto IP = Builder.GetInsertPoint();
+    if (IP == Builder.GetInsertBlock()->begin())
+      return nullptr;
+    return &*std::prev(IP);
+  }
+
+  /// Wrap the lanes \p Lanes of a chain rule, computing them with vector
+  /// instructions where possible. The scalar lane computations which were
+  /// emitted in \p StartBB after \p Start, and are replaced by vector
+  /// instructions, are erased.
+  Value *combineChainRule(IRBuilder<> &Builder, ArrayRef<Value *> Lanes,
+                          BasicBlock *StartBB, Instruction *Start);
+
   /// Unwraps a vector derivative from its internal representation and applies a
   /// function f to each element. Return values of f are collected and wrapped.
   template <typename Func, typename... Args>
@@ -2418,7 +2470,10 @@ public:
     forfree->setAlignment(align);
 #endif
 
-    CallInst *ci = CreateDealloc(tbuild, forfree);
+    CallInst *ci = useCacheArena() ? CreateTapeDealloc(tbuild, forfree)
+                   : isSegmentedChunk(sublimits, i)
+                       ? CreateSegmentedDealloc(tbuild, forfree)
+                       : CreateDealloc(tbuild, forfree);
     if (ci) {
       if (newFunc->getSubprogram())
         ci->setDebugLoc(DILocation::get(newFunc->getContext(), 0, 0,
@@ -2594,6 +2649,12 @@ public:
     // all additional parallelism in this function is outlined.
     if (backwardsOnlyShadows.find(TmpOrig) != backwardsOnlyShadows.end())
       Atomic = false;
+    // Likewise the shadow of a stack slot whose address is never captured is
+    // only ever accessed by the thread owning the frame.
+    if (Atomic && isa<AllocaInst>(TmpOrig) &&
+        !PointerMayBeCaptured(TmpOrig, /*ReturnCaptures*/ true,
+                              /*StoreCaptures*/ true))
+      Atomic = false;
 
     if (Atomic) {
       // For amdgcn constant AS is 4 and if the primal is in it we need to cast
@@ -0,0 +1,1131 @@
+//===- LoopCheckpointing.cpp - Binomial checkpointing of outermost loops  -===//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+// If using this code in an academic setting, please cite the following:
+// @incollection{enzymeNeurips,
+// title = {Instead of Rewriting Foreign Code for Machine Learning,
+//          Automatically Synthesize Fast Gradients},
+// author = {Moses, William S. and Churavy, Valentin},
+// booktitle = {Advances in Neural Information Processing Systems 33},
+// year = {2020},
+// note = {To appear in},
+// }
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements an opt-in checkpointing strategy for outermost loops.
+//
+// An eligible loop carries its state in header phis and in stack arrays of the
+// function which are only ever loaded from and stored to, and does not access
+// other memory. It is outlined into a readnone function taking and returning
+// the elements of those arrays by value, which callers therefore never
+// augment: the forward pass runs the loop as is, and the reverse pass invokes
+// the combined derivative of the outlined function. That derivative is built
+// here from the Enzyme derivative of a single iteration, whose state holds the
+// phis and the arrays, and reverses the iterations following the binomial
+// (revolve) schedule of Griewank and Walther. Given s snapshots and n
+// iterations, at most s states are live at a time and every iteration is
+// recomputed at most t times, for the smallest t with binomial(s + t, s) >= n.
+// Every snapshot thus copies the arrays the loop writes along with its phis.
+//
+//===----------------------------------------------------------------------===//
+#include "LoopCheckpointing.h"
+
+#include "llvm/ADT/SetVector.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include "FunctionUtils.h"
+#include "TypeAnalysis/TypeAnalysis.h"
+#include "Utils.h"
+
+using namespace llvm;
+
+extern "C" {
+llvm::cl::opt<bool> EnzymeLoopCheckpoint(
+    "enzyme-loop-checkpoint", cl::init(false), cl::Hidden,
+    cl::desc("Checkpoint all eligible outermost loops rather than only those "
+             "annotated with enzyme.checkpoint"));
+
+llvm::cl::opt<unsigned> EnzymeLoopCheckpointSnapshots(
+    "enzyme-loop-checkpoint-snapshots", cl::init(0), cl::Hidden,
+    cl::desc("Number of snapshots used to checkpoint a loop, or 0 to use the "
+             "bit width of its trip count"));
+}
+
+/// Function attribute marking a loop outlined for checkpointing, whose value
+/// is the number of snapshots to use.
+static constexpr const char *CheckpointAttr = "enzyme_checkpoint";
+
+/// Function attribute marking a single iteration of a checkpointed loop.
+static constexpr const char *CheckpointIterationAttr =
+    "enzyme_checkpoint_iteration";
+
+/// Largest number of elements of the stack arrays held in the state of a
+/// checkpointed loop, each of which is passed to the outlined loop by value.
+static constexpr unsigned MaxMemoryStateElements = 64;
+
+static bool isCheckpointableType(Type *T) {
+  return T->isIntOrIntVectorTy() || T->isFPOrFPVectorTy();
+}
+
+/// Append the index paths and types of the elements of \p T to \p elements,
+/// returning false if it holds other than checkpointable elements.
+static bool
+flattenMemoryType(Type *T, SmallVectorImpl<unsigned> &path,
+                  SmallVectorImpl<std::pair<SmallVector<unsigned, 2>, Type *>>
+                      &elements) {
+  if (isCheckpointableType(T)) {
+    if (elements.size() == MaxMemoryStateElements)
+      return false;
+    elements.emplace_back(SmallVector<unsigned, 2>(path.begin(), path.end()),
+                          T);
+    return true;
+  }
+  unsigned count = 0;
+  if (auto AT = dyn_cast<ArrayType>(T))
+    count = AT->getNumElements();
+  else if (auto ST = dyn_cast<StructType>(T))
+    count = ST->getNumElements();
+  else
+    return false;
+  for (unsigned i = 0; i < count; i++) {
+    path.push_back(i);
+    bool legal = flattenMemoryType(GetElementPtrInst::getTypeAtIndex(T, i),
+                                   path, elements);
+    path.pop_back();
+    if (!legal)
+      return false;
+  }
+  return true;
+}
+
+/// Whether the stack allocation \p AI of \p F can be held in the state of a
+/// checkpointed loop, only being accessed by plain loads and stores.
+static bool isMemoryState(AllocaInst *AI, Function *F) {
+  if (AI->getParent() != &F->getEntryBlock() || !AI->isStaticAlloca() ||
+      !cast<ConstantInt>(AI->getArraySize())->isOne())
+    return false;
+  SmallVector<Value *, 4> todo = {AI};
+  while (todo.size()) {
+    Value *V = todo.pop_back_val();
+    for (User *U : V->users()) {
+      if (isa<GetElementPtrInst>(U) || isa<BitCastInst>(U)) {
+        todo.push_back(U);
+        continue;
+      }
+      if (auto LI = dyn_cast<LoadInst>(U))
+        if (LI->isSimple() && isCheckpointableType(LI->getType()))
+          continue;
+      if (auto SI = dyn_cast<StoreInst>(U))
+        if (SI->isSimple() && SI->getValueOperand() != V &&
+            isCheckpointableType(SI->getValueOperand()->getType()))
+          continue;
+      if (isa<DbgInfoIntrinsic>(U))
+        continue;
+      if (auto II = dyn_cast<IntrinsicInst>(U))
+        if (II->isLifetimeStartOrEnd())
+          continue;
+      return false;
+    }
+  }
+  return true;
+}
+
+/// The stack allocation \p Ptr points into, if any.
+static AllocaInst *getBaseAlloca(Value *Ptr) {
+  while (true) {
+    if (auto GEP = dyn_cast<GetElementPtrInst>(Ptr))
+      Ptr = GEP->getPointerOperand();
+    else if (auto BC = dyn_cast<BitCastInst>(Ptr))
+      Ptr = BC->getOperand(0);
+    else
+      return dyn_cast<AllocaInst>(Ptr);
+  }
+}
+
+/// A pointer to the element at \p path of the allocation \p AI.
+static Value *getElementPtr(IRBuilder<> &B, AllocaInst *AI,
+                            ArrayRef<unsigned> path) {
+  if (path.empty())
+    return AI;
+  SmallVector<Value *, 4> idxs = {B.getInt32(0)};
+  for (unsigned i : path)
+    idxs.push_back(B.getInt32(i));
+  return B.CreateInBoundsGEP(AI->getAllocatedType(), AI, idxs);
+}
+
+/// Outline \p L into a readnone function, returning nullptr and setting
+/// \p reason if the loop is not eligible.
+static Function *outlineLoop(Loop *L, Function *NewF, Function *Orig,
+                             unsigned snapshots, StringRef &reason) {
+  BasicBlock *preheader = L->getLoopPreheader();
+  BasicBlock *header = L->getHeader();
+  BasicBlock *exiting = L->getExitingBlock();
+  BasicBlock *exit = L->getExitBlock();
+  reason = "lacks a unique exit";
+  if (!preheader || !L->getLoopLatch() || !exiting || !exit)
+    return nullptr;
+  auto exitBr = dyn_cast<BranchInst>(exiting->getTerminator());
+  if (!exitBr || !exitBr->isConditional())
+    return nullptr;
+
+  reason = "carries state other than integer or floating point phis";
+  if (header->phis().begin() == header->phis().end())
+    return nullptr;
+  for (auto &PN : header->phis())
+    if (!isCheckpointableType(PN.getType()))
+      return nullptr;
+
+  // Pointers from outside the loop into the stack arrays it keeps its state
+  // in, which are recreated within the outlined loop.
+  SetVector<AllocaInst *> memory;
+  SetVector<Instruction *> pointers;
+  auto addPointer = [&](Value *V) {
+    AllocaInst *AI = getBaseAlloca(V);
+    if (!AI || !isMemoryState(AI, NewF))
+      return false;
+    memory.insert(AI);
+    SmallVector<Instruction *, 2> chain;
+    for (auto I = cast<Instruction>(V); I != AI;
+         I = cast<Instruction>(I->getOperand(0))) {
+      if (auto GEP = dyn_cast<GetElementPtrInst>(I))
+        if (!GEP->hasAllConstantIndices())
+          return false;
+      chain.push_back(I);
+    }
+    for (auto I = chain.rbegin(); I != chain.rend(); ++I)
+      pointers.insert(*I);
+    return true;
+  };
+
+  SetVector<Value *> inputs;
+  SetVector<Instruction *> outputs;
+  for (BasicBlock *BB : L->blocks()) {
+    for (Instruction &I : *BB) {
+      if (isa<DbgInfoIntrinsic>(&I))
+        continue;
+      if (I.mayReadOrWriteMemory()) {
+        reason = "accesses memory other than stack arrays of the function";
+        Value *ptr = nullptr;
+        if (auto LI = dyn_cast<LoadInst>(&I)) {
+          if (LI->isSimple())
+            ptr = LI->getPointerOperand();
+        } else if (auto SI = dyn_cast<StoreInst>(&I)) {
+          if (SI->isSimple())
+            ptr = SI->getPointerOperand();
+        }
+        if (!ptr || !getBaseAlloca(ptr) ||
+            !isMemoryState(getBaseAlloca(ptr), NewF))
+          return nullptr;
+      }
+      reason = "allocates or unwinds";
+      if (isa<AllocaInst>(&I) || I.isEHPad())
+        return nullptr;
+      if (auto CI = dyn_cast<CallInst>(&I))
+        if (CI->isConvergent()) {
+          reason = "contains a convergent call";
+          return nullptr;
+        }
+      for (Value *op : I.operands()) {
+        auto opI = dyn_cast<Instruction>(op);
+        if (isa<Argument>(op) || (opI && !L->contains(opI))) {
+          if (op->getType()->isPointerTy() && opI) {
+            reason = "uses a pointer other than into stack arrays of the "
+                     "function";
+            if (!addPointer(op))
+              return nullptr;
+            continue;
+          }
+          reason = "uses a value which is not an integer or floating point";
+          if (!isCheckpointableType(op->getType()))
+            return nullptr;
+          inputs.insert(op);
+        }
+      }
+      for (User *U : I.users()) {
+        if (!L->contains(cast<Instruction>(U))) {
+          reason = "has a result which is not an integer or floating point";
+          if (!isCheckpointableType(I.getType()))
+            return nullptr;
+          outputs.insert(&I);
+        }
+      }
+    }
+  }
+
+  // The elements of the stack arrays are passed to and returned from the
+  // outlined loop by value.
+  SmallVector<std::pair<AllocaInst *, SmallVector<unsigned, 2>>, 8> elements;
+  SmallVector<Type *, 8> elementTys;
+  for (AllocaInst *AI : memory) {
+    SmallVector<unsigned, 2> path;
+    SmallVector<std::pair<SmallVector<unsigned, 2>, Type *>, 8> flat;
+    reason = "keeps too many elements of stack arrays in its state";
+    if (!flattenMemoryType(AI->getAllocatedType(), path, flat) ||
+        elements.size() + flat.size() > MaxMemoryStateElements)
+      return nullptr;
+    for (auto &pair : flat) {
+      elements.emplace_back(AI, pair.first);
+      elementTys.push_back(pair.second);
+    }
+  }
+  // A loop without results is dead, and left for later cleanup.
+  reason = "has no results";
+  if (outputs.empty() && elements.empty())
+    return nullptr;
+
+  LLVMContext &ctx = NewF->getContext();
+  SmallVector<Type *, 4> paramTys;
+  for (Value *V : inputs)
+    paramTys.push_back(V->getType());
+  paramTys.append(elementTys.begin(), elementTys.end());
+  SmallVector<Type *, 4> outputTys;
+  for (Instruction *I : outputs)
+    outputTys.push_back(I->getType());
+  outputTys.append(elementTys.begin(), elementTys.end());
+  Type *RetTy = outputTys.size() == 1
+                    ? outputTys[0]
+                    : StructType::get(ctx, ArrayRef<Type *>(outputTys));
+
+  Function *CF = Function::Create(
+      FunctionType::get(RetTy, paramTys, /*isVarArg*/ false),
+      GlobalValue::InternalLinkage, "checkpointloop_" + Orig->getName(),
+      NewF->getParent());
+  CF->addFnAttr(Attribute::ReadNone);
+  CF->addFnAttr(Attribute::NoUnwind);
+#if LLVM_VERSION_MAJOR >= 14
+  CF->addFnAttr(Attribute::WillReturn);
+#elif LLVM_VERSION_MAJOR >= 9
+  CF->addAttribute(AttributeList::FunctionIndex, Attribute::WillReturn);
+#endif
+  CF->addFnAttr(CheckpointAttr, std::to_string(snapshots));
+
+  ValueToValueMapTy VMap;
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", CF);
+  {
+    auto arg = CF->arg_begin();
+    for (Value *V : inputs) {
+      arg->setName(V->getName());
+      VMap[V] = &*arg;
+      ++arg;
+    }
+    // The outlined loop keeps its own copy of the stack arrays, initialized
+    // from and returned as their elements.
+    IRBuilder<> B(entry);
+    SmallVector<Instruction *, 4> cloned(memory.begin(), memory.end());
+    cloned.append(pointers.begin(), pointers.end());
+    for (Instruction *I : cloned) {
+      Instruction *NI = I->clone();
+      NI->setDebugLoc(DebugLoc());
+      B.Insert(NI, I->getName());
+      RemapInstruction(NI, VMap, RF_IgnoreMissingLocals);
+      VMap[I] = NI;
+    }
+    for (auto &pair : elements) {
+      arg->setName(pair.first->getName() + ".in");
+      B.CreateStore(&*arg, getElementPtr(B, cast<AllocaInst>(VMap[pair.first]),
+                                         pair.second));
+      ++arg;
+    }
+  }
+  SmallVector<BasicBlock *, 8> blocks;
+  for (BasicBlock *BB : L->blocks()) {
+    BasicBlock *NBB = CloneBasicBlock(BB, VMap, "", CF);
+    VMap[BB] = NBB;
+    blocks.push_back(NBB);
+  }
+  BasicBlock *ret = BasicBlock::Create(ctx, "exit", CF);
+  VMap[preheader] = entry;
+  VMap[exit] = ret;
+  remapInstructionsInBlocks(blocks, VMap);
+  BranchInst::Create(cast<BasicBlock>(VMap[header]), entry);
+
+  // Debug info is specific to the subprogram of the original function.
+  for (BasicBlock *BB : blocks) {
+    for (auto I = BB->begin(), E = BB->end(); I != E;) {
+      Instruction *inst = &*I++;
+      if (isa<DbgInfoIntrinsic>(inst)) {
+        inst->eraseFromParent();
+        continue;
+      }
+      inst->setDebugLoc(DebugLoc());
+      inst->setMetadata(LLVMContext::MD_loop, nullptr);
+    }
+  }
+
+  {
+    IRBuilder<> B(ret);
+    SmallVector<Value *, 4> rets;
+    for (Instruction *I : outputs)
+      rets.push_back(VMap[I]);
+    for (unsigned i = 0; i < elements.size(); i++)
+      rets.push_back(B.CreateLoad(
+          elementTys[i],
+          getElementPtr(B, cast<AllocaInst>(VMap[elements[i].first]),
+                        elements[i].second)));
+    if (rets.size() == 1) {
+      B.CreateRet(rets[0]);
+    } else {
+      Value *agg = UndefValue::get(RetTy);
+      for (unsigned i = 0; i < rets.size(); i++)
+        agg = B.CreateInsertValue(agg, rets[i], {i});
+      B.CreateRet(agg);
+    }
+  }
+
+  // Replace the loop in the original function by a call to the outlined one.
+  BasicBlock *callBB = BasicBlock::Create(ctx, "checkpoint", NewF, exit);
+  IRBuilder<> B(callBB);
+  SmallVector<Value *, 4> args(inputs.begin(), inputs.end());
+  SmallVector<Value *, 8> elementPtrs;
+  for (unsigned i = 0; i < elements.size(); i++) {
+    elementPtrs.push_back(
+        getElementPtr(B, elements[i].first, elements[i].second));
+    args.push_back(B.CreateLoad(elementTys[i], elementPtrs[i]));
+  }
+  CallInst *call = B.CreateCall(CF, args);
+  if (auto DL = exitBr->getDebugLoc())
+    call->setDebugLoc(DL);
+  SmallVector<Value *, 4> results;
+  if (outputTys.size() == 1)
+    results.push_back(call);
+  else
+    for (unsigned i = 0; i < outputTys.size(); i++)
+      results.push_back(B.CreateExtractValue(call, {i}));
+  for (unsigned i = 0; i < elements.size(); i++)
+    B.CreateStore(results[outputs.size() + i], elementPtrs[i]);
+  B.CreateBr(exit);
+
+  preheader->getTerminator()->replaceUsesOfWith(header, callBB);
+  for (auto &PN : exit->phis())
+    for (unsigned i = 0; i < PN.getNumIncomingValues(); i++)
+      if (PN.getIncomingBlock(i) == exiting)
+        PN.setIncomingBlock(i, callBB);
+  for (unsigned i = 0; i < outputs.size(); i++) {
+    SmallVector<Use *, 4> uses;
+    for (Use &U : outputs[i]->uses())
+      if (!L->contains(cast<Instruction>(U.getUser())))
+        uses.push_back(&U);
+    for (Use *U : uses)
+      U->set(results[i]);
+  }
+
+  SmallVector<BasicBlock *, 8> loopBlocks(L->blocks().begin(),
+                                          L->blocks().end());
+  for (BasicBlock *BB : loopBlocks)
+    BB->dropAllReferences();
+  for (BasicBlock *BB : loopBlocks)
+    BB->eraseFromParent();
+  return CF;
+}
+
+bool outlineCheckpointedLoops(Function *NewF, Function *Orig,
+                              FunctionAnalysisManager &FAM) {
+  if (NewF->hasFnAttribute(CheckpointAttr) ||
+      NewF->hasFnAttribute(CheckpointIterationAttr))
+    return false;
+
+  LoopInfo &LI = FAM.getResult<LoopAnalysis>(*NewF);
+  SmallVector<std::pair<Loop *, unsigned>, 2> todo;
+  for (Loop *L : LI) {
+    auto annotation = findStringMetadataForLoop(L, "enzyme.checkpoint");
+    if (!annotation && !EnzymeLoopCheckpoint)
+      continue;
+    unsigned snapshots = EnzymeLoopCheckpointSnapshots;
+    if (annotation && *annotation)
+      if (auto CI = mdconst::dyn_extract<ConstantInt>(**annotation))
+        snapshots = CI->getZExtValue();
+    todo.emplace_back(L, snapshots);
+  }
+
+  bool changed = false;
+  for (auto &pair : todo) {
+    Loop *L = pair.first;
+    auto Loc = L->getStartLoc();
+    BasicBlock *header = L->getHeader();
+    BasicBlock *preheader = L->getLoopPreheader();
+    StringRef reason;
+    if (auto CF = outlineLoop(L, NewF, Orig, pair.second, reason)) {
+      EmitWarning("CheckpointLoop", Loc, NewF, preheader,
+                  "Checkpointing loop of ", Orig->getName(), " as ",
+                  CF->getName());
+      changed = true;
+    } else {
+      EmitWarning("CheckpointLoop", Loc, NewF, header,
+                  "Cannot checkpoint loop ", header->getName(), " of ",
+                  Orig->getName(), " as it ", reason);
+    }
+  }
+
+  if (changed) {
+    PreservedAnalyses PA;
+    FAM.invalidate(*NewF, PA);
+  }
+  return changed;
+}
+
+namespace {
+enum class IterationKind {
+  /// Runs an iteration known not to exit, updating the state in place
+  Step,
+  /// Runs an iteration, updating the state and returning true unless it exits
+  Continue,
+  /// Runs the final iteration, returning the results of the loop
+  Last,
+};
+
+/// The structure of a loop outlined by outlineLoop
+struct OutlinedLoop {
+  Function *F;
+  BasicBlock *header;
+  BasicBlock *latch;
+  BasicBlock *exit;
+  SmallVector<PHINode *, 4> phis;
+  /// Stack arrays of the outlined loop, held in the state after the phis
+  SmallVector<AllocaInst *, 2> allocas;
+  StructType *StateTy;
+
+  bool analyze(Function *F) {
+    this->F = F;
+    auto entryBr = dyn_cast<BranchInst>(F->getEntryBlock().getTerminator());
+    if (!entryBr || entryBr->isConditional())
+      return false;
+    header = entryBr->getSuccessor(0);
+    exit = nullptr;
+    for (BasicBlock &BB : *F) {
+      if (isa<ReturnInst>(BB.getTerminator())) {
+        if (exit)
+          return false;
+        exit = &BB;
+      }
+    }
+    if (!exit || !exit->getSinglePredecessor() || exit->phis().begin() !=
+                                                       exit->phis().end())
+      return false;
+    latch = nullptr;
+    for (BasicBlock *pred : predecessors(header)) {
+      if (pred == &F->getEntryBlock())
+        continue;
+      if (latch)
+        return false;
+      latch = pred;
+    }
+    if (!latch)
+      return false;
+    SmallVector<Type *, 4> types;
+    for (auto &PN : header->phis()) {
+      phis.push_back(&PN);
+      types.push_back(PN.getType());
+    }
+    for (Instruction &I : F->getEntryBlock()) {
+      if (auto AI = dyn_cast<AllocaInst>(&I)) {
+        allocas.push_back(AI);
+        types.push_back(AI->getAllocatedType());
+      }
+    }
+    StateTy = StructType::get(F->getContext(), types);
+    return true;
+  }
+
+  /// Map the stack arrays of the loop to their place in the state \p st,
+  /// cloning the pointers into them computed before the loop.
+  void mapMemory(IRBuilder<> &B, Value *st, ValueToValueMapTy &VMap) {
+    for (unsigned i = 0; i < allocas.size(); i++)
+      VMap[allocas[i]] = B.CreateStructGEP(StateTy, st, phis.size() + i,
+                                           allocas[i]->getName());
+    for (Instruction &I : F->getEntryBlock()) {
+      if (!isa<GetElementPtrInst>(&I) && !isa<BitCastInst>(&I))
+        continue;
+      Instruction *NI = I.clone();
+      B.Insert(NI, I.getName());
+      RemapInstruction(NI, VMap, RF_IgnoreMissingLocals);
+      VMap[&I] = NI;
+    }
+  }
+
+  /// Clone a single iteration of the loop, taking a pointer to the state
+  /// followed by the arguments of the loop.
+  Function *cloneIteration(IterationKind kind) {
+    LLVMContext &ctx = F->getContext();
+    SmallVector<Type *, 4> params = {PointerType::getUnqual(StateTy)};
+    for (auto &arg : F->args())
+      params.push_back(arg.getType());
+    Type *RetTy = nullptr;
+    StringRef prefix;
+    switch (kind) {
+    case IterationKind::Step:
+      RetTy = Type::getVoidTy(ctx);
+      prefix = "checkpointstep_";
+      break;
+    case IterationKind::Continue:
+      RetTy = Type::getInt1Ty(ctx);
+      prefix = "checkpointcontinue_";
+      break;
+    case IterationKind::Last:
+      RetTy = F->getReturnType();
+      prefix = "checkpointlast_";
+      break;
+    }
+    Function *NF = Function::Create(
+        FunctionType::get(RetTy, params, /*isVarArg*/ false),
+        GlobalValue::InternalLinkage, prefix + F->getName(), F->getParent());
+    NF->addFnAttr(CheckpointIterationAttr);
+    NF->addFnAttr(Attribute::NoUnwind);
+    NF->addParamAttr(0, Attribute::NoCapture);
+    NF->addParamAttr(0, Attribute::NoAlias);
+
+    ValueToValueMapTy VMap;
+    Argument *st = NF->arg_begin();
+    st->setName("state");
+    {
+      auto arg = NF->arg_begin() + 1;
+      for (auto &oarg : F->args()) {
+        arg->setName(oarg.getName());
+        VMap[&oarg] = &*arg;
+        ++arg;
+      }
+    }
+
+    BasicBlock *entry = BasicBlock::Create(ctx, "entry", NF);
+    SmallVector<BasicBlock *, 8> blocks;
+    for (BasicBlock &BB : *F) {
+      if (&BB == &F->getEntryBlock() || &BB == exit)
+        continue;
+      BasicBlock *NBB = CloneBasicBlock(&BB, VMap, "", NF);
+      VMap[&BB] = NBB;
+      blocks.push_back(NBB);
+    }
+
+    IRBuilder<> B(entry);
+    for (unsigned i = 0; i < phis.size(); i++) {
+      cast<PHINode>(VMap[phis[i]])->eraseFromParent();
+      VMap[phis[i]] = B.CreateLoad(phis[i]->getType(),
+                                   B.CreateStructGEP(StateTy, st, i),
+                                   phis[i]->getName());
+    }
+    mapMemory(B, st, VMap);
+    BasicBlock *NHeader = cast<BasicBlock>(VMap[header]);
+    B.CreateBr(NHeader);
+
+    BasicBlock *backedge = BasicBlock::Create(ctx, "backedge", NF);
+    BasicBlock *NExit = nullptr;
+    if (kind == IterationKind::Last) {
+      NExit = CloneBasicBlock(exit, VMap, "", NF);
+      blocks.push_back(NExit);
+    } else
+      NExit = BasicBlock::Create(ctx, "exit", NF);
+    VMap[exit] = NExit;
+    remapInstructionsInBlocks(blocks, VMap);
+    cast<BasicBlock>(VMap[latch])
+        ->getTerminator()
+        ->replaceUsesOfWith(NHeader, backedge);
+
+    B.SetInsertPoint(backedge);
+    if (kind == IterationKind::Last) {
+      B.CreateUnreachable();
+    } else {
+      for (unsigned i = 0; i < phis.size(); i++) {
+        Value *next = MapValue(phis[i]->getIncomingValueForBlock(latch), VMap);
+        B.CreateStore(next, B.CreateStructGEP(StateTy, st, i));
+      }
+      if (kind == IterationKind::Step)
+        B.CreateRetVoid();
+      else
+        B.CreateRet(ConstantInt::getTrue(ctx));
+    }
+
+    if (kind == IterationKind::Step) {
+      B.SetInsertPoint(NExit);
+      B.CreateUnreachable();
+    } else if (kind == IterationKind::Continue) {
+      B.SetInsertPoint(NExit);
+      B.CreateRet(ConstantInt::getFalse(ctx));
+    }
+    return NF;
+  }
+};
+} // namespace
+
+/// Type information for a cloned iteration, whose first argument points to
+/// the loop state and the remainder are those of the outlined loop.
+static FnTypeInfo getIterationTypeInfo(Function *NF, const OutlinedLoop &loop,
+                                       const FnTypeInfo &outer,
+                                       TypeAnalysis &TA) {
+  const DataLayout &DL = NF->getParent()->getDataLayout();
+  FnTypeInfo typeInfo(NF);
+
+  TypeTree state;
+  std::function<void(Type *, int)> addType = [&](Type *T, int off) {
+    if (auto ST = dyn_cast<StructType>(T)) {
+      auto SL = DL.getStructLayout(ST);
+      for (unsigned i = 0; i < ST->getNumElements(); i++)
+        addType(ST->getElementType(i), off + SL->getElementOffset(i));
+      return;
+    }
+    if (auto AT = dyn_cast<ArrayType>(T)) {
+      int eltSize = DL.getTypeAllocSize(AT->getElementType());
+      for (unsigned i = 0; i < AT->getNumElements(); i++)
+        addType(AT->getElementType(), off + (int)i * eltSize);
+      return;
+    }
+    Type *ST = T->getScalarType();
+    int eltSize = DL.getTypeStoreSize(ST);
+    unsigned count = 1;
+#if LLVM_VERSION_MAJOR >= 11
+    if (auto VT = dyn_cast<FixedVectorType>(T))
+#else
+    if (auto VT = dyn_cast<VectorType>(T))
+#endif
+      count = VT->getNumElements();
+    for (unsigned j = 0; j < count; j++) {
+      if (ST->isFloatingPointTy())
+        state.insert({off + (int)j * eltSize}, ConcreteType(ST));
+      else
+        for (int k = 0; k < eltSize; k++)
+          state.insert({off + (int)j * eltSize + k},
+                       ConcreteType(BaseType::Integer));
+    }
+  };
+  addType(loop.StateTy, 0);
+  state.insert({}, BaseType::Pointer);
+
+  auto arg = NF->arg_begin();
+  typeInfo.Arguments.insert(std::make_pair(&*arg, state.Only(-1)));
+  typeInfo.KnownValues.insert(
+      std::make_pair(&*arg, std::set<int64_t>()));
+  ++arg;
+  for (auto &oarg : loop.F->args()) {
+    auto foundT = outer.Arguments.find(&oarg);
+    typeInfo.Arguments.insert(std::make_pair(
+        &*arg, foundT == outer.Arguments.end() ? TypeTree() : foundT->second));
+    auto foundV = outer.KnownValues.find(&oarg);
+    typeInfo.KnownValues.insert(std::make_pair(
+        &*arg, foundV == outer.KnownValues.end() ? std::set<int64_t>()
+                                                 : foundV->second));
+    ++arg;
+  }
+  if (!NF->getReturnType()->isVoidTy() && !NF->getReturnType()->isIntegerTy(1))
+    typeInfo.Return = outer.Return;
+  return TA.analyzeFunction(typeInfo).getAnalyzedTypeInfo();
+}
+
+/// Add the derivatives returned by the combined derivative of an iteration
+/// to the accumulators in \p acc.
+static void accumulateAdjoint(IRBuilder<> &B, Value *res, StructType *AccTy,
+                              Value *acc, unsigned offset = 0) {
+  for (unsigned i = 0; i < AccTy->getNumElements(); i++) {
+    Type *T = AccTy->getElementType(i);
+    Value *ptr = B.CreateStructGEP(AccTy, acc, i);
+    Value *prev = B.CreateLoad(T, ptr);
+    B.CreateStore(B.CreateFAdd(prev, B.CreateExtractValue(res, {i + offset})),
+                  ptr);
+  }
+}
+
+Function *createCheckpointedGradient(EnzymeLogic &Logic,
+                                     const ReverseCacheKey &key,
+                                     TypeAnalysis &TA) {
+  if (key.mode != DerivativeMode::ReverseModeCombined || key.width != 1 ||
+      key.shadowReturnUsed || key.additionalType)
+    return nullptr;
+  for (auto ty : key.constant_args)
+    if (ty == DIFFE_TYPE::DUP_ARG || ty == DIFFE_TYPE::DUP_NONEED)
+      return nullptr;
+
+  OutlinedLoop loop;
+  if (!loop.analyze(key.todiff))
+    return nullptr;
+
+  Function *CF = key.todiff;
+  Module &M = *CF->getParent();
+  LLVMContext &ctx = CF->getContext();
+  Type *I64 = Type::getInt64Ty(ctx);
+  StructType *StateTy = loop.StateTy;
+  Type *StatePtrTy = PointerType::getUnqual(StateTy);
+
+  SmallVector<Type *, 4> accTys;
+  for (auto &arg : CF->args())
+    if (key.constant_args[arg.getArgNo()] == DIFFE_TYPE::OUT_DIFF)
+      accTys.push_back(arg.getType());
+  StructType *AccTy = StructType::get(ctx, accTys);
+  Type *AccPtrTy = PointerType::getUnqual(AccTy);
+
+  bool diffeReturnArg = key.retType == DIFFE_TYPE::OUT_DIFF;
+  FunctionType *FTy = getFunctionTypeForClone(
+      CF->getFunctionType(), key.mode, key.width, nullptr, key.constant_args,
+      diffeReturnArg,
+      key.returnUsed ? ReturnType::ArgsWithReturn : ReturnType::Args,
+      key.retType);
+  Function *NewF = Function::Create(FTy, GlobalValue::InternalLinkage,
+                                    "diffe" + CF->getName(), &M);
+
+  SmallVector<Value *, 4> inputs;
+  auto newArg = NewF->arg_begin();
+  for (auto &arg : CF->args()) {
+    newArg->setName(arg.getName());
+    inputs.push_back(&*newArg);
+    ++newArg;
+  }
+  Value *dret = nullptr;
+  if (diffeReturnArg) {
+    dret = &*newArg;
+    dret->setName("differeturn");
+  }
+
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", NewF);
+  IRBuilder<> B(entry);
+
+  ValueToValueMapTy adjMap;
+  auto finish = [&](Value *primal, Value *acc, Value *adj) {
+    SmallVector<Value *, 4> rets;
+    if (key.returnUsed)
+      rets.push_back(primal);
+    unsigned accIdx = 0;
+    for (auto &arg : CF->args()) {
+      if (key.constant_args[arg.getArgNo()] != DIFFE_TYPE::OUT_DIFF)
+        continue;
+      Value *d = Constant::getNullValue(arg.getType());
+      if (acc) {
+        d = B.CreateLoad(arg.getType(), B.CreateStructGEP(AccTy, acc, accIdx));
+        // Derivatives flowing into the initial state of the loop.
+        for (unsigned i = 0; i < loop.phis.size(); i++) {
+          if (loop.phis[i]->getIncomingValueForBlock(&CF->getEntryBlock()) !=
+              &arg)
+            continue;
+          d = B.CreateFAdd(d, B.CreateLoad(arg.getType(),
+                                           B.CreateStructGEP(StateTy, adj, i)));
+        }
+        // Derivatives flowing into the initial elements of the stack arrays.
+        for (Instruction &I : CF->getEntryBlock()) {
+          auto SI = dyn_cast<StoreInst>(&I);
+          if (!SI || SI->getValueOperand() != &arg)
+            continue;
+          d = B.CreateFAdd(d, B.CreateLoad(arg.getType(),
+                                           adjMap[SI->getPointerOperand()]));
+        }
+      }
+      rets.push_back(d);
+      accIdx++;
+    }
+    if (FTy->getReturnType()->isVoidTy()) {
+      B.CreateRetVoid();
+      return;
+    }
+    Value *agg = UndefValue::get(FTy->getReturnType());
+    for (unsigned i = 0; i < rets.size(); i++)
+      agg = B.CreateInsertValue(agg, rets[i], {i});
+    B.CreateRet(agg);
+  };
+
+  // Without a differential return there is nothing to propagate.
+  if (key.retType == DIFFE_TYPE::CONSTANT) {
+    Value *primal = nullptr;
+    if (key.returnUsed)
+      primal = B.CreateCall(CF, inputs);
+    finish(primal, nullptr, nullptr);
+    return NewF;
+  }
+
+  Function *step = loop.cloneIteration(IterationKind::Step);
+  Function *cont = loop.cloneIteration(IterationKind::Continue);
+  Function *last = loop.cloneIteration(IterationKind::Last);
+
+  std::vector<DIFFE_TYPE> iterArgs = {DIFFE_TYPE::DUP_ARG};
+  iterArgs.insert(iterArgs.end(), key.constant_args.begin(),
+                  key.constant_args.end());
+  auto getDerivative = [&](Function *iter, DIFFE_TYPE retType) {
+    std::map<Argument *, bool> uncacheable_args;
+    for (auto &arg : iter->args())
+      uncacheable_args[&arg] = false;
+    return Logic.CreatePrimalAndGradient(
+        (ReverseCacheKey){.todiff = iter,
+                          .retType = retType,
+                          .constant_args = iterArgs,
+                          .uncacheable_args = uncacheable_args,
+                          .returnUsed = false,
+                          .shadowReturnUsed = false,
+                          .mode = DerivativeMode::ReverseModeCombined,
+                          .width = 1,
+                          .freeMemory = true,
+                          .AtomicAdd = key.AtomicAdd,
+                          .additionalType = nullptr,
+                          .typeInfo = getIterationTypeInfo(iter, loop,
+                                                           key.typeInfo, TA)},
+        TA, /*augmenteddata*/ nullptr);
+  };
+  Function *dstep = getDerivative(step, DIFFE_TYPE::CONSTANT);
+  Function *dlast = getDerivative(last, key.retType);
+
+  // advance(state, count, inputs...) runs count iterations from state.
+  Function *advance;
+  {
+    SmallVector<Type *, 4> params = {StatePtrTy, I64};
+    for (auto &arg : CF->args())
+      params.push_back(arg.getType());
+    advance = Function::Create(
+        FunctionType::get(Type::getVoidTy(ctx), params, false),
+        GlobalValue::InternalLinkage, "checkpointadvance_" + CF->getName(), &M);
+    auto arg = advance->arg_begin();
+    Argument *st = &*arg++;
+    Argument *count = &*arg++;
+    st->setName("state");
+    count->setName("count");
+    SmallVector<Value *, 4> args = {st};
+    for (; arg != advance->arg_end(); ++arg)
+      args.push_back(&*arg);
+
+    BasicBlock *aentry = BasicBlock::Create(ctx, "entry", advance);
+    BasicBlock *aloop = BasicBlock::Create(ctx, "loop", advance);
+    BasicBlock *abody = BasicBlock::Create(ctx, "body", advance);
+    BasicBlock *aexit = BasicBlock::Create(ctx, "exit", advance);
+    IRBuilder<> AB(aentry);
+    AB.CreateBr(aloop);
+    AB.SetInsertPoint(aloop);
+    auto iv = AB.CreatePHI(I64, 2, "iv");
+    iv->addIncoming(ConstantInt::get(I64, 0), aentry);
+    AB.CreateCondBr(AB.CreateICmpULT(iv, count), abody, aexit);
+    AB.SetInsertPoint(abody);
+    AB.CreateCall(step, args);
+    iv->addIncoming(AB.CreateAdd(iv, ConstantInt::get(I64, 1)), abody);
+    AB.CreateBr(aloop);
+    AB.SetInsertPoint(aexit);
+    AB.CreateRetVoid();
+  }
+
+  // revolve(a, b, s, state, adjoint, acc, inputs...) reverses iterations
+  // [a, b) given the state at a and s free snapshots, turning the adjoint of
+  // the state at b into that of the state at a.
+  Function *revolve;
+  {
+    SmallVector<Type *, 4> params = {I64,        I64,      I64,
+                                     StatePtrTy, StatePtrTy, AccPtrTy};
+    for (auto &arg : CF->args())
+      params.push_back(arg.getType());
+    revolve = Function::Create(
+        FunctionType::get(Type::getVoidTy(ctx), params, false),
+        GlobalValue::InternalLinkage, "revolve_" + CF->getName(), &M);
+    auto arg = revolve->arg_begin();
+    Argument *a = &*arg++;
+    Argument *b = &*arg++;
+    Argument *s = &*arg++;
+    Argument *st = &*arg++;
+    Argument *adj = &*arg++;
+    Argument *acc = &*arg++;
+    a->setName("begin");
+    b->setName("end");
+    s->setName("snapshots");
+    st->setName("state");
+    adj->setName("adjoint");
+    acc->setName("acc");
+    SmallVector<Value *, 4> rinputs;
+    for (; arg != revolve->arg_end(); ++arg)
+      rinputs.push_back(&*arg);
+
+    BasicBlock *rentry = BasicBlock::Create(ctx, "entry", revolve);
+    BasicBlock *rnonempty = BasicBlock::Create(ctx, "nonempty", revolve);
+    BasicBlock *rsingle = BasicBlock::Create(ctx, "single", revolve);
+    BasicBlock *rmulti = BasicBlock::Create(ctx, "multi", revolve);
+    BasicBlock *rnosnap = BasicBlock::Create(ctx, "nosnapshot", revolve);
+    BasicBlock *rsearch = BasicBlock::Create(ctx, "search", revolve);
+    BasicBlock *rsearchinc = BasicBlock::Create(ctx, "search.inc", revolve);
+    BasicBlock *rsplit = BasicBlock::Create(ctx, "split", revolve);
+    BasicBlock *rexit = BasicBlock::Create(ctx, "exit", revolve);
+
+    IRBuilder<> RB(rentry);
+    auto tmp = RB.CreateAlloca(StateTy, nullptr, "snapshot");
+    auto len = RB.CreateSub(b, a, "len");
+    RB.CreateCondBr(RB.CreateICmpEQ(len, ConstantInt::get(I64, 0)), rexit,
+                    rnonempty);
+
+    RB.SetInsertPoint(rnonempty);
+    RB.CreateCondBr(RB.CreateICmpEQ(len, ConstantInt::get(I64, 1)), rsingle,
+                    rmulti);
+
+    auto copyState = [&](Value *from) {
+      RB.CreateStore(RB.CreateLoad(StateTy, from), tmp);
+    };
+    auto reverseStep = [&]() {
+      SmallVector<Value *, 4> args = {tmp, adj};
+      args.append(rinputs.begin(), rinputs.end());
+      auto res = RB.CreateCall(dstep, args);
+      if (AccTy->getNumElements())
+        accumulateAdjoint(RB, res, AccTy, acc);
+    };
+    auto advanceTo = [&](Value *count) {
+      SmallVector<Value *, 4> args = {tmp, count};
+      args.append(rinputs.begin(), rinputs.end());
+      RB.CreateCall(advance, args);
+    };
+
+    // A single iteration is reversed directly.
+    RB.SetInsertPoint(rsingle);
+    copyState(st);
+    reverseStep();
+    RB.CreateBr(rexit);
+
+    RB.SetInsertPoint(rmulti);
+    Value *lastIter = RB.CreateSub(len, ConstantInt::get(I64, 1));
+    RB.CreateCondBr(RB.CreateICmpEQ(s, ConstantInt::get(I64, 0)), rnosnap,
+                    rsearch);
+
+    // Without snapshots every iteration is recomputed from the start.
+    RB.SetInsertPoint(rnosnap);
+    {
+      auto j = RB.CreatePHI(I64, 2, "j");
+      j->addIncoming(lastIter, rmulti);
+      copyState(st);
+      advanceTo(j);
+      reverseStep();
+      auto jnext = RB.CreateSub(j, ConstantInt::get(I64, 1));
+      j->addIncoming(jnext, rnosnap);
+      RB.CreateCondBr(RB.CreateICmpEQ(j, ConstantInt::get(I64, 0)), rexit,
+                      rnosnap);
+    }
+
+    // Find the smallest t with beta(s, t) = binomial(s + t, s) >= len.
+    RB.SetInsertPoint(rsearch);
+    auto t = RB.CreatePHI(I64, 2, "t");
+    auto beta = RB.CreatePHI(I64, 2, "beta");
+    t->addIncoming(ConstantInt::get(I64, 0), rmulti);
+    beta->addIncoming(ConstantInt::get(I64, 1), rmulti);
+    RB.CreateCondBr(RB.CreateICmpULT(beta, len), rsearchinc, rsplit);
+
+    RB.SetInsertPoint(rsearchinc);
+    auto tnext = RB.CreateAdd(t, ConstantInt::get(I64, 1));
+    auto betanext =
+        RB.CreateUDiv(RB.CreateMul(beta, RB.CreateAdd(s, tnext)), tnext);
+    t->addIncoming(tnext, rsearchinc);
+    beta->addIncoming(betanext, rsearchinc);
+    RB.CreateBr(rsearch);
+
+    // The last beta(s - 1, t) iterations can be reversed with one snapshot
+    // less, so advance to the first of them and store a snapshot there.
+    RB.SetInsertPoint(rsplit);
+    Value *right =
+        RB.CreateUDiv(RB.CreateMul(beta, s), RB.CreateAdd(s, t), "right");
+    right = RB.CreateSelect(RB.CreateICmpULT(right, lastIter), right, lastIter);
+    Value *mid = RB.CreateSub(b, right, "mid");
+    copyState(st);
+    advanceTo(RB.CreateSub(mid, a));
+    {
+      SmallVector<Value *, 4> args = {
+          mid, b, RB.CreateSub(s, ConstantInt::get(I64, 1)), tmp, adj, acc};
+      args.append(rinputs.begin(), rinputs.end());
+      RB.CreateCall(revolve, args);
+    }
+    {
+      SmallVector<Value *, 4> args = {a, mid, s, st, adj, acc};
+      args.append(rinputs.begin(), rinputs.end());
+      RB.CreateCall(revolve, args);
+    }
+    RB.CreateBr(rexit);
+
+    RB.SetInsertPoint(rexit);
+    RB.CreateRetVoid();
+  }
+
+  // The gradient itself counts the iterations, reverses the final one, and
+  // reverses the remainder by revolve from the initial state.
+  auto init = B.CreateAlloca(StateTy, nullptr, "initial");
+  auto cur = B.CreateAlloca(StateTy, nullptr, "current");
+  auto adj = B.CreateAlloca(StateTy, nullptr, "adjoint");
+  auto acc = B.CreateAlloca(AccTy, nullptr, "acc");
+  for (unsigned i = 0; i < loop.phis.size(); i++) {
+    Value *V = loop.phis[i]->getIncomingValueForBlock(&CF->getEntryBlock());
+    if (auto arg = dyn_cast<Argument>(V))
+      V = inputs[arg->getArgNo()];
+    B.CreateStore(V, B.CreateStructGEP(StateTy, init, i));
+  }
+  {
+    ValueToValueMapTy initMap;
+    loop.mapMemory(B, init, initMap);
+    for (Instruction &I : CF->getEntryBlock())
+      if (auto SI = dyn_cast<StoreInst>(&I))
+        B.CreateStore(inputs[cast<Argument>(SI->getValueOperand())->getArgNo()],
+                      initMap[SI->getPointerOperand()]);
+    loop.mapMemory(B, adj, adjMap);
+  }
+  // Iterations write the stack arrays before deciding whether to exit, so
+  // counting them keeps the state before the latest one to restore.
+  AllocaInst *prev = nullptr;
+  if (loop.allocas.size())
+    prev = B.CreateAlloca(StateTy, nullptr, "previous");
+  B.CreateStore(B.CreateLoad(StateTy, init), cur);
+  B.CreateStore(Constant::getNullValue(StateTy), adj);
+  B.CreateStore(Constant::getNullValue(AccTy), acc);
+
+  BasicBlock *count = BasicBlock::Create(ctx, "count", NewF);
+  BasicBlock *counted = BasicBlock::Create(ctx, "counted", NewF);
+  B.CreateBr(count);
+  B.SetInsertPoint(count);
+  auto n = B.CreatePHI(I64, 2, "iters");
+  n->addIncoming(ConstantInt::get(I64, 0), entry);
+  if (prev)
+    B.CreateStore(B.CreateLoad(StateTy, cur), prev);
+  {
+    SmallVector<Value *, 4> args = {cur};
+    args.append(inputs.begin(), inputs.end());
+    auto again = B.CreateCall(cont, args);
+    n->addIncoming(B.CreateAdd(n, ConstantInt::get(I64, 1)), count);
+    B.CreateCondBr(again, count, counted);
+  }
+
+  B.SetInsertPoint(counted);
+  if (prev)
+    B.CreateStore(B.CreateLoad(StateTy, prev), cur);
+  Value *primal = nullptr;
+  {
+    SmallVector<Value *, 4> args = {cur};
+    args.append(inputs.begin(), inputs.end());
+    if (key.returnUsed) {
+      // The final iteration may update the state its derivative starts from.
+      if (prev)
+        args[0] = prev;
+      primal = B.CreateCall(last, args);
+      args[0] = cur;
+    }
+    args.insert(args.begin() + 1, adj);
+    args.push_back(dret);
+    auto res = B.CreateCall(dlast, args);
+    if (AccTy->getNumElements())
+      accumulateAdjoint(B, res, AccTy, acc);
+  }
+
+  Value *snapshots = nullptr;
+  unsigned fixed = 0;
+  CF->getFnAttribute(CheckpointAttr).getValueAsString().getAsInteger(10,
+                                                                     fixed);
+  if (fixed) {
+    snapshots = ConstantInt::get(I64, fixed);
+  } else {
+    // Default to the bit width of the trip count, for logarithmic memory.
+    auto ctlz = Intrinsic::getDeclaration(&M, Intrinsic::ctlz, {I64});
+    snapshots = B.CreateSub(
+        ConstantInt::get(I64, 64),
+        B.CreateCall(ctlz, {n, ConstantInt::getFalse(ctx)}), "snapshots");
+  }
+  {
+    SmallVector<Value *, 4> args = {ConstantInt::get(I64, 0), n, snapshots,
+                                    init, adj, acc};
+    args.append(inputs.begin(), inputs.end());
+    B.CreateCall(revolve, args);
+  }
+  finish(primal, acc, adj);
+  return NewF;
+}
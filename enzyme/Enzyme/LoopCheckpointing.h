@@ -0,0 +1,59 @@
+//===- LoopCheckpointing.h - Binomial checkpointing of outermost loops  ---===//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+// If using this code in an academic setting, please cite the following:
+// @incollection{enzymeNeurips,
+// title = {Instead of Rewriting Foreign Code for Machine Learning,
+//          Automatically Synthesize Fast Gradients},
+// author = {Moses, William S. and Churavy, Valentin},
+// booktitle = {Advances in Neural Information Processing Systems 33},
+// year = {2020},
+// note = {To appear in},
+// }
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares an opt-in checkpointing strategy for outermost loops.
+// Rather than caching every iteration, a checkpointed loop is outlined into
+// its own function whose reverse pass only keeps state snapshots at the
+// iterations chosen by the binomial (revolve) schedule, recomputing the
+// iterations in between.
+//
+//===----------------------------------------------------------------------===//
+#ifndef ENZYME_LOOP_CHECKPOINTING_H
+#define ENZYME_LOOP_CHECKPOINTING_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "EnzymeLogic.h"
+
+extern "C" {
+/// Checkpoint all eligible outermost loops, not just annotated ones
+extern llvm::cl::opt<bool> EnzymeLoopCheckpoint;
+/// Number of snapshots available to the revolve schedule
+extern llvm::cl::opt<unsigned> EnzymeLoopCheckpointSnapshots;
+}
+
+/// Outline the outermost loops of \p NewF which should be checkpointed,
+/// either by flag or by an enzyme.checkpoint loop annotation, into separate
+/// functions whose derivative is created by createCheckpointedGradient.
+/// Returns whether any loop was outlined. \p Orig is the function \p NewF was
+/// cloned from and is used for naming.
+bool outlineCheckpointedLoops(llvm::Function *NewF, llvm::Function *Orig,
+                              llvm::FunctionAnalysisManager &FAM);
+
+/// Create the combined derivative of a loop outlined by
+/// outlineCheckpointedLoops, or return nullptr if this derivative cannot be
+/// checkpointed and must be generated as usual.
+llvm::Function *createCheckpointedGradient(EnzymeLogic &Logic,
+                                           const ReverseCacheKey &key,
+                                           TypeAnalysis &TA);
+
+#endif
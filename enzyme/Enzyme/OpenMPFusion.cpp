@@ -0,0 +1,637 @@
+//===- OpenMPFusion.cpp - Fuse consecutive reverse OpenMP regions --------===//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+// If using this code in an academic setting, please cite the following:
+// @incollection{enzymeNeurips,
+// title = {Instead of Rewriting Foreign Code for Machine Learning,
+//          Automatically Synthesize Fast Gradients},
+// author = {Moses, William S. and Churavy, Valentin},
+// booktitle = {Advances in Neural Information Processing Systems 33},
+// year = {2020},
+// note = {To appear in},
+// }
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the fusion of the reverse of consecutive OpenMP
+// parallel regions.
+//
+// Every differentiated __kmpc_fork_call forks a parallel region in the
+// reverse pass running the reverse of its outlined body. When a function
+// forks several regions in a row, such as one per stage of a computation,
+// the reverse pass forks and joins the team once per region. Instead, the
+// reverse of a region forked directly after the reverse of another, with
+// nothing but the setup of its own arguments in between, is fused with it.
+// The fused region runs the first reverse body, a barrier so that every
+// adjoint it accumulated is visible to the team, and then the second body.
+// The arguments of both bodies are passed to the fused region, so the setup
+// of the second region is simply run before the fused region starts, while
+// the code finishing the first region, which frees its tape and accumulates
+// the adjoints it returns, runs once the fused region ends.
+//
+// A reverse loop forking a region on every iteration, such as the reverse of
+// a time loop around a parallel-for, is run by one team instead. Every thread
+// runs the loop, calls the reverse body in each iteration and waits at a
+// barrier before the next one. This requires the rest of the loop to be safe
+// to run redundantly on each thread: it may only compute values, load from
+// the cache of the forward pass, and store to stack slots private to the
+// loop, of which each thread gets its own copy. Frees of the per-iteration
+// tapes run on the master thread once the barrier has passed.
+//
+// Both rely on each thread of the team running the reverse of the work it
+// ran in the forward pass. The values a region body caches for its reverse
+// are thus kept in stacks local to each thread rather than in allocations
+// shared by the team and indexed by the thread number. Every call of the
+// forward body reserves a slot on the stack of the thread running it, and
+// every call of the reverse body releases the slot most recently reserved,
+// such that a reverse loop over the regions forked by a forward loop finds
+// the slots of each iteration in turn. The buffer of a stack is kept by its
+// thread for the next calls rather than freed.
+//
+//===----------------------------------------------------------------------===//
+#include "OpenMPFusion.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+
+using namespace llvm;
+
+extern "C" {
+llvm::cl::opt<bool> EnzymeOMPFuseReverse(
+    "enzyme-omp-fuse-reverse", cl::init(false), cl::Hidden,
+    cl::desc("Fuse the reverse of consecutive OpenMP parallel regions, and "
+             "of regions forked in every iteration of a loop, into one "
+             "parallel region separated by barriers. Requires every parallel "
+             "region to run the thread of a given number on the same system "
+             "thread, as the tapes of regions are kept in thread-local "
+             "stacks."));
+}
+
+/// Fields of a thread-local tape stack
+enum OMPTapeStackField {
+  /// Buffer holding the slots
+  OMPTapeBuffer = 0,
+  /// Bytes of the buffer in use
+  OMPTapeUsed = 1,
+  /// Size in bytes of the buffer
+  OMPTapeCapacity = 2,
+};
+
+/// Smallest buffer a tape stack will allocate
+static const uint64_t OMPTapeMinCapacity = 256;
+
+GlobalVariable *createOMPTapeStack(Function &F, Type *T, const Twine &Name) {
+  auto &Ctx = F.getContext();
+  auto I64 = Type::getInt64Ty(Ctx);
+  Type *Elems[] = {PointerType::getUnqual(T), I64, I64};
+  auto ST = StructType::get(Ctx, ArrayRef<Type *>(Elems));
+  return new GlobalVariable(*F.getParent(), ST, /*isConstant*/ false,
+                            GlobalValue::InternalLinkage,
+                            Constant::getNullValue(ST), Name, nullptr,
+                            GlobalValue::GeneralDynamicTLSModel);
+}
+
+/// The untyped tape stack the helpers operate on
+static StructType *getOMPTapeStackType(LLVMContext &Ctx) {
+  auto I64 = Type::getInt64Ty(Ctx);
+  Type *Elems[] = {Type::getInt8PtrTy(Ctx), I64, I64};
+  return StructType::get(Ctx, ArrayRef<Type *>(Elems));
+}
+
+/// Return the helper reserving \p size bytes on a tape stack, growing its
+/// buffer as needed
+static Function *getOrInsertOMPTapePush(Module &M) {
+  auto &Ctx = M.getContext();
+  auto I64 = Type::getInt64Ty(Ctx);
+  auto I8P = Type::getInt8PtrTy(Ctx);
+  auto ST = getOMPTapeStackType(Ctx);
+  Type *Params[] = {PointerType::getUnqual(ST), I64};
+  FunctionType *FT = FunctionType::get(I8P, Params, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(
+      M.getOrInsertFunction("__enzyme_omp_tape_push", FT).getCallee());
+#else
+  Function *F =
+      cast<Function>(M.getOrInsertFunction("__enzyme_omp_tape_push", FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+  BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", F);
+  BasicBlock *Grow = BasicBlock::Create(Ctx, "grow", F);
+  BasicBlock *Bump = BasicBlock::Create(Ctx, "bump", F);
+
+  auto Stack = F->arg_begin();
+  Stack->setName("stack");
+  Value *Size = F->arg_begin() + 1;
+  Size->setName("size");
+
+  IRBuilder<> B(Entry);
+  auto field = [&](OMPTapeStackField i) {
+    return B.CreateStructGEP(ST, Stack, i);
+  };
+  Value *Buffer = B.CreateLoad(I8P, field(OMPTapeBuffer), "buffer");
+  Value *Used = B.CreateLoad(I64, field(OMPTapeUsed), "used");
+  Value *Capacity = B.CreateLoad(I64, field(OMPTapeCapacity), "capacity");
+  Value *Next = B.CreateAdd(Used, Size, "next");
+  B.CreateCondBr(B.CreateICmpULE(Next, Capacity), Bump, Grow);
+
+  B.SetInsertPoint(Grow);
+  auto umax = [&](Value *a, Value *b) {
+    return B.CreateSelect(B.CreateICmpUGT(a, b), a, b);
+  };
+  Value *NewCapacity =
+      umax(umax(B.CreateShl(Capacity, 1), Next),
+           ConstantInt::get(I64, OMPTapeMinCapacity));
+  auto ReallocF = M.getOrInsertFunction("realloc", I8P, I8P, I64);
+  Value *NewBuffer = B.CreateCall(ReallocF, {Buffer, NewCapacity}, "grown");
+  B.CreateStore(NewBuffer, field(OMPTapeBuffer));
+  B.CreateStore(NewCapacity, field(OMPTapeCapacity));
+  B.CreateBr(Bump);
+
+  B.SetInsertPoint(Bump);
+  auto Base = B.CreatePHI(I8P, 2);
+  Base->addIncoming(Buffer, Entry);
+  Base->addIncoming(NewBuffer, Grow);
+  B.CreateStore(Next, field(OMPTapeUsed));
+  B.CreateRet(B.CreateInBoundsGEP(Type::getInt8Ty(Ctx), Base, Used));
+  return F;
+}
+
+/// Return the helper releasing the last \p size bytes of a tape stack
+static Function *getOrInsertOMPTapePop(Module &M) {
+  auto &Ctx = M.getContext();
+  auto I64 = Type::getInt64Ty(Ctx);
+  auto I8P = Type::getInt8PtrTy(Ctx);
+  auto ST = getOMPTapeStackType(Ctx);
+  Type *Params[] = {PointerType::getUnqual(ST), I64};
+  FunctionType *FT = FunctionType::get(I8P, Params, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(
+      M.getOrInsertFunction("__enzyme_omp_tape_pop", FT).getCallee());
+#else
+  Function *F =
+      cast<Function>(M.getOrInsertFunction("__enzyme_omp_tape_pop", FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+  auto Stack = F->arg_begin();
+  Stack->setName("stack");
+  Value *Size = F->arg_begin() + 1;
+  Size->setName("size");
+
+  IRBuilder<> B(BasicBlock::Create(Ctx, "entry", F));
+  Value *Buffer =
+      B.CreateLoad(I8P, B.CreateStructGEP(ST, Stack, OMPTapeBuffer), "buffer");
+  Value *UsedPtr = B.CreateStructGEP(ST, Stack, OMPTapeUsed);
+  Value *Used = B.CreateSub(B.CreateLoad(I64, UsedPtr), Size, "used");
+  B.CreateStore(Used, UsedPtr);
+  B.CreateRet(B.CreateInBoundsGEP(Type::getInt8Ty(Ctx), Buffer, Used));
+  return F;
+}
+
+/// Call \p Helper on the tape stack \p Stack, returning the slot it yields
+static Value *CreateOMPTapeCall(IRBuilder<> &B, Function *Helper,
+                                GlobalVariable *Stack) {
+  auto &DL = Stack->getParent()->getDataLayout();
+  auto ST = cast<StructType>(Stack->getValueType());
+  Type *T = ST->getElementType(OMPTapeBuffer)->getPointerElementType();
+  Value *Args[] = {
+      B.CreatePointerCast(Stack, Helper->getFunctionType()->getParamType(0)),
+      ConstantInt::get(Type::getInt64Ty(Stack->getContext()),
+                       DL.getTypeAllocSize(T))};
+  Value *Slot = B.CreateCall(Helper, Args);
+  return B.CreatePointerCast(Slot, PointerType::getUnqual(T),
+                             Stack->getName() + "_slot");
+}
+
+Value *CreateOMPTapePush(IRBuilder<> &B, GlobalVariable *Stack) {
+  return CreateOMPTapeCall(B, getOrInsertOMPTapePush(*Stack->getParent()),
+                           Stack);
+}
+
+Value *CreateOMPTapePop(IRBuilder<> &B, GlobalVariable *Stack) {
+  return CreateOMPTapeCall(B, getOrInsertOMPTapePop(*Stack->getParent()),
+                           Stack);
+}
+
+/// The outlined body forked by the __kmpc_fork_call \p Fork
+static Function *getForkedBody(CallInst *Fork) {
+  return dyn_cast<Function>(Fork->getArgOperand(2)->stripPointerCasts());
+}
+
+/// Whether \p I forks a parallel region
+static bool isForkCall(const Instruction &I) {
+  if (auto CI = dyn_cast<CallInst>(&I))
+    if (auto F = CI->getCalledFunction())
+      return F->getName() == "__kmpc_fork_call";
+  return false;
+}
+
+/// Whether the outlined body forked by \p Fork can be called directly with
+/// the arguments of the fork
+static bool isDirectlyCallable(CallInst *Fork) {
+  Function *Body = getForkedBody(Fork);
+  if (!Body)
+    return false;
+  FunctionType *FT = Body->getFunctionType();
+  if (FT->isVarArg() || FT->getNumParams() + 1 != Fork->arg_size())
+    return false;
+  for (unsigned j = 3; j < Fork->arg_size(); j++)
+    if (Fork->getArgOperand(j)->getType() != FT->getParamType(j - 1))
+      return false;
+  return true;
+}
+
+/// The location given to a barrier in a region forked at \p Ident, which is
+/// only passed on if it is a constant, as is the case for code emitted by
+/// clang.
+static Value *getBarrierIdent(Value *Ident) {
+  if (!isa<Constant>(Ident))
+    return ConstantPointerNull::get(cast<PointerType>(Ident->getType()));
+  return Ident;
+}
+
+CallInst *fuseOMPForks(CallInst *First, Instruction *FirstEnd,
+                       CallInst *Second) {
+  Function *Bodies[2] = {getForkedBody(First), getForkedBody(Second)};
+  CallInst *Forks[2] = {First, Second};
+  if (!isDirectlyCallable(First) || !isDirectlyCallable(Second))
+    return nullptr;
+
+  // The outlined bodies are passed the global and bound thread ids, followed
+  // by the arguments given to the fork after the body.
+  SmallVector<Type *, 8> Params;
+  SmallVector<Value *, 8> Args;
+  for (int i = 0; i < 2; i++)
+    for (unsigned j = 3; j < Forks[i]->arg_size(); j++)
+      Args.push_back(Forks[i]->getArgOperand(j));
+  Params.push_back(Bodies[0]->getFunctionType()->getParamType(0));
+  Params.push_back(Bodies[0]->getFunctionType()->getParamType(1));
+  for (auto A : Args)
+    Params.push_back(A->getType());
+
+  Module &M = *Second->getModule();
+  LLVMContext &Ctx = M.getContext();
+  auto FT = FunctionType::get(Type::getVoidTy(Ctx), Params, false);
+  Function *F =
+      Function::Create(FT, GlobalVariable::InternalLinkage,
+                       Bodies[0]->getName() + "#fused", M);
+  F->addFnAttr(Attribute::NoUnwind);
+
+  Value *Ident = getBarrierIdent(Second->getArgOperand(0));
+  Type *I32 = Type::getInt32Ty(Ctx);
+  Type *BarrierArgs[] = {Ident->getType(), I32};
+  auto BarrierFn = M.getOrInsertFunction(
+      "__kmpc_barrier",
+      FunctionType::get(Type::getVoidTy(Ctx), BarrierArgs, false));
+
+  IRBuilder<> B(BasicBlock::Create(Ctx, "entry", F));
+  auto FArg = F->arg_begin();
+  Value *GTid = &*FArg++;
+  Value *BTid = &*FArg++;
+  for (int i = 0; i < 2; i++) {
+    if (i == 1) {
+      Value *Tid = B.CreateLoad(I32, GTid, "gtid");
+      B.CreateCall(BarrierFn, {Ident, Tid});
+    }
+    SmallVector<Value *, 8> SubArgs = {GTid, BTid};
+    for (unsigned j = 3; j < Forks[i]->arg_size(); j++)
+      SubArgs.push_back(&*FArg++);
+    auto CI = B.CreateCall(Bodies[i], SubArgs);
+    CI->setCallingConv(Bodies[i]->getCallingConv());
+  }
+  B.CreateRetVoid();
+
+  SmallVector<Value *, 8> ForkArgs = {
+      Second->getArgOperand(0),
+      ConstantInt::get(Second->getArgOperand(1)->getType(), Args.size()),
+      ConstantExpr::getPointerCast(F, Second->getArgOperand(2)->getType())};
+  ForkArgs.append(Args.begin(), Args.end());
+  IRBuilder<> FB(Second);
+  CallInst *Fused = FB.CreateCall(Second->getFunctionType(),
+                                  Second->getCalledFunction(), ForkArgs);
+  Fused->setCallingConv(Second->getCallingConv());
+  Fused->setDebugLoc(Second->getDebugLoc());
+  Second->eraseFromParent();
+
+  SmallVector<Instruction *, 4> Finish;
+  if (FirstEnd != First)
+    for (Instruction *I = First->getNextNode();; I = I->getNextNode()) {
+      Finish.push_back(I);
+      if (I == FirstEnd)
+        break;
+    }
+  Instruction *InsertPt = Fused;
+  for (auto I : Finish) {
+    I->moveAfter(InsertPt);
+    InsertPt = I;
+  }
+  First->eraseFromParent();
+  return Fused;
+}
+
+/// Run the loop \p L, whose only parallel region is forked by \p Fork, in
+/// one team of threads. Returns whether the loop was moved into a parallel
+/// region.
+static bool hoistOMPTeam(Function &F, Loop *L, CallInst *Fork) {
+  BasicBlock *Preheader = L->getLoopPreheader();
+  BasicBlock *Exit = L->getExitBlock();
+  if (!Preheader || !Exit || isa<PHINode>(Exit->begin()) ||
+      !isDirectlyCallable(Fork))
+    return false;
+  if (auto I = dyn_cast<Instruction>(Fork->getArgOperand(0)))
+    if (L->contains(I))
+      return false;
+
+  // Stack slots only accessed within the loop are private to each thread
+  SmallPtrSet<Value *, 4> Private;
+  for (auto &I : F.getEntryBlock()) {
+    auto AI = dyn_cast<AllocaInst>(&I);
+    if (!AI)
+      continue;
+    bool Local = !AI->use_empty();
+    for (auto &U : AI->uses()) {
+      auto UI = dyn_cast<Instruction>(U.getUser());
+      if (!UI || !L->contains(UI) ||
+          !((isa<LoadInst>(UI) && U.getOperandNo() == 0) ||
+            (isa<StoreInst>(UI) && U.getOperandNo() == 1) ||
+            (UI == Fork && U.getOperandNo() >= 3))) {
+        Local = false;
+        break;
+      }
+    }
+    if (Local)
+      Private.insert(AI);
+  }
+
+  // The rest of the loop is run by every thread, except for the frees of
+  // tapes after the region which are left to the master thread.
+  SmallVector<CallInst *, 2> Frees;
+  SetVector<Value *> Inputs;
+  for (BasicBlock *BB : L->blocks()) {
+    bool AfterFork = false;
+    for (auto &I : *BB) {
+      for (User *U : I.users())
+        if (!L->contains(cast<Instruction>(U)))
+          return false;
+      for (Value *Op : I.operands())
+        if ((isa<Argument>(Op) ||
+             (isa<Instruction>(Op) && !L->contains(cast<Instruction>(Op)))) &&
+            !Private.count(Op))
+          Inputs.insert(Op);
+      if (&I == Fork) {
+        AfterFork = true;
+        continue;
+      }
+      if (isa<DbgInfoIntrinsic>(&I) || isa<PHINode>(&I) ||
+          isa<BranchInst>(&I) || isa<SwitchInst>(&I))
+        continue;
+      if (auto LI = dyn_cast<LoadInst>(&I)) {
+        if (LI->isSimple() &&
+            (Private.count(LI->getPointerOperand()) ||
+             LI->hasMetadata(LLVMContext::MD_invariant_group) ||
+             LI->hasMetadata(LLVMContext::MD_invariant_load)))
+          continue;
+        return false;
+      }
+      if (auto SI = dyn_cast<StoreInst>(&I)) {
+        if (SI->isSimple() && Private.count(SI->getPointerOperand()))
+          continue;
+        return false;
+      }
+      if (auto CI = dyn_cast<CallInst>(&I)) {
+        if (auto Callee = CI->getCalledFunction())
+          if (AfterFork && Callee->getName() == "free") {
+            Frees.push_back(CI);
+            continue;
+          }
+      }
+      if (I.mayReadOrWriteMemory() || I.mayHaveSideEffects() ||
+          I.isTerminator())
+        return false;
+    }
+  }
+
+  // Arguments of a parallel region are passed as pointer-sized values
+  Module &M = *F.getParent();
+  LLVMContext &Ctx = M.getContext();
+  auto &DL = M.getDataLayout();
+  Type *IntPtr = DL.getIntPtrType(Ctx);
+  for (Value *In : Inputs) {
+    Type *T = In->getType();
+    if (!T->isPointerTy() &&
+        !(T->isIntegerTy() &&
+          T->getIntegerBitWidth() <= IntPtr->getIntegerBitWidth()) &&
+        !(T->isFloatingPointTy() &&
+          DL.getTypeSizeInBits(T) == DL.getTypeSizeInBits(IntPtr)))
+      return false;
+  }
+
+  Function *Body = getForkedBody(Fork);
+  SmallVector<Type *, 8> Params = {Body->getFunctionType()->getParamType(0),
+                                   Body->getFunctionType()->getParamType(1)};
+  SmallVector<Value *, 8> ForkArgs = {
+      Fork->getArgOperand(0),
+      ConstantInt::get(Fork->getArgOperand(1)->getType(), Inputs.size()),
+      nullptr};
+  IRBuilder<> PB(Preheader->getTerminator());
+  for (Value *In : Inputs) {
+    Type *T = In->getType();
+    if (T->isPointerTy()) {
+      Params.push_back(T);
+      ForkArgs.push_back(In);
+    } else {
+      Params.push_back(IntPtr);
+      ForkArgs.push_back(T->isIntegerTy() ? PB.CreateZExt(In, IntPtr)
+                                          : PB.CreateBitCast(In, IntPtr));
+    }
+  }
+
+  auto FT = FunctionType::get(Type::getVoidTy(Ctx), Params, false);
+  Function *Team = Function::Create(FT, GlobalVariable::InternalLinkage,
+                                    Body->getName() + "#loop", M);
+  Team->addFnAttr(Attribute::NoUnwind);
+  BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", Team);
+  BasicBlock *Ret = BasicBlock::Create(Ctx, "exit", Team);
+  ReturnInst::Create(Ctx, Ret);
+
+  IRBuilder<> EB(Entry);
+  DenseMap<Value *, Value *> VMap;
+  auto TArg = Team->arg_begin();
+  Value *GTid = &*TArg++;
+  Value *BTid = &*TArg++;
+  for (Value *In : Inputs) {
+    Value *A = &*TArg++;
+    Type *T = In->getType();
+    if (T->isIntegerTy())
+      A = EB.CreateTrunc(A, T);
+    else if (!T->isPointerTy())
+      A = EB.CreateBitCast(A, T);
+    VMap[In] = A;
+  }
+  for (Value *V : Private) {
+    auto AI = cast<AllocaInst>(V);
+    auto NA = EB.CreateAlloca(AI->getAllocatedType(), AI->getArraySize());
+    NA->takeName(AI);
+    VMap[AI] = NA;
+  }
+  EB.CreateBr(L->getHeader());
+
+  SmallVector<BasicBlock *, 8> Blocks(L->blocks().begin(), L->blocks().end());
+  for (BasicBlock *BB : Blocks) {
+    BB->removeFromParent();
+    BB->insertInto(Team, Ret);
+  }
+  SmallVector<Instruction *, 4> DbgInsts;
+  for (BasicBlock *BB : Blocks) {
+    for (auto &I : *BB) {
+      if (isa<DbgInfoIntrinsic>(&I)) {
+        DbgInsts.push_back(&I);
+        continue;
+      }
+      I.setDebugLoc(DebugLoc());
+      for (Use &U : I.operands()) {
+        auto found = VMap.find(U.get());
+        if (found != VMap.end())
+          U.set(found->second);
+      }
+      if (auto PN = dyn_cast<PHINode>(&I))
+        for (unsigned i = 0; i < PN->getNumIncomingValues(); i++)
+          if (PN->getIncomingBlock(i) == Preheader)
+            PN->setIncomingBlock(i, Entry);
+    }
+    BB->getTerminator()->replaceSuccessorWith(Exit, Ret);
+  }
+  for (auto I : DbgInsts)
+    I->eraseFromParent();
+  for (Value *AI : Private)
+    cast<Instruction>(AI)->eraseFromParent();
+
+  ForkArgs[2] = ConstantExpr::getPointerCast(
+      Team, Fork->getArgOperand(2)->getType());
+  auto NewFork = PB.CreateCall(Fork->getFunctionType(),
+                               Fork->getCalledFunction(), ForkArgs);
+  NewFork->setCallingConv(Fork->getCallingConv());
+  NewFork->setDebugLoc(Fork->getDebugLoc());
+  PB.CreateBr(Exit);
+  Preheader->getTerminator()->eraseFromParent();
+
+  // Each iteration runs the body on the whole team, and waits for it to
+  // finish before its tape is freed or the next iteration starts
+  Type *I32 = Type::getInt32Ty(Ctx);
+  Value *Ident = getBarrierIdent(Fork->getArgOperand(0));
+  Type *BarrierArgs[] = {Ident->getType(), I32};
+  auto BarrierFn = M.getOrInsertFunction(
+      "__kmpc_barrier",
+      FunctionType::get(Type::getVoidTy(Ctx), BarrierArgs, false));
+  IRBuilder<> B(Fork);
+  SmallVector<Value *, 8> SubArgs = {GTid, BTid};
+  for (unsigned j = 3; j < Fork->arg_size(); j++)
+    SubArgs.push_back(Fork->getArgOperand(j));
+  auto CI = B.CreateCall(Body, SubArgs);
+  CI->setCallingConv(Body->getCallingConv());
+  B.CreateCall(BarrierFn, {Ident, B.CreateLoad(I32, GTid, "gtid")});
+  Fork->eraseFromParent();
+
+  if (Frees.size()) {
+    auto ThreadNumFn = M.getOrInsertFunction("omp_get_thread_num",
+                                             FunctionType::get(I32, {}));
+    IRBuilder<> TB(Entry->getTerminator());
+    Value *IsMaster = TB.CreateICmpEQ(TB.CreateCall(ThreadNumFn, {}),
+                                      ConstantInt::get(I32, 0), "master");
+    for (auto Free : Frees) {
+      auto Then = SplitBlockAndInsertIfThen(IsMaster, Free, false);
+      Then->getParent()->setName("omp.master.free");
+      Free->getParent()->setName("omp.master.end");
+      Free->moveBefore(Then);
+    }
+  }
+  return true;
+}
+
+bool fuseOMPLoops(Function &F) {
+  SmallPtrSet<CallInst *, 4> Done;
+  bool Changed = false;
+  bool Promoted = false;
+  while (true) {
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+
+    SmallVector<std::pair<CallInst *, Loop *>, 2> Candidates;
+    for (auto &BB : F)
+      for (auto &I : BB)
+        if (isForkCall(I) && !Done.count(cast<CallInst>(&I)))
+          if (Loop *L = LI.getLoopFor(&BB))
+            Candidates.emplace_back(cast<CallInst>(&I), L);
+    if (Candidates.empty())
+      return Changed;
+
+    // Reverse induction variables of the loops are kept in stack slots,
+    // which would otherwise be shared by the team. Only the slots used within
+    // those loops are promoted, the rest of the function is left to the
+    // usual cleanup.
+    if (!Promoted) {
+      Promoted = true;
+      SmallVector<AllocaInst *, 4> ToPromote;
+      for (auto &I : F.getEntryBlock()) {
+        auto AI = dyn_cast<AllocaInst>(&I);
+        if (!AI || !isAllocaPromotable(AI))
+          continue;
+        bool InLoops = false;
+        for (auto U : AI->users())
+          for (auto &pair : Candidates)
+            if (pair.second->contains(cast<Instruction>(U)))
+              InLoops = true;
+        if (InLoops)
+          ToPromote.push_back(AI);
+      }
+      if (ToPromote.size()) {
+        PromoteMemToReg(ToPromote, DT);
+        continue;
+      }
+    }
+
+    bool Hoisted = false;
+    for (auto &pair : Candidates) {
+      CallInst *Fork = pair.first;
+      Loop *L = pair.second;
+      Done.insert(Fork);
+      unsigned NumForks = 0;
+      for (BasicBlock *BB : L->blocks())
+        for (auto &I : *BB)
+          NumForks += isForkCall(I);
+      if (NumForks == 1 && hoistOMPTeam(F, L, Fork)) {
+        Changed = Hoisted = true;
+        break;
+      }
+    }
+    if (!Hoisted)
+      return Changed;
+  }
+}
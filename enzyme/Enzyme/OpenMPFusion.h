@@ -0,0 +1,76 @@
+//===- OpenMPFusion.h - Fuse consecutive reverse OpenMP regions ----------===//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+// If using this code in an academic setting, please cite the following:
+// @incollection{enzymeNeurips,
+// title = {Instead of Rewriting Foreign Code for Machine Learning,
+//          Automatically Synthesize Fast Gradients},
+// author = {Moses, William S. and Churavy, Valentin},
+// booktitle = {Advances in Neural Information Processing Systems 33},
+// year = {2020},
+// note = {To appear in},
+// }
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the fusion of the reverse of consecutive OpenMP
+// parallel regions, or of a region forked in every iteration of a loop, into
+// a single parallel region, which runs the reverse bodies in turn separated
+// by barriers.
+//
+//===----------------------------------------------------------------------===//
+#ifndef ENZYME_OPENMP_FUSION_H
+#define ENZYME_OPENMP_FUSION_H
+
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+
+extern "C" {
+/// Fuse the reverse of consecutive or loop-enclosed OpenMP parallel regions,
+/// keeping the tapes of parallel regions in thread-local stacks
+extern llvm::cl::opt<bool> EnzymeOMPFuseReverse;
+}
+
+/// Create the thread-local stack holding values of type \p T cached by the
+/// parallel region body \p F for its reverse
+llvm::GlobalVariable *createOMPTapeStack(llvm::Function &F, llvm::Type *T,
+                                         const llvm::Twine &Name);
+
+/// Reserve the slot of the current call on the thread-local tape stack
+/// \p Stack, returning a pointer to it. The slot stays valid until the next
+/// slot is reserved on the stack by this thread.
+llvm::Value *CreateOMPTapePush(llvm::IRBuilder<> &B,
+                               llvm::GlobalVariable *Stack);
+
+/// Release the slot most recently reserved on the thread-local tape stack
+/// \p Stack, returning a pointer to it. The slot stays valid until the next
+/// slot is reserved on the stack by this thread.
+llvm::Value *CreateOMPTapePop(llvm::IRBuilder<> &B,
+                              llvm::GlobalVariable *Stack);
+
+/// Replace the parallel region \p First, and the region forked by \p Second
+/// after it, with one parallel region running the body of \p First, a
+/// barrier, and then the body of \p Second. The instructions after \p First
+/// up to and including \p FirstEnd finish the first region, and are moved
+/// after the fused region. The new fork is inserted in place of \p Second
+/// and returned, or nullptr if the regions cannot be fused. Both calls are
+/// erased when fused.
+llvm::CallInst *fuseOMPForks(llvm::CallInst *First,
+                             llvm::Instruction *FirstEnd,
+                             llvm::CallInst *Second);
+
+/// Run the loops of \p F which fork a parallel region in every iteration,
+/// and otherwise only compute values, read the cache of the forward pass or
+/// free tapes, in a single parallel region. Every thread runs the loop,
+/// calling the body of the region followed by a barrier in each iteration.
+/// Returns whether \p F was changed.
+bool fuseOMPLoops(llvm::Function &F);
+
+#endif
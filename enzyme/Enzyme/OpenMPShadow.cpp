@@ -0,0 +1,706 @@
+//===- OpenMPShadow.cpp - Thread-private shadows for OpenMP reverse regions ==//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+// If using this code in an academic setting, please cite the following:
+// @incollection{enzymeNeurips,
+// title = {Instead of Rewriting Foreign Code for Machine Learning,
+//          Automatically Synthesize Fast Gradients},
+// author = {Moses, William S. and Churavy, Valentin},
+// booktitle = {Advances in Neural Information Processing Systems 33},
+// year = {2020},
+// note = {To appear in},
+// }
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements thread-private shadows for reverse OpenMP regions.
+//
+// The reverse of an outlined parallel body is generated with atomic adjoint
+// updates, since several threads may accumulate into the same shadow. When
+// many threads read the same primal values, such as shared coefficients, the
+// atomics all contend on the same cache lines. A shadow argument is instead
+// privatized when its only uses are atomic fadds whose offsets scalar
+// evolution bounds, either by a small constant or by an expression of the
+// arguments of the region such as the trip count of a loop. The caller
+// evaluates the bound, and passes a header holding a pointer to the shared
+// shadow and the size of the slots. As the size of the team is only known
+// once the region runs, thread zero then allocates one zeroed slot for each
+// thread of the team, which the other threads find in the header after a
+// barrier. The updates become plain read-modify-writes of the slot of the
+// executing thread, and before returning the team reduces the slots pairwise
+// with log2(threads) barriers, thread zero adding the total into the shared
+// shadow and freeing the slots. Shadows with an unknown footprint keep their
+// atomic updates.
+//
+//===----------------------------------------------------------------------===//
+#include "OpenMPShadow.h"
+
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+#include "llvm/Support/MathExtras.h"
+
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+
+#include "Utils.h"
+
+using namespace llvm;
+
+extern "C" {
+llvm::cl::opt<bool> EnzymeOMPPrivateShadow(
+    "enzyme-omp-private-shadow", cl::init(false), cl::Hidden,
+    cl::desc("Accumulate adjoints of OpenMP parallel regions into "
+             "thread-private shadows rather than with atomics, where the "
+             "footprint of the shadow is known"));
+
+llvm::cl::opt<unsigned> EnzymeOMPPrivateShadowMaxBytes(
+    "enzyme-omp-private-shadow-max-bytes", cl::init(4096), cl::Hidden,
+    cl::desc("Largest constant footprint in bytes of a shadow given "
+             "thread-private copies in a reverse OpenMP region"));
+}
+
+/// Size of the header of a private buffer, holding the pointer to the shared
+/// shadow, the size of a slot, the end of the footprint in elements and the
+/// slots of the team. Slots are also padded to this size to avoid false
+/// sharing between threads.
+static constexpr uint64_t PrivateHeaderBytes = 64;
+/// Offsets in the header of a private buffer
+static constexpr uint64_t HeaderSlotBytes = 8;
+static constexpr uint64_t HeaderEnd = 16;
+static constexpr uint64_t HeaderSlots = 24;
+
+namespace {
+/// Footprint of the accumulations into one shadow argument
+struct ShadowFootprint {
+  Argument *Arg;
+  /// Element type of the accumulations
+  Type *ElTy = nullptr;
+  /// Smallest byte offset accumulated to
+  uint64_t Begin = UINT64_MAX;
+  /// One past the largest byte offset accumulated to, in terms of the
+  /// arguments of the region
+  const SCEV *End = nullptr;
+  SmallVector<AtomicRMWInst *, 4> Updates;
+  /// Size of a slot and the end of the footprint in elements, as loaded from
+  /// the header of the private buffer
+  Value *SlotBytes = nullptr;
+  Value *EndIdx = nullptr;
+  /// Slots of the team, as allocated by thread zero
+  Value *Slots = nullptr;
+};
+} // namespace
+
+/// An upper bound of the unsigned value of \p S which only refers to
+/// arguments and constants, or nullptr if none is known.
+static const SCEV *getUpperBound(const SCEV *S, ScalarEvolution &SE) {
+  if (!SCEVExprContains(S, [](const SCEV *Op) {
+        if (auto U = dyn_cast<SCEVUnknown>(Op))
+          return !isa<Argument>(U->getValue());
+        return isa<SCEVAddRecExpr>(Op);
+      }))
+    return S;
+  if (auto AR = dyn_cast<SCEVAddRecExpr>(S)) {
+    // A recurrence which does not wrap and starts or ends at a non-negative
+    // value is largest at its other end
+    if (!AR->isAffine() ||
+        !(AR->hasNoUnsignedWrap() || AR->hasNoSignedWrap()))
+      return nullptr;
+    auto Step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+    if (!Step || Step->getValue()->isZero())
+      return nullptr;
+    const SCEV *BTC = SE.getBackedgeTakenCount(AR->getLoop());
+    if (isa<SCEVCouldNotCompute>(BTC))
+      return nullptr;
+    const SCEV *First = AR->getStart();
+    const SCEV *Last = AR->evaluateAtIteration(BTC, SE);
+    bool Increasing = !Step->getValue()->isNegative();
+    if (!SE.isKnownNonNegative(Increasing ? First : Last))
+      return nullptr;
+    return getUpperBound(Increasing ? Last : First, SE);
+  }
+  if (auto Min = dyn_cast<SCEVUMinExpr>(S)) {
+    for (auto Op : Min->operands())
+      if (auto Bound = getUpperBound(Op, SE))
+        return Bound;
+    return nullptr;
+  }
+  if (auto ZExt = dyn_cast<SCEVZeroExtendExpr>(S)) {
+    if (auto Bound = getUpperBound(ZExt->getOperand(), SE))
+      return SE.getZeroExtendExpr(Bound, S->getType());
+    return nullptr;
+  }
+  return nullptr;
+}
+
+/// Emit the integer expression \p S, which only refers to arguments of the
+/// function it was computed for, in terms of \p Args. Returns nullptr if the
+/// expression is not handled.
+static Value *emitBound(IRBuilder<> &B, const SCEV *S,
+                        ArrayRef<Value *> Args) {
+  if (!S->getType()->isIntegerTy())
+    return nullptr;
+  if (auto C = dyn_cast<SCEVConstant>(S))
+    return C->getValue();
+  if (auto U = dyn_cast<SCEVUnknown>(S)) {
+    if (auto A = dyn_cast<Argument>(U->getValue()))
+      return Args[A->getArgNo()];
+    return nullptr;
+  }
+  if (auto Cast = dyn_cast<SCEVCastExpr>(S)) {
+    Value *Op = emitBound(B, Cast->getOperand(), Args);
+    if (!Op)
+      return nullptr;
+    if (isa<SCEVZeroExtendExpr>(S))
+      return B.CreateZExt(Op, S->getType());
+    if (isa<SCEVSignExtendExpr>(S))
+      return B.CreateSExt(Op, S->getType());
+    if (isa<SCEVTruncateExpr>(S))
+      return B.CreateTrunc(Op, S->getType());
+    return nullptr;
+  }
+  if (auto Div = dyn_cast<SCEVUDivExpr>(S)) {
+    Value *LHS = emitBound(B, Div->getLHS(), Args);
+    Value *RHS = emitBound(B, Div->getRHS(), Args);
+    if (!LHS || !RHS)
+      return nullptr;
+    return B.CreateUDiv(LHS, RHS);
+  }
+  auto NAry = dyn_cast<SCEVNAryExpr>(S);
+  if (!NAry || isa<SCEVAddRecExpr>(S))
+    return nullptr;
+  Value *Res = nullptr;
+  for (auto Op : NAry->operands()) {
+    Value *V = emitBound(B, Op, Args);
+    if (!V)
+      return nullptr;
+    if (!Res) {
+      Res = V;
+      continue;
+    }
+    switch (S->getSCEVType()) {
+    case scAddExpr:
+      Res = B.CreateAdd(Res, V);
+      break;
+    case scMulExpr:
+      Res = B.CreateMul(Res, V);
+      break;
+    case scUMaxExpr:
+      Res = B.CreateSelect(B.CreateICmpUGT(Res, V), Res, V);
+      break;
+    case scSMaxExpr:
+      Res = B.CreateSelect(B.CreateICmpSGT(Res, V), Res, V);
+      break;
+    case scUMinExpr:
+      Res = B.CreateSelect(B.CreateICmpULT(Res, V), Res, V);
+      break;
+    case scSMinExpr:
+      Res = B.CreateSelect(B.CreateICmpSLT(Res, V), Res, V);
+      break;
+    default:
+      return nullptr;
+    }
+  }
+  return Res;
+}
+
+/// Whether \p Arg is only used by atomic fadds at offsets bounded by scalar
+/// evolution, by a constant or in terms of the arguments of its function,
+/// filling in the footprint of those updates.
+static bool computeFootprint(ShadowFootprint &FP, ScalarEvolution &SE,
+                             const DataLayout &DL) {
+  Argument *Arg = FP.Arg;
+  auto PT = dyn_cast<PointerType>(Arg->getType());
+  if (!PT || PT->getAddressSpace() != 0)
+    return false;
+  const SCEV *Base = SE.getSCEV(Arg);
+
+  SmallVector<Value *, 4> todo = {Arg};
+  while (todo.size()) {
+    Value *V = todo.pop_back_val();
+    for (User *U : V->users()) {
+      if (auto GEP = dyn_cast<GetElementPtrInst>(U)) {
+        if (GEP->getPointerOperand() != V)
+          return false;
+        todo.push_back(GEP);
+        continue;
+      }
+      if (isa<BitCastInst>(U)) {
+        todo.push_back(U);
+        continue;
+      }
+      auto RMW = dyn_cast<AtomicRMWInst>(U);
+      if (!RMW || RMW->getOperation() != AtomicRMWInst::FAdd ||
+          RMW->getPointerOperand() != V)
+        return false;
+      Type *T = RMW->getValOperand()->getType();
+      if (FP.ElTy && FP.ElTy != T)
+        return false;
+      FP.ElTy = T;
+      uint64_t size = DL.getTypeStoreSize(T);
+      if (!isPowerOf2_64(size))
+        return false;
+
+      const SCEV *Offset = SE.getMinusSCEV(SE.getSCEV(V), Base);
+      if (isa<SCEVCouldNotCompute>(Offset))
+        return false;
+      // Slots are reduced elementwise, so every update must be aligned to
+      // the element size.
+      if (SE.GetMinTrailingZeros(Offset) < Log2_64(size))
+        return false;
+      const SCEV *End = nullptr;
+      APInt Max = SE.getUnsignedRangeMax(Offset);
+      if (Max.getActiveBits() <= 32 &&
+          alignTo(Max.getZExtValue() + size, size) <=
+              EnzymeOMPPrivateShadowMaxBytes) {
+        End = SE.getConstant(Offset->getType(),
+                             alignTo(Max.getZExtValue() + size, size));
+      } else {
+        const SCEV *Bound = getUpperBound(Offset, SE);
+        if (!Bound)
+          return false;
+        End = SE.getAddExpr(Bound, SE.getConstant(Offset->getType(), size));
+        if (auto C = dyn_cast<SCEVConstant>(End))
+          if (C->getAPInt().getActiveBits() > 32 ||
+              C->getValue()->getZExtValue() > EnzymeOMPPrivateShadowMaxBytes)
+            return false;
+      }
+      APInt Min = SE.getUnsignedRangeMin(Offset);
+      FP.Begin = std::min(FP.Begin, Min.getActiveBits() <= 32
+                                        ? alignDown(Min.getZExtValue(), size)
+                                        : 0);
+      if (FP.End && FP.End->getType() != End->getType())
+        return false;
+      FP.End = FP.End ? SE.getUMaxExpr(FP.End, End) : End;
+      FP.Updates.push_back(RMW);
+    }
+  }
+  return FP.Updates.size() != 0;
+}
+
+/// Emit a loop over the elements of the footprint \p FP, calling \p body
+/// with a builder in the loop and the element index.
+static void
+emitElementLoop(IRBuilder<> &B, const ShadowFootprint &FP, const Twine &Name,
+                function_ref<void(IRBuilder<> &, Value *)> body) {
+  auto &DL = B.GetInsertBlock()->getModule()->getDataLayout();
+  uint64_t size = DL.getTypeStoreSize(FP.ElTy);
+  Function *F = B.GetInsertBlock()->getParent();
+  LLVMContext &Ctx = F->getContext();
+  Type *I64 = Type::getInt64Ty(Ctx);
+
+  BasicBlock *Pre = B.GetInsertBlock();
+  BasicBlock *Loop = BasicBlock::Create(Ctx, Name, F);
+  BasicBlock *Exit = BasicBlock::Create(Ctx, Name + ".end", F);
+  Value *Begin = ConstantInt::get(I64, FP.Begin / size);
+  B.CreateCondBr(B.CreateICmpULT(Begin, FP.EndIdx), Loop, Exit);
+
+  B.SetInsertPoint(Loop);
+  auto Idx = B.CreatePHI(I64, 2, "idx");
+  Idx->addIncoming(Begin, Pre);
+  body(B, Idx);
+  auto Next = B.CreateAdd(Idx, ConstantInt::get(I64, 1), "", true, true);
+  Idx->addIncoming(Next, B.GetInsertBlock());
+  B.CreateCondBr(B.CreateICmpEQ(Next, FP.EndIdx), Exit, Loop);
+  B.SetInsertPoint(Exit);
+}
+
+/// A pointer to the field of type \p T at byte offset \p Off of the header
+/// of the private buffer \p Buf.
+static Value *getHeaderField(IRBuilder<> &B, Value *Buf, uint64_t Off,
+                             Type *T) {
+#if LLVM_VERSION_MAJOR > 7
+  Value *Ptr = B.CreateInBoundsGEP(B.getInt8Ty(), Buf,
+                                   ConstantInt::get(B.getInt64Ty(), Off));
+#else
+  Value *Ptr = B.CreateInBoundsGEP(Buf, ConstantInt::get(B.getInt64Ty(), Off));
+#endif
+  return B.CreatePointerCast(Ptr, PointerType::getUnqual(T));
+}
+
+/// Load the field of type \p T at byte offset \p Off of the header of the
+/// private buffer \p Buf.
+static Value *loadHeader(IRBuilder<> &B, Value *Buf, uint64_t Off, Type *T,
+                         const Twine &Name) {
+#if LLVM_VERSION_MAJOR > 7
+  return B.CreateLoad(T, getHeaderField(B, Buf, Off, T), Name);
+#else
+  return B.CreateLoad(getHeaderField(B, Buf, Off, T), Name);
+#endif
+}
+
+/// The slot of thread \p Tid in the slots of the team of \p FP, as a
+/// pointer to its element type.
+static Value *getSlot(IRBuilder<> &B, Value *Tid, const ShadowFootprint &FP) {
+  Value *Off = B.CreateMul(B.CreateZExt(Tid, B.getInt64Ty()), FP.SlotBytes,
+                           "", true, true);
+#if LLVM_VERSION_MAJOR > 7
+  Value *Slot = B.CreateInBoundsGEP(B.getInt8Ty(), FP.Slots, Off);
+#else
+  Value *Slot = B.CreateInBoundsGEP(FP.Slots, Off);
+#endif
+  return B.CreatePointerCast(Slot, PointerType::getUnqual(FP.ElTy));
+}
+
+static Value *loadElement(IRBuilder<> &B, Type *T, Value *Ptr, Value *Idx) {
+#if LLVM_VERSION_MAJOR > 7
+  return B.CreateLoad(T, B.CreateInBoundsGEP(T, Ptr, Idx));
+#else
+  return B.CreateLoad(B.CreateInBoundsGEP(Ptr, Idx));
+#endif
+}
+
+static void addToElement(IRBuilder<> &B, Type *T, Value *Ptr, Value *Idx,
+                         Value *Dif) {
+#if LLVM_VERSION_MAJOR > 7
+  Value *EP = B.CreateInBoundsGEP(T, Ptr, Idx);
+  B.CreateStore(B.CreateFAdd(B.CreateLoad(T, EP), Dif), EP);
+#else
+  Value *EP = B.CreateInBoundsGEP(Ptr, Idx);
+  B.CreateStore(B.CreateFAdd(B.CreateLoad(EP), Dif), EP);
+#endif
+}
+
+/// Replace the atomic update \p RMW by a plain read-modify-write.
+static void demoteAtomic(AtomicRMWInst *RMW) {
+  IRBuilder<> B(RMW);
+  Type *T = RMW->getValOperand()->getType();
+#if LLVM_VERSION_MAJOR > 7
+  auto LI = B.CreateLoad(T, RMW->getPointerOperand());
+#else
+  auto LI = B.CreateLoad(RMW->getPointerOperand());
+#endif
+#if LLVM_VERSION_MAJOR >= 11
+  LI->setAlignment(RMW->getAlign());
+#endif
+  auto SI =
+      B.CreateStore(B.CreateFAdd(LI, RMW->getValOperand()), LI->getOperand(0));
+#if LLVM_VERSION_MAJOR >= 11
+  SI->setAlignment(RMW->getAlign());
+#else
+  (void)SI;
+#endif
+  RMW->replaceAllUsesWith(LI);
+  RMW->eraseFromParent();
+}
+
+Function *privatizeOMPShadows(Function *F, ArrayRef<unsigned> ShadowArgNos,
+                              Value *Ident, TargetLibraryInfo &TLI,
+                              SmallVectorImpl<PrivateShadow> &Privatized) {
+#if LLVM_VERSION_MAJOR >= 9
+  if (F->empty() || ShadowArgNos.empty())
+    return nullptr;
+  auto &DL = F->getParent()->getDataLayout();
+
+  ValueToValueMapTy VMap;
+  Function *NF = CloneFunction(F, VMap);
+  NF->setName(F->getName() + "_private");
+  NF->setLinkage(Function::LinkageTypes::InternalLinkage);
+
+  SmallVector<ShadowFootprint, 2> Footprints;
+  SmallVector<Function *, 2> FootprintFns;
+  {
+    DominatorTree DT(*NF);
+    // Reverse induction variables are kept in stack slots, which hide the
+    // offsets of the updates from scalar evolution
+    SmallVector<AllocaInst *, 4> ToPromote;
+    for (auto &I : NF->getEntryBlock())
+      if (auto AI = dyn_cast<AllocaInst>(&I))
+        if (isAllocaPromotable(AI))
+          ToPromote.push_back(AI);
+    if (ToPromote.size()) {
+      PromoteMemToReg(ToPromote, DT);
+      DT.recalculate(*NF);
+    }
+    LoopInfo LI(DT);
+    AssumptionCache AC(*NF);
+    ScalarEvolution SE(*NF, TLI, AC, DT, LI);
+    for (auto ArgNo : ShadowArgNos) {
+      ShadowFootprint FP;
+      FP.Arg = NF->arg_begin() + ArgNo;
+      if (FP.Arg->use_empty())
+        continue;
+      Function *FootprintFn = nullptr;
+      if (computeFootprint(FP, SE, DL)) {
+        // The caller sizes the slots before the region runs, by evaluating
+        // the end of the footprint on the arguments of the region
+        Type *I64 = Type::getInt64Ty(F->getContext());
+        auto FT = FunctionType::get(I64, F->getFunctionType()->params(),
+                                    /*isVarArg*/ false);
+        FootprintFn =
+            Function::Create(FT, Function::LinkageTypes::InternalLinkage,
+                             F->getName() + "_private_footprint",
+                             F->getParent());
+        FootprintFn->addFnAttr(Attribute::AlwaysInline);
+        IRBuilder<> B(
+            BasicBlock::Create(F->getContext(), "entry", FootprintFn));
+        SmallVector<Value *, 4> Args;
+        for (auto &A : FootprintFn->args())
+          Args.push_back(&A);
+        if (Value *End = emitBound(B, FP.End, Args)) {
+          End = B.CreateZExtOrTrunc(End, I64);
+          // The bound exceeds the footprint of updates which do not run,
+          // such as in loops with a negative trip count
+          Value *Begin = ConstantInt::get(I64, FP.Begin);
+          B.CreateRet(B.CreateSelect(B.CreateICmpSGT(End, Begin), End, Begin));
+        } else {
+          FootprintFn->eraseFromParent();
+          FootprintFn = nullptr;
+        }
+      }
+      if (FootprintFn) {
+        Footprints.push_back(FP);
+        FootprintFns.push_back(FootprintFn);
+      } else
+        EmitWarning("OMPAtomicShadow", F, "Using atomic updates of ",
+                    *FP.Arg, " in ", F->getName(),
+                    " as its footprint is unknown");
+    }
+  }
+  if (Footprints.empty()) {
+    NF->eraseFromParent();
+    return nullptr;
+  }
+
+  Module &M = *NF->getParent();
+  LLVMContext &Ctx = NF->getContext();
+  Type *I32 = Type::getInt32Ty(Ctx);
+  Type *I8P = Type::getInt8PtrTy(Ctx);
+  auto ThreadNumFn =
+      M.getOrInsertFunction("omp_get_thread_num", FunctionType::get(I32, {}));
+  auto NumThreadsFn =
+      M.getOrInsertFunction("omp_get_num_threads", FunctionType::get(I32, {}));
+
+  // The barrier takes the location of the region if it is a constant, which
+  // is the case for code emitted by clang.
+  Type *IdentTy = Ident->getType();
+  if (!isa<Constant>(Ident))
+    Ident = ConstantPointerNull::get(cast<PointerType>(IdentTy));
+  Type *BarrierArgs[] = {IdentTy, I32};
+  auto BarrierFn = M.getOrInsertFunction(
+      "__kmpc_barrier",
+      FunctionType::get(Type::getVoidTy(Ctx), BarrierArgs, false));
+
+  // Thread zero allocates the slots of the team once it is known, before the
+  // body runs
+  BasicBlock *Entry = &NF->getEntryBlock();
+  auto SplitPt = Entry->begin();
+  while (isa<AllocaInst>(&*SplitPt))
+    ++SplitPt;
+  BasicBlock *Body = Entry->splitBasicBlock(SplitPt, "omp.private.body");
+  Entry->getTerminator()->eraseFromParent();
+  BasicBlock *Alloc = BasicBlock::Create(Ctx, "omp.private.alloc", NF, Body);
+  BasicBlock *Ready = BasicBlock::Create(Ctx, "omp.private.ready", NF, Body);
+
+  IRBuilder<> EB(Entry);
+  Value *Tid = EB.CreateCall(ThreadNumFn, {}, "tid");
+  Value *NumThreads = EB.CreateCall(NumThreadsFn, {}, "nthreads");
+  Value *IsMaster = EB.CreateICmpEQ(Tid, ConstantInt::get(I32, 0), "master");
+  EB.CreateCondBr(IsMaster, Alloc, Ready);
+  EB.SetInsertPoint(Entry->getTerminator());
+
+  IRBuilder<> AB(Alloc);
+  AB.CreateBr(Ready);
+  AB.SetInsertPoint(Alloc->getTerminator());
+
+  IRBuilder<> RB(Ready);
+#if LLVM_VERSION_MAJOR > 7
+  Value *Gtid = RB.CreateLoad(I32, NF->arg_begin(), "gtid");
+#else
+  Value *Gtid = RB.CreateLoad(NF->arg_begin(), "gtid");
+#endif
+  RB.CreateCall(BarrierFn, {Ident, Gtid});
+  RB.CreateBr(Body);
+  RB.SetInsertPoint(Ready->getTerminator());
+
+  SmallVector<Value *, 2> Shared;
+  for (size_t i = 0; i < Footprints.size(); i++) {
+    auto &FP = Footprints[i];
+    PrivateShadow P;
+    P.ArgNo = FP.Arg->getArgNo();
+    P.ElTy = FP.ElTy;
+    P.FootprintFn = FootprintFns[i];
+    Privatized.push_back(P);
+
+    for (auto RMW : FP.Updates)
+      demoteAtomic(RMW);
+
+    Argument *NA = NF->arg_begin() + P.ArgNo;
+    SmallVector<Use *, 4> Uses;
+    for (Use &U : NA->uses())
+      Uses.push_back(&U);
+
+    Value *Buf = EB.CreatePointerCast(NA, I8P, "private_buf");
+    Shared.push_back(loadHeader(EB, Buf, 0, NA->getType(), "shared_shadow"));
+    FP.SlotBytes = loadHeader(EB, Buf, HeaderSlotBytes, EB.getInt64Ty(),
+                              "slot_bytes");
+    FP.EndIdx = loadHeader(EB, Buf, HeaderEnd, EB.getInt64Ty(),
+                           "footprint_end");
+
+    Instruction *ZeroMem = nullptr;
+    Value *Size = AB.CreateMul(AB.CreateZExt(NumThreads, AB.getInt64Ty()),
+                               FP.SlotBytes, "", true, true);
+    Value *Slots = CreateAllocation(AB, AB.getInt8Ty(), Size,
+                                    "omp_private_slots", nullptr, &ZeroMem);
+    AB.CreateStore(Slots, getHeaderField(AB, Buf, HeaderSlots, I8P));
+
+    FP.Slots = loadHeader(RB, Buf, HeaderSlots, I8P, "private_slots");
+    Value *Slot = RB.CreatePointerCast(getSlot(RB, Tid, FP), NA->getType(),
+                                       "private_shadow");
+    for (Use *U : Uses)
+      U->set(Slot);
+  }
+
+  SmallVector<ReturnInst *, 1> Returns;
+  for (auto &BB : *NF)
+    if (auto RI = dyn_cast<ReturnInst>(BB.getTerminator()))
+      Returns.push_back(RI);
+
+  for (auto RI : Returns) {
+    BasicBlock *Pre = RI->getParent();
+    BasicBlock *Exit = Pre->splitBasicBlock(RI, "omp.private.exit");
+    Pre->getTerminator()->eraseFromParent();
+
+    IRBuilder<> B(Pre);
+    BasicBlock *Head = BasicBlock::Create(Ctx, "omp.private.tree", NF);
+    BasicBlock *Step = BasicBlock::Create(Ctx, "omp.private.step", NF);
+    BasicBlock *Add = BasicBlock::Create(Ctx, "omp.private.add", NF);
+    BasicBlock *Latch = BasicBlock::Create(Ctx, "omp.private.latch", NF);
+    BasicBlock *Final = BasicBlock::Create(Ctx, "omp.private.final", NF);
+    BasicBlock *Merge = BasicBlock::Create(Ctx, "omp.private.merge", NF);
+    B.CreateBr(Head);
+
+    // In the step with stride s, thread t with t % 2s == 0 adds the slot of
+    // thread t + s into its own, leaving the total in the slot of thread 0.
+    B.SetInsertPoint(Head);
+    auto Stride = B.CreatePHI(I32, 2, "stride");
+    Stride->addIncoming(ConstantInt::get(I32, 1), Pre);
+    B.CreateCondBr(B.CreateICmpULT(Stride, NumThreads), Step, Final);
+
+    B.SetInsertPoint(Step);
+    B.CreateCall(BarrierFn, {Ident, Gtid});
+    Value *Double = B.CreateShl(Stride, 1);
+    Value *Other = B.CreateAdd(Tid, Stride);
+    Value *Active = B.CreateAnd(
+        B.CreateICmpEQ(B.CreateAnd(Tid, B.CreateSub(Double,
+                                                    ConstantInt::get(I32, 1))),
+                       ConstantInt::get(I32, 0)),
+        B.CreateICmpULT(Other, NumThreads));
+    B.CreateCondBr(Active, Add, Latch);
+
+    B.SetInsertPoint(Add);
+    for (size_t i = 0; i < Footprints.size(); i++) {
+      auto &FP = Footprints[i];
+      Value *Mine = getSlot(B, Tid, FP);
+      Value *Theirs = getSlot(B, Other, FP);
+      emitElementLoop(B, FP, "omp.private.sum",
+                      [&](IRBuilder<> &LB, Value *Idx) {
+                        addToElement(LB, FP.ElTy, Mine, Idx,
+                                     loadElement(LB, FP.ElTy, Theirs, Idx));
+                      });
+    }
+    B.CreateBr(Latch);
+
+    B.SetInsertPoint(Latch);
+    Stride->addIncoming(Double, Latch);
+    B.CreateBr(Head);
+
+    // Other shadows of the region may alias the shared shadow, so the total
+    // is added atomically. Elements which were never updated are skipped so
+    // that only memory accumulated to by the region is accessed. No other
+    // thread reads the slots past the last step, which thread zero frees.
+    B.SetInsertPoint(Final);
+    B.CreateCondBr(B.CreateICmpEQ(Tid, ConstantInt::get(I32, 0)), Merge, Exit);
+
+    B.SetInsertPoint(Merge);
+    for (size_t i = 0; i < Footprints.size(); i++) {
+      auto &FP = Footprints[i];
+      Value *Mine = getSlot(B, Tid, FP);
+      Value *Dst =
+          B.CreatePointerCast(Shared[i], PointerType::getUnqual(FP.ElTy));
+      emitElementLoop(
+          B, FP, "omp.private.merge", [&](IRBuilder<> &LB, Value *Idx) {
+            Value *Dif = loadElement(LB, FP.ElTy, Mine, Idx);
+            BasicBlock *Update =
+                BasicBlock::Create(Ctx, "omp.private.update", NF);
+            BasicBlock *Cont = BasicBlock::Create(Ctx, "omp.private.next", NF);
+            LB.CreateCondBr(
+                LB.CreateFCmpUNE(Dif, ConstantFP::get(FP.ElTy, 0.0)), Update,
+                Cont);
+            LB.SetInsertPoint(Update);
+#if LLVM_VERSION_MAJOR > 7
+            Value *EP = LB.CreateInBoundsGEP(FP.ElTy, Dst, Idx);
+#else
+            Value *EP = LB.CreateInBoundsGEP(Dst, Idx);
+#endif
+#if LLVM_VERSION_MAJOR >= 13
+            LB.CreateAtomicRMW(AtomicRMWInst::FAdd, EP, Dif, MaybeAlign(),
+                               AtomicOrdering::Monotonic, SyncScope::System);
+#else
+            LB.CreateAtomicRMW(AtomicRMWInst::FAdd, EP, Dif,
+                               AtomicOrdering::Monotonic, SyncScope::System);
+#endif
+            LB.CreateBr(Cont);
+            LB.SetInsertPoint(Cont);
+          });
+      CreateDealloc(B, FP.Slots);
+    }
+    B.CreateBr(Exit);
+  }
+  return NF;
+#else
+  return nullptr;
+#endif
+}
+
+Value *allocatePrivateShadow(IRBuilder<> &B, Value *Shared,
+                             const PrivateShadow &P,
+                             ArrayRef<Value *> RegionArgs) {
+  Module &M = *B.GetInsertBlock()->getModule();
+  Type *I64 = B.getInt64Ty();
+  Function *FootprintFn = P.FootprintFn;
+
+  // The thread ids are not known outside the region and do not bound the
+  // footprint
+  SmallVector<Value *, 4> Args;
+  for (auto &A : FootprintFn->args()) {
+    unsigned i = A.getArgNo();
+    if (i < 2 || i - 2 >= RegionArgs.size())
+      Args.push_back(Constant::getNullValue(A.getType()));
+    else
+      Args.push_back(
+          B.CreateBitOrPointerCast(RegionArgs[i - 2], A.getType()));
+  }
+  Value *End = B.CreateCall(FootprintFn, Args, "footprint");
+  Value *SlotBytes = B.CreateAnd(
+      B.CreateAdd(End, ConstantInt::get(I64, PrivateHeaderBytes - 1)),
+      ConstantInt::get(I64, ~(PrivateHeaderBytes - 1)));
+  auto &DL = M.getDataLayout();
+  uint64_t ElSize = DL.getTypeStoreSize(P.ElTy);
+
+  // The slots themselves are allocated by the region, for the team it runs
+  // with
+  Value *Buf = CreateAllocation(B, B.getInt8Ty(),
+                                ConstantInt::get(I64, PrivateHeaderBytes),
+                                "omp_private_shadow");
+  B.CreateStore(Shared, getHeaderField(B, Buf, 0, Shared->getType()));
+  B.CreateStore(SlotBytes, getHeaderField(B, Buf, HeaderSlotBytes, I64));
+  B.CreateStore(
+      B.CreateUDiv(B.CreateAdd(End, ConstantInt::get(I64, ElSize - 1)),
+                   ConstantInt::get(I64, ElSize)),
+      getHeaderField(B, Buf, HeaderEnd, I64));
+  return B.CreatePointerCast(Buf, Shared->getType());
+}
@@ -0,0 +1,80 @@
+//===- OpenMPShadow.h - Thread-private shadows for OpenMP reverse regions -===//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+// If using this code in an academic setting, please cite the following:
+// @incollection{enzymeNeurips,
+// title = {Instead of Rewriting Foreign Code for Machine Learning,
+//          Automatically Synthesize Fast Gradients},
+// author = {Moses, William S. and Churavy, Valentin},
+// booktitle = {Advances in Neural Information Processing Systems 33},
+// year = {2020},
+// note = {To appear in},
+// }
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares an opt-in alternative to atomic adjoint updates in the
+// reverse of an OpenMP parallel region. Shadow arguments which the reverse
+// region only accumulates into, at a set of offsets bounded by a constant or
+// by the arguments of the region, are given one private slot per thread which
+// is summed by a tree reduction when the region ends.
+//
+//===----------------------------------------------------------------------===//
+#ifndef ENZYME_OPENMP_SHADOW_H
+#define ENZYME_OPENMP_SHADOW_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
+
+extern "C" {
+/// Accumulate into thread-private shadows in reverse OpenMP regions
+extern llvm::cl::opt<bool> EnzymeOMPPrivateShadow;
+/// Largest constant per-thread footprint, in bytes, of a privatized shadow
+extern llvm::cl::opt<unsigned> EnzymeOMPPrivateShadowMaxBytes;
+}
+
+/// A shadow argument of a reverse OpenMP body given thread-private slots.
+struct PrivateShadow {
+  /// Argument number in the outlined body
+  unsigned ArgNo;
+  /// Type of the elements accumulated to
+  llvm::Type *ElTy;
+  /// Function with the arguments of the outlined body returning one past
+  /// the largest byte offset it accumulates to
+  llvm::Function *FootprintFn;
+};
+
+/// Clone the reverse outlined OpenMP body \p F so that the atomic
+/// accumulations into the shadow arguments numbered \p ShadowArgNos with a
+/// known footprint go to a private slot of the executing thread, and the
+/// slots are reduced into the shared shadow when the region ends. \p Ident is
+/// the source location of the parallel region. The privatized arguments are
+/// appended to \p Privatized and the clone expects each of them to be passed
+/// a buffer created by allocatePrivateShadow. Returns nullptr if no shadow
+/// can be privatized.
+llvm::Function *privatizeOMPShadows(llvm::Function *F,
+                                    llvm::ArrayRef<unsigned> ShadowArgNos,
+                                    llvm::Value *Ident,
+                                    llvm::TargetLibraryInfo &TLI,
+                                    llvm::SmallVectorImpl<PrivateShadow> &Privatized);
+
+/// Allocate the header describing the private slots of \p Shared for the
+/// next parallel region, returning the buffer to pass in its place.
+/// \p RegionArgs are the arguments the region is forked with, after the
+/// thread ids, from which the size of the slots is computed. The slots
+/// themselves are allocated and freed by the region for the team it runs
+/// with.
+llvm::Value *allocatePrivateShadow(llvm::IRBuilder<> &B, llvm::Value *Shared,
+                                   const PrivateShadow &P,
+                                   llvm::ArrayRef<llvm::Value *> RegionArgs);
+
+#endif
@@ -0,0 +1,130 @@
+//===- PhaseTimer.cpp - Compile-time timers for the phases of Enzyme  -----===//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+// If using this code in an academic setting, please cite the following:
+// @incollection{enzymeNeurips,
+// title = {Instead of Rewriting Foreign Code for Machine Learning,
+//          Automatically Synthesize Fast Gradients},
+// author = {Moses, William S. and Churavy, Valentin},
+// booktitle = {Advances in Neural Information Processing Systems 33},
+// year = {2020},
+// note = {To appear in},
+// }
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements timers which attribute the compile time of Enzyme to
+// the phase of differentiation it is spent in.
+//
+//===----------------------------------------------------------------------===//
+#include "PhaseTimer.h"
+
+#include <llvm/Config/llvm-config.h>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+extern "C" {
+llvm::cl::opt<std::string> EnzymeStatsJSON(
+    "enzyme-stats-json", cl::init(""), cl::Hidden,
+    cl::desc("Write Enzyme phase timers and statistics as JSON to this file"));
+}
+
+namespace {
+struct PhaseTimers {
+  TimerGroup Group;
+  Timer Timers[(unsigned)EnzymePhase::NumPhases];
+  /// The phases currently entered, innermost last. Only the timer of the
+  /// innermost phase is running.
+  SmallVector<Timer *, 8> Stack;
+
+  PhaseTimers() : Group("enzyme", "Enzyme phase timing") {
+    const char *Names[][2] = {
+        {"preprocess", "Preprocess"},
+        {"optimize", "Optimize intermediate"},
+        {"type-analysis", "Type analysis"},
+        {"activity-analysis", "Activity analysis"},
+        {"mincut", "Cache min-cut"},
+        {"augmented-primal", "Augmented primal emission"},
+        {"reverse", "Gradient emission"},
+        {"forward", "Forward derivative emission"},
+        {"batch", "Batch emission"},
+    };
+    static_assert(sizeof(Names) / sizeof(*Names) ==
+                      (unsigned)EnzymePhase::NumPhases,
+                  "every phase needs a name");
+    for (unsigned i = 0; i < (unsigned)EnzymePhase::NumPhases; i++)
+      Timers[i].init(Names[i][0], Names[i][1], Group);
+  }
+
+  ~PhaseTimers() {
+    // Only print the report on exit if it was asked for by -time-passes
+    if (!TimePassesIsEnabled)
+      Group.clear();
+  }
+};
+} // namespace
+
+static ManagedStatic<PhaseTimers> Timers;
+
+PhaseTimer::PhaseTimer(EnzymePhase Phase, bool Enabled)
+    : Active(Enabled && (TimePassesIsEnabled || !EnzymeStatsJSON.empty())) {
+  if (!Active)
+    return;
+  Timer *T = &Timers->Timers[(unsigned)Phase];
+  auto &Stack = Timers->Stack;
+  if (!Stack.empty()) {
+    // Reentering the running phase leaves its timer running
+    if (Stack.back() == T) {
+      Stack.push_back(T);
+      return;
+    }
+    Stack.back()->stopTimer();
+  }
+  Stack.push_back(T);
+  T->startTimer();
+}
+
+PhaseTimer::~PhaseTimer() {
+  if (!Active)
+    return;
+  auto &Stack = Timers->Stack;
+  Timer *T = Stack.pop_back_val();
+  if (!Stack.empty() && Stack.back() == T)
+    return;
+  T->stopTimer();
+  if (!Stack.empty())
+    Stack.back()->startTimer();
+}
+
+void writeEnzymeStatsJSON() {
+  if (EnzymeStatsJSON.empty())
+    return;
+  std::error_code EC;
+#if LLVM_VERSION_MAJOR >= 13
+  raw_fd_ostream OS(EnzymeStatsJSON, EC, sys::fs::OF_TextWithCRLF);
+#elif LLVM_VERSION_MAJOR >= 9
+  raw_fd_ostream OS(EnzymeStatsJSON, EC, sys::fs::OF_Text);
+#else
+  raw_fd_ostream OS(EnzymeStatsJSON, EC, sys::fs::F_Text);
+#endif
+  if (EC) {
+    errs() << "could not open " << EnzymeStatsJSON << ": " << EC.message()
+           << "\n";
+    return;
+  }
+  // Includes the values of every timer group, and so the phase timers
+  PrintStatisticsJSON(OS);
+}
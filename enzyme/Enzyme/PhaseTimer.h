@@ -0,0 +1,75 @@
+//===- PhaseTimer.h - Compile-time timers for the phases of Enzyme  -------===//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+// If using this code in an academic setting, please cite the following:
+// @incollection{enzymeNeurips,
+// title = {Instead of Rewriting Foreign Code for Machine Learning,
+//          Automatically Synthesize Fast Gradients},
+// author = {Moses, William S. and Churavy, Valentin},
+// booktitle = {Advances in Neural Information Processing Systems 33},
+// year = {2020},
+// note = {To appear in},
+// }
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares timers which attribute the compile time of Enzyme to
+// the phase of differentiation it is spent in. The timers are enabled by
+// -time-passes (or -ftime-report) and are reported in the "enzyme" timer
+// group. -enzyme-stats-json writes the timers together with the statistics
+// of the pass as JSON.
+//
+//===----------------------------------------------------------------------===//
+#ifndef ENZYME_PHASE_TIMER_H
+#define ENZYME_PHASE_TIMER_H
+
+#include <string>
+
+#include "llvm/Support/CommandLine.h"
+
+extern "C" {
+/// File to which the phase timers and statistics are written as JSON
+extern llvm::cl::opt<std::string> EnzymeStatsJSON;
+}
+
+/// A phase of differentiation whose compile time is measured
+enum class EnzymePhase {
+  Preprocess,
+  Optimize,
+  TypeAnalysis,
+  ActivityAnalysis,
+  MinCut,
+  AugmentedPrimal,
+  Reverse,
+  Forward,
+  Batch,
+  NumPhases
+};
+
+/// Attribute the compile time spent during the lifetime of this object to
+/// the given phase. Phases nest, and time is only counted towards the
+/// innermost phase, so that recursively differentiating a callee or
+/// querying an analysis is not also counted towards the enclosing phase.
+/// A timer constructed with Enabled false measures nothing, so that
+/// recursive entry points can time only their outermost call.
+class PhaseTimer {
+public:
+  PhaseTimer(EnzymePhase Phase, bool Enabled = true);
+  ~PhaseTimer();
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+  bool Active;
+};
+
+/// Write the phase timers and the statistics collected so far as JSON to the
+/// file given by -enzyme-stats-json, if any
+void writeEnzymeStatsJSON();
+
+#endif // ENZYME_PHASE_TIMER_H
@@ -41,18 +41,35 @@
 #include "llvm/Support/raw_ostream.h"
 
 #include "llvm/ADT/SmallSet.h"
+#include "llvm/ADT/Statistic.h"
 
 #include "llvm/IR/InlineAsm.h"
 
 #include "../Utils.h"
 #include "TypeAnalysis.h"
 
+#include "../FunctionSummary.h"
 #include "../FunctionUtils.h"
 #include "../LibraryFuncs.h"
+#include "../PhaseTimer.h"
 
 #include "RustDebugInfo.h"
 #include "TBAA.h"
 
+#ifdef DEBUG_TYPE
+#undef DEBUG_TYPE
+#endif
+#define DEBUG_TYPE "enzyme"
+
+STATISTIC(NumTypeAnalysisFunctions,
+          "Number of functions analyzed by TypeAnalysis");
+STATISTIC(NumTypeAnalysisIterations,
+          "Number of TypeAnalysis fixpoint iterations, each draining the "
+          "worklist before analyzing one pending call");
+STATISTIC(NumTypeAnalysisVisits, "Number of values visited by TypeAnalysis");
+STATISTIC(NumTypeSummaryHits,
+          "Number of calls whose types were derived from a callee summary");
+
 extern "C" {
 /// Maximum offset for type trees to keep
 llvm::cl::opt<int> MaxIntOffset("enzyme-max-int-offset", cl::init(100),
@@ -70,6 +87,11 @@ llvm::cl::opt<bool> RustTypeRules("enzyme-rust-type", cl::init(false),
 llvm::cl::opt<bool> EnzymeStrictAliasing(
     "enzyme-strict-aliasing", cl::init(true), cl::Hidden,
     cl::desc("Assume strict aliasing of types / type stability"));
+
+llvm::cl::opt<bool> EnzymeTypeSummaries(
+    "enzyme-type-summaries", cl::init(false), cl::Hidden,
+    cl::desc("Use context-insensitive callee summaries before reanalyzing "
+             "a callee for each calling context"));
 }
 
 const std::map<std::string, llvm::Intrinsic::ID> LIBM_FUNCTIONS = {
@@ -653,6 +675,11 @@ void TypeAnalyzer::updateAnalysis(Value *Val, TypeTree Data, Value *Origin) {
       Invalid = true;
       return;
     }
+    if (interprocedural.RecoverIllegal) {
+      Invalid = true;
+      interprocedural.SawIllegal = true;
+      return;
+    }
     if (CustomErrorHandler) {
       std::string str;
       raw_string_ostream ss(str);
@@ -687,6 +714,9 @@ void TypeAnalyzer::updateAnalysis(Value *Val, TypeTree Data, Value *Origin) {
         analysis[Val] = Data;
       }
     }
+    // Share the storage of the updated tree with identical trees
+    analysis[Val].intern();
+
     // Add val so it can explicitly propagate this new info, if able to
     if (Val != Origin)
       addToWorkList(Val);
@@ -1054,6 +1084,7 @@ void TypeAnalyzer::run() {
   std::deque<Instruction *> pendingCalls;
 
   do {
+    ++NumTypeAnalysisIterations;
 
     while (!Invalid && workList.size()) {
       auto todo = *workList.begin();
@@ -1080,12 +1111,14 @@ void TypeAnalyzer::run() {
           }
         }
       }
+      ++NumTypeAnalysisVisits;
       visitValue(*todo);
     }
 
     if (pendingCalls.size() > 0) {
       auto todo = pendingCalls.front();
       pendingCalls.pop_front();
+      ++NumTypeAnalysisVisits;
       visitValue(*todo);
       continue;
     } else
@@ -1096,6 +1129,7 @@ void TypeAnalyzer::run() {
   runPHIHypotheses();
 
   do {
+    ++NumTypeAnalysisIterations;
 
     while (!Invalid && workList.size()) {
       auto todo = *workList.begin();
@@ -1108,12 +1142,14 @@ void TypeAnalyzer::run() {
         pendingCalls.push_back(ci);
         continue;
       }
+      ++NumTypeAnalysisVisits;
       visitValue(*todo);
     }
 
     if (pendingCalls.size() > 0) {
       auto todo = pendingCalls.front();
       pendingCalls.pop_front();
+      ++NumTypeAnalysisVisits;
       visitValue(*todo);
       continue;
     } else
@@ -3636,6 +3672,38 @@ void TypeAnalyzer::visitCallInst(CallInst &call) {
       }
       return;
     }
+    if (funcName == "pthread_create") {
+      updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
+      for (int i = 0; i < 3; i++)
+        updateAnalysis(call.getOperand(i),
+                       TypeTree(BaseType::Pointer).Only(-1), &call);
+
+      Function *fn = dyn_cast<Function>(call.getArgOperand(2));
+      if (auto castinst = dyn_cast<ConstantExpr>(call.getArgOperand(2)))
+        if (castinst->isCast())
+          fn = dyn_cast<Function>(castinst->getOperand(0));
+
+      if (fn && !fn->empty() && fn->arg_size() == 1 && (direction & UP)) {
+        FnTypeInfo typeInfo(fn);
+        typeInfo.Arguments.insert(std::pair<Argument *, TypeTree>(
+            fn->arg_begin(), getAnalysis(call.getArgOperand(3))));
+        typeInfo.KnownValues.insert(std::pair<Argument *, std::set<int64_t>>(
+            fn->arg_begin(), {}));
+        TypeResults STR = interprocedural.analyzeFunction(typeInfo);
+        updateAnalysis(call.getArgOperand(3), STR.query(fn->arg_begin()),
+                       &call);
+      }
+      return;
+    }
+    if (funcName == "pthread_join") {
+      updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
+      if (call.getOperand(0)->getType()->isIntegerTy())
+        updateAnalysis(call.getOperand(0),
+                       TypeTree(BaseType::Integer).Only(-1), &call);
+      updateAnalysis(call.getOperand(1), TypeTree(BaseType::Pointer).Only(-1),
+                     &call);
+      return;
+    }
     if (funcName == "__kmpc_for_static_init_4" ||
         funcName == "__kmpc_for_static_init_4u" ||
         funcName == "__kmpc_for_static_init_8" ||
@@ -3742,7 +3810,8 @@ void TypeAnalyzer::visitCallInst(CallInst &call) {
       updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
       return;
     }
-    if (funcName == "MPI_Isend" || funcName == "MPI_Irecv") {
+    if (funcName == "MPI_Isend" || funcName == "MPI_Irecv" ||
+        funcName == "MPI_Send_init" || funcName == "MPI_Recv_init") {
       TypeTree buf = TypeTree(BaseType::Pointer);
 
       if (Constant *C = dyn_cast<Constant>(call.getOperand(2))) {
@@ -3777,6 +3846,20 @@ void TypeAnalyzer::visitCallInst(CallInst &call) {
       updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
       return;
     }
+    if (funcName == "MPI_Start" || funcName == "MPI_Request_free") {
+      updateAnalysis(call.getOperand(0), TypeTree(BaseType::Pointer).Only(-1),
+                     &call);
+      updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
+      return;
+    }
+    if (funcName == "MPI_Startall") {
+      updateAnalysis(call.getOperand(0), TypeTree(BaseType::Integer).Only(-1),
+                     &call);
+      updateAnalysis(call.getOperand(1), TypeTree(BaseType::Pointer).Only(-1),
+                     &call);
+      updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
+      return;
+    }
     if (funcName == "MPI_Waitany") {
       updateAnalysis(call.getOperand(0), TypeTree(BaseType::Integer).Only(-1),
                      &call);
@@ -3799,13 +3882,17 @@ void TypeAnalyzer::visitCallInst(CallInst &call) {
       updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
       return;
     }
-    if (funcName == "MPI_Bcast") {
+    if (funcName == "MPI_Bcast" || funcName == "MPI_Ibcast") {
       updateAnalysis(call.getOperand(0), TypeTree(BaseType::Pointer).Only(-1),
                      &call);
       updateAnalysis(call.getOperand(1), TypeTree(BaseType::Integer).Only(-1),
                      &call);
       updateAnalysis(call.getOperand(3), TypeTree(BaseType::Integer).Only(-1),
                      &call);
+      // request
+      if (funcName == "MPI_Ibcast")
+        updateAnalysis(call.getOperand(5),
+                       TypeTree(BaseType::Pointer).Only(-1), &call);
       updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
       return;
     }
@@ -3829,7 +3916,7 @@ void TypeAnalyzer::visitCallInst(CallInst &call) {
       updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
       return;
     }
-    if (funcName == "MPI_Allreduce") {
+    if (funcName == "MPI_Allreduce" || funcName == "MPI_Iallreduce") {
       // int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count,
       //             MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
       // sendbuf
@@ -3844,6 +3931,10 @@ void TypeAnalyzer::visitCallInst(CallInst &call) {
       // datatype
       // op
       // comm
+      // request
+      if (funcName == "MPI_Iallreduce")
+        updateAnalysis(call.getOperand(6),
+                       TypeTree(BaseType::Pointer).Only(-1), &call);
       // result
       updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
       return;
@@ -3879,8 +3970,6 @@ void TypeAnalyzer::visitCallInst(CallInst &call) {
                      &call);
       updateAnalysis(call.getOperand(6), TypeTree(BaseType::Integer).Only(-1),
                      &call);
-      updateAnalysis(call.getOperand(7), TypeTree(BaseType::Integer).Only(-1),
-                     &call);
       updateAnalysis(call.getOperand(8), TypeTree(BaseType::Integer).Only(-1),
                      &call);
       updateAnalysis(call.getOperand(9), TypeTree(BaseType::Integer).Only(-1),
@@ -3904,7 +3993,8 @@ void TypeAnalyzer::visitCallInst(CallInst &call) {
       updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
       return;
     }
-    if (funcName == "MPI_Allgather") {
+    if (funcName == "MPI_Allgather" || funcName == "MPI_Alltoall" ||
+        funcName == "MPI_Neighbor_alltoall") {
       updateAnalysis(call.getOperand(0), TypeTree(BaseType::Pointer).Only(-1),
                      &call);
       updateAnalysis(call.getOperand(1), TypeTree(BaseType::Integer).Only(-1),
@@ -3916,6 +4006,21 @@ void TypeAnalyzer::visitCallInst(CallInst &call) {
       updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
       return;
     }
+    if (funcName == "MPI_Alltoallv") {
+      TypeTree ints;
+      ints.insert({-1}, BaseType::Pointer);
+      ints.insert({-1, 0}, BaseType::Integer);
+      updateAnalysis(call.getOperand(0), TypeTree(BaseType::Pointer).Only(-1),
+                     &call);
+      updateAnalysis(call.getOperand(1), ints, &call);
+      updateAnalysis(call.getOperand(2), ints, &call);
+      updateAnalysis(call.getOperand(4), TypeTree(BaseType::Pointer).Only(-1),
+                     &call);
+      updateAnalysis(call.getOperand(5), ints, &call);
+      updateAnalysis(call.getOperand(6), ints, &call);
+      updateAnalysis(&call, TypeTree(BaseType::Integer).Only(-1), &call);
+      return;
+    }
     /// END MPI
     if (funcName == "memcpy" || funcName == "memmove") {
       // TODO have this call common mem transfer to copy data
@@ -4840,6 +4945,11 @@ void TypeAnalyzer::visitIPOCall(CallInst &call, Function &fn) {
 
   FnTypeInfo typeInfo = getCallInfo(call, fn);
 
+  // Apply the context-insensitive summary of the callee, only reanalyzing it
+  // for this calling context if the summary is imprecise.
+  if (applySummary(call, fn, typeInfo, hasUp, hasDown))
+    return;
+
   if (EnzymePrintType)
     llvm::errs() << " starting IPO of " << call << "\n";
 
@@ -4878,6 +4988,120 @@ void TypeAnalyzer::visitIPOCall(CallInst &call, Function &fn) {
   }
 }
 
+bool TypeAnalyzer::applySummary(CallInst &call, Function &fn,
+                                const FnTypeInfo &typeInfo, bool hasUp,
+                                bool hasDown) {
+  // Prefer the summary embedded at compile time over deriving it again
+  TypeTree SummaryReturn;
+  std::vector<TypeTree> SummaryArgs;
+  if (auto Embedded = getFunctionSummary(&fn)) {
+    SummaryReturn = Embedded->Return;
+    SummaryArgs = Embedded->Arguments;
+  } else {
+    // Deriving a summary is only worthwhile if it often spares the analysis
+    // of the callee in its calling context, which is not the common case.
+    if (!EnzymeTypeSummaries)
+      return false;
+
+    // The summary of a recursive function is incomplete while it is computed
+    if (interprocedural.PendingSummaries.count(&fn))
+      return false;
+
+    TypeResults Summary = interprocedural.analyzeSummary(&fn);
+    SummaryReturn = Summary.getReturnAnalysis();
+    for (auto &arg : fn.args())
+      SummaryArgs.push_back(Summary.query(&arg));
+  }
+
+  // The summary is exact if the calling context adds nothing to it, as
+  // analyzing the callee from the context would reach the same fixpoint.
+  bool exact = true;
+  for (auto &pair : typeInfo.KnownValues)
+    if (!pair.second.empty())
+      exact = false;
+  for (auto &pair : typeInfo.Arguments) {
+    TypeTree tmp = SummaryArgs[pair.first->getArgNo()];
+    bool Legal = true;
+    if (tmp.checkedOrIn(pair.second, /*PointerIntSame*/ false, Legal) ||
+        !Legal)
+      exact = false;
+  }
+  {
+    TypeTree tmp = SummaryReturn;
+    bool Legal = true;
+    if (tmp.checkedOrIn(typeInfo.Return, /*PointerIntSame*/ false, Legal) ||
+        !Legal)
+      exact = false;
+  }
+
+  if (EnzymePrintType)
+    llvm::errs() << " applying summary of " << fn.getName() << " to " << call
+                 << " exact=" << exact << "\n";
+
+  if (hasUp) {
+    auto a = fn.arg_begin();
+#if LLVM_VERSION_MAJOR >= 14
+    for (auto &arg : call.args())
+#else
+    for (auto &arg : call.arg_operands())
+#endif
+    {
+      updateAnalysis(arg, SummaryArgs[a->getArgNo()], &call);
+      ++a;
+    }
+  }
+
+  if (hasDown) {
+    TypeTree vd = SummaryReturn;
+    if (call.getType()->isIntOrIntVectorTy() &&
+        vd.Inner0() == BaseType::Anything) {
+      bool returned = false;
+      if (mustRemainInteger(&call, &returned) && !returned) {
+        vd = TypeTree(BaseType::Integer).Only(-1);
+      }
+    }
+    updateAnalysis(&call, vd, &call);
+  }
+
+  if (exact) {
+    ++NumTypeSummaryHits;
+    return true;
+  }
+
+  // Otherwise the summary is sufficient if it determined everything this
+  // call needs.
+  if (hasDown && !getAnalysis(&call).IsFullyDetermined())
+    return false;
+  if (hasUp) {
+#if LLVM_VERSION_MAJOR >= 14
+    for (auto &arg : call.args())
+#else
+    for (auto &arg : call.arg_operands())
+#endif
+    {
+      if (isa<ConstantData>(arg))
+        continue;
+      if (!getAnalysis(arg).IsFullyDetermined())
+        return false;
+    }
+  }
+  ++NumTypeSummaryHits;
+  return true;
+}
+
+TypeResults TypeAnalysis::analyzeSummary(Function *F) {
+  FnTypeInfo fn(F);
+  for (auto &arg : F->args()) {
+    fn.Arguments.insert(std::pair<Argument *, TypeTree>(&arg, TypeTree()));
+    fn.KnownValues.insert(
+        std::pair<Argument *, std::set<int64_t>>(&arg, std::set<int64_t>()));
+  }
+  PendingSummaries.insert(F);
+  TypeResults Result = analyzeFunction(fn);
+  PendingSummaries.erase(F);
+  return Result;
+}
+
 TypeResults TypeAnalysis::analyzeFunction(const FnTypeInfo &fn) {
   assert(fn.KnownValues.size() ==
          fn.Function->getFunctionType()->getNumParams());
@@ -4893,9 +5117,13 @@ TypeResults TypeAnalysis::analyzeFunction(const FnTypeInfo &fn) {
     }
     assert(analysis.fntypeinfo.Function == fn.Function);
 
+    if (analysis.Invalid)
+      SawIllegal = true;
     return TypeResults(analysis);
   }
 
+  PhaseTimer timer(EnzymePhase::TypeAnalysis);
+  ++NumTypeAnalysisFunctions;
   auto res = analyzedFunctions.emplace(fn, new TypeAnalyzer(fn, *this));
   auto &analysis = *res.first->second;
 
@@ -5131,4 +5359,32 @@ std::set<int64_t> TypeAnalyzer::knownIntegralValues(Value *val) {
   return fntypeinfo.knownIntegralValues(val, DT, intseen, SE);
 }
 
+void TypeAnalysis::invalidate(Function *F) {
+  // The analyses of callers were derived from the body of F, and so on
+  // transitively. Analyses of callees only depend on the calling context
+  // they are keyed by and remain valid.
+  SmallPtrSet<Function *, 4> Stale = {F};
+  SmallVector<Function *, 4> todo = {F};
+  while (!todo.empty()) {
+    Function *cur = todo.pop_back_val();
+    SmallVector<User *, 4> users(cur->users());
+    while (!users.empty()) {
+      User *U = users.pop_back_val();
+      if (auto I = dyn_cast<Instruction>(U)) {
+        Function *caller = I->getParent()->getParent();
+        if (Stale.insert(caller).second)
+          todo.push_back(caller);
+      } else if (isa<ConstantExpr>(U)) {
+        users.append(U->user_begin(), U->user_end());
+      }
+    }
+  }
+  for (auto it = analyzedFunctions.begin(); it != analyzedFunctions.end();) {
+    if (Stale.count(it->first.Function))
+      it = analyzedFunctions.erase(it);
+    else
+      ++it;
+  }
+}
+
 void TypeAnalysis::clear() { analyzedFunctions.clear(); }
@@ -337,6 +337,12 @@ public:
 
   void visitIPOCall(llvm::CallInst &call, llvm::Function &fn);
 
+  /// Update the arguments and result of \p call from the summary of \p fn,
+  /// returning whether the summary makes analyzing \p fn in the calling
+  /// context \p typeInfo unnecessary
+  bool applySummary(llvm::CallInst &call, llvm::Function &fn,
+                    const FnTypeInfo &typeInfo, bool hasUp, bool hasDown);
+
   void visitInvokeInst(llvm::InvokeInst &call);
   void visitCallInst(llvm::CallInst &call);
 
@@ -373,6 +379,28 @@ public:
   /// Analyze a particular function, returning the results
   TypeResults analyzeFunction(const FnTypeInfo &fn);
 
+  /// Analyze \p F without any information about its arguments, return or
+  /// known integral values. The results hold for every call of \p F, and
+  /// are computed once per function.
+  TypeResults analyzeSummary(llvm::Function *F);
+
+  /// Functions whose summary is currently being computed
+  std::set<llvm::Function *> PendingSummaries;
+
+  /// Whether an illegal type merge stops the analysis of the function it
+  /// occurs in, rather than aborting. Used by clients which analyze code that
+  /// may never be differentiated.
+  bool RecoverIllegal = false;
+
+  /// Whether an analysis was stopped by an illegal type merge, if
+  /// RecoverIllegal is set. Reset by the client.
+  bool SawIllegal = false;
+
+  /// Remove all analyses of \p F and of its transitive callers, which must be
+  /// called if the body of \p F is modified while this TypeAnalysis is still
+  /// in use
+  void invalidate(llvm::Function *F);
+
   /// Clear existing analyses
   void clear();
 };
@@ -28,11 +28,15 @@
 // rather than limiting the depth.
 //
 //===----------------------------------------------------------------------===//
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
 
 #include "llvm/Support/CommandLine.h"
 
+#include <mutex>
+
 #include "TypeTree.h"
 
 using namespace llvm;
@@ -46,3 +50,98 @@ llvm::cl::opt<bool> EnzymeTypeWarning("enzyme-type-warning", cl::init(true),
                                       cl::Hidden,
                                       cl::desc("Print Type Depth Warning"));
 }
+
+namespace {
+struct TypeTreeStorageInfo {
+  static TypeTreeStorage *getEmptyKey() {
+    return DenseMapInfo<TypeTreeStorage *>::getEmptyKey();
+  }
+  static TypeTreeStorage *getTombstoneKey() {
+    return DenseMapInfo<TypeTreeStorage *>::getTombstoneKey();
+  }
+  static unsigned getHashValue(const TypeTreeStorage *S) { return S->Hash; }
+  static bool isEqual(const TypeTreeStorage *LHS, const TypeTreeStorage *RHS) {
+    if (LHS == RHS)
+      return true;
+    if (LHS == getEmptyKey() || LHS == getTombstoneKey() ||
+        RHS == getEmptyKey() || RHS == getTombstoneKey())
+      return false;
+    return LHS->Hash == RHS->Hash &&
+           ArrayRef<TypeTreeEntry>(LHS->Entries) ==
+               ArrayRef<TypeTreeEntry>(RHS->Entries);
+  }
+};
+} // namespace
+
+/// All interned storage. This is intentionally leaked so that TypeTrees
+/// destroyed during static destruction can still be released.
+static DenseSet<TypeTreeStorage *, TypeTreeStorageInfo> &getInternTable() {
+  static auto *Table = new DenseSet<TypeTreeStorage *, TypeTreeStorageInfo>();
+  return *Table;
+}
+
+/// Guards the intern table, and the release of the last reference to
+/// interned storage, which must not race with the storage being found in the
+/// table by another thread.
+static std::mutex &getInternMutex() {
+  static auto *Mutex = new std::mutex();
+  return *Mutex;
+}
+
+void TypeTreeStorage::Release() const {
+  if (!Interned) {
+    unsigned Prev = RefCount.fetch_sub(1);
+    (void)Prev;
+    assert(Prev > 0);
+    if (Prev == 1)
+      delete this;
+    return;
+  }
+
+  // Dropping a reference which is not the last needs no lock, as the holder
+  // of another reference keeps the storage alive.
+  unsigned Count = RefCount.load();
+  while (Count > 1)
+    if (RefCount.compare_exchange_weak(Count, Count - 1))
+      return;
+
+  std::lock_guard<std::mutex> Lock(getInternMutex());
+  if (RefCount.fetch_sub(1) != 1)
+    return;
+  getInternTable().erase(const_cast<TypeTreeStorage *>(this));
+  delete this;
+}
+
+IntrusiveRefCntPtr<TypeTreeStorage>
+TypeTreeStorage::intern(TypeTreeStorage *S) {
+  assert(!S->Interned);
+  hash_code H = hash_value(S->Entries.size());
+  for (const auto &Entry : S->Entries) {
+    H = hash_combine(H, hash_combine_range(Entry.first.begin(),
+                                           Entry.first.end()));
+    H = hash_combine(H, (unsigned)Entry.second.SubTypeEnum,
+                     Entry.second.SubType);
+  }
+  unsigned Hash = (unsigned)(size_t)H;
+
+  // Storage shared with other trees, which may belong to other threads, is
+  // not marked interned in place
+  if (S->RefCount.load() > 1)
+    S = new TypeTreeStorage(S->Entries);
+  S->Hash = Hash;
+
+  std::lock_guard<std::mutex> Lock(getInternMutex());
+  auto &Table = getInternTable();
+  auto Found = Table.find(S);
+  if (Found != Table.end()) {
+    // Take the reference while holding the lock, such that the storage
+    // cannot be released concurrently
+    IntrusiveRefCntPtr<TypeTreeStorage> Result(*Found);
+    if (S->RefCount.load() == 0)
+      delete S;
+    return Result;
+  }
+  S->Interned = true;
+  Table.insert(S);
+  return IntrusiveRefCntPtr<TypeTreeStorage>(S);
+}
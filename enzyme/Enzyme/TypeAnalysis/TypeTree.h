@@ -31,9 +31,15 @@
 #ifndef ENZYME_TYPE_ANALYSIS_TYPE_TREE_H
 #define ENZYME_TYPE_ANALYSIS_TYPE_TREE_H 1
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
 #include <vector>
@@ -49,7 +55,7 @@ constexpr int EnzymeMaxTypeDepth = 6;
 }
 
 /// Helper function to print a vector of ints to a string
-static inline std::string to_string(const std::vector<int> x) {
+static inline std::string to_string(llvm::ArrayRef<int> x) {
   std::string out = "[";
   for (unsigned i = 0; i < x.size(); ++i) {
     if (i != 0)
@@ -63,49 +69,197 @@ static inline std::string to_string(const std::vector<int> x) {
 class TypeTree;
 
 typedef std::shared_ptr<const TypeTree> TypeResult;
-typedef std::map<const std::vector<int>, ConcreteType> ConcreteTypeMapType;
 typedef std::map<const std::vector<int>, const TypeResult> TypeTreeMapType;
 
+/// A sequence of offsets, one per pointer indirection, into a TypeTree. Each
+/// offset is a byte offset or -1 for all offsets. As trees never exceed
+/// EnzymeMaxTypeDepth indirections, the offsets are stored inline.
+class TypeTreePath {
+private:
+  uint8_t Len = 0;
+  int Data[EnzymeMaxTypeDepth];
+
+public:
+  TypeTreePath() {}
+  TypeTreePath(llvm::ArrayRef<int> Seq) : Len(Seq.size()) {
+    assert(Seq.size() <= EnzymeMaxTypeDepth);
+    std::copy(Seq.begin(), Seq.end(), Data);
+  }
+
+  size_t size() const { return Len; }
+  bool empty() const { return Len == 0; }
+  int *begin() { return Data; }
+  int *end() { return Data + Len; }
+  const int *begin() const { return Data; }
+  const int *end() const { return Data + Len; }
+  int &operator[](size_t i) {
+    assert(i < Len);
+    return Data[i];
+  }
+  int operator[](size_t i) const {
+    assert(i < Len);
+    return Data[i];
+  }
+  int &back() { return (*this)[Len - 1]; }
+  int back() const { return (*this)[Len - 1]; }
+  void push_back(int Off) {
+    assert(Len < EnzymeMaxTypeDepth);
+    Data[Len++] = Off;
+  }
+  void pop_back() {
+    assert(Len > 0);
+    --Len;
+  }
+  operator llvm::ArrayRef<int>() const { return llvm::ArrayRef<int>(Data, Len); }
+
+  bool operator==(const TypeTreePath &RHS) const {
+    return llvm::ArrayRef<int>(*this) == llvm::ArrayRef<int>(RHS);
+  }
+  bool operator!=(const TypeTreePath &RHS) const { return !(*this == RHS); }
+  bool operator<(const TypeTreePath &RHS) const {
+    return std::lexicographical_compare(begin(), end(), RHS.begin(),
+                                        RHS.end());
+  }
+};
+
+typedef std::pair<TypeTreePath, ConcreteType> TypeTreeEntry;
+
+/// The entries of a TypeTree sorted by offset path. Storage is shared
+/// between copies of a tree and copied on write. Interned storage is
+/// additionally shared between all trees with the same entries, across
+/// threads, so reference counts are atomic and the intern table is locked.
+class TypeTreeStorage {
+private:
+  mutable std::atomic<unsigned> RefCount{0};
+
+public:
+  /// Whether this storage is in the intern table, and thus immutable. Only
+  /// set while the storage is not yet shared.
+  bool Interned = false;
+  /// Hash of the entries, valid if interned
+  unsigned Hash = 0;
+  llvm::SmallVector<TypeTreeEntry, 2> Entries;
+
+  TypeTreeStorage() {}
+  TypeTreeStorage(llvm::ArrayRef<TypeTreeEntry> Entries)
+      : Entries(Entries.begin(), Entries.end()) {}
+
+  /// Whether this storage may not be modified in place
+  bool isShared() const { return Interned || RefCount > 1; }
+
+  void Retain() const { ++RefCount; }
+  void Release() const;
+
+  /// Return the interned storage with the same entries as \p S
+  static llvm::IntrusiveRefCntPtr<TypeTreeStorage>
+  intern(TypeTreeStorage *S);
+};
+
 /// Class representing the underlying types of values as
 /// sequences of offsets to a ConcreteType
 class TypeTree : public std::enable_shared_from_this<TypeTree> {
 private:
-  // mapping of known indices to type if one exists
-  ConcreteTypeMapType mapping;
-  std::vector<int> minIndices;
+  // mapping of known indices to type if one exists, null if empty
+  llvm::IntrusiveRefCntPtr<TypeTreeStorage> Storage;
+  TypeTreePath minIndices;
+
+  /// Lookup the entry for the exact offset sequence, if one exists
+  const TypeTreeEntry *find(llvm::ArrayRef<int> Seq) const {
+    auto Entries = getMapping();
+    auto Found = std::lower_bound(
+        Entries.begin(), Entries.end(), Seq,
+        [](const TypeTreeEntry &Entry, llvm::ArrayRef<int> Seq) {
+          return std::lexicographical_compare(
+              Entry.first.begin(), Entry.first.end(), Seq.begin(), Seq.end());
+        });
+    if (Found != Entries.end() && llvm::ArrayRef<int>(Found->first) == Seq)
+      return Found;
+    return nullptr;
+  }
+
+  /// The entries of this tree, to be modified in place
+  llvm::SmallVectorImpl<TypeTreeEntry> &getMutableMapping() {
+    if (!Storage)
+      Storage = new TypeTreeStorage();
+    else if (Storage->isShared())
+      Storage = new TypeTreeStorage(Storage->Entries);
+    return Storage->Entries;
+  }
+
+  /// Add an entry if none exists for the offset sequence, returning whether
+  /// it was added
+  bool insertEntry(llvm::ArrayRef<int> Seq, ConcreteType CT) {
+    auto Entries = getMapping();
+    size_t Idx = std::lower_bound(
+                     Entries.begin(), Entries.end(), Seq,
+                     [](const TypeTreeEntry &Entry, llvm::ArrayRef<int> Seq) {
+                       return std::lexicographical_compare(
+                           Entry.first.begin(), Entry.first.end(),
+                           Seq.begin(), Seq.end());
+                     }) -
+                 Entries.begin();
+    if (Idx != Entries.size() && llvm::ArrayRef<int>(Entries[Idx].first) == Seq)
+      return false;
+    auto &Mutable = getMutableMapping();
+    Mutable.insert(Mutable.begin() + Idx, TypeTreeEntry(Seq, CT));
+    return true;
+  }
+
+  /// Remove the entry for the offset sequence, if one exists
+  void eraseEntry(llvm::ArrayRef<int> Seq) {
+    auto Found = find(Seq);
+    if (!Found)
+      return;
+    size_t Idx = Found - getMapping().begin();
+    auto &Mutable = getMutableMapping();
+    Mutable.erase(Mutable.begin() + Idx);
+    if (Mutable.empty())
+      Storage = nullptr;
+  }
 
 public:
   TypeTree() {}
   TypeTree(ConcreteType dat) {
     if (dat != ConcreteType(BaseType::Unknown)) {
-      mapping.insert(std::pair<const std::vector<int>, ConcreteType>({}, dat));
+      insertEntry({}, dat);
+      intern();
     }
   }
 
   /// Utility helper to lookup the mapping
-  const ConcreteTypeMapType &getMapping() const { return mapping; }
+  llvm::ArrayRef<TypeTreeEntry> getMapping() const {
+    if (!Storage)
+      return {};
+    return Storage->Entries;
+  }
+
+  /// Share the storage of this tree with all other interned trees with the
+  /// same entries
+  void intern() {
+    if (Storage && !Storage->Interned)
+      Storage = TypeTreeStorage::intern(Storage.get());
+  }
 
   /// Lookup the underlying ConcreteType at a given offset sequence
   /// or Unknown if none exists
-  ConcreteType operator[](const std::vector<int> Seq) const {
-    auto Found0 = mapping.find(Seq);
-    if (Found0 != mapping.end())
+  ConcreteType operator[](llvm::ArrayRef<int> Seq) const {
+    if (auto Found0 = find(Seq))
       return Found0->second;
     size_t Len = Seq.size();
-    if (Len == 0)
+    if (Len == 0 || Len > EnzymeMaxTypeDepth)
       return BaseType::Unknown;
 
-    std::vector<std::vector<int>> todo[2];
+    llvm::SmallVector<TypeTreePath, 4> todo[2];
     todo[0].push_back({});
     int parity = 0;
     for (size_t i = 0, Len = Seq.size(); i < Len - 1; ++i) {
       for (auto prev : todo[parity]) {
         prev.push_back(-1);
-        if (mapping.find(prev) != mapping.end())
+        if (find(prev))
           todo[1 - parity].push_back(prev);
         if (Seq[i] != -1) {
           prev.back() = Seq[i];
-          if (mapping.find(prev) != mapping.end())
+          if (find(prev))
             todo[1 - parity].push_back(prev);
         }
       }
@@ -116,13 +270,11 @@ public:
     size_t i = Len - 1;
     for (auto prev : todo[parity]) {
       prev.push_back(-1);
-      auto Found = mapping.find(prev);
-      if (Found != mapping.end())
+      if (auto Found = find(prev))
         return Found->second;
       if (Seq[i] != -1) {
         prev.back() = Seq[i];
-        Found = mapping.find(prev);
-        if (Found != mapping.end())
+        if (auto Found = find(prev))
           return Found->second;
       }
     }
@@ -132,19 +284,22 @@ public:
   // Return true if this type tree is fully known (i.e. there
   // is no more information which could be added).
   bool IsFullyDetermined() const {
-    std::vector<int> offsets = {-1};
+    TypeTreePath offsets;
+    offsets.push_back(-1);
     while (1) {
-      auto found = mapping.find(offsets);
-      if (found == mapping.end())
+      auto found = find(offsets);
+      if (!found)
         return false;
       if (found->second != BaseType::Pointer)
         return true;
+      if (offsets.size() == EnzymeMaxTypeDepth)
+        return false;
       offsets.push_back(-1);
     }
   }
 
   /// Return if changed
-  bool insert(const std::vector<int> Seq, ConcreteType CT,
+  bool insert(llvm::ArrayRef<int> Seq, ConcreteType CT,
               bool intsAreLegalSubPointer = false) {
     size_t SeqSize = Seq.size();
     if (SeqSize > EnzymeMaxTypeDepth) {
@@ -156,18 +311,17 @@ public:
       return false;
     }
     if (SeqSize == 0) {
-      mapping.insert(std::pair<const std::vector<int>, ConcreteType>(Seq, CT));
+      insertEntry(Seq, CT);
       return true;
     }
 
     // check types at lower pointer offsets are either pointer or
     // anything. Don't insert into an anything
     {
-      std::vector<int> tmp(Seq);
+      TypeTreePath tmp(Seq);
       while (tmp.size() > 0) {
-        tmp.erase(tmp.end() - 1);
-        auto found = mapping.find(tmp);
-        if (found != mapping.end()) {
+        tmp.pop_back();
+        if (auto found = find(tmp)) {
           if (found->second == BaseType::Anything)
             return false;
           if (found->second != BaseType::Pointer) {
@@ -184,8 +338,8 @@ public:
 
     // if this is a ending -1, remove other elems if no more info
     if (Seq.back() == -1) {
-      std::set<std::vector<int>> toremove;
-      for (const auto &pair : mapping) {
+      llvm::SmallVector<TypeTreePath, 4> toremove;
+      for (const auto &pair : getMapping()) {
         if (pair.first.size() != SeqSize)
           continue;
         bool matches = true;
@@ -200,12 +354,12 @@ public:
 
         if (intsAreLegalSubPointer && pair.second == BaseType::Integer &&
             CT == BaseType::Pointer) {
-          toremove.insert(pair.first);
+          toremove.push_back(pair.first);
         } else {
           if (CT == pair.second) {
             // previous equivalent values or values overwritten by
             // an anything are removed
-            toremove.insert(pair.first);
+            toremove.push_back(pair.first);
           } else if (pair.second != BaseType::Anything) {
             llvm::errs() << "inserting into : " << str() << " with "
                          << to_string(Seq) << " of " << CT.str() << "\n";
@@ -215,15 +369,15 @@ public:
       }
 
       for (const auto &val : toremove) {
-        mapping.erase(val);
+        eraseEntry(val);
         changed = true;
       }
     }
 
     // if this is a starting -1, remove other -1's
     if (Seq[0] == -1) {
-      std::set<std::vector<int>> toremove;
-      for (const auto &pair : mapping) {
+      llvm::SmallVector<TypeTreePath, 4> toremove;
+      for (const auto &pair : getMapping()) {
         if (pair.first.size() != SeqSize)
           continue;
         bool matches = true;
@@ -237,12 +391,12 @@ public:
           continue;
         if (intsAreLegalSubPointer && pair.second == BaseType::Integer &&
             CT == BaseType::Pointer) {
-          toremove.insert(pair.first);
+          toremove.push_back(pair.first);
         } else {
           if (CT == pair.second) {
             // previous equivalent values or values overwritten by
             // an anything are removed
-            toremove.insert(pair.first);
+            toremove.push_back(pair.first);
           } else if (pair.second != BaseType::Anything) {
             llvm::errs() << "inserting into : " << str() << " with "
                          << to_string(Seq) << " of " << CT.str() << "\n";
@@ -252,7 +406,7 @@ public:
       }
 
       for (const auto &val : toremove) {
-        mapping.erase(val);
+        eraseEntry(val);
         changed = true;
       }
     }
@@ -275,8 +429,8 @@ public:
     }
 
     if (possibleDeletion) {
-      std::vector<std::vector<int>> toErase;
-      for (const auto &pair : mapping) {
+      llvm::SmallVector<TypeTreePath, 4> toErase;
+      for (const auto &pair : getMapping()) {
         size_t i = 0;
         bool mustKeep = false;
         bool considerErase = false;
@@ -296,7 +450,7 @@ public:
       }
 
       for (auto vec : toErase) {
-        mapping.erase(vec);
+        eraseEntry(vec);
         changed = true;
       }
     }
@@ -316,26 +470,32 @@ public:
     }
     if (considerErase && !keep)
       return changed;
-    mapping.insert(std::pair<const std::vector<int>, ConcreteType>(Seq, CT));
+    insertEntry(Seq, CT);
     return true;
   }
 
   /// How this TypeTree compares with another
-  bool operator<(const TypeTree &vd) const { return mapping < vd.mapping; }
+  bool operator<(const TypeTree &vd) const {
+    if (Storage == vd.Storage)
+      return false;
+    auto LHS = getMapping(), RHS = vd.getMapping();
+    return std::lexicographical_compare(LHS.begin(), LHS.end(), RHS.begin(),
+                                        RHS.end());
+  }
 
   /// Whether this TypeTree contains any information
   bool isKnown() const {
-    for (const auto &pair : mapping) {
+    for (const auto &pair : getMapping()) {
       // we should assert here as we shouldn't keep any unknown maps for
       // efficiency
       assert(pair.second.isKnown());
     }
-    return mapping.size() != 0;
+    return getMapping().size() != 0;
   }
 
   /// Whether this TypeTree knows any non-pointer information
   bool isKnownPastPointer() const {
-    for (auto &pair : mapping) {
+    for (auto &pair : getMapping()) {
       // we should assert here as we shouldn't keep any unknown maps for
       // efficiency
       assert(pair.second.isKnown());
@@ -352,7 +512,7 @@ public:
   /// Select only the Integer ConcreteTypes
   TypeTree JustInt() const {
     TypeTree vd;
-    for (auto &pair : mapping) {
+    for (auto &pair : getMapping()) {
       if (pair.second == BaseType::Integer) {
         vd.insert(pair.first, pair.second);
       }
@@ -364,29 +524,32 @@ public:
   /// Prepend an offset to all mappings
   TypeTree Only(int Off) const {
     TypeTree Result;
-    Result.minIndices.reserve(1 + minIndices.size());
     Result.minIndices.push_back(Off);
-    for (auto midx : minIndices)
-      Result.minIndices.push_back(midx);
+    for (size_t i = 0, Len = minIndices.size(); i < Len; i++) {
+      if (i + 1 == EnzymeMaxTypeDepth)
+        break;
+      Result.minIndices.push_back(minIndices[i]);
+    }
 
-    if (Result.minIndices.size() > EnzymeMaxTypeDepth) {
-      Result.minIndices.pop_back();
+    if (minIndices.size() + 1 > EnzymeMaxTypeDepth) {
       if (EnzymeTypeWarning)
         llvm::errs() << "not handling more than " << EnzymeMaxTypeDepth
                      << " pointer lookups deep dt:" << str() << " only(" << Off
                      << "): " << str() << "\n";
     }
 
-    for (const auto &pair : mapping) {
+    // Prepending an offset preserves the order of the entries
+    llvm::SmallVectorImpl<TypeTreeEntry> *Entries = nullptr;
+    for (const auto &pair : getMapping()) {
       if (pair.first.size() == EnzymeMaxTypeDepth)
         continue;
-      std::vector<int> Vec;
-      Vec.reserve(pair.first.size() + 1);
+      TypeTreePath Vec;
       Vec.push_back(Off);
       for (auto Val : pair.first)
         Vec.push_back(Val);
-      Result.mapping.insert(
-          std::pair<const std::vector<int>, ConcreteType>(Vec, pair.second));
+      if (!Entries)
+        Entries = &Result.getMutableMapping();
+      Entries->emplace_back(Vec, pair.second);
     }
     return Result;
   }
@@ -395,16 +558,15 @@ public:
   TypeTree Data0() const {
     TypeTree Result;
 
-    for (const auto &pair : mapping) {
+    for (const auto &pair : getMapping()) {
       if (pair.first.size() == 0) {
         llvm::errs() << str() << "\n";
       }
       assert(pair.first.size() != 0);
 
       if (pair.first[0] == -1) {
-        std::vector<int> next(pair.first.begin() + 1, pair.first.end());
-        Result.mapping.insert(
-            std::pair<const std::vector<int>, ConcreteType>(next, pair.second));
+        TypeTreePath next(llvm::ArrayRef<int>(pair.first).drop_front());
+        Result.insertEntry(next, pair.second);
         for (size_t i = 0, Len = next.size(); i < Len; ++i) {
           if (i == Result.minIndices.size())
             Result.minIndices.push_back(next[i]);
@@ -413,9 +575,9 @@ public:
         }
       }
     }
-    for (const auto &pair : mapping) {
+    for (const auto &pair : getMapping()) {
       if (pair.first[0] == 0) {
-        std::vector<int> next(pair.first.begin() + 1, pair.first.end());
+        TypeTreePath next(llvm::ArrayRef<int>(pair.first).drop_front());
         // We do insertion like this to force an error
         // on the orIn operation if there is an incompatible
         // merge. The insert operation does not error.
@@ -442,7 +604,7 @@ public:
     // to force an error if there is an incompatible
     // merge. The insert operation does not error.
 
-    for (const auto &pair : mapping) {
+    for (const auto &pair : getMapping()) {
       assert(pair.first.size() != 0);
 
       if (pair.first[0] == -1) {
@@ -475,9 +637,9 @@ public:
   TypeTree Lookup(size_t len, const llvm::DataLayout &dl) const {
 
     // Map of indices[1:] => ( End => possible Index[0] )
-    std::map<std::vector<int>, std::map<ConcreteType, std::set<int>>> staging;
+    std::map<TypeTreePath, std::map<ConcreteType, std::set<int>>> staging;
 
-    for (const auto &pair : mapping) {
+    for (const auto &pair : getMapping()) {
       assert(pair.first.size() != 0);
 
       // Pointer is at offset 0 from this object
@@ -496,7 +658,7 @@ public:
           continue;
       }
 
-      std::vector<int> next(pair.first.begin() + 2, pair.first.end());
+      TypeTreePath next(llvm::ArrayRef<int>(pair.first).drop_front(2));
 
       staging[next][pair.second].insert(pair.first[1]);
     }
@@ -542,8 +704,7 @@ public:
           }
         }
 
-        std::vector<int> next;
-        next.reserve(pnext.size() + 1);
+        TypeTreePath next;
         next.push_back(-1);
         for (auto v : pnext)
           next.push_back(v);
@@ -566,7 +727,7 @@ public:
   /// canonicalize this, creating -1's where possible
   void CanonicalizeInPlace(size_t len, const llvm::DataLayout &dl) {
     bool canonicalized = true;
-    for (const auto &pair : mapping) {
+    for (const auto &pair : getMapping()) {
       assert(pair.first.size() != 0);
       if (pair.first[0] != -1) {
         canonicalized = false;
@@ -577,12 +738,11 @@ public:
       return;
 
     // Map of indices[1:] => ( End => possible Index[0] )
-    std::map<const std::vector<int>, std::map<ConcreteType, std::set<int>>>
-        staging;
+    std::map<TypeTreePath, std::map<ConcreteType, std::set<int>>> staging;
 
-    for (const auto &pair : mapping) {
+    for (const auto &pair : getMapping()) {
 
-      std::vector<int> next(pair.first.begin() + 1, pair.first.end());
+      TypeTreePath next(llvm::ArrayRef<int>(pair.first).drop_front());
       if (pair.first[0] != -1) {
         if ((size_t)pair.first[0] >= len) {
           llvm::errs() << str() << "\n";
@@ -593,7 +753,7 @@ public:
       staging[next][pair.second].insert(pair.first[0]);
     }
 
-    mapping.clear();
+    Storage = nullptr;
 
     for (auto &pair : staging) {
       auto &pnext = pair.first;
@@ -638,8 +798,7 @@ public:
           }
         }
 
-        std::vector<int> next;
-        next.reserve(pnext.size() + 1);
+        TypeTreePath next;
         next.push_back(-1);
         for (auto v : pnext)
           next.push_back(v);
@@ -660,7 +819,7 @@ public:
   TypeTree KeepMinusOne(bool &legal) const {
     TypeTree dat;
 
-    for (const auto &pair : mapping) {
+    for (const auto &pair : getMapping()) {
 
       assert(pair.first.size() != 0);
 
@@ -726,7 +885,7 @@ public:
                         const int maxSize, size_t addOffset = 0) const {
     TypeTree Result;
 
-    for (const auto &pair : mapping) {
+    for (const auto &pair : getMapping()) {
       if (pair.first.size() == 0) {
         if (pair.second == BaseType::Pointer ||
             pair.second == BaseType::Anything) {
@@ -739,7 +898,7 @@ public:
         llvm_unreachable("ShiftIndices called on a nonpointer/anything");
       }
 
-      std::vector<int> next(pair.first);
+      TypeTreePath next(pair.first);
 
       if (next[0] == -1) {
         if (maxSize == -1) {
@@ -803,11 +962,11 @@ public:
   /// Keep only mappings where the type is not an `Anything`
   TypeTree PurgeAnything() const {
     TypeTree Result;
-    Result.minIndices.reserve(minIndices.size());
-    for (const auto &pair : mapping) {
+    for (const auto &pair : getMapping()) {
       if (pair.second == ConcreteType(BaseType::Anything))
         continue;
-      Result.mapping.insert(pair);
+      // Filtering preserves the order of the entries
+      Result.getMutableMapping().push_back(pair);
       for (size_t i = 0, Len = pair.first.size(); i < Len; ++i) {
         if (i == Result.minIndices.size())
           Result.minIndices.push_back(pair.first[i]);
@@ -821,10 +980,10 @@ public:
   /// Replace -1 with 0
   TypeTree ReplaceMinus() const {
     TypeTree dat;
-    for (const auto &pair : mapping) {
+    for (const auto &pair : getMapping()) {
       if (pair.second == ConcreteType(BaseType::Anything))
         continue;
-      std::vector<int> nex = pair.first;
+      TypeTreePath nex = pair.first;
       for (auto &v : nex)
         if (v == -1)
           v = 0;
@@ -835,7 +994,12 @@ public:
 
   /// Replace all integer subtypes with anything
   void ReplaceIntWithAnything() {
-    for (auto &pair : mapping) {
+    bool hasInt = false;
+    for (const auto &pair : getMapping())
+      hasInt |= pair.second == BaseType::Integer;
+    if (!hasInt)
+      return;
+    for (auto &pair : getMutableMapping()) {
       if (pair.second == BaseType::Integer) {
         pair.second = BaseType::Anything;
       }
@@ -845,7 +1009,7 @@ public:
   /// Keep only mappings where the type is an `Anything`
   TypeTree JustAnything() const {
     TypeTree dat;
-    for (const auto &pair : mapping) {
+    for (const auto &pair : getMapping()) {
       if (pair.second != ConcreteType(BaseType::Anything))
         continue;
       dat.insert(pair.first, pair.second);
@@ -854,21 +1018,25 @@ public:
   }
 
   /// Chceck equality of two TypeTrees
-  bool operator==(const TypeTree &RHS) const { return mapping == RHS.mapping; }
+  bool operator==(const TypeTree &RHS) const {
+    if (Storage == RHS.Storage)
+      return true;
+    // Interned trees with the same entries share their storage
+    if (Storage && RHS.Storage && Storage->Interned && RHS.Storage->Interned)
+      return false;
+    return getMapping() == RHS.getMapping();
+  }
 
   /// Set this to another TypeTree, returning if this was changed
   bool operator=(const TypeTree &RHS) {
     if (*this == RHS)
       return false;
     minIndices = RHS.minIndices;
-    mapping.clear();
-    for (const auto &elems : RHS.mapping) {
-      mapping.emplace(elems);
-    }
+    Storage = RHS.Storage;
     return true;
   }
 
-  bool checkedOrIn(const std::vector<int> &Seq, ConcreteType RHS,
+  bool checkedOrIn(llvm::ArrayRef<int> Seq, ConcreteType RHS,
                    bool PointerIntSame, bool &LegalOr) {
     assert(RHS != BaseType::Unknown);
     ConcreteType CT = operator[](Seq);
@@ -882,9 +1050,7 @@ public:
     if (Seq.size() > 0) {
       // check pointer abilities from before
       {
-        std::vector<int> tmp(Seq.begin(), Seq.end() - 1);
-        auto found = mapping.find(tmp);
-        if (found != mapping.end()) {
+        if (auto found = find(Seq.drop_back())) {
           if (!(found->second == BaseType::Pointer ||
                 found->second == BaseType::Anything)) {
             LegalOr = false;
@@ -895,8 +1061,8 @@ public:
 
       // if this is a ending -1, remove other elems if no more info
       if (Seq.back() == -1) {
-        std::set<std::vector<int>> toremove;
-        for (const auto &pair : mapping) {
+        llvm::SmallVector<TypeTreePath, 4> toremove;
+        for (const auto &pair : getMapping()) {
           if (pair.first.size() == Seq.size()) {
             bool matches = true;
             for (unsigned i = 0; i < pair.first.size() - 1; ++i) {
@@ -911,7 +1077,7 @@ public:
             if (CT == BaseType::Anything || CT == pair.second) {
               // previous equivalent values or values overwritten by
               // an anything are removed
-              toremove.insert(pair.first);
+              toremove.push_back(pair.first);
             } else if (CT != BaseType::Anything &&
                        pair.second == BaseType::Anything) {
               // keep lingering anythings if not being overwritten
@@ -922,14 +1088,14 @@ public:
           }
         }
         for (const auto &val : toremove) {
-          mapping.erase(val);
+          eraseEntry(val);
         }
       }
 
       // if this is a starting -1, remove other -1's
       if (Seq[0] == -1) {
-        std::set<std::vector<int>> toremove;
-        for (const auto &pair : mapping) {
+        llvm::SmallVector<TypeTreePath, 4> toremove;
+        for (const auto &pair : getMapping()) {
           if (pair.first.size() == Seq.size()) {
             bool matches = true;
             for (unsigned i = 1; i < pair.first.size(); ++i) {
@@ -944,7 +1110,7 @@ public:
             if (CT == BaseType::Anything || CT == pair.second) {
               // previous equivalent values or values overwritten by
               // an anything are removed
-              toremove.insert(pair.first);
+              toremove.push_back(pair.first);
             } else if (CT != BaseType::Anything &&
                        pair.second == BaseType::Anything) {
               // keep lingering anythings if not being overwritten
@@ -956,7 +1122,7 @@ public:
         }
 
         for (const auto &val : toremove) {
-          mapping.erase(val);
+          eraseEntry(val);
         }
       }
     }
@@ -964,14 +1130,6 @@ public:
     return insert(Seq, CT);
   }
 
-  bool orIn(const std::vector<int> &Seq, ConcreteType RHS,
-            bool PointerIntSame = false) {
-    bool LegalOr = true;
-    bool Result = checkedOrIn(Seq, RHS, PointerIntSame, LegalOr);
-    assert(LegalOr);
-    return Result;
-  }
-
   /// Set this to the logical or of itself and RHS, returning whether this value
   /// changed Setting `PointerIntSame` considers pointers and integers as
   /// equivalent If this is an illegal operation, `LegalOr` will be set to false
@@ -979,7 +1137,7 @@ public:
     // TODO detect recursive merge and simplify
 
     bool changed = false;
-    for (auto &pair : RHS.mapping) {
+    for (auto &pair : RHS.getMapping()) {
       changed |= checkedOrIn(pair.first, pair.second, PointerIntSame, LegalOr);
     }
     return changed;
@@ -1000,10 +1158,19 @@ public:
     return Result;
   }
 
+  /// Set this to the logical or of itself and RHS, returning whether this value
+  /// changed. An illegal Operation is only diagnosed in builds with assertions
+  bool orIn(llvm::ArrayRef<int> Seq, ConcreteType RHS) {
+    bool LegalOr = true;
+    bool Result = checkedOrIn(Seq, RHS, /*PointerIntSame*/ false, LegalOr);
+    assert(LegalOr);
+    return Result;
+  }
+
   /// Set this to the logical or of itself and RHS, returning whether this value
   /// changed Setting `PointerIntSame` considers pointers and integers as
   /// equivalent This function will error if doing an illegal Operation
-  bool orIn(const std::vector<int> Seq, ConcreteType CT, bool PointerIntSame) {
+  bool orIn(llvm::ArrayRef<int> Seq, ConcreteType CT, bool PointerIntSame) {
     bool Legal = true;
     bool Result = checkedOrIn(Seq, CT, PointerIntSame, Legal);
     if (!Legal) {
@@ -1029,21 +1196,25 @@ public:
   bool andIn(const TypeTree &RHS) {
     bool changed = false;
 
-    std::vector<std::vector<int>> keystodelete;
-    for (auto &pair : mapping) {
-      ConcreteType other = BaseType::Unknown;
-      auto fd = RHS.mapping.find(pair.first);
-      if (fd != RHS.mapping.end()) {
-        other = fd->second;
-      }
-      changed = (pair.second &= other);
-      if (pair.second == BaseType::Unknown) {
-        keystodelete.push_back(pair.first);
+    if (Storage == RHS.Storage)
+      return false;
+
+    llvm::SmallVector<TypeTreePath, 4> keystodelete;
+    if (Storage) {
+      for (auto &pair : getMutableMapping()) {
+        ConcreteType other = BaseType::Unknown;
+        if (auto fd = RHS.find(pair.first)) {
+          other = fd->second;
+        }
+        changed = (pair.second &= other);
+        if (pair.second == BaseType::Unknown) {
+          keystodelete.push_back(pair.first);
+        }
       }
     }
 
     for (auto &key : keystodelete) {
-      mapping.erase(key);
+      eraseEntry(key);
     }
 
     return changed;
@@ -1060,9 +1231,11 @@ public:
   bool binopIn(const TypeTree &RHS, llvm::BinaryOperator::BinaryOps Op) {
     bool changed = false;
 
-    std::vector<std::vector<int>> toErase;
+    llvm::SmallVector<TypeTreePath, 4> toErase;
+    llvm::SmallVector<TypeTreeEntry, 1> toInsert;
 
-    for (auto &pair : mapping) {
+    for (auto &pair : Storage ? getMutableMapping()
+                              : llvm::MutableArrayRef<TypeTreeEntry>()) {
       // TODO propagate non-first level operands:
       // Special handling is necessary here because a pointer to an int
       // binop with something should not apply the binop rules to the
@@ -1076,8 +1249,7 @@ public:
       ConcreteType RightCT(BaseType::Unknown);
 
       // Mutual mappings
-      auto found = RHS.mapping.find(pair.first);
-      if (found != RHS.mapping.end()) {
+      if (auto found = RHS.find(pair.first)) {
         RightCT = found->second;
       }
 
@@ -1090,7 +1262,7 @@ public:
     }
 
     // mapings just on the right
-    for (auto &pair : RHS.mapping) {
+    for (auto &pair : RHS.getMapping()) {
       // TODO propagate non-first level operands:
       // Special handling is necessary here because a pointer to an int
       // binop with something should not apply the binop rules to the
@@ -1099,17 +1271,20 @@ public:
         continue;
       }
 
-      if (mapping.find(pair.first) == RHS.mapping.end()) {
+      if (!find(pair.first)) {
         ConcreteType CT = BaseType::Unknown;
         changed |= CT.binopIn(pair.second, Op);
         if (CT != BaseType::Unknown) {
-          mapping.insert(std::make_pair(pair.first, CT));
+          toInsert.emplace_back(pair.first, CT);
         }
       }
     }
 
     for (auto vec : toErase) {
-      mapping.erase(vec);
+      eraseEntry(vec);
+    }
+    for (auto &pair : toInsert) {
+      insertEntry(pair.first, pair.second);
     }
 
     return changed;
@@ -1119,7 +1294,7 @@ public:
   std::string str() const {
     std::string out = "{";
     bool first = true;
-    for (auto &pair : mapping) {
+    for (auto &pair : getMapping()) {
       if (!first) {
         out += ", ";
       }
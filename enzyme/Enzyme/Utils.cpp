@@ -23,6 +23,7 @@
 //
 //===----------------------------------------------------------------------===//
 #include "Utils.h"
+#include "FunctionSummary.h"
 #include "TypeAnalysis/TypeAnalysis.h"
 
 #include "SCEV/ScalarEvolution.h"
@@ -37,6 +38,8 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 
+#include "llvm/Analysis/VectorUtils.h"
+
 #include "llvm-c/Core.h"
 
 #include "LibraryFuncs.h"
@@ -54,6 +57,44 @@ void (*CustomRuntimeInactiveError)(LLVMBuilderRef, LLVMValueRef,
                                    LLVMValueRef) = nullptr;
 LLVMValueRef (*EnzymePostCacheStore)(LLVMValueRef, LLVMBuilderRef,
                                      LLVMValueRef *) = nullptr;
+LLVMValueRef (*CustomTapeAllocator)(LLVMBuilderRef,
+                                    /*Size*/ LLVMValueRef) = nullptr;
+LLVMValueRef (*CustomTapeReallocator)(LLVMBuilderRef, /*Ptr*/ LLVMValueRef,
+                                      /*OldSize*/ LLVMValueRef,
+                                      /*NewSize*/ LLVMValueRef) = nullptr;
+LLVMValueRef (*CustomTapeDeallocator)(LLVMBuilderRef, LLVMValueRef) = nullptr;
+llvm::cl::opt<bool> EnzymeTapeArena(
+    "enzyme-tape-arena", cl::init(false), cl::Hidden,
+    cl::desc("Allocate cache buffers out of a reusable thread-local arena"));
+llvm::cl::opt<unsigned long long> EnzymeTapeArenaLimit(
+    "enzyme-tape-arena-limit", cl::init(1ULL << 30), cl::Hidden,
+    cl::desc("Most bytes the chunks of the tape arena may hold. Allocations "
+             "beyond it fall back to malloc, so that caches which are never "
+             "freed do not grow the arena for the life of the thread "
+             "(0 disables)"));
+llvm::cl::opt<unsigned long long> EnzymeTapeMmapThreshold(
+    "enzyme-tape-mmap-threshold", cl::init(0), cl::Hidden,
+    cl::desc("Back cache buffers of at least this many bytes by memory mapped "
+             "temporary files rather than the heap (0 disables)"));
+llvm::cl::opt<std::string> EnzymeTapeMmapDir(
+    "enzyme-tape-mmap-dir", cl::init("/tmp"), cl::Hidden,
+    cl::desc("Directory holding the temporary files of memory mapped caches"));
+llvm::cl::opt<unsigned> EnzymeTapeMmapPrefetch(
+    "enzyme-tape-mmap-prefetch", cl::init(4 << 20), cl::Hidden,
+    cl::desc("Bytes of a memory mapped cache the reverse pass asks to be read "
+             "ahead of its use, rounded up to a power of two"));
+llvm::cl::opt<bool> EnzymeSegmentedCache(
+    "enzyme-segmented-cache", cl::init(false), cl::Hidden,
+    cl::desc("Cache the iterations of dynamic loops in a list of fixed size "
+             "segments rather than a buffer reallocated as the loop runs"));
+llvm::cl::opt<unsigned> EnzymeCacheSegmentIterations(
+    "enzyme-cache-segment-iterations", cl::init(1024), cl::Hidden,
+    cl::desc("Number of dynamic loop iterations held by one cache segment, "
+             "rounded up to a power of two"));
+llvm::cl::opt<bool> EnzymeVectorShadow(
+    "enzyme-vector-shadow", cl::init(false), cl::Hidden,
+    cl::desc("Emit the floating point arithmetic of vector mode shadows and "
+             "batched values as vector instructions"));
 }
 
 llvm::SmallVector<llvm::Instruction *, 2> PostCacheStore(llvm::StoreInst *SI,
@@ -70,11 +111,711 @@ llvm::SmallVector<llvm::Instruction *, 2> PostCacheStore(llvm::StoreInst *SI,
   return res;
 }
 
+bool useTapeMmap() { return EnzymeTapeMmapThreshold && !CustomTapeAllocator; }
+
+bool useTapeArena() {
+  return EnzymeTapeArena || CustomTapeAllocator || useTapeMmap();
+}
+
+bool useSegmentedCache() {
+  return EnzymeSegmentedCache && !useTapeArena() && !CustomAllocator;
+}
+
+unsigned getCacheSegmentShift() {
+  return Log2_64_Ceil(std::max(8u, (unsigned)EnzymeCacheSegmentIterations));
+}
+
+/// Fields of the tape arena state
+enum TapeArenaField {
+  /// The chunk currently allocated from, whose first word points to the
+  /// previously allocated chunk and whose second word holds its size
+  ArenaChunk = 0,
+  /// Size in bytes of the current chunk
+  ArenaCapacity = 1,
+  /// Bytes of the current chunk in use
+  ArenaUsed = 2,
+  /// Number of allocations not yet freed
+  ArenaLive = 3,
+  /// Bytes allocated since the last reset
+  ArenaTotal = 4,
+  /// Most bytes allocated between two resets
+  ArenaPeak = 5,
+  /// Bytes held by all chained chunks
+  ArenaHeld = 6,
+};
+
+/// Size of the header at the start of each arena chunk, which also keeps
+/// every allocation 16-byte aligned
+static const uint64_t ArenaHeader = 16;
+
+/// Smallest chunk the arena will allocate
+static const uint64_t ArenaMinChunk = 1 << 16;
+
+static GlobalVariable *getOrInsertTapeArenaState(Module &M) {
+  StringRef name = "__enzyme_tape_arena";
+  if (auto GV = M.getGlobalVariable(name, /*AllowInternal*/ true))
+    return GV;
+  auto &ctx = M.getContext();
+  auto i64 = Type::getInt64Ty(ctx);
+  SmallVector<Type *, 7> elems = {Type::getInt8PtrTy(ctx), i64, i64, i64,
+                                  i64, i64, i64};
+  auto ST = StructType::get(ctx, elems);
+  // Every module differentiated with the arena shares the same state on a
+  // given thread.
+  return new GlobalVariable(M, ST, /*isConstant*/ false,
+                            GlobalValue::LinkOnceODRLinkage,
+                            Constant::getNullValue(ST), name, nullptr,
+                            GlobalValue::GeneralDynamicTLSModel);
+}
+
+static Function *getOrInsertTapeArenaAlloc(Module &M) {
+  auto &ctx = M.getContext();
+  auto i64 = Type::getInt64Ty(ctx);
+  auto i8p = Type::getInt8PtrTy(ctx);
+  FunctionType *FT = FunctionType::get(i8p, {i64}, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(
+      M.getOrInsertFunction("__enzyme_tape_arena_alloc", FT).getCallee());
+#else
+  Function *F =
+      cast<Function>(M.getOrInsertFunction("__enzyme_tape_arena_alloc", FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+#if LLVM_VERSION_MAJOR >= 14
+  F->addRetAttr(Attribute::NoAlias);
+#else
+  F->addAttribute(AttributeList::ReturnIndex, Attribute::NoAlias);
+#endif
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+  BasicBlock *grow = BasicBlock::Create(ctx, "grow", F);
+  BasicBlock *bump = BasicBlock::Create(ctx, "bump", F);
+
+  auto state = getOrInsertTapeArenaState(M);
+  auto ST = state->getValueType();
+  Argument *size = F->arg_begin();
+  size->setName("size");
+
+  IRBuilder<> B(entry);
+  auto field = [&](TapeArenaField i) {
+    return B.CreateStructGEP(ST, state, i);
+  };
+  // An empty allocation still takes a slot, so that it is never null and its
+  // free balances the count of live allocations.
+  Value *nonempty =
+      B.CreateSelect(B.CreateICmpEQ(size, ConstantInt::get(i64, 0)),
+                     ConstantInt::get(i64, 1), size, "nonempty");
+  Value *rounded = B.CreateAnd(
+      B.CreateAdd(nonempty, ConstantInt::get(i64, ArenaHeader - 1)),
+      ConstantInt::get(i64, ~(ArenaHeader - 1)), "rounded");
+  Value *chunk = B.CreateLoad(i8p, field(ArenaChunk), "chunk");
+  Value *capacity = B.CreateLoad(i64, field(ArenaCapacity), "capacity");
+  Value *used = B.CreateLoad(i64, field(ArenaUsed), "used");
+  B.CreateCondBr(B.CreateICmpULE(B.CreateAdd(used, rounded), capacity), bump,
+                 grow);
+
+  // Chain a new chunk large enough for this allocation, twice the previous
+  // chunk, and everything the arena held at its fullest.
+  B.SetInsertPoint(grow);
+  auto umax = [&](Value *a, Value *b) {
+    return B.CreateSelect(B.CreateICmpUGT(a, b), a, b);
+  };
+  Value *peak = B.CreateLoad(i64, field(ArenaPeak), "peak");
+  Value *need = B.CreateAdd(rounded, ConstantInt::get(i64, ArenaHeader));
+  Value *next = umax(umax(B.CreateShl(capacity, 1), need),
+                     umax(B.CreateAdd(peak, ConstantInt::get(i64, ArenaHeader)),
+                          ConstantInt::get(i64, ArenaMinChunk)));
+  Value *held = B.CreateLoad(i64, field(ArenaHeld), "held");
+  auto mallocF = M.getOrInsertFunction("malloc", i8p, i64);
+  BasicBlock *chain = grow;
+  if (EnzymeTapeArenaLimit) {
+    // Past the limit the allocation comes from malloc and is not counted
+    // as live, so that it is released by free rather than a reset.
+    chain = BasicBlock::Create(ctx, "chain", F, bump);
+    BasicBlock *heap = BasicBlock::Create(ctx, "heap", F, bump);
+    Value *limit = ConstantInt::get(i64, EnzymeTapeArenaLimit);
+    Value *room =
+        B.CreateSelect(B.CreateICmpULT(held, limit), B.CreateSub(limit, held),
+                       ConstantInt::get(i64, 0), "room");
+    next = B.CreateSelect(B.CreateICmpULT(room, next), room, next);
+    B.CreateCondBr(B.CreateICmpULT(next, need), heap, chain);
+
+    B.SetInsertPoint(heap);
+    B.CreateRet(B.CreateCall(mallocF, nonempty));
+
+    B.SetInsertPoint(chain);
+  }
+  Value *newChunk = B.CreateCall(mallocF, next, "newchunk");
+  Value *header = B.CreatePointerCast(newChunk, i8p->getPointerTo());
+  B.CreateStore(chunk, header);
+  B.CreateStore(B.CreateIntToPtr(next, i8p),
+                B.CreateConstInBoundsGEP1_64(i8p, header, 1));
+  B.CreateStore(newChunk, field(ArenaChunk));
+  B.CreateStore(next, field(ArenaCapacity));
+  B.CreateStore(B.CreateAdd(held, next), field(ArenaHeld));
+  B.CreateBr(bump);
+
+  B.SetInsertPoint(bump);
+  auto base = B.CreatePHI(i8p, 2);
+  base->addIncoming(chunk, entry);
+  base->addIncoming(newChunk, chain);
+  auto offset = B.CreatePHI(i64, 2);
+  offset->addIncoming(used, entry);
+  offset->addIncoming(ConstantInt::get(i64, ArenaHeader), chain);
+  B.CreateStore(B.CreateAdd(offset, rounded), field(ArenaUsed));
+  B.CreateStore(B.CreateAdd(B.CreateLoad(i64, field(ArenaLive)),
+                            ConstantInt::get(i64, 1)),
+                field(ArenaLive));
+  B.CreateStore(B.CreateAdd(B.CreateLoad(i64, field(ArenaTotal)), rounded),
+                field(ArenaTotal));
+  B.CreateRet(B.CreateInBoundsGEP(Type::getInt8Ty(ctx), base, offset));
+  return F;
+}
+
+static Function *getOrInsertTapeArenaFree(Module &M) {
+  auto &ctx = M.getContext();
+  auto i64 = Type::getInt64Ty(ctx);
+  auto i8p = Type::getInt8PtrTy(ctx);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(ctx), {i8p}, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(
+      M.getOrInsertFunction("__enzyme_tape_arena_free", FT).getCallee());
+#else
+  Function *F =
+      cast<Function>(M.getOrInsertFunction("__enzyme_tape_arena_free", FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+  BasicBlock *release = BasicBlock::Create(ctx, "release", F);
+  BasicBlock *reset = BasicBlock::Create(ctx, "reset", F);
+  BasicBlock *freeChunks = BasicBlock::Create(ctx, "freechunks", F);
+  BasicBlock *cleared = BasicBlock::Create(ctx, "cleared", F);
+  BasicBlock *exit = BasicBlock::Create(ctx, "exit", F);
+
+  auto state = getOrInsertTapeArenaState(M);
+  auto ST = state->getValueType();
+  Argument *ptr = F->arg_begin();
+  ptr->setName("ptr");
+
+  IRBuilder<> B(entry);
+  auto field = [&](TapeArenaField i) {
+    return B.CreateStructGEP(ST, state, i);
+  };
+  if (EnzymeTapeArenaLimit) {
+    // An allocation which fell back to malloc lies in none of the chunks.
+    BasicBlock *find = BasicBlock::Create(ctx, "find", F, release);
+    BasicBlock *check = BasicBlock::Create(ctx, "check", F, release);
+    BasicBlock *nextChunk = BasicBlock::Create(ctx, "nextchunk", F, release);
+    BasicBlock *heap = BasicBlock::Create(ctx, "heap", F, release);
+    Value *first = B.CreateLoad(i8p, field(ArenaChunk));
+    B.CreateCondBr(B.CreateIsNull(ptr), exit, find);
+
+    B.SetInsertPoint(find);
+    auto cur = B.CreatePHI(i8p, 2);
+    cur->addIncoming(first, entry);
+    B.CreateCondBr(B.CreateIsNull(cur), heap, check);
+
+    B.SetInsertPoint(check);
+    Value *header = B.CreatePointerCast(cur, i8p->getPointerTo());
+    Value *size = B.CreatePtrToInt(
+        B.CreateLoad(i8p, B.CreateConstInBoundsGEP1_64(i8p, header, 1)), i64);
+    Value *off = B.CreateSub(B.CreatePtrToInt(ptr, i64),
+                             B.CreatePtrToInt(cur, i64));
+    B.CreateCondBr(B.CreateICmpULT(off, size), release, nextChunk);
+
+    B.SetInsertPoint(nextChunk);
+    cur->addIncoming(B.CreateLoad(i8p, header), nextChunk);
+    B.CreateBr(find);
+
+    B.SetInsertPoint(heap);
+    B.CreateCall(M.getOrInsertFunction("free", Type::getVoidTy(ctx), i8p),
+                 ptr);
+    B.CreateBr(exit);
+  } else
+    B.CreateCondBr(B.CreateIsNull(ptr), exit, release);
+
+  // Memory is only reclaimed once every allocation has been freed, which
+  // happens at the end of the outermost gradient.
+  B.SetInsertPoint(release);
+  Value *live = B.CreateSub(B.CreateLoad(i64, field(ArenaLive)),
+                            ConstantInt::get(i64, 1));
+  B.CreateStore(live, field(ArenaLive));
+  B.CreateCondBr(B.CreateICmpEQ(live, ConstantInt::get(i64, 0)), reset, exit);
+
+  // Keep a single chunk for reuse. If the arena had to chain chunks, release
+  // them all so that the next allocation makes one chunk of the peak size.
+  B.SetInsertPoint(reset);
+  Value *total = B.CreateLoad(i64, field(ArenaTotal));
+  Value *peak = B.CreateLoad(i64, field(ArenaPeak));
+  B.CreateStore(B.CreateSelect(B.CreateICmpUGT(total, peak), total, peak),
+                field(ArenaPeak));
+  B.CreateStore(ConstantInt::get(i64, 0), field(ArenaTotal));
+  B.CreateStore(ConstantInt::get(i64, ArenaHeader), field(ArenaUsed));
+  Value *chunk = B.CreateLoad(i8p, field(ArenaChunk));
+  Value *prev =
+      B.CreateLoad(i8p, B.CreatePointerCast(chunk, i8p->getPointerTo()));
+  B.CreateCondBr(B.CreateIsNull(prev), exit, freeChunks);
+
+  B.SetInsertPoint(freeChunks);
+  auto cur = B.CreatePHI(i8p, 2);
+  cur->addIncoming(chunk, reset);
+  Value *after =
+      B.CreateLoad(i8p, B.CreatePointerCast(cur, i8p->getPointerTo()));
+  auto freeF = M.getOrInsertFunction("free", Type::getVoidTy(ctx), i8p);
+  B.CreateCall(freeF, cur);
+  cur->addIncoming(after, freeChunks);
+  B.CreateCondBr(B.CreateIsNull(after), cleared, freeChunks);
+
+  B.SetInsertPoint(cleared);
+  B.CreateStore(ConstantPointerNull::get(i8p), field(ArenaChunk));
+  B.CreateStore(ConstantInt::get(i64, 0), field(ArenaCapacity));
+  B.CreateStore(ConstantInt::get(i64, 0), field(ArenaUsed));
+  B.CreateStore(ConstantInt::get(i64, 0), field(ArenaHeld));
+  B.CreateBr(exit);
+
+  B.SetInsertPoint(exit);
+  B.CreateRetVoid();
+  return F;
+}
+
+static Function *getOrInsertTapeArenaRealloc(Module &M) {
+  auto &ctx = M.getContext();
+  auto i64 = Type::getInt64Ty(ctx);
+  auto i8p = Type::getInt8PtrTy(ctx);
+  Type *types[] = {i8p, i64, i64};
+  FunctionType *FT = FunctionType::get(i8p, types, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(
+      M.getOrInsertFunction("__enzyme_tape_arena_realloc", FT).getCallee());
+#else
+  Function *F =
+      cast<Function>(M.getOrInsertFunction("__enzyme_tape_arena_realloc", FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+  BasicBlock *fresh = BasicBlock::Create(ctx, "fresh", F);
+  BasicBlock *checklast = BasicBlock::Create(ctx, "checklast", F);
+  BasicBlock *inplace = BasicBlock::Create(ctx, "inplace", F);
+  BasicBlock *move = BasicBlock::Create(ctx, "move", F);
+
+  auto state = getOrInsertTapeArenaState(M);
+  auto ST = state->getValueType();
+  auto arg = F->arg_begin();
+  Argument *ptr = &*arg++;
+  ptr->setName("ptr");
+  Argument *oldSize = &*arg++;
+  oldSize->setName("oldsize");
+  Argument *newSize = &*arg++;
+  newSize->setName("newsize");
+
+  IRBuilder<> B(entry);
+  auto field = [&](TapeArenaField i) {
+    return B.CreateStructGEP(ST, state, i);
+  };
+  auto round = [&](Value *size) {
+    return B.CreateAnd(
+        B.CreateAdd(size, ConstantInt::get(i64, ArenaHeader - 1)),
+        ConstantInt::get(i64, ~(ArenaHeader - 1)));
+  };
+  auto allocF = getOrInsertTapeArenaAlloc(M);
+  B.CreateCondBr(B.CreateIsNull(ptr), fresh, checklast);
+
+  B.SetInsertPoint(fresh);
+  B.CreateRet(B.CreateCall(allocF, newSize));
+
+  // The most recent allocation grows in place if its chunk has room.
+  B.SetInsertPoint(checklast);
+  Value *oldRounded = round(oldSize);
+  Value *newRounded = round(newSize);
+  Value *chunk = B.CreateLoad(i8p, field(ArenaChunk));
+  Value *capacity = B.CreateLoad(i64, field(ArenaCapacity));
+  Value *used = B.CreateLoad(i64, field(ArenaUsed));
+  Value *start = B.CreateSub(used, oldRounded);
+  Value *isLast = B.CreateICmpEQ(
+      ptr, B.CreateInBoundsGEP(Type::getInt8Ty(ctx), chunk, start));
+  Value *grown = B.CreateAdd(start, newRounded);
+  B.CreateCondBr(B.CreateAnd(isLast, B.CreateICmpULE(grown, capacity)),
+                 inplace, move);
+
+  B.SetInsertPoint(inplace);
+  B.CreateStore(grown, field(ArenaUsed));
+  B.CreateStore(B.CreateAdd(B.CreateSub(B.CreateLoad(i64, field(ArenaTotal)),
+                                        oldRounded),
+                            newRounded),
+                field(ArenaTotal));
+  B.CreateRet(ptr);
+
+  // Otherwise copy into a new allocation. The old one stays in the arena
+  // until the next reset but no longer counts as live, or is returned to
+  // malloc if it fell back to it.
+  B.SetInsertPoint(move);
+  Value *res = B.CreateCall(allocF, newSize);
+  Value *margs[] = {res, ptr, oldSize, ConstantInt::getFalse(ctx)};
+  Type *tys[] = {i8p, i8p, i64};
+  B.CreateCall(Intrinsic::getDeclaration(&M, Intrinsic::memcpy, tys), margs);
+  B.CreateCall(getOrInsertTapeArenaFree(M), ptr);
+  B.CreateRet(res);
+  return F;
+}
+
+/// Fields of the header before each allocation of the memory mapped tape
+/// backend
+enum TapeMmapField {
+  /// Whether the allocation is a file mapping rather than on the heap
+  TapeMmapKind = 0,
+  /// Size in bytes of the allocation, including the header
+  TapeMmapLength = 1,
+};
+
+/// Size of the header before each allocation of the memory mapped tape
+/// backend, which also keeps every allocation 16-byte aligned
+static const uint64_t TapeMmapHeader = 16;
+
+/// Values of the POSIX constants passed to mmap and madvise
+enum TapeMmapFlags {
+  TapeProtReadWrite = 3,
+  TapeMapShared = 1,
+  TapeAdviseSequential = 2,
+  TapeAdviseWillNeed = 3,
+};
+
+static uint64_t getTapeMmapWindow() {
+  return PowerOf2Ceil(std::max(4096u, (unsigned)EnzymeTapeMmapPrefetch));
+}
+
+/// Allocations of at least the threshold are backed by an unlinked temporary
+/// file mapped shared, so that the OS may write them back to disk rather than
+/// keeping them in memory. Smaller allocations, and those whose file could not
+/// be mapped, come from the heap.
+static Function *getOrInsertTapeMmapAlloc(Module &M) {
+  auto &ctx = M.getContext();
+  auto i32 = Type::getInt32Ty(ctx);
+  auto i64 = Type::getInt64Ty(ctx);
+  auto i8 = Type::getInt8Ty(ctx);
+  auto i8p = Type::getInt8PtrTy(ctx);
+  FunctionType *FT = FunctionType::get(i8p, {i64}, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(
+      M.getOrInsertFunction("__enzyme_tape_mmap_alloc", FT).getCallee());
+#else
+  Function *F =
+      cast<Function>(M.getOrInsertFunction("__enzyme_tape_mmap_alloc", FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+#if LLVM_VERSION_MAJOR >= 14
+  F->addRetAttr(Attribute::NoAlias);
+#else
+  F->addAttribute(AttributeList::ReturnIndex, Attribute::NoAlias);
+#endif
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+  BasicBlock *file = BasicBlock::Create(ctx, "file", F);
+  BasicBlock *resize = BasicBlock::Create(ctx, "resize", F);
+  BasicBlock *map = BasicBlock::Create(ctx, "map", F);
+  BasicBlock *mapped = BasicBlock::Create(ctx, "mapped", F);
+  BasicBlock *fail = BasicBlock::Create(ctx, "fail", F);
+  BasicBlock *heap = BasicBlock::Create(ctx, "heap", F);
+
+  Argument *size = F->arg_begin();
+  size->setName("size");
+
+  IRBuilder<> B(entry);
+  auto header = [&](Value *base, Value *length, bool isMapped) {
+    Value *fields = B.CreatePointerCast(base, i64->getPointerTo());
+    B.CreateStore(ConstantInt::get(i64, isMapped),
+                  B.CreateConstInBoundsGEP1_64(i64, fields, TapeMmapKind));
+    B.CreateStore(length,
+                  B.CreateConstInBoundsGEP1_64(i64, fields, TapeMmapLength));
+    return B.CreateConstInBoundsGEP1_64(i8, base, TapeMmapHeader);
+  };
+  std::string pattern = EnzymeTapeMmapDir + "/enzyme-tape-XXXXXX";
+  auto PT = ArrayType::get(i8, pattern.size() + 1);
+  Value *path = B.CreateAlloca(PT, nullptr, "path");
+  Value *total = B.CreateAdd(size, ConstantInt::get(i64, TapeMmapHeader), "total");
+  B.CreateCondBr(
+      B.CreateICmpUGE(total, ConstantInt::get(i64, EnzymeTapeMmapThreshold)),
+      file, heap);
+
+  B.SetInsertPoint(file);
+  B.CreateStore(ConstantDataArray::getString(ctx, pattern), path);
+  path = B.CreatePointerCast(path, i8p);
+  auto mkstempF = M.getOrInsertFunction("mkstemp", i32, i8p);
+  Value *fd = B.CreateCall(mkstempF, path, "fd");
+  B.CreateCondBr(B.CreateICmpSLT(fd, ConstantInt::get(i32, 0)), heap, resize);
+
+  // The file is unlinked right away so that it is reclaimed once unmapped,
+  // including if the program exits before the reverse pass
+  B.SetInsertPoint(resize);
+  B.CreateCall(M.getOrInsertFunction("unlink", i32, i8p), path);
+  Value *res =
+      B.CreateCall(M.getOrInsertFunction("ftruncate", i32, i32, i64), {fd, total});
+  auto closeF = M.getOrInsertFunction("close", i32, i32);
+  B.CreateCondBr(B.CreateICmpEQ(res, ConstantInt::get(i32, 0)), map, fail);
+
+  B.SetInsertPoint(map);
+  Value *margs[] = {ConstantPointerNull::get(i8p), total,
+                    ConstantInt::get(i32, TapeProtReadWrite),
+                    ConstantInt::get(i32, TapeMapShared), fd,
+                    ConstantInt::get(i64, 0)};
+  Value *addr = B.CreateCall(
+      M.getOrInsertFunction("mmap", i8p, i8p, i64, i32, i32, i32, i64), margs,
+      "addr");
+  B.CreateCall(closeF, fd);
+  B.CreateCondBr(B.CreateICmpEQ(addr, B.CreateIntToPtr(
+                                          ConstantInt::get(i64, -1), i8p)),
+                 heap, mapped);
+
+  // The forward pass writes the cache in order
+  B.SetInsertPoint(mapped);
+  auto madviseF = M.getOrInsertFunction("madvise", i32, i8p, i64, i32);
+  B.CreateCall(madviseF,
+               {addr, total, ConstantInt::get(i32, TapeAdviseSequential)});
+  B.CreateRet(header(addr, total, /*isMapped*/ true));
+
+  B.SetInsertPoint(fail);
+  B.CreateCall(closeF, fd);
+  B.CreateBr(heap);
+
+  B.SetInsertPoint(heap);
+  Value *mem =
+      B.CreateCall(M.getOrInsertFunction("malloc", i8p, i64), total, "mem");
+  B.CreateRet(header(mem, total, /*isMapped*/ false));
+  return F;
+}
+
+static Function *getOrInsertTapeMmapFree(Module &M) {
+  auto &ctx = M.getContext();
+  auto i32 = Type::getInt32Ty(ctx);
+  auto i64 = Type::getInt64Ty(ctx);
+  auto i8p = Type::getInt8PtrTy(ctx);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(ctx), {i8p}, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(
+      M.getOrInsertFunction("__enzyme_tape_mmap_free", FT).getCallee());
+#else
+  Function *F =
+      cast<Function>(M.getOrInsertFunction("__enzyme_tape_mmap_free", FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+  BasicBlock *release = BasicBlock::Create(ctx, "release", F);
+  BasicBlock *unmap = BasicBlock::Create(ctx, "unmap", F);
+  BasicBlock *heap = BasicBlock::Create(ctx, "heap", F);
+  BasicBlock *exit = BasicBlock::Create(ctx, "exit", F);
+
+  Argument *ptr = F->arg_begin();
+  ptr->setName("ptr");
+
+  IRBuilder<> B(entry);
+  B.CreateCondBr(B.CreateIsNull(ptr), exit, release);
+
+  B.SetInsertPoint(release);
+  Value *base = B.CreateConstInBoundsGEP1_64(Type::getInt8Ty(ctx), ptr,
+                                             -(int64_t)TapeMmapHeader, "base");
+  Value *fields = B.CreatePointerCast(base, i64->getPointerTo());
+  Value *kind = B.CreateLoad(
+      i64, B.CreateConstInBoundsGEP1_64(i64, fields, TapeMmapKind), "kind");
+  B.CreateCondBr(B.CreateICmpEQ(kind, ConstantInt::get(i64, 0)), heap, unmap);
+
+  B.SetInsertPoint(unmap);
+  Value *length = B.CreateLoad(
+      i64, B.CreateConstInBoundsGEP1_64(i64, fields, TapeMmapLength), "length");
+  B.CreateCall(M.getOrInsertFunction("munmap", i32, i8p, i64), {base, length});
+  B.CreateBr(exit);
+
+  B.SetInsertPoint(heap);
+  B.CreateCall(M.getOrInsertFunction("free", Type::getVoidTy(ctx), i8p), base);
+  B.CreateBr(exit);
+
+  B.SetInsertPoint(exit);
+  B.CreateRetVoid();
+  return F;
+}
+
+static Function *getOrInsertTapeMmapRealloc(Module &M) {
+  auto &ctx = M.getContext();
+  auto i64 = Type::getInt64Ty(ctx);
+  auto i8p = Type::getInt8PtrTy(ctx);
+  Type *types[] = {i8p, i64, i64};
+  FunctionType *FT = FunctionType::get(i8p, types, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(
+      M.getOrInsertFunction("__enzyme_tape_mmap_realloc", FT).getCallee());
+#else
+  Function *F =
+      cast<Function>(M.getOrInsertFunction("__enzyme_tape_mmap_realloc", FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+  BasicBlock *fresh = BasicBlock::Create(ctx, "fresh", F);
+  BasicBlock *check = BasicBlock::Create(ctx, "check", F);
+  BasicBlock *heap = BasicBlock::Create(ctx, "heap", F);
+  BasicBlock *move = BasicBlock::Create(ctx, "move", F);
+
+  auto arg = F->arg_begin();
+  Argument *ptr = &*arg++;
+  ptr->setName("ptr");
+  Argument *oldSize = &*arg++;
+  oldSize->setName("oldsize");
+  Argument *newSize = &*arg++;
+  newSize->setName("newsize");
+
+  IRBuilder<> B(entry);
+  auto allocF = getOrInsertTapeMmapAlloc(M);
+  B.CreateCondBr(B.CreateIsNull(ptr), fresh, check);
+
+  B.SetInsertPoint(fresh);
+  B.CreateRet(B.CreateCall(allocF, newSize));
+
+  // A heap allocation staying below the threshold is reallocated in place
+  B.SetInsertPoint(check);
+  Value *base = B.CreateConstInBoundsGEP1_64(Type::getInt8Ty(ctx), ptr,
+                                             -(int64_t)TapeMmapHeader, "base");
+  Value *fields = B.CreatePointerCast(base, i64->getPointerTo());
+  Value *kind = B.CreateLoad(
+      i64, B.CreateConstInBoundsGEP1_64(i64, fields, TapeMmapKind), "kind");
+  Value *total = B.CreateAdd(newSize, ConstantInt::get(i64, TapeMmapHeader));
+  B.CreateCondBr(
+      B.CreateAnd(B.CreateICmpEQ(kind, ConstantInt::get(i64, 0)),
+                  B.CreateICmpULT(
+                      total, ConstantInt::get(i64, EnzymeTapeMmapThreshold))),
+      heap, move);
+
+  B.SetInsertPoint(heap);
+  Value *mem = B.CreateCall(M.getOrInsertFunction("realloc", i8p, i8p, i64),
+                            {base, total});
+  B.CreateStore(total,
+                B.CreateConstInBoundsGEP1_64(
+                    i64, B.CreatePointerCast(mem, i64->getPointerTo()),
+                    TapeMmapLength));
+  B.CreateRet(B.CreateConstInBoundsGEP1_64(Type::getInt8Ty(ctx), mem,
+                                           TapeMmapHeader));
+
+  // Otherwise copy into a new allocation, which is mapped if large enough
+  B.SetInsertPoint(move);
+  Value *res = B.CreateCall(allocF, newSize);
+  Value *margs[] = {res, ptr, oldSize, ConstantInt::getFalse(ctx)};
+  Type *tys[] = {i8p, i8p, i64};
+  B.CreateCall(Intrinsic::getDeclaration(&M, Intrinsic::memcpy, tys), margs);
+  B.CreateCall(getOrInsertTapeMmapFree(M), ptr);
+  B.CreateRet(res);
+  return F;
+}
+
+/// The reverse pass reads a cache from its end to its start, which the OS
+/// does not read ahead. On entering a window of a mapped cache, ask for the
+/// window below it to be read in.
+static Function *getOrInsertTapeMmapPrefetch(Module &M) {
+  auto &ctx = M.getContext();
+  auto i32 = Type::getInt32Ty(ctx);
+  auto i64 = Type::getInt64Ty(ctx);
+  auto i8p = Type::getInt8PtrTy(ctx);
+  Type *types[] = {i8p, i64, i64};
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(ctx), types, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(
+      M.getOrInsertFunction("__enzyme_tape_mmap_prefetch", FT).getCallee());
+#else
+  Function *F =
+      cast<Function>(M.getOrInsertFunction("__enzyme_tape_mmap_prefetch", FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::AlwaysInline);
+  F->addFnAttr(Attribute::NoUnwind);
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+  BasicBlock *check = BasicBlock::Create(ctx, "check", F);
+  BasicBlock *advise = BasicBlock::Create(ctx, "advise", F);
+  BasicBlock *exit = BasicBlock::Create(ctx, "exit", F);
+
+  auto arg = F->arg_begin();
+  Argument *ptr = &*arg++;
+  ptr->setName("ptr");
+  Argument *offset = &*arg++;
+  offset->setName("offset");
+  Argument *stride = &*arg++;
+  stride->setName("stride");
+
+  uint64_t window = getTapeMmapWindow();
+  IRBuilder<> B(entry);
+  // Position within the mapping, whose windows are page aligned
+  Value *pos = B.CreateAdd(offset, ConstantInt::get(i64, TapeMmapHeader));
+  Value *within = B.CreateAnd(pos, ConstantInt::get(i64, window - 1));
+  Value *entering =
+      B.CreateICmpUGE(within, B.CreateSub(ConstantInt::get(i64, window), stride));
+  Value *below = B.CreateICmpUGE(pos, ConstantInt::get(i64, window));
+  B.CreateCondBr(B.CreateAnd(entering, below), check, exit);
+
+  B.SetInsertPoint(check);
+  Value *base = B.CreateConstInBoundsGEP1_64(Type::getInt8Ty(ctx), ptr,
+                                             -(int64_t)TapeMmapHeader, "base");
+  Value *kind = B.CreateLoad(
+      i64, B.CreateConstInBoundsGEP1_64(
+               i64, B.CreatePointerCast(base, i64->getPointerTo()),
+               TapeMmapKind));
+  B.CreateCondBr(B.CreateICmpEQ(kind, ConstantInt::get(i64, 0)), exit, advise);
+
+  B.SetInsertPoint(advise);
+  Value *start = B.CreateSub(B.CreateSub(pos, within),
+                             ConstantInt::get(i64, window));
+  Value *args[] = {B.CreateInBoundsGEP(Type::getInt8Ty(ctx), base, start),
+                   ConstantInt::get(i64, window),
+                   ConstantInt::get(i32, TapeAdviseWillNeed)};
+  B.CreateCall(M.getOrInsertFunction("madvise", i32, i8p, i64, i32), args);
+  B.CreateBr(exit);
+
+  B.SetInsertPoint(exit);
+  B.CreateRetVoid();
+  return F;
+}
+
 Function *getOrInsertExponentialAllocator(Module &M, Function *newFunc,
-                                          bool ZeroInit, llvm::Type *RT) {
+                                          bool ZeroInit, llvm::Type *RT,
+                                          bool Arena) {
   bool custom = true;
   llvm::PointerType *allocType;
-  {
+  if (Arena) {
+    custom = false;
+    allocType = Type::getInt8PtrTy(M.getContext());
+  } else {
     auto i64 = Type::getInt64Ty(newFunc->getContext());
     BasicBlock *BB = BasicBlock::Create(M.getContext(), "entry", newFunc);
     IRBuilder<> B(BB);
@@ -97,7 +838,9 @@ Function *getOrInsertExponentialAllocator(Module &M, Function *newFunc,
   std::string name = "__enzyme_exponentialallocation";
   if (ZeroInit)
     name += "zero";
-  if (custom)
+  if (Arena)
+    name += useTapeMmap() ? ".mmap" : ".arena";
+  else if (custom)
     name += ".custom@" + std::to_string((size_t)RT);
 
   FunctionType *FT = FunctionType::get(allocType, types, false);
@@ -154,7 +897,18 @@ Function *getOrInsertExponentialAllocator(Module &M, Function *newFunc,
                      ConstantInt::get(next->getType(), 0),
                      B.CreateLShr(next, ConstantInt::get(next->getType(), 1)));
 
-  if (!custom) {
+  if (Arena) {
+    Value *oldPtr = B.CreatePointerCast(ptr, allocType);
+    if (CustomTapeReallocator) {
+      gVal = unwrap(CustomTapeReallocator(wrap(&B), wrap(oldPtr),
+                                          wrap(prevSize), wrap(next)));
+    } else {
+      Value *args[] = {oldPtr, prevSize, next};
+      gVal = B.CreateCall(useTapeMmap() ? getOrInsertTapeMmapRealloc(M)
+                                        : getOrInsertTapeArenaRealloc(M),
+                          args);
+    }
+  } else if (!custom) {
     auto reallocF = M.getOrInsertFunction("realloc", allocType, allocType,
                                           Type::getInt64Ty(M.getContext()));
 
@@ -213,7 +967,8 @@ Function *getOrInsertExponentialAllocator(Module &M, Function *newFunc,
 llvm::Value *CreateReAllocation(llvm::IRBuilder<> &B, llvm::Value *prev,
                                 llvm::Type *T, llvm::Value *OuterCount,
                                 llvm::Value *InnerCount, llvm::Twine Name,
-                                llvm::CallInst **caller, bool ZeroMem) {
+                                llvm::CallInst **caller, bool ZeroMem,
+                                bool Arena) {
   auto newFunc = B.GetInsertBlock()->getParent();
 
   Value *tsize = ConstantInt::get(
@@ -231,13 +986,211 @@ llvm::Value *CreateReAllocation(llvm::IRBuilder<> &B, llvm::Value *prev,
 
   auto realloccall =
       B.CreateCall(getOrInsertExponentialAllocator(*newFunc->getParent(),
-                                                   newFunc, ZeroMem, T),
+                                                   newFunc, ZeroMem, T, Arena),
                    idxs, Name);
   if (caller)
     *caller = realloccall;
   return realloccall;
 }
 
+/// The directory of a segmented cache is an array of pointers to its
+/// segments, followed by a null pointer. It is reallocated when the number of
+/// segments reaches a power of two, whereas the segments themselves never
+/// move.
+static Function *getOrInsertSegmentedAllocator(Module &M, bool ZeroInit) {
+  auto &ctx = M.getContext();
+  auto i64 = Type::getInt64Ty(ctx);
+  auto i8p = Type::getInt8PtrTy(ctx);
+  auto i8pp = i8p->getPointerTo();
+  Type *types[] = {i8pp, i64, i64, i64};
+  FunctionType *FT = FunctionType::get(i8pp, types, false);
+  std::string name = "__enzyme_segmentedallocation";
+  if (ZeroInit)
+    name += "zero";
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(M.getOrInsertFunction(name, FT).getCallee());
+#else
+  Function *F = cast<Function>(M.getOrInsertFunction(name, FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+  BasicBlock *segment = BasicBlock::Create(ctx, "segment", F);
+  BasicBlock *grow = BasicBlock::Create(ctx, "grow", F);
+  BasicBlock *alloc = BasicBlock::Create(ctx, "alloc", F);
+  BasicBlock *exit = BasicBlock::Create(ctx, "exit", F);
+
+  auto arg = F->arg_begin();
+  Argument *dir = &*arg++;
+  dir->setName("dir");
+  Argument *iter = &*arg++;
+  iter->setName("iter");
+  Argument *shift = &*arg++;
+  shift->setName("shift");
+  Argument *bytes = &*arg++;
+  bytes->setName("bytes");
+
+  // A new segment is needed on the first iteration it holds
+  IRBuilder<> B(entry);
+  Value *mask = B.CreateSub(B.CreateShl(ConstantInt::get(i64, 1), shift),
+                            ConstantInt::get(i64, 1));
+  B.CreateCondBr(B.CreateICmpEQ(B.CreateAnd(iter, mask),
+                                ConstantInt::get(i64, 0)),
+                 segment, exit);
+
+  B.SetInsertPoint(segment);
+  Value *idx = B.CreateLShr(iter, shift, "idx");
+  Value *next = B.CreateAdd(idx, ConstantInt::get(i64, 1));
+  B.CreateCondBr(B.CreateICmpEQ(B.CreateAnd(idx, next),
+                                ConstantInt::get(i64, 0)),
+                 grow, alloc);
+
+  // Double the directory, leaving room for the terminating null
+  B.SetInsertPoint(grow);
+  auto reallocF = M.getOrInsertFunction("realloc", i8p, i8p, i64);
+  Value *args[] = {B.CreatePointerCast(dir, i8p),
+                   B.CreateMul(next, ConstantInt::get(i64, 16))};
+  Value *grown = B.CreatePointerCast(B.CreateCall(reallocF, args), i8pp);
+  B.CreateBr(alloc);
+
+  B.SetInsertPoint(alloc);
+  auto cur = B.CreatePHI(i8pp, 2);
+  cur->addIncoming(dir, segment);
+  cur->addIncoming(grown, grow);
+  Value *seg;
+  if (ZeroInit) {
+    auto callocF = M.getOrInsertFunction("calloc", i8p, i64, i64);
+    seg = B.CreateCall(callocF, {ConstantInt::get(i64, 1), bytes});
+  } else {
+    auto mallocF = M.getOrInsertFunction("malloc", i8p, i64);
+    seg = B.CreateCall(mallocF, bytes);
+  }
+  B.CreateStore(seg, B.CreateInBoundsGEP(i8p, cur, idx));
+  B.CreateStore(ConstantPointerNull::get(i8p),
+                B.CreateInBoundsGEP(i8p, cur, next));
+  B.CreateBr(exit);
+
+  B.SetInsertPoint(exit);
+  auto res = B.CreatePHI(i8pp, 2);
+  res->addIncoming(dir, entry);
+  res->addIncoming(cur, alloc);
+  B.CreateRet(res);
+  return F;
+}
+
+static Function *getOrInsertSegmentedFree(Module &M) {
+  auto &ctx = M.getContext();
+  auto i64 = Type::getInt64Ty(ctx);
+  auto i8p = Type::getInt8PtrTy(ctx);
+  auto i8pp = i8p->getPointerTo();
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(ctx), {i8pp}, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(
+      M.getOrInsertFunction("__enzyme_segmentedfree", FT).getCallee());
+#else
+  Function *F =
+      cast<Function>(M.getOrInsertFunction("__enzyme_segmentedfree", FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+  BasicBlock *loop = BasicBlock::Create(ctx, "loop", F);
+  BasicBlock *body = BasicBlock::Create(ctx, "body", F);
+  BasicBlock *done = BasicBlock::Create(ctx, "done", F);
+  BasicBlock *exit = BasicBlock::Create(ctx, "exit", F);
+
+  Argument *dir = F->arg_begin();
+  dir->setName("dir");
+  auto freeF = M.getOrInsertFunction("free", Type::getVoidTy(ctx), i8p);
+
+  IRBuilder<> B(entry);
+  B.CreateCondBr(B.CreateIsNull(dir), exit, loop);
+
+  B.SetInsertPoint(loop);
+  auto idx = B.CreatePHI(i64, 2);
+  idx->addIncoming(ConstantInt::get(i64, 0), entry);
+  Value *seg = B.CreateLoad(i8p, B.CreateInBoundsGEP(i8p, dir, idx));
+  B.CreateCondBr(B.CreateIsNull(seg), done, body);
+
+  B.SetInsertPoint(body);
+  B.CreateCall(freeF, seg);
+  idx->addIncoming(B.CreateAdd(idx, ConstantInt::get(i64, 1)), body);
+  B.CreateBr(loop);
+
+  B.SetInsertPoint(done);
+  B.CreateCall(freeF, B.CreatePointerCast(dir, i8p));
+  B.CreateBr(exit);
+
+  B.SetInsertPoint(exit);
+  B.CreateRetVoid();
+  return F;
+}
+
+llvm::Value *CreateSegmentedAllocation(llvm::IRBuilder<> &B, llvm::Value *prev,
+                                       llvm::Type *T, llvm::Value *Iteration,
+                                       llvm::Value *InnerCount,
+                                       llvm::Twine Name, llvm::CallInst **caller,
+                                       bool ZeroMem) {
+  auto &M = *B.GetInsertBlock()->getParent()->getParent();
+  auto i64 = Type::getInt64Ty(M.getContext());
+  auto i8pp = Type::getInt8PtrTy(M.getContext())->getPointerTo();
+
+  Value *tsize = ConstantInt::get(
+      InnerCount->getType(), M.getDataLayout().getTypeAllocSizeInBits(T) / 8);
+
+  Value *idxs[] = {
+      B.CreatePointerCast(prev, i8pp), Iteration,
+      ConstantInt::get(i64, getCacheSegmentShift()),
+      /*segment size (element x subloops x iterations per segment)*/
+      B.CreateShl(B.CreateMul(tsize, InnerCount, "", /*NUW*/ true,
+                              /*NSW*/ true),
+                  getCacheSegmentShift())};
+
+  auto call = B.CreateCall(getOrInsertSegmentedAllocator(M, ZeroMem), idxs,
+                           Name);
+  if (caller)
+    *caller = call;
+  return call;
+}
+
+CallInst *CreateSegmentedDealloc(llvm::IRBuilder<> &B, llvm::Value *ToFree) {
+  auto &M = *B.GetInsertBlock()->getParent()->getParent();
+  ToFree = B.CreatePointerCast(
+      ToFree, Type::getInt8PtrTy(M.getContext())->getPointerTo());
+  return B.CreateCall(getOrInsertSegmentedFree(M), ToFree);
+}
+
+/// Zero the Count elements of size Align allocated by malloccall
+static Instruction *CreateZeroAllocation(IRBuilder<> &Builder,
+                                         CallInst *malloccall, Value *Align,
+                                         Value *Count) {
+  auto &M = *Builder.GetInsertBlock()->getParent()->getParent();
+  auto PT = cast<PointerType>(malloccall->getType());
+  Value *tozero = malloccall;
+  if (!PT->getPointerElementType()->isIntegerTy(8))
+    tozero = Builder.CreatePointerCast(
+        tozero, PointerType::get(Type::getInt8Ty(PT->getContext()),
+                                 PT->getAddressSpace()));
+  Value *args[] = {
+      tozero, ConstantInt::get(Type::getInt8Ty(malloccall->getContext()), 0),
+      Builder.CreateMul(Align, Count, "", true, true),
+      ConstantInt::getFalse(malloccall->getContext())};
+  Type *tys[] = {args[0]->getType(), args[2]->getType()};
+
+  return Builder.CreateCall(
+      Intrinsic::getDeclaration(&M, Intrinsic::memset, tys), args);
+}
+
 Value *CreateAllocation(IRBuilder<> &Builder, llvm::Type *T, Value *Count,
                         Twine Name, CallInst **caller, Instruction **ZeroMem) {
   Value *res;
@@ -320,22 +1273,36 @@ Value *CreateAllocation(IRBuilder<> &Builder, llvm::Type *T, Value *Count,
         F->getName() == "jl_gc_alloc_typed" ||
         F->getName() == "ijl_gc_alloc_typed")
       ZeroMem = nullptr;
-  if (ZeroMem) {
-    auto PT = cast<PointerType>(malloccall->getType());
-    Value *tozero = malloccall;
-    if (!PT->getPointerElementType()->isIntegerTy(8))
-      tozero = Builder.CreatePointerCast(
-          tozero, PointerType::get(Type::getInt8Ty(PT->getContext()),
-                                   PT->getAddressSpace()));
-    Value *args[] = {
-        tozero, ConstantInt::get(Type::getInt8Ty(malloccall->getContext()), 0),
-        Builder.CreateMul(Align, Count, "", true, true),
-        ConstantInt::getFalse(malloccall->getContext())};
-    Type *tys[] = {args[0]->getType(), args[2]->getType()};
+  if (ZeroMem)
+    *ZeroMem = CreateZeroAllocation(Builder, malloccall, Align, Count);
+  return res;
+}
 
-    *ZeroMem = Builder.CreateCall(
-        Intrinsic::getDeclaration(&M, Intrinsic::memset, tys), args);
+Value *CreateTapeAllocation(IRBuilder<> &Builder, llvm::Type *T, Value *Count,
+                            Twine Name, CallInst **caller,
+                            Instruction **ZeroMem) {
+  auto &M = *Builder.GetInsertBlock()->getParent()->getParent();
+  auto AlignI = M.getDataLayout().getTypeAllocSizeInBits(T) / 8;
+  auto Align = ConstantInt::get(Count->getType(), AlignI);
+  Value *size = Builder.CreateMul(Align, Count, "", true, true);
+  CallInst *malloccall;
+  if (CustomTapeAllocator) {
+    malloccall =
+        cast<CallInst>(unwrap(CustomTapeAllocator(wrap(&Builder), wrap(size))));
+  } else if (useTapeMmap()) {
+    malloccall = Builder.CreateCall(getOrInsertTapeMmapAlloc(M), size);
+  } else {
+    malloccall = Builder.CreateCall(getOrInsertTapeArenaAlloc(M), size);
   }
+  Value *res = Builder.CreatePointerCast(
+      malloccall,
+      PointerType::get(
+          T, cast<PointerType>(malloccall->getType())->getAddressSpace()),
+      Name);
+  if (caller)
+    *caller = malloccall;
+  if (ZeroMem)
+    *ZeroMem = CreateZeroAllocation(Builder, malloccall, Align, Count);
   return res;
 }
 
@@ -368,6 +1335,247 @@ CallInst *CreateDealloc(llvm::IRBuilder<> &Builder, llvm::Value *ToFree) {
   return res;
 }
 
+CallInst *CreateTapeDealloc(llvm::IRBuilder<> &Builder, llvm::Value *ToFree) {
+  ToFree = Builder.CreatePointerCast(ToFree,
+                                     Type::getInt8PtrTy(ToFree->getContext()));
+  if (CustomTapeDeallocator)
+    return dyn_cast_or_null<CallInst>(
+        unwrap(CustomTapeDeallocator(wrap(&Builder), wrap(ToFree))));
+  auto &M = *Builder.GetInsertBlock()->getParent()->getParent();
+  if (useTapeMmap())
+    return Builder.CreateCall(getOrInsertTapeMmapFree(M), ToFree);
+  return Builder.CreateCall(getOrInsertTapeArenaFree(M), ToFree);
+}
+
+CallInst *CreateTapePrefetch(llvm::IRBuilder<> &Builder, llvm::Value *Ptr,
+                             llvm::Value *Offset, uint64_t Stride) {
+  auto &M = *Builder.GetInsertBlock()->getParent()->getParent();
+  Value *args[] = {
+      Builder.CreatePointerCast(Ptr, Type::getInt8PtrTy(Ptr->getContext())),
+      Builder.CreateZExtOrTrunc(Offset, Type::getInt64Ty(Ptr->getContext())),
+      ConstantInt::get(Type::getInt64Ty(Ptr->getContext()), Stride)};
+  return Builder.CreateCall(getOrInsertTapeMmapPrefetch(M), args);
+}
+
+bool isCombinableLanes(ArrayRef<Value *> Lanes) {
+  auto I0 = dyn_cast<Instruction>(Lanes[0]);
+  if (!I0)
+    return false;
+  if (isa<BinaryOperator>(I0) || isa<UnaryOperator>(I0) ||
+      isa<SelectInst>(I0)) {
+    if (!I0->getType()->isFloatingPointTy())
+      return false;
+  } else if (auto FC = dyn_cast<FCmpInst>(I0)) {
+    if (!FC->getOperand(0)->getType()->isFloatingPointTy())
+      return false;
+  } else if (auto II = dyn_cast<IntrinsicInst>(I0)) {
+    if (!I0->getType()->isFloatingPointTy() ||
+        !isTriviallyVectorizable(II->getIntrinsicID()))
+      return false;
+#if LLVM_VERSION_MAJOR >= 14
+    for (auto &Arg : II->args())
+#else
+    for (auto &Arg : II->arg_operands())
+#endif
+      if (Arg->getType() != I0->getType())
+        return false;
+  } else {
+    return false;
+  }
+  for (auto V : Lanes.drop_front()) {
+    auto I = dyn_cast<Instruction>(V);
+    if (!I || I->getOpcode() != I0->getOpcode() ||
+        I->getNumOperands() != I0->getNumOperands())
+      return false;
+    if (auto FC = dyn_cast<FCmpInst>(I0))
+      if (cast<FCmpInst>(I)->getPredicate() != FC->getPredicate())
+        return false;
+    if (auto CI = dyn_cast<CallInst>(I0))
+      if (cast<CallInst>(I)->getCalledOperand() != CI->getCalledOperand())
+        return false;
+  }
+  return true;
+}
+
+/// Return the first point after which all of \p Lanes are defined, or
+/// nullptr if the lanes are instructions of different blocks.
+static Instruction *getLanesDefinitionPoint(Function *F,
+                                            ArrayRef<Value *> Lanes) {
+  SmallPtrSet<Instruction *, 4> Insts;
+  for (auto V : Lanes)
+    if (auto I = dyn_cast<Instruction>(V)) {
+      if (!Insts.empty() && I->getParent() != (*Insts.begin())->getParent())
+        return nullptr;
+      Insts.insert(I);
+    }
+  if (Insts.empty())
+    return &*F->getEntryBlock().getFirstInsertionPt();
+  BasicBlock *BB = (*Insts.begin())->getParent();
+  Instruction *Last = nullptr;
+  unsigned Seen = 0;
+  for (auto &I : *BB) {
+    if (!Insts.count(&I))
+      continue;
+    Last = &I;
+    if (++Seen == Insts.size())
+      break;
+  }
+  if (isa<PHINode>(Last))
+    return &*BB->getFirstInsertionPt();
+  if (Last->isTerminator())
+    return nullptr;
+  return Last->getNextNode();
+}
+
+/// Pack \p Lanes into a vector by Pack. If \p Packs is given, the vector is
+/// emitted once right after the lanes are defined and reused by later calls.
+static Value *
+packLanes(IRBuilder<> &B, ArrayRef<Value *> Lanes,
+          std::map<SmallVector<Value *, 4>, Value *> *Packs,
+          function_ref<Value *(IRBuilder<> &)> Pack) {
+  if (!Packs)
+    return Pack(B);
+  SmallVector<Value *, 4> Key(Lanes.begin(), Lanes.end());
+  auto found = Packs->find(Key);
+  if (found != Packs->end())
+    return found->second;
+  auto IP = getLanesDefinitionPoint(B.GetInsertBlock()->getParent(), Lanes);
+  if (!IP)
+    return Pack(B);
+  IRBuilder<> BH(IP);
+  BH.SetCurrentDebugLocation(DebugLoc());
+  Value *res = Pack(BH);
+  (*Packs)[Key] = res;
+  return res;
+}
+
+static Value *
+combineLanes(IRBuilder<> &B, ArrayRef<Value *> Lanes,
+             std::map<SmallVector<Value *, 4>, Value *> &Seen,
+             SmallVectorImpl<Instruction *> &Combined,
+             std::map<SmallVector<Value *, 4>, Value *> *Packs) {
+  Type *T = Lanes[0]->getType();
+  unsigned width = Lanes.size();
+#if LLVM_VERSION_MAJOR >= 11
+  auto VT = FixedVectorType::get(T, width);
+#else
+  auto VT = VectorType::get(T, width);
+#endif
+
+  if (llvm::all_of(Lanes, [&](Value *V) { return V == Lanes[0]; }))
+    return packLanes(B, Lanes, Packs, [&](IRBuilder<> &BP) {
+      return BP.CreateVectorSplat(width, Lanes[0]);
+    });
+
+  if (llvm::all_of(Lanes, [](Value *V) { return isa<Constant>(V); })) {
+    SmallVector<Constant *, 4> Elems;
+    for (auto V : Lanes)
+      Elems.push_back(cast<Constant>(V));
+    return ConstantVector::get(Elems);
+  }
+
+  // Lanes which were extracted in order from a vector of the same width.
+  if (auto E0 = dyn_cast<ExtractElementInst>(Lanes[0])) {
+    Value *Vec = E0->getVectorOperand();
+    bool inOrder = Vec->getType() == VT;
+    for (unsigned i = 0; inOrder && i < width; i++) {
+      auto E = dyn_cast<ExtractElementInst>(Lanes[i]);
+      auto Idx = E ? dyn_cast<ConstantInt>(E->getIndexOperand()) : nullptr;
+      inOrder = Idx && E->getVectorOperand() == Vec && Idx->getZExtValue() == i;
+    }
+    if (inOrder)
+      return Vec;
+  }
+
+  SmallVector<Value *, 4> Key(Lanes.begin(), Lanes.end());
+  auto found = Seen.find(Key);
+  if (found != Seen.end())
+    return found->second;
+
+  Value *res = nullptr;
+  if (isCombinableLanes(Lanes)) {
+    auto I0 = cast<Instruction>(Lanes[0]);
+    SmallVector<Value *, 3> Ops;
+#if LLVM_VERSION_MAJOR >= 14
+    unsigned numOps = isa<CallInst>(I0) ? cast<CallInst>(I0)->arg_size()
+                                        : I0->getNumOperands();
+#else
+    unsigned numOps = isa<CallInst>(I0)
+                          ? cast<CallInst>(I0)->getNumArgOperands()
+                          : I0->getNumOperands();
+#endif
+    for (unsigned j = 0; j < numOps; j++) {
+      SmallVector<Value *, 4> OpLanes;
+      for (auto V : Lanes)
+        OpLanes.push_back(cast<Instruction>(V)->getOperand(j));
+      Ops.push_back(combineLanes(B, OpLanes, Seen, Combined, Packs));
+    }
+    if (auto BO = dyn_cast<BinaryOperator>(I0))
+      res = B.CreateBinOp(BO->getOpcode(), Ops[0], Ops[1]);
+    else if (auto UO = dyn_cast<UnaryOperator>(I0))
+      res = B.CreateUnOp(UO->getOpcode(), Ops[0]);
+    else if (auto FC = dyn_cast<FCmpInst>(I0))
+      res = B.CreateFCmp(FC->getPredicate(), Ops[0], Ops[1]);
+    else if (isa<SelectInst>(I0))
+      res = B.CreateSelect(Ops[0], Ops[1], Ops[2]);
+    else {
+      auto II = cast<IntrinsicInst>(I0);
+      Function *F = Intrinsic::getDeclaration(
+          II->getModule(), II->getIntrinsicID(), ArrayRef<Type *>(VT));
+      res = B.CreateCall(F, Ops);
+    }
+    if (auto RI = dyn_cast<Instruction>(res)) {
+      RI->copyIRFlags(I0);
+      for (auto V : Lanes.drop_front())
+        RI->andIRFlags(V);
+    }
+    for (auto V : Lanes)
+      Combined.push_back(cast<Instruction>(V));
+  } else {
+    res = packLanes(B, Lanes, Packs, [&](IRBuilder<> &BP) {
+      Value *vec = UndefValue::get(VT);
+      for (unsigned i = 0; i < width; i++)
+        vec = BP.CreateInsertElement(vec, Lanes[i], i);
+      return vec;
+    });
+  }
+  Seen[Key] = res;
+  return res;
+}
+
+Value *combineLanes(IRBuilder<> &B, ArrayRef<Value *> Lanes,
+                    SmallVectorImpl<Instruction *> &Combined,
+                    std::map<SmallVector<Value *, 4>, Value *> *Packs) {
+  std::map<SmallVector<Value *, 4>, Value *> Seen;
+  return combineLanes(B, Lanes, Seen, Combined, Packs);
+}
+
+void EmitCacheRemark(OptimizationRemarkEmitter &ORE, StringRef RemarkName,
+                     const DiagnosticLocation &Loc, const BasicBlock *BB,
+                     StringRef Message, const Value *V, StringRef Name,
+                     uint64_t ElementBytes, unsigned LoopDepth,
+                     uint64_t EstimatedBytes) {
+  ORE.emit([&]() {
+    OptimizationRemarkAnalysis R("enzyme", RemarkName, Loc, BB);
+    R << Message << " ";
+    if (V)
+      R << ore::NV("Value", V);
+    else
+      R << ore::NV("Value", Name);
+    return R << ": " << ore::NV("ElementBytes", ElementBytes)
+             << " bytes per element, loop depth "
+             << ore::NV("LoopDepth", LoopDepth) << ", estimated "
+             << ore::NV("EstimatedBytes", EstimatedBytes) << " bytes";
+  });
+}
+
+DiagnosticLocation getBlockLocation(const BasicBlock *BB) {
+  for (auto &I : *BB)
+    if (I.getDebugLoc())
+      return DiagnosticLocation(I.getDebugLoc());
+  return DiagnosticLocation();
+}
+
 EnzymeFailure::EnzymeFailure(llvm::StringRef RemarkName,
                              const llvm::DiagnosticLocation &Loc,
                              const llvm::Instruction *CodeRegion)
@@ -591,20 +1799,137 @@ Function *getOrInsertDifferentialFloatMemcpy(Module &M, Type *elementType,
       srcl->setAlignment(Align(srcalign));
       srcs->setAlignment(Align(srcalign));
 #else
-      srcl->setAlignment(srcalign);
-      srcs->setAlignment(srcalign);
+      srcl->setAlignment(srcalign);
+      srcs->setAlignment(srcalign);
+#endif
+    }
+
+    Value *next =
+        B.CreateNUWAdd(idx, ConstantInt::get(num->getType(), 1), "idx.next");
+    idx->addIncoming(next, body);
+    B.CreateCondBr(B.CreateICmpEQ(num, next), end, body);
+  }
+
+  {
+    IRBuilder<> B(end);
+    B.CreateRetVoid();
+  }
+  return F;
+}
+
+Function *getOrInsertFixedPointUpdate(Module &M, Type *elementType) {
+  assert(elementType->isFloatingPointTy());
+  std::string name = "__enzyme_fixedpoint_update_" + tofltstr(elementType);
+  Type *PT = PointerType::getUnqual(elementType);
+  FunctionType *FT = FunctionType::get(
+      Type::getInt1Ty(M.getContext()),
+      {PT, PT, PT, PT, Type::getInt64Ty(M.getContext()), elementType}, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(M.getOrInsertFunction(name, FT).getCallee());
+#else
+  Function *F = cast<Function>(M.getOrInsertFunction(name, FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::ArgMemOnly);
+  F->addFnAttr(Attribute::NoUnwind);
+  F->addFnAttr(Attribute::AlwaysInline);
+  for (unsigned i = 0; i < 4; i++)
+    F->addParamAttr(i, Attribute::NoCapture);
+  F->addParamAttr(1, Attribute::ReadOnly);
+
+  BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", F);
+  BasicBlock *body = BasicBlock::Create(M.getContext(), "for.body", F);
+  BasicBlock *end = BasicBlock::Create(M.getContext(), "for.end", F);
+
+  auto lambda = F->arg_begin();
+  lambda->setName("lambda");
+  auto seed = lambda + 1;
+  seed->setName("seed");
+  auto prod = seed + 1;
+  prod->setName("prod");
+  auto dout = prod + 1;
+  dout->setName("dout");
+  auto num = dout + 1;
+  num->setName("num");
+  auto tol = num + 1;
+  tol->setName("tol");
+
+  Constant *zero = ConstantFP::get(elementType, 0.0);
+  {
+    IRBuilder<> B(entry);
+    B.CreateCondBr(B.CreateICmpEQ(num, ConstantInt::get(num->getType(), 0)),
+                   end, body);
+  }
+
+  PHINode *err, *mag;
+  Value *nerr, *nmag;
+  {
+    IRBuilder<> B(body);
+    PHINode *idx = B.CreatePHI(num->getType(), 2, "idx");
+    idx->addIncoming(ConstantInt::get(num->getType(), 0), entry);
+    err = B.CreatePHI(elementType, 2, "err");
+    err->addIncoming(zero, entry);
+    mag = B.CreatePHI(elementType, 2, "mag");
+    mag->addIncoming(zero, entry);
+
+    auto load = [&](Value *ptr, const char *name) {
+#if LLVM_VERSION_MAJOR > 7
+      Value *gep = B.CreateInBoundsGEP(elementType, ptr, idx);
+      return std::make_pair(gep, (Value *)B.CreateLoad(elementType, gep, name));
+#else
+      Value *gep = B.CreateInBoundsGEP(ptr, idx);
+      return std::make_pair(gep, (Value *)B.CreateLoad(gep, name));
+#endif
+    };
+    auto lam = load(lambda, "lambda.i");
+    auto sd = load(seed, "seed.i");
+    auto pr = load(prod, "prod.i");
+#if LLVM_VERSION_MAJOR > 7
+    Value *douti = B.CreateInBoundsGEP(elementType, dout, idx);
+#else
+    Value *douti = B.CreateInBoundsGEP(dout, idx);
 #endif
-    }
 
-    Value *next =
+    // lambda = seed + J^T lambda, leaving the new lambda as the seed of the
+    // next product and clearing the accumulator of that product
+    Value *next = B.CreateFAdd(sd.second, pr.second, "lambda.next");
+    B.CreateStore(next, lam.first);
+    B.CreateStore(next, douti);
+    B.CreateStore(zero, pr.first);
+
+    Value *delta = B.CreateUnaryIntrinsic(
+        Intrinsic::fabs, B.CreateFSub(next, lam.second), nullptr, "delta");
+    nerr = B.CreateBinaryIntrinsic(Intrinsic::maxnum, err, delta);
+    nmag = B.CreateBinaryIntrinsic(
+        Intrinsic::maxnum, mag,
+        B.CreateUnaryIntrinsic(Intrinsic::fabs, next, nullptr));
+    err->addIncoming(nerr, body);
+    mag->addIncoming(nmag, body);
+
+    Value *inc =
         B.CreateNUWAdd(idx, ConstantInt::get(num->getType(), 1), "idx.next");
-    idx->addIncoming(next, body);
-    B.CreateCondBr(B.CreateICmpEQ(num, next), end, body);
+    idx->addIncoming(inc, body);
+    B.CreateCondBr(B.CreateICmpEQ(num, inc), end, body);
   }
 
   {
     IRBuilder<> B(end);
-    B.CreateRetVoid();
+    PHINode *ferr = B.CreatePHI(elementType, 2, "err.end");
+    ferr->addIncoming(zero, entry);
+    ferr->addIncoming(nerr, body);
+    PHINode *fmag = B.CreatePHI(elementType, 2, "mag.end");
+    fmag->addIncoming(zero, entry);
+    fmag->addIncoming(nmag, body);
+    // Converged once no entry moved by more than tol relative to the
+    // largest entry, or absolutely for a lambda smaller than one
+    Value *scale = B.CreateBinaryIntrinsic(Intrinsic::maxnum, fmag,
+                                           ConstantFP::get(elementType, 1.0));
+    B.CreateRet(B.CreateFCmpOLE(ferr, B.CreateFMul(tol, scale)));
   }
   return F;
 }
@@ -711,6 +2036,245 @@ Function *getOrInsertMemcpyStrided(Module &M, PointerType *T, Type *IT,
   return F;
 }
 
+BLASEmitter::BLASEmitter(Module &M, IRBuilder<> &AllocaBuilder,
+                         StringRef prefix, StringRef suffix, Type *fpType,
+                         IntegerType *intType, bool byRef)
+    : fpType(fpType), intType(intType), byRef(byRef), M(M),
+      AllocaBuilder(AllocaBuilder), prefix(prefix.str()),
+      suffix(suffix.str()) {}
+
+std::string BLASEmitter::name(StringRef routine) const {
+  return prefix + (fpType->isDoubleTy() ? "d" : "s") + routine.str() + suffix;
+}
+
+Value *BLASEmitter::byReference(IRBuilder<> &B, Value *V) {
+  auto alloc = AllocaBuilder.CreateAlloca(V->getType());
+  B.CreateStore(V, alloc);
+  return alloc;
+}
+
+Value *BLASEmitter::integer(IRBuilder<> &B, Value *V) {
+  if (V->getType() != intType)
+    V = B.CreateSExtOrTrunc(V, intType);
+  return byRef ? byReference(B, V) : V;
+}
+
+Value *BLASEmitter::integer(IRBuilder<> &B, int64_t C) {
+  return integer(B, ConstantInt::get(intType, C, /*signed*/ true));
+}
+
+Value *BLASEmitter::fp(IRBuilder<> &B, Value *V) {
+  return byRef ? byReference(B, V) : V;
+}
+
+Value *BLASEmitter::fp(IRBuilder<> &B, double C) {
+  return fp(B, ConstantFP::get(fpType, C));
+}
+
+Value *BLASEmitter::ptr(IRBuilder<> &B, Value *V) {
+  auto PT = PointerType::getUnqual(fpType);
+  if (V->getType()->isIntegerTy())
+    return B.CreateIntToPtr(V, PT);
+  return B.CreatePointerCast(V, PT);
+}
+
+Value *BLASEmitter::flag(IRBuilder<> &B, Value *cond, char setChar,
+                         char unsetChar, unsigned setEnum,
+                         unsigned unsetEnum) {
+  if (byRef)
+    return byReference(B, B.CreateSelect(cond, B.getInt8(setChar),
+                                         B.getInt8(unsetChar)));
+  return B.CreateSelect(cond, B.getInt32(setEnum), B.getInt32(unsetEnum));
+}
+
+Value *BLASEmitter::trans(IRBuilder<> &B, Value *isTrans) {
+  return flag(B, isTrans, 'T', 'N', /*CblasTrans*/ 112, /*CblasNoTrans*/ 111);
+}
+
+Value *BLASEmitter::uplo(IRBuilder<> &B, Value *isUpper) {
+  return flag(B, isUpper, 'U', 'L', /*CblasUpper*/ 121, /*CblasLower*/ 122);
+}
+
+Value *BLASEmitter::diag(IRBuilder<> &B, Value *isUnit) {
+  return flag(B, isUnit, 'U', 'N', /*CblasUnit*/ 132, /*CblasNonUnit*/ 131);
+}
+
+Value *BLASEmitter::side(IRBuilder<> &B, Value *isLeft) {
+  return flag(B, isLeft, 'L', 'R', /*CblasLeft*/ 141, /*CblasRight*/ 142);
+}
+
+CallInst *BLASEmitter::call(IRBuilder<> &B, StringRef routine,
+                            ArrayRef<Value *> args) {
+  bool level1 = routine == "dot" || routine == "axpy" || routine == "scal" ||
+                routine == "copy";
+  SmallVector<Value *, 14> callArgs;
+  if (!level1 && !byRef)
+    callArgs.push_back(B.getInt32(/*CblasColMajor*/ 102));
+  callArgs.append(args.begin(), args.end());
+
+  SmallVector<Type *, 14> types;
+  for (auto arg : callArgs)
+    types.push_back(arg->getType());
+  Type *RT = routine == "dot" ? fpType : B.getVoidTy();
+  auto FT = FunctionType::get(RT, types, false);
+  auto F = M.getOrInsertFunction(name(routine), FT);
+  return B.CreateCall(F, callArgs);
+}
+
+Value *BLASEmitter::matrix(IRBuilder<> &B, BLASMatrixOp op, Value *tri,
+                           Value *unit, ArrayRef<Value *> args) {
+  StringRef routine;
+  switch (op) {
+  case BLASMatrixOp::Dot:
+    routine = "dot";
+    break;
+  case BLASMatrixOp::Axpy:
+    routine = "axpy";
+    break;
+  case BLASMatrixOp::Scal:
+    routine = "scal";
+    break;
+  case BLASMatrixOp::Copy:
+    routine = "copy";
+    break;
+  }
+  bool hasAlpha = op == BLASMatrixOp::Axpy || op == BLASMatrixOp::Scal;
+  bool hasY = op != BLASMatrixOp::Scal;
+
+  auto PT = PointerType::getUnqual(fpType);
+  SmallVector<Type *, 9> types = {B.getInt8Ty(), B.getInt1Ty(), intType,
+                                  intType};
+  if (hasAlpha)
+    types.push_back(fpType);
+  types.push_back(PT);
+  types.push_back(intType);
+  if (hasY) {
+    types.push_back(PT);
+    types.push_back(intType);
+  }
+  Type *RT = op == BLASMatrixOp::Dot ? fpType : B.getVoidTy();
+  auto FT = FunctionType::get(RT, types, false);
+
+  SmallVector<Value *, 9> callArgs = {tri, unit};
+  for (auto tup : llvm::enumerate(args)) {
+    Value *V = tup.value();
+    Type *T = types[tup.index() + 2];
+    if (T == intType)
+      V = B.CreateSExtOrTrunc(V, intType);
+    else if (T == PT)
+      V = ptr(B, V);
+    callArgs.push_back(V);
+  }
+
+  std::string helperName = "__enzyme_matrix_" + name(routine);
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F =
+      cast<Function>(M.getOrInsertFunction(helperName, FT).getCallee());
+#else
+  Function *F = cast<Function>(M.getOrInsertFunction(helperName, FT));
+#endif
+
+  if (F->empty()) {
+    F->setLinkage(Function::LinkageTypes::InternalLinkage);
+    F->addFnAttr(Attribute::NoUnwind);
+
+    auto &Ctx = M.getContext();
+    BasicBlock *entry = BasicBlock::Create(Ctx, "entry", F);
+    BasicBlock *loop = BasicBlock::Create(Ctx, "for.body", F);
+    BasicBlock *column = BasicBlock::Create(Ctx, "column", F);
+    BasicBlock *latch = BasicBlock::Create(Ctx, "for.latch", F);
+    BasicBlock *end = BasicBlock::Create(Ctx, "for.end", F);
+
+    auto arg = F->arg_begin();
+    Value *ftri = arg++;
+    Value *funit = arg++;
+    Value *m = arg++;
+    Value *n = arg++;
+    Value *alpha = hasAlpha ? (Value *)arg++ : nullptr;
+    Value *X = arg++;
+    Value *ldx = arg++;
+    Value *Y = hasY ? (Value *)arg++ : nullptr;
+    Value *ldy = hasY ? (Value *)arg++ : nullptr;
+
+    Value *zero = ConstantInt::get(intType, 0);
+    Value *one = ConstantInt::get(intType, 1);
+    Value *fzero = ConstantFP::get(fpType, 0.0);
+
+    IRBuilder<> EB(entry);
+    EB.CreateCondBr(EB.CreateICmpSGT(n, zero), loop, end);
+    IRBuilder<> AB(entry->getTerminator());
+    BLASEmitter E(M, AB, prefix, suffix, fpType, intType, byRef);
+
+    IRBuilder<> LB(loop);
+    PHINode *j = LB.CreatePHI(intType, 2, "j");
+    j->addIncoming(zero, entry);
+    PHINode *acc = nullptr;
+    if (op == BLASMatrixOp::Dot) {
+      acc = LB.CreatePHI(fpType, 2, "acc");
+      acc->addIncoming(fzero, entry);
+    }
+    // Rows [start, end) of column j which lie in the requested triangle
+    Value *unitI = LB.CreateZExt(funit, intType);
+    Value *start = LB.CreateSelect(
+        LB.CreateICmpEQ(ftri, LB.getInt8(Lower)), LB.CreateAdd(j, unitI),
+        zero, "start");
+    Value *upperEnd = LB.CreateSub(LB.CreateAdd(j, one), unitI);
+    upperEnd = LB.CreateSelect(LB.CreateICmpSLT(upperEnd, m), upperEnd, m);
+    Value *rowEnd = LB.CreateSelect(LB.CreateICmpEQ(ftri, LB.getInt8(Upper)),
+                                    upperEnd, m, "end");
+    Value *len = LB.CreateSub(rowEnd, start, "len");
+    LB.CreateCondBr(LB.CreateICmpSGT(len, zero), column, latch);
+
+    IRBuilder<> CB(column);
+    auto element = [&](Value *P, Value *ld) -> Value * {
+      Value *idx = CB.CreateAdd(
+          CB.CreateMul(CB.CreateSExt(j, CB.getInt64Ty()),
+                       CB.CreateSExt(ld, CB.getInt64Ty())),
+          CB.CreateSExt(start, CB.getInt64Ty()));
+#if LLVM_VERSION_MAJOR > 7
+      return CB.CreateInBoundsGEP(fpType, P, idx);
+#else
+      return CB.CreateInBoundsGEP(P, idx);
+#endif
+    };
+    SmallVector<Value *, 6> colArgs = {E.integer(CB, len)};
+    if (hasAlpha)
+      colArgs.push_back(E.fp(CB, alpha));
+    colArgs.push_back(element(X, ldx));
+    colArgs.push_back(E.integer(CB, 1));
+    if (hasY) {
+      colArgs.push_back(element(Y, ldy));
+      colArgs.push_back(E.integer(CB, 1));
+    }
+    Value *res = E.call(CB, routine, colArgs);
+    Value *sum = acc ? CB.CreateFAdd(acc, res) : nullptr;
+    CB.CreateBr(latch);
+
+    IRBuilder<> NB(latch);
+    PHINode *nacc = nullptr;
+    if (acc) {
+      nacc = NB.CreatePHI(fpType, 2, "acc.next");
+      nacc->addIncoming(acc, loop);
+      nacc->addIncoming(sum, column);
+      acc->addIncoming(nacc, latch);
+    }
+    Value *jnext = NB.CreateAdd(j, one, "j.next");
+    j->addIncoming(jnext, latch);
+    NB.CreateCondBr(NB.CreateICmpSLT(jnext, n), loop, end);
+
+    IRBuilder<> RB(end);
+    if (acc) {
+      PHINode *result = RB.CreatePHI(fpType, 2, "result");
+      result->addIncoming(fzero, entry);
+      result->addIncoming(nacc, latch);
+      RB.CreateRet(result);
+    } else {
+      RB.CreateRetVoid();
+    }
+  }
+  return B.CreateCall(F, callArgs);
+}
+
 // TODO implement differential memmove
 Function *getOrInsertDifferentialFloatMemmove(Module &M, Type *T,
                                               unsigned dstalign,
@@ -921,6 +2485,7 @@ llvm::Function *getOrInsertDifferentialMPI_Wait(llvm::Module &M,
                                                 Type *reqType) {
   llvm::SmallVector<llvm::Type *, 4> types(T.begin(), T.end());
   types.push_back(reqType);
+  types.push_back(PointerType::getUnqual(getMPIHelper(M.getContext())));
   std::string name = "__enzyme_differential_mpi_wait";
   FunctionType *FT =
       FunctionType::get(Type::getVoidTy(M.getContext()), types, false);
@@ -939,8 +2504,6 @@ llvm::Function *getOrInsertDifferentialMPI_Wait(llvm::Module &M,
   F->addFnAttr(Attribute::AlwaysInline);
 
   BasicBlock *entry = BasicBlock::Create(M.getContext(), "entry", F);
-  BasicBlock *isend = BasicBlock::Create(M.getContext(), "invertISend", F);
-  BasicBlock *irecv = BasicBlock::Create(M.getContext(), "invertIRecv", F);
 
 #if 0
     /*0 */Type::getInt8PtrTy(call.getContext())
@@ -969,6 +2532,151 @@ llvm::Function *getOrInsertDifferentialMPI_Wait(llvm::Module &M,
   fn->setName("fn");
   Value *d_req = buff + 7;
   d_req->setName("d_req");
+  Value *helper = buff + 8;
+  helper->setName("helper");
+
+  IRBuilder<> B(entry);
+
+  // The adjoint of a non-blocking collective is begun where the reverse pass
+  // reaches its wait, reducing the shadow buffer in place. The adjoint of a
+  // persistent request is restarted instead.
+  auto iallreducefn = M.getFunction("MPI_Iallreduce");
+  auto ibcastfn = M.getFunction("MPI_Ibcast");
+  bool persistent =
+      M.getFunction("MPI_Send_init") || M.getFunction("MPI_Recv_init");
+  if (iallreducefn || ibcastfn || persistent) {
+    BasicBlock *ptp =
+        BasicBlock::Create(M.getContext(), "invertPointToPoint", F);
+    auto SI = B.CreateSwitch(fn, ptp);
+
+    auto conv = [&](Value *V, Type *T) -> Value * {
+      if (V->getType()->isIntegerTy())
+        return T->isIntegerTy() ? B.CreateZExtOrTrunc(V, T)
+                                : B.CreateIntToPtr(V, T);
+      return T->isIntegerTy() ? B.CreatePtrToInt(V, T)
+                              : B.CreatePointerCast(V, T);
+    };
+    // MPI_IN_PLACE is (void*)1 in Open MPI, and (void*)-1 in MPICH whose
+    // handles are integers
+    auto inPlace = [&](Type *T, Type *commTy) -> Value * {
+      return ConstantExpr::getIntToPtr(
+          ConstantInt::get(Type::getInt64Ty(M.getContext()),
+                           commTy->isIntegerTy() ? -1 : 1, true),
+          T);
+    };
+
+    if (iallreducefn) {
+      BasicBlock *BB =
+          BasicBlock::Create(M.getContext(), "invertIAllreduce", F);
+      SI->addCase(ConstantInt::get(cast<IntegerType>(fn->getType()),
+                                   (int)MPI_CallType::IALLREDUCE),
+                  BB);
+      B.SetInsertPoint(BB);
+      // int MPI_Iallreduce(const void *sendbuf, void *recvbuf, int count,
+      //                    MPI_Datatype datatype, MPI_Op op, MPI_Comm comm,
+      //                    MPI_Request *request)
+      auto FT = iallreducefn->getFunctionType();
+      Value *args[] = {
+          inPlace(FT->getParamType(0), FT->getParamType(5)),
+          conv(buf, FT->getParamType(1)),
+          conv(count, FT->getParamType(2)),
+          conv(datatype, FT->getParamType(3)),
+          conv(tag, FT->getParamType(4)),
+          conv(comm, FT->getParamType(5)),
+          conv(d_req, FT->getParamType(6)),
+      };
+      auto fcall = B.CreateCall(iallreducefn, args);
+      fcall->setCallingConv(iallreducefn->getCallingConv());
+      B.CreateRetVoid();
+    }
+
+    if (ibcastfn) {
+      BasicBlock *BB = BasicBlock::Create(M.getContext(), "invertIBcast", F);
+      SI->addCase(ConstantInt::get(cast<IntegerType>(fn->getType()),
+                                   (int)MPI_CallType::IBCAST),
+                  BB);
+      B.SetInsertPoint(BB);
+      // int MPI_Ibcast(void *buffer, int count, MPI_Datatype datatype,
+      //                int root, MPI_Comm comm, MPI_Request *request)
+      auto FT = ibcastfn->getFunctionType();
+      Type *bufTy = FT->getParamType(0);
+      Type *rootTy = FT->getParamType(3);
+      Type *commTy = FT->getParamType(4);
+
+      Type *opTy = commTy->isIntegerTy() ? commTy
+                                         : Type::getInt8PtrTy(M.getContext());
+      for (auto name : {"MPI_Iallreduce", "MPI_Allreduce"})
+        if (auto reducefn = M.getFunction(name))
+          opTy = reducefn->getFunctionType()->getParamType(4);
+
+      Type *rankTys[] = {commTy, PointerType::getUnqual(rootTy)};
+      auto rankfn = M.getOrInsertFunction(
+          "MPI_Comm_rank",
+          FunctionType::get(FT->getReturnType(), rankTys, false));
+      Value *rankp = IRBuilder<>(entry, entry->begin()).CreateAlloca(rootTy);
+      Value *comm_ = conv(comm, commTy);
+      B.CreateCall(rankfn, {comm_, rankp});
+#if LLVM_VERSION_MAJOR > 7
+      Value *rank = B.CreateLoad(rootTy, rankp);
+#else
+      Value *rank = B.CreateLoad(rankp);
+#endif
+      Value *root = conv(source, rootTy);
+      Value *shadow = conv(buf, bufTy);
+
+      // Sum the shadow buffers into the root's
+      // int MPI_Ireduce(const void *sendbuf, void *recvbuf, int count,
+      //                 MPI_Datatype datatype, MPI_Op op, int root,
+      //                 MPI_Comm comm, MPI_Request *request)
+      Value *args[] = {
+          B.CreateSelect(B.CreateICmpEQ(rank, root), inPlace(bufTy, commTy),
+                         shadow),
+          shadow,
+          conv(count, FT->getParamType(1)),
+          conv(datatype, FT->getParamType(2)),
+          conv(tag, opTy),
+          root,
+          comm_,
+          conv(d_req, FT->getParamType(5)),
+      };
+      Type *types[sizeof(args) / sizeof(*args)];
+      for (size_t i = 0; i < sizeof(args) / sizeof(*args); i++)
+        types[i] = args[i]->getType();
+      B.CreateCall(
+          M.getOrInsertFunction(
+              "MPI_Ireduce",
+              FunctionType::get(FT->getReturnType(), types, false)),
+          args);
+      B.CreateRetVoid();
+    }
+
+    if (persistent) {
+      BasicBlock *BB =
+          BasicBlock::Create(M.getContext(), "restartPersistent", F);
+      for (auto CT : {MPI_CallType::PSEND, MPI_CallType::PRECV})
+        SI->addCase(
+            ConstantInt::get(cast<IntegerType>(fn->getType()), (int)CT), BB);
+      B.SetInsertPoint(BB);
+      // int MPI_Start(MPI_Request *request)
+      auto PT = getMPIPersistentHelper(M.getContext(),
+                                       reqType->getPointerElementType());
+      Value *idxs[] = {
+          ConstantInt::get(Type::getInt64Ty(M.getContext()), 0),
+          ConstantInt::get(Type::getInt32Ty(M.getContext()),
+                           (int)MPI_PersistentElem::Request)};
+      Value *adj_req = B.CreateInBoundsGEP(
+          PT, B.CreatePointerCast(helper, PointerType::getUnqual(PT)), idxs);
+      Type *startTys[] = {adj_req->getType()};
+      B.CreateCall(M.getOrInsertFunction(
+                       "MPI_Start",
+                       FunctionType::get(Type::getInt32Ty(M.getContext()),
+                                         startTys, false)),
+                   adj_req);
+      B.CreateRetVoid();
+    }
+
+    B.SetInsertPoint(ptp);
+  }
 
   bool pmpi = true;
   auto isendfn = M.getFunction("PMPI_Isend");
@@ -976,7 +2684,13 @@ llvm::Function *getOrInsertDifferentialMPI_Wait(llvm::Module &M,
     isendfn = M.getFunction("MPI_Isend");
     pmpi = false;
   }
-  assert(isendfn);
+  if (!isendfn) {
+    assert(iallreducefn || ibcastfn || persistent);
+    B.CreateUnreachable();
+    return F;
+  }
+  BasicBlock *isend = BasicBlock::Create(M.getContext(), "invertISend", F);
+  BasicBlock *irecv = BasicBlock::Create(M.getContext(), "invertIRecv", F);
   auto irecvfn = M.getFunction("PMPI_Irecv");
   if (!irecvfn)
     irecvfn = M.getFunction("MPI_Irecv");
@@ -992,7 +2706,6 @@ llvm::Function *getOrInsertDifferentialMPI_Wait(llvm::Module &M,
   }
   assert(irecvfn);
 
-  IRBuilder<> B(entry);
   auto arg = isendfn->arg_begin();
   if (arg->getType()->isIntegerTy())
     buf = B.CreatePtrToInt(buf, arg->getType());
@@ -1033,6 +2746,408 @@ llvm::Function *getOrInsertDifferentialMPI_Wait(llvm::Module &M,
   return F;
 }
 
+llvm::Function *getOrInsertDifferentialMPI_Start(llvm::Module &M,
+                                                 llvm::Type *reqType,
+                                                 llvm::Type *statusType) {
+  auto &Ctx = M.getContext();
+  auto impi = getMPIHelper(Ctx);
+  Type *types[] = {PointerType::getUnqual(impi)};
+  std::string name = "__enzyme_differential_mpi_start";
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(Ctx), types, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(M.getOrInsertFunction(name, FT).getCallee());
+#else
+  Function *F = cast<Function>(M.getOrInsertFunction(name, FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+  F->addFnAttr(Attribute::AlwaysInline);
+
+  BasicBlock *entry = BasicBlock::Create(Ctx, "entry", F);
+  BasicBlock *nonnull = BasicBlock::Create(Ctx, "nonnull", F);
+  BasicBlock *send = BasicBlock::Create(Ctx, "accumulateSend", F);
+  BasicBlock *recv = BasicBlock::Create(Ctx, "zeroRecv", F);
+  BasicBlock *end = BasicBlock::Create(Ctx, "end", F);
+
+  Value *helper = F->arg_begin();
+  helper->setName("helper");
+
+  auto i32 = Type::getInt32Ty(Ctx);
+  auto i64 = Type::getInt64Ty(Ctx);
+  auto i8p = Type::getInt8PtrTy(Ctx);
+
+  IRBuilder<> B(entry);
+  Value *status = B.CreateAlloca(statusType);
+  Value *tysizep = B.CreateAlloca(i32);
+  B.CreateCondBr(B.CreateICmpEQ(helper, Constant::getNullValue(types[0])), end,
+                 nonnull);
+
+  B.SetInsertPoint(nonnull);
+  auto PT = getMPIPersistentHelper(Ctx, reqType);
+  Value *phelper = B.CreatePointerCast(helper, PointerType::getUnqual(PT));
+  auto member = [&](MPI_PersistentElem E) -> Value * {
+    Value *idxs[] = {ConstantInt::get(i64, 0),
+                     ConstantInt::get(i32, (uint64_t)E)};
+    return B.CreateInBoundsGEP(PT, phelper, idxs);
+  };
+
+  // Complete the adjoint communication of this start
+  // int MPI_Wait(MPI_Request *request, MPI_Status *status)
+  Value *adj_req = member(MPI_PersistentElem::Request);
+  Type *waitTys[] = {adj_req->getType(), status->getType()};
+  B.CreateCall(M.getOrInsertFunction("MPI_Wait",
+                                     FunctionType::get(i32, waitTys, false)),
+               {adj_req, status});
+
+#if LLVM_VERSION_MAJOR > 7
+  Value *buf =
+      B.CreateLoad(i8p, getMPIMemberPtr<MPI_Elem::Buf>(B, helper), "buf");
+  Value *count =
+      B.CreateLoad(i64, getMPIMemberPtr<MPI_Elem::Count>(B, helper), "count");
+  Value *datatype = B.CreateLoad(
+      i8p, getMPIMemberPtr<MPI_Elem::DataType>(B, helper), "datatype");
+  Value *fn = B.CreateLoad(Type::getInt8Ty(Ctx),
+                           getMPIMemberPtr<MPI_Elem::Call>(B, helper), "fn");
+  Value *shadow =
+      B.CreateLoad(i8p, member(MPI_PersistentElem::Shadow), "shadow");
+#else
+  Value *buf = B.CreateLoad(getMPIMemberPtr<MPI_Elem::Buf>(B, helper), "buf");
+  Value *count =
+      B.CreateLoad(getMPIMemberPtr<MPI_Elem::Count>(B, helper), "count");
+  Value *datatype =
+      B.CreateLoad(getMPIMemberPtr<MPI_Elem::DataType>(B, helper), "datatype");
+  Value *fn = B.CreateLoad(getMPIMemberPtr<MPI_Elem::Call>(B, helper), "fn");
+  Value *shadow = B.CreateLoad(member(MPI_PersistentElem::Shadow), "shadow");
+#endif
+  auto SI = B.CreateSwitch(fn, end);
+  SI->addCase(ConstantInt::get(cast<IntegerType>(fn->getType()),
+                               (int)MPI_CallType::PSEND),
+              send);
+  SI->addCase(ConstantInt::get(cast<IntegerType>(fn->getType()),
+                               (int)MPI_CallType::PRECV),
+              recv);
+
+  // Handles are integers in MPICH, and opaque pointers in Open MPI
+  Function *initfn = M.getFunction("MPI_Send_init");
+  if (!initfn)
+    initfn = M.getFunction("MPI_Recv_init");
+  assert(initfn);
+  auto initTy = initfn->getFunctionType();
+  auto conv = [&](Value *V, Type *T) -> Value * {
+    if (T->isIntegerTy())
+      return V->getType()->isIntegerTy() ? B.CreateZExtOrTrunc(V, T)
+                                         : B.CreatePtrToInt(V, T);
+    return B.CreatePointerCast(V, T);
+  };
+
+  {
+    // The adjoint message is summed into the shadow of the sent buffer
+    // int MPI_Reduce_local(const void *inbuf, void *inoutbuf, int count,
+    //                      MPI_Datatype datatype, MPI_Op op)
+    B.SetInsertPoint(send);
+#if LLVM_VERSION_MAJOR > 7
+    Value *op = B.CreateLoad(i8p, member(MPI_PersistentElem::Op), "op");
+#else
+    Value *op = B.CreateLoad(member(MPI_PersistentElem::Op), "op");
+#endif
+    Value *args[] = {
+        conv(buf, initTy->getParamType(0)),
+        conv(shadow, initTy->getParamType(0)),
+        conv(count, initTy->getParamType(1)),
+        conv(datatype, initTy->getParamType(2)),
+        B.CreatePointerCast(op, PointerType::getUnqual(i8p)),
+    };
+    Type *tys[sizeof(args) / sizeof(*args)];
+    for (size_t i = 0; i < sizeof(args) / sizeof(*args); i++)
+      tys[i] = args[i]->getType();
+    B.CreateCall(
+        M.getOrInsertFunction("MPI_Reduce_local",
+                              FunctionType::get(i32, tys, false)),
+        args);
+    B.CreateBr(end);
+  }
+
+  {
+    // The shadow of the received buffer was sent, and is zeroed
+    // int MPI_Type_size(MPI_Datatype datatype, int *size)
+    B.SetInsertPoint(recv);
+    Value *args[] = {conv(datatype, initTy->getParamType(2)), tysizep};
+    Type *tys[] = {args[0]->getType(), args[1]->getType()};
+    B.CreateCall(M.getOrInsertFunction("MPI_Type_size",
+                                       FunctionType::get(i32, tys, false)),
+                 args);
+#if LLVM_VERSION_MAJOR > 7
+    Value *tysize = B.CreateLoad(i32, tysizep);
+#else
+    Value *tysize = B.CreateLoad(tysizep);
+#endif
+    Value *len = B.CreateMul(count, B.CreateZExt(tysize, i64), "", true, true);
+    auto val_arg = ConstantInt::get(Type::getInt8Ty(Ctx), 0);
+    auto volatile_arg = ConstantInt::getFalse(Ctx);
+#if LLVM_VERSION_MAJOR == 6
+    auto align_arg = ConstantInt::get(i32, 1);
+    Value *nargs[] = {shadow, val_arg, len, align_arg, volatile_arg};
+#else
+    Value *nargs[] = {shadow, val_arg, len, volatile_arg};
+#endif
+    Type *memsetTys[] = {shadow->getType(), len->getType()};
+    B.CreateCall(
+        Intrinsic::getDeclaration(&M, Intrinsic::memset, memsetTys), nargs);
+    B.CreateBr(end);
+  }
+
+  B.SetInsertPoint(end);
+  B.CreateRetVoid();
+  return F;
+}
+
+llvm::Function *getOrInsertDifferentialMPI_Startall(llvm::Module &M,
+                                                    llvm::Type *countType,
+                                                    llvm::Type *reqType,
+                                                    llvm::Type *statusType) {
+  auto &Ctx = M.getContext();
+  auto impip = PointerType::getUnqual(getMPIHelper(Ctx));
+  Type *types[] = {countType, PointerType::getUnqual(impip)};
+  std::string name = "__enzyme_differential_mpi_startall";
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(Ctx), types, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(M.getOrInsertFunction(name, FT).getCallee());
+#else
+  Function *F = cast<Function>(M.getOrInsertFunction(name, FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+  F->addFnAttr(Attribute::AlwaysInline);
+
+  BasicBlock *entry = BasicBlock::Create(Ctx, "entry", F);
+  BasicBlock *loopBlock = BasicBlock::Create(Ctx, "loop", F);
+  BasicBlock *endBlock = BasicBlock::Create(Ctx, "end", F);
+
+  Value *count = F->arg_begin();
+  count->setName("count");
+  Value *helpers = F->arg_begin() + 1;
+  helpers->setName("helpers");
+
+  Function *dstart = getOrInsertDifferentialMPI_Start(M, reqType, statusType);
+
+  IRBuilder<> B(entry);
+  B.CreateCondBr(B.CreateICmpEQ(count, ConstantInt::get(countType, 0)),
+                 endBlock, loopBlock);
+
+  B.SetInsertPoint(loopBlock);
+  auto idx = B.CreatePHI(countType, 2);
+  idx->addIncoming(ConstantInt::get(countType, 0), entry);
+  auto inc = B.CreateAdd(idx, ConstantInt::get(countType, 1));
+  idx->addIncoming(inc, loopBlock);
+  Value *idxs[] = {idx};
+#if LLVM_VERSION_MAJOR > 7
+  Value *helper =
+      B.CreateLoad(impip, B.CreateInBoundsGEP(impip, helpers, idxs));
+#else
+  Value *helper = B.CreateLoad(B.CreateInBoundsGEP(helpers, idxs));
+#endif
+  auto cal = B.CreateCall(dstart, helper);
+  cal->setCallingConv(dstart->getCallingConv());
+  B.CreateCondBr(B.CreateICmpEQ(inc, count), endBlock, loopBlock);
+
+  B.SetInsertPoint(endBlock);
+  B.CreateRetVoid();
+  return F;
+}
+
+llvm::Function *getOrInsertMPIExtent(llvm::Module &M, llvm::Type *countsType,
+                                     llvm::Type *intType) {
+  auto &Ctx = M.getContext();
+  auto i64 = Type::getInt64Ty(Ctx);
+  Type *types[] = {countsType, countsType, intType};
+  std::string name = "__enzyme_mpi_extent";
+  FunctionType *FT = FunctionType::get(i64, types, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(M.getOrInsertFunction(name, FT).getCallee());
+#else
+  Function *F = cast<Function>(M.getOrInsertFunction(name, FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::ArgMemOnly);
+  F->addFnAttr(Attribute::ReadOnly);
+  F->addFnAttr(Attribute::NoUnwind);
+  F->addFnAttr(Attribute::AlwaysInline);
+  F->addParamAttr(0, Attribute::NoCapture);
+  F->addParamAttr(1, Attribute::NoCapture);
+
+  BasicBlock *entry = BasicBlock::Create(Ctx, "entry", F);
+  BasicBlock *loopBlock = BasicBlock::Create(Ctx, "loop", F);
+  BasicBlock *endBlock = BasicBlock::Create(Ctx, "end", F);
+
+  Value *counts = F->arg_begin();
+  counts->setName("counts");
+  Value *displs = F->arg_begin() + 1;
+  displs->setName("displs");
+  Value *n = F->arg_begin() + 2;
+  n->setName("n");
+
+  IRBuilder<> B(entry);
+  Value *num = B.CreateZExtOrTrunc(n, i64);
+  B.CreateCondBr(B.CreateICmpEQ(num, ConstantInt::get(i64, 0)), endBlock,
+                 loopBlock);
+
+  // The extent is the furthest end of any nonempty block
+  B.SetInsertPoint(loopBlock);
+  auto idx = B.CreatePHI(i64, 2);
+  idx->addIncoming(ConstantInt::get(i64, 0), entry);
+  auto max = B.CreatePHI(i64, 2);
+  max->addIncoming(ConstantInt::get(i64, 0), entry);
+  auto inc = B.CreateAdd(idx, ConstantInt::get(i64, 1), "", true, true);
+  idx->addIncoming(inc, loopBlock);
+  Type *elTy = countsType->getPointerElementType();
+  Value *idxs[] = {idx};
+#if LLVM_VERSION_MAJOR > 7
+  Value *count = B.CreateLoad(elTy, B.CreateInBoundsGEP(elTy, counts, idxs));
+  Value *displ = B.CreateLoad(elTy, B.CreateInBoundsGEP(elTy, displs, idxs));
+#else
+  Value *count = B.CreateLoad(B.CreateInBoundsGEP(counts, idxs));
+  Value *displ = B.CreateLoad(B.CreateInBoundsGEP(displs, idxs));
+#endif
+  Value *blockEnd =
+      B.CreateAdd(B.CreateSExt(displ, i64), B.CreateSExt(count, i64));
+  Value *larger =
+      B.CreateAnd(B.CreateICmpSGT(count, ConstantInt::get(elTy, 0)),
+                  B.CreateICmpSGT(blockEnd, max));
+  Value *next = B.CreateSelect(larger, blockEnd, max);
+  max->addIncoming(next, loopBlock);
+  B.CreateCondBr(B.CreateICmpEQ(inc, num), endBlock, loopBlock);
+
+  B.SetInsertPoint(endBlock);
+  auto res = B.CreatePHI(i64, 2);
+  res->addIncoming(ConstantInt::get(i64, 0), entry);
+  res->addIncoming(next, loopBlock);
+  B.CreateRet(res);
+  return F;
+}
+
+llvm::Function *getOrInsertMPINeighborCount(llvm::Module &M,
+                                            llvm::Type *commType,
+                                            llvm::Type *intType) {
+  auto &Ctx = M.getContext();
+  auto intp = PointerType::getUnqual(intType);
+  Type *types[] = {commType, intp, intp};
+  std::string name = "__enzyme_mpi_neighbor_count";
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(Ctx), types, false);
+
+#if LLVM_VERSION_MAJOR >= 9
+  Function *F = cast<Function>(M.getOrInsertFunction(name, FT).getCallee());
+#else
+  Function *F = cast<Function>(M.getOrInsertFunction(name, FT));
+#endif
+
+  if (!F->empty())
+    return F;
+
+  F->setLinkage(Function::LinkageTypes::InternalLinkage);
+  F->addFnAttr(Attribute::NoUnwind);
+  F->addFnAttr(Attribute::AlwaysInline);
+
+  BasicBlock *entry = BasicBlock::Create(Ctx, "entry", F);
+  BasicBlock *cart = BasicBlock::Create(Ctx, "cart", F);
+  BasicBlock *graph = BasicBlock::Create(Ctx, "graph", F);
+  BasicBlock *distGraph = BasicBlock::Create(Ctx, "distGraph", F);
+
+  Value *comm = F->arg_begin();
+  comm->setName("comm");
+  Value *indegree = F->arg_begin() + 1;
+  indegree->setName("indegree");
+  Value *outdegree = F->arg_begin() + 2;
+  outdegree->setName("outdegree");
+
+  auto call = [&](IRBuilder<> &B, StringRef name, ArrayRef<Value *> args) {
+    SmallVector<Type *, 4> tys;
+    for (auto arg : args)
+      tys.push_back(arg->getType());
+    B.CreateCall(
+        M.getOrInsertFunction(name, FunctionType::get(intType, tys, false)),
+        args);
+  };
+
+  IRBuilder<> B(entry);
+  Value *topo = B.CreateAlloca(intType);
+  Value *res = B.CreateAlloca(intType);
+  // int MPI_Topo_test(MPI_Comm comm, int *status)
+  call(B, "MPI_Topo_test", {comm, topo});
+#if LLVM_VERSION_MAJOR > 7
+  Value *kind = B.CreateLoad(intType, topo);
+#else
+  Value *kind = B.CreateLoad(topo);
+#endif
+  // MPI_CART and MPI_GRAPH are 2 and 1 in MPICH whose handles are integers,
+  // and swapped in Open MPI
+  bool mpich = commType->isIntegerTy();
+  auto SI = B.CreateSwitch(kind, distGraph);
+  SI->addCase(cast<ConstantInt>(ConstantInt::get(intType, mpich ? 2 : 1)),
+              cart);
+  SI->addCase(cast<ConstantInt>(ConstantInt::get(intType, mpich ? 1 : 2)),
+              graph);
+
+  {
+    // A cartesian process has two neighbors in every dimension
+    // int MPI_Cartdim_get(MPI_Comm comm, int *ndims)
+    B.SetInsertPoint(cart);
+    call(B, "MPI_Cartdim_get", {comm, res});
+#if LLVM_VERSION_MAJOR > 7
+    Value *ndims = B.CreateLoad(intType, res);
+#else
+    Value *ndims = B.CreateLoad(res);
+#endif
+    Value *n = B.CreateShl(ndims, 1);
+    B.CreateStore(n, indegree);
+    B.CreateStore(n, outdegree);
+    B.CreateRetVoid();
+  }
+
+  {
+    // int MPI_Graph_neighbors_count(MPI_Comm comm, int rank, int *nneighbors)
+    B.SetInsertPoint(graph);
+    call(B, "MPI_Comm_rank", {comm, res});
+#if LLVM_VERSION_MAJOR > 7
+    Value *rank = B.CreateLoad(intType, res);
+#else
+    Value *rank = B.CreateLoad(res);
+#endif
+    call(B, "MPI_Graph_neighbors_count", {comm, rank, res});
+#if LLVM_VERSION_MAJOR > 7
+    Value *n = B.CreateLoad(intType, res);
+#else
+    Value *n = B.CreateLoad(res);
+#endif
+    B.CreateStore(n, indegree);
+    B.CreateStore(n, outdegree);
+    B.CreateRetVoid();
+  }
+
+  {
+    // int MPI_Dist_graph_neighbors_count(MPI_Comm comm, int *indegree,
+    //                                    int *outdegree, int *weighted)
+    B.SetInsertPoint(distGraph);
+    call(B, "MPI_Dist_graph_neighbors_count", {comm, indegree, outdegree, res});
+    B.CreateRetVoid();
+  }
+  return F;
+}
+
 llvm::Value *getOrInsertOpFloatSum(llvm::Module &M, llvm::Type *OpPtr,
                                    ConcreteType CT, llvm::Type *intType,
                                    IRBuilder<> &B2) {
@@ -1569,7 +3684,7 @@ bool writesToMemoryReadBy(llvm::AAResults &AA, llvm::TargetLibraryInfo &TLI,
     if (funcName == "MPI_Wait" || funcName == "PMPI_Wait" ||
         funcName == "MPI_Waitall" || funcName == "PMPI_Waitall") {
 #if LLVM_VERSION_MAJOR > 11
-      auto loc = LocationSize::afterPointer();
+      auto loc = LocationSize::beforeOrAfterPointer();
 #else
       auto loc = MemoryLocation::UnknownSize;
 #endif
@@ -1674,6 +3789,31 @@ bool writesToMemoryReadBy(llvm::AAResults &AA, llvm::TargetLibraryInfo &TLI,
       if (StringRef(iasm->getAsmString()).contains("exit"))
         return false;
     }
+
+    // The summary of the callee lists the arguments whose memory it may
+    // write, if it writes no other memory
+    if (auto F = call->getCalledFunction()) {
+      if (auto Summary = getFunctionSummary(F)) {
+        if (!Summary->WritesOther) {
+          bool mayConflict = false;
+          for (size_t i = 0, e = Summary->WrittenArgs.size(); i < e; i++) {
+            if (!Summary->WrittenArgs[i])
+              continue;
+            // The callee may write at negative offsets from the argument
+#if LLVM_VERSION_MAJOR > 11
+            auto loc = LocationSize::beforeOrAfterPointer();
+#else
+            auto loc = MemoryLocation::UnknownSize;
+#endif
+            if (isRefSet(
+                    AA.getModRefInfo(maybeReader, call->getArgOperand(i), loc)))
+              mayConflict = true;
+          }
+          if (!mayConflict)
+            return false;
+        }
+      }
+    }
   }
   if (auto call = dyn_cast<CallInst>(maybeReader)) {
     StringRef funcName = getFuncNameFromCall(call);
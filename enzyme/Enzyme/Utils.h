@@ -78,6 +78,24 @@ extern "C" {
 extern llvm::cl::opt<bool> EnzymePrintPerf;
 extern void (*CustomErrorHandler)(const char *, LLVMValueRef, ErrorType,
                                   void *);
+/// Allocate cache buffers out of a reusable thread-local arena
+extern llvm::cl::opt<bool> EnzymeTapeArena;
+/// Most bytes the chunks of the tape arena may hold before allocations fall
+/// back to malloc
+extern llvm::cl::opt<unsigned long long> EnzymeTapeArenaLimit;
+extern LLVMValueRef (*CustomTapeAllocator)(LLVMBuilderRef, LLVMValueRef);
+extern LLVMValueRef (*CustomTapeReallocator)(LLVMBuilderRef, LLVMValueRef,
+                                             LLVMValueRef, LLVMValueRef);
+extern LLVMValueRef (*CustomTapeDeallocator)(LLVMBuilderRef, LLVMValueRef);
+/// Emit the arithmetic on floating point lanes of vector mode shadows and
+/// batched values as vector instructions
+extern llvm::cl::opt<bool> EnzymeVectorShadow;
+/// Back cache buffers of at least this many bytes by memory mapped files
+extern llvm::cl::opt<unsigned long long> EnzymeTapeMmapThreshold;
+/// Cache dynamic loops in fixed size segments instead of reallocating
+extern llvm::cl::opt<bool> EnzymeSegmentedCache;
+/// Number of dynamic loop iterations held by one cache segment
+extern llvm::cl::opt<unsigned> EnzymeCacheSegmentIterations;
 }
 
 llvm::SmallVector<llvm::Instruction *, 2> PostCacheStore(llvm::StoreInst *SI,
@@ -89,11 +107,72 @@ llvm::Value *CreateAllocation(llvm::IRBuilder<> &B, llvm::Type *T,
                               llvm::Instruction **ZeroMem = nullptr);
 llvm::CallInst *CreateDealloc(llvm::IRBuilder<> &B, llvm::Value *ToFree);
 
+/// Whether cache buffers should be allocated out of the tape arena, either
+/// the builtin one, the memory mapped backend, or one registered through the
+/// C API
+bool useTapeArena();
+
+/// Whether the tape arena is the backend spilling large cache buffers to
+/// memory mapped files
+bool useTapeMmap();
+
+/// Whether the lanes \p Lanes are computed by the same elementwise floating
+/// point operation, so that combineLanes computes them by a vector operation
+bool isCombinableLanes(llvm::ArrayRef<llvm::Value *> Lanes);
+
+/// Return a vector whose elements are \p Lanes, emitted at the insertion
+/// point of \p B. Lanes computed by the same elementwise floating point
+/// operation on different operands are computed by one vector operation,
+/// recursively, and other lanes are inserted into the vector one at a time.
+/// The scalar instructions computed by vector operations are appended to
+/// \p Combined. If \p Packs is given, lanes inserted one at a time are
+/// packed once right after their definition and cached in \p Packs, so that
+/// later calls reuse the vector rather than repacking it at each use.
+llvm::Value *combineLanes(
+    llvm::IRBuilder<> &B, llvm::ArrayRef<llvm::Value *> Lanes,
+    llvm::SmallVectorImpl<llvm::Instruction *> &Combined,
+    std::map<llvm::SmallVector<llvm::Value *, 4>, llvm::Value *> *Packs =
+        nullptr);
+
+/// Allocate Count elements of T out of the tape arena
+llvm::Value *CreateTapeAllocation(llvm::IRBuilder<> &B, llvm::Type *T,
+                                  llvm::Value *Count, llvm::Twine Name = "",
+                                  llvm::CallInst **caller = nullptr,
+                                  llvm::Instruction **ZeroMem = nullptr);
+
+/// Return memory allocated by CreateTapeAllocation to the tape arena
+llvm::CallInst *CreateTapeDealloc(llvm::IRBuilder<> &B, llvm::Value *ToFree);
+
+/// Hint that the reverse pass is about to read the element of Stride bytes at
+/// byte Offset of Ptr, allocated by the memory mapped tape backend
+llvm::CallInst *CreateTapePrefetch(llvm::IRBuilder<> &B, llvm::Value *Ptr,
+                                   llvm::Value *Offset, uint64_t Stride);
+
 llvm::Value *CreateReAllocation(llvm::IRBuilder<> &B, llvm::Value *prev,
                                 llvm::Type *T, llvm::Value *OuterCount,
                                 llvm::Value *InnerCount, llvm::Twine Name = "",
                                 llvm::CallInst **caller = nullptr,
-                                bool ZeroMem = false);
+                                bool ZeroMem = false, bool Arena = false);
+
+/// Whether caches of dynamic loops are kept in fixed size segments
+bool useSegmentedCache();
+
+/// Log2 of the number of dynamic loop iterations held by one cache segment
+unsigned getCacheSegmentShift();
+
+/// Ensure the segmented cache prev has a segment for iteration Iteration of a
+/// dynamic loop, each iteration holding InnerCount elements of T. Return the
+/// possibly moved directory of segments.
+llvm::Value *CreateSegmentedAllocation(llvm::IRBuilder<> &B, llvm::Value *prev,
+                                       llvm::Type *T, llvm::Value *Iteration,
+                                       llvm::Value *InnerCount,
+                                       llvm::Twine Name = "",
+                                       llvm::CallInst **caller = nullptr,
+                                       bool ZeroMem = false);
+
+/// Free every segment of a segmented cache and its directory
+llvm::CallInst *CreateSegmentedDealloc(llvm::IRBuilder<> &B,
+                                       llvm::Value *ToFree);
 
 extern std::map<std::string, std::function<llvm::Value *(
                                  llvm::IRBuilder<> &, llvm::CallInst *,
@@ -145,6 +224,21 @@ void EmitWarning(llvm::StringRef RemarkName, const llvm::Function *F,
     (llvm::errs() << ... << args) << "\n";
 }
 
+/// Report a decision to cache or recompute \p V, or the cache named \p Name
+/// if \p V is null, as an analysis remark through \p ORE. The remark gives
+/// the size of one element, the depth of the loop nest the value is cached in
+/// and the estimated number of bytes of tape for it.
+void EmitCacheRemark(llvm::OptimizationRemarkEmitter &ORE,
+                     llvm::StringRef RemarkName,
+                     const llvm::DiagnosticLocation &Loc,
+                     const llvm::BasicBlock *BB, llvm::StringRef Message,
+                     const llvm::Value *V, llvm::StringRef Name,
+                     uint64_t ElementBytes, unsigned LoopDepth,
+                     uint64_t EstimatedBytes);
+
+/// The location of the first instruction of \p BB with a debug location
+llvm::DiagnosticLocation getBlockLocation(const llvm::BasicBlock *BB);
+
 class EnzymeFailure final : public llvm::DiagnosticInfoIROptimization {
 public:
   EnzymeFailure(llvm::StringRef RemarkName, const llvm::DiagnosticLocation &Loc,
@@ -573,11 +667,81 @@ getOrInsertDifferentialFloatMemcpy(llvm::Module &M, llvm::Type *T,
                                    unsigned dstalign, unsigned srcalign,
                                    unsigned dstaddr, unsigned srcaddr);
 
+/// Create function for type that performs one update of the adjoint fixed
+/// point iteration lambda = seed + J^T lambda, given the product in prod.
+/// It writes the new lambda to dout, clears prod, and returns whether lambda
+/// moved by no more than the given tolerance
+llvm::Function *getOrInsertFixedPointUpdate(llvm::Module &M,
+                                            llvm::Type *elementType);
+
 /// Create function for type that performs memcpy with a stride
 llvm::Function *getOrInsertMemcpyStrided(llvm::Module &M, llvm::PointerType *T,
                                          llvm::Type *IT, unsigned dstalign,
                                          unsigned srcalign);
 
+/// Column-wise operations on a matrix which are performed by calling the
+/// corresponding level 1 BLAS routine once per column
+enum class BLASMatrixOp { Dot, Axpy, Scal, Copy };
+
+/// Emits calls to BLAS routines using the same calling convention (cblas or
+/// Fortran, integer width, precision) as an existing call to BLAS. Matrices
+/// are always passed in column-major order.
+class BLASEmitter {
+public:
+  /// Triangle of a matrix touched by BLASEmitter::matrix, passed as an i8
+  enum Triangle { Full = 0, Upper = 1, Lower = 2 };
+
+  BLASEmitter(llvm::Module &M, llvm::IRBuilder<> &AllocaBuilder,
+              llvm::StringRef prefix, llvm::StringRef suffix,
+              llvm::Type *fpType, llvm::IntegerType *intType, bool byRef);
+
+  /// Pass an integer operand, converting it to \p intType
+  llvm::Value *integer(llvm::IRBuilder<> &B, llvm::Value *V);
+  llvm::Value *integer(llvm::IRBuilder<> &B, int64_t C);
+
+  /// Pass a floating point scalar operand
+  llvm::Value *fp(llvm::IRBuilder<> &B, llvm::Value *V);
+  llvm::Value *fp(llvm::IRBuilder<> &B, double C);
+
+  /// Pass an array operand
+  llvm::Value *ptr(llvm::IRBuilder<> &B, llvm::Value *V);
+
+  /// Pass a character operand given the i1 condition selecting between the
+  /// two choices of the flag
+  llvm::Value *trans(llvm::IRBuilder<> &B, llvm::Value *isTrans);
+  llvm::Value *uplo(llvm::IRBuilder<> &B, llvm::Value *isUpper);
+  llvm::Value *diag(llvm::IRBuilder<> &B, llvm::Value *isUnit);
+  llvm::Value *side(llvm::IRBuilder<> &B, llvm::Value *isLeft);
+
+  /// Call \p routine (without precision, prefix or suffix, e.g. "gemm") with
+  /// already converted operands, prepending the column-major layout for cblas
+  /// level 2 and 3 routines
+  llvm::CallInst *call(llvm::IRBuilder<> &B, llvm::StringRef routine,
+                       llvm::ArrayRef<llvm::Value *> args);
+
+  /// Apply \p op to the \p tri triangle (excluding the diagonal if the i1
+  /// \p unit is set) of the columns of an m x n matrix. Operands are passed
+  /// unconverted as m, n, [alpha,] X, ldx[, Y, ldy].
+  llvm::Value *matrix(llvm::IRBuilder<> &B, BLASMatrixOp op,
+                      llvm::Value *tri, llvm::Value *unit,
+                      llvm::ArrayRef<llvm::Value *> args);
+
+  llvm::Type *fpType;
+  llvm::IntegerType *intType;
+  bool byRef;
+
+private:
+  llvm::Value *flag(llvm::IRBuilder<> &B, llvm::Value *cond, char setChar,
+                    char unsetChar, unsigned setEnum, unsigned unsetEnum);
+  llvm::Value *byReference(llvm::IRBuilder<> &B, llvm::Value *V);
+  std::string name(llvm::StringRef routine) const;
+
+  llvm::Module &M;
+  llvm::IRBuilder<> &AllocaBuilder;
+  std::string prefix;
+  std::string suffix;
+};
+
 /// Create function for type that performs the derivative memmove on floating
 /// point memory
 llvm::Function *
@@ -593,6 +757,30 @@ llvm::Function *getOrInsertDifferentialMPI_Wait(llvm::Module &M,
                                                 llvm::ArrayRef<llvm::Type *> T,
                                                 llvm::Type *reqType);
 
+/// Create function that completes the adjoint of a start of a persistent
+/// request, given its bookkeeping
+llvm::Function *getOrInsertDifferentialMPI_Start(llvm::Module &M,
+                                                 llvm::Type *reqType,
+                                                 llvm::Type *statusType);
+
+/// Create function that completes the adjoints of the starts of an array of
+/// persistent requests, given their bookkeeping
+llvm::Function *getOrInsertDifferentialMPI_Startall(llvm::Module &M,
+                                                    llvm::Type *countType,
+                                                    llvm::Type *reqType,
+                                                    llvm::Type *statusType);
+
+/// Create function returning the number of elements spanned by the blocks of
+/// a vector collective, given its counts, displacements and number of blocks
+llvm::Function *getOrInsertMPIExtent(llvm::Module &M, llvm::Type *countsType,
+                                     llvm::Type *intType);
+
+/// Create function storing the in and out degrees of the neighborhood of a
+/// communicator with a process topology
+llvm::Function *getOrInsertMPINeighborCount(llvm::Module &M,
+                                            llvm::Type *commType,
+                                            llvm::Type *intType);
+
 /// Create function to computer nearest power of two
 llvm::Value *nextPowerOfTwo(llvm::IRBuilder<> &B, llvm::Value *V);
 
@@ -896,6 +1084,10 @@ allInstructionsBetween(llvm::LoopInfo &LI, llvm::Instruction *inst1,
 enum class MPI_CallType {
   ISEND = 1,
   IRECV = 2,
+  IALLREDUCE = 3,
+  IBCAST = 4,
+  PSEND = 5,
+  PRECV = 6,
 };
 
 enum class MPI_Elem {
@@ -925,6 +1117,24 @@ static inline llvm::StructType *getMPIHelper(llvm::LLVMContext &Context) {
   return StructType::get(Context, types, false);
 }
 
+enum class MPI_PersistentElem { Helper = 0, Shadow = 1, Op = 2, Request = 3 };
+
+/// The bookkeeping of a persistent request extends the MPI helper with the
+/// shadow buffer, the reduction used to accumulate into it, and the adjoint
+/// persistent request, which is created once and restarted for every start of
+/// the primal request.
+static inline llvm::StructType *
+getMPIPersistentHelper(llvm::LLVMContext &Context, llvm::Type *reqType) {
+  using namespace llvm;
+  Type *types[] = {
+      /*helper  0 */ getMPIHelper(Context),
+      /*shadow  1 */ Type::getInt8PtrTy(Context),
+      /*op      2 */ Type::getInt8PtrTy(Context),
+      /*request 3 */ reqType,
+  };
+  return StructType::get(Context, types, false);
+}
+
 template <MPI_Elem E, bool Pointer = true>
 static inline llvm::Value *getMPIMemberPtr(llvm::IRBuilder<> &B,
                                            llvm::Value *V) {
@@ -945,6 +1155,49 @@ static inline llvm::Value *getMPIMemberPtr(llvm::IRBuilder<> &B,
   }
 }
 
+enum class PThread_Elem {
+  Arg = 0,
+  Shadow = 1,
+  Tape = 2,
+  Return = 3,
+  Reverse = 4,
+  Thread = 5
+};
+
+/// The closure handed to a thread spawned by differentiated code carries the
+/// argument and its shadow into the augmented routine, and carries the tape,
+/// the value returned by the routine, and the routine's adjoint back out to
+/// the join. The adjoint of the join spawns that adjoint as a thread of its
+/// own, whose id is kept for the adjoint of the create to join.
+static inline llvm::StructType *getPThreadClosure(llvm::LLVMContext &Context,
+                                                  llvm::Type *threadType) {
+  using namespace llvm;
+  Type *types[] = {
+      /*arg     0 */ Type::getInt8PtrTy(Context),
+      /*shadow  1 */ Type::getInt8PtrTy(Context),
+      /*tape    2 */ Type::getInt8PtrTy(Context),
+      /*return  3 */ Type::getInt8PtrTy(Context),
+      /*reverse 4 */ Type::getInt8PtrTy(Context),
+      /*thread  5 */ threadType,
+  };
+  return StructType::get(Context, types, false);
+}
+
+template <PThread_Elem E>
+static inline llvm::Value *getPThreadMemberPtr(llvm::IRBuilder<> &B,
+                                               llvm::Value *V) {
+  using namespace llvm;
+  auto i64 = Type::getInt64Ty(V->getContext());
+  auto i32 = Type::getInt32Ty(V->getContext());
+  auto c0_64 = ConstantInt::get(i64, 0);
+#if LLVM_VERSION_MAJOR > 7
+  return B.CreateInBoundsGEP(V->getType()->getPointerElementType(), V,
+                             {c0_64, ConstantInt::get(i32, (uint64_t)E)});
+#else
+  return B.CreateInBoundsGEP(V, {c0_64, ConstantInt::get(i32, (uint64_t)E)});
+#endif
+}
+
 llvm::Value *getOrInsertOpFloatSum(llvm::Module &M, llvm::Type *OpPtr,
                                    ConcreteType CT, llvm::Type *intType,
                                    llvm::IRBuilder<> &B2);
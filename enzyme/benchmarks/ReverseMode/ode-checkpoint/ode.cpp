@@ -0,0 +1,70 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+template<typename Return, typename... T>
+Return __enzyme_autodiff(T...);
+
+static float tdiff(struct timeval *start, struct timeval *end) {
+  return (end->tv_sec-start->tv_sec) + 1e-6*(end->tv_usec-start->tv_usec);
+}
+
+// Count the bytes requested from malloc, which includes every tape
+// allocation made by the generated gradient.
+extern "C" void *__libc_malloc(size_t);
+static size_t allocated = 0;
+extern "C" void *malloc(size_t size) {
+  allocated += size;
+  return __libc_malloc(size);
+}
+
+// Van der Pol oscillator integrated with classical Runge-Kutta.
+static inline void vdp(double mu, double x, double y, double &dx, double &dy) {
+  dx = y;
+  dy = mu * (1 - x * x) * y - x;
+}
+
+double integrate(double mu, double h, uint64_t steps) {
+  double x = 2.0, y = 0.0;
+  for (uint64_t i = 0; i < steps; i++) {
+    double k1x, k1y, k2x, k2y, k3x, k3y, k4x, k4y;
+    vdp(mu, x, y, k1x, k1y);
+    vdp(mu, x + h / 2 * k1x, y + h / 2 * k1y, k2x, k2y);
+    vdp(mu, x + h / 2 * k2x, y + h / 2 * k2y, k3x, k3y);
+    vdp(mu, x + h * k3x, y + h * k3y, k4x, k4y);
+    x += h / 6 * (k1x + 2 * k2x + 2 * k3x + k4x);
+    y += h / 6 * (k1y + 2 * k2y + 2 * k3y + k4y);
+  }
+  return x * x + y * y;
+}
+
+int main(int argc, char** argv) {
+
+  uint64_t max_iters = atoll(argv[1]);
+  double mu = 1.5;
+
+  for(uint64_t iters=max_iters/10; iters<=max_iters; iters+=max_iters/10) {
+    double h = 10.0 / iters;
+    {
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    double res = integrate(mu, h, iters);
+
+    gettimeofday(&end, NULL);
+    printf("iters=%" PRIu64 " primal %0.6f res=%f\n", iters, tdiff(&start, &end), res);
+    }
+
+    {
+    struct timeval start, end;
+    size_t before = allocated;
+    gettimeofday(&start, NULL);
+
+    double dmu = __enzyme_autodiff<double>(integrate, mu, h, iters);
+
+    gettimeofday(&end, NULL);
+    printf("iters=%" PRIu64 " gradient %0.6f tape=%zu res'=%f\n", iters, tdiff(&start, &end), allocated - before, dmu);
+    }
+  }
+}
@@ -0,0 +1,81 @@
+// Scaling of the reverse of a parallel stencil whose few coefficients are
+// read by every thread, over the number of threads and the problem size.
+// Every thread accumulates into the shadow of the coefficients, which is
+// done atomically unless thread-private shadows are enabled.
+
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <omp.h>
+
+void __enzyme_autodiff(void*, ...);
+
+#define K 4
+
+static void check(double res, double expected, double tol) {
+  if (fabs(res - expected) > tol) {
+    fprintf(stderr, "incorrect gradient %f, expected %f\n", res, expected);
+    abort();
+  }
+}
+
+void stencil(const double* c, const double* x, double* out, int n) {
+  #pragma omp parallel for
+  for (int i=0; i<n; i++) {
+    double sum = 0;
+    for (int k=0; k<K; k++)
+      sum += c[k] * x[i+k];
+    out[i] = sum;
+  }
+}
+
+int main(int argc, char** argv) {
+  int sizes[] = {1 << 10, 1 << 14, 1 << 18};
+  int maxThreads = omp_get_max_threads();
+
+  for (int s=0; s<sizeof(sizes)/sizeof(*sizes); s++) {
+    int n = sizes[s];
+    double* x = (double*)malloc(sizeof(double) * (n + K));
+    double* d_x = (double*)malloc(sizeof(double) * (n + K));
+    double* out = (double*)malloc(sizeof(double) * n);
+    double* d_out = (double*)malloc(sizeof(double) * n);
+    for (int i=0; i<n+K; i++)
+      x[i] = 1.0 / (i + 1);
+
+    for (int threads=1; threads<=maxThreads; threads*=2) {
+      omp_set_num_threads(threads);
+
+      double c[K] = {0.5, -1.0, 2.0, 0.25};
+      double d_c[K] = {0};
+      for (int i=0; i<n+K; i++)
+        d_x[i] = 0;
+      for (int i=0; i<n; i++)
+        d_out[i] = 1.0;
+
+      double start = omp_get_wtime();
+      __enzyme_autodiff((void*)stencil, c, d_c, x, d_x, out, d_out, n);
+      double end = omp_get_wtime();
+      printf("n=%d threads=%d reverse=%fs\n", n, threads, end - start);
+
+      for (int k=0; k<K; k++) {
+        double expected = 0;
+        for (int i=0; i<n; i++)
+          expected += x[i+k];
+        check(d_c[k], expected, 1e-8 * n);
+      }
+      for (int i=0; i<n+K; i++) {
+        double expected = 0;
+        for (int k=0; k<K; k++)
+          if (i - k >= 0 && i - k < n)
+            expected += c[k];
+        check(d_x[i], expected, 1e-10);
+      }
+    }
+
+    free(x);
+    free(d_x);
+    free(out);
+    free(d_out);
+  }
+  return 0;
+}
@@ -0,0 +1,53 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+template<typename Return, typename... T>
+Return __enzyme_autodiff(T...);
+
+static float tdiff(struct timeval *start, struct timeval *end) {
+  return (end->tv_sec-start->tv_sec) + 1e-6*(end->tv_usec-start->tv_usec);
+}
+
+// Explicit Euler steps of a chain of pendulums updated in place, so that the
+// gradient caches every cell of every step. The tape holds steps * n doubles.
+double simulate(double *x, uint64_t n, uint64_t steps) {
+  for (uint64_t t = 0; t < steps; t++) {
+    for (uint64_t i = 0; i < n; i++)
+      x[i] += 1e-3 * __builtin_sin(x[i]);
+  }
+  double sum = 0;
+  for (uint64_t i = 0; i < n; i++)
+    sum += x[i] * x[i];
+  return sum;
+}
+
+int main(int argc, char** argv) {
+
+  // Size the tape several times larger than the memory limit, in MiB, the
+  // benchmark is run under.
+  uint64_t limit = atoll(argv[1]);
+  uint64_t factor = argc > 2 ? atoll(argv[2]) : 4;
+  uint64_t n = 1 << 16;
+  uint64_t steps = (factor * limit << 20) / (n * sizeof(double));
+
+  double *x = (double *)malloc(n * sizeof(double));
+  double *dx = (double *)calloc(n, sizeof(double));
+  for (uint64_t i = 0; i < n; i++)
+    x[i] = 0.5 + 1e-5 * i;
+
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+
+  __enzyme_autodiff<void>(simulate, x, dx, n, steps);
+
+  gettimeofday(&end, NULL);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("steps=%" PRIu64 " tape=%" PRIu64 "MiB limit=%" PRIu64
+         "MiB gradient %0.6f maxrss=%ldMiB res'=%f\n",
+         steps, (steps * n * sizeof(double)) >> 20, limit,
+         tdiff(&start, &end), usage.ru_maxrss >> 10, dx[0]);
+}
@@ -0,0 +1,38 @@
+; RUN: %opt < %s %loadEnzyme -print-activity-analysis -activity-analysis-func=kernel_main -o /dev/null | FileCheck %s
+; RUN: %opt < %s %loadEnzyme -enzyme-summary -S | %opt %loadEnzyme -print-activity-analysis -activity-analysis-func=kernel_main -o /dev/null | FileCheck %s --check-prefix=SUMMARY
+
+; The embedded summary of @record shows that it only uses the bits of its
+; argument as an integer, so %m is inactive as its only use is by @record
+
+@seen = global i64 0
+
+define double @kernel_main(double %x) {
+entry:
+  %m = fmul double %x, %x
+  call void @record(double %m)
+  ret double %x
+}
+
+define void @record(double %d) {
+entry:
+  %b = bitcast double %d to i64
+  store i64 %b, i64* @seen, align 8, !tbaa !0
+  ret void
+}
+
+!0 = !{!1, !1, i64 0}
+!1 = !{!"long", !2, i64 0}
+!2 = !{!"omnipotent char", !3, i64 0}
+!3 = !{!"Simple C/C++ TBAA"}
+
+; CHECK: double %x: icv:0
+; CHECK-NEXT: entry
+; CHECK-NEXT:   %m = fmul double %x, %x: icv:0 ici:0
+; CHECK-NEXT:   call void @record(double %m): icv:1 ici:0
+; CHECK-NEXT:   ret double %x: icv:1 ici:1
+
+; SUMMARY: double %x: icv:0
+; SUMMARY-NEXT: entry
+; SUMMARY-NEXT:   %m = fmul double %x, %x: icv:1 ici:1
+; SUMMARY-NEXT:   call void @record(double %m): icv:1 ici:1
+; SUMMARY-NEXT:   ret double %x: icv:1 ici:1
@@ -0,0 +1,16 @@
+;RUN: if [ %llvmver -ge 10 && %llvmver -le 12 ]; then %clang %s -Xclang -load -Xclang %loadBC -S -emit-llvm -o - | %FileCheck %s; fi
+;RUN: if [ %llvmver -ge 12 ]; then %clang %s -fno-experimental-new-pass-manager -Xclang -load -Xclang %loadBC -S -emit-llvm -o - | %FileCheck %s; fi
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+; Function Attrs: noinline nounwind optnone uwtable
+define dso_local void @g(double* %A, double* %x) {
+entry:
+  call void @cblas_dtrsv(i32 101, i32 121, i32 111, i32 131, i32 3, double* %A, i32 3, double* %x, i32 1)
+  ret void
+}
+
+declare dso_local void @cblas_dtrsv(i32, i32, i32, i32, i32, double*, i32, double*, i32)
+
+;CHECK: define internal void @cblas_dtrsv
@@ -0,0 +1,18 @@
+;RUN: if [ %llvmver -ge 10 && %llvmver -le 12 ]; then %clang %s -Xclang -load -Xclang %loadBC -S -emit-llvm -o - | %FileCheck %s; fi
+;RUN: if [ %llvmver -ge 12 ]; then %clang %s -fno-experimental-new-pass-manager -Xclang -load -Xclang %loadBC -S -emit-llvm -o - | %FileCheck %s; fi
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+; Function Attrs: noinline nounwind optnone uwtable
+define void @caller(i8* %transa, i8* %transb, i32* %m, i32* %n, i32* %k, double* %alpha, double* %A, i32* %lda, double* %B, i32* %ldb, double* %beta, double* %C, i32* %ldc) {
+entry:
+  call void @dgemm_(i8* %transa, i8* %transb, i32* %m, i32* %n, i32* %k, double* %alpha, double* %A, i32* %lda, double* %B, i32* %ldb, double* %beta, double* %C, i32* %ldc)
+  ret void
+}
+
+declare dso_local void @dgemm_(i8*, i8*, i32*, i32*, i32*, double*, double*, i32*, double*, i32*, double*, double*, i32*)
+
+;CHECK-DAG: define internal void @dgemm_
+;CHECK-DAG: define internal void @cblas_dgemm
+;CHECK-NOT: define {{.*}} @ddot_
@@ -0,0 +1,42 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-vector-shadow -mem2reg -S | FileCheck %s
+
+declare [4 x double] @__enzyme_batch(...)
+
+define double @square_add(double %x, double %y) {
+entry:
+  %mul = fmul double %x, %x
+  %add = fadd double %mul, %y
+  ret double %add
+}
+
+define [4 x double] @dsquare(double %x1, double %x2, double %x3, double %x4, double %y) {
+entry:
+  %call = call [4 x double] (...) @__enzyme_batch(double (double, double)* @square_add, metadata !"enzyme_width", i64 4, metadata !"enzyme_vector", double %x1, double %x2, double %x3, double %x4, metadata !"enzyme_scalar", double %y)
+  ret [4 x double] %call
+}
+
+
+; CHECK: define internal [4 x double] @batch_square_add([4 x double] %x, double %y)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %.splatinsert = insertelement <4 x double> poison, double %y, i32 0
+; CHECK-NEXT:   %.splat = shufflevector <4 x double> %.splatinsert, <4 x double> poison, <4 x i32> zeroinitializer
+; CHECK-NEXT:   %unwrap.x0 = extractvalue [4 x double] %x, 0
+; CHECK-NEXT:   %unwrap.x1 = extractvalue [4 x double] %x, 1
+; CHECK-NEXT:   %unwrap.x2 = extractvalue [4 x double] %x, 2
+; CHECK-NEXT:   %unwrap.x3 = extractvalue [4 x double] %x, 3
+; CHECK-NEXT:   %0 = insertelement <4 x double> undef, double %unwrap.x0, i64 0
+; CHECK-NEXT:   %1 = insertelement <4 x double> %0, double %unwrap.x1, i64 1
+; CHECK-NEXT:   %2 = insertelement <4 x double> %1, double %unwrap.x2, i64 2
+; CHECK-NEXT:   %3 = insertelement <4 x double> %2, double %unwrap.x3, i64 3
+; CHECK-NEXT:   %mul = fmul <4 x double> %3, %3
+; CHECK-NEXT:   %add = fadd <4 x double> %mul, %.splat
+; CHECK-NEXT:   %4 = extractelement <4 x double> %add, i64 0
+; CHECK-NEXT:   %5 = extractelement <4 x double> %add, i64 1
+; CHECK-NEXT:   %6 = extractelement <4 x double> %add, i64 2
+; CHECK-NEXT:   %7 = extractelement <4 x double> %add, i64 3
+; CHECK-NEXT:   %mrv = insertvalue [4 x double] undef, double %4, 0
+; CHECK-NEXT:   %mrv1 = insertvalue [4 x double] %mrv, double %5, 1
+; CHECK-NEXT:   %mrv2 = insertvalue [4 x double] %mrv1, double %6, 2
+; CHECK-NEXT:   %mrv3 = insertvalue [4 x double] %mrv2, double %7, 3
+; CHECK-NEXT:   ret [4 x double] %mrv3
+; CHECK-NEXT: }
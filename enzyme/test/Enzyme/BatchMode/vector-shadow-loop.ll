@@ -0,0 +1,71 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-vector-shadow -mem2reg -S | FileCheck %s
+
+declare [4 x double] @__enzyme_batch(...)
+
+define double @horner(double %x, double* %c, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi double [ 0.000000e+00, %entry ], [ %acc.next, %loop ]
+  %gep = getelementptr inbounds double, double* %c, i64 %i
+  %ci = load double, double* %gep
+  %mul = fmul double %acc, %x
+  %acc.next = fadd double %mul, %ci
+  %i.next = add nuw i64 %i, 1
+  %cmp = icmp eq i64 %i.next, %n
+  br i1 %cmp, label %exit, label %loop
+
+exit:
+  ret double %acc.next
+}
+
+define [4 x double] @vhorner(double %x1, double %x2, double %x3, double %x4, double* %c, i64 %n) {
+entry:
+  %call = call [4 x double] (...) @__enzyme_batch(double (double, double*, i64)* @horner, metadata !"enzyme_width", i64 4, metadata !"enzyme_vector", double %x1, double %x2, double %x3, double %x4, metadata !"enzyme_scalar", double* %c, metadata !"enzyme_scalar", i64 %n)
+  ret [4 x double] %call
+}
+
+
+; CHECK: define internal [4 x double] @batch_horner([4 x double] %x, double* %c, i64 %n) {
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %unwrap.x0 = extractvalue [4 x double] %x, 0
+; CHECK-NEXT:   %unwrap.x1 = extractvalue [4 x double] %x, 1
+; CHECK-NEXT:   %unwrap.x2 = extractvalue [4 x double] %x, 2
+; CHECK-NEXT:   %unwrap.x3 = extractvalue [4 x double] %x, 3
+; CHECK-NEXT:   %0 = insertelement <4 x double> undef, double %unwrap.x0, i64 0
+; CHECK-NEXT:   %1 = insertelement <4 x double> %0, double %unwrap.x1, i64 1
+; CHECK-NEXT:   %2 = insertelement <4 x double> %1, double %unwrap.x2, i64 2
+; CHECK-NEXT:   %3 = insertelement <4 x double> %2, double %unwrap.x3, i64 3
+; CHECK-NEXT:   br label %loop
+
+; CHECK: loop:
+; CHECK-NEXT:   %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+; CHECK-NEXT:   %acc6 = phi <4 x double> [ zeroinitializer, %entry ], [ %acc.next, %loop ]
+; CHECK-NEXT:   %gep = getelementptr inbounds double, double* %c, i64 %i
+; CHECK-NEXT:   %ci0 = load double, double* %gep, align 8
+; CHECK-NEXT:   %ci1 = load double, double* %gep, align 8
+; CHECK-NEXT:   %ci2 = load double, double* %gep, align 8
+; CHECK-NEXT:   %ci3 = load double, double* %gep, align 8
+; CHECK-NEXT:   %4 = insertelement <4 x double> undef, double %ci0, i64 0
+; CHECK-NEXT:   %5 = insertelement <4 x double> %4, double %ci1, i64 1
+; CHECK-NEXT:   %6 = insertelement <4 x double> %5, double %ci2, i64 2
+; CHECK-NEXT:   %7 = insertelement <4 x double> %6, double %ci3, i64 3
+; CHECK-NEXT:   %mul = fmul <4 x double> %acc6, %3
+; CHECK-NEXT:   %acc.next = fadd <4 x double> %mul, %7
+; CHECK-NEXT:   %8 = extractelement <4 x double> %acc.next, i64 0
+; CHECK-NEXT:   %9 = extractelement <4 x double> %acc.next, i64 1
+; CHECK-NEXT:   %10 = extractelement <4 x double> %acc.next, i64 2
+; CHECK-NEXT:   %11 = extractelement <4 x double> %acc.next, i64 3
+; CHECK-NEXT:   %i.next = add nuw i64 %i, 1
+; CHECK-NEXT:   %cmp = icmp eq i64 %i.next, %n
+; CHECK-NEXT:   br i1 %cmp, label %exit, label %loop
+
+; CHECK: exit:
+; CHECK-NEXT:   %mrv = insertvalue [4 x double] undef, double %8, 0
+; CHECK-NEXT:   %mrv3 = insertvalue [4 x double] %mrv, double %9, 1
+; CHECK-NEXT:   %mrv4 = insertvalue [4 x double] %mrv3, double %10, 2
+; CHECK-NEXT:   %mrv5 = insertvalue [4 x double] %mrv4, double %11, 3
+; CHECK-NEXT:   ret [4 x double] %mrv5
+; CHECK-NEXT: }
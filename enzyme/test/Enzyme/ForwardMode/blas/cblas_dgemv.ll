@@ -0,0 +1,30 @@
+;RUN: %opt < %s %loadEnzyme -enzyme -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+declare dso_local void @__enzyme_fwddiff(...)
+
+declare void @cblas_dgemv(i32, i32, i32, i32, double, double*, i32, double*, i32, double, double*, i32)
+
+define void @f(i32 %m, i32 %n, double %alpha, double* noalias %A, i32 %lda, double* noalias %x, double %beta, double* noalias %y) {
+entry:
+  call void @cblas_dgemv(i32 101, i32 111, i32 %m, i32 %n, double %alpha, double* %A, i32 %lda, double* %x, i32 1, double %beta, double* %y, i32 1)
+  ret void
+}
+
+define void @active(i32 %m, i32 %n, double %alpha, double %dalpha, double* %A, double* %dA, i32 %lda, double* %x, double* %dx, double %beta, double* %y, double* %dy) {
+entry:
+  call void (...) @__enzyme_fwddiff(void (i32, i32, double, double*, i32, double*, double, double*)* @f, i32 %m, i32 %n, double %alpha, double %dalpha, double* %A, double* %dA, i32 %lda, double* %x, double* %dx, metadata !"enzyme_const", double %beta, double* %y, double* %dy)
+  ret void
+}
+
+; CHECK: define internal void @fwddiffef(i32 %m, i32 %n, double %alpha, double %"alpha'", double* noalias %A, double* %"A'", i32 %lda, double* noalias %x, double* %"x'", double %beta, double* noalias %y, double* %"y'")
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   call void @cblas_dscal(i32 %m, double %beta, double* %"y'", i32 1)
+; CHECK-NEXT:   call void @cblas_dgemv(i32 102, i32 112, i32 %n, i32 %m, double %alpha, double* %A, i32 %lda, double* %"x'", i32 1, double 1.000000e+00, double* %"y'", i32 1)
+; CHECK-NEXT:   call void @cblas_dgemv(i32 102, i32 112, i32 %n, i32 %m, double %alpha, double* %"A'", i32 %lda, double* %x, i32 1, double 1.000000e+00, double* %"y'", i32 1)
+; CHECK-NEXT:   call void @cblas_dgemv(i32 102, i32 112, i32 %n, i32 %m, double %"alpha'", double* %A, i32 %lda, double* %x, i32 1, double 1.000000e+00, double* %"y'", i32 1)
+; CHECK-NEXT:   call void @cblas_dgemv(i32 101, i32 111, i32 %m, i32 %n, double %alpha, double* %A, i32 %lda, double* %x, i32 1, double %beta, double* %y, i32 1)
+; CHECK-NEXT:   ret void
+; CHECK-NEXT: }
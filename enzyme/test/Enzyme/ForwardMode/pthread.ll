@@ -0,0 +1,145 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+%struct.W = type { double*, double* }
+%union.pthread_attr_t = type { i64, [48 x i8] }
+
+define internal i8* @body(i8* %p) {
+entry:
+  %w = bitcast i8* %p to %struct.W*
+  %xp = getelementptr inbounds %struct.W, %struct.W* %w, i64 0, i32 0
+  %x = load double*, double** %xp
+  %yp = getelementptr inbounds %struct.W, %struct.W* %w, i64 0, i32 1
+  %y = load double*, double** %yp
+  %a = load double, double* %x
+  %sq = fmul double %a, %a
+  %cu = fmul double %sq, %a
+  store double %cu, double* %y
+  store double 0.000000e+00, double* %x
+  ret i8* %p
+}
+
+define void @f(double* %x, double* %y) {
+entry:
+  %t = alloca [2 x i64]
+  %w = alloca [2 x %struct.W]
+  %r = alloca i8*
+  %w0 = getelementptr inbounds [2 x %struct.W], [2 x %struct.W]* %w, i64 0, i64 0
+  %w1 = getelementptr inbounds [2 x %struct.W], [2 x %struct.W]* %w, i64 0, i64 1
+  %x1 = getelementptr inbounds double, double* %x, i64 1
+  %y1 = getelementptr inbounds double, double* %y, i64 1
+  %w0x = getelementptr inbounds %struct.W, %struct.W* %w0, i64 0, i32 0
+  store double* %x, double** %w0x
+  %w0y = getelementptr inbounds %struct.W, %struct.W* %w0, i64 0, i32 1
+  store double* %y, double** %w0y
+  %w1x = getelementptr inbounds %struct.W, %struct.W* %w1, i64 0, i32 0
+  store double* %x1, double** %w1x
+  %w1y = getelementptr inbounds %struct.W, %struct.W* %w1, i64 0, i32 1
+  store double* %y1, double** %w1y
+  %t0 = getelementptr inbounds [2 x i64], [2 x i64]* %t, i64 0, i64 0
+  %t1 = getelementptr inbounds [2 x i64], [2 x i64]* %t, i64 0, i64 1
+  %p0 = bitcast %struct.W* %w0 to i8*
+  %p1 = bitcast %struct.W* %w1 to i8*
+  %c0 = call i32 @pthread_create(i64* %t0, %union.pthread_attr_t* null, i8* (i8*)* @body, i8* %p0)
+  %c1 = call i32 @pthread_create(i64* %t1, %union.pthread_attr_t* null, i8* (i8*)* @body, i8* %p1)
+  %l0 = load i64, i64* %t0
+  %j0 = call i32 @pthread_join(i64 %l0, i8** %r)
+  %l1 = load i64, i64* %t1
+  %j1 = call i32 @pthread_join(i64 %l1, i8** null)
+  ret void
+}
+
+declare i32 @pthread_create(i64*, %union.pthread_attr_t*, i8* (i8*)*, i8*)
+declare i32 @pthread_join(i64, i8**)
+
+define void @dsquare(double* %x, double* %dx, double* %y, double* %dy) {
+entry:
+  %0 = tail call double (void (double*, double*)*, ...) @__enzyme_fwddiff(void (double*, double*)* nonnull @f, double* %x, double* %dx, double* %y, double* %dy)
+  ret void
+}
+
+declare double @__enzyme_fwddiff(void (double*, double*)*, ...)
+
+; CHECK: define internal void @fwddiffef(double* %x, double* %"x'", double* %y, double* %"y'")
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = alloca i8*
+; CHECK-NEXT:   %1 = alloca i8*
+; CHECK-NEXT:   %t = alloca [2 x i64]
+; CHECK-NEXT:   %"w'ipa" = alloca [2 x %struct.W]
+; CHECK-NEXT:   store [2 x %struct.W] zeroinitializer, [2 x %struct.W]* %"w'ipa"
+; CHECK-NEXT:   %w = alloca [2 x %struct.W]
+; CHECK-NEXT:   %r = alloca i8*
+; CHECK-NEXT:   %"w0'ipg" = getelementptr inbounds [2 x %struct.W], [2 x %struct.W]* %"w'ipa", i64 0, i64 0
+; CHECK-NEXT:   %w0 = getelementptr inbounds [2 x %struct.W], [2 x %struct.W]* %w, i64 0, i64 0
+; CHECK-NEXT:   %"w1'ipg" = getelementptr inbounds [2 x %struct.W], [2 x %struct.W]* %"w'ipa", i64 0, i64 1
+; CHECK-NEXT:   %w1 = getelementptr inbounds [2 x %struct.W], [2 x %struct.W]* %w, i64 0, i64 1
+; CHECK-NEXT:   %"x1'ipg" = getelementptr inbounds double, double* %"x'", i64 1
+; CHECK-NEXT:   %x1 = getelementptr inbounds double, double* %x, i64 1
+; CHECK-NEXT:   %"y1'ipg" = getelementptr inbounds double, double* %"y'", i64 1
+; CHECK-NEXT:   %y1 = getelementptr inbounds double, double* %y, i64 1
+; CHECK-NEXT:   %"w0x'ipg" = getelementptr inbounds %struct.W, %struct.W* %"w0'ipg", i64 0, i32 0
+; CHECK-NEXT:   %w0x = getelementptr inbounds %struct.W, %struct.W* %w0, i64 0, i32 0
+; CHECK-NEXT:   store double* %x, double** %w0x
+; CHECK-NEXT:   store double* %"x'", double** %"w0x'ipg"
+; CHECK-NEXT:   %"w0y'ipg" = getelementptr inbounds %struct.W, %struct.W* %"w0'ipg", i64 0, i32 1
+; CHECK-NEXT:   %w0y = getelementptr inbounds %struct.W, %struct.W* %w0, i64 0, i32 1
+; CHECK-NEXT:   store double* %y, double** %w0y
+; CHECK-NEXT:   store double* %"y'", double** %"w0y'ipg"
+; CHECK-NEXT:   %"w1x'ipg" = getelementptr inbounds %struct.W, %struct.W* %"w1'ipg", i64 0, i32 0
+; CHECK-NEXT:   %w1x = getelementptr inbounds %struct.W, %struct.W* %w1, i64 0, i32 0
+; CHECK-NEXT:   store double* %x1, double** %w1x
+; CHECK-NEXT:   store double* %"x1'ipg", double** %"w1x'ipg"
+; CHECK-NEXT:   %"w1y'ipg" = getelementptr inbounds %struct.W, %struct.W* %"w1'ipg", i64 0, i32 1
+; CHECK-NEXT:   %w1y = getelementptr inbounds %struct.W, %struct.W* %w1, i64 0, i32 1
+; CHECK-NEXT:   store double* %y1, double** %w1y
+; CHECK-NEXT:   store double* %"y1'ipg", double** %"w1y'ipg"
+; CHECK-NEXT:   %t0 = getelementptr inbounds [2 x i64], [2 x i64]* %t, i64 0, i64 0
+; CHECK-NEXT:   %t1 = getelementptr inbounds [2 x i64], [2 x i64]* %t, i64 0, i64 1
+; CHECK-NEXT:   %"p0'ipc" = bitcast %struct.W* %"w0'ipg" to i8*
+; CHECK-NEXT:   %p0 = bitcast %struct.W* %w0 to i8*
+; CHECK-NEXT:   %"p1'ipc" = bitcast %struct.W* %"w1'ipg" to i8*
+; CHECK-NEXT:   %p1 = bitcast %struct.W* %w1 to i8*
+; CHECK-NEXT:   %malloccall = tail call noalias nonnull dereferenceable(48) dereferenceable_or_null(48) i8* @malloc(i64 48)
+; CHECK-NEXT:   %thread_closure = bitcast i8* %malloccall to { i8*, i8*, i8*, i8*, i8*, i64 }*
+; CHECK-NEXT:   %2 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %thread_closure, i64 0, i32 0
+; CHECK-NEXT:   store i8* %p0, i8** %2
+; CHECK-NEXT:   %3 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %thread_closure, i64 0, i32 1
+; CHECK-NEXT:   store i8* %"p0'ipc", i8** %3
+; CHECK-NEXT:   %4 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %thread_closure, i64 0, i32 4
+; CHECK-NEXT:   store i8* null, i8** %4
+; CHECK-NEXT:   %c0 = call i32 @pthread_create(i64* %t0, %union.pthread_attr_t* null, i8* (i8*)* @fwddiffebody_thread, i8* %malloccall)
+; CHECK-NEXT:   %malloccall1 = tail call noalias nonnull dereferenceable(48) dereferenceable_or_null(48) i8* @malloc(i64 48)
+; CHECK-NEXT:   %thread_closure2 = bitcast i8* %malloccall1 to { i8*, i8*, i8*, i8*, i8*, i64 }*
+; CHECK-NEXT:   %5 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %thread_closure2, i64 0, i32 0
+; CHECK-NEXT:   store i8* %p1, i8** %5
+; CHECK-NEXT:   %6 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %thread_closure2, i64 0, i32 1
+; CHECK-NEXT:   store i8* %"p1'ipc", i8** %6
+; CHECK-NEXT:   %7 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %thread_closure2, i64 0, i32 4
+; CHECK-NEXT:   store i8* null, i8** %7
+; CHECK-NEXT:   %c1 = call i32 @pthread_create(i64* %t1, %union.pthread_attr_t* null, i8* (i8*)* @fwddiffebody_thread, i8* %malloccall1)
+; CHECK-NEXT:   %l0 = load i64, i64* %t0
+; CHECK-NEXT:   %j0 = call i32 @pthread_join(i64 %l0, i8** %0)
+; CHECK-NEXT:   %8 = load i8*, i8** %0
+; CHECK-NEXT:   %9 = bitcast i8* %8 to { i8*, i8*, i8*, i8*, i8*, i64 }*
+; CHECK-NEXT:   %10 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %9, i64 0, i32 3
+; CHECK-NEXT:   %11 = load i8*, i8** %10
+; CHECK-NEXT:   store i8* %11, i8** %r
+; CHECK-NEXT:   tail call void @free(i8* nonnull %8)
+; CHECK-NEXT:   %l1 = load i64, i64* %t1
+; CHECK-NEXT:   %j1 = call i32 @pthread_join(i64 %l1, i8** %1)
+; CHECK-NEXT:   %12 = load i8*, i8** %1
+; CHECK-NEXT:   tail call void @free(i8* nonnull %12)
+; CHECK-NEXT:   ret void
+; CHECK-NEXT: }
+
+; CHECK: define internal i8* @fwddiffebody_thread(i8* %0)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %1 = bitcast i8* %0 to { i8*, i8*, i8*, i8*, i8*, i64 }*
+; CHECK-NEXT:   %2 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %1, i64 0, i32 0
+; CHECK-NEXT:   %3 = load i8*, i8** %2
+; CHECK-NEXT:   %4 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %1, i64 0, i32 1
+; CHECK-NEXT:   %5 = load i8*, i8** %4
+; CHECK-NEXT:   %6 = call i8* @fwddiffebody(i8* %3, i8* %5)
+; CHECK-NEXT:   %7 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %1, i64 0, i32 3
+; CHECK-NEXT:   store i8* %6, i8** %7
+; CHECK-NEXT:   ret i8* %0
+; CHECK-NEXT: }
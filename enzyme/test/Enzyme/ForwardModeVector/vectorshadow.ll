@@ -0,0 +1,66 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-vector-shadow -mem2reg -early-cse -instsimplify -simplifycfg -adce -S | FileCheck %s
+
+%struct.Gradients = type { double, double, double, double }
+
+; Function Attrs: nounwind
+declare %struct.Gradients @__enzyme_fwddiff(double (double,double)*, ...)
+
+declare double @llvm.sin.f64(double)
+
+define double @tester(double %x, double %y) {
+entry:
+  %0 = fdiv fast double %x, %y
+  %1 = call fast double @llvm.sin.f64(double %0)
+  ret double %1
+}
+
+define %struct.Gradients @test_derivative(double %x, double %y) {
+entry:
+  %0 = tail call %struct.Gradients (double (double, double)*, ...) @__enzyme_fwddiff(double (double, double)* nonnull @tester, metadata !"enzyme_width", i64 4, double %x, double 1.0, double 0.0, double 1.0, double 0.0, double %y, double 0.0, double 1.0, double 1.0, double 0.0)
+  ret %struct.Gradients %0
+}
+
+; CHECK: define internal [4 x double] @fwddiffe4tester(double %x, [4 x double] %"x'", double %y, [4 x double] %"y'")
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = fdiv fast double %x, %y
+; CHECK-NEXT:   %1 = extractvalue [4 x double] %"x'", 0
+; CHECK-NEXT:   %2 = extractvalue [4 x double] %"y'", 0
+; CHECK-NEXT:   %3 = extractvalue [4 x double] %"x'", 1
+; CHECK-NEXT:   %4 = extractvalue [4 x double] %"y'", 1
+; CHECK-NEXT:   %5 = extractvalue [4 x double] %"x'", 2
+; CHECK-NEXT:   %6 = extractvalue [4 x double] %"y'", 2
+; CHECK-NEXT:   %7 = extractvalue [4 x double] %"x'", 3
+; CHECK-NEXT:   %8 = extractvalue [4 x double] %"y'", 3
+; CHECK-NEXT:   %9 = insertelement <4 x double> undef, double %1, i64 0
+; CHECK-NEXT:   %10 = insertelement <4 x double> %9, double %3, i64 1
+; CHECK-NEXT:   %11 = insertelement <4 x double> %10, double %5, i64 2
+; CHECK-NEXT:   %12 = insertelement <4 x double> %11, double %7, i64 3
+; CHECK-NEXT:   %.splatinsert = insertelement <4 x double> poison, double %y, i32 0
+; CHECK-NEXT:   %.splat = shufflevector <4 x double> %.splatinsert, <4 x double> poison, <4 x i32> zeroinitializer
+; CHECK-NEXT:   %13 = fmul fast <4 x double> %12, %.splat
+; CHECK-NEXT:   %.splatinsert2 = insertelement <4 x double> poison, double %x, i32 0
+; CHECK-NEXT:   %.splat3 = shufflevector <4 x double> %.splatinsert2, <4 x double> poison, <4 x i32> zeroinitializer
+; CHECK-NEXT:   %14 = insertelement <4 x double> undef, double %2, i64 0
+; CHECK-NEXT:   %15 = insertelement <4 x double> %14, double %4, i64 1
+; CHECK-NEXT:   %16 = insertelement <4 x double> %15, double %6, i64 2
+; CHECK-NEXT:   %17 = insertelement <4 x double> %16, double %8, i64 3
+; CHECK-NEXT:   %18 = fmul fast <4 x double> %.splat3, %17
+; CHECK-NEXT:   %19 = fsub fast <4 x double> %13, %18
+; CHECK-NEXT:   %20 = fmul fast double %y, %y
+; CHECK-NEXT:   %.splatinsert4 = insertelement <4 x double> poison, double %20, i32 0
+; CHECK-NEXT:   %.splat5 = shufflevector <4 x double> %.splatinsert4, <4 x double> poison, <4 x i32> zeroinitializer
+; CHECK-NEXT:   %21 = fdiv fast <4 x double> %19, %.splat5
+; CHECK-NEXT:   %22 = call fast double @llvm.cos.f64(double %0)
+; CHECK-NEXT:   %.splatinsert6 = insertelement <4 x double> poison, double %22, i32 0
+; CHECK-NEXT:   %.splat7 = shufflevector <4 x double> %.splatinsert6, <4 x double> poison, <4 x i32> zeroinitializer
+; CHECK-NEXT:   %23 = fmul fast <4 x double> %21, %.splat7
+; CHECK-NEXT:   %24 = extractelement <4 x double> %23, i64 0
+; CHECK-NEXT:   %25 = insertvalue [4 x double] undef, double %24, 0
+; CHECK-NEXT:   %26 = extractelement <4 x double> %23, i64 1
+; CHECK-NEXT:   %27 = insertvalue [4 x double] %25, double %26, 1
+; CHECK-NEXT:   %28 = extractelement <4 x double> %23, i64 2
+; CHECK-NEXT:   %29 = insertvalue [4 x double] %27, double %28, 2
+; CHECK-NEXT:   %30 = extractelement <4 x double> %23, i64 3
+; CHECK-NEXT:   %31 = insertvalue [4 x double] %29, double %30, 3
+; CHECK-NEXT:   ret [4 x double] %31
+; CHECK-NEXT: }
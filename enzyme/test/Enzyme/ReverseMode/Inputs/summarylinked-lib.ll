@@ -0,0 +1,13 @@
+; Definitions linked into summarylinked.ll after its summaries are derived
+
+define double @ext(double* %x) {
+entry:
+  %v = load double, double* %x, align 8, !tbaa !0
+  %m = fmul double %v, %v
+  ret double %m
+}
+
+!0 = !{!1, !1, i64 0}
+!1 = !{!"double", !2, i64 0}
+!2 = !{!"omnipotent char", !3, i64 0}
+!3 = !{!"Simple C++ TBAA"}
@@ -0,0 +1,29 @@
+;RUN: %opt < %s %loadEnzyme -enzyme -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+declare dso_local double @__enzyme_autodiff(...)
+
+declare void @cblas_daxpy(i32, double, double*, i32, double*, i32)
+
+define void @f(i32 %n, double %alpha, double* noalias %x, i32 %incx, double* noalias %y, i32 %incy) {
+entry:
+  call void @cblas_daxpy(i32 %n, double %alpha, double* %x, i32 %incx, double* %y, i32 %incy)
+  ret void
+}
+
+define double @active(i32 %n, double %alpha, double* %x, double* %dx, i32 %incx, double* %y, double* %dy, i32 %incy) {
+entry:
+  %r = call double (...) @__enzyme_autodiff(void (i32, double, double*, i32, double*, i32)* @f, i32 %n, double %alpha, double* %x, double* %dx, i32 %incx, double* %y, double* %dy, i32 %incy)
+  ret double %r
+}
+
+; CHECK: define internal { double } @diffef(i32 %n, double %alpha, double* noalias %x, double* %"x'", i32 %incx, double* noalias %y, double* %"y'", i32 %incy)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   call void @cblas_daxpy(i32 %n, double %alpha, double* %x, i32 %incx, double* %y, i32 %incy)
+; CHECK-NEXT:   call void @cblas_daxpy(i32 %n, double %alpha, double* %"y'", i32 %incy, double* %"x'", i32 %incx)
+; CHECK-NEXT:   %0 = call fast double @cblas_ddot(i32 %n, double* nocapture readonly %x, i32 %incx, double* nocapture readonly %"y'", i32 %incy)
+; CHECK-NEXT:   %1 = insertvalue { double } undef, double %0, 0
+; CHECK-NEXT:   ret { double } %1
+; CHECK-NEXT: }
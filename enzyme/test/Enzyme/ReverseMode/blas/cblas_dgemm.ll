@@ -0,0 +1,52 @@
+;RUN: %opt < %s %loadEnzyme -enzyme -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+declare dso_local { double, double } @__enzyme_autodiff(...)
+
+declare void @cblas_dgemm(i32, i32, i32, i32, i32, i32, double, double*, i32, double*, i32, double, double*, i32)
+
+define void @f(i32 %m, i32 %n, i32 %k, double %alpha, double* noalias %A, i32 %lda, double* noalias %B, i32 %ldb, double %beta, double* noalias %C, i32 %ldc) {
+entry:
+  call void @cblas_dgemm(i32 102, i32 111, i32 112, i32 %m, i32 %n, i32 %k, double %alpha, double* %A, i32 %lda, double* %B, i32 %ldb, double %beta, double* %C, i32 %ldc)
+  ret void
+}
+
+define { double, double } @active(i32 %m, i32 %n, i32 %k, double %alpha, double* %A, double* %dA, i32 %lda, double* %B, double* %dB, i32 %ldb, double %beta, double* %C, double* %dC, i32 %ldc) {
+entry:
+  %r = call { double, double } (...) @__enzyme_autodiff(void (i32, i32, i32, double, double*, i32, double*, i32, double, double*, i32)* @f, i32 %m, i32 %n, i32 %k, double %alpha, double* %A, double* %dA, i32 %lda, double* %B, double* %dB, i32 %ldb, double %beta, double* %C, double* %dC, i32 %ldc)
+  ret { double, double } %r
+}
+
+; CHECK: define internal { double, double } @diffef(i32 %m, i32 %n, i32 %k, double %alpha, double* noalias %A, double* %"A'", i32 %lda, double* noalias %B, double* %"B'", i32 %ldb, double %beta, double* noalias %C, double* %"C'", i32 %ldc)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = sext i32 %m to i64
+; CHECK-NEXT:   %1 = sext i32 %n to i64
+; CHECK-NEXT:   %2 = mul i64 %0, %1
+; CHECK-NEXT:   %mallocsize = mul nuw nsw i64 %2, 8
+; CHECK-NEXT:   %malloccall = tail call noalias nonnull i8* @malloc(i64 %mallocsize)
+; CHECK-NEXT:   %[[Cpre:.+]] = bitcast i8* %malloccall to double*
+; CHECK-NEXT:   call void @__enzyme_matrix_cblas_dcopy(i8 0, i1 false, i32 %m, i32 %n, double* %C, i32 %ldc, double* %[[Cpre]], i32 %m)
+; CHECK-NEXT:   call void @cblas_dgemm(i32 102, i32 111, i32 112, i32 %m, i32 %n, i32 %k, double %alpha, double* %A, i32 %lda, double* %B, i32 %ldb, double %beta, double* %C, i32 %ldc)
+; CHECK:   %[[AB:.+]] = bitcast i8* %malloccall2 to double*
+; CHECK-NEXT:   call void @cblas_dgemm(i32 102, i32 111, i32 112, i32 %m, i32 %n, i32 %k, double 1.000000e+00, double* %A, i32 %lda, double* %B, i32 %ldb, double 0.000000e+00, double* %[[AB]], i32 %m)
+; CHECK-NEXT:   %[[dalpha:.+]] = call fast double @__enzyme_matrix_cblas_ddot(i8 0, i1 false, i32 %m, i32 %n, double* %[[AB]], i32 %m, double* %"C'", i32 %ldc)
+; CHECK-NEXT:   tail call void @free(i8* nonnull %malloccall2)
+; CHECK-NEXT:   call void @cblas_dgemm(i32 102, i32 111, i32 111, i32 %m, i32 %k, i32 %n, double %alpha, double* %"C'", i32 %ldc, double* %B, i32 %ldb, double 1.000000e+00, double* %"A'", i32 %lda)
+; CHECK-NEXT:   call void @cblas_dgemm(i32 102, i32 112, i32 111, i32 %n, i32 %k, i32 %m, double %alpha, double* %"C'", i32 %ldc, double* %A, i32 %lda, double 1.000000e+00, double* %"B'", i32 %ldb)
+; CHECK-NEXT:   %[[dbeta:.+]] = call fast double @__enzyme_matrix_cblas_ddot(i8 0, i1 false, i32 %m, i32 %n, double* %[[Cpre]], i32 %m, double* %"C'", i32 %ldc)
+; CHECK-NEXT:   call void @__enzyme_matrix_cblas_dscal(i8 0, i1 false, i32 %m, i32 %n, double %beta, double* %"C'", i32 %ldc)
+; CHECK-NEXT:   tail call void @free(i8* nonnull %malloccall)
+; CHECK-NEXT:   %[[r0:.+]] = insertvalue { double, double } undef, double %[[dalpha]], 0
+; CHECK-NEXT:   %[[r1:.+]] = insertvalue { double, double } %[[r0]], double %[[dbeta]], 1
+; CHECK-NEXT:   ret { double, double } %[[r1]]
+; CHECK-NEXT: }
+
+; CHECK: define internal double @__enzyme_matrix_cblas_ddot(i8 %0, i1 %1, i32 %2, i32 %3, double* %4, i32 %5, double* %6, i32 %7)
+; CHECK: for.body:
+; CHECK-NEXT:   %j = phi i32 [ 0, %entry ], [ %j.next, %for.latch ]
+; CHECK-NEXT:   %acc = phi double [ 0.000000e+00, %entry ], [ %acc.next, %for.latch ]
+; CHECK: column:
+; CHECK:   %[[col:.+]] = call double @cblas_ddot(i32 %len, double* nocapture readonly %{{.+}}, i32 1, double* nocapture readonly %{{.+}}, i32 1)
+; CHECK-NEXT:   %[[sum:.+]] = fadd double %acc, %[[col]]
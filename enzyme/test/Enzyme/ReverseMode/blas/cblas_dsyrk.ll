@@ -0,0 +1,51 @@
+;RUN: %opt < %s %loadEnzyme -enzyme -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+declare dso_local { double, double } @__enzyme_autodiff(...)
+
+declare void @cblas_dsyrk(i32, i32, i32, i32, i32, double, double*, i32, double, double*, i32)
+
+define void @f(i32 %n, i32 %k, double %alpha, double* noalias %A, i32 %lda, double %beta, double* noalias %C, i32 %ldc) {
+entry:
+  call void @cblas_dsyrk(i32 102, i32 122, i32 111, i32 %n, i32 %k, double %alpha, double* %A, i32 %lda, double %beta, double* %C, i32 %ldc)
+  ret void
+}
+
+define { double, double } @active(i32 %n, i32 %k, double %alpha, double* %A, double* %dA, i32 %lda, double %beta, double* %C, double* %dC, i32 %ldc) {
+entry:
+  %r = call { double, double } (...) @__enzyme_autodiff(void (i32, i32, double, double*, i32, double, double*, i32)* @f, i32 %n, i32 %k, double %alpha, double* %A, double* %dA, i32 %lda, double %beta, double* %C, double* %dC, i32 %ldc)
+  ret { double, double } %r
+}
+
+; CHECK: define internal { double, double } @diffef(i32 %n, i32 %k, double %alpha, double* noalias %A, double* %"A'", i32 %lda, double %beta, double* noalias %C, double* %"C'", i32 %ldc)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = sext i32 %n to i64
+; CHECK-NEXT:   %1 = sext i32 %n to i64
+; CHECK-NEXT:   %2 = mul i64 %0, %1
+; CHECK-NEXT:   %mallocsize = mul nuw nsw i64 %2, 8
+; CHECK-NEXT:   %malloccall = tail call noalias nonnull i8* @malloc(i64 %mallocsize)
+; CHECK-NEXT:   %3 = bitcast i8* %malloccall to double*
+; CHECK-NEXT:   call void @__enzyme_matrix_cblas_dcopy(i8 2, i1 false, i32 %n, i32 %n, double* %C, i32 %ldc, double* %3, i32 %n)
+; CHECK-NEXT:   call void @cblas_dsyrk(i32 102, i32 122, i32 111, i32 %n, i32 %k, double %alpha, double* %A, i32 %lda, double %beta, double* %C, i32 %ldc)
+; CHECK-NEXT:   %4 = add i32 %ldc, 1
+; CHECK-NEXT:   call void @cblas_dscal(i32 %n, double 2.000000e+00, double* %"C'", i32 %4)
+; CHECK-NEXT:   call void @cblas_dsymm(i32 102, i32 141, i32 122, i32 %n, i32 %k, double %alpha, double* %"C'", i32 %ldc, double* %A, i32 %lda, double 1.000000e+00, double* %"A'", i32 %lda)
+; CHECK-NEXT:   call void @cblas_dscal(i32 %n, double 5.000000e-01, double* %"C'", i32 %4)
+; CHECK-NEXT:   %5 = sext i32 %n to i64
+; CHECK-NEXT:   %6 = sext i32 %n to i64
+; CHECK-NEXT:   %7 = mul i64 %5, %6
+; CHECK-NEXT:   %mallocsize1 = mul nuw nsw i64 %7, 8
+; CHECK-NEXT:   %malloccall2 = tail call noalias nonnull i8* @malloc(i64 %mallocsize1)
+; CHECK-NEXT:   %8 = bitcast i8* %malloccall2 to double*
+; CHECK-NEXT:   call void @cblas_dsyrk(i32 102, i32 122, i32 111, i32 %n, i32 %k, double 1.000000e+00, double* %A, i32 %lda, double 0.000000e+00, double* %8, i32 %n)
+; CHECK-NEXT:   %9 = call fast double @__enzyme_matrix_cblas_ddot(i8 2, i1 false, i32 %n, i32 %n, double* %8, i32 %n, double* %"C'", i32 %ldc)
+; CHECK-NEXT:   tail call void @free(i8* nonnull %malloccall2)
+; CHECK-NEXT:   %10 = call fast double @__enzyme_matrix_cblas_ddot(i8 2, i1 false, i32 %n, i32 %n, double* %3, i32 %n, double* %"C'", i32 %ldc)
+; CHECK-NEXT:   call void @__enzyme_matrix_cblas_dscal(i8 2, i1 false, i32 %n, i32 %n, double %beta, double* %"C'", i32 %ldc)
+; CHECK-NEXT:   tail call void @free(i8* nonnull %malloccall)
+; CHECK-NEXT:   %11 = insertvalue { double, double } undef, double %9, 0
+; CHECK-NEXT:   %12 = insertvalue { double, double } %11, double %10, 1
+; CHECK-NEXT:   ret { double, double } %12
+; CHECK-NEXT: }
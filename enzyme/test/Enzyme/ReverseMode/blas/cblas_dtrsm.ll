@@ -0,0 +1,37 @@
+;RUN: %opt < %s %loadEnzyme -enzyme -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+declare dso_local void @__enzyme_autodiff(...)
+
+declare void @cblas_dtrsm(i32, i32, i32, i32, i32, i32, i32, double, double*, i32, double*, i32)
+
+define void @f(i32 %m, i32 %n, double %alpha, double* noalias %A, i32 %lda, double* noalias %B, i32 %ldb) {
+entry:
+  call void @cblas_dtrsm(i32 102, i32 141, i32 121, i32 111, i32 131, i32 %m, i32 %n, double %alpha, double* %A, i32 %lda, double* %B, i32 %ldb)
+  ret void
+}
+
+define void @active(i32 %m, i32 %n, double %alpha, double* %A, double* %dA, i32 %lda, double* %B, double* %dB, i32 %ldb) {
+entry:
+  call void (...) @__enzyme_autodiff(void (i32, i32, double, double*, i32, double*, i32)* @f, i32 %m, i32 %n, metadata !"enzyme_const", double %alpha, double* %A, double* %dA, i32 %lda, double* %B, double* %dB, i32 %ldb)
+  ret void
+}
+
+; CHECK: define internal void @diffef(i32 %m, i32 %n, double %alpha, double* noalias %A, double* %"A'", i32 %lda, double* noalias %B, double* %"B'", i32 %ldb)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   call void @cblas_dtrsm(i32 102, i32 141, i32 121, i32 111, i32 131, i32 %m, i32 %n, double %alpha, double* %A, i32 %lda, double* %B, i32 %ldb)
+; CHECK-NEXT:   call void @cblas_dtrsm(i32 102, i32 141, i32 121, i32 112, i32 131, i32 %m, i32 %n, double 1.000000e+00, double* %A, i32 %lda, double* %"B'", i32 %ldb)
+; CHECK-NEXT:   %0 = sext i32 %m to i64
+; CHECK-NEXT:   %1 = sext i32 %m to i64
+; CHECK-NEXT:   %2 = mul i64 %0, %1
+; CHECK-NEXT:   %mallocsize = mul nuw nsw i64 %2, 8
+; CHECK-NEXT:   %malloccall = tail call noalias nonnull i8* @malloc(i64 %mallocsize)
+; CHECK-NEXT:   %3 = bitcast i8* %malloccall to double*
+; CHECK-NEXT:   call void @cblas_dgemm(i32 102, i32 111, i32 112, i32 %m, i32 %m, i32 %n, double 1.000000e+00, double* %"B'", i32 %ldb, double* %B, i32 %ldb, double 0.000000e+00, double* %3, i32 %m)
+; CHECK-NEXT:   call void @__enzyme_matrix_cblas_daxpy(i8 1, i1 false, i32 %m, i32 %m, double -1.000000e+00, double* %3, i32 %m, double* %"A'", i32 %lda)
+; CHECK-NEXT:   tail call void @free(i8* nonnull %malloccall)
+; CHECK-NEXT:   call void @__enzyme_matrix_cblas_dscal(i8 0, i1 false, i32 %m, i32 %n, double %alpha, double* %"B'", i32 %ldb)
+; CHECK-NEXT:   ret void
+; CHECK-NEXT: }
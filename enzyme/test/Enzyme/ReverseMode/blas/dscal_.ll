@@ -0,0 +1,60 @@
+;RUN: %opt < %s %loadEnzyme -enzyme -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+declare dso_local void @__enzyme_autodiff(...)
+
+declare void @dscal_(i32*, double*, double*, i32*)
+
+define void @f(i32* noalias %n, double* noalias %alpha, double* noalias %x, i32* noalias %incx) {
+entry:
+  call void @dscal_(i32* %n, double* %alpha, double* %x, i32* %incx)
+  ret void
+}
+
+define void @active(i32* %n, double* %alpha, double* %dalpha, double* %x, double* %dx, i32* %incx) {
+entry:
+  call void (...) @__enzyme_autodiff(void (i32*, double*, double*, i32*)* @f, metadata !"enzyme_const", i32* %n, double* %alpha, double* %dalpha, double* %x, double* %dx, metadata !"enzyme_const", i32* %incx)
+  ret void
+}
+
+; CHECK: define internal void @diffef(i32* noalias %n, double* noalias %alpha, double* %"alpha'", double* noalias %x, double* %"x'", i32* noalias %incx)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = alloca i32
+; CHECK-NEXT:   %1 = alloca i32
+; CHECK-NEXT:   %2 = alloca i32
+; CHECK-NEXT:   %3 = alloca i32
+; CHECK-NEXT:   %4 = alloca i32
+; CHECK-NEXT:   %5 = alloca i32
+; CHECK-NEXT:   %6 = alloca i32
+; CHECK-NEXT:   %7 = alloca double
+; CHECK-NEXT:   %8 = alloca i32
+; CHECK-NEXT:   %9 = load i32, i32* %n
+; CHECK-NEXT:   %10 = load i32, i32* %incx
+; CHECK-NEXT:   %11 = sext i32 %9 to i64
+; CHECK-NEXT:   %mallocsize = mul nuw nsw i64 %11, 8
+; CHECK-NEXT:   %malloccall = tail call noalias nonnull i8* @malloc(i64 %mallocsize)
+; CHECK-NEXT:   %12 = bitcast i8* %malloccall to double*
+; CHECK-NEXT:   store i32 %9, i32* %0
+; CHECK-NEXT:   store i32 %10, i32* %1
+; CHECK-NEXT:   store i32 1, i32* %2
+; CHECK-NEXT:   call void @dcopy_(i32* %0, double* %x, i32* %1, double* %12, i32* %2)
+; CHECK-NEXT:   call void @dscal_(i32* %n, double* %alpha, double* %x, i32* %incx)
+; CHECK-NEXT:   %13 = load i32, i32* %n
+; CHECK-NEXT:   %14 = load double, double* %alpha
+; CHECK-NEXT:   %15 = load i32, i32* %incx
+; CHECK-NEXT:   store i32 %13, i32* %3
+; CHECK-NEXT:   store i32 1, i32* %4
+; CHECK-NEXT:   store i32 %15, i32* %5
+; CHECK-NEXT:   %16 = call fast double @ddot_(i32* %3, double* %12, i32* %4, double* %"x'", i32* %5)
+; CHECK-NEXT:   %17 = load double, double* %"alpha'"
+; CHECK-NEXT:   %18 = fadd fast double %17, %16
+; CHECK-NEXT:   store double %18, double* %"alpha'"
+; CHECK-NEXT:   store i32 %13, i32* %6
+; CHECK-NEXT:   store double %14, double* %7
+; CHECK-NEXT:   store i32 %15, i32* %8
+; CHECK-NEXT:   call void @dscal_(i32* %6, double* %7, double* %"x'", i32* %8)
+; CHECK-NEXT:   tail call void @free(i8* nonnull %malloccall)
+; CHECK-NEXT:   ret void
+; CHECK-NEXT: }
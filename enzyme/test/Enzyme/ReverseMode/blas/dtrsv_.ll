@@ -0,0 +1,43 @@
+;RUN: %opt < %s %loadEnzyme -enzyme -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+declare dso_local void @__enzyme_autodiff(...)
+
+declare void @dtrsv_(i8*, i8*, i8*, i32*, double*, i32*, double*, i32*)
+
+define void @active(i8* %uplo, i8* %trans, i8* %diag, i32* %n, double* %A, double* %dA, i32* %lda, double* %x, double* %dx, i32* %incx) {
+entry:
+  call void (...) @__enzyme_autodiff(void (i8*, i8*, i8*, i32*, double*, i32*, double*, i32*)* @f, metadata !"enzyme_const", i8* %uplo, metadata !"enzyme_const", i8* %trans, metadata !"enzyme_const", i8* %diag, metadata !"enzyme_const", i32* %n, double* %A, double* %dA, metadata !"enzyme_const", i32* %lda, double* %x, double* %dx, metadata !"enzyme_const", i32* %incx)
+  ret void
+}
+
+define void @f(i8* noalias %uplo, i8* noalias %trans, i8* noalias %diag, i32* noalias %n, double* noalias %A, i32* noalias %lda, double* noalias %x, i32* noalias %incx) {
+entry:
+  call void @dtrsv_(i8* %uplo, i8* %trans, i8* %diag, i32* %n, double* %A, i32* %lda, double* %x, i32* %incx)
+  store double 0.000000e+00, double* %A
+  ret void
+}
+
+; CHECK: define internal void @diffef(i8* noalias %uplo, i8* noalias %trans, i8* noalias %diag, i32* noalias %n, double* noalias %A, double* %"A'", i32* noalias %lda, double* noalias %x, double* %"x'", i32* noalias %incx)
+; CHECK: entry:
+; CHECK:   %[[uplo:.+]] = load i8, i8* %uplo, align 1
+; CHECK-NEXT:   %[[ulower:.+]] = or i8 %[[uplo]], 32
+; CHECK-NEXT:   %[[upper:.+]] = icmp eq i8 %[[ulower]], 117
+; CHECK-NEXT:   %[[n:.+]] = load i32, i32* %n, align 4
+; CHECK-NEXT:   %[[lda:.+]] = load i32, i32* %lda, align 4
+; CHECK-NEXT:   %[[tri:.+]] = select i1 %[[upper]], i8 1, i8 2
+; CHECK:   %[[Acache:.+]] = bitcast i8* %malloccall to double*
+; CHECK-NEXT:   call void @__enzyme_matrix_dcopy_(i8 %[[tri]], i1 false, i32 %[[n]], i32 %[[n]], double* %A, i32 %[[lda]], double* %[[Acache]], i32 %[[n]])
+; CHECK-NEXT:   call void @dtrsv_(i8* %uplo, i8* %trans, i8* %diag, i32* %n, double* %A, i32* %lda, double* %x, i32* %incx)
+; CHECK-NEXT:   store double 0.000000e+00, double* %A, align 8
+; CHECK-NEXT:   store double 0.000000e+00, double* %"A'", align 8
+; CHECK:   %[[isN:.+]] = icmp eq i8 %{{.+}}, 110
+; CHECK:   %[[flip:.+]] = select i1 %[[isN]], i8 84, i8 78
+; CHECK-NEXT:   store i8 %[[flip]], i8* %[[transp:.+]], align 1
+; CHECK:   call void @dtrsv_(i8* %{{.+}}, i8* %[[transp]], i8* %{{.+}}, i32* %{{.+}}, double* %[[Acache]], i32* %{{.+}}, double* %"x'", i32* %{{.+}})
+; CHECK:   call void @dcopy_(i32* %{{.+}}, double* %"x'", i32* %{{.+}}, double* %[[lambda:.+]], i32* %{{.+}})
+; CHECK:   call void @dcopy_(i32* %{{.+}}, double* %x, i32* %{{.+}}, double* %[[xs:.+]], i32* %{{.+}})
+; CHECK:   call void @dgemm_(i8* %{{.+}}, i8* %{{.+}}, i32* %{{.+}}, i32* %{{.+}}, i32* %{{.+}}, double* %{{.+}}, double* %{{.+}}, i32* %{{.+}}, double* %{{.+}}, i32* %{{.+}}, double* %{{.+}}, double* %[[outer:.+]], i32* %{{.+}})
+; CHECK:   call void @__enzyme_matrix_daxpy_(i8 %{{.+}}, i1 %{{.+}}, i32 %{{.+}}, i32 %{{.+}}, double -1.000000e+00, double* %[[outer]], i32 %{{.+}}, double* %"A'", i32 %{{.+}})
@@ -0,0 +1,44 @@
+; RUN: if [ %llvmver -ge 9 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -mem2reg -instsimplify -simplifycfg -pass-remarks-analysis=enzyme -disable-output 2>&1 | FileCheck %s; fi
+
+define void @square(double* %x) !dbg !6 {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %next, %loop ]
+  %gep = getelementptr inbounds double, double* %x, i64 %i, !dbg !9
+  %ld = load double, double* %gep, align 8, !dbg !9
+  %mul = fmul double %ld, %ld, !dbg !10
+  store double %mul, double* %gep, align 8, !dbg !11
+  %next = add nuw nsw i64 %i, 1
+  %cmp = icmp eq i64 %next, 10
+  br i1 %cmp, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+define void @dsquare(double* %x, double* %dx) {
+entry:
+  call void (...) @__enzyme_autodiff(void (double*)* @square, double* %x, double* %dx)
+  ret void
+}
+
+declare void @__enzyme_autodiff(...)
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!3, !4}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: !1, producer: "clang", isOptimized: true, runtimeVersion: 0, emissionKind: FullDebug, enums: !2)
+!1 = !DIFile(filename: "square.c", directory: "/tmp")
+!2 = !{}
+!3 = !{i32 2, !"Debug Info Version", i32 3}
+!4 = !{i32 7, !"Dwarf Version", i32 4}
+!5 = !DISubroutineType(types: !2)
+!6 = distinct !DISubprogram(name: "square", scope: !1, file: !1, line: 1, type: !5, scopeLine: 1, spFlags: DISPFlagDefinition | DISPFlagOptimized, unit: !0, retainedNodes: !2)
+!9 = !DILocation(line: 3, column: 16, scope: !6)
+!10 = !DILocation(line: 3, column: 21, scope: !6)
+!11 = !DILocation(line: 3, column: 10, scope: !6)
+
+; CHECK: remark: square.c:3:16: Created cache for ld: 8 bytes per element, loop depth 1, estimated 80 bytes
+; CHECK: remark: square.c:3:16: Caching load: 8 bytes per element, loop depth 1, estimated 80 bytes
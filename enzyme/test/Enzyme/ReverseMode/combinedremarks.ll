@@ -0,0 +1,40 @@
+; RUN: if [ %llvmver -ge 9 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -pass-remarks-missed=enzyme -disable-output 2>&1 | FileCheck %s; fi
+
+declare double @__enzyme_autodiff(i8*, ...)
+
+define double @sq(double %x) {
+entry:
+  %m = fmul double %x, %x
+  ret double %m
+}
+
+define double @tester(double %x) !dbg !6 {
+entry:
+  %c = call double @sq(double %x), !dbg !9
+  %m = fmul double %c, %c, !dbg !10
+  ret double %m
+}
+
+define double @test_derivative(double %x) {
+entry:
+  %0 = tail call double (i8*, ...) @__enzyme_autodiff(i8* bitcast (double (double)* @tester to i8*), double %x)
+  ret double %0
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!3, !4}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: !1, producer: "clang", isOptimized: true, runtimeVersion: 0, emissionKind: FullDebug, enums: !2)
+!1 = !DIFile(filename: "sq.c", directory: "/tmp")
+!2 = !{}
+!3 = !{i32 2, !"Debug Info Version", i32 3}
+!4 = !{i32 7, !"Dwarf Version", i32 4}
+!5 = !DISubroutineType(types: !2)
+!6 = distinct !DISubprogram(name: "tester", scope: !1, file: !1, line: 3, type: !5, scopeLine: 3, spFlags: DISPFlagDefinition | DISPFlagOptimized, unit: !0, retainedNodes: !2)
+!9 = !DILocation(line: 4, column: 14, scope: !6)
+!10 = !DILocation(line: 5, column: 12, scope: !6)
+
+; The result of the call is needed by the reverse of the square, so the
+; augmented forward pass of the callee must return it on its tape.
+
+; CHECK: remark: sq.c:4:14: could not combine forward and reverse of call to sq (value needed in reverse) due to call, loop depth 0
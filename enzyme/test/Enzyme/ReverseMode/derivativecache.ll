@@ -0,0 +1,50 @@
+; RUN: rm -rf %t
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-derivative-cache=%t -enzyme-print-perf -S -o /dev/null 2>&1 | FileCheck %s --check-prefix=MISS
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-derivative-cache=%t -enzyme-print-perf -mem2reg -instsimplify -simplifycfg -S 2>&1 | FileCheck %s
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-derivative-cache=%t -enzyme-print-perf -enzyme-tape-arena -S -o /dev/null 2>&1 | FileCheck %s --check-prefix=MISS
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-derivative-cache=%t -enzyme-print-perf -enzyme-weighted-mincut -S -o /dev/null 2>&1 | FileCheck %s --check-prefix=MISS
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-derivative-cache=%t -enzyme-print-perf -enzyme-tape-arena -S -o /dev/null 2>&1 | FileCheck %s --check-prefix=HIT
+
+define internal double @square(double %x) {
+entry:
+  %mul = fmul fast double %x, %x
+  ret double %mul
+}
+
+define double @tester(double %x, double %y) {
+entry:
+  %sq = call double @square(double %x)
+  %add = fadd fast double %sq, %y
+  ret double %add
+}
+
+define double @test_derivative(double %x, double %y) {
+entry:
+  %0 = tail call double (double (double, double)*, ...) @__enzyme_autodiff(double (double, double)* nonnull @tester, double %x, double %y)
+  ret double %0
+}
+
+declare double @__enzyme_autodiff(double (double, double)*, ...)
+
+; MISS: Derivative cache miss for tester
+
+; CHECK: Derivative cache hit for tester
+
+; A derivative generated under different options is not reused, but is cached
+; under its own key.
+; HIT: Derivative cache hit for tester
+
+; CHECK: define double @test_derivative(double %x, double %y)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = call { double, double } @diffetester(double %x, double %y, double 1.000000e+00)
+
+; CHECK: define internal { double, double } @diffetester(double %x, double %y, double %differeturn)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = call { double } @diffesquare(double %x, double %differeturn)
+; CHECK-NEXT:   %1 = extractvalue { double } %0, 0
+; CHECK-NEXT:   %2 = insertvalue { double, double } undef, double %1, 0
+; CHECK-NEXT:   %3 = insertvalue { double, double } %2, double %differeturn, 1
+; CHECK-NEXT:   ret { double, double } %3
+; CHECK-NEXT: }
+
+; CHECK: define internal { double } @diffesquare(double %x, double %differeturn)
@@ -0,0 +1,82 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-fixed-point-max-iterations=50 -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+declare void @__enzyme_fixed_point(...)
+declare double @llvm.cos.f64(double)
+
+; out[i] = 0.5 * cos(in[i]) + p[i]
+define void @step(double* %out, double* %in, double* %p, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %inp = getelementptr inbounds double, double* %in, i64 %i
+  %x = load double, double* %inp
+  %pp = getelementptr inbounds double, double* %p, i64 %i
+  %pv = load double, double* %pp
+  %c = call double @llvm.cos.f64(double %x)
+  %h = fmul double %c, 5.000000e-01
+  %o = fadd double %h, %pv
+  %outp = getelementptr inbounds double, double* %out, i64 %i
+  store double %o, double* %outp
+  %i.next = add nuw i64 %i, 1
+  %cmp = icmp eq i64 %i.next, %n
+  br i1 %cmp, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+define void @dstep(double* %x, double* %dx, double* %p, double* %dp, i64 %n) {
+entry:
+  call void (...) @__enzyme_fixed_point(void (double*, double*, double*, i64)* @step, double* %x, double* %dx, i64 %n, metadata !"enzyme_dup", double* %p, double* %dp, metadata !"enzyme_const", i64 %n)
+  ret void
+}
+
+; CHECK: @[[msg:.+]] = private unnamed_addr constant [75 x i8] c"Enzyme: __enzyme_fixed_point adjoint did not converge within 50 iterations\00"
+
+; CHECK: define void @dstep(double* %x, double* %dx, double* %p, double* %dp, i64 %n)
+; CHECK: %malloccall = tail call noalias nonnull i8* @malloc(i64 %mallocsize)
+; CHECK-NEXT: %[[lambda:.+]] = bitcast i8* %malloccall to double*
+; CHECK: %fixedpoint.prod = getelementptr inbounds double, double* %[[lambda]], i64 %n
+; CHECK-NEXT: %fixedpoint.dout = getelementptr inbounds double, double* %fixedpoint.prod, i64 %n
+; CHECK-NEXT: %fixedpoint.out = getelementptr inbounds double, double* %fixedpoint.dout, i64 %n
+; CHECK-NEXT: %[[c0:.+]] = call i1 @__enzyme_fixedpoint_update_double(double* %[[lambda]], double* %dx, double* %fixedpoint.prod, double* %fixedpoint.dout, i64 %n, double 1.000000e-10)
+; CHECK-NEXT: br i1 %[[c0]], label %fixedpoint.end, label %fixedpoint.iter
+
+; CHECK: fixedpoint.iter:
+; CHECK-NEXT: %fixedpoint.it = phi i64 [ 0, %entry ], [ %fixedpoint.it.next, %fixedpoint.latch ]
+; CHECK-NEXT: call void @diffestep(double* %fixedpoint.out, double* %fixedpoint.dout, double* %x, double* %fixedpoint.prod, double* %p, i64 %n)
+; CHECK-NEXT: %fixedpoint.it.next = add nuw i64 %fixedpoint.it, 1
+; CHECK-NEXT: %[[c1:.+]] = call i1 @__enzyme_fixedpoint_update_double(double* %[[lambda]], double* %dx, double* %fixedpoint.prod, double* %fixedpoint.dout, i64 %n, double 1.000000e-10)
+; CHECK-NEXT: br i1 %[[c1]], label %fixedpoint.end, label %fixedpoint.latch
+
+; CHECK: fixedpoint.latch:
+; CHECK-NEXT: %[[lim:.+]] = icmp uge i64 %fixedpoint.it.next, 50
+; CHECK-NEXT: br i1 %[[lim]], label %fixedpoint.capped, label %fixedpoint.iter
+
+; CHECK: fixedpoint.capped:
+; CHECK-NEXT: %{{.+}} = call i32 @puts(i8* getelementptr inbounds ([75 x i8], [75 x i8]* @[[msg]], i32 0, i32 0))
+; CHECK-NEXT: br label %fixedpoint.end
+
+; CHECK: fixedpoint.end:
+; CHECK-NEXT: call void @diffestep.1(double* %fixedpoint.out, double* %fixedpoint.dout, double* %x, double* %fixedpoint.prod, double* %p, double* %dp, i64 %n)
+; CHECK-NEXT: %[[dxi8:.+]] = bitcast double* %dx to i8*
+; CHECK-NEXT: %[[sz:.+]] = mul nuw i64 %n, 8
+; CHECK-NEXT: call void @llvm.memset.p0i8.i64(i8* %[[dxi8]], i8 0, i64 %[[sz]], i1 false)
+; CHECK-NEXT: tail call void @free(i8* nonnull %malloccall)
+; CHECK-NEXT: ret void
+
+; CHECK: define internal i1 @__enzyme_fixedpoint_update_double(double* nocapture %lambda, double* nocapture readonly %seed, double* nocapture %prod, double* nocapture %dout, i64 %num, double %tol)
+; CHECK: %lambda.next = fadd double %seed.i, %prod.i
+; CHECK-NEXT: store double %lambda.next, double* %{{.+}}, align 8
+; CHECK-NEXT: store double %lambda.next, double* %{{.+}}, align 8
+; CHECK-NEXT: store double 0.000000e+00, double* %{{.+}}, align 8
+; CHECK: for.end:
+; CHECK: %[[scale:.+]] = call double @llvm.maxnum.f64(double %mag.end, double 1.000000e+00)
+; CHECK-NEXT: %[[tol:.+]] = fmul double %tol, %[[scale]]
+; CHECK-NEXT: %[[ok:.+]] = fcmp ole double %err.end, %[[tol]]
+; CHECK-NEXT: ret i1 %[[ok]]
+
+; CHECK: define internal void @diffestep(double* %out, double* %"out'", double* %in, double* %"in'", double* %p, i64 %n)
+; CHECK: define internal void @diffestep.1(double* %out, double* %"out'", double* %in, double* %"in'", double* %p, double* %"p'", i64 %n)
@@ -0,0 +1,59 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+declare double @__enzyme_autodiff(i8*, ...)
+declare double @llvm.sin.f64(double)
+
+define double @tester(double %x, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %u = phi double [ %x, %entry ], [ %u.next, %loop ]
+  %s = call double @llvm.sin.f64(double %u)
+  %u.next = fadd double %u, %s
+  %i.next = add nuw nsw i64 %i, 1
+  %cmp = icmp eq i64 %i.next, %n
+  br i1 %cmp, label %exit, label %loop, !llvm.loop !0
+
+exit:
+  ret double %u.next
+}
+
+define double @dtester(double %x, i64 %n) {
+entry:
+  %0 = tail call double (i8*, ...) @__enzyme_autodiff(i8* bitcast (double (double, i64)* @tester to i8*), double %x, i64 %n)
+  ret double %0
+}
+
+!0 = distinct !{!0, !1}
+!1 = !{!"enzyme.checkpoint", i32 2}
+
+; CHECK: define internal double @checkpointloop_tester(double %x, i64 %n) #[[ATTR:[0-9]+]]
+
+; CHECK: define internal { double } @diffetester(double %x, i64 %n, double %differeturn)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = call { double } @diffecheckpointloop_tester(double %x, i64 %n, double %differeturn)
+; CHECK-NEXT:   ret { double } %0
+
+; CHECK: define internal { double } @diffecheckpointloop_tester(double %x, i64 %n, double %differeturn)
+; CHECK: count:
+; CHECK-NEXT:   %iters = phi i64 [ 0, %entry ], [ %[[inc:.+]], %count ]
+; CHECK-NEXT:   %[[again:.+]] = call i1 @checkpointcontinue_checkpointloop_tester({ i64, double }* %current, double %x, i64 %n)
+; CHECK-NEXT:   %[[inc]] = add i64 %iters, 1
+; CHECK-NEXT:   br i1 %[[again]], label %count, label %counted
+; CHECK: counted:
+; CHECK-NEXT:   %[[dlast:.+]] = call { double } @diffecheckpointlast_checkpointloop_tester({ i64, double }* %current, { i64, double }* %adjoint, double %x, i64 %n, double %differeturn)
+; CHECK:   call void @revolve_checkpointloop_tester(i64 0, i64 %iters, i64 2, { i64, double }* %initial, { i64, double }* %adjoint, { double }* %acc, double %x, i64 %n)
+
+; CHECK: define internal void @revolve_checkpointloop_tester(i64 %begin, i64 %end, i64 %snapshots, { i64, double }* %state, { i64, double }* %adjoint, { double }* %acc, double %0, i64 %1)
+; CHECK: single:
+; CHECK:   call { double } @diffecheckpointstep_checkpointloop_tester({ i64, double }* %snapshot, { i64, double }* %adjoint, double %0, i64 %1)
+; CHECK: split:
+; CHECK:   %mid = sub i64 %end, %{{.+}}
+; CHECK:   call void @checkpointadvance_checkpointloop_tester({ i64, double }* %snapshot, i64 %{{.+}}, double %0, i64 %1)
+; CHECK-NEXT:   %[[less:.+]] = sub i64 %snapshots, 1
+; CHECK-NEXT:   call void @revolve_checkpointloop_tester(i64 %mid, i64 %end, i64 %[[less]], { i64, double }* %snapshot, { i64, double }* %adjoint, { double }* %acc, double %0, i64 %1)
+; CHECK-NEXT:   call void @revolve_checkpointloop_tester(i64 %begin, i64 %mid, i64 %snapshots, { i64, double }* %state, { i64, double }* %adjoint, { double }* %acc, double %0, i64 %1)
+
+; CHECK: attributes #[[ATTR]] = { nounwind readnone willreturn "enzyme_checkpoint"="2" }
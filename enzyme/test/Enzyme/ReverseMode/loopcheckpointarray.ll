@@ -0,0 +1,111 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+; RUN: if [ %llvmver -ge 9 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -pass-remarks=enzyme -disable-output 2>&1 | FileCheck %s --check-prefix=REMARK; fi
+
+declare double @__enzyme_autodiff(i8*, ...)
+declare double @llvm.sin.f64(double)
+
+define double @tester(double %x, i64 %n) {
+entry:
+  %arr = alloca [2 x double], align 16
+  %a0 = getelementptr inbounds [2 x double], [2 x double]* %arr, i64 0, i64 0
+  %a1 = getelementptr inbounds [2 x double], [2 x double]* %arr, i64 0, i64 1
+  store double %x, double* %a0, align 16
+  store double 1.000000e+00, double* %a1, align 8
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %v0 = load double, double* %a0, align 16
+  %v1 = load double, double* %a1, align 8
+  %s = call double @llvm.sin.f64(double %v0)
+  %m = fmul double %v1, %s
+  %v0.next = fadd double %v0, %m
+  %v1.next = fmul double %v0, 5.000000e-01
+  store double %v0.next, double* %a0, align 16
+  store double %v1.next, double* %a1, align 8
+  %i.next = add nuw nsw i64 %i, 1
+  %cmp = icmp eq i64 %i.next, %n
+  br i1 %cmp, label %exit, label %loop, !llvm.loop !0
+
+exit:
+  %r0 = load double, double* %a0, align 16
+  %r1 = load double, double* %a1, align 8
+  %r = fmul double %r0, %r1
+  ret double %r
+}
+
+define double @dtester(double %x, i64 %n) {
+entry:
+  %0 = tail call double (i8*, ...) @__enzyme_autodiff(i8* bitcast (double (double, i64)* @tester to i8*), double %x, i64 %n)
+  ret double %0
+}
+
+define void @escaping(double* %out, double %x, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %u = phi double [ %x, %entry ], [ %u.next, %loop ]
+  %u.next = fmul double %u, %u
+  store double %u.next, double* %out, align 8
+  %i.next = add nuw nsw i64 %i, 1
+  %cmp = icmp eq i64 %i.next, %n
+  br i1 %cmp, label %exit, label %loop, !llvm.loop !0
+
+exit:
+  ret void
+}
+
+define void @descaping(double* %out, double* %dout, double %x, i64 %n) {
+entry:
+  %0 = tail call double (i8*, ...) @__enzyme_autodiff(i8* bitcast (void (double*, double, i64)* @escaping to i8*), double* %out, double* %dout, double %x, i64 %n)
+  ret void
+}
+
+!0 = distinct !{!0, !1}
+!1 = !{!"enzyme.checkpoint", i32 2}
+
+; REMARK: remark: <unknown>:0:0: Checkpointing loop of tester as checkpointloop_tester
+; REMARK: remark: <unknown>:0:0: Cannot checkpoint loop loop of escaping as it accesses memory other than stack arrays of the function
+
+; CHECK: define internal { double, double } @checkpointloop_tester(i64 %n, double %arr.in, double %arr.in1) #[[ATTR:[0-9]+]]
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %arr = alloca [2 x double], align 16
+; CHECK-NEXT:   %a0 = getelementptr inbounds [2 x double], [2 x double]* %arr, i64 0, i64 0
+; CHECK-NEXT:   %a1 = getelementptr inbounds [2 x double], [2 x double]* %arr, i64 0, i64 1
+; CHECK-NEXT:   %[[in0:.+]] = getelementptr inbounds [2 x double], [2 x double]* %arr, i32 0, i32 0
+; CHECK-NEXT:   store double %arr.in, double* %[[in0]], align 8
+; CHECK-NEXT:   %[[in1:.+]] = getelementptr inbounds [2 x double], [2 x double]* %arr, i32 0, i32 1
+; CHECK-NEXT:   store double %arr.in1, double* %[[in1]], align 8
+; CHECK: exit:
+; CHECK-NEXT:   %[[out0:.+]] = getelementptr inbounds [2 x double], [2 x double]* %arr, i32 0, i32 0
+; CHECK-NEXT:   %[[r0:.+]] = load double, double* %[[out0]], align 8
+; CHECK-NEXT:   %[[out1:.+]] = getelementptr inbounds [2 x double], [2 x double]* %arr, i32 0, i32 1
+; CHECK-NEXT:   %[[r1:.+]] = load double, double* %[[out1]], align 8
+
+; CHECK: define internal { double } @diffetester(double %x, i64 %n, double %differeturn)
+; CHECK:   %[[call:.+]] = call { double, double } @checkpointloop_tester(i64 %n, double %[[x0:.+]], double %[[x1:.+]])
+; CHECK:   call { double, double } @diffecheckpointloop_tester(i64 %n, double %[[x0]], double %[[x1]], { double, double } %{{.+}})
+
+; CHECK: define internal { double, double } @diffecheckpointloop_tester(i64 %n, double %arr.in, double %arr.in1, { double, double } %differeturn)
+; CHECK: count:
+; CHECK-NEXT:   %iters = phi i64 [ 0, %entry ], [ %[[inc:.+]], %count ]
+; CHECK-NEXT:   %[[prev:.+]] = load { i64, [2 x double] }, { i64, [2 x double] }* %current, align 8
+; CHECK-NEXT:   %[[again:.+]] = call i1 @checkpointcontinue_checkpointloop_tester({ i64, [2 x double] }* %current, i64 %n, double %arr.in, double %arr.in1)
+; CHECK-NEXT:   %[[inc]] = add i64 %iters, 1
+; CHECK-NEXT:   br i1 %[[again]], label %count, label %counted
+; CHECK: counted:
+; CHECK-NEXT:   store { i64, [2 x double] } %[[prev]], { i64, [2 x double] }* %current, align 8
+; CHECK-NEXT:   %{{.+}} = call { double, double } @diffecheckpointlast_checkpointloop_tester({ i64, [2 x double] }* %current, { i64, [2 x double] }* %adjoint, i64 %n, double %arr.in, double %arr.in1, { double, double } %differeturn)
+; CHECK:   call void @revolve_checkpointloop_tester(i64 0, i64 %iters, i64 2, { i64, [2 x double] }* %initial, { i64, [2 x double] }* %adjoint, { double, double }* %acc, i64 %n, double %arr.in, double %arr.in1)
+
+; CHECK: define internal void @checkpointstep_checkpointloop_tester({ i64, [2 x double] }* noalias nocapture %state, i64 %n, double %arr.in, double %arr.in1)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %[[ivp:.+]] = getelementptr inbounds { i64, [2 x double] }, { i64, [2 x double] }* %state, i32 0, i32 0
+; CHECK-NEXT:   %iv = load i64, i64* %[[ivp]], align 4
+; CHECK-NEXT:   %arr = getelementptr inbounds { i64, [2 x double] }, { i64, [2 x double] }* %state, i32 0, i32 1
+; CHECK-NEXT:   %a0 = getelementptr inbounds [2 x double], [2 x double]* %arr, i64 0, i64 0
+; CHECK-NEXT:   %a1 = getelementptr inbounds [2 x double], [2 x double]* %arr, i64 0, i64 1
+
+; CHECK: attributes #[[ATTR]] = { nounwind readnone willreturn "enzyme_checkpoint"="2" }
@@ -0,0 +1,73 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-weighted-mincut -mem2reg -sroa -simplifycfg -adce -early-cse -S | FileCheck %s
+
+declare double @__enzyme_autodiff(i8*, ...)
+
+define double @tester(double %x, i8* %a, i8* %b) {
+entry:
+  br label %loop
+
+loop:
+  %iv = phi i64 [ 0, %entry ], [ %iv.next, %loop ]
+  %sum = phi double [ 0.000000e+00, %entry ], [ %sum.next, %loop ]
+  %iv.next = add nuw nsw i64 %iv, 1
+  %pa = getelementptr inbounds i8, i8* %a, i64 %iv
+  %pb = getelementptr inbounds i8, i8* %b, i64 %iv
+  %la = load i8, i8* %pa, align 1
+  %lb = load i8, i8* %pb, align 1
+  %fa = sitofp i8 %la to double
+  %fb = sitofp i8 %lb to double
+  %prod = fmul double %fa, %fb
+  %mul = fmul double %prod, %x
+  %sum.next = fadd double %sum, %mul
+  store i8 0, i8* %pa, align 1
+  store i8 0, i8* %pb, align 1
+  %cmp = icmp eq i64 %iv.next, 100
+  br i1 %cmp, label %exit, label %loop
+
+exit:
+  ret double %sum.next
+}
+
+define double @test_derivative(double %x, i8* %a, i8* %b) {
+entry:
+  %0 = tail call double (i8*, ...) @__enzyme_autodiff(i8* bitcast (double (double, i8*, i8*)* @tester to i8*), double %x, metadata !"enzyme_const", i8* %a, metadata !"enzyme_const", i8* %b)
+  ret double %0
+}
+
+; The unweighted cut caches the single double %prod, whereas caching the two
+; i8 loads requires a quarter of the tape.
+
+; CHECK: define internal { double } @diffetester(double %x, i8* %a, i8* %b, double %differeturn)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %malloccall = tail call noalias nonnull dereferenceable(100) dereferenceable_or_null(100) i8* @malloc(i64 100)
+; CHECK-NEXT:   %malloccall4 = tail call noalias nonnull dereferenceable(100) dereferenceable_or_null(100) i8* @malloc(i64 100)
+; CHECK-NEXT:   br label %loop
+
+; CHECK: loop:
+; CHECK-NEXT:   %iv1 = phi i64 [ %iv.next2, %loop ], [ 0, %entry ]
+; CHECK-NEXT:   %iv.next2 = add nuw nsw i64 %iv1, 1
+; CHECK-NEXT:   %pa = getelementptr inbounds i8, i8* %a, i64 %iv1
+; CHECK-NEXT:   %pb = getelementptr inbounds i8, i8* %b, i64 %iv1
+; CHECK-NEXT:   %la = load i8, i8* %pa, align 1
+; CHECK-NEXT:   %lb = load i8, i8* %pb, align 1
+; CHECK-NEXT:   store i8 0, i8* %pa, align 1
+; CHECK-NEXT:   %0 = getelementptr inbounds i8, i8* %malloccall4, i64 %iv1
+; CHECK-NEXT:   store i8 %lb, i8* %0, align 1, !invariant.group !
+; CHECK-NEXT:   %1 = getelementptr inbounds i8, i8* %malloccall, i64 %iv1
+; CHECK-NEXT:   store i8 %la, i8* %1, align 1, !invariant.group !
+; CHECK-NEXT:   store i8 0, i8* %pb, align 1
+; CHECK-NEXT:   %cmp = icmp eq i64 %iv.next2, 100
+; CHECK-NEXT:   br i1 %cmp, label %invertloop, label %loop
+
+; CHECK: invertloop:
+; CHECK-NEXT:   %"x'de.0" = phi double [ %7, %incinvertloop ], [ 0.000000e+00, %loop ]
+; CHECK-NEXT:   %"sum.next'de.0" = phi double [ %9, %incinvertloop ], [ %differeturn, %loop ]
+; CHECK-NEXT:   %"iv1'ac.0" = phi i64 [ %10, %incinvertloop ], [ 99, %loop ]
+; CHECK-NEXT:   %3 = getelementptr inbounds i8, i8* %malloccall, i64 %"iv1'ac.0"
+; CHECK-NEXT:   %4 = load i8, i8* %3, align 1, !invariant.group !
+; CHECK-NEXT:   %fa_unwrap = sitofp i8 %4 to double
+; CHECK-NEXT:   %5 = getelementptr inbounds i8, i8* %malloccall4, i64 %"iv1'ac.0"
+; CHECK-NEXT:   %6 = load i8, i8* %5, align 1, !invariant.group !
+; CHECK-NEXT:   %fb_unwrap = sitofp i8 %6 to double
+; CHECK-NEXT:   %prod_unwrap = fmul double %fa_unwrap, %fb_unwrap
+; CHECK-NEXT:   %m1diffex = fmul fast double %"sum.next'de.0", %prod_unwrap
@@ -332,7 +332,7 @@ attributes #4 = { nounwind }
 ; CHECK-NEXT:   ret void
 ; CHECK-NEXT: }
 
-; CHECK: define internal void @__enzyme_differential_mpi_wait(i8* %buf, i64 %count, i8* %datatype, i64 %source, i64 %tag, i8* %comm, i8 %fn, %struct.ompi_request_t** %d_req)
+; CHECK: define internal void @__enzyme_differential_mpi_wait(i8* %buf, i64 %count, i8* %datatype, i64 %source, i64 %tag, i8* %comm, i8 %fn, %struct.ompi_request_t** %d_req, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %helper)
 ; CHECK-NEXT: entry:
 ; CHECK-NEXT:   %0 = trunc i64 %count to i32
 ; CHECK-NEXT:   %1 = bitcast i8* %datatype to %struct.ompi_datatype_t*
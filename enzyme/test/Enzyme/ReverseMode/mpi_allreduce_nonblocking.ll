@@ -0,0 +1,56 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-nonblocking-mpi -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+%struct.ompi_predefined_datatype_t = type opaque
+%struct.ompi_predefined_op_t = type opaque
+%struct.ompi_predefined_communicator_t = type opaque
+%struct.ompi_op_t = type opaque
+%struct.ompi_datatype_t = type opaque
+%struct.ompi_communicator_t = type opaque
+%struct.ompi_request_t = type opaque
+%struct.ompi_status_public_t = type { i32, i32, i32, i32, i64 }
+
+@random_datatype = external dso_local global %struct.ompi_predefined_datatype_t, align 1
+@ompi_mpi_op_sum = external dso_local global %struct.ompi_predefined_op_t, align 1
+@ompi_mpi_comm_world = external dso_local global %struct.ompi_predefined_communicator_t, align 1
+
+define void @mpi_allreduce_test(double* noalias %b, double* noalias %global_sum, double* noalias %x, double* noalias %y) {
+entry:
+  %xv = load double, double* %x
+  %s = call double @llvm.sin.f64(double %xv)
+  store double %s, double* %y
+  %i8buf = bitcast double* %b to i8*
+  %i8sum = bitcast double* %global_sum to i8*
+  call i32 @MPI_Allreduce(i8* nonnull %i8buf, i8* %i8sum, i32 1, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @random_datatype to %struct.ompi_datatype_t*), %struct.ompi_op_t* bitcast (%struct.ompi_predefined_op_t* @ompi_mpi_op_sum to %struct.ompi_op_t*), %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*))
+  ret void
+}
+
+declare double @llvm.sin.f64(double)
+
+declare i32 @MPI_Allreduce(i8*, i8*, i32, %struct.ompi_datatype_t*, %struct.ompi_op_t*, %struct.ompi_communicator_t*) local_unnamed_addr
+
+declare i32 @MPI_Wait(%struct.ompi_request_t**, %struct.ompi_status_public_t*)
+
+define void @caller(double* %b, double* %db, double* %sum, double* %dsum, double* %x, double* %dx, double* %y, double* %dy) local_unnamed_addr  {
+entry:
+  call void (i8*, ...) @__enzyme_autodiff(i8* bitcast (void (double*, double*, double*, double*)* @mpi_allreduce_test to i8*), metadata !"enzyme_dup", double* %b, double* %db, metadata !"enzyme_dup", double* %sum, double* %dsum, metadata !"enzyme_dup", double* %x, double* %dx, metadata !"enzyme_dup", double* %y, double* %dy)
+  ret void
+}
+
+declare void @__enzyme_autodiff(i8*, ...)
+
+; The adjoint reduction is issued at the reverse of the allreduce, and only
+; waited upon once the reverse pass is done with the independent sin.
+
+; CHECK: define internal void @diffempi_allreduce_test(
+; CHECK: %[[req:.+]] = alloca %struct.ompi_request_t*
+; CHECK: call i32 @MPI_Allreduce(i8* nonnull %i8buf, i8* %i8sum,
+; CHECK: %[[tmp:.+]] = tail call noalias nonnull i8* @malloc(
+; CHECK-NEXT: %{{.+}} = call i32 @MPI_Iallreduce(i8* %"i8sum'ipc", i8* %[[tmp]], i32 1, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @random_datatype to %struct.ompi_datatype_t*), %struct.ompi_op_t* bitcast (%struct.ompi_predefined_op_t* @ompi_mpi_op_sum to %struct.ompi_op_t*), %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), %struct.ompi_request_t** %[[req]])
+; CHECK: call fast double @llvm.cos.f64(double %xv)
+; CHECK: store double %{{.+}}, double* %"x'"
+; CHECK-NEXT: %{{.+}} = call i32 @MPI_Wait(%struct.ompi_request_t** %[[req]], %struct.ompi_status_public_t* %
+; CHECK-NEXT: call void @llvm.memset.p0i8.i64(i8* nonnull %"i8sum'ipc", i8 0, i64 %{{.+}}, i1 false)
+; CHECK: %[[add:.+]] = fadd fast double %src.i.l.i, %dst.i.l.i
+; CHECK-NEXT: store double %[[add]], double* %src.i.i
+; CHECK: tail call void @free(i8* nonnull %[[tmp]])
+; CHECK-NEXT: ret void
@@ -0,0 +1,65 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+%struct.ompi_predefined_datatype_t = type opaque
+%struct.ompi_predefined_communicator_t = type opaque
+%struct.ompi_datatype_t = type opaque
+%struct.ompi_communicator_t = type opaque
+
+@ompi_mpi_double = external dso_local global %struct.ompi_predefined_datatype_t, align 1
+@ompi_mpi_comm_world = external dso_local global %struct.ompi_predefined_communicator_t, align 1
+
+define void @mpi_alltoall_test(double* %x, double* %y) {
+entry:
+  %xb = bitcast double* %x to i8*
+  %yb = bitcast double* %y to i8*
+  %call = call i32 @MPI_Alltoall(i8* %xb, i32 1, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i8* %yb, i32 1, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*))
+  ret void
+}
+
+declare i32 @MPI_Alltoall(i8*, i32, %struct.ompi_datatype_t*, i8*, i32, %struct.ompi_datatype_t*, %struct.ompi_communicator_t*) local_unnamed_addr
+
+define void @caller(double* %x, double* %dx, double* %y, double* %dy) local_unnamed_addr  {
+entry:
+  call void (i8*, ...) @__enzyme_autodiff(i8* bitcast (void (double*, double*)* @mpi_alltoall_test to i8*), metadata !"enzyme_dup", double* %x, double* %dx, metadata !"enzyme_dup", double* %y, double* %dy)
+  ret void
+}
+
+declare void @__enzyme_autodiff(i8*, ...)
+
+; CHECK: define internal void @diffempi_alltoall_test(double* %x, double* %"x'", double* %y, double* %"y'")
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = alloca i32
+; CHECK-NEXT:   %xb = bitcast double* %x to i8*
+; CHECK-NEXT:   %"yb'ipc" = bitcast double* %"y'" to i8*
+; CHECK-NEXT:   %yb = bitcast double* %y to i8*
+; CHECK-NEXT:   %call = call i32 @MPI_Alltoall(i8* %xb, i32 1, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i8* %yb, i32 1, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*))
+; CHECK-NEXT:   %1 = call i32 @MPI_Comm_size(%struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), i32* %0)
+; CHECK-NEXT:   %2 = load i32, i32* %0
+; CHECK-NEXT:   %3 = zext i32 %2 to i64
+; CHECK-NEXT:   %4 = mul nuw nsw i64 8, %3
+; CHECK-NEXT:   %5 = zext i32 %2 to i64
+; CHECK-NEXT:   %6 = mul nuw nsw i64 8, %5
+; CHECK-NEXT:   %7 = tail call noalias nonnull i8* @malloc(i64 %4)
+; CHECK-NEXT:   %8 = call i32 @MPI_Alltoall(i8* %"yb'ipc", i32 1, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i8* %7, i32 1, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*))
+; CHECK-NEXT:   call void @llvm.memset.p0i8.i64(i8* nonnull %"yb'ipc", i8 0, i64 %6, i1 false)
+; CHECK-NEXT:   %9 = bitcast i8* %7 to double*
+; CHECK-NEXT:   %10 = icmp eq i64 %3, 0
+; CHECK-NEXT:   br i1 %10, label %__enzyme_memcpyadd_doubleda1sa1.exit, label %for.body.i
+
+; CHECK: for.body.i:                                       ; preds = %for.body.i, %entry
+; CHECK-NEXT:   %idx.i = phi i64 [ 0, %entry ], [ %idx.next.i, %for.body.i ]
+; CHECK-NEXT:   %dst.i.i = getelementptr inbounds double, double* %9, i64 %idx.i
+; CHECK-NEXT:   %dst.i.l.i = load double, double* %dst.i.i
+; CHECK-NEXT:   store double 0.000000e+00, double* %dst.i.i
+; CHECK-NEXT:   %src.i.i = getelementptr inbounds double, double* %"x'", i64 %idx.i
+; CHECK-NEXT:   %src.i.l.i = load double, double* %src.i.i
+; CHECK-NEXT:   %11 = fadd fast double %src.i.l.i, %dst.i.l.i
+; CHECK-NEXT:   store double %11, double* %src.i.i
+; CHECK-NEXT:   %idx.next.i = add nuw i64 %idx.i, 1
+; CHECK-NEXT:   %12 = icmp eq i64 %3, %idx.next.i
+; CHECK-NEXT:   br i1 %12, label %__enzyme_memcpyadd_doubleda1sa1.exit, label %for.body.i
+
+; CHECK: __enzyme_memcpyadd_doubleda1sa1.exit:             ; preds = %entry, %for.body.i
+; CHECK-NEXT:   tail call void @free(i8* nonnull %7)
+; CHECK-NEXT:   ret void
+; CHECK-NEXT: }
@@ -0,0 +1,131 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+%struct.ompi_predefined_datatype_t = type opaque
+%struct.ompi_predefined_op_t = type opaque
+%struct.ompi_predefined_communicator_t = type opaque
+%struct.ompi_op_t = type opaque
+%struct.ompi_datatype_t = type opaque
+%struct.ompi_communicator_t = type opaque
+%struct.ompi_request_t = type opaque
+%struct.ompi_status_public_t = type { i32, i32, i32, i32, i64 }
+
+@random_datatype = external dso_local global %struct.ompi_predefined_datatype_t, align 1
+@ompi_mpi_op_sum = external dso_local global %struct.ompi_predefined_op_t, align 1
+@ompi_mpi_comm_world = external dso_local global %struct.ompi_predefined_communicator_t, align 1
+
+define void @mpi_iallreduce_test(double* %b, i8* %global_sum_addr) {
+entry:
+  %req = alloca %struct.ompi_request_t*
+  %status = alloca %struct.ompi_status_public_t
+  %i8buf = bitcast double* %b to i8*
+  call i32 @MPI_Iallreduce(i8* nonnull %i8buf, i8* %global_sum_addr, i32 1, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @random_datatype to %struct.ompi_datatype_t*), %struct.ompi_op_t* bitcast (%struct.ompi_predefined_op_t* @ompi_mpi_op_sum to %struct.ompi_op_t*), %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), %struct.ompi_request_t** %req)
+  call i32 @MPI_Wait(%struct.ompi_request_t** %req, %struct.ompi_status_public_t* %status)
+  ret void
+}
+
+declare i32 @MPI_Iallreduce(i8*, i8*, i32, %struct.ompi_datatype_t*, %struct.ompi_op_t*, %struct.ompi_communicator_t*, %struct.ompi_request_t**) local_unnamed_addr
+
+declare i32 @MPI_Wait(%struct.ompi_request_t**, %struct.ompi_status_public_t*) local_unnamed_addr
+
+; Function Attrs: nounwind uwtable
+define void @caller(double* %b, double* %db, i8* %sum, i8* %dsum) local_unnamed_addr  {
+entry:
+  call void (i8*, ...) @__enzyme_autodiff(i8* bitcast (void (double*, i8*)* @mpi_iallreduce_test to i8*), metadata !"enzyme_dup", double* %b, double* %db, metadata !"enzyme_dup", i8* %sum, i8* %dsum)
+  ret void
+}
+
+declare void @__enzyme_autodiff(i8*, ...)
+
+; CHECK: define internal void @diffempi_iallreduce_test(double* %b, double* %"b'", i8* %global_sum_addr, i8* %"global_sum_addr'")
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = alloca i32
+; CHECK-NEXT:   %1 = alloca %struct.ompi_status_public_t
+; CHECK-NEXT:   %"req'ipa" = alloca %struct.ompi_request_t*
+; CHECK-NEXT:   store %struct.ompi_request_t* null, %struct.ompi_request_t** %"req'ipa"
+; CHECK-NEXT:   %req = alloca %struct.ompi_request_t*
+; CHECK-NEXT:   %status = alloca %struct.ompi_status_public_t
+; CHECK-NEXT:   %i8buf = bitcast double* %b to i8*
+; CHECK-NEXT:   %malloccall = tail call noalias nonnull dereferenceable(64) dereferenceable_or_null(64) i8* @malloc(i64 64)
+; CHECK-NEXT:   %2 = bitcast i8* %malloccall to { i8*, i64, i8*, i64, i64, i8*, i8, i8* }*
+; CHECK-NEXT:   %3 = bitcast %struct.ompi_request_t** %"req'ipa" to { i8*, i64, i8*, i64, i64, i8*, i8, i8* }**
+; CHECK-NEXT:   %4 = load { i8*, i64, i8*, i64, i64, i8*, i8, i8* }*, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }** %3
+; CHECK-NEXT:   %5 = getelementptr inbounds { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %2, i64 0, i32 7
+; CHECK-NEXT:   %6 = bitcast { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %4 to i8*
+; CHECK-NEXT:   store i8* %6, i8** %5
+; CHECK-NEXT:   store { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %2, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }** %3
+; CHECK-NEXT:   %7 = getelementptr inbounds { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %2, i64 0, i32 0
+; CHECK-NEXT:   store i8* %"global_sum_addr'", i8** %7
+; CHECK-NEXT:   %8 = getelementptr inbounds { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %2, i64 0, i32 1
+; CHECK-NEXT:   store i64 1, i64* %8
+; CHECK-NEXT:   %9 = getelementptr inbounds { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %2, i64 0, i32 2
+; CHECK-NEXT:   store i8* bitcast (%struct.ompi_predefined_datatype_t* @random_datatype to i8*), i8** %9
+; CHECK-NEXT:   %10 = getelementptr inbounds { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %2, i64 0, i32 3
+; CHECK-NEXT:   store i64 0, i64* %10
+; CHECK-NEXT:   %11 = getelementptr inbounds { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %2, i64 0, i32 4
+; CHECK-NEXT:   store i64 ptrtoint (%struct.ompi_predefined_op_t* @ompi_mpi_op_sum to i64), i64* %11
+; CHECK-NEXT:   %12 = getelementptr inbounds { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %2, i64 0, i32 5
+; CHECK-NEXT:   store i8* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to i8*), i8** %12
+; CHECK-NEXT:   %13 = getelementptr inbounds { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %2, i64 0, i32 6
+; CHECK-NEXT:   store i8 3, i8* %13
+; CHECK-NEXT:   %14 = call i32 @MPI_Iallreduce(i8* nonnull %i8buf, i8* %global_sum_addr, i32 1, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @random_datatype to %struct.ompi_datatype_t*), %struct.ompi_op_t* bitcast (%struct.ompi_predefined_op_t* @ompi_mpi_op_sum to %struct.ompi_op_t*), %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), %struct.ompi_request_t** %req)
+; CHECK-NEXT:   %15 = bitcast %struct.ompi_request_t** %"req'ipa" to { i8*, i64, i8*, i64, i64, i8*, i8, i8* }**
+; CHECK-NEXT:   %16 = load { i8*, i64, i8*, i64, i64, i8*, i8, i8* }*, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }** %15
+; CHECK-NEXT:   %17 = call i32 @MPI_Wait(%struct.ompi_request_t** %req, %struct.ompi_status_public_t* %status)
+; CHECK-NEXT:   %18 = icmp eq { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %16, null
+; CHECK-NEXT:   br i1 %18, label %invertentry_end, label %invertentry_nonnull
+
+; CHECK: invertentry_nonnull:                              ; preds = %entry
+; CHECK-NEXT:   %19 = load { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %16
+; CHECK-NEXT:   %20 = extractvalue { i8*, i64, i8*, i64, i64, i8*, i8, i8* } %19, 0
+; CHECK-NEXT:   %21 = extractvalue { i8*, i64, i8*, i64, i64, i8*, i8, i8* } %19, 1
+; CHECK-NEXT:   %22 = extractvalue { i8*, i64, i8*, i64, i64, i8*, i8, i8* } %19, 2
+; CHECK-NEXT:   %23 = extractvalue { i8*, i64, i8*, i64, i64, i8*, i8, i8* } %19, 4
+; CHECK-NEXT:   %24 = extractvalue { i8*, i64, i8*, i64, i64, i8*, i8, i8* } %19, 5
+; CHECK-NEXT:   %25 = trunc i64 %21 to i32
+; CHECK-NEXT:   %26 = bitcast i8* %22 to %struct.ompi_datatype_t*
+; CHECK-NEXT:   %27 = inttoptr i64 %23 to %struct.ompi_op_t*
+; CHECK-NEXT:   %28 = bitcast i8* %24 to %struct.ompi_communicator_t*
+; CHECK-NEXT:   %29 = call i32 @MPI_Iallreduce(i8* inttoptr (i64 1 to i8*), i8* %20, i32 %25, %struct.ompi_datatype_t* %26, %struct.ompi_op_t* %27, %struct.ompi_communicator_t* %28, %struct.ompi_request_t** %req)
+; CHECK-NEXT:   br label %invertentry_end
+
+; CHECK: invertentry_end:                                  ; preds = %invertentry_nonnull, %entry
+; CHECK-NEXT:   %30 = bitcast %struct.ompi_request_t** %"req'ipa" to { i8*, i64, i8*, i64, i64, i8*, i8, i8* }**
+; CHECK-NEXT:   %31 = load { i8*, i64, i8*, i64, i64, i8*, i8, i8* }*, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }** %30
+; CHECK-NEXT:   %32 = getelementptr inbounds { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %31, i64 0, i32 0
+; CHECK-NEXT:   %33 = load i8*, i8** %32
+; CHECK-NEXT:   %34 = getelementptr inbounds { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %31, i64 0, i32 1
+; CHECK-NEXT:   %35 = load i64, i64* %34
+; CHECK-NEXT:   %36 = getelementptr inbounds { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %31, i64 0, i32 2
+; CHECK-NEXT:   %37 = load i8*, i8** %36
+; CHECK-NEXT:   %38 = getelementptr inbounds { i8*, i64, i8*, i64, i64, i8*, i8, i8* }, { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %31, i64 0, i32 7
+; CHECK-NEXT:   %39 = load i8*, i8** %38
+; CHECK-NEXT:   %40 = bitcast %struct.ompi_request_t** %"req'ipa" to i8**
+; CHECK-NEXT:   store i8* %39, i8** %40
+; CHECK-NEXT:   %41 = call i32 @MPI_Type_size(i8* %37, i32* %0)
+; CHECK-NEXT:   %42 = load i32, i32* %0
+; CHECK-NEXT:   %43 = zext i32 %42 to i64
+; CHECK-NEXT:   %44 = mul nuw nsw i64 %35, %43
+; CHECK-NEXT:   %45 = call i32 @MPI_Wait(%struct.ompi_request_t** %req, %struct.ompi_status_public_t* %1)
+; CHECK-NEXT:   %46 = bitcast i8* %33 to double*
+; CHECK-NEXT:   %47 = udiv i64 %44, 8
+; CHECK-NEXT:   %48 = icmp eq i64 %47, 0
+; CHECK-NEXT:   br i1 %48, label %__enzyme_memcpyadd_doubleda1sa1.exit, label %for.body.i
+
+; CHECK: for.body.i:                                       ; preds = %for.body.i, %invertentry_end
+; CHECK-NEXT:   %idx.i = phi i64 [ 0, %invertentry_end ], [ %idx.next.i, %for.body.i ]
+; CHECK-NEXT:   %dst.i.i = getelementptr inbounds double, double* %46, i64 %idx.i
+; CHECK-NEXT:   %dst.i.l.i = load double, double* %dst.i.i
+; CHECK-NEXT:   store double 0.000000e+00, double* %dst.i.i
+; CHECK-NEXT:   %src.i.i = getelementptr inbounds double, double* %"b'", i64 %idx.i
+; CHECK-NEXT:   %src.i.l.i = load double, double* %src.i.i
+; CHECK-NEXT:   %49 = fadd fast double %src.i.l.i, %dst.i.l.i
+; CHECK-NEXT:   store double %49, double* %src.i.i
+; CHECK-NEXT:   %idx.next.i = add nuw i64 %idx.i, 1
+; CHECK-NEXT:   %50 = icmp eq i64 %47, %idx.next.i
+; CHECK-NEXT:   br i1 %50, label %__enzyme_memcpyadd_doubleda1sa1.exit, label %for.body.i
+
+; CHECK: __enzyme_memcpyadd_doubleda1sa1.exit:             ; preds = %invertentry_end, %for.body.i
+; CHECK-NEXT:   %51 = bitcast { i8*, i64, i8*, i64, i64, i8*, i8, i8* }* %31 to i8*
+; CHECK-NEXT:   tail call void @free(i8* nonnull %51)
+; CHECK-NEXT:   ret void
+; CHECK-NEXT: }
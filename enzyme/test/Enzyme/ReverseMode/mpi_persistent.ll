@@ -0,0 +1,95 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+%struct.ompi_predefined_datatype_t = type opaque
+%struct.ompi_predefined_communicator_t = type opaque
+%struct.ompi_datatype_t = type opaque
+%struct.ompi_communicator_t = type opaque
+%struct.ompi_request_t = type opaque
+%struct.ompi_status_public_t = type { i32, i32, i32, i32, i64 }
+
+@ompi_mpi_double = external dso_local global %struct.ompi_predefined_datatype_t, align 1
+@ompi_mpi_comm_world = external dso_local global %struct.ompi_predefined_communicator_t, align 1
+
+define void @mpi_persistent_test(double* %x, double* %y, i32 %left, i32 %right) {
+entry:
+  %sreq = alloca %struct.ompi_request_t*
+  %rreq = alloca %struct.ompi_request_t*
+  %status = alloca %struct.ompi_status_public_t
+  %xb = bitcast double* %x to i8*
+  %yb = bitcast double* %y to i8*
+  %c0 = call i32 @MPI_Send_init(i8* %xb, i32 2, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i32 %right, i32 0, %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), %struct.ompi_request_t** %sreq)
+  %c1 = call i32 @MPI_Recv_init(i8* %yb, i32 2, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i32 %left, i32 0, %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), %struct.ompi_request_t** %rreq)
+  %c2 = call i32 @MPI_Start(%struct.ompi_request_t** %rreq)
+  %c3 = call i32 @MPI_Start(%struct.ompi_request_t** %sreq)
+  %c4 = call i32 @MPI_Wait(%struct.ompi_request_t** %sreq, %struct.ompi_status_public_t* %status)
+  %c5 = call i32 @MPI_Wait(%struct.ompi_request_t** %rreq, %struct.ompi_status_public_t* %status)
+  %c6 = call i32 @MPI_Request_free(%struct.ompi_request_t** %sreq)
+  %c7 = call i32 @MPI_Request_free(%struct.ompi_request_t** %rreq)
+  ret void
+}
+
+declare i32 @MPI_Send_init(i8*, i32, %struct.ompi_datatype_t*, i32, i32, %struct.ompi_communicator_t*, %struct.ompi_request_t**) local_unnamed_addr
+
+declare i32 @MPI_Recv_init(i8*, i32, %struct.ompi_datatype_t*, i32, i32, %struct.ompi_communicator_t*, %struct.ompi_request_t**) local_unnamed_addr
+
+declare i32 @MPI_Start(%struct.ompi_request_t**) local_unnamed_addr
+
+declare i32 @MPI_Wait(%struct.ompi_request_t**, %struct.ompi_status_public_t*) local_unnamed_addr
+
+declare i32 @MPI_Request_free(%struct.ompi_request_t**) local_unnamed_addr
+
+define void @caller(double* %x, double* %dx, double* %y, double* %dy, i32 %left, i32 %right) local_unnamed_addr  {
+entry:
+  call void (i8*, ...) @__enzyme_autodiff(i8* bitcast (void (double*, double*, i32, i32)* @mpi_persistent_test to i8*), metadata !"enzyme_dup", double* %x, double* %dx, metadata !"enzyme_dup", double* %y, double* %dy, i32 %left, i32 %right)
+  ret void
+}
+
+declare void @__enzyme_autodiff(i8*, ...)
+
+; CHECK: define internal void @diffempi_persistent_test(double* %x, double* %"x'", double* %y, double* %"y'", i32 %left, i32 %right)
+; CHECK:   %24 = call i32 @MPI_Recv_init(i8* %22, i32 2, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i32 %right, i32 0, %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), %struct.ompi_request_t** %23)
+; CHECK:   %c0 = call i32 @MPI_Send_init(i8* %xb, i32 2, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i32 %right, i32 0, %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), %struct.ompi_request_t** %sreq)
+; CHECK:   %44 = call i32 @MPI_Send_init(i8* %42, i32 2, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i32 %left, i32 0, %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), %struct.ompi_request_t** %43)
+; CHECK:   %c1 = call i32 @MPI_Recv_init(i8* %yb, i32 2, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i32 %left, i32 0, %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), %struct.ompi_request_t** %rreq)
+; CHECK:   %c2 = call i32 @MPI_Start(%struct.ompi_request_t** %rreq)
+; CHECK:   %c3 = call i32 @MPI_Start(%struct.ompi_request_t** %sreq)
+; CHECK:   %c4 = call i32 @MPI_Wait(%struct.ompi_request_t** %sreq, %struct.ompi_status_public_t* %status)
+; CHECK:   %c5 = call i32 @MPI_Wait(%struct.ompi_request_t** %rreq, %struct.ompi_status_public_t* %status)
+; CHECK:   %c6 = call i32 @MPI_Request_free(%struct.ompi_request_t** %sreq)
+; CHECK:   %c7 = call i32 @MPI_Request_free(%struct.ompi_request_t** %rreq)
+
+; CHECK: invertentry_nonnull:                              ; preds = %entry
+; CHECK:   %56 = call i32 @MPI_Start(%struct.ompi_request_t** %55)
+
+; CHECK: invertentry_end:                                  ; preds = %invertentry_nonnull, %entry
+
+; CHECK: invertentry_end_nonnull:                          ; preds = %invertentry_end
+; CHECK:   %60 = call i32 @MPI_Start(%struct.ompi_request_t** %59)
+
+; CHECK: invertentry_end_end:                              ; preds = %invertentry_end_nonnull, %invertentry_end
+
+; CHECK: nonnull.i:                                        ; preds = %invertentry_end_end
+; CHECK:   %66 = call i32 @MPI_Wait(%struct.ompi_request_t** %65, %struct.ompi_status_public_t* %2)
+
+; CHECK: accumulateSend.i:                                 ; preds = %nonnull.i
+; CHECK:   %76 = call i32 @MPI_Reduce_local(i8* %buf.i, i8* %shadow.i, i32 %73, %struct.ompi_datatype_t* %74, i8** %75)
+
+; CHECK: zeroRecv.i:                                       ; preds = %nonnull.i
+; CHECK:   %78 = call i32 @MPI_Type_size(%struct.ompi_datatype_t* %77, i32* %3)
+; CHECK:   call void @llvm.memset.p0i8.i64(i8* %shadow.i, i8 0, i64 %81, i1 false)
+
+; CHECK: nonnull.i8:                                       ; preds = %__enzyme_differential_mpi_start.exit
+; CHECK:   %89 = call i32 @MPI_Wait(%struct.ompi_request_t** %88, %struct.ompi_status_public_t* %0)
+
+; CHECK: accumulateSend.i10:                               ; preds = %nonnull.i8
+; CHECK:   %99 = call i32 @MPI_Reduce_local(i8* %buf.i3, i8* %shadow.i7, i32 %96, %struct.ompi_datatype_t* %97, i8** %98)
+
+; CHECK: zeroRecv.i11:                                     ; preds = %nonnull.i8
+; CHECK:   %101 = call i32 @MPI_Type_size(%struct.ompi_datatype_t* %100, i32* %1)
+; CHECK:   call void @llvm.memset.p0i8.i64(i8* %shadow.i7, i8 0, i64 %104, i1 false)
+; CHECK:   %114 = call i32 @MPI_Request_free(%struct.ompi_request_t** %113)
+; CHECK:   tail call void @free(i8* nonnull %115)
+; CHECK:   %123 = call i32 @MPI_Request_free(%struct.ompi_request_t** %122)
+; CHECK:   tail call void @free(i8* nonnull %125)
+; CHECK:   tail call void @free(i8* nonnull %126)
+; CHECK-NEXT:   ret void
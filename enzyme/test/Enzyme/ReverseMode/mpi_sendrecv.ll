@@ -0,0 +1,61 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+%struct.ompi_predefined_datatype_t = type opaque
+%struct.ompi_predefined_communicator_t = type opaque
+%struct.ompi_datatype_t = type opaque
+%struct.ompi_communicator_t = type opaque
+%struct.ompi_status_public_t = type { i32, i32, i32, i32, i64 }
+
+@ompi_mpi_double = external dso_local global %struct.ompi_predefined_datatype_t, align 1
+@ompi_mpi_comm_world = external dso_local global %struct.ompi_predefined_communicator_t, align 1
+
+define void @mpi_sendrecv_test(double* %x, double* %y, i32 %left, i32 %right) {
+entry:
+  %status = alloca %struct.ompi_status_public_t
+  %xb = bitcast double* %x to i8*
+  %yb = bitcast double* %y to i8*
+  %call = call i32 @MPI_Sendrecv(i8* %xb, i32 2, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i32 %right, i32 0, i8* %yb, i32 2, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i32 %left, i32 0, %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), %struct.ompi_status_public_t* %status)
+  ret void
+}
+
+declare i32 @MPI_Sendrecv(i8*, i32, %struct.ompi_datatype_t*, i32, i32, i8*, i32, %struct.ompi_datatype_t*, i32, i32, %struct.ompi_communicator_t*, %struct.ompi_status_public_t*) local_unnamed_addr
+
+define void @caller(double* %x, double* %dx, double* %y, double* %dy, i32 %left, i32 %right) local_unnamed_addr  {
+entry:
+  call void (i8*, ...) @__enzyme_autodiff(i8* bitcast (void (double*, double*, i32, i32)* @mpi_sendrecv_test to i8*), metadata !"enzyme_dup", double* %x, double* %dx, metadata !"enzyme_dup", double* %y, double* %dy, i32 %left, i32 %right)
+  ret void
+}
+
+declare void @__enzyme_autodiff(i8*, ...)
+
+; CHECK: define internal void @diffempi_sendrecv_test(double* %x, double* %"x'", double* %y, double* %"y'", i32 %left, i32 %right)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = alloca %struct.ompi_status_public_t
+; CHECK-NEXT:   %status = alloca %struct.ompi_status_public_t
+; CHECK-NEXT:   %xb = bitcast double* %x to i8*
+; CHECK-NEXT:   %"yb'ipc" = bitcast double* %"y'" to i8*
+; CHECK-NEXT:   %yb = bitcast double* %y to i8*
+; CHECK-NEXT:   %call = call i32 @MPI_Sendrecv(i8* %xb, i32 2, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i32 %right, i32 0, i8* %yb, i32 2, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i32 %left, i32 0, %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), %struct.ompi_status_public_t* %status)
+; CHECK-NEXT:   %1 = tail call noalias nonnull dereferenceable(16) dereferenceable_or_null(16) i8* @malloc(i64 16)
+; CHECK-NEXT:   %2 = call i32 @MPI_Sendrecv(i8* %"yb'ipc", i32 2, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i32 %left, i32 0, i8* %1, i32 2, %struct.ompi_datatype_t* bitcast (%struct.ompi_predefined_datatype_t* @ompi_mpi_double to %struct.ompi_datatype_t*), i32 %right, i32 0, %struct.ompi_communicator_t* bitcast (%struct.ompi_predefined_communicator_t* @ompi_mpi_comm_world to %struct.ompi_communicator_t*), %struct.ompi_status_public_t* %0)
+; CHECK-NEXT:   call void @llvm.memset.p0i8.i64(i8* nonnull %"yb'ipc", i8 0, i64 16, i1 false)
+; CHECK-NEXT:   %3 = bitcast i8* %1 to double*
+; CHECK-NEXT:   br label %for.body.i
+
+; CHECK: for.body.i:                                       ; preds = %for.body.i, %entry
+; CHECK-NEXT:   %idx.i = phi i64 [ 0, %entry ], [ %idx.next.i, %for.body.i ]
+; CHECK-NEXT:   %dst.i.i = getelementptr inbounds double, double* %3, i64 %idx.i
+; CHECK-NEXT:   %dst.i.l.i = load double, double* %dst.i.i
+; CHECK-NEXT:   store double 0.000000e+00, double* %dst.i.i
+; CHECK-NEXT:   %src.i.i = getelementptr inbounds double, double* %"x'", i64 %idx.i
+; CHECK-NEXT:   %src.i.l.i = load double, double* %src.i.i
+; CHECK-NEXT:   %4 = fadd fast double %src.i.l.i, %dst.i.l.i
+; CHECK-NEXT:   store double %4, double* %src.i.i
+; CHECK-NEXT:   %idx.next.i = add nuw i64 %idx.i, 1
+; CHECK-NEXT:   %5 = icmp eq i64 2, %idx.next.i
+; CHECK-NEXT:   br i1 %5, label %__enzyme_memcpyadd_doubleda1sa1.exit, label %for.body.i
+
+; CHECK: __enzyme_memcpyadd_doubleda1sa1.exit:             ; preds = %for.body.i
+; CHECK-NEXT:   tail call void @free(i8* nonnull %1)
+; CHECK-NEXT:   ret void
+; CHECK-NEXT: }
@@ -0,0 +1,108 @@
+; RUN: if [ %llvmver -ge 9 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -mem2reg -instsimplify -adce -loop-deletion -correlated-propagation -simplifycfg -adce -simplifycfg -S | FileCheck %s; fi
+
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.ident_t = type { i32, i32, i32, i32, i8* }
+
+@0 = private unnamed_addr constant [23 x i8] c";unknown;unknown;0;0;;\00", align 1
+@1 = private unnamed_addr constant %struct.ident_t { i32 0, i32 514, i32 0, i32 0, i8* getelementptr inbounds ([23 x i8], [23 x i8]* @0, i32 0, i32 0) }, align 8
+@2 = private unnamed_addr constant %struct.ident_t { i32 0, i32 2, i32 0, i32 0, i8* getelementptr inbounds ([23 x i8], [23 x i8]* @0, i32 0, i32 0) }, align 8
+
+define void @main(double* %x, double* %dx, i64 %n) {
+entry:
+  call void (i8*, ...) @__enzyme_autodiff(i8* bitcast (void (double*, i64)* @f to i8*), double* %x, double* %dx, i64 %n)
+  ret void
+}
+
+declare void @__enzyme_autodiff(i8*, ...)
+
+define internal void @f(double* %e_new, i64 %length) {
+entry:
+  tail call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* nonnull @2, i32 2, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, i64, double*)* @.omp_outlined. to void (i32*, i32*, ...)*), i64 %length, double* %e_new)
+  ret void
+}
+
+; #pragma omp parallel for schedule(dynamic, 3)
+define internal void @.omp_outlined.(i32* noalias nocapture readonly %.global_tid., i32* noalias nocapture readnone %.bound_tid., i64 %length, double* nocapture nonnull align 8 dereferenceable(8) %tmp) {
+entry:
+  %.omp.lb = alloca i64, align 8
+  %.omp.ub = alloca i64, align 8
+  %.omp.stride = alloca i64, align 8
+  %.omp.is_last = alloca i32, align 4
+  %sub4 = add i64 %length, -1
+  %cmp.not = icmp eq i64 %length, 0
+  br i1 %cmp.not, label %omp.precond.end, label %omp.precond.then
+
+omp.precond.then:
+  store i64 0, i64* %.omp.lb, align 8
+  store i64 %sub4, i64* %.omp.ub, align 8
+  store i64 1, i64* %.omp.stride, align 8
+  store i32 0, i32* %.omp.is_last, align 4
+  %0 = load i32, i32* %.global_tid., align 4
+  call void @__kmpc_dispatch_init_8u(%struct.ident_t* nonnull @1, i32 %0, i32 35, i64 0, i64 %sub4, i64 1, i64 3)
+  br label %omp.dispatch.cond
+
+omp.dispatch.cond:
+  %r = call i32 @__kmpc_dispatch_next_8u(%struct.ident_t* nonnull @1, i32 %0, i32* nonnull %.omp.is_last, i64* nonnull %.omp.lb, i64* nonnull %.omp.ub, i64* nonnull %.omp.stride)
+  %tobool = icmp ne i32 %r, 0
+  br i1 %tobool, label %omp.dispatch.body, label %omp.precond.end
+
+omp.dispatch.body:
+  %1 = load i64, i64* %.omp.lb, align 8
+  %2 = load i64, i64* %.omp.ub, align 8
+  %add29 = add i64 %2, 1
+  %cmp730 = icmp ult i64 %1, %add29
+  br i1 %cmp730, label %omp.inner.for.body, label %omp.dispatch.inc
+
+omp.inner.for.body:
+  %.omp.iv.031 = phi i64 [ %add11, %omp.inner.for.body ], [ %1, %omp.dispatch.body ]
+  %arrayidx = getelementptr inbounds double, double* %tmp, i64 %.omp.iv.031
+  %3 = load double, double* %arrayidx, align 8
+  %call = call double @sqrt(double %3)
+  store double %call, double* %arrayidx, align 8
+  %add11 = add nuw i64 %.omp.iv.031, 1
+  %cmp7 = icmp ult i64 %add11, %add29
+  br i1 %cmp7, label %omp.inner.for.body, label %omp.dispatch.inc
+
+omp.dispatch.inc:
+  br label %omp.dispatch.cond
+
+omp.precond.end:
+  ret void
+}
+
+declare void @__kmpc_dispatch_init_8u(%struct.ident_t*, i32, i32, i64, i64, i64, i64)
+declare i32 @__kmpc_dispatch_next_8u(%struct.ident_t*, i32, i32*, i64*, i64*, i64*)
+declare double @sqrt(double)
+declare !callback !11 void @__kmpc_fork_call(%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...)
+
+!11 = !{!12}
+!12 = !{i64 2, i64 -1, i64 -1, i1 true}
+
+; CHECK: define internal void @diffef(double* %e_new, double* %"e_new'", i64 %length)
+; CHECK: %[[nthreads:.+]] = call i64 @omp_get_max_threads()
+; CHECK: %mallocsize_unwrap = mul nuw nsw i64 %[[nthreads]], 8
+; CHECK: call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* @2, i32 4, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, i64, double*, double*, { i1**, i64**, i64**, double*** }*)* @augmented_.omp_outlined..1 to void (i32*, i32*, ...)*)
+; CHECK: call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* @2, i32 4, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, i64, double*, double*, { i1**, i64**, i64**, double*** }*)* @diffe.omp_outlined. to void (i32*, i32*, ...)*)
+
+; CHECK: define internal void @augmented_.omp_outlined..1(
+; CHECK: %[[tid:.+]] = call i64 @omp_get_thread_num()
+; CHECK: call void @__kmpc_dispatch_init_8u(
+; CHECK: %r = call i32 @__kmpc_dispatch_next_8u(
+; CHECK: omp.precond.end:
+; CHECK: %[[slot:.+]] = getelementptr inbounds i1*, i1** %{{.*}}, i64 %[[tid]]
+; CHECK-NEXT: store i1* %tobool_cache.1, i1** %[[slot]]
+; CHECK: ret void
+
+; CHECK: define internal void @diffe.omp_outlined.(
+; CHECK: %[[dtid:.+]] = call i64 @omp_get_thread_num()
+; CHECK-NEXT: %[[dslot:.+]] = getelementptr inbounds i1*, i1** %{{.*}}, i64 %[[dtid]]
+; CHECK-NEXT: %tobool_thread = load i1*, i1** %[[dslot]]
+; CHECK-NOT: __kmpc_dispatch
+; CHECK: incinvertomp.dispatch.cond:
+; CHECK-NEXT: %[[chunk:.+]] = add nsw i64 %"iv'ac.0", -1
+; CHECK-NEXT: %[[lbp:.+]] = getelementptr inbounds i64, i64* %_thread, i64 %[[chunk]]
+; CHECK-NEXT: %[[lb:.+]] = load i64, i64* %[[lbp]]
+; CHECK-NEXT: %[[ubp:.+]] = getelementptr inbounds i64, i64* %_thread{{[0-9]+}}, i64 %[[chunk]]
+; CHECK-NEXT: %[[ub:.+]] = load i64, i64* %[[ubp]]
@@ -0,0 +1,154 @@
+; RUN: if [ %llvmver -ge 9 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-omp-fuse-reverse -mem2reg -instsimplify -adce -loop-deletion -correlated-propagation -simplifycfg -adce -simplifycfg -S | FileCheck %s; fi
+
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.ident_t = type { i32, i32, i32, i32, i8* }
+
+@0 = private unnamed_addr constant [23 x i8] c";unknown;unknown;0;0;;\00", align 1
+@1 = private unnamed_addr constant %struct.ident_t { i32 0, i32 514, i32 0, i32 0, i8* getelementptr inbounds ([23 x i8], [23 x i8]* @0, i32 0, i32 0) }, align 8
+@2 = private unnamed_addr constant %struct.ident_t { i32 0, i32 2, i32 0, i32 0, i8* getelementptr inbounds ([23 x i8], [23 x i8]* @0, i32 0, i32 0) }, align 8
+
+define void @main(double* %x, double* %dx, i64 %n) {
+entry:
+  call void (i8*, ...) @__enzyme_autodiff(i8* bitcast (void (double*, i64)* @f to i8*), double* %x, double* %dx, i64 %n)
+  ret void
+}
+
+declare void @__enzyme_autodiff(i8*, ...)
+
+; Two parallel regions, whose reverse runs in one team of threads
+define internal void @f(double* %e_new, i64 %length) {
+entry:
+  tail call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* nonnull @2, i32 2, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, i64, double*)* @.omp_outlined. to void (i32*, i32*, ...)*), i64 %length, double* %e_new)
+  tail call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* nonnull @2, i32 2, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, i64, double*)* @.omp_outlined.2 to void (i32*, i32*, ...)*), i64 %length, double* %e_new)
+  ret void
+}
+
+define internal void @.omp_outlined.(i32* noalias nocapture readonly %.global_tid., i32* noalias nocapture readnone %.bound_tid., i64 %length, double* nocapture nonnull align 8 dereferenceable(8) %tmp) {
+entry:
+  %.omp.lb = alloca i64, align 8
+  %.omp.ub = alloca i64, align 8
+  %.omp.stride = alloca i64, align 8
+  %.omp.is_last = alloca i32, align 4
+  %sub4 = add i64 %length, -1
+  %cmp.not = icmp eq i64 %length, 0
+  br i1 %cmp.not, label %omp.precond.end, label %omp.precond.then
+
+omp.precond.then:                                 ; preds = %entry
+  %0 = bitcast i64* %.omp.lb to i8*
+  store i64 0, i64* %.omp.lb, align 8
+  %1 = bitcast i64* %.omp.ub to i8*
+  store i64 %sub4, i64* %.omp.ub, align 8
+  %2 = bitcast i64* %.omp.stride to i8*
+  store i64 1, i64* %.omp.stride, align 8
+  %3 = bitcast i32* %.omp.is_last to i8*
+  store i32 0, i32* %.omp.is_last, align 4
+  %4 = load i32, i32* %.global_tid., align 4
+  call void @__kmpc_for_static_init_8u(%struct.ident_t* nonnull @1, i32 %4, i32 34, i32* nonnull %.omp.is_last, i64* nonnull %.omp.lb, i64* nonnull %.omp.ub, i64* nonnull %.omp.stride, i64 1, i64 1)
+  %5 = load i64, i64* %.omp.ub, align 8
+  %cmp6 = icmp ugt i64 %5, %sub4
+  %cond = select i1 %cmp6, i64 %sub4, i64 %5
+  store i64 %cond, i64* %.omp.ub, align 8
+  %6 = load i64, i64* %.omp.lb, align 8
+  %add29 = add i64 %cond, 1
+  %cmp730 = icmp ult i64 %6, %add29
+  br i1 %cmp730, label %omp.inner.for.body, label %omp.loop.exit
+
+omp.inner.for.body:                               ; preds = %omp.precond.then, %omp.inner.for.body
+  %.omp.iv.031 = phi i64 [ %add11, %omp.inner.for.body ], [ %6, %omp.precond.then ]
+  %arrayidx = getelementptr inbounds double, double* %tmp, i64 %.omp.iv.031
+  %7 = load double, double* %arrayidx, align 8
+  %call = call double @sqrt(double %7)
+  store double %call, double* %arrayidx, align 8
+  %add11 = add nuw i64 %.omp.iv.031, 1
+  %8 = load i64, i64* %.omp.ub, align 8
+  %add = add i64 %8, 1
+  %cmp7 = icmp ult i64 %add11, %add
+  br i1 %cmp7, label %omp.inner.for.body, label %omp.loop.exit
+
+omp.loop.exit:                                    ; preds = %omp.inner.for.body, %omp.precond.then
+  call void @__kmpc_for_static_fini(%struct.ident_t* nonnull @1, i32 %4)
+  br label %omp.precond.end
+
+omp.precond.end:                                  ; preds = %omp.loop.exit, %entry
+  ret void
+}
+
+define internal void @.omp_outlined.2(i32* noalias nocapture readonly %.global_tid., i32* noalias nocapture readnone %.bound_tid., i64 %length, double* nocapture nonnull align 8 dereferenceable(8) %tmp) {
+entry:
+  %.omp.lb = alloca i64, align 8
+  %.omp.ub = alloca i64, align 8
+  %.omp.stride = alloca i64, align 8
+  %.omp.is_last = alloca i32, align 4
+  %sub4 = add i64 %length, -1
+  %cmp.not = icmp eq i64 %length, 0
+  br i1 %cmp.not, label %omp.precond.end, label %omp.precond.then
+
+omp.precond.then:                                 ; preds = %entry
+  %0 = bitcast i64* %.omp.lb to i8*
+  store i64 0, i64* %.omp.lb, align 8
+  %1 = bitcast i64* %.omp.ub to i8*
+  store i64 %sub4, i64* %.omp.ub, align 8
+  %2 = bitcast i64* %.omp.stride to i8*
+  store i64 1, i64* %.omp.stride, align 8
+  %3 = bitcast i32* %.omp.is_last to i8*
+  store i32 0, i32* %.omp.is_last, align 4
+  %4 = load i32, i32* %.global_tid., align 4
+  call void @__kmpc_for_static_init_8u(%struct.ident_t* nonnull @1, i32 %4, i32 34, i32* nonnull %.omp.is_last, i64* nonnull %.omp.lb, i64* nonnull %.omp.ub, i64* nonnull %.omp.stride, i64 1, i64 1)
+  %5 = load i64, i64* %.omp.ub, align 8
+  %cmp6 = icmp ugt i64 %5, %sub4
+  %cond = select i1 %cmp6, i64 %sub4, i64 %5
+  store i64 %cond, i64* %.omp.ub, align 8
+  %6 = load i64, i64* %.omp.lb, align 8
+  %add29 = add i64 %cond, 1
+  %cmp730 = icmp ult i64 %6, %add29
+  br i1 %cmp730, label %omp.inner.for.body, label %omp.loop.exit
+
+omp.inner.for.body:                               ; preds = %omp.precond.then, %omp.inner.for.body
+  %.omp.iv.031 = phi i64 [ %add11, %omp.inner.for.body ], [ %6, %omp.precond.then ]
+  %arrayidx = getelementptr inbounds double, double* %tmp, i64 %.omp.iv.031
+  %7 = load double, double* %arrayidx, align 8
+  %sq = fmul double %7, %7
+  %call = fmul double %sq, %7
+  store double %call, double* %arrayidx, align 8
+  %add11 = add nuw i64 %.omp.iv.031, 1
+  %8 = load i64, i64* %.omp.ub, align 8
+  %add = add i64 %8, 1
+  %cmp7 = icmp ult i64 %add11, %add
+  br i1 %cmp7, label %omp.inner.for.body, label %omp.loop.exit
+
+omp.loop.exit:                                    ; preds = %omp.inner.for.body, %omp.precond.then
+  call void @__kmpc_for_static_fini(%struct.ident_t* nonnull @1, i32 %4)
+  br label %omp.precond.end
+
+omp.precond.end:                                  ; preds = %omp.loop.exit, %entry
+  ret void
+}
+
+declare void @__kmpc_for_static_init_8u(%struct.ident_t*, i32, i32, i32*, i64*, i64*, i64*, i64, i64)
+declare void @__kmpc_for_static_fini(%struct.ident_t*, i32)
+declare double @sqrt(double)
+declare !callback !11 void @__kmpc_fork_call(%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...)
+
+!11 = !{!12}
+!12 = !{i64 2, i64 -1, i64 -1, i1 true}
+
+; CHECK: define internal void @diffef(double* %e_new, double* %"e_new'", i64 %length)
+; CHECK: @__kmpc_fork_call(%struct.ident_t* @2, i32 4, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, i64, double*, double*, double**)* @augmented_.omp_outlined..2 to void (i32*, i32*, ...)*)
+; CHECK: @__kmpc_fork_call(%struct.ident_t* @2, i32 4, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, i64, double*, double*, double**)* @augmented_.omp_outlined.2.1 to void (i32*, i32*, ...)*)
+; CHECK-NEXT: store double* %[[tape2:.+]], double** %[[arg2:.+]], align 8
+; CHECK-NEXT: store double* %[[tape1:.+]], double** %[[arg1:.+]], align 8
+; CHECK-NEXT: call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* @2, i32 8, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, i64, double*, double*, double**, i64, double*, double*, double**)* @"diffe.omp_outlined.2#fused" to void (i32*, i32*, ...)*), i64 %length, double* %e_new, double* %"e_new'", double** nonnull %[[arg2]], i64 %length, double* %e_new, double* %"e_new'", double** nonnull %[[arg1]])
+; CHECK-NEXT: tail call void @free(
+; CHECK-NEXT: tail call void @free(
+; CHECK-NEXT: ret void
+
+; CHECK: define internal void @"diffe.omp_outlined.2#fused"(i32* %0, i32* %1, i64 %2, double* %3, double* %4, double** %5, i64 %6, double* %7, double* %8, double** %9)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   call void @diffe.omp_outlined.2(i32* %0, i32* %1, i64 %2, double* %3, double* %4, double** %5)
+; CHECK-NEXT:   %gtid = load i32, i32* %0, align 4
+; CHECK-NEXT:   call void @__kmpc_barrier(%struct.ident_t* @2, i32 %gtid)
+; CHECK-NEXT:   call void @diffe.omp_outlined.(i32* %0, i32* %1, i64 %6, double* %7, double* %8, double** %9)
+; CHECK-NEXT:   ret void
+; CHECK-NEXT: }
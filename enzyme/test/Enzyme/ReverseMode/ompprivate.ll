@@ -0,0 +1,145 @@
+; RUN: if [ %llvmver -ge 9 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-omp-private-shadow -mem2reg -instsimplify -adce -simplifycfg -S | FileCheck %s; fi
+
+source_filename = "lulesh.cc"
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.ident_t = type { i32, i32, i32, i32, i8* }
+
+@0 = private unnamed_addr constant [23 x i8] c";unknown;unknown;0;0;;\00", align 1
+@1 = private unnamed_addr constant %struct.ident_t { i32 0, i32 514, i32 0, i32 0, i8* getelementptr inbounds ([23 x i8], [23 x i8]* @0, i32 0, i32 0) }, align 8
+@2 = private unnamed_addr constant %struct.ident_t { i32 0, i32 2, i32 0, i32 0, i8* getelementptr inbounds ([23 x i8], [23 x i8]* @0, i32 0, i32 0) }, align 8
+
+; Function Attrs: norecurse nounwind uwtable mustprogress
+define dso_local i32 @main(i32 %argc, i8** nocapture readnone %argv) local_unnamed_addr #0 {
+entry:
+  %data = alloca double, align 8
+  %d_data = alloca double, align 8
+  call void @_Z17__enzyme_autodiffPvS_S_m(i8* bitcast (void (double*, double*)* @_ZL16LagrangeLeapFrogPdm to i8*), double* %data, double* %d_data, double* %data, double* %d_data)
+  ret i32 0
+}
+
+declare dso_local void @_Z17__enzyme_autodiffPvS_S_m(i8*, double*, double*, double*, double*)
+
+; Function Attrs: inlinehint nounwind uwtable mustprogress
+define internal void @_ZL16LagrangeLeapFrogPdm(double* nocapture readonly noalias %e_new, double* noalias nocapture %out) #3 {
+entry:
+  tail call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* nonnull @2, i32 2, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, double*, double*)* @.omp_outlined. to void (i32*, i32*, ...)*), double* %e_new, double* %out)
+  ret void
+}
+
+
+declare i64 @omp_get_thread_num()
+
+declare void @julia.write_barrier(double* nocapture) readnone
+
+; Function Attrs: norecurse nounwind uwtable
+define internal void @.omp_outlined.(i32* noalias nocapture readonly %.global_tid., i32* noalias nocapture readnone %.bound_tid., double* readonly nocapture noalias %x, double* noalias nocapture %out) #4 {
+entry:
+  %m = alloca double, align 16
+  ; A fake barrier here is added to prevent %m from being mem2reg'd away
+  call void @julia.write_barrier(double* %m)
+  %prev = load double, double* %x, align 8
+  store double %prev, double* %m, align 8
+  %t = call i64 @omp_get_thread_num()
+  %gep = getelementptr inbounds double, double* %out, i64 %t
+  %mload = load double, double* %m, align 8
+  store double %mload, double* %gep, align 8
+  ret void
+}
+
+; Function Attrs: nounwind
+declare !callback !11 void @__kmpc_fork_call(%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) local_unnamed_addr #5
+
+attributes #0 = { norecurse nounwind uwtable }
+attributes #1 = { argmemonly }
+
+!llvm.module.flags = !{!0, !1}
+!llvm.ident = !{!2}
+!nvvm.annotations = !{}
+
+!0 = !{i32 1, !"wchar_size", i32 4}
+!1 = !{i32 7, !"uwtable", i32 1}
+!2 = !{!"clang version 13.0.0 (git@github.com:llvm/llvm-project 619bfe8bd23f76b22f0a53fedafbfc8c97a15f12)"}
+!3 = !{!4, !4, i64 0}
+!4 = !{!"long", !5, i64 0}
+!5 = !{!"omnipotent char", !6, i64 0}
+!6 = !{!"Simple C++ TBAA"}
+!7 = !{!8, !8, i64 0}
+!8 = !{!"int", !5, i64 0}
+!9 = !{!10, !10, i64 0}
+!10 = !{!"double", !5, i64 0}
+!11 = !{!12}
+!12 = !{i64 2, i64 -1, i64 -1, i1 true}
+
+; CHECK: define internal void @diffe_ZL16LagrangeLeapFrogPdm(double* noalias nocapture readonly %e_new, double* nocapture %"e_new'", double* noalias nocapture %out, double* nocapture %"out'")
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* @2, i32 4, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, double*, double*, double*, double*)* @augmented_.omp_outlined. to void (i32*, i32*, ...)*), double* %e_new, double* %"e_new'", double* %out, double* %"out'")
+; CHECK-NEXT:   %[[buf:.+]] = tail call noalias nonnull dereferenceable(64) dereferenceable_or_null(64) i8* @malloc(i64 64)
+; CHECK-NEXT:   %[[hdr:.+]] = bitcast i8* %[[buf]] to double**
+; CHECK-NEXT:   store double* %"e_new'", double** %[[hdr]], align 8
+; CHECK-NEXT:   %[[sbp:.+]] = getelementptr inbounds i8, i8* %[[buf]], i64 8
+; CHECK-NEXT:   %[[sbpc:.+]] = bitcast i8* %[[sbp]] to i64*
+; CHECK-NEXT:   store i64 64, i64* %[[sbpc]], align 8
+; CHECK-NEXT:   %[[endp:.+]] = getelementptr inbounds i8, i8* %[[buf]], i64 16
+; CHECK-NEXT:   %[[endpc:.+]] = bitcast i8* %[[endp]] to i64*
+; CHECK-NEXT:   store i64 1, i64* %[[endpc]], align 8
+; CHECK-NEXT:   %[[priv:.+]] = bitcast i8* %[[buf]] to double*
+; CHECK-NEXT:   call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* @2, i32 4, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, double*, double*, double*, double*)* @diffe.omp_outlined._private to void (i32*, i32*, ...)*), double* %e_new, double* %[[priv]], double* %out, double* %"out'")
+; CHECK-NEXT:   tail call void @free(i8* nonnull %[[buf]])
+; CHECK-NEXT:   ret void
+; CHECK-NEXT: }
+
+; The slots are sized by the team the region actually runs with
+; CHECK: define internal void @diffe.omp_outlined._private(i32* noalias nocapture readonly %.global_tid., i32* noalias nocapture readnone %.bound_tid., double* noalias nocapture readonly %x, double* nocapture %"x'", double* noalias nocapture %out, double* nocapture %"out'")
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %"m'ai" = alloca double, i64 1, align 16
+; CHECK-NEXT:   %tid = call i32 bitcast (i64 ()* @omp_get_thread_num to i32 ()*)()
+; CHECK-NEXT:   %nthreads = call i32 @omp_get_num_threads()
+; CHECK-NEXT:   %master = icmp eq i32 %tid, 0
+; CHECK-NEXT:   %private_buf = bitcast double* %"x'" to i8*
+; CHECK-NEXT:   %[[hdr:.+]] = bitcast i8* %private_buf to double**
+; CHECK-NEXT:   %shared_shadow = load double*, double** %[[hdr]], align 8
+; CHECK-NEXT:   %[[sbp:.+]] = getelementptr inbounds i8, i8* %private_buf, i64 8
+; CHECK-NEXT:   %[[sbpc:.+]] = bitcast i8* %[[sbp]] to i64*
+; CHECK-NEXT:   %slot_bytes = load i64, i64* %[[sbpc]], align 8
+; CHECK-NEXT:   %[[endp:.+]] = getelementptr inbounds i8, i8* %private_buf, i64 16
+; CHECK-NEXT:   %[[endpc:.+]] = bitcast i8* %[[endp]] to i64*
+; CHECK-NEXT:   %footprint_end = load i64, i64* %[[endpc]], align 8
+; CHECK-NEXT:   br i1 %master, label %omp.private.alloc, label %omp.private.ready
+
+; CHECK: omp.private.alloc:
+; CHECK-NEXT:   %[[nt64:.+]] = zext i32 %nthreads to i64
+; CHECK-NEXT:   %[[size:.+]] = mul nuw nsw i64 %[[nt64]], %slot_bytes
+; CHECK-NEXT:   %[[slots:.+]] = tail call noalias nonnull i8* @malloc(i64 %[[size]])
+; CHECK-NEXT:   call void @llvm.memset.p0i8.i64(i8* %[[slots]], i8 0, i64 %[[size]], i1 false)
+; CHECK-NEXT:   %[[slotsp:.+]] = getelementptr inbounds i8, i8* %private_buf, i64 24
+; CHECK-NEXT:   %[[slotspc:.+]] = bitcast i8* %[[slotsp]] to i8**
+; CHECK-NEXT:   store i8* %[[slots]], i8** %[[slotspc]], align 8
+; CHECK-NEXT:   br label %omp.private.ready
+
+; CHECK: omp.private.ready:
+; CHECK-NEXT:   %gtid = load i32, i32* %.global_tid., align 4
+; CHECK-NEXT:   call void @__kmpc_barrier(%struct.ident_t* @2, i32 %gtid)
+; CHECK-NEXT:   %[[slotsp:.+]] = getelementptr inbounds i8, i8* %private_buf, i64 24
+; CHECK-NEXT:   %[[slotspc:.+]] = bitcast i8* %[[slotsp]] to i8**
+; CHECK-NEXT:   %private_slots = load i8*, i8** %[[slotspc]], align 8
+; CHECK-NEXT:   %[[tid64:.+]] = zext i32 %tid to i64
+; CHECK-NEXT:   %[[off:.+]] = mul nuw nsw i64 %[[tid64]], %slot_bytes
+; CHECK-NEXT:   %[[slot:.+]] = getelementptr inbounds i8, i8* %private_slots, i64 %[[off]]
+; CHECK-NEXT:   %[[myslot:.+]] = bitcast i8* %[[slot]] to double*
+; CHECK-NOT:    atomicrmw
+; CHECK:        %[[old:.+]] = load double, double* %[[myslot]], align 8
+; CHECK-NEXT:   %[[new:.+]] = fadd double %[[old]], %[[dif:.+]]
+; CHECK-NEXT:   store double %[[new]], double* %[[myslot]], align 8
+; CHECK-NEXT:   br label %omp.private.tree
+
+; CHECK: omp.private.tree:
+
+; CHECK: omp.private.step:
+; CHECK-NEXT:   call void @__kmpc_barrier(%struct.ident_t* @2, i32 %gtid)
+
+; CHECK: omp.private.merge:
+; CHECK: omp.private.merge.end:
+; CHECK-NEXT:   tail call void @free(i8* nonnull %private_slots)
+; CHECK:        atomicrmw fadd double* %{{.+}}, double %{{.+}} monotonic
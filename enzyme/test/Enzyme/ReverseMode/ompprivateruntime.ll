@@ -0,0 +1,117 @@
+; RUN: if [ %llvmver -ge 9 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-omp-private-shadow -mem2reg -instsimplify -adce -simplifycfg -S | FileCheck %s; fi
+
+source_filename = "ompprivateruntime.c"
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.ident_t = type { i32, i32, i32, i32, i8* }
+
+@0 = private unnamed_addr constant [23 x i8] c";unknown;unknown;0;0;;\00", align 1
+@1 = private unnamed_addr constant %struct.ident_t { i32 0, i32 2, i32 0, i32 0, i8* getelementptr inbounds ([23 x i8], [23 x i8]* @0, i32 0, i32 0) }, align 8
+
+define void @f(double* %x, i64 %n, double* %out) {
+entry:
+  tail call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* nonnull @1, i32 3, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, double*, i64, double*)* @.omp_outlined. to void (i32*, i32*, ...)*), double* %x, i64 %n, double* %out)
+  ret void
+}
+
+define internal void @.omp_outlined.(i32* noalias nocapture readonly %.global_tid., i32* noalias nocapture readnone %.bound_tid., double* noalias nocapture readonly %x, i64 %n, double* noalias nocapture %out) {
+entry:
+  %t = call i32 @omp_get_thread_num()
+  %t64 = sext i32 %t to i64
+  %tf = sitofp i32 %t to double
+  %cmp0 = icmp sgt i64 %n, 0
+  br i1 %cmp0, label %loop, label %exit
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %sum = phi double [ 0.0, %entry ], [ %sum.next, %loop ]
+  %p = getelementptr inbounds double, double* %x, i64 %i
+  %v = load double, double* %p, align 8
+  %m = fmul double %v, %tf
+  %sum.next = fadd double %sum, %m
+  %i.next = add nuw nsw i64 %i, 1
+  %c = icmp eq i64 %i.next, %n
+  br i1 %c, label %exit, label %loop
+
+exit:
+  %res = phi double [ 0.0, %entry ], [ %sum.next, %loop ]
+  %o = getelementptr inbounds double, double* %out, i64 %t64
+  store double %res, double* %o, align 8
+  ret void
+}
+
+declare i32 @omp_get_thread_num()
+
+declare !callback !0 void @__kmpc_fork_call(%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...)
+
+define void @df(double* %x, double* %dx, i64 %n, double* %out, double* %dout) {
+entry:
+  call void (...) @__enzyme_autodiff(void (double*, i64, double*)* @f, double* %x, double* %dx, i64 %n, double* %out, double* %dout)
+  ret void
+}
+
+declare void @__enzyme_autodiff(...)
+
+!0 = !{!1}
+!1 = !{i64 2, i64 -1, i64 -1, i1 true}
+
+; The footprint of x' is bounded by the trip count, so its slots are sized when
+; the reverse region is forked. out' is indexed by the thread and stays shared.
+
+; CHECK: define internal void @diffef(double* %x, double* %"x'", i64 %n, double* %out, double* %"out'")
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* @1, i32 5, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, double*, double*, i64, double*, double*)* @augmented_.omp_outlined. to void (i32*, i32*, ...)*), double* %x, double* %"x'", i64 %n, double* %out, double* %"out'")
+; CHECK-NEXT:   %[[bytes:.+]] = mul i64 8, %n
+; CHECK-NEXT:   %[[pos:.+]] = icmp sgt i64 %[[bytes]], 0
+; CHECK-NEXT:   %[[end:.+]] = select i1 %[[pos]], i64 %[[bytes]], i64 0
+; CHECK-NEXT:   %[[pad:.+]] = add i64 %[[end]], 63
+; CHECK-NEXT:   %[[sb:.+]] = and i64 %[[pad]], -64
+; CHECK-NEXT:   %[[buf:.+]] = tail call noalias nonnull dereferenceable(64) dereferenceable_or_null(64) i8* @malloc(i64 64)
+; CHECK-NEXT:   %[[hdr:.+]] = bitcast i8* %[[buf]] to double**
+; CHECK-NEXT:   store double* %"x'", double** %[[hdr]], align 8
+; CHECK-NEXT:   %[[sbp:.+]] = getelementptr inbounds i8, i8* %[[buf]], i64 8
+; CHECK-NEXT:   %[[sbpc:.+]] = bitcast i8* %[[sbp]] to i64*
+; CHECK-NEXT:   store i64 %[[sb]], i64* %[[sbpc]], align 8
+; CHECK-NEXT:   %[[endp:.+]] = getelementptr inbounds i8, i8* %[[buf]], i64 16
+; CHECK-NEXT:   %[[endpc:.+]] = bitcast i8* %[[endp]] to i64*
+; CHECK-NEXT:   %[[round:.+]] = add i64 %[[end]], 7
+; CHECK-NEXT:   %[[idx:.+]] = udiv i64 %[[round]], 8
+; CHECK-NEXT:   store i64 %[[idx]], i64* %[[endpc]], align 8
+; CHECK-NEXT:   %[[priv:.+]] = bitcast i8* %[[buf]] to double*
+; CHECK-NEXT:   call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* @1, i32 5, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, double*, double*, i64, double*, double*)* @diffe.omp_outlined._private to void (i32*, i32*, ...)*), double* %x, double* %[[priv]], i64 %n, double* %out, double* %"out'")
+; CHECK-NEXT:   tail call void @free(i8* nonnull %[[buf]])
+; CHECK-NEXT:   ret void
+; CHECK-NEXT: }
+
+; CHECK: define internal void @diffe.omp_outlined._private(
+; CHECK:        %slot_bytes = load i64
+; CHECK:        %footprint_end = load i64
+; CHECK: omp.private.ready:
+; CHECK:        %private_slots = load i8*
+; CHECK-NEXT:   %[[tid64:.+]] = zext i32 %tid to i64
+; CHECK-NEXT:   %[[off:.+]] = mul nuw nsw i64 %[[tid64]], %slot_bytes
+; CHECK-NEXT:   %[[slot:.+]] = getelementptr inbounds i8, i8* %private_slots, i64 %[[off]]
+; CHECK-NEXT:   %[[myslot:.+]] = bitcast i8* %[[slot]] to double*
+
+; CHECK: invertloop:
+; CHECK:        %[[p:.+]] = getelementptr inbounds double, double* %[[myslot]], i64 %"iv'ac.0"
+; CHECK-NEXT:   %[[old:.+]] = load double, double* %[[p]], align 8
+; CHECK-NEXT:   %[[new:.+]] = fadd double %[[old]], %m0diffev
+; CHECK-NEXT:   store double %[[new]], double* %[[p]], align 8
+
+; CHECK: omp.private.add:
+; CHECK:        %[[any:.+]] = icmp ult i64 0, %footprint_end
+; CHECK-NEXT:   br i1 %[[any]], label %omp.private.sum, label %omp.private.latch
+
+; CHECK: omp.private.sum:
+; CHECK:        %[[next:.+]] = add nuw nsw i64 %idx, 1
+; CHECK-NEXT:   %[[done:.+]] = icmp eq i64 %[[next]], %footprint_end
+
+; CHECK: define internal i64 @diffe.omp_outlined._private_footprint(i32* %0, i32* %1, double* %2, double* %3, i64 %4, double* %5, double* %6)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %[[bytes:.+]] = mul i64 8, %4
+; CHECK-NEXT:   %[[pos:.+]] = icmp sgt i64 %[[bytes]], 0
+; CHECK-NEXT:   %[[end:.+]] = select i1 %[[pos]], i64 %[[bytes]], i64 0
+; CHECK-NEXT:   ret i64 %[[end]]
+; CHECK-NEXT: }
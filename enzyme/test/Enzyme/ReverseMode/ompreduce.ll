@@ -0,0 +1,157 @@
+; RUN: if [ %llvmver -ge 9 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -mem2reg -instsimplify -adce -loop-deletion -correlated-propagation -simplifycfg -adce -simplifycfg -S | FileCheck %s; fi
+
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.ident_t = type { i32, i32, i32, i32, i8* }
+
+@0 = private unnamed_addr constant [23 x i8] c";unknown;unknown;0;0;;\00", align 1
+@1 = private unnamed_addr constant %struct.ident_t { i32 0, i32 514, i32 0, i32 0, i8* getelementptr inbounds ([23 x i8], [23 x i8]* @0, i32 0, i32 0) }, align 8
+@2 = private unnamed_addr constant %struct.ident_t { i32 0, i32 2, i32 0, i32 0, i8* getelementptr inbounds ([23 x i8], [23 x i8]* @0, i32 0, i32 0) }, align 8
+@3 = private unnamed_addr constant %struct.ident_t { i32 0, i32 18, i32 0, i32 0, i8* getelementptr inbounds ([23 x i8], [23 x i8]* @0, i32 0, i32 0) }, align 8
+@.gomp_critical_user_.reduction.var = common global [8 x i32] zeroinitializer
+
+define void @main(double* %x, double* %dx, i64 %n, double* %out, double* %dout) {
+entry:
+  call void (i8*, ...) @__enzyme_autodiff(i8* bitcast (void (double*, i64, double*)* @f to i8*), double* %x, double* %dx, i64 %n, double* %out, double* %dout)
+  ret void
+}
+
+declare void @__enzyme_autodiff(i8*, ...)
+
+define internal void @f(double* %x, i64 %length, double* %out) {
+entry:
+  %sum = alloca double, align 8
+  store double 0.000000e+00, double* %sum, align 8
+  call void (%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...) @__kmpc_fork_call(%struct.ident_t* nonnull @2, i32 3, void (i32*, i32*, ...)* bitcast (void (i32*, i32*, i64, double*, double*)* @.omp_outlined. to void (i32*, i32*, ...)*), i64 %length, double* %x, double* nonnull %sum)
+  %s = load double, double* %sum, align 8
+  store double %s, double* %out, align 8
+  ret void
+}
+
+; parallel for reduction(+:sum)
+define internal void @.omp_outlined.(i32* noalias nocapture readonly %.global_tid., i32* noalias nocapture readnone %.bound_tid., i64 %length, double* nocapture readonly %x, double* nocapture nonnull align 8 dereferenceable(8) %sum) {
+entry:
+  %.omp.lb = alloca i64, align 8
+  %.omp.ub = alloca i64, align 8
+  %.omp.stride = alloca i64, align 8
+  %.omp.is_last = alloca i32, align 4
+  %priv = alloca double, align 8
+  %.omp.reduction.red_list = alloca [1 x i8*], align 8
+  store double 0.000000e+00, double* %priv, align 8
+  %sub4 = add i64 %length, -1
+  %cmp.not = icmp eq i64 %length, 0
+  br i1 %cmp.not, label %omp.precond.end, label %omp.precond.then
+
+omp.precond.then:
+  store i64 0, i64* %.omp.lb, align 8
+  store i64 %sub4, i64* %.omp.ub, align 8
+  store i64 1, i64* %.omp.stride, align 8
+  store i32 0, i32* %.omp.is_last, align 4
+  %0 = load i32, i32* %.global_tid., align 4
+  call void @__kmpc_for_static_init_8u(%struct.ident_t* nonnull @1, i32 %0, i32 34, i32* nonnull %.omp.is_last, i64* nonnull %.omp.lb, i64* nonnull %.omp.ub, i64* nonnull %.omp.stride, i64 1, i64 1)
+  %1 = load i64, i64* %.omp.ub, align 8
+  %cmp6 = icmp ugt i64 %1, %sub4
+  %cond = select i1 %cmp6, i64 %sub4, i64 %1
+  store i64 %cond, i64* %.omp.ub, align 8
+  %2 = load i64, i64* %.omp.lb, align 8
+  %add29 = add i64 %cond, 1
+  %cmp730 = icmp ult i64 %2, %add29
+  br i1 %cmp730, label %omp.inner.for.body, label %omp.loop.exit
+
+omp.inner.for.body:
+  %.omp.iv.031 = phi i64 [ %add11, %omp.inner.for.body ], [ %2, %omp.precond.then ]
+  %arrayidx = getelementptr inbounds double, double* %x, i64 %.omp.iv.031
+  %3 = load double, double* %arrayidx, align 8
+  %sq = fmul double %3, %3
+  %4 = load double, double* %priv, align 8
+  %add = fadd double %4, %sq
+  store double %add, double* %priv, align 8
+  %add11 = add nuw i64 %.omp.iv.031, 1
+  %cmp7 = icmp ult i64 %add11, %add29
+  br i1 %cmp7, label %omp.inner.for.body, label %omp.loop.exit
+
+omp.loop.exit:
+  call void @__kmpc_for_static_fini(%struct.ident_t* nonnull @1, i32 %0)
+  %5 = getelementptr inbounds [1 x i8*], [1 x i8*]* %.omp.reduction.red_list, i64 0, i64 0
+  %6 = bitcast double* %priv to i8*
+  store i8* %6, i8** %5, align 8
+  %7 = bitcast [1 x i8*]* %.omp.reduction.red_list to i8*
+  %8 = call i32 @__kmpc_reduce_nowait(%struct.ident_t* nonnull @3, i32 %0, i32 1, i64 8, i8* nonnull %7, void (i8*, i8*)* nonnull @.omp.reduction.reduction_func, [8 x i32]* nonnull @.gomp_critical_user_.reduction.var)
+  switch i32 %8, label %omp.precond.end [
+    i32 1, label %.omp.reduction.case1
+    i32 2, label %.omp.reduction.case2
+  ]
+
+.omp.reduction.case1:
+  %9 = load double, double* %sum, align 8
+  %10 = load double, double* %priv, align 8
+  %add12 = fadd double %9, %10
+  store double %add12, double* %sum, align 8
+  call void @__kmpc_end_reduce_nowait(%struct.ident_t* nonnull @3, i32 %0, [8 x i32]* nonnull @.gomp_critical_user_.reduction.var)
+  br label %omp.precond.end
+
+.omp.reduction.case2:
+  %11 = load double, double* %priv, align 8
+  %12 = atomicrmw fadd double* %sum, double %11 monotonic
+  br label %omp.precond.end
+
+omp.precond.end:
+  ret void
+}
+
+define internal void @.omp.reduction.reduction_func(i8* %0, i8* %1) {
+entry:
+  %2 = bitcast i8* %0 to double**
+  %3 = bitcast i8* %1 to double**
+  %4 = load double*, double** %2, align 8
+  %5 = load double*, double** %3, align 8
+  %6 = load double, double* %4, align 8
+  %7 = load double, double* %5, align 8
+  %add = fadd double %6, %7
+  store double %add, double* %4, align 8
+  ret void
+}
+
+declare void @__kmpc_for_static_init_8u(%struct.ident_t*, i32, i32, i32*, i64*, i64*, i64*, i64, i64)
+declare void @__kmpc_for_static_fini(%struct.ident_t*, i32)
+declare i32 @__kmpc_reduce_nowait(%struct.ident_t*, i32, i32, i64, i8*, void (i8*, i8*)*, [8 x i32]*)
+declare void @__kmpc_end_reduce_nowait(%struct.ident_t*, i32, [8 x i32]*)
+declare !callback !11 void @__kmpc_fork_call(%struct.ident_t*, i32, void (i32*, i32*, ...)*, ...)
+
+!11 = !{!12}
+!12 = !{i64 2, i64 -1, i64 -1, i1 true}
+
+; CHECK: define internal void @diffef(
+; CHECK-NOT: __kmpc_critical
+
+; CHECK: define internal void @__enzyme_omp_reduce_add(%struct.ident_t* %0, i32 %1, double* nocapture %2, double* nocapture %3)
+; CHECK: %[[list:.+]] = bitcast [1 x i8*]* %red_list to i8*
+; CHECK-NEXT: %[[method:.+]] = call i32 @__kmpc_reduce_nowait(%struct.ident_t* %0, i32 %1, i32 1, i64 8, i8* nonnull %[[list]], void (i8*, i8*)* @.omp.reduction.reduction_func, [8 x i32]* @.gomp_critical_user_.reduction.var)
+; CHECK-NEXT: switch i32 %[[method]], label %exit [
+; CHECK-NEXT: i32 1, label %combine
+; CHECK-NEXT: i32 2, label %atomic
+; CHECK-NEXT: ]
+; CHECK: atomic:
+; CHECK-NEXT: %[[aprivate:.+]] = load double, double* %2, align 8
+; CHECK-NEXT: %{{.+}} = atomicrmw fadd double* %3, double %[[aprivate]] monotonic, align 8
+
+; CHECK: define internal void @augmented_.omp_outlined..1(
+; CHECK-NOT: __kmpc_critical
+; CHECK: call void @__enzyme_omp_reduce_add(%struct.ident_t* @3, i32 %{{.+}}, double* nonnull %priv, double* nonnull %sum)
+; CHECK-NOT: __kmpc_critical
+; CHECK: ret void
+
+; CHECK: define internal void @diffe.omp_outlined.(
+; CHECK-NOT: __kmpc_critical
+; CHECK: call void @__kmpc_for_static_init_8u(
+; CHECK-NEXT: %[[rgtid:.+]] = load i32, i32* %.global_tid.
+; CHECK-NEXT: call void @__kmpc_barrier(%struct.ident_t* @3, i32 %[[rgtid]])
+; CHECK-NEXT: %[[dsum:.+]] = load double, double* %"sum'", align 8
+; CHECK-NEXT: %[[dpriv:.+]] = load double, double* %"priv'ai", align 8
+; CHECK-NEXT: %[[dpriv2:.+]] = fadd fast double %[[dpriv]], %[[dsum]]
+; CHECK-NEXT: store double %[[dpriv2]], double* %"priv'ai", align 8
+; CHECK-NOT: __kmpc_critical
+; CHECK-NOT: atomicrmw fadd double* %"priv'ai"
+; CHECK-NOT: atomicrmw fadd double* %"sum'"
+; CHECK: ret void
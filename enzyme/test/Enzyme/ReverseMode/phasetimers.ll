@@ -0,0 +1,28 @@
+; RUN: if [ %llvmver -ge 9 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-stats-json=%t -disable-output 2>&1 | FileCheck %s --check-prefix=NOREPORT --allow-empty && cat %t | FileCheck %s; fi
+; RUN: if [ %llvmver -ge 9 ]; then %opt < %s %loadEnzyme -enzyme -time-passes -disable-output 2>&1 | FileCheck %s --check-prefix=REPORT; fi
+
+define double @square(double %x) {
+entry:
+  %mul = fmul double %x, %x
+  ret double %mul
+}
+
+define double @dsquare(double %x) {
+entry:
+  %0 = tail call double (double (double)*, ...) @__enzyme_autodiff(double (double)* nonnull @square, double %x)
+  ret double %0
+}
+
+declare double @__enzyme_autodiff(double (double)*, ...)
+
+; NOREPORT-NOT: Enzyme phase timing
+
+; CHECK: {
+; CHECK-DAG: "time.enzyme.reverse.wall":
+; CHECK-DAG: "time.enzyme.type-analysis.wall":
+; CHECK-DAG: "time.enzyme.activity-analysis.wall":
+; CHECK-DAG: "time.enzyme.preprocess.wall":
+; CHECK: }
+
+; REPORT: Enzyme phase timing
+; REPORT: Gradient emission
@@ -0,0 +1,206 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-tape-arena -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-tape-arena -mem2reg -instsimplify -simplifycfg -S | FileCheck %s --check-prefix=ARENA
+
+%struct.W = type { double*, double* }
+%union.pthread_attr_t = type { i64, [48 x i8] }
+
+define internal i8* @body(i8* %p) {
+entry:
+  %w = bitcast i8* %p to %struct.W*
+  %xp = getelementptr inbounds %struct.W, %struct.W* %w, i64 0, i32 0
+  %x = load double*, double** %xp
+  %yp = getelementptr inbounds %struct.W, %struct.W* %w, i64 0, i32 1
+  %y = load double*, double** %yp
+  %a = load double, double* %x
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inc, %loop ]
+  %acc = phi double [ 1.000000e+00, %entry ], [ %mul, %loop ]
+  %mul = fmul double %acc, %a
+  %inc = add nuw nsw i64 %i, 1
+  %cmp = icmp eq i64 %inc, 4
+  br i1 %cmp, label %exit, label %loop
+
+exit:
+  store double %mul, double* %y
+  ret i8* null
+}
+
+define void @f(double* %x, double* %y, double* %z) {
+entry:
+  %t = alloca i64
+  %w = alloca %struct.W
+  %wx = getelementptr inbounds %struct.W, %struct.W* %w, i64 0, i32 0
+  store double* %x, double** %wx
+  %wy = getelementptr inbounds %struct.W, %struct.W* %w, i64 0, i32 1
+  store double* %y, double** %wy
+  %p = bitcast %struct.W* %w to i8*
+  %c = call i32 @pthread_create(i64* %t, %union.pthread_attr_t* null, i8* (i8*)* @body, i8* %p)
+  %a = load double, double* %x
+  %sq = fmul double %a, %a
+  store double %sq, double* %z
+  %l = load i64, i64* %t
+  %j = call i32 @pthread_join(i64 %l, i8** null)
+  ret void
+}
+
+declare i32 @pthread_create(i64*, %union.pthread_attr_t*, i8* (i8*)*, i8*)
+declare i32 @pthread_join(i64, i8**)
+
+define void @dsquare(double* %x, double* %dx, double* %y, double* %dy, double* %z, double* %dz) {
+entry:
+  call void (void (double*, double*, double*)*, ...) @__enzyme_autodiff(void (double*, double*, double*)* nonnull @f, double* %x, double* %dx, double* %y, double* %dy, double* %z, double* %dz)
+  ret void
+}
+
+declare void @__enzyme_autodiff(void (double*, double*, double*)*, ...)
+
+; ARENA-NOT: __enzyme_tape_arena
+
+; CHECK: define internal void @diffef(double* %x, double* %"x'", double* %y, double* %"y'", double* %z, double* %"z'")
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = alloca i8*
+; CHECK-NEXT:   %t = alloca i64
+; CHECK-NEXT:   %"w'ipa" = alloca %struct.W
+; CHECK-NEXT:   store %struct.W zeroinitializer, %struct.W* %"w'ipa"
+; CHECK-NEXT:   %w = alloca %struct.W
+; CHECK-NEXT:   %"wx'ipg" = getelementptr inbounds %struct.W, %struct.W* %"w'ipa", i64 0, i32 0
+; CHECK-NEXT:   %wx = getelementptr inbounds %struct.W, %struct.W* %w, i64 0, i32 0
+; CHECK-NEXT:   store double* %"x'", double** %"wx'ipg"
+; CHECK-NEXT:   store double* %x, double** %wx
+; CHECK-NEXT:   %"wy'ipg" = getelementptr inbounds %struct.W, %struct.W* %"w'ipa", i64 0, i32 1
+; CHECK-NEXT:   %wy = getelementptr inbounds %struct.W, %struct.W* %w, i64 0, i32 1
+; CHECK-NEXT:   store double* %"y'", double** %"wy'ipg"
+; CHECK-NEXT:   store double* %y, double** %wy
+; CHECK-NEXT:   %"p'ipc" = bitcast %struct.W* %"w'ipa" to i8*
+; CHECK-NEXT:   %p = bitcast %struct.W* %w to i8*
+; CHECK-NEXT:   %malloccall = tail call noalias nonnull dereferenceable(48) dereferenceable_or_null(48) i8* @malloc(i64 48)
+; CHECK-NEXT:   %thread_closure = bitcast i8* %malloccall to { i8*, i8*, i8*, i8*, i8*, i64 }*
+; CHECK-NEXT:   %1 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %thread_closure, i64 0, i32 0
+; CHECK-NEXT:   store i8* %p, i8** %1
+; CHECK-NEXT:   %2 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %thread_closure, i64 0, i32 1
+; CHECK-NEXT:   store i8* %"p'ipc", i8** %2
+; CHECK-NEXT:   %3 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %thread_closure, i64 0, i32 4
+; CHECK-NEXT:   store i8* bitcast (i8* (i8*)* @diffebody_thread to i8*), i8** %3
+; CHECK-NEXT:   %c = call i32 @pthread_create(i64* %t, %union.pthread_attr_t* null, i8* (i8*)* @augmented_body_thread, i8* %malloccall)
+; CHECK-NEXT:   %a = load double, double* %x
+; CHECK-NEXT:   %sq = fmul double %a, %a
+; CHECK-NEXT:   store double %sq, double* %z
+; CHECK-NEXT:   %l = load i64, i64* %t
+; CHECK-NEXT:   %j = call i32 @pthread_join(i64 %l, i8** %0)
+; CHECK-NEXT:   %4 = load i8*, i8** %0
+; CHECK-NEXT:   %5 = bitcast i8* %4 to { i8*, i8*, i8*, i8*, i8*, i64 }*
+; CHECK-NEXT:   %6 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %5, i64 0, i32 5
+; CHECK-NEXT:   %7 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %5, i64 0, i32 4
+; CHECK-NEXT:   %8 = load i8*, i8** %7
+; CHECK-NEXT:   %9 = bitcast i8* %8 to i8* (i8*)*
+; CHECK-NEXT:   %10 = call i32 bitcast (i32 (i64*, %union.pthread_attr_t*, i8* (i8*)*, i8*)* @pthread_create to i32 (i64*, i8*, i8* (i8*)*, i8*)*)(i64* %6, i8* null, i8* (i8*)* %9, i8* %4)
+; CHECK-NEXT:   %11 = load double, double* %"z'"
+; CHECK-NEXT:   store double 0.000000e+00, double* %"z'"
+; CHECK-NEXT:   %m0diffea = fmul fast double %11, %a
+; CHECK-NEXT:   %m1diffea = fmul fast double %11, %a
+; CHECK-NEXT:   %12 = fadd fast double %m0diffea, %m1diffea
+; CHECK-NEXT:   %13 = atomicrmw fadd double* %"x'", double %12 monotonic
+; CHECK-NEXT:   %14 = getelementptr inbounds { i8*, i8*, i8*, i8*, i8*, i64 }, { i8*, i8*, i8*, i8*, i8*, i64 }* %thread_closure, i64 0, i32 5
+; CHECK-NEXT:   %15 = load i64, i64* %14
+; CHECK-NEXT:   %16 = call i32 @pthread_join(i64 %15, i8** null)
+; CHECK-NEXT:   tail call void @free(i8* nonnull %malloccall)
+; CHECK-NEXT:   ret void
+; CHECK-NEXT: }
+
+; CHECK: define internal { i8*, i8* } @augmented_body(i8* %p, i8* %"p'")
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = alloca { i8*, i8* }
+; CHECK-NEXT:   %malloccall1 = tail call noalias nonnull dereferenceable(32) dereferenceable_or_null(32) i8* @malloc(i64 32)
+; CHECK-NEXT:   %tapemem = bitcast i8* %malloccall1 to { double*, double*, double, double* }*
+; CHECK-NEXT:   %1 = getelementptr inbounds { i8*, i8* }, { i8*, i8* }* %0, i32 0, i32 0
+; CHECK-NEXT:   store i8* %malloccall1, i8** %1
+; CHECK-NEXT:   %"w'ipc" = bitcast i8* %"p'" to %struct.W*
+; CHECK-NEXT:   %w = bitcast i8* %p to %struct.W*
+; CHECK-NEXT:   %"xp'ipg" = getelementptr inbounds %struct.W, %struct.W* %"w'ipc", i64 0, i32 0
+; CHECK-NEXT:   %xp = getelementptr inbounds %struct.W, %struct.W* %w, i64 0, i32 0
+; CHECK-NEXT:   %"x'ipl" = load double*, double** %"xp'ipg"
+; CHECK-NEXT:   %2 = getelementptr inbounds { double*, double*, double, double* }, { double*, double*, double, double* }* %tapemem, i32 0, i32 1
+; CHECK-NEXT:   store double* %"x'ipl", double** %2
+; CHECK-NEXT:   %x = load double*, double** %xp
+; CHECK-NEXT:   %"yp'ipg" = getelementptr inbounds %struct.W, %struct.W* %"w'ipc", i64 0, i32 1
+; CHECK-NEXT:   %yp = getelementptr inbounds %struct.W, %struct.W* %w, i64 0, i32 1
+; CHECK-NEXT:   %"y'ipl" = load double*, double** %"yp'ipg"
+; CHECK-NEXT:   %3 = getelementptr inbounds { double*, double*, double, double* }, { double*, double*, double, double* }* %tapemem, i32 0, i32 0
+; CHECK-NEXT:   store double* %"y'ipl", double** %3
+; CHECK-NEXT:   %y = load double*, double** %yp
+; CHECK-NEXT:   %a = load double, double* %x
+; CHECK-NEXT:   %4 = getelementptr inbounds { double*, double*, double, double* }, { double*, double*, double, double* }* %tapemem, i32 0, i32 2
+; CHECK-NEXT:   store double %a, double* %4
+; CHECK-NEXT:   %malloccall = tail call noalias nonnull dereferenceable(32) dereferenceable_or_null(32) i8* @malloc(i64 32)
+; CHECK-NEXT:   %acc_malloccache = bitcast i8* %malloccall to double*
+; CHECK-NEXT:   %5 = getelementptr inbounds { double*, double*, double, double* }, { double*, double*, double, double* }* %tapemem, i32 0, i32 3
+; CHECK-NEXT:   store double* %acc_malloccache, double** %5
+; CHECK-NEXT:   br label %loop
+
+; CHECK: loop:                                             ; preds = %loop, %entry
+; CHECK-NEXT:   %iv = phi i64 [ %iv.next, %loop ], [ 0, %entry ]
+; CHECK-NEXT:   %acc = phi double [ 1.000000e+00, %entry ], [ %mul, %loop ]
+; CHECK-NEXT:   %6 = getelementptr inbounds double, double* %acc_malloccache, i64 %iv
+; CHECK-NEXT:   store double %acc, double* %6
+; CHECK-NEXT:   %iv.next = add nuw nsw i64 %iv, 1
+; CHECK-NEXT:   %mul = fmul double %acc, %a
+; CHECK-NEXT:   %cmp = icmp eq i64 %iv.next, 4
+; CHECK-NEXT:   br i1 %cmp, label %exit, label %loop
+
+; CHECK: exit:                                             ; preds = %loop
+; CHECK-NEXT:   store double %mul, double* %y
+; CHECK-NEXT:   %7 = getelementptr inbounds { i8*, i8* }, { i8*, i8* }* %0, i32 0, i32 1
+; CHECK-NEXT:   store i8* null, i8** %7
+; CHECK-NEXT:   %8 = load { i8*, i8* }, { i8*, i8* }* %0
+; CHECK-NEXT:   ret { i8*, i8* } %8
+; CHECK-NEXT: }
+
+; CHECK: define internal void @diffebody(i8* %p, i8* %"p'", i8* %tapeArg)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = bitcast i8* %tapeArg to { double*, double*, double, double* }*
+; CHECK-NEXT:   %truetape = load { double*, double*, double, double* }, { double*, double*, double, double* }* %0
+; CHECK-NEXT:   tail call void @free(i8* nonnull %tapeArg)
+; CHECK-NEXT:   %1 = extractvalue { double*, double*, double, double* } %truetape, 3
+; CHECK-NEXT:   %"x'il_phi" = extractvalue { double*, double*, double, double* } %truetape, 1
+; CHECK-NEXT:   %"y'il_phi" = extractvalue { double*, double*, double, double* } %truetape, 0
+; CHECK-NEXT:   %a = extractvalue { double*, double*, double, double* } %truetape, 2
+; CHECK-NEXT:   br label %loop
+
+; CHECK: loop:                                             ; preds = %loop, %entry
+; CHECK-NEXT:   %iv = phi i64 [ %iv.next, %loop ], [ 0, %entry ]
+; CHECK-NEXT:   %iv.next = add nuw nsw i64 %iv, 1
+; CHECK-NEXT:   %cmp = icmp eq i64 %iv.next, 4
+; CHECK-NEXT:   br i1 %cmp, label %invertexit, label %loop
+
+; CHECK: invertentry:                                      ; preds = %invertloop
+; CHECK-NEXT:   %2 = atomicrmw fadd double* %"x'il_phi", double %7 monotonic
+; CHECK-NEXT:   %3 = bitcast double* %1 to i8*
+; CHECK-NEXT:   tail call void @free(i8* nonnull %3)
+; CHECK-NEXT:   ret void
+
+; CHECK: invertloop:                                       ; preds = %invertexit, %incinvertloop
+; CHECK-NEXT:   %"mul'de.0" = phi double [ %11, %invertexit ], [ %9, %incinvertloop ]
+; CHECK-NEXT:   %"a'de.0" = phi double [ 0.000000e+00, %invertexit ], [ %7, %incinvertloop ]
+; CHECK-NEXT:   %"iv'ac.0" = phi i64 [ 3, %invertexit ], [ %10, %incinvertloop ]
+; CHECK-NEXT:   %m0diffeacc = fmul fast double %"mul'de.0", %a
+; CHECK-NEXT:   %4 = extractvalue { double*, double*, double, double* } %truetape, 3
+; CHECK-NEXT:   %5 = getelementptr inbounds double, double* %4, i64 %"iv'ac.0"
+; CHECK-NEXT:   %6 = load double, double* %5
+; CHECK-NEXT:   %m1diffea = fmul fast double %"mul'de.0", %6
+; CHECK-NEXT:   %7 = fadd fast double %"a'de.0", %m1diffea
+; CHECK-NEXT:   %8 = icmp eq i64 %"iv'ac.0", 0
+; CHECK-NEXT:   %9 = select fast i1 %8, double 0.000000e+00, double %m0diffeacc
+; CHECK-NEXT:   br i1 %8, label %invertentry, label %incinvertloop
+
+; CHECK: incinvertloop:                                    ; preds = %invertloop
+; CHECK-NEXT:   %10 = add nsw i64 %"iv'ac.0", -1
+; CHECK-NEXT:   br label %invertloop
+
+; CHECK: invertexit:                                       ; preds = %loop
+; CHECK-NEXT:   %11 = load double, double* %"y'il_phi"
+; CHECK-NEXT:   store double 0.000000e+00, double* %"y'il_phi"
+; CHECK-NEXT:   br label %invertloop
+; CHECK-NEXT: }
+
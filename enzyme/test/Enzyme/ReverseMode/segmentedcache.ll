@@ -0,0 +1,68 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-segmented-cache -enzyme-cache-segment-iterations=16 -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+declare double @__enzyme_autodiff(i8*, ...)
+declare double @llvm.sin.f64(double)
+
+; dynamic loop running until the value drops below 1e-3
+define double @f(double %x) {
+entry:
+  br label %loop
+
+loop:
+  %v = phi double [ %x, %entry ], [ %v.next, %loop ]
+  %acc = phi double [ 0.0, %entry ], [ %acc.next, %loop ]
+  %sv = call double @llvm.sin.f64(double %v)
+  %acc.next = fadd double %acc, %sv
+  %m = fmul double %sv, %v
+  %v.next = fmul double %m, 0.5
+  %d = fcmp olt double %v.next, 1.000000e-03
+  br i1 %d, label %exit, label %loop
+
+exit:
+  ret double %acc.next
+}
+
+define double @df(double %x) {
+  %r = call double (i8*, ...) @__enzyme_autodiff(i8* bitcast (double (double)* @f to i8*), double %x)
+  ret double %r
+}
+
+; CHECK: define internal { double } @diffef(double %x, double %differeturn)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   br label %loop
+
+; CHECK: loop:
+; CHECK-NEXT:   %v_cache.0 = phi double** [ null, %entry ], [ %1, %loop ]
+; CHECK-NEXT:   %iv = phi i64 [ %iv.next, %loop ], [ 0, %entry ]
+; CHECK-NEXT:   %v = phi double [ %x, %entry ], [ %v.next, %loop ]
+; CHECK-NEXT:   %iv.next = add nuw nsw i64 %iv, 1
+; CHECK-NEXT:   %0 = bitcast double** %v_cache.0 to i8**
+; CHECK-NEXT:   %v_segmentedcache = call i8** @__enzyme_segmentedallocation(i8** %0, i64 %iv, i64 4, i64 128)
+; CHECK-NEXT:   %1 = bitcast i8** %v_segmentedcache to double**
+; CHECK-NEXT:   %2 = lshr i64 %iv, 4
+; CHECK-NEXT:   %3 = and i64 %iv, 15
+; CHECK-NEXT:   %4 = getelementptr inbounds double*, double** %1, i64 %2
+; CHECK-NEXT:   %5 = load double*, double** %4, align 8
+; CHECK-NEXT:   %6 = getelementptr inbounds double, double* %5, i64 %3
+; CHECK-NEXT:   store double %v, double* %6, align 8, !invariant.group !0
+
+; CHECK: invertentry:
+; CHECK-NEXT:   %7 = insertvalue { double } undef, double %22, 0
+; CHECK-NEXT:   call void @__enzyme_segmentedfree(i8** %v_segmentedcache)
+; CHECK-NEXT:   ret { double } %7
+
+; CHECK: invertloop:
+; CHECK:   %8 = lshr i64 %"iv'ac.0", 4
+; CHECK-NEXT:   %9 = and i64 %"iv'ac.0", 15
+; CHECK-NEXT:   %10 = getelementptr inbounds double*, double** %1, i64 %8
+; CHECK-NEXT:   %11 = load double*, double** %10, align 8
+; CHECK-NEXT:   %12 = getelementptr inbounds double, double* %11, i64 %9
+; CHECK-NEXT:   %13 = load double, double* %12, align 8, !invariant.group !0
+
+; CHECK: define internal i8** @__enzyme_segmentedallocation(i8** %dir, i64 %iter, i64 %shift, i64 %bytes)
+; CHECK: grow:
+; CHECK:   call i8* @realloc(i8* %{{.+}}, i64 %{{.+}})
+; CHECK: alloc:
+; CHECK:   %[[seg:.+]] = call i8* @malloc(i64 %bytes)
+
+; CHECK: define internal void @__enzyme_segmentedfree(i8** %dir)
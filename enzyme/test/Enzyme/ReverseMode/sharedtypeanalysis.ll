@@ -0,0 +1,93 @@
+; RUN: if [ %llvmver -lt 16 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -mem2reg -instsimplify -simplifycfg -S | FileCheck %s; fi
+; RUN: if [ %llvmver -lt 16 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-print-type -disable-output 2>&1 | FileCheck %s --check-prefix=TA; fi
+
+; @c1 is analyzed for @d1 before the __enzyme_autodiff call in its callee @h
+; is rewritten. The shared type analysis must then drop the analysis of @c1
+; along with that of @h, rather than reuse it for @d2.
+
+define double @sq(double %x) {
+entry:
+  %m = fmul double %x, %x
+  ret double %m
+}
+
+define double @c1(double %x, i64 %n) {
+entry:
+  %r = call i64 @h(i64 %n)
+  %f = sitofp i64 %r to double
+  %m = fmul double %x, %f
+  ret double %m
+}
+
+define double @d1(double %x) {
+entry:
+  %r = call double (...) @__enzyme_autodiff(double (double, i64)* @c1, double %x, i64 3)
+  ret double %r
+}
+
+define i64 @h(i64 %n) {
+entry:
+  %f = sitofp i64 %n to double
+  %d = call double (...) @__enzyme_autodiff(double (double)* @sq, double %f)
+  %i = fptosi double %d to i64
+  ret i64 %i
+}
+
+define double @d2(double %x) {
+entry:
+  %r = call double (...) @__enzyme_fwddiff(double (double, i64)* @c1, double %x, double 1.0, i64 3)
+  ret double %r
+}
+
+define double @c2(double %x) {
+entry:
+  %r = call i64 @h(i64 2)
+  %f = sitofp i64 %r to double
+  %m = fmul double %x, %f
+  ret double %m
+}
+
+define double @d3(double %x) {
+entry:
+  %r = call double (...) @__enzyme_autodiff(double (double)* @c2, double %x)
+  ret double %r
+}
+
+declare double @__enzyme_autodiff(...)
+declare double @__enzyme_fwddiff(...)
+
+; TA: analyzing function c1
+; TA: analyzing function sq
+; TA: analyzing function c1
+; TA: analyzing function c2
+
+; CHECK: define i64 @h(i64 %n)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %f = sitofp i64 %n to double
+; CHECK-NEXT:   %0 = call { double } @diffesq(double %f, double 1.000000e+00)
+
+; CHECK: define internal { double } @diffec1(double %x, i64 %n, double %differeturn)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %r = call i64 @h(i64 %n)
+; CHECK-NEXT:   %f = sitofp i64 %r to double
+; CHECK-NEXT:   %m0diffex = fmul fast double %differeturn, %f
+; CHECK-NEXT:   %0 = insertvalue { double } undef, double %m0diffex, 0
+; CHECK-NEXT:   ret { double } %0
+; CHECK-NEXT: }
+
+; CHECK: define internal double @fwddiffec1(double %x, double %"x'", i64 %n)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %r = call i64 @h(i64 %n)
+; CHECK-NEXT:   %f = sitofp i64 %r to double
+; CHECK-NEXT:   %0 = fmul fast double %"x'", %f
+; CHECK-NEXT:   ret double %0
+; CHECK-NEXT: }
+
+; CHECK: define internal { double } @diffec2(double %x, double %differeturn)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %r = call i64 @h(i64 2)
+; CHECK-NEXT:   %f = sitofp i64 %r to double
+; CHECK-NEXT:   %m0diffex = fmul fast double %differeturn, %f
+; CHECK-NEXT:   %0 = insertvalue { double } undef, double %m0diffex, 0
+; CHECK-NEXT:   ret { double } %0
+; CHECK-NEXT: }
@@ -0,0 +1,77 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-stack-cache-bytes=256 -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+declare void @__enzyme_autodiff(i8*, ...)
+declare double @llvm.sin.f64(double)
+
+; constant trip count loop updating x in place
+define void @f(double* %x) noinline {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %p = getelementptr inbounds double, double* %x, i64 %i
+  %a = load double, double* %p
+  %s = call double @llvm.sin.f64(double %a)
+  %b = fmul double %a, %s
+  store double %b, double* %p
+  %i.next = add nuw i64 %i, 1
+  %c = icmp eq i64 %i.next, 12
+  br i1 %c, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+define void @g(double* %x) {
+entry:
+  call void @f(double* %x)
+  %p = getelementptr inbounds double, double* %x, i64 1
+  %r = load double, double* %p
+  %sq = fmul double %r, %r
+  store double %sq, double* %x
+  ret void
+}
+
+define void @df(double* %x, double* %dx) {
+entry:
+  call void (i8*, ...) @__enzyme_autodiff(i8* bitcast (void (double*)* @f to i8*), double* %x, double* %dx)
+  ret void
+}
+
+define void @dg(double* %x, double* %dx) {
+entry:
+  call void (i8*, ...) @__enzyme_autodiff(i8* bitcast (void (double*)* @g to i8*), double* %x, double* %dx)
+  ret void
+}
+
+; CHECK: define internal void @diffef(double* %x, double* %"x'")
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %a_stackcache = alloca [12 x double], align 8
+; CHECK-NEXT:   %0 = bitcast [12 x double]* %a_stackcache to double*
+; CHECK:   %[[st:.+]] = getelementptr inbounds double, double* %0, i64 %iv
+; CHECK-NEXT:   store double %a, double* %[[st]], align 8, !invariant.group
+; CHECK:   %[[ld:.+]] = getelementptr inbounds double, double* %0, i64 %"iv'ac.0"
+; CHECK-NEXT:   %{{.+}} = load double, double* %[[ld]], align 8, !invariant.group
+; CHECK-NOT: call void @free
+; CHECK: }
+
+; CHECK: define internal void @diffeg(double* %x, double* %"x'")
+; CHECK:   %_augmented = call fast [12 x double] @augmented_f(double* %x, double* %"x'")
+; CHECK:   call void @diffef.2(double* %x, double* %"x'", [12 x double] %_augmented)
+
+; CHECK: define internal [12 x double] @augmented_f(double* %x, double* %"x'")
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %a_stackcache = alloca [12 x double], align 8
+; CHECK-NOT: call {{.*}} @malloc
+; CHECK: exit:
+; CHECK-NEXT:   %a_stackcache_tape = load [12 x double], [12 x double]* %a_stackcache, align 8
+; CHECK-NEXT:   ret [12 x double] %a_stackcache_tape
+
+; CHECK: define internal void @diffef.2(double* %x, double* %"x'", [12 x double] %tapeArg)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %tapeArg_stackcache = alloca [12 x double], align 8
+; CHECK-NEXT:   store [12 x double] %tapeArg, [12 x double]* %tapeArg_stackcache, align 8
+; CHECK-NEXT:   %0 = bitcast [12 x double]* %tapeArg_stackcache to double*
+; CHECK:   %[[ld:.+]] = getelementptr inbounds double, double* %0, i64 %"iv'ac.0"
+; CHECK-NEXT:   %{{.+}} = load double, double* %[[ld]], align 8, !invariant.group
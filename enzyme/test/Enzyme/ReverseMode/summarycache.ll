@@ -0,0 +1,89 @@
+; RUN: if [ %llvmver -lt 16 ]; then %opt < %s %loadEnzyme -enzyme-summary -S | %opt %loadEnzyme -enzyme -enzyme-preopt=false -S | FileCheck %s; fi
+
+; The embedded summary of @bump shows it only writes the counter it is
+; passed, which cannot alias %x, so the loads of %x in @sum are redone in the
+; reverse pass rather than cached. @clear_before writes before the pointer
+; it is passed, overwriting the element loaded in the same iteration of
+; @sumclear, so that load must be cached.
+
+define void @bump(i64* %cnt) {
+entry:
+  %c = load i64, i64* %cnt, align 8, !tbaa !0
+  %c1 = add i64 %c, 1
+  store i64 %c1, i64* %cnt, align 8, !tbaa !0
+  ret void
+}
+
+define void @clear_before(double* %p) {
+entry:
+  %q = getelementptr inbounds double, double* %p, i64 -1
+  store double 0.000000e+00, double* %q, align 8, !tbaa !4
+  ret void
+}
+
+define double @sum(double* %x, i64 %n) {
+entry:
+  %cnt = alloca i64, align 8
+  store i64 0, i64* %cnt, align 8, !tbaa !0
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inc, %loop ]
+  %acc = phi double [ 0.000000e+00, %entry ], [ %add, %loop ]
+  %p = getelementptr inbounds double, double* %x, i64 %i
+  %v = load double, double* %p, align 8, !tbaa !4
+  call void @bump(i64* %cnt)
+  %m = fmul double %v, %v
+  %add = fadd double %acc, %m
+  %inc = add nuw i64 %i, 1
+  %cmp = icmp eq i64 %inc, %n
+  br i1 %cmp, label %exit, label %loop
+
+exit:
+  ret double %add
+}
+
+define double @sumclear(double* %x, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inc, %loop ]
+  %acc = phi double [ 0.000000e+00, %entry ], [ %add, %loop ]
+  %p = getelementptr inbounds double, double* %x, i64 %i
+  %v = load double, double* %p, align 8, !tbaa !4
+  %next = getelementptr inbounds double, double* %p, i64 1
+  call void @clear_before(double* %next)
+  %m = fmul double %v, %v
+  %add = fadd double %acc, %m
+  %inc = add nuw i64 %i, 1
+  %cmp = icmp eq i64 %inc, %n
+  br i1 %cmp, label %exit, label %loop
+
+exit:
+  ret double %add
+}
+
+declare double @__enzyme_autodiff(...)
+
+define double @dsum(double* %x, double* %dx, i64 %n) {
+entry:
+  %r = call double (...) @__enzyme_autodiff(double (double*, i64)* @sum, double* %x, double* %dx, i64 %n)
+  %r2 = call double (...) @__enzyme_autodiff(double (double*, i64)* @sumclear, double* %x, double* %dx, i64 %n)
+  ret double %r
+}
+
+!0 = !{!1, !1, i64 0}
+!1 = !{!"long", !2, i64 0}
+!2 = !{!"omnipotent char", !3, i64 0}
+!3 = !{!"Simple C/C++ TBAA"}
+!4 = !{!5, !5, i64 0}
+!5 = !{!"double", !2, i64 0}
+
+; CHECK-LABEL: define internal void @diffesum(
+; CHECK-NOT: %v_cache
+; CHECK: %v_unwrap = load double, double* %p_unwrap
+; CHECK-LABEL: define internal void @diffesumclear(
+; CHECK: %v_cache = alloca double*
+; CHECK-NOT: %v_unwrap = load
+; CHECK-LABEL: define internal void @diffeclear_before(
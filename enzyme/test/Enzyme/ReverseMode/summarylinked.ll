@@ -0,0 +1,31 @@
+; RUN: if [ %llvmver -lt 16 ]; then %opt < %s %loadEnzyme -enzyme-summary -o %t.bc && llvm-link %t.bc %S/Inputs/summarylinked-lib.ll -S | %opt %loadEnzyme -enzyme -enzyme-preopt=false -S | FileCheck %s; fi
+
+; @ext is only declared when the summaries are derived and is defined once
+; the module is linked with its library. The summary of @caller does not
+; depend on whether @ext is defined, so it is kept after linking.
+
+define double @caller(double* %x) {
+entry:
+  %v = load double, double* %x, align 8, !tbaa !0
+  %r = call double @ext(double* %x)
+  %m = fmul double %v, %r
+  ret double %m
+}
+
+declare double @ext(double*)
+
+define void @test_derivative(double* %x, double* %dx) {
+entry:
+  %0 = tail call double (double (double*)*, ...) @__enzyme_autodiff(double (double*)* nonnull @caller, double* %x, double* %dx)
+  ret void
+}
+
+declare double @__enzyme_autodiff(double (double*)*, ...)
+
+!0 = !{!1, !1, i64 0}
+!1 = !{!"double", !2, i64 0}
+!2 = !{!"omnipotent char", !3, i64 0}
+!3 = !{!"Simple C++ TBAA"}
+
+; CHECK: define double @caller(double* %x) !enzyme_summary
+; CHECK: define double @ext(double* %x) {
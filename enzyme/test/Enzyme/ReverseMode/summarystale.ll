@@ -0,0 +1,30 @@
+; RUN: if [ %llvmver -lt 16 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -S | FileCheck %s; fi
+
+; The summary of @lib was derived from a different body, so it is dropped
+; rather than trusted.
+
+define double @lib(double* %x) !enzyme_summary !0 {
+entry:
+  %v = load double, double* %x, align 8
+  %m = fmul double %v, %v
+  ret double %m
+}
+
+define void @test_derivative(double* %x, double* %dx) {
+entry:
+  %0 = tail call double (double (double*)*, ...) @__enzyme_autodiff(double (double*)* nonnull @lib, double* %x, double* %dx)
+  ret void
+}
+
+declare double @__enzyme_autodiff(double (double*)*, ...)
+
+!0 = !{i64 1, !1, !3, !4, !5, i1 false}
+!1 = !{!2}
+!2 = !{!"Integer", i64 -1}
+!3 = !{!1}
+!4 = !{i1 true}
+!5 = !{i1 false}
+
+; CHECK: define double @lib(double* %x) {
+; CHECK: define internal void @diffelib(double* %x, double* %"x'", double %differeturn)
+; CHECK: %m0diffev = fmul fast double %{{[0-9]+}}, %v
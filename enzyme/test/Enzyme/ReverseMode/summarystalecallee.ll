@@ -0,0 +1,80 @@
+; RUN: if [ %llvmver -lt 16 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -S | FileCheck %s; fi
+
+; The summary of @caller was derived while @lib had a different body, so it
+; is dropped although the body of @caller itself is unchanged. The summary
+; of @keep, whose callee is unchanged, is kept. The summary of @tagged was
+; derived before its load carried TBAA, and that of @outer is dropped with
+; the stale summary of the external function it calls.
+
+define double @caller(double* %x) !enzyme_summary !0 {
+entry:
+  %r = call double @lib(double* %x)
+  ret double %r
+}
+
+define internal double @lib(double* %x) {
+entry:
+  %v = load double, double* %x, align 8
+  %m = fmul double %v, %v
+  ret double %m
+}
+
+define double @keep(double* %x) !enzyme_summary !6 {
+entry:
+  %r = call double @leaf(double* %x)
+  ret double %r
+}
+
+define internal double @leaf(double* %x) !enzyme_summary !7 {
+entry:
+  %v = load double, double* %x, align 8
+  ret double %v
+}
+
+define double @tagged(double* %x) !enzyme_summary !7 {
+entry:
+  %v = load double, double* %x, align 8, !tbaa !8
+  ret double %v
+}
+
+define double @outer(double* %x) !enzyme_summary !12 {
+entry:
+  %r = call double @inner(double* %x)
+  ret double %r
+}
+
+define double @inner(double* %x) !enzyme_summary !13 {
+entry:
+  %v = load double, double* %x, align 8
+  ret double %v
+}
+
+define void @test_derivative(double* %x, double* %dx) {
+entry:
+  %0 = tail call double (double (double*)*, ...) @__enzyme_autodiff(double (double*)* nonnull @caller, double* %x, double* %dx)
+  ret void
+}
+
+declare double @__enzyme_autodiff(double (double*)*, ...)
+
+!0 = !{i64 -71196177501314306, !1, !2, !5, !5, i1 false}
+!1 = !{}
+!2 = !{!3}
+!3 = !{!4}
+!4 = !{!"Pointer", i64 -1}
+!5 = !{i1 false}
+!6 = !{i64 7635329316384885875, !1, !2, !5, !5, i1 false}
+!7 = !{i64 8081608941239692009, !1, !2, !5, !5, i1 false}
+!8 = !{!9, !9, i64 0}
+!9 = !{!"double", !10, i64 0}
+!10 = !{!"omnipotent char", !11, i64 0}
+!11 = !{!"Simple C++ TBAA"}
+!12 = !{i64 7223669116784742143, !1, !2, !5, !5, i1 false}
+!13 = !{i64 1, !1, !2, !5, !5, i1 false}
+
+; CHECK: define double @caller(double* %x) {
+; CHECK: define double @keep(double* %x) !enzyme_summary
+; CHECK: define internal double @leaf(double* %x) !enzyme_summary
+; CHECK: define double @tagged(double* %x) {
+; CHECK: define double @outer(double* %x) {
+; CHECK: define double @inner(double* %x) {
@@ -0,0 +1,85 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-tape-arena -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+declare double @__enzyme_autodiff(i8*, ...)
+declare double @llvm.sin.f64(double)
+
+; static loop over n elements plus a dynamic loop until the value drops below 1
+define double @f(double* %x, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %sum = phi double [ 0.0, %entry ], [ %sum.next, %loop ]
+  %p = getelementptr inbounds double, double* %x, i64 %i
+  %a = load double, double* %p
+  store double 0.0, double* %p
+  %s = call double @llvm.sin.f64(double %a)
+  %sum.next = fadd double %sum, %s
+  %i.next = add nuw i64 %i, 1
+  %c = icmp eq i64 %i.next, %n
+  br i1 %c, label %dyn, label %loop
+
+dyn:
+  %v = phi double [ %sum.next, %loop ], [ %v.next, %dyn ]
+  %acc = phi double [ 0.0, %loop ], [ %acc.next, %dyn ]
+  %sv = call double @llvm.sin.f64(double %v)
+  %acc.next = fadd double %acc, %sv
+  %v.next = fmul double %v, 0.5
+  %d = fcmp olt double %v.next, 1.000000e-03
+  br i1 %d, label %exit, label %dyn
+
+exit:
+  ret double %acc.next
+}
+
+define void @df(double* %x, double* %dx, i64 %n) {
+  %r = call double (i8*, ...) @__enzyme_autodiff(i8* bitcast (double (double*, i64)* @f to i8*), double* %x, double* %dx, i64 %n)
+  ret void
+}
+
+; CHECK: define internal void @diffef(double* %x, double* %"x'", i64 %n, double %differeturn)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = add i64 %n, -1
+; CHECK-NEXT:   %1 = mul nuw nsw i64 8, %n
+; CHECK-NEXT:   %2 = call i8* @__enzyme_tape_arena_alloc(i64 %1)
+; CHECK-NEXT:   %a_malloccache = bitcast i8* %2 to double*
+
+; CHECK: grow.i:
+; CHECK:   %[[realloc:.+]] = call i8* @__enzyme_tape_arena_realloc(i8* %{{.+}}, i64 %{{.+}}, i64 %{{.+}})
+
+; CHECK: invertentry:
+; CHECK-NEXT:   call void @__enzyme_tape_arena_free(i8* %2)
+; CHECK-NEXT:   ret void
+
+; CHECK: invertdyn.preheader:
+; CHECK-NEXT:   call void @__enzyme_tape_arena_free(i8* %{{.+}})
+
+; CHECK: define internal noalias i8* @__enzyme_tape_arena_alloc(i64 %size)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %[[empty:.+]] = icmp eq i64 %size, 0
+; CHECK-NEXT:   %nonempty = select i1 %[[empty]], i64 1, i64 %size
+; CHECK-NEXT:   %[[pad:.+]] = add i64 %nonempty, 15
+; CHECK-NEXT:   %rounded = and i64 %[[pad]], -16
+; CHECK: grow:
+; CHECK:   %room = select i1 %{{.+}}, i64 %{{.+}}, i64 0
+; CHECK: chain:
+; CHECK-NEXT:   %newchunk = call i8* @malloc(i64 %{{.+}})
+; CHECK: heap:
+; CHECK-NEXT:   %{{.+}} = call i8* @malloc(i64 %nonempty)
+
+; CHECK: define internal void @__enzyme_tape_arena_free(i8* %ptr)
+; CHECK: check:
+; CHECK:   br i1 %{{.+}}, label %release, label %nextchunk
+; CHECK: heap:
+; CHECK-NEXT:   call void @free(i8* %ptr)
+; CHECK: release:
+; CHECK:   br i1 %{{.+}}, label %reset, label %exit
+; CHECK: freechunks:
+; CHECK:   call void @free(i8* %{{.+}})
+
+; CHECK: define internal i8* @__enzyme_tape_arena_realloc(i8* %ptr, i64 %oldsize, i64 %newsize)
+; CHECK: inplace:
+; CHECK: move:
+; CHECK:   call void @llvm.memcpy.p0i8.p0i8.i64(i8* %{{.+}}, i8* %ptr, i64 %oldsize, i1 false)
+; CHECK-NEXT:   call void @__enzyme_tape_arena_free(i8* %ptr)
@@ -0,0 +1,72 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-tape-arena -enzyme-tape-arena-limit=262144 -mem2reg -simplifycfg -S | %lli - | FileCheck %s
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-tape-arena -enzyme-tape-arena-limit=0 -mem2reg -simplifycfg -S | %lli - | FileCheck %s --check-prefix=NOLIMIT
+
+; The reverse pass leaves the caches of every gradient unfreed, so the arena
+; never resets. Past the limit its allocations fall back to malloc rather than
+; chaining ever more chunks.
+
+@__enzyme_tape_arena = linkonce_odr thread_local global { i8*, i64, i64, i64, i64, i64, i64 } zeroinitializer
+@.str = private unnamed_addr constant [27 x i8] c"held=%d live=%lld dx=%.3f\0A\00", align 1
+
+declare void @__enzyme_augmentfwd(void (double*, double*, i64)*, ...)
+declare i64 @__enzyme_augmentsize(void (double*, double*, i64)*, ...)
+declare void @__enzyme_reverse(void (double*, double*, i64)*, ...)
+declare double @llvm.sin.f64(double)
+declare i32 @printf(i8*, ...)
+
+define void @f(double* noalias %in, double* noalias %out, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %ip = getelementptr inbounds double, double* %in, i64 %i
+  %op = getelementptr inbounds double, double* %out, i64 %i
+  %a = load double, double* %ip
+  %s = call double @llvm.sin.f64(double %a)
+  store double %s, double* %op
+  %i.next = add nuw i64 %i, 1
+  %c = icmp eq i64 %i.next, %n
+  br i1 %c, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+define i32 @main() {
+entry:
+  %x = alloca [1024 x double]
+  %dx = alloca [1024 x double]
+  %y = alloca [1024 x double]
+  %dy = alloca [1024 x double]
+  %xp = getelementptr inbounds [1024 x double], [1024 x double]* %x, i64 0, i64 0
+  %dxp = getelementptr inbounds [1024 x double], [1024 x double]* %dx, i64 0, i64 0
+  %yp = getelementptr inbounds [1024 x double], [1024 x double]* %y, i64 0, i64 0
+  %dyp = getelementptr inbounds [1024 x double], [1024 x double]* %dy, i64 0, i64 0
+  %size = call i64 (void (double*, double*, i64)*, ...) @__enzyme_augmentsize(void (double*, double*, i64)* nonnull @f, metadata !"enzyme_dup", metadata !"enzyme_dup", metadata !"enzyme_const")
+  %cache = alloca i8, i64 %size, align 8
+  br label %loop
+
+loop:
+  %it = phi i32 [ 0, %entry ], [ %it.next, %loop ]
+  store double 0.0, double* %xp
+  store double 0.0, double* %dxp
+  store double 1.0, double* %dyp
+  call void (void (double*, double*, i64)*, ...) @__enzyme_augmentfwd(void (double*, double*, i64)* nonnull @f, metadata !"enzyme_allocated", i64 %size, metadata !"enzyme_tape", i8* %cache, double* %xp, double* %dxp, double* %yp, double* %dyp, i64 1024)
+  call void (void (double*, double*, i64)*, ...) @__enzyme_reverse(void (double*, double*, i64)* nonnull @f, metadata !"enzyme_allocated", i64 %size, metadata !"enzyme_nofree", metadata !"enzyme_tape", i8* %cache, double* %xp, double* %dxp, double* %yp, double* %dyp, i64 1024)
+  %it.next = add nuw i32 %it, 1
+  %c = icmp eq i32 %it.next, 200
+  br i1 %c, label %exit, label %loop
+
+exit:
+  %held = load i64, i64* getelementptr ({ i8*, i64, i64, i64, i64, i64, i64 }, { i8*, i64, i64, i64, i64, i64, i64 }* @__enzyme_tape_arena, i64 0, i32 6)
+  %capped = icmp ule i64 %held, 262144
+  %hz = zext i1 %capped to i32
+  %live = load i64, i64* getelementptr ({ i8*, i64, i64, i64, i64, i64, i64 }, { i8*, i64, i64, i64, i64, i64, i64 }* @__enzyme_tape_arena, i64 0, i32 3)
+  %d = load double, double* %dxp
+  call i32 (i8*, ...) @printf(i8* getelementptr ([27 x i8], [27 x i8]* @.str, i64 0, i64 0), i32 %hz, i64 %live, double %d)
+  ret i32 0
+}
+
+; CHECK: held=1 live={{[0-9]+}} dx=1.000
+; NOLIMIT: held=0 live=200 dx=1.000
@@ -0,0 +1,59 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-tape-pack-ints -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+declare double @__enzyme_autodiff(i8*, ...)
+
+define double @f(double* %x, i64* %idx, i64 %n) #0 {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %sum = phi double [ 0.0, %entry ], [ %sum.next, %loop ]
+  %ip = getelementptr inbounds i64, i64* %idx, i64 %i
+  %k = load i64, i64* %ip
+  %km = and i64 %k, 1023
+  store i64 0, i64* %ip
+  %p = getelementptr inbounds double, double* %x, i64 %km
+  %a = load double, double* %p
+  store double 0.0, double* %p
+  %m = fmul double %a, %a
+  %sum.next = fadd double %sum, %m
+  %i.next = add nuw i64 %i, 1
+  %c = icmp eq i64 %i.next, %n
+  br i1 %c, label %exit, label %loop
+
+exit:
+  ret double %sum.next
+}
+
+define void @df(double* %x, double* %dx, i64* %idx, i64 %n) {
+  %r = call double (i8*, ...) @__enzyme_autodiff(i8* bitcast (double (double*, i64*, i64)* @f to i8*), double* %x, double* %dx, i64* %idx, i64 %n)
+  ret void
+}
+attributes #0 = { "enzyme_tape_compress_fp"="float" }
+
+; CHECK: define internal void @diffef(double* %x, double* %"x'", i64* %idx, i64 %n, double %differeturn)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = add i64 %n, -1
+; CHECK-NEXT:   %mallocsize = mul nuw nsw i64 %n, 4
+; CHECK-NEXT:   %malloccall = tail call noalias nonnull i8* @malloc(i64 %mallocsize)
+; CHECK-NEXT:   %a_malloccache = bitcast i8* %malloccall to float*
+; CHECK-NEXT:   %mallocsize5 = mul nuw nsw i64 %n, 2
+; CHECK-NEXT:   %malloccall6 = tail call noalias nonnull i8* @malloc(i64 %mallocsize5)
+; CHECK-NEXT:   %km_malloccache = bitcast i8* %malloccall6 to i16*
+
+; CHECK: loop:
+; CHECK:   %[[aptr:.+]] = getelementptr inbounds float, float* %a_malloccache, i64 %iv
+; CHECK-NEXT:   %[[atrunc:.+]] = fptrunc double %a to float
+; CHECK-NEXT:   store float %[[atrunc]], float* %[[aptr]], align 4, !invariant.group
+; CHECK-NEXT:   %[[kptr:.+]] = getelementptr inbounds i16, i16* %km_malloccache, i64 %iv
+; CHECK-NEXT:   %[[ktrunc:.+]] = trunc i64 %km to i16
+; CHECK-NEXT:   store i16 %[[ktrunc]], i16* %[[kptr]], align 2, !invariant.group
+
+; CHECK: invertloop:
+; CHECK:   %[[aload:.+]] = load float, float* %{{.+}}, align 4, !invariant.group
+; CHECK-NEXT:   %[[aext:.+]] = fpext float %[[aload]] to double
+; CHECK-NEXT:   %m0diffea = fmul fast double %"sum.next'de.0", %[[aext]]
+; CHECK:   %[[kload:.+]] = load i16, i16* %{{.+}}, align 2, !invariant.group
+; CHECK-NEXT:   %[[kext:.+]] = sext i16 %[[kload]] to i64
+; CHECK-NEXT:   %"p'ipg_unwrap" = getelementptr inbounds double, double* %"x'", i64 %[[kext]]
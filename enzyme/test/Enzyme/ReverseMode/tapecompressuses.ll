@@ -0,0 +1,55 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-tape-compress-fp=bfloat16 -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+; RUN: if [ %llvmver -ge 9 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-tape-compress-fp=bfloat16 -pass-remarks-analysis=enzyme -disable-output 2>&1 | FileCheck %s --check-prefix=REMARK; fi
+
+; %a only feeds the derivative of %m, so it is cached as bfloat16. %b also
+; decides the select, whose condition is recomputed from the cached %b in the
+; reverse, so it is cached in full precision.
+
+declare double @__enzyme_autodiff(i8*, ...)
+
+define double @f(double* %x, double* %y, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %sum = phi double [ 0.0, %entry ], [ %sum.next, %loop ]
+  %p = getelementptr inbounds double, double* %x, i64 %i
+  %a = load double, double* %p
+  store double 0.0, double* %p
+  %q = getelementptr inbounds double, double* %y, i64 %i
+  %b = load double, double* %q
+  store double 0.0, double* %q
+  %m = fmul double %a, %b
+  %pos = fcmp ogt double %b, 0.0
+  %s = select i1 %pos, double %m, double 0.0
+  %sum.next = fadd double %sum, %s
+  %i.next = add nuw i64 %i, 1
+  %c = icmp eq i64 %i.next, %n
+  br i1 %c, label %exit, label %loop
+
+exit:
+  ret double %sum.next
+}
+
+define void @df(double* %x, double* %dx, double* %y, double* %dy, i64 %n) {
+  %r = call double (i8*, ...) @__enzyme_autodiff(i8* bitcast (double (double*, double*, i64)* @f to i8*), double* %x, double* %dx, double* %y, double* %dy, i64 %n)
+  ret void
+}
+
+; CHECK: define internal void @diffef(double* %x, double* %"x'", double* %y, double* %"y'", i64 %n, double %differeturn)
+; CHECK:   %b_malloccache = bitcast i8* %malloccall to double*
+; CHECK:   %a_malloccache = bitcast i8* %malloccall6 to i16*
+
+; CHECK: invertloop:
+; CHECK:   %[[bload:.+]] = load double, double* %{{.+}}, align 8, !invariant.group
+; CHECK-NEXT:   %pos_unwrap = fcmp ogt double %[[bload]], 0.000000e+00
+; CHECK:   %[[aload:.+]] = load i16, i16* %{{.+}}, align 2, !invariant.group
+; CHECK-NEXT:   %[[aext:.+]] = zext i16 %[[aload]] to i32
+; CHECK-NEXT:   %[[ashl:.+]] = shl i32 %[[aext]], 16
+; CHECK-NEXT:   %[[afloat:.+]] = bitcast i32 %[[ashl]] to float
+; CHECK-NEXT:   %[[adouble:.+]] = fpext float %[[afloat]] to double
+; CHECK-NEXT:   %m1diffeb = fmul fast double %{{.+}}, %[[adouble]]
+
+; REMARK: remark: <unknown>:0:0: Caching load as bfloat16, relative error up to 2^-8 for magnitudes from 2^-126 to 2^127, larger magnitudes overflow to infinity
+; REMARK-NOT: as bfloat16
@@ -0,0 +1,85 @@
+; RUN: %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-tape-mmap-threshold=65536 -enzyme-tape-mmap-prefetch=65536 -mem2reg -instsimplify -simplifycfg -S | FileCheck %s
+
+declare double @__enzyme_autodiff(i8*, ...)
+declare double @llvm.sin.f64(double)
+
+; static loop over n elements plus a dynamic loop until the value drops below 1
+define double @f(double* %x, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %sum = phi double [ 0.0, %entry ], [ %sum.next, %loop ]
+  %p = getelementptr inbounds double, double* %x, i64 %i
+  %a = load double, double* %p
+  store double 0.0, double* %p
+  %s = call double @llvm.sin.f64(double %a)
+  %sum.next = fadd double %sum, %s
+  %i.next = add nuw i64 %i, 1
+  %c = icmp eq i64 %i.next, %n
+  br i1 %c, label %dyn, label %loop
+
+dyn:
+  %v = phi double [ %sum.next, %loop ], [ %v.next, %dyn ]
+  %acc = phi double [ 0.0, %loop ], [ %acc.next, %dyn ]
+  %sv = call double @llvm.sin.f64(double %v)
+  %acc.next = fadd double %acc, %sv
+  %v.next = fmul double %v, 0.5
+  %d = fcmp olt double %v.next, 1.000000e-03
+  br i1 %d, label %exit, label %dyn
+
+exit:
+  ret double %acc.next
+}
+
+define void @df(double* %x, double* %dx, i64 %n) {
+  %r = call double (i8*, ...) @__enzyme_autodiff(i8* bitcast (double (double*, i64)* @f to i8*), double* %x, double* %dx, i64 %n)
+  ret void
+}
+
+; CHECK: define internal void @diffef(double* %x, double* %"x'", i64 %n, double %differeturn)
+; CHECK-NEXT: entry:
+; CHECK-NEXT:   %0 = add i64 %n, -1
+; CHECK-NEXT:   %1 = mul nuw nsw i64 8, %n
+; CHECK-NEXT:   %2 = call i8* @__enzyme_tape_mmap_alloc(i64 %1)
+; CHECK-NEXT:   %a_malloccache = bitcast i8* %2 to double*
+
+; CHECK: grow.i:
+; CHECK:   %{{.+}} = call i8* @__enzyme_tape_mmap_realloc(i8* %{{.+}}, i64 %{{.+}}, i64 %{{.+}})
+
+; CHECK: invertentry:
+; CHECK-NEXT:   call void @__enzyme_tape_mmap_free(i8* %2)
+; CHECK-NEXT:   ret void
+
+; CHECK: invertloop:
+; CHECK:   %[[off:.+]] = mul nuw nsw i64 %"iv'ac.0", 8
+; CHECK-NEXT:   %[[pos:.+]] = add i64 %[[off]], 16
+; CHECK-NEXT:   %[[within:.+]] = and i64 %[[pos]], 65535
+; CHECK-NEXT:   %{{.+}} = icmp uge i64 %[[within]], 65528
+; CHECK: advise.i:
+; CHECK:   %{{.+}} = call i32 @madvise(i8* %{{.+}}, i64 65536, i32 3)
+
+; CHECK: invertdyn.preheader:
+; CHECK-NEXT:   call void @__enzyme_tape_mmap_free(i8* %{{.+}})
+
+; CHECK: define internal noalias i8* @__enzyme_tape_mmap_alloc(i64 %size)
+; CHECK:   %total = add i64 %size, 16
+; CHECK-NEXT:   %[[big:.+]] = icmp uge i64 %total, 65536
+; CHECK: file:
+; CHECK:   %fd = call i32 @mkstemp(i8* %{{.+}})
+; CHECK: resize:
+; CHECK-NEXT:   %{{.+}} = call i32 @unlink(i8* %{{.+}})
+; CHECK-NEXT:   %{{.+}} = call i32 @ftruncate(i32 %fd, i64 %total)
+; CHECK: map:
+; CHECK-NEXT:   %addr = call i8* @mmap(i8* null, i64 %total, i32 3, i32 1, i32 %fd, i64 0)
+; CHECK: mapped:
+; CHECK-NEXT:   %{{.+}} = call i32 @madvise(i8* %addr, i64 %total, i32 2)
+; CHECK: heap:
+; CHECK-NEXT:   %mem = call i8* @malloc(i64 %total)
+
+; CHECK: define internal void @__enzyme_tape_mmap_free(i8* %ptr)
+; CHECK: unmap:
+; CHECK:   %{{.+}} = call i32 @munmap(i8* %base, i64 %length)
+; CHECK: heap:
+; CHECK-NEXT:   call void @free(i8* %base)
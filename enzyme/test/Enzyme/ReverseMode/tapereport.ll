@@ -0,0 +1,71 @@
+; RUN: if [ %llvmver -ge 10 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-weighted-mincut -pass-remarks-output=%t.yaml -disable-output && %enzyme-tape-report %t.yaml | FileCheck %s; fi
+; RUN: if [ %llvmver -ge 10 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-weighted-mincut -pass-remarks-output=%t.yaml -disable-output && %enzyme-tape-report %t.yaml %t.yaml | FileCheck %s --check-prefix=TWICE; fi
+; RUN: if [ %llvmver -ge 10 ]; then %opt < %s %loadEnzyme -enzyme -enzyme-preopt=false -enzyme-weighted-mincut -pass-remarks-output=%t.yaml -disable-output && %enzyme-tape-report --remark-name=MinCutCache --top=1 %t.yaml | FileCheck %s --check-prefix=TOP; fi
+; RUN: if [ %llvmver -ge 10 ]; then not %enzyme-tape-report %t.missing.yaml 2>&1 | FileCheck %s --check-prefix=MISSING; fi
+
+declare double @__enzyme_autodiff(i8*, ...)
+
+define double @tester(double %x, i8* %a, i16* %b) !dbg !6 {
+entry:
+  br label %loop
+
+loop:
+  %iv = phi i64 [ 0, %entry ], [ %iv.next, %loop ]
+  %sum = phi double [ 0.000000e+00, %entry ], [ %sum.next, %loop ]
+  %iv.next = add nuw nsw i64 %iv, 1
+  %pa = getelementptr inbounds i8, i8* %a, i64 %iv
+  %pb = getelementptr inbounds i16, i16* %b, i64 %iv
+  %la = load i8, i8* %pa, align 1, !dbg !9
+  %lb = load i16, i16* %pb, align 2, !dbg !10
+  %fa = sitofp i8 %la to double, !dbg !9
+  %fb = sitofp i16 %lb to double, !dbg !10
+  %prod = fmul double %fa, %fb, !dbg !11
+  %mul = fmul double %prod, %x, !dbg !11
+  %sum.next = fadd double %sum, %mul, !dbg !11
+  store i8 0, i8* %pa, align 1
+  store i16 0, i16* %pb, align 2
+  %cmp = icmp eq i64 %iv.next, 100
+  br i1 %cmp, label %exit, label %loop
+
+exit:
+  ret double %sum.next
+}
+
+define double @test_derivative(double %x, i8* %a, i16* %b) {
+entry:
+  %0 = tail call double (i8*, ...) @__enzyme_autodiff(i8* bitcast (double (double, i8*, i16*)* @tester to i8*), double %x, metadata !"enzyme_const", i8* %a, metadata !"enzyme_const", i16* %b)
+  ret double %0
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!3, !4}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: !1, producer: "clang", isOptimized: true, runtimeVersion: 0, emissionKind: FullDebug, enums: !2)
+!1 = !DIFile(filename: "dot.c", directory: "/tmp")
+!2 = !{}
+!3 = !{i32 2, !"Debug Info Version", i32 3}
+!4 = !{i32 7, !"Dwarf Version", i32 4}
+!5 = !DISubroutineType(types: !2)
+!6 = distinct !DISubprogram(name: "tester", scope: !1, file: !1, line: 1, type: !5, scopeLine: 1, spFlags: DISPFlagDefinition | DISPFlagOptimized, unit: !0, retainedNodes: !2)
+!9 = !DILocation(line: 4, column: 10, scope: !6)
+!10 = !DILocation(line: 5, column: 10, scope: !6)
+!11 = !DILocation(line: 6, column: 12, scope: !6)
+
+; The cached loads of lines 4 and 5 are ranked by the bytes they store on the
+; tape, summed across the files given.
+
+; CHECK: bytes  percent  count  depth  location
+; CHECK-NEXT: 200   66.67%      1      1  dot.c:5
+; CHECK-NEXT: 100   33.33%      1      1  dot.c:4
+; CHECK-NEXT: 300                         total
+
+; TWICE: bytes  percent  count  depth  location
+; TWICE-NEXT: 400   66.67%      2      1  dot.c:5
+; TWICE-NEXT: 200   33.33%      2      1  dot.c:4
+; TWICE-NEXT: 600                         total
+
+; TOP: bytes  percent  count  depth  location
+; TOP-NEXT: 200   66.67%      1      1  dot.c:5
+; TOP-NEXT: 300                         total
+
+; MISSING: error: '{{.*}}.missing.yaml': No such file or directory
@@ -0,0 +1,53 @@
+// RUN: %clang -std=c11 -O0 %mpicflags %s -S -emit-llvm -o - | %opt - %loadEnzyme -enzyme -enzyme-nonblocking-mpi -S | %clang -x ir - %mpildflags -lm -o %s.out && %mpirun -np 4 %s.out
+// RUN: %clang -std=c11 -O1 %mpicflags %s -S -emit-llvm -o - | %opt - %loadEnzyme -enzyme -enzyme-nonblocking-mpi -S | %clang -x ir - %mpildflags -lm -o %s.out && %mpirun -np 4 %s.out
+// RUN: %clang -std=c11 -O2 %mpicflags %s -S -emit-llvm -o - | %opt - %loadEnzyme -enzyme -enzyme-nonblocking-mpi -S | %clang -x ir - %mpildflags -lm -o %s.out && %mpirun -np 4 %s.out
+// RUN: %clang -std=c11 -O3 %mpicflags %s -S -emit-llvm -o - | %opt - %loadEnzyme -enzyme -enzyme-nonblocking-mpi -S | %clang -x ir - %mpildflags -lm -o %s.out && %mpirun -np 4 %s.out
+// REQUIRES: mpi
+
+#include <stdio.h>
+#include <math.h>
+#include <assert.h>
+
+#include "test_utils.h"
+
+#include <mpi.h>
+
+void __enzyme_autodiff(void*, ...);
+
+// The adjoint reduction is waited upon only in the reverse of either branch,
+// after the adjoint of the work independent of it
+void mpi_allreduce_test(double *b, double *global_sum, double *x, double *y,
+                        int c) {
+  if (c)
+    *y = sin(*x);
+  else
+    *y = exp(*x);
+  MPI_Allreduce(b, global_sum, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+}
+
+int main(int argc, char** argv) {
+  MPI_Init(&argc, &argv);
+  int numprocs;
+  MPI_Comm_size(MPI_COMM_WORLD, &numprocs);
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  double b = 10.0 + rank;
+  double db = 0;
+  double sum;
+  double dsum = 1.0 + rank;
+  double x = 0.5;
+  double dx = 0;
+  double y;
+  double dy = 2.0;
+  int c = rank % 2;
+  __enzyme_autodiff((void*)mpi_allreduce_test, &b, &db, &sum, &dsum, &x, &dx,
+                    &y, &dy, c);
+  printf("db=%f dx=%f rank=%d\n", db, dx, rank);
+  fflush(0);
+  APPROX_EQ(db, numprocs * (numprocs + 1) / 2.0, 1e-10);
+  APPROX_EQ(dsum, 0.0, 1e-10);
+  APPROX_EQ(dx, c ? 2.0 * cos(0.5) : 2.0 * exp(0.5), 1e-10);
+  MPI_Finalize();
+  return 0;
+}
@@ -1,4 +1,5 @@
-; RUN: %opt < %s %loadEnzyme -print-type-analysis -type-analysis-func=mv -o /dev/null | FileCheck %s
+; RUN: %opt < %s %loadEnzyme -print-type-analysis -type-analysis-func=mv -enzyme-type-summaries=0 -o /dev/null | FileCheck %s
+; RUN: %opt < %s %loadEnzyme -print-type-analysis -type-analysis-func=mv -enzyme-type-summaries=1 -o /dev/null | FileCheck %s --check-prefix=SUMMARY
 
 define internal void @mv(i64* %m_dims) #1 {
 entry:
@@ -82,3 +83,15 @@ attributes #4 = { nounwind }
 ; CHECK-NEXT: i64 %a: {[-1]:Integer}
 ; CHECK-NEXT: entry
 ; CHECK-NEXT:   ret i64 %a: {}
+
+; The summary of @sub determines its argument for any context, so @sub is not
+; reanalyzed for the context of @mv.
+; SUMMARY: mv - {} |{[-1]:Pointer}:{}
+; SUMMARY-NEXT: i64* %m_dims: {[-1]:Pointer, [-1,0]:Integer, [-1,1]:Integer, [-1,2]:Integer, [-1,3]:Integer, [-1,4]:Integer, [-1,5]:Integer, [-1,6]:Integer, [-1,7]:Integer}
+; SUMMARY-NEXT: entry
+; SUMMARY-NEXT:   %call4 = call i64 @sub(i64* nonnull %m_dims): {[-1]:Integer}
+; SUMMARY-NEXT:   ret void: {}
+
+; SUMMARY: sub - {} |{}:{}
+; SUMMARY-NEXT: i64* %this: {[-1]:Pointer, [-1,0]:Integer, [-1,1]:Integer, [-1,2]:Integer, [-1,3]:Integer, [-1,4]:Integer, [-1,5]:Integer, [-1,6]:Integer, [-1,7]:Integer}
+; SUMMARY-NOT: sub - {} |{[-1]:Pointer}:{}
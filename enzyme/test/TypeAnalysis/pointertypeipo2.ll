@@ -1,4 +1,5 @@
-; RUN: %opt < %s %loadEnzyme -print-type-analysis -type-analysis-func=mv -o /dev/null | FileCheck %s
+; RUN: %opt < %s %loadEnzyme -print-type-analysis -type-analysis-func=mv -enzyme-type-summaries=0 -o /dev/null | FileCheck %s
+; RUN: %opt < %s %loadEnzyme -print-type-analysis -type-analysis-func=mv -enzyme-type-summaries=1 -o /dev/null | FileCheck %s --check-prefix=SUMMARY
 
 define internal void @mv(i64* %m_dims, i64* %out) #1 {
 entry:
@@ -84,3 +85,25 @@ attributes #4 = { nounwind }
 ; CHECK-NEXT: i64 %a: {[-1]:Float@double}
 ; CHECK-NEXT: entry
 ; CHECK-NEXT:   ret i64 %a: {}
+
+; The context-insensitive summary of @sub leaves the type of its argument
+; undetermined, so @sub is still analyzed in the calling context of @mv and
+; the result for @mv is unchanged.
+
+; SUMMARY: mv - {} |{[-1]:Pointer}:{} {[-1]:Pointer}:{}
+; SUMMARY-NEXT: i64* %m_dims: {[-1]:Pointer, [-1,0]:Float@double}
+; SUMMARY-NEXT: i64* %out: {[-1]:Pointer, [-1,0]:Float@double}
+; SUMMARY-NEXT: entry
+; SUMMARY-NEXT:   %call4 = call i64 @sub(i64* nonnull %m_dims): {[-1]:Float@double}
+; SUMMARY-NEXT:   store i64 %call4, i64* %out{{(, align 4)?}}: {}
+; SUMMARY-NEXT:   ret void: {}
+
+; SUMMARY: sub - {} |{}:{}
+; SUMMARY-NEXT: i64* %this: {[-1]:Pointer, [-1,0]:Float@double}
+
+; SUMMARY: sub - {[-1]:Float@double} |{[-1]:Pointer, [-1,0]:Float@double}:{}
+; SUMMARY-NEXT: i64* %this: {[-1]:Pointer, [-1,0]:Float@double}
+; SUMMARY-NEXT: entry
+; SUMMARY-NEXT:   %agg = load i64, i64* %this{{(, align 4)?}}: {[-1]:Float@double}
+; SUMMARY-NEXT:   %call = tail call i64 @pop(i64 %agg): {[-1]:Float@double}
+; SUMMARY-NEXT:   ret i64 %call: {}
@@ -0,0 +1,47 @@
+; RUN: %opt < %s %loadEnzyme -enzyme-summary -S | FileCheck %s
+; RUN: %opt < %s %loadEnzyme -enzyme-summary -S | %opt %loadEnzyme -print-type-analysis -type-analysis-func=caller -o /dev/null | FileCheck %s --check-prefix=USE
+; RUN: %opt < %s %loadEnzyme -print-type-analysis -type-analysis-func=caller -enzyme-type-summaries=1 -o /dev/null | FileCheck %s --check-prefix=NOUSE
+
+define double @caller(double* %x, i64* %cnt) {
+entry:
+  %r = call double @lib(double* %x, i64 3, i64* %cnt)
+  ret double %r
+}
+
+define double @lib(double* %x, i64 %n, i64* %cnt) {
+entry:
+  %g = getelementptr inbounds double, double* %x, i64 %n
+  %v = load double, double* %g, align 8, !tbaa !2
+  %c = load i64, i64* %cnt, align 8, !tbaa !6
+  %c1 = add i64 %c, 1
+  store i64 %c1, i64* %cnt, align 8, !tbaa !6
+  ret double %v
+}
+
+!2 = !{!3, !3, i64 0}
+!3 = !{!"double", !4, i64 0}
+!4 = !{!"omnipotent char", !5, i64 0}
+!5 = !{!"Simple C/C++ TBAA"}
+!6 = !{!7, !7, i64 0}
+!7 = !{!"long", !4, i64 0}
+
+; CHECK: define double @caller(double* %x, i64* %cnt) !enzyme_summary ![[callersum:[0-9]+]]
+; CHECK: define double @lib(double* %x, i64 %n, i64* %cnt) !enzyme_summary ![[libsum:[0-9]+]]
+
+; CHECK-DAG: ![[libsum]] = !{i64 {{-?[0-9]+}}, ![[ret:[0-9]+]], ![[args:[0-9]+]], ![[inactive:[0-9]+]], ![[written:[0-9]+]], i1 false}
+; CHECK-DAG: ![[ret]] = !{![[double:[0-9]+]]}
+; CHECK-DAG: ![[double]] = !{!"Float@double", i64 -1}
+; CHECK-DAG: ![[args]] = !{![[ptr:[0-9]+]], ![[int:[0-9]+]], ![[cntty:[0-9]+]]}
+; CHECK-DAG: ![[int]] = !{![[intentry:[0-9]+]]}
+; CHECK-DAG: ![[intentry]] = !{!"Integer", i64 -1}
+; CHECK-DAG: ![[inactive]] = !{i1 false, i1 true, i1 false}
+; CHECK-DAG: ![[written]] = !{i1 false, i1 false, i1 true}
+
+; The embedded summary of @lib is used rather than analyzing @lib without
+; a calling context
+; USE: caller - {[-1]:Float@double} |{[-1]:Pointer, [-1,-1]:Float@double}:{} {[-1]:Pointer}:{}
+; USE-NOT: lib - {} |{}:{} {}:{} {}:{}
+; USE: lib - {[-1]:Float@double} |{[-1]:Pointer, [-1,-1]:Float@double}:{} {[-1]:Integer}:{3,} {[-1]:Pointer}:{}
+
+; Without one, the summary is derived by analyzing @lib without a context
+; NOUSE: lib - {} |{}:{} {}:{} {}:{}
@@ -0,0 +1,30 @@
+; RUN: %opt < %s %loadEnzyme -enzyme-summary -S | FileCheck %s
+
+; @pun reads the same memory as a double and as a pointer, which TypeAnalysis
+; rejects. It is never differentiated, so it is left without a summary rather
+; than aborting compilation.
+
+define i64 @pun(double* %p) {
+entry:
+  %d = load double, double* %p, align 8, !tbaa !0
+  %ip = bitcast double* %p to i64**
+  %q = load i64*, i64** %ip, align 8, !tbaa !4
+  %v = load i64, i64* %q, align 8
+  ret i64 %v
+}
+
+define double @square(double %x) {
+entry:
+  %m = fmul double %x, %x
+  ret double %m
+}
+
+!0 = !{!1, !1, i64 0}
+!1 = !{!"double", !2, i64 0}
+!2 = !{!"omnipotent char", !3, i64 0}
+!3 = !{!"Simple C/C++ TBAA"}
+!4 = !{!5, !5, i64 0}
+!5 = !{!"any pointer", !2, i64 0}
+
+; CHECK: define i64 @pun(double* %p) {
+; CHECK: define double @square(double %x) !enzyme_summary
@@ -0,0 +1,26 @@
+; RUN: %opt < %s %loadEnzyme -enzyme-summary -S | FileCheck %s
+
+; The definition of the weak @lib may be replaced at link time, so neither it
+; nor its caller is summarized, while @other is.
+
+define double @caller(double* %x) {
+entry:
+  %r = call double @lib(double* %x)
+  ret double %r
+}
+
+define weak double @lib(double* %x) {
+entry:
+  %v = load double, double* %x, align 8
+  ret double %v
+}
+
+define i64 @other(i64 %n) {
+entry:
+  %m = mul i64 %n, %n
+  ret i64 %m
+}
+
+; CHECK: define double @caller(double* %x) {
+; CHECK: define weak double @lib(double* %x) {
+; CHECK: define i64 @other(i64 %n) !enzyme_summary
@@ -0,0 +1,42 @@
+; RUN: %opt < %s %loadEnzyme -print-type-analysis -type-analysis-func=caller -enzyme-type-summaries=0 -enzyme-print-type -o /dev/null 2>&1 | FileCheck %s
+; RUN: %opt < %s %loadEnzyme -print-type-analysis -type-analysis-func=caller -enzyme-type-summaries=1 -enzyme-print-type -o /dev/null 2>&1 | FileCheck %s --check-prefix=SUMMARY
+
+; @sub is called from two calling contexts. Its summary is derived once and
+; is exact for both, so @sub is not analyzed for either context.
+
+define void @caller(i64* %a, i64* %b, double* %out) {
+entry:
+  %x = call i64 @sub(i64* %a)
+  %y = call i64 @sub(i64* %b)
+  %s = add i64 %x, %y
+  %f = sitofp i64 %s to double
+  store double %f, double* %out, align 8
+  ret void
+}
+
+define internal i64 @sub(i64* %p) {
+entry:
+  %v = load i64, i64* %p, align 8, !tbaa !0
+  %m = mul i64 %v, 3
+  ret i64 %m
+}
+
+!0 = !{!1, !1, i64 0}
+!1 = !{!"long", !2, i64 0}
+!2 = !{!"omnipotent char", !3, i64 0}
+!3 = !{!"Simple C/C++ TBAA"}
+
+; Without summaries, @sub is analyzed in the context of the calls
+; CHECK: analyzing function caller
+; CHECK: analyzing function sub
+; CHECK: sub - {[-1]:Integer} |{[-1]:Pointer}:{}
+
+; SUMMARY: analyzing function caller
+; SUMMARY-COUNT-1: analyzing function sub
+; SUMMARY-NOT: analyzing function sub
+; SUMMARY: applying summary of sub to   %x = call i64 @sub(i64* %a) exact=1
+; SUMMARY: applying summary of sub to   %y = call i64 @sub(i64* %b) exact=1
+; SUMMARY-NOT: analyzing function sub
+; SUMMARY: sub - {} |{}:{}
+; SUMMARY-NEXT: i64* %p: {[-1]:Pointer, [-1,0]:Integer, [-1,1]:Integer, [-1,2]:Integer, [-1,3]:Integer, [-1,4]:Integer, [-1,5]:Integer, [-1,6]:Integer, [-1,7]:Integer}
+; SUMMARY-NOT: sub - {[-1]:Integer} |{[-1]:Pointer}:{}
@@ -0,0 +1,137 @@
+//===- enzyme-tape-report.cpp - Summarize Enzyme cache remarks ------------===//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file reads the optimization records written with
+// -fsave-optimization-record (or opt -pass-remarks-output) and ranks the
+// source lines by the estimated number of bytes Enzyme stores on the tape
+// for them.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Remarks/Remark.h"
+#include "llvm/Remarks/RemarkFormat.h"
+#include "llvm/Remarks/RemarkParser.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<std::string> InputFiles(cl::Positional, cl::OneOrMore,
+                                        cl::desc("<remark files>"));
+
+static cl::opt<std::string>
+    RemarkName("remark-name", cl::init("StoreInCache"),
+               cl::desc("Name of the Enzyme remark whose estimated bytes are "
+                        "summed (StoreInCache, CacheForScope, MinCutCache)"));
+
+static cl::opt<unsigned> Top("top", cl::init(0),
+                             cl::desc("Only print the N largest lines"));
+
+namespace {
+struct LineSummary {
+  uint64_t Bytes = 0;
+  uint64_t Count = 0;
+  unsigned MaxDepth = 0;
+};
+} // namespace
+
+static Error addRemarks(StringRef Filename, StringMap<LineSummary> &Lines) {
+  auto Buf = MemoryBuffer::getFile(Filename);
+  if (!Buf)
+    return createFileError(Filename, errorCodeToError(Buf.getError()));
+
+  auto Parser = remarks::createRemarkParserFromMeta(remarks::Format::YAML,
+                                                    (*Buf)->getBuffer());
+  if (!Parser)
+    return Parser.takeError();
+
+  while (true) {
+    auto MaybeRemark = (*Parser)->next();
+    if (!MaybeRemark) {
+      Error E = MaybeRemark.takeError();
+      if (E.isA<remarks::EndOfFileError>()) {
+        consumeError(std::move(E));
+        break;
+      }
+      return E;
+    }
+    const remarks::Remark &R = **MaybeRemark;
+    if (R.PassName != "enzyme" || R.RemarkName != RemarkName)
+      continue;
+
+    std::string Key = "<unknown>";
+    if (R.Loc)
+      Key = (R.Loc->SourceFilePath + ":" + Twine(R.Loc->SourceLine)).str();
+
+    LineSummary &S = Lines[Key];
+    S.Count++;
+    for (const remarks::Argument &Arg : R.Args) {
+      uint64_t Val;
+      if (Arg.Val.getAsInteger(10, Val))
+        continue;
+      if (Arg.Key == "EstimatedBytes")
+        S.Bytes = SaturatingAdd(S.Bytes, Val);
+      else if (Arg.Key == "LoopDepth")
+        S.MaxDepth = std::max(S.MaxDepth, (unsigned)Val);
+    }
+  }
+  return Error::success();
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv,
+                              "Rank source lines by Enzyme tape bytes\n");
+
+  StringMap<LineSummary> Lines;
+  for (auto &Filename : InputFiles) {
+    if (Error E = addRemarks(Filename, Lines)) {
+      logAllUnhandledErrors(std::move(E), WithColor::error(errs(), argv[0]));
+      return 1;
+    }
+  }
+
+  std::vector<std::pair<StringRef, LineSummary>> Sorted;
+  uint64_t Total = 0;
+  for (auto &Entry : Lines) {
+    Sorted.emplace_back(Entry.getKey(), Entry.getValue());
+    Total = SaturatingAdd(Total, Entry.getValue().Bytes);
+  }
+  std::stable_sort(Sorted.begin(), Sorted.end(),
+                   [](const std::pair<StringRef, LineSummary> &LHS,
+                      const std::pair<StringRef, LineSummary> &RHS) {
+                     if (LHS.second.Bytes != RHS.second.Bytes)
+                       return LHS.second.Bytes > RHS.second.Bytes;
+                     return LHS.first < RHS.first;
+                   });
+  if (Top && Sorted.size() > Top)
+    Sorted.resize(Top);
+
+  outs() << formatv("{0,14} {1,8} {2,6} {3,6}  {4}\n", "bytes", "percent",
+                    "count", "depth", "location");
+  for (auto &Entry : Sorted) {
+    double Percent = Total ? 100.0 * Entry.second.Bytes / Total : 0.0;
+    outs() << formatv("{0,14} {1,7:F2}% {2,6} {3,6}  {4}\n",
+                      Entry.second.Bytes, Percent, Entry.second.Count,
+                      Entry.second.MaxDepth, Entry.first);
+  }
+  outs() << formatv("{0,14} {1,8} {2,6} {3,6}  {4}\n", Total, "", "", "",
+                    "total");
+  return 0;
+}
@@ -0,0 +1,103 @@
+//===- enzyme-typetree-bench.cpp - Benchmark TypeTree operations ----------===//
+//
+//                             Enzyme Project
+//
+// Part of the Enzyme Project, under the Apache License v2.0 with LLVM
+// Exceptions. See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file times the TypeTree operations that dominate Type Analysis on
+// large modules, on trees shaped like those of pointers to structs of
+// doubles and integers.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Type.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include "TypeTree.h"
+
+using namespace llvm;
+
+static cl::opt<unsigned> Iterations("iterations", cl::init(100000),
+                                    cl::desc("Iterations per operation"));
+
+static cl::opt<unsigned> Fields("fields", cl::init(8),
+                                cl::desc("Number of fields per struct"));
+
+/// Sink for results so that the timed operations are not optimized away
+static volatile size_t Sink;
+
+static void run(StringRef Name, const std::function<size_t()> &Op) {
+  auto Start = std::chrono::steady_clock::now();
+  size_t Total = 0;
+  for (unsigned i = 0; i < Iterations; i++)
+    Total += Op();
+  auto End = std::chrono::steady_clock::now();
+  Sink = Total;
+  double NS = std::chrono::duration<double, std::nano>(End - Start).count();
+  outs() << formatv("{0,-16} {1,10:F1} ns/op\n", Name, NS / Iterations);
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "Enzyme TypeTree benchmark\n");
+
+  LLVMContext Ctx;
+  DataLayout DL("e-m:e-i64:64-f80:128-n8:16:32:64-S128");
+  ConcreteType Double(Type::getDoubleTy(Ctx));
+
+  // A struct alternating doubles and integers, and a pointer to it
+  TypeTree Struct;
+  for (unsigned i = 0; i < Fields; i++)
+    Struct.insert({(int)i * 8}, i % 2 ? ConcreteType(BaseType::Integer)
+                                      : Double);
+  TypeTree Ptr = Struct.Only(0);
+  Ptr.insert({}, BaseType::Pointer);
+  TypeTree PtrPtr = Ptr.Only(-1);
+  PtrPtr.insert({-1}, BaseType::Pointer);
+
+  run("Only", [&]() { return Struct.Only(-1).getMapping().size(); });
+  run("Data0", [&]() { return PtrPtr.Data0().getMapping().size(); });
+  run("ShiftIndices", [&]() {
+    return Struct.ShiftIndices(DL, 8, Fields * 8 - 8, 0).getMapping().size();
+  });
+  run("Lookup", [&]() {
+    return PtrPtr.Lookup(8, DL).getMapping().size();
+  });
+  run("orIn", [&]() {
+    TypeTree Result = Ptr;
+    Result.orIn(PtrPtr.Data0(), /*PointerIntSame*/ false);
+    return Result.getMapping().size();
+  });
+  run("insert", [&]() {
+    TypeTree Result;
+    for (unsigned i = 0; i < Fields; i++)
+      Result.insert({0, (int)i * 8}, Double);
+    return Result.getMapping().size();
+  });
+  run("copy", [&]() {
+    TypeTree Result = PtrPtr;
+    return Result.getMapping().size();
+  });
+  run("operator[]", [&]() {
+    return (size_t)(PtrPtr[{0, 8, 0}] == BaseType::Unknown);
+  });
+  run("intern", [&]() {
+    TypeTree Result = Struct.Only(0);
+    Result.intern();
+    return (size_t)(Result == Ptr.Only(-1));
+  });
+  return 0;
+}